@@ -28,6 +28,8 @@ LOCAL_CFLAGS := -Wall -Werror
 LOCAL_CFLAGS += -D_XOPEN_SOURCE -D_GNU_SOURCE
 LOCAL_MODULE := libfusesideload
 LOCAL_STATIC_LIBRARIES := \
+    libverifier \
+    libotautil \
     libcrypto \
     libbase
 include $(BUILD_STATIC_LIBRARY)
@@ -182,7 +184,6 @@ LOCAL_STATIC_LIBRARIES := \
 LOCAL_STATIC_LIBRARIES += \
     libmksh_driver \
     librecovery \
-    libverifier \
     libbootloader_message \
     libfs_mgr \
     libext4_utils \
@@ -199,8 +200,10 @@ LOCAL_STATIC_LIBRARIES += \
     libotautil \
     libmounts \
     libminadbd \
+    liblz4 \
     libasyncio \
     libfusesideload \
+    libverifier \
     libminui \
     libpng \
     libcrypto_utils \
@@ -344,8 +347,14 @@ LOCAL_FORCE_STATIC_EXECUTABLE := true
 LOCAL_SRC_FILES := \
     bu.cpp \
     backup.cpp \
+    compress.cpp \
+    hash.cpp \
+    manifest.cpp \
+    pipeline.cpp \
     restore.cpp \
-    roots.cpp
+    roots.cpp \
+    sparse.cpp \
+    stats.cpp
 LOCAL_CFLAGS += -DMINIVOLD
 LOCAL_CFLAGS += -Wno-unused-parameter
 LOCAL_STATIC_LIBRARIES += \
@@ -354,11 +363,14 @@ LOCAL_STATIC_LIBRARIES += \
     libext2_uuid \
     libsparse \
     libmounts \
+    libotautil \
     libz \
     libminadbd \
+    liblz4 \
     libminui \
     libfs_mgr \
     libtar \
+    libzstd \
     libcrypto \
     libbase \
     libcutils \
@@ -378,6 +390,7 @@ LOCAL_C_INCLUDES += \
     external/libtar/listhash \
     external/openssl/include \
     external/zlib \
+    external/zstd/lib \
     bionic/libc/bionic \
     external/e2fsprogs/lib
 
@@ -425,7 +438,7 @@ LOCAL_SRC_FILES := \
     recovery-persist.cpp \
     rotate_logs.cpp
 LOCAL_MODULE := recovery-persist
-LOCAL_SHARED_LIBRARIES := liblog libbase
+LOCAL_SHARED_LIBRARIES := liblog libbase libz
 LOCAL_CFLAGS := -Wall -Werror
 LOCAL_INIT_RC := recovery-persist.rc
 include $(BUILD_EXECUTABLE)
@@ -437,7 +450,7 @@ LOCAL_SRC_FILES := \
     recovery-refresh.cpp \
     rotate_logs.cpp
 LOCAL_MODULE := recovery-refresh
-LOCAL_SHARED_LIBRARIES := liblog libbase
+LOCAL_SHARED_LIBRARIES := liblog libbase libz
 LOCAL_CFLAGS := -Wall -Werror
 LOCAL_INIT_RC := recovery-refresh.rc
 include $(BUILD_EXECUTABLE)
@@ -35,6 +35,7 @@
 #include "common.h"
 #include "fuse_sideload.h"
 #include "install.h"
+#include "roots.h"
 #include "ui.h"
 
 static void set_usb_driver(bool enabled) {
@@ -124,6 +125,12 @@ void sideload_start() {
   stop_adbd();
   set_usb_driver(true);
 
+  // The blocks of the package are kept on /cache as they arrive, so that retrying a failed sideload
+  // picks up where it left off.
+  if (volume_for_mount_point("/cache") != nullptr) {
+    ensure_path_mounted(FUSE_SIDELOAD_SPILL_PATHNAME);
+  }
+
   if ((sideload_adb_pid = fork()) == 0) {
     execl("/sbin/recovery", "recovery", "--adbd", nullptr);
     _exit(EXIT_FAILURE);
@@ -157,6 +164,13 @@ int sideload_install(bool* wipe_cache, const char* install_file, bool verify) {
         install_package(FUSE_SIDELOAD_HOST_PATHNAME, wipe_cache, install_file, false, 0, verify);
 
     set_perf_mode(false);
+
+    // There's nothing left to resume, or the package itself is bad and needs to be fetched anew.
+    if (result == INSTALL_SUCCESS || result == INSTALL_CORRUPT) {
+      if (unlink(FUSE_SIDELOAD_SPILL_PATHNAME) == -1 && errno != ENOENT) {
+        PLOG(WARNING) << "Failed to remove " << FUSE_SIDELOAD_SPILL_PATHNAME;
+      }
+    }
   }
 
   return result;
@@ -23,16 +23,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/statfs.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <condition_variable>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/parseint.h>
 #include <android-base/strings.h>
@@ -42,12 +48,15 @@
 #include "otafault/ota_io.h"
 #include "otautil/cache_location.h"
 #include "otautil/print_sha1.h"
+#include "otautil/thread_pool.h"
 
 static int LoadPartitionContents(const std::string& filename, FileContents* file);
 static size_t FileSink(const unsigned char* data, size_t len, int fd);
-static int GenerateTarget(const FileContents& source_file, const std::unique_ptr<Value>& patch,
+static void DropPartitionHashes(const std::string& partition);
+static int GenerateTarget(const FileContents& source_file, const Value* patch,
                           const std::string& target_filename,
-                          const uint8_t target_sha1[SHA_DIGEST_LENGTH], const Value* bonus_data);
+                          const uint8_t target_sha1[SHA_DIGEST_LENGTH], const Value* bonus_data,
+                          bool backup_source);
 
 // Read a file into memory; store the file contents and associated metadata in *file.
 // Return 0 on success.
@@ -80,6 +89,9 @@ int LoadFileContents(const char* filename, FileContents* file) {
   return 0;
 }
 
+// The size of each read of LoadPartitionContents().
+static constexpr size_t kPartitionReadSize = 1024 * 1024;
+
 // Load the contents of an EMMC partition into the provided
 // FileContents.  filename should be a string of the form
 // "EMMC:<partition_device>:...".  The smallest size_n bytes for
@@ -116,8 +128,8 @@ static int LoadPartitionContents(const std::string& filename, FileContents* file
   std::sort(pairs.begin(), pairs.end());
 
   const char* partition = pieces[1].c_str();
-  unique_file dev(ota_fopen(partition, "rb"));
-  if (!dev) {
+  unique_fd dev(ota_open(partition, O_RDONLY));
+  if (dev == -1) {
     printf("failed to open emmc partition \"%s\": %s\n", partition, strerror(errno));
     return -1;
   }
@@ -127,26 +139,72 @@ static int LoadPartitionContents(const std::string& filename, FileContents* file
 
   // Allocate enough memory to hold the largest size.
   std::vector<unsigned char> buffer(pairs[pair_count - 1].first);
-  unsigned char* buffer_ptr = buffer.data();
-  size_t buffer_size = 0;  // # bytes read so far
+  size_t buffer_size = 0;  // # bytes hashed so far
   bool found = false;
 
+  // A reader thread fills the buffer with large aligned reads, while the partition read so far
+  // gets hashed here. The reader stops as soon as a match is found, or at the largest size. It may
+  // hit the end of the partition before then, which is only an error if we need the data past it.
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t bytes_read = 0;
+  bool read_done = false;
+  bool stop_reading = false;
+  std::thread reader([&]() {
+    size_t offset = 0;
+    while (offset < buffer.size()) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stop_reading) break;
+      }
+      size_t count = std::min(kPartitionReadSize, buffer.size() - offset);
+      ssize_t read = TEMP_FAILURE_RETRY(ota_pread(dev, buffer.data() + offset, count, offset));
+      if (read <= 0) {
+        if (read == -1) {
+          printf("failed to read partition \"%s\": %s\n", partition, strerror(errno));
+        }
+        break;
+      }
+      offset += read;
+      std::lock_guard<std::mutex> lock(mutex);
+      bytes_read = offset;
+      cv.notify_one();
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    read_done = true;
+    cv.notify_one();
+  });
+
+  auto stop_reader = [&]() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop_reading = true;
+    }
+    reader.join();
+  };
+
   for (const auto& pair : pairs) {
     size_t current_size = pair.first;
     const std::string& current_sha1 = pair.second;
 
-    // Read enough additional bytes to get us up to the next size. (Again,
-    // we're trying the possibilities in order of increasing size).
-    size_t next = current_size - buffer_size;
-    if (next > 0) {
-      size_t read = ota_fread(buffer_ptr, 1, next, dev.get());
-      if (next != read) {
-        printf("short read (%zu bytes of %zu) for partition \"%s\"\n", read, next, partition);
+    // Hash enough additional bytes to get us up to the next size, as they arrive. (Again, we're
+    // trying the possibilities in order of increasing size).
+    while (buffer_size < current_size) {
+      size_t available;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() { return bytes_read > buffer_size || read_done; });
+        available = bytes_read;
+      }
+      if (available <= buffer_size) {
+        printf("short read (%zu bytes of %zu) for partition \"%s\"\n", available, current_size,
+               partition);
+        stop_reader();
         return -1;
       }
-      SHA1_Update(&sha_ctx, buffer_ptr, read);
-      buffer_size += read;
-      buffer_ptr += read;
+      size_t count = std::min(available, current_size) - buffer_size;
+      SHA1_Update(&sha_ctx, buffer.data() + buffer_size, count);
+      buffer_size += count;
     }
 
     // Duplicate the SHA context and finalize the duplicate so we can
@@ -159,6 +217,7 @@ static int LoadPartitionContents(const std::string& filename, FileContents* file
     uint8_t parsed_sha[SHA_DIGEST_LENGTH];
     if (ParseSha1(current_sha1.c_str(), parsed_sha) != 0) {
       printf("failed to parse SHA-1 %s in %s\n", current_sha1.c_str(), filename.c_str());
+      stop_reader();
       return -1;
     }
 
@@ -169,6 +228,7 @@ static int LoadPartitionContents(const std::string& filename, FileContents* file
       break;
     }
   }
+  stop_reader();
 
   if (!found) {
     // Ran off the end of the list of (size, sha1) pairs without finding a match.
@@ -211,6 +271,145 @@ int SaveFileContents(const char* filename, const FileContents* file) {
   return 0;
 }
 
+// Syncs and drops the page cache, so that a subsequent read goes to the device.
+static void DropCaches() {
+  sync();
+  unique_fd dc(ota_open("/proc/sys/vm/drop_caches", O_WRONLY));
+  if (TEMP_FAILURE_RETRY(ota_write(dc, "3\n", 2)) == -1) {
+    printf("write to /proc/sys/vm/drop_caches failed: %s\n", strerror(errno));
+  } else {
+    printf("  caches dropped\n");
+  }
+  ota_close(dc);
+  sleep(1);
+}
+
+// The verification reads |partition| in chunks of this size, into buffers aligned for O_DIRECT.
+static constexpr size_t kVerifyChunkSize = 1 << 20;
+static constexpr size_t kVerifyAlignment = 4096;
+
+// Reads up to |size| bytes at |offset|, stopping early only at the end of the file. Returns the
+// number of bytes read, or -1 on error.
+static ssize_t ReadChunk(int fd, unsigned char* buffer, size_t size, off64_t offset) {
+  size_t so_far = 0;
+  while (so_far < size) {
+    ssize_t read_count =
+        TEMP_FAILURE_RETRY(ota_pread(fd, buffer + so_far, size - so_far, offset + so_far));
+    if (read_count == -1) {
+      return -1;
+    } else if (read_count == 0) {
+      break;
+    }
+    so_far += read_count;
+  }
+  return so_far;
+}
+
+// Reads the first |len| bytes of |partition| back and compares them with |data|, setting |*start|
+// to the offset of the first 4096-byte block that differs, or to |len| if they all match. With
+// |direct|, the reads bypass the page cache; otherwise the whole cache has to be dropped first.
+// Each chunk is compared while the next one is being read. Returns 0 unless the reads fail, or 1
+// if |direct| is set but the partition doesn't support O_DIRECT.
+static int VerifyPartitionWith(const char* partition, const unsigned char* data, size_t len,
+                               bool direct, size_t* start) {
+  unique_fd fd(ota_open(partition, direct ? O_RDONLY | O_DIRECT : O_RDONLY));
+  if (fd == -1) {
+    if (direct && errno == EINVAL) {
+      return 1;
+    }
+    printf("failed to reopen %s for verify: %s\n", partition, strerror(errno));
+    return -1;
+  }
+  if (!direct) {
+    // Drop caches so our subsequent verification read won't just be reading the cache.
+    DropCaches();
+  }
+
+  std::unique_ptr<unsigned char, decltype(&free)> buffers[2] = { { nullptr, free },
+                                                                 { nullptr, free } };
+  for (auto& buffer : buffers) {
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, kVerifyAlignment, kVerifyChunkSize) != 0) {
+      printf("failed to allocate the verify buffers\n");
+      return -1;
+    }
+    buffer.reset(static_cast<unsigned char*>(ptr));
+  }
+
+  ThreadPool& pool = ThreadPool::Shared();
+  auto read_chunk = [&pool, &fd, &buffers, len, direct](size_t p) {
+    size_t to_read = std::min(len - p, kVerifyChunkSize);
+    if (direct) {
+      // O_DIRECT only reads whole blocks, so the tail gets rounded up.
+      to_read = (to_read + kVerifyAlignment - 1) / kVerifyAlignment * kVerifyAlignment;
+    }
+    unsigned char* buffer = buffers[(p / kVerifyChunkSize) % 2].get();
+    int fd_value = fd.get();
+    return pool.Async([fd_value, buffer, to_read, p]() {
+      ssize_t read_count = ReadChunk(fd_value, buffer, to_read, p);
+      return std::make_pair(read_count, read_count == -1 ? errno : 0);
+    }, ThreadPool::Priority::kHigh);
+  };
+
+  *start = len;
+  std::future<std::pair<ssize_t, int>> pending;
+  if (len > 0) {
+    pending = read_chunk(0);
+  }
+  for (size_t p = 0; p < len; p += kVerifyChunkSize) {
+    std::pair<ssize_t, int> result = pool.Await(pending);
+    size_t to_compare = std::min(len - p, kVerifyChunkSize);
+    if (result.first == -1) {
+      if (direct && result.second == EINVAL) {
+        return 1;
+      }
+      printf("verify read error %s at %zu: %s\n", partition, p, strerror(result.second));
+      return -1;
+    } else if (static_cast<size_t>(result.first) < to_compare) {
+      printf("verify read reached unexpected EOF, %s at %zu\n", partition, p + result.first);
+      return -1;
+    }
+    // The buffer being compared is never the one the next read fills.
+    if (p + kVerifyChunkSize < len) {
+      pending = read_chunk(p + kVerifyChunkSize);
+    }
+
+    const unsigned char* buffer = buffers[(p / kVerifyChunkSize) % 2].get();
+    if (memcmp(buffer, data + p, to_compare) != 0) {
+      for (size_t block = 0; block < to_compare; block += kVerifyAlignment) {
+        size_t block_len = std::min(to_compare - block, kVerifyAlignment);
+        if (memcmp(buffer + block, data + p + block, block_len) != 0) {
+          *start = p + block;
+          break;
+        }
+      }
+      printf("verification failed starting at %zu\n", *start);
+      if (pending.valid()) {
+        pool.Await(pending);
+      }
+      break;
+    }
+  }
+
+  if (ota_close(fd) != 0) {
+    printf("failed to close %s: %s\n", partition, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+// Verifies |partition| with O_DIRECT, or through the page cache if the partition doesn't support
+// it.
+static int VerifyPartition(const char* partition, const unsigned char* data, size_t len,
+                           size_t* start) {
+  int result = VerifyPartitionWith(partition, data, len, true, start);
+  if (result != 1) {
+    return result;
+  }
+  printf("%s doesn't support O_DIRECT, verifying through the page cache\n", partition);
+  return VerifyPartitionWith(partition, data, len, false, start);
+}
+
 // Write a memory buffer to 'target' partition, a string of the form
 // "EMMC:<partition_device>[:...]". The target name
 // might contain multiple colons, but WriteToPartition() only uses the first
@@ -223,6 +422,7 @@ int WriteToPartition(const unsigned char* data, size_t len, const std::string& t
   }
 
   const char* partition = pieces[1].c_str();
+  DropPartitionHashes(partition);
   unique_fd fd(ota_open(partition, O_RDWR));
   if (fd == -1) {
     printf("failed to open %s: %s\n", partition, strerror(errno));
@@ -257,71 +457,15 @@ int WriteToPartition(const unsigned char* data, size_t len, const std::string& t
       return -1;
     }
 
-    fd.reset(ota_open(partition, O_RDONLY));
-    if (fd == -1) {
-      printf("failed to reopen %s for verify: %s\n", partition, strerror(errno));
+    if (VerifyPartition(partition, data, len, &start) != 0) {
       return -1;
     }
-
-    // Drop caches so our subsequent verification read won't just be reading the cache.
-    sync();
-    unique_fd dc(ota_open("/proc/sys/vm/drop_caches", O_WRONLY));
-    if (TEMP_FAILURE_RETRY(ota_write(dc, "3\n", 2)) == -1) {
-      printf("write to /proc/sys/vm/drop_caches failed: %s\n", strerror(errno));
-    } else {
-      printf("  caches dropped\n");
-    }
-    ota_close(dc);
-    sleep(1);
-
-    // Verify.
-    if (TEMP_FAILURE_RETRY(lseek(fd, 0, SEEK_SET)) == -1) {
-      printf("failed to seek back to beginning of %s: %s\n", partition, strerror(errno));
-      return -1;
-    }
-
-    unsigned char buffer[4096];
-    start = len;
-    for (size_t p = 0; p < len; p += sizeof(buffer)) {
-      size_t to_read = len - p;
-      if (to_read > sizeof(buffer)) {
-        to_read = sizeof(buffer);
-      }
-
-      size_t so_far = 0;
-      while (so_far < to_read) {
-        ssize_t read_count = TEMP_FAILURE_RETRY(ota_read(fd, buffer + so_far, to_read - so_far));
-        if (read_count == -1) {
-          printf("verify read error %s at %zu: %s\n", partition, p, strerror(errno));
-          return -1;
-        } else if (read_count == 0) {
-          printf("verify read reached unexpected EOF, %s at %zu\n", partition, p);
-          return -1;
-        }
-        if (static_cast<size_t>(read_count) < to_read) {
-          printf("short verify read %s at %zu: %zd %zu\n", partition, p, read_count, to_read);
-        }
-        so_far += read_count;
-      }
-
-      if (memcmp(buffer, data + p, to_read) != 0) {
-        printf("verification failed starting at %zu\n", p);
-        start = p;
-        break;
-      }
-    }
-
     if (start == len) {
       printf("verification read succeeded (attempt %zu)\n", attempt + 1);
       success = true;
       break;
     }
 
-    if (ota_close(fd) != 0) {
-      printf("failed to close %s: %s\n", partition, strerror(errno));
-      return -1;
-    }
-
     fd.reset(ota_open(partition, O_RDWR));
     if (fd == -1) {
       printf("failed to reopen %s for retry write && verify: %s\n", partition, strerror(errno));
@@ -333,11 +477,6 @@ int WriteToPartition(const unsigned char* data, size_t len, const std::string& t
     printf("failed to verify after all attempts\n");
     return -1;
   }
-
-  if (ota_close(fd) == -1) {
-    printf("error closing %s: %s\n", partition, strerror(errno));
-    return -1;
-  }
   sync();
 
   return 0;
@@ -386,10 +525,184 @@ static int FindMatchingPatch(uint8_t* sha1, const std::vector<std::string>& patc
   return -1;
 }
 
+// The partition hash cache keeps, for each partition that applypatch_check() has read with
+// |use_hash_cache| set, the SHA-1 of the matched prefix along with a fingerprint of the partition:
+// its identity (device numbers, and the dm uuid if any), and the SHA-1 of |kFingerprintBlocks|
+// blocks sampled across the prefix. A raw partition has no write generation, so a write that
+// didn't go through WriteToPartition() (which drops the entries itself) and missed the samples
+// goes unnoticed. That's why only the boot-time check of install-recovery opts in, where a stale
+// match merely leaves recovery as it is. Each line is "<partition> <size> <fingerprint> <sha1>".
+static constexpr size_t kFingerprintBlocks = 64;
+static constexpr size_t kFingerprintBlockSize = 4096;
+static constexpr size_t kMaxPartitionHashes = 16;
+
+struct PartitionHash {
+  std::string partition;
+  size_t size;
+  std::string fingerprint;
+  std::string sha1;
+};
+
+static std::vector<PartitionHash> ReadPartitionHashes() {
+  std::vector<PartitionHash> hashes;
+  std::string content;
+  const std::string cache = CacheLocation::location().partition_hash_cache();
+  if (cache.empty() || !android::base::ReadFileToString(cache, &content)) {
+    return hashes;
+  }
+  for (const auto& line : android::base::Split(content, "\n")) {
+    std::vector<std::string> fields = android::base::Split(line, " ");
+    PartitionHash hash;
+    if (fields.size() != 4 || !android::base::ParseUint(fields[1], &hash.size)) {
+      continue;
+    }
+    hash.partition = fields[0];
+    hash.fingerprint = fields[2];
+    hash.sha1 = fields[3];
+    hashes.push_back(std::move(hash));
+  }
+  return hashes;
+}
+
+static void WritePartitionHashes(const std::vector<PartitionHash>& hashes) {
+  const std::string cache = CacheLocation::location().partition_hash_cache();
+  if (cache.empty()) {
+    return;
+  }
+  std::string content;
+  for (const auto& hash : hashes) {
+    content += hash.partition + " " + std::to_string(hash.size) + " " + hash.fingerprint + " " +
+               hash.sha1 + "\n";
+  }
+  // Replaces the cache in one go, so that an interrupted update leaves the old one.
+  std::string temp = cache + ".tmp";
+  if (!android::base::WriteStringToFile(content, temp) ||
+      rename(temp.c_str(), cache.c_str()) != 0) {
+    printf("failed to write the partition hash cache %s: %s\n", cache.c_str(), strerror(errno));
+    unlink(temp.c_str());
+  }
+}
+
+// Computes the fingerprint of the first |size| bytes of |partition|. Returns false if it can't be
+// read.
+static bool PartitionFingerprint(const std::string& partition, size_t size,
+                                 std::string* fingerprint) {
+  unique_fd fd(ota_open(partition.c_str(), O_RDONLY));
+  struct stat sb;
+  if (fd == -1 || fstat(fd, &sb) == -1) {
+    return false;
+  }
+
+  SHA_CTX ctx;
+  SHA1_Init(&ctx);
+  std::string identity = std::to_string(sb.st_dev) + ":" + std::to_string(sb.st_ino) + ":" +
+                         std::to_string(sb.st_rdev);
+  if (S_ISBLK(sb.st_mode)) {
+    std::string uuid;
+    std::string uuid_path = "/sys/dev/block/" + std::to_string(major(sb.st_rdev)) + ":" +
+                            std::to_string(minor(sb.st_rdev)) + "/dm/uuid";
+    if (android::base::ReadFileToString(uuid_path, &uuid)) {
+      identity += ":" + android::base::Trim(uuid);
+    }
+  }
+  SHA1_Update(&ctx, identity.data(), identity.size());
+
+  // The first and last blocks, and the ones evenly spaced in between. A small prefix gets read
+  // as a whole.
+  size_t blocks =
+      std::min(kFingerprintBlocks, (size + kFingerprintBlockSize - 1) / kFingerprintBlockSize);
+  std::vector<unsigned char> block(kFingerprintBlockSize);
+  for (size_t i = 0; i < blocks; i++) {
+    size_t offset = blocks > 1 ? (size - kFingerprintBlockSize) * i / (blocks - 1) : 0;
+    size_t count = std::min(kFingerprintBlockSize, size - offset);
+    if (!android::base::ReadFullyAtOffset(fd, block.data(), count, offset)) {
+      return false;
+    }
+    SHA1_Update(&ctx, block.data(), count);
+  }
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1_Final(digest, &ctx);
+  *fingerprint = print_sha1(digest);
+  ota_close(fd);
+  return true;
+}
+
+// Returns whether the cache says that a prefix listed in |filename| ("EMMC:<partition>:<size_1>:
+// <sha1_1>:...") has the expected SHA-1, and one of |patch_sha1_str| if that's not empty.
+static bool CheckCachedPartitionHash(const char* filename,
+                                     const std::vector<std::string>& patch_sha1_str) {
+  std::vector<std::string> pieces = android::base::Split(filename, ":");
+  if (pieces.size() < 4 || pieces.size() % 2 != 0 || pieces[0] != "EMMC") {
+    return false;
+  }
+  std::vector<PartitionHash> hashes = ReadPartitionHashes();
+  for (size_t i = 2; i < pieces.size(); i += 2) {
+    size_t size;
+    uint8_t expected[SHA_DIGEST_LENGTH];
+    if (!android::base::ParseUint(pieces[i], &size) ||
+        ParseSha1(pieces[i + 1].c_str(), expected) != 0 ||
+        (!patch_sha1_str.empty() && FindMatchingPatch(expected, patch_sha1_str) < 0)) {
+      continue;
+    }
+    for (const auto& hash : hashes) {
+      uint8_t cached[SHA_DIGEST_LENGTH];
+      std::string fingerprint;
+      if (hash.partition == pieces[1] && hash.size == size &&
+          ParseSha1(hash.sha1.c_str(), cached) == 0 &&
+          memcmp(cached, expected, SHA_DIGEST_LENGTH) == 0 &&
+          PartitionFingerprint(hash.partition, size, &fingerprint) &&
+          fingerprint == hash.fingerprint) {
+        printf("partition \"%s\" matched cached size %zu SHA-1 %s\n", pieces[1].c_str(), size,
+               hash.sha1.c_str());
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Records that the first |size| bytes of |partition| have the given SHA-1, replacing the older
+// entries of the partition.
+static void SavePartitionHash(const std::string& partition, size_t size,
+                              const uint8_t sha1[SHA_DIGEST_LENGTH]) {
+  std::string fingerprint;
+  if (CacheLocation::location().partition_hash_cache().empty() ||
+      !PartitionFingerprint(partition, size, &fingerprint)) {
+    return;
+  }
+  std::vector<PartitionHash> hashes = ReadPartitionHashes();
+  hashes.erase(std::remove_if(hashes.begin(), hashes.end(),
+                              [&partition](const PartitionHash& hash) {
+                                return hash.partition == partition;
+                              }),
+               hashes.end());
+  hashes.push_back({ partition, size, fingerprint, print_sha1(sha1) });
+  if (hashes.size() > kMaxPartitionHashes) {
+    hashes.erase(hashes.begin(), hashes.end() - kMaxPartitionHashes);
+  }
+  WritePartitionHashes(hashes);
+}
+
+static void DropPartitionHashes(const std::string& partition) {
+  std::vector<PartitionHash> hashes = ReadPartitionHashes();
+  auto it = std::remove_if(hashes.begin(), hashes.end(), [&partition](const PartitionHash& hash) {
+    return hash.partition == partition;
+  });
+  if (it != hashes.end()) {
+    hashes.erase(it, hashes.end());
+    WritePartitionHashes(hashes);
+  }
+}
+
 // Returns 0 if the contents of the file (argv[2]) or the cached file
 // match any of the sha1's on the command line (argv[3:]).  Returns
 // nonzero otherwise.
-int applypatch_check(const char* filename, const std::vector<std::string>& patch_sha1_str) {
+int applypatch_check(const char* filename, const std::vector<std::string>& patch_sha1_str,
+                     bool use_hash_cache) {
+  if (use_hash_cache && CheckCachedPartitionHash(filename, patch_sha1_str)) {
+    return 0;
+  }
+
   FileContents file;
 
   // It's okay to specify no sha1s; the check will pass if the
@@ -412,6 +725,8 @@ int applypatch_check(const char* filename, const std::vector<std::string>& patch
       printf("cache bits don't match any sha1 for \"%s\"\n", filename);
       return 1;
     }
+  } else if (use_hash_cache && strncmp(filename, "EMMC:", 5) == 0) {
+    SavePartitionHash(android::base::Split(filename, ":")[1], file.data.size(), file.sha1);
   }
   return 0;
 }
@@ -453,6 +768,30 @@ int CacheSizeCheck(size_t bytes) {
     return 0;
 }
 
+// Returns whether the two "EMMC:<partition_device>[:...]" names refer to the same device. Assumes
+// they do if that can't be told, e.g. either one fails to stat.
+static bool IsSamePartition(const std::string& source, const std::string& target) {
+  std::vector<std::string> source_pieces = android::base::Split(source, ":");
+  std::vector<std::string> target_pieces = android::base::Split(target, ":");
+  if (source_pieces.size() < 2 || target_pieces.size() < 2) {
+    return true;
+  }
+  if (source_pieces[1] == target_pieces[1]) {
+    return true;
+  }
+
+  struct stat source_st;
+  struct stat target_st;
+  if (stat(source_pieces[1].c_str(), &source_st) != 0 ||
+      stat(target_pieces[1].c_str(), &target_st) != 0) {
+    return true;
+  }
+  if (S_ISBLK(source_st.st_mode) && S_ISBLK(target_st.st_mode)) {
+    return source_st.st_rdev == target_st.st_rdev;
+  }
+  return source_st.st_dev == target_st.st_dev && source_st.st_ino == target_st.st_ino;
+}
+
 // This function applies binary patches to EMMC target files in a way that is safe (the original
 // file is not touched until we have the desired replacement for it) and idempotent (it's okay to
 // run this program multiple times).
@@ -475,9 +814,18 @@ int CacheSizeCheck(size_t bytes) {
 // become obsolete since we have dropped the support for patching non-EMMC targets (EMMC targets
 // have the size embedded in the filename).
 int applypatch(const char* source_filename, const char* target_filename,
-               const char* target_sha1_str, size_t /* target_size */,
+               const char* target_sha1_str, size_t target_size,
                const std::vector<std::string>& patch_sha1_str,
                const std::vector<std::unique_ptr<Value>>& patch_data, const Value* bonus_data) {
+  return applypatch(source_filename, target_filename, target_sha1_str, target_size,
+                    patch_sha1_str, [&patch_data](size_t i) { return patch_data[i].get(); },
+                    bonus_data);
+}
+
+int applypatch(const char* source_filename, const char* target_filename,
+               const char* target_sha1_str, size_t /* target_size */,
+               const std::vector<std::string>& patch_sha1_str, const PatchLoader& load_patch,
+               const Value* bonus_data) {
   printf("patch %s: ", source_filename);
 
   if (target_filename[0] == '-' && target_filename[1] == '\0') {
@@ -517,8 +865,10 @@ int applypatch(const char* source_filename, const char* target_filename,
   if (!source_file.data.empty()) {
     int to_use = FindMatchingPatch(source_file.sha1, patch_sha1_str);
     if (to_use != -1) {
-      return GenerateTarget(source_file, patch_data[to_use], target_filename, target_sha1,
-                            bonus_data);
+      // The source only needs a backup on /cache if writing the target would overwrite it.
+      bool backup_source = IsSamePartition(source_filename, target_filename);
+      return GenerateTarget(source_file, load_patch(to_use), target_filename, target_sha1,
+                            bonus_data, backup_source);
     }
   }
 
@@ -536,7 +886,8 @@ int applypatch(const char* source_filename, const char* target_filename,
     return 1;
   }
 
-  return GenerateTarget(copy_file, patch_data[to_use], target_filename, target_sha1, bonus_data);
+  return GenerateTarget(copy_file, load_patch(to_use), target_filename, target_sha1, bonus_data,
+                        true);
 }
 
 /*
@@ -593,16 +944,21 @@ int applypatch_flash(const char* source_filename, const char* target_filename,
   return 0;
 }
 
-static int GenerateTarget(const FileContents& source_file, const std::unique_ptr<Value>& patch,
+static int GenerateTarget(const FileContents& source_file, const Value* patch,
                           const std::string& target_filename,
-                          const uint8_t target_sha1[SHA_DIGEST_LENGTH], const Value* bonus_data) {
+                          const uint8_t target_sha1[SHA_DIGEST_LENGTH], const Value* bonus_data,
+                          bool backup_source) {
+  if (patch == nullptr) {
+    printf("failed to load the patch\n");
+    return 1;
+  }
   if (patch->type != VAL_BLOB) {
     printf("patch is not a blob\n");
     return 1;
   }
 
-  const char* header = &patch->data[0];
-  size_t header_bytes_read = patch->data.size();
+  const char* header = patch->bytes();
+  size_t header_bytes_read = patch->size();
   bool use_bsdiff = false;
   if (header_bytes_read >= 8 && memcmp(header, "BSDIFF40", 8) == 0) {
     use_bsdiff = true;
@@ -615,22 +971,46 @@ static int GenerateTarget(const FileContents& source_file, const std::unique_ptr
 
   CHECK(android::base::StartsWith(target_filename, "EMMC:"));
 
-  // We still write the original source to cache, in case the partition write is interrupted.
-  if (MakeFreeSpaceOnCache(source_file.data.size()) < 0) {
-    printf("not enough free space on /cache\n");
-    return 1;
-  }
-  if (SaveFileContents(CacheLocation::location().cache_temp_source().c_str(), &source_file) < 0) {
-    printf("failed to back up source file\n");
-    return 1;
-  }
-
-  // We store the decoded output in memory.
   std::string memory_sink_str;  // Don't need to reserve space.
-  SinkFn sink = [&memory_sink_str](const unsigned char* data, size_t len) {
-    memory_sink_str.append(reinterpret_cast<const char*>(data), len);
-    return len;
-  };
+  unique_fd target_fd;
+  size_t target_len = 0;
+  SinkFn sink;
+  if (backup_source) {
+    // We still write the original source to cache, in case the partition write is interrupted.
+    if (MakeFreeSpaceOnCache(source_file.data.size()) < 0) {
+      printf("not enough free space on /cache\n");
+      return 1;
+    }
+    if (SaveFileContents(CacheLocation::location().cache_temp_source().c_str(), &source_file) <
+        0) {
+      printf("failed to back up source file\n");
+      return 1;
+    }
+
+    // We store the decoded output in memory, as the source is overwritten by the target.
+    sink = [&memory_sink_str](const unsigned char* data, size_t len) {
+      memory_sink_str.append(reinterpret_cast<const char*>(data), len);
+      return len;
+    };
+  } else {
+    // The source stays intact on a different partition, which is what makes the update safe to
+    // retry. Stream the output straight to the target partition, and verify it afterwards.
+    std::vector<std::string> pieces = android::base::Split(target_filename, ":");
+    if (pieces.size() < 2) {
+      printf("bad target name \"%s\"\n", target_filename.c_str());
+      return 1;
+    }
+    target_fd.reset(ota_open(pieces[1].c_str(), O_WRONLY));
+    if (target_fd == -1) {
+      printf("failed to open %s: %s\n", pieces[1].c_str(), strerror(errno));
+      return 1;
+    }
+    sink = [&target_fd, &target_len](const unsigned char* data, size_t len) {
+      size_t written = FileSink(data, len, target_fd);
+      target_len += written;
+      return written;
+    };
+  }
 
   SHA_CTX ctx;
   SHA1_Init(&ctx);
@@ -658,6 +1038,29 @@ static int GenerateTarget(const FileContents& source_file, const std::unique_ptr
     printf("now %s\n", short_sha1(target_sha1).c_str());
   }
 
+  if (!backup_source) {
+    if (ota_fsync(target_fd) != 0) {
+      printf("failed to sync to %s: %s\n", target_filename.c_str(), strerror(errno));
+      return 1;
+    }
+    if (ota_close(target_fd) != 0) {
+      printf("failed to close %s: %s\n", target_filename.c_str(), strerror(errno));
+      return 1;
+    }
+
+    // Read the partition back, as WriteToPartition() does; only the hash of the output is kept.
+    DropCaches();
+    std::vector<std::string> pieces = android::base::Split(target_filename, ":");
+    std::string written_name = "EMMC:" + pieces[1] + ":" + std::to_string(target_len) + ":" +
+                               print_sha1(target_sha1);
+    FileContents written;
+    if (LoadPartitionContents(written_name, &written) != 0) {
+      printf("verification of patched data on %s failed\n", target_filename.c_str());
+      return 1;
+    }
+    return 0;
+  }
+
   // Write back the temp file to the partition.
   if (WriteToPartition(reinterpret_cast<const unsigned char*>(memory_sink_str.c_str()),
                        memory_sink_str.size(), target_filename) != 0) {
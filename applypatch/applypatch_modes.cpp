@@ -26,6 +26,7 @@
 #include <vector>
 
 #include <android-base/parseint.h>
+#include <android-base/properties.h>
 #include <android-base/strings.h>
 #include <openssl/sha.h>
 
@@ -41,7 +42,10 @@ static int CheckMode(int argc, const char** argv) {
         sha1.push_back(argv[i]);
     }
 
-    return applypatch_check(argv[2], sha1);
+    // Only for the check of install-recovery at boot, on devices that opt in.
+    return applypatch_check(argv[2], sha1,
+                            android::base::GetBoolProperty("ro.applypatch.partition_hash_cache",
+                                                           false));
 }
 
 // Parse arguments (which should be of the form "<sha1>:<filename>" into the
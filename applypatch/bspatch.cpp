@@ -20,13 +20,23 @@
 // applypatch with the -l option will display the bsdiff license
 // notice.
 
+#include <bzlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/types.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <android-base/logging.h>
 #include <bsdiff/bspatch.h>
+#include <bsdiff/file_interface.h>
 #include <openssl/sha.h>
 
 #include "applypatch/applypatch.h"
@@ -65,6 +75,230 @@ void ShowBSDiffLicense() {
         );
 }
 
+// Logs the SHA-1 of the patch when bspatch reports a data error, as the patch may be corrupted.
+static void LogPatchError(int result, const Value& patch, size_t patch_offset) {
+  LOG(ERROR) << "bspatch failed, result: " << result;
+  if (result == 2) {
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const uint8_t*>(patch.bytes() + patch_offset),
+         patch.size() - patch_offset, digest);
+    std::string patch_sha1 = print_sha1(digest);
+    LOG(ERROR) << "Patch may be corrupted, offset: " << patch_offset << ", SHA1: " << patch_sha1;
+  }
+}
+
+namespace {
+
+// The BSDIFF40 patches with more than this much compressed data have their streams decoded on
+// separate threads, which takes most of the apply time otherwise.
+constexpr size_t kParallelDecodeMinSize = 64 * 1024;
+
+// Each stream is decoded ahead by up to kMaxDecodedChunks chunks of kDecodedChunkSize bytes.
+constexpr size_t kDecodedChunkSize = 256 * 1024;
+constexpr size_t kMaxDecodedChunks = 4;
+
+// The diff and extra data are applied in pieces of this size at most.
+constexpr size_t kApplyChunkSize = 1024 * 1024;
+
+constexpr size_t kBSDiff40HeaderSize = 32;
+
+// Decodes one of the bzip2 streams of a BSDIFF40 patch on its own thread, ahead of the patching,
+// into a bounded queue of chunks.
+class StreamDecoder {
+ public:
+  StreamDecoder(const uint8_t* data, size_t size) : data_(data), size_(size) {
+    thread_ = std::thread(&StreamDecoder::Run, this);
+  }
+
+  ~StreamDecoder() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopped_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+  }
+
+  // Reads exactly |len| bytes of the decoded stream. Returns false if the stream ends before, or
+  // fails to decode.
+  bool Read(uint8_t* out, size_t len) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (len > 0) {
+      cv_.wait(lock, [this]() { return !chunks_.empty() || done_; });
+      if (chunks_.empty()) {
+        return false;
+      }
+      const std::vector<uint8_t>& chunk = chunks_.front();
+      size_t count = std::min(len, chunk.size() - read_pos_);
+      memcpy(out, chunk.data() + read_pos_, count);
+      out += count;
+      len -= count;
+      read_pos_ += count;
+      if (read_pos_ == chunk.size()) {
+        chunks_.pop_front();
+        read_pos_ = 0;
+        cv_.notify_all();
+      }
+    }
+    return true;
+  }
+
+ private:
+  void Run() {
+    bz_stream stream = {};
+    if (BZ2_bzDecompressInit(&stream, 0, 0) != BZ_OK) {
+      Finish();
+      return;
+    }
+    stream.next_in = const_cast<char*>(reinterpret_cast<const char*>(data_));
+    stream.avail_in = size_;
+    int result = BZ_OK;
+    while (result == BZ_OK) {
+      std::vector<uint8_t> chunk(kDecodedChunkSize);
+      stream.next_out = reinterpret_cast<char*>(chunk.data());
+      stream.avail_out = chunk.size();
+      while (result == BZ_OK && stream.avail_out > 0) {
+        result = BZ2_bzDecompress(&stream);
+        if (result == BZ_OK && stream.avail_in == 0 && stream.avail_out > 0) {
+          // Truncated stream.
+          result = BZ_UNEXPECTED_EOF;
+        }
+      }
+      if (result != BZ_OK && result != BZ_STREAM_END) {
+        // Read() only reports it if the data is needed.
+        break;
+      }
+      chunk.resize(chunk.size() - stream.avail_out);
+
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this]() { return chunks_.size() < kMaxDecodedChunks || stopped_; });
+      if (stopped_) {
+        break;
+      }
+      if (!chunk.empty()) {
+        chunks_.push_back(std::move(chunk));
+        cv_.notify_all();
+      }
+    }
+    BZ2_bzDecompressEnd(&stream);
+    Finish();
+  }
+
+  void Finish() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    done_ = true;
+    cv_.notify_all();
+  }
+
+  const uint8_t* data_;
+  size_t size_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  // Guarded by mutex_.
+  std::deque<std::vector<uint8_t>> chunks_;
+  size_t read_pos_ = 0;  // In the first chunk.
+  bool done_ = false;
+  bool stopped_ = false;
+
+  std::thread thread_;
+};
+
+// Reads the sign-magnitude 64-bit integer of bsdiff.
+int64_t ReadOffset(const uint8_t* buf) {
+  int64_t value = buf[7] & 0x7f;
+  for (int i = 6; i >= 0; i--) {
+    value = value * 256 + buf[i];
+  }
+  return (buf[7] & 0x80) ? -value : value;
+}
+
+// Applies a BSDIFF40 patch like bsdiff::bspatch() does, but with the control, diff and extra
+// streams each decoded by a StreamDecoder. Returns 0 on success, 1 if the sink fails, or 2 if the
+// patch is corrupted (as bspatch does). Returns -1 for the patches it doesn't handle, which are
+// left to bspatch.
+int ApplyBSDiff40Patch(const uint8_t* old_data, size_t old_size, const uint8_t* patch,
+                       size_t patch_size, const SinkFn& sink) {
+  if (patch_size < kBSDiff40HeaderSize + kParallelDecodeMinSize ||
+      memcmp(patch, "BSDIFF40", 8) != 0) {
+    return -1;
+  }
+  int64_t ctrl_len = ReadOffset(patch + 8);
+  int64_t diff_len = ReadOffset(patch + 16);
+  int64_t new_size = ReadOffset(patch + 24);
+  uint64_t streams_size = patch_size - kBSDiff40HeaderSize;
+  if (ctrl_len < 0 || diff_len < 0 || new_size < 0 ||
+      static_cast<uint64_t>(ctrl_len) > streams_size ||
+      static_cast<uint64_t>(diff_len) > streams_size - ctrl_len) {
+    LOG(ERROR) << "Corrupt bsdiff patch header";
+    return 2;
+  }
+
+  const uint8_t* ctrl_start = patch + kBSDiff40HeaderSize;
+  const uint8_t* diff_start = ctrl_start + ctrl_len;
+  const uint8_t* extra_start = diff_start + diff_len;
+  StreamDecoder ctrl(ctrl_start, ctrl_len);
+  StreamDecoder diff(diff_start, diff_len);
+  StreamDecoder extra(extra_start, patch + patch_size - extra_start);
+
+  std::vector<uint8_t> buffer(std::min<uint64_t>(new_size, kApplyChunkSize));
+  int64_t old_pos = 0;
+  int64_t new_pos = 0;
+  while (new_pos < new_size) {
+    uint8_t ctrl_buf[24];
+    if (!ctrl.Read(ctrl_buf, sizeof(ctrl_buf))) {
+      LOG(ERROR) << "Failed to read the bsdiff control data";
+      return 2;
+    }
+    int64_t diff_size = ReadOffset(ctrl_buf);
+    int64_t extra_size = ReadOffset(ctrl_buf + 8);
+    int64_t seek = ReadOffset(ctrl_buf + 16);
+    if (diff_size < 0 || extra_size < 0 || diff_size > new_size - new_pos ||
+        extra_size > new_size - new_pos - diff_size) {
+      LOG(ERROR) << "Corrupt bsdiff control data";
+      return 2;
+    }
+
+    // Adds the diff data to the old data, where there's any.
+    while (diff_size > 0) {
+      size_t count = std::min<int64_t>(diff_size, buffer.size());
+      if (!diff.Read(buffer.data(), count)) {
+        LOG(ERROR) << "Failed to read the bsdiff diff data";
+        return 2;
+      }
+      for (size_t i = 0; i < count; i++) {
+        int64_t pos = old_pos + static_cast<int64_t>(i);
+        if (pos >= 0 && static_cast<uint64_t>(pos) < old_size) {
+          buffer[i] += old_data[pos];
+        }
+      }
+      if (sink(buffer.data(), count) != count) {
+        return 1;
+      }
+      diff_size -= count;
+      old_pos += count;
+      new_pos += count;
+    }
+
+    while (extra_size > 0) {
+      size_t count = std::min<int64_t>(extra_size, buffer.size());
+      if (!extra.Read(buffer.data(), count)) {
+        LOG(ERROR) << "Failed to read the bsdiff extra data";
+        return 2;
+      }
+      if (sink(buffer.data(), count) != count) {
+        return 1;
+      }
+      extra_size -= count;
+      new_pos += count;
+    }
+    old_pos += seek;
+  }
+  return 0;
+}
+
+}  // namespace
+
 int ApplyBSDiffPatch(const unsigned char* old_data, size_t old_size, const Value& patch,
                      size_t patch_offset, SinkFn sink, SHA_CTX* ctx) {
   auto sha_sink = [&sink, &ctx](const uint8_t* data, size_t len) {
@@ -73,21 +307,111 @@ int ApplyBSDiffPatch(const unsigned char* old_data, size_t old_size, const Value
     return len;
   };
 
-  CHECK_LE(patch_offset, patch.data.size());
+  CHECK_LE(patch_offset, patch.size());
 
-  int result = bsdiff::bspatch(old_data, old_size,
-                               reinterpret_cast<const uint8_t*>(&patch.data[patch_offset]),
-                               patch.data.size() - patch_offset, sha_sink);
+  const uint8_t* patch_data = reinterpret_cast<const uint8_t*>(patch.bytes() + patch_offset);
+  size_t patch_size = patch.size() - patch_offset;
+  int result = ApplyBSDiff40Patch(old_data, old_size, patch_data, patch_size, sha_sink);
+  if (result == -1) {
+    result = bsdiff::bspatch(old_data, old_size, patch_data, patch_size, sha_sink);
+  }
   if (result != 0) {
-    LOG(ERROR) << "bspatch failed, result: " << result;
-    // print SHA1 of the patch in the case of a data error.
-    if (result == 2) {
-      uint8_t digest[SHA_DIGEST_LENGTH];
-      SHA1(reinterpret_cast<const uint8_t*>(patch.data.data() + patch_offset),
-           patch.data.size() - patch_offset, digest);
-      std::string patch_sha1 = print_sha1(digest);
-      LOG(ERROR) << "Patch may be corrupted, offset: " << patch_offset << ", SHA1: " << patch_sha1;
+    LogPatchError(result, patch, patch_offset);
+  }
+  return result;
+}
+
+namespace {
+
+// The old file for bspatch, which reads the source data through a SourceFn.
+class SourceFile : public bsdiff::FileInterface {
+ public:
+  SourceFile(const SourceFn& source, size_t size) : source_(source), size_(size), pos_(0) {}
+
+  bool Read(void* buf, size_t count, size_t* bytes_read) override {
+    count = std::min(count, size_ - pos_);
+    if (count > 0 && !source_(pos_, static_cast<unsigned char*>(buf), count)) {
+      return false;
     }
+    pos_ += count;
+    *bytes_read = count;
+    return true;
+  }
+
+  bool Write(const void*, size_t, size_t*) override {
+    return false;
+  }
+
+  bool Seek(off_t pos) override {
+    if (pos < 0 || static_cast<uint64_t>(pos) > size_) {
+      return false;
+    }
+    pos_ = pos;
+    return true;
+  }
+
+  bool Close() override {
+    return true;
+  }
+
+  bool GetSize(uint64_t* size) override {
+    *size = size_;
+    return true;
+  }
+
+ private:
+  const SourceFn& source_;
+  size_t size_;
+  size_t pos_;
+};
+
+// The new file for bspatch, which passes the output to a SinkFn and updates the SHA-1 context.
+class SinkFile : public bsdiff::FileInterface {
+ public:
+  SinkFile(const SinkFn& sink, SHA_CTX* ctx) : sink_(sink), ctx_(ctx) {}
+
+  bool Read(void*, size_t, size_t*) override {
+    return false;
+  }
+
+  bool Write(const void* buf, size_t count, size_t* bytes_written) override {
+    const unsigned char* data = static_cast<const unsigned char*>(buf);
+    size_t written = sink_(data, count);
+    if (ctx_) SHA1_Update(ctx_, data, written);
+    *bytes_written = written;
+    return written == count;
+  }
+
+  bool Seek(off_t) override {
+    return false;
+  }
+
+  bool Close() override {
+    return true;
+  }
+
+  bool GetSize(uint64_t*) override {
+    return false;
+  }
+
+ private:
+  const SinkFn& sink_;
+  SHA_CTX* ctx_;
+};
+
+}  // namespace
+
+int ApplyBSDiffPatchFromSource(const SourceFn& source, size_t old_size, const Value& patch,
+                               size_t patch_offset, SinkFn sink, SHA_CTX* ctx) {
+  CHECK_LE(patch_offset, patch.size());
+
+  std::unique_ptr<bsdiff::FileInterface> old_file = std::make_unique<SourceFile>(source, old_size);
+  std::unique_ptr<bsdiff::FileInterface> new_file = std::make_unique<SinkFile>(sink, ctx);
+  int result = bsdiff::bspatch(old_file, new_file,
+                               reinterpret_cast<const uint8_t*>(patch.bytes() + patch_offset),
+                               patch.size() - patch_offset);
+  if (result != 0) {
+    LogPatchError(result, patch, patch_offset);
   }
   return result;
 }
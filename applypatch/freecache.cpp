@@ -25,71 +25,50 @@
 #include <dirent.h>
 #include <ctype.h>
 
+#include <algorithm>
 #include <memory>
 #include <set>
 #include <string>
-
-#include <android-base/parseint.h>
-#include <android-base/stringprintf.h>
+#include <vector>
 
 #include "applypatch/applypatch.h"
 #include "otautil/cache_location.h"
+#include "otautil/open_files.h"
 
 static int EliminateOpenFiles(std::set<std::string>* files) {
-  std::unique_ptr<DIR, decltype(&closedir)> d(opendir("/proc"), closedir);
-  if (!d) {
-    printf("error opening /proc: %s\n", strerror(errno));
+  OpenFiles open_files;
+  if (!open_files.Scan(false)) {
+    printf("error scanning /proc: %s\n", strerror(errno));
     return -1;
   }
-  struct dirent* de;
-  while ((de = readdir(d.get())) != 0) {
-    unsigned int pid;
-    if (!android::base::ParseUint(de->d_name, &pid)) {
-        continue;
-    }
-    std::string path = android::base::StringPrintf("/proc/%s/fd/", de->d_name);
-
-    struct dirent* fdde;
-    std::unique_ptr<DIR, decltype(&closedir)> fdd(opendir(path.c_str()), closedir);
-    if (!fdd) {
-      printf("error opening %s: %s\n", path.c_str(), strerror(errno));
-      continue;
-    }
-    while ((fdde = readdir(fdd.get())) != 0) {
-      std::string fd_path = path + fdde->d_name;
-      char link[FILENAME_MAX];
-
-      int count = readlink(fd_path.c_str(), link, sizeof(link)-1);
-      if (count >= 0) {
-        link[count] = '\0';
-        if (strncmp(link, "/cache/", 7) == 0) {
-          if (files->erase(link) > 0) {
-            printf("%s is open by %s\n", link, de->d_name);
-          }
-        }
-      }
+  for (const auto& entry : open_files.entries()) {
+    if (entry.kind == OpenFiles::Kind::kFd && files->erase(entry.path) > 0) {
+      printf("%s is open by %d\n", entry.path.c_str(), entry.pid);
     }
   }
   return 0;
 }
 
-static std::set<std::string> FindExpendableFiles() {
-  std::set<std::string> files;
-  // We're allowed to delete unopened regular files in any of these
-  // directories.
-  const char* dirs[2] = {"/cache", "/cache/recovery/otatest"};
+// An expendable file, along with the attributes it's ordered by.
+struct ExpendableFile {
+  std::string path;
+  off_t size;
+  time_t mtime;
+};
 
-  for (size_t i = 0; i < sizeof(dirs)/sizeof(dirs[0]); ++i) {
-    std::unique_ptr<DIR, decltype(&closedir)> d(opendir(dirs[i]), closedir);
+static std::set<std::string> FindExpendableFiles(const std::vector<std::string>& dirs) {
+  std::set<std::string> files;
+  for (const auto& dir : dirs) {
+    std::unique_ptr<DIR, decltype(&closedir)> d(opendir(dir.c_str()), closedir);
     if (!d) {
-      printf("error opening %s: %s\n", dirs[i], strerror(errno));
+      printf("error opening %s: %s\n", dir.c_str(), strerror(errno));
       continue;
     }
 
     // Look for regular files in the directory (not in any subdirectories).
     struct dirent* de;
     while ((de = readdir(d.get())) != 0) {
-      std::string path = std::string(dirs[i]) + "/" + de->d_name;
+      std::string path = dir + "/" + de->d_name;
 
       // We can't delete cache_temp_source; if it's there we might have restarted during
       // installation and could be depending on it to be there.
@@ -111,39 +90,63 @@ static std::set<std::string> FindExpendableFiles() {
   return files;
 }
 
-int MakeFreeSpaceOnCache(size_t bytes_needed) {
-#ifndef __ANDROID__
-  // TODO (xunchang) implement a heuristic cache size check during host simulation.
-  printf("Skip making (%zu) bytes free space on cache; program is running on host\n", bytes_needed);
-  return 0;
-#endif
+// Lists the expendable files in the order they should be deleted: the oldest first, and the larger
+// one first among the files of the same age. The list is built afresh for each call of
+// MakeFreeSpaceInDirectories(), as any of the files may have been opened since the last one.
+static std::vector<ExpendableFile> ListExpendableFiles(const std::vector<std::string>& dirs) {
+  std::vector<ExpendableFile> expendable;
+  for (const auto& path : FindExpendableFiles(dirs)) {
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0) {
+      expendable.push_back({ path, st.st_size, st.st_mtime });
+    }
+  }
+  std::sort(expendable.begin(), expendable.end(),
+            [](const ExpendableFile& a, const ExpendableFile& b) {
+              if (a.mtime != b.mtime) return a.mtime < b.mtime;
+              if (a.size != b.size) return a.size > b.size;
+              return a.path < b.path;
+            });
+  return expendable;
+}
 
-  size_t free_now = FreeSpaceForFile("/cache");
-  printf("%zu bytes free on /cache (%zu needed)\n", free_now, bytes_needed);
+int MakeFreeSpaceInDirectories(size_t bytes_needed, const std::vector<std::string>& dirs,
+                               const std::function<size_t(const std::string&)>& space_checker) {
+  size_t free_now = space_checker(dirs[0]);
+  printf("%zu bytes free on %s (%zu needed)\n", free_now, dirs[0].c_str(), bytes_needed);
 
   if (free_now >= bytes_needed) {
     return 0;
   }
-  std::set<std::string> files = FindExpendableFiles();
-  if (files.empty()) {
+
+  std::vector<ExpendableFile> expendable = ListExpendableFiles(dirs);
+  if (expendable.empty()) {
     // nothing we can delete to free up space!
-    printf("no files can be deleted to free space on /cache\n");
+    printf("no files can be deleted to free space on %s\n", dirs[0].c_str());
     return -1;
   }
 
-  // We could try to be smarter about which files to delete:  the
-  // biggest ones?  the smallest ones that will free up enough space?
-  // the oldest?  the newest?
-  //
-  // Instead, we'll be dumb.
-
-  for (const auto& file : files) {
-    unlink(file.c_str());
-    free_now = FreeSpaceForFile("/cache");
-    printf("deleted %s; now %zu bytes free\n", file.c_str(), free_now);
-    if (free_now < bytes_needed) {
-        break;
+  for (const auto& file : expendable) {
+    if (free_now >= bytes_needed) {
+      break;
     }
+    unlink(file.path.c_str());
+    free_now = space_checker(dirs[0]);
+    printf("deleted %s; now %zu bytes free\n", file.path.c_str(), free_now);
   }
   return (free_now >= bytes_needed) ? 0 : -1;
 }
+
+int MakeFreeSpaceOnCache(size_t bytes_needed) {
+#ifndef __ANDROID__
+  // TODO (xunchang) implement a heuristic cache size check during host simulation.
+  printf("Skip making (%zu) bytes free space on cache; program is running on host\n", bytes_needed);
+  return 0;
+#endif
+
+  // We're allowed to delete unopened regular files in any of these directories.
+  return MakeFreeSpaceInDirectories(bytes_needed, { "/cache", "/cache/recovery/otatest" },
+                                    [](const std::string& dir) {
+                                      return FreeSpaceForFile(dir.c_str());
+                                    });
+}
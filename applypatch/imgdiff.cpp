@@ -148,12 +148,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <functional>
+#include <map>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <android-base/file.h>
@@ -164,11 +168,13 @@
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <bsdiff/bsdiff.h>
+#include <openssl/sha.h>
 #include <ziparchive/zip_archive.h>
 #include <zlib.h>
 
 #include "applypatch/imgdiff_image.h"
 #include "otautil/rangeset.h"
+#include "otautil/thread_pool.h"
 
 using android::base::get_unaligned;
 
@@ -245,17 +251,100 @@ static bool RemoveUsedBlocks(size_t* start, size_t* length, const SortedRangeSet
   return false;
 }
 
+// Calls |work(i)| for each i in [0, count) on up to |jobs| threads of the shared pool, the calling
+// one included. The indices are handed out in order, and no new ones are started once a call fails.
+// Nested calls (e.g. for the chunks of each split) share the same workers. Returns false if any of
+// the calls fails.
+static bool RunInParallel(size_t count, size_t jobs, const std::function<bool(size_t)>& work) {
+  jobs = std::max<size_t>(1, std::min(jobs, count));
+  if (jobs == 1) {
+    for (size_t i = 0; i < count; i++) {
+      if (!work(i)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  return ThreadPool::Shared().ParallelFor(count, work, jobs);
+}
+
 static const struct option OPTIONS[] = {
   { "zip-mode", no_argument, nullptr, 'z' },
   { "bonus-file", required_argument, nullptr, 'b' },
+  { "jobs", required_argument, nullptr, 'j' },
+  { "sa-cache-limit", required_argument, nullptr, 0 },
   { "block-limit", required_argument, nullptr, 0 },
   { "debug-dir", required_argument, nullptr, 0 },
   { "split-info", required_argument, nullptr, 0 },
+  { "device-profile", required_argument, nullptr, 0 },
   { "verbose", no_argument, nullptr, 'v' },
   { nullptr, 0, nullptr, 0 },
 };
 
-ImageChunk::ImageChunk(int type, size_t start, const std::vector<uint8_t>* file_content,
+FileContent::FileContent(FileContent&& other) noexcept
+    : buffer_(std::move(other.buffer_)),
+      mapped_(other.mapped_),
+      mapped_size_(other.mapped_size_) {
+  other.mapped_ = nullptr;
+  other.mapped_size_ = 0;
+}
+
+FileContent& FileContent::operator=(FileContent&& other) noexcept {
+  if (this != &other) {
+    Unmap();
+    buffer_ = std::move(other.buffer_);
+    mapped_ = other.mapped_;
+    mapped_size_ = other.mapped_size_;
+    other.mapped_ = nullptr;
+    other.mapped_size_ = 0;
+  }
+  return *this;
+}
+
+FileContent::~FileContent() {
+  Unmap();
+}
+
+void FileContent::Unmap() {
+  if (mapped_ != nullptr) {
+    munmap(mapped_, mapped_size_);
+    mapped_ = nullptr;
+    mapped_size_ = 0;
+  }
+}
+
+bool FileContent::MapFile(const std::string& filename) {
+  Unmap();
+  buffer_.clear();
+
+  android::base::unique_fd fd(open(filename.c_str(), O_RDONLY));
+  if (fd == -1) {
+    PLOG(ERROR) << "Failed to open " << filename;
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    PLOG(ERROR) << "Failed to stat " << filename;
+    return false;
+  }
+
+  // An empty file can't be mapped; leave the content empty instead.
+  size_t sz = static_cast<size_t>(st.st_size);
+  if (sz == 0) {
+    return true;
+  }
+
+  void* addr = mmap(nullptr, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (addr == MAP_FAILED) {
+    PLOG(ERROR) << "Failed to map " << filename;
+    return false;
+  }
+  mapped_ = static_cast<uint8_t*>(addr);
+  mapped_size_ = sz;
+  return true;
+}
+
+ImageChunk::ImageChunk(int type, size_t start, const FileContent* file_content,
                        size_t raw_data_len, std::string entry_name)
     : type_(type),
       start_(start),
@@ -329,9 +418,75 @@ void ImageChunk::MergeAdjacentNormal(const ImageChunk& other) {
   raw_data_len_ = raw_data_len_ + other.raw_data_len_;
 }
 
+struct SuffixArrayCache::Entry {
+  ~Entry() {
+    delete index;
+  }
+
+  // Held while the first user builds |index|, which is never changed once set.
+  std::mutex lock;
+  bsdiff::SuffixArrayIndexInterface* index = nullptr;
+  size_t size = 0;
+};
+
+std::shared_ptr<SuffixArrayCache::Entry> SuffixArrayCache::Lookup(const uint8_t* data,
+                                                                  size_t length) {
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1(data, length, digest);
+  std::string key =
+      std::string(reinterpret_cast<const char*>(digest), sizeof(digest)) + std::to_string(length);
+
+  std::lock_guard<std::mutex> lock(lock_);
+  auto it = entries_.find(key);
+  if (it != entries_.end()) {
+    hits_++;
+    lru_.remove(key);
+    lru_.push_front(key);
+    return it->second;
+  }
+
+  // libdivsufsort uses 32-bit indexes for inputs under 2 GiB, and 64-bit ones otherwise.
+  misses_++;
+  auto entry = std::make_shared<Entry>();
+  entry->size = (length + 1) * (length < (1ULL << 31) ? sizeof(int32_t) : sizeof(int64_t));
+  entries_.emplace(key, entry);
+  lru_.push_front(key);
+  size_ += entry->size;
+
+  // The arrays that are still in use stay alive with their users after the eviction.
+  while (size_ > limit_ && lru_.size() > 1) {
+    auto victim = entries_.find(lru_.back());
+    LOG(INFO) << "Evicting a suffix array of " << victim->second->size << " bytes";
+    size_ -= victim->second->size;
+    entries_.erase(victim);
+    lru_.pop_back();
+  }
+  return entry;
+}
+
+int SuffixArrayCache::Diff(const ImageChunk& src, const ImageChunk& tgt, const char* patch_name) {
+  auto entry = Lookup(src.DataForPatch(), src.DataLengthForPatch());
+
+  // Concurrent users of the same source wait for the first one to build the index, and then search
+  // it without locking. A diff against an empty target only builds it; |patch_name| is written
+  // over by the actual diff.
+  {
+    std::lock_guard<std::mutex> build_lock(entry->lock);
+    if (entry->index == nullptr) {
+      int result = bsdiff::bsdiff(src.DataForPatch(), src.DataLengthForPatch(), nullptr, 0,
+                                  patch_name, &entry->index);
+      if (result != 0 || entry->index == nullptr) {
+        LOG(ERROR) << "Failed to index the source of " << src.DataLengthForPatch() << " bytes";
+        return result != 0 ? result : -1;
+      }
+    }
+  }
+  return bsdiff::bsdiff(src.DataForPatch(), src.DataLengthForPatch(), tgt.DataForPatch(),
+                        tgt.DataLengthForPatch(), patch_name, &entry->index);
+}
+
 bool ImageChunk::MakePatch(const ImageChunk& tgt, const ImageChunk& src,
-                           std::vector<uint8_t>* patch_data,
-                           bsdiff::SuffixArrayIndexInterface** bsdiff_cache) {
+                           std::vector<uint8_t>* patch_data, SuffixArrayCache* sa_cache) {
 #if defined(__ANDROID__)
   char ptemp[] = "/data/local/tmp/imgdiff-patch-XXXXXX";
 #else
@@ -345,8 +500,10 @@ bool ImageChunk::MakePatch(const ImageChunk& tgt, const ImageChunk& src,
   }
   close(fd);
 
-  int r = bsdiff::bsdiff(src.DataForPatch(), src.DataLengthForPatch(), tgt.DataForPatch(),
-                         tgt.DataLengthForPatch(), ptemp, bsdiff_cache);
+  int r = (sa_cache != nullptr)
+              ? sa_cache->Diff(src, tgt, ptemp)
+              : bsdiff::bsdiff(src.DataForPatch(), src.DataLengthForPatch(), tgt.DataForPatch(),
+                               tgt.DataLengthForPatch(), ptemp, nullptr);
   if (r != 0) {
     LOG(ERROR) << "bsdiff() failed: " << r;
     return false;
@@ -377,17 +534,35 @@ bool ImageChunk::MakePatch(const ImageChunk& tgt, const ImageChunk& src,
   return true;
 }
 
-bool ImageChunk::ReconstructDeflateChunk() {
+bool ImageChunk::ReconstructDeflateChunk(int* level_hint) {
   if (type_ != CHUNK_DEFLATE) {
     LOG(ERROR) << "Attempted to reconstruct non-deflate chunk";
     return false;
   }
 
   // We only check two combinations of encoder parameters:  level 6 (the default) and level 9
-  // (the maximum).
-  for (int level = 6; level <= 9; level += 3) {
-    if (TryReconstruction(level)) {
+  // (the maximum). The level that worked for the previous chunk of the same image is tried first,
+  // as the entries are usually compressed alike.
+  std::vector<int> levels = { 6, 9 };
+  if (level_hint != nullptr && *level_hint == levels.back()) {
+    std::reverse(levels.begin(), levels.end());
+  }
+
+  // Rule out the levels whose output already differs within the first kProbeSize bytes before
+  // compressing the whole chunk, which is what dominates the runtime for large entries. For small
+  // chunks the probe is the full check.
+  static constexpr size_t kProbeSize = 4096;
+  if (raw_data_len_ > kProbeSize) {
+    auto mismatch = [this](int level) { return !TryReconstruction(level, kProbeSize); };
+    levels.erase(std::remove_if(levels.begin(), levels.end(), mismatch), levels.end());
+  }
+
+  for (int level : levels) {
+    if (TryReconstruction(level, raw_data_len_)) {
       compress_level_ = level;
+      if (level_hint != nullptr) {
+        *level_hint = level;
+      }
       return true;
     }
   }
@@ -395,12 +570,7 @@ bool ImageChunk::ReconstructDeflateChunk() {
   return false;
 }
 
-/*
- * Takes the uncompressed data stored in the chunk, compresses it using the zlib parameters stored
- * in the chunk, and checks that it matches exactly the compressed data we started with (also
- * stored in the chunk).
- */
-bool ImageChunk::TryReconstruction(int level) {
+bool ImageChunk::TryReconstruction(int level, size_t limit) {
   z_stream strm;
   strm.zalloc = Z_NULL;
   strm.zfree = Z_NULL;
@@ -413,7 +583,9 @@ bool ImageChunk::TryReconstruction(int level) {
     return false;
   }
 
-  std::vector<uint8_t> buffer(BUFFER_SIZE);
+  // Limit the output buffer as well, so that deflate stops consuming input once the first |limit|
+  // bytes are out.
+  std::vector<uint8_t> buffer(std::min(BUFFER_SIZE, std::max<size_t>(limit, 1)));
   size_t offset = 0;
   do {
     strm.avail_out = buffer.size();
@@ -421,16 +593,23 @@ bool ImageChunk::TryReconstruction(int level) {
     ret = deflate(&strm, Z_FINISH);
     if (ret < 0) {
       LOG(ERROR) << "Failed to deflate: " << ret;
+      deflateEnd(&strm);
       return false;
     }
 
     size_t compressed_size = buffer.size() - strm.avail_out;
-    if (memcmp(buffer.data(), input_file_ptr_->data() + start_ + offset, compressed_size) != 0) {
+    if (offset + compressed_size > raw_data_len_ ||
+        memcmp(buffer.data(), input_file_ptr_->data() + start_ + offset, compressed_size) != 0) {
       // mismatch; data isn't the same.
       deflateEnd(&strm);
       return false;
     }
     offset += compressed_size;
+    if (limit < raw_data_len_ && offset >= limit) {
+      // The probe has matched so far.
+      deflateEnd(&strm);
+      return true;
+    }
   } while (ret != Z_STREAM_END);
   deflateEnd(&strm);
 
@@ -618,29 +797,9 @@ void Image::DumpChunks() const {
   }
 }
 
-bool Image::ReadFile(const std::string& filename, std::vector<uint8_t>* file_content) {
+bool Image::ReadFile(const std::string& filename, FileContent* file_content) {
   CHECK(file_content != nullptr);
-
-  android::base::unique_fd fd(open(filename.c_str(), O_RDONLY));
-  if (fd == -1) {
-    PLOG(ERROR) << "Failed to open " << filename;
-    return false;
-  }
-  struct stat st;
-  if (fstat(fd, &st) != 0) {
-    PLOG(ERROR) << "Failed to stat " << filename;
-    return false;
-  }
-
-  size_t sz = static_cast<size_t>(st.st_size);
-  file_content->resize(sz);
-  if (!android::base::ReadFully(fd, file_content->data(), sz)) {
-    PLOG(ERROR) << "Failed to read " << filename;
-    return false;
-  }
-  fd.reset();
-
-  return true;
+  return file_content->MapFile(filename);
 }
 
 bool ZipModeImage::Initialize(const std::string& filename) {
@@ -669,6 +828,7 @@ bool ZipModeImage::Initialize(const std::string& filename) {
   }
 
   CloseArchive(handle);
+  IndexChunks();
   return true;
 }
 
@@ -701,10 +861,13 @@ bool ZipModeImage::InitializeChunks(const std::string& filename, ZipArchiveHandl
 
   EndIteration(cookie);
 
+  // The deflated entries are inflated once all the chunks are in place.
+  std::vector<std::pair<size_t, ZipEntry>> inflations;
+
   // For source chunks, we don't need to compose chunks for the metadata.
   if (is_source_) {
     for (auto& entry : temp_entries) {
-      if (!AddZipEntryToChunks(handle, entry.first, &entry.second)) {
+      if (!AddZipEntryToChunks(handle, entry.first, &entry.second, &inflations)) {
         LOG(ERROR) << "Failed to add " << entry.first << " to source chunks";
         return false;
       }
@@ -720,7 +883,7 @@ bool ZipModeImage::InitializeChunks(const std::string& filename, ZipArchiveHandl
     chunks_.emplace_back(CHUNK_NORMAL, entries_end, &file_content_,
                          file_content_.size() - entries_end);
 
-    return true;
+    return InflateEntries(handle, inflations);
   }
 
   // For target chunks, add the deflate entries as CHUNK_DEFLATE and the contents between two
@@ -732,7 +895,7 @@ bool ZipModeImage::InitializeChunks(const std::string& filename, ZipArchiveHandl
         static_cast<off64_t>(pos) == temp_entries[nextentry].second.offset) {
       // Add the next zip entry.
       std::string entry_name = temp_entries[nextentry].first;
-      if (!AddZipEntryToChunks(handle, entry_name, &temp_entries[nextentry].second)) {
+      if (!AddZipEntryToChunks(handle, entry_name, &temp_entries[nextentry].second, &inflations)) {
         LOG(ERROR) << "Failed to add " << entry_name << " to target chunks";
         return false;
       }
@@ -754,11 +917,12 @@ bool ZipModeImage::InitializeChunks(const std::string& filename, ZipArchiveHandl
     pos += raw_data_len;
   }
 
-  return true;
+  return InflateEntries(handle, inflations);
 }
 
-bool ZipModeImage::AddZipEntryToChunks(ZipArchiveHandle handle, const std::string& entry_name,
-                                       ZipEntry* entry) {
+bool ZipModeImage::AddZipEntryToChunks(ZipArchiveHandle, const std::string& entry_name,
+                                       ZipEntry* entry,
+                                       std::vector<std::pair<size_t, ZipEntry>>* inflations) {
   size_t compressed_len = entry->compressed_length;
   if (compressed_len == 0) return true;
 
@@ -775,17 +939,8 @@ bool ZipModeImage::AddZipEntryToChunks(ZipArchiveHandle handle, const std::strin
       compressed_len -= length;
     }
   } else if (entry->method == kCompressDeflated) {
-    size_t uncompressed_len = entry->uncompressed_length;
-    std::vector<uint8_t> uncompressed_data(uncompressed_len);
-    int ret = ExtractToMemory(handle, entry, uncompressed_data.data(), uncompressed_len);
-    if (ret != 0) {
-      LOG(ERROR) << "Failed to extract " << entry_name << " with size " << uncompressed_len << ": "
-                 << ErrorCodeString(ret);
-      return false;
-    }
-    ImageChunk curr(CHUNK_DEFLATE, entry->offset, &file_content_, compressed_len, entry_name);
-    curr.SetUncompressedData(std::move(uncompressed_data));
-    chunks_.push_back(std::move(curr));
+    inflations->emplace_back(chunks_.size(), *entry);
+    chunks_.emplace_back(CHUNK_DEFLATE, entry->offset, &file_content_, compressed_len, entry_name);
   } else {
     chunks_.emplace_back(CHUNK_NORMAL, entry->offset, &file_content_, compressed_len, entry_name);
   }
@@ -793,6 +948,29 @@ bool ZipModeImage::AddZipEntryToChunks(ZipArchiveHandle handle, const std::strin
   return true;
 }
 
+bool ZipModeImage::InflateEntries(ZipArchiveHandle handle,
+                                  const std::vector<std::pair<size_t, ZipEntry>>& inflations) {
+  if (layout_only_) {
+    return true;
+  }
+  // The archive is opened from memory, so the entries can be extracted concurrently. Each one goes
+  // to its own chunk, which keeps the chunks in order.
+  return RunInParallel(inflations.size(), jobs_, [&](size_t i) {
+    ImageChunk& chunk = chunks_[inflations[i].first];
+    ZipEntry entry = inflations[i].second;
+    size_t uncompressed_len = entry.uncompressed_length;
+    std::vector<uint8_t> uncompressed_data(uncompressed_len);
+    int ret = ExtractToMemory(handle, &entry, uncompressed_data.data(), uncompressed_len);
+    if (ret != 0) {
+      LOG(ERROR) << "Failed to extract " << chunk.GetEntryName() << " with size "
+                 << uncompressed_len << ": " << ErrorCodeString(ret);
+      return false;
+    }
+    chunk.SetUncompressedData(std::move(uncompressed_data));
+    return true;
+  });
+}
+
 // EOCD record
 // offset 0: signature 0x06054b50, 4 bytes
 // offset 4: number of this disk, 2 bytes
@@ -831,10 +1009,43 @@ ImageChunk ZipModeImage::PseudoSource() const {
   return ImageChunk(CHUNK_NORMAL, 0, &file_content_, file_content_.size());
 }
 
+void ZipModeImage::IndexChunks() {
+  name_index_.clear();
+  for (size_t i = 0; i < chunks_.size(); i++) {
+    name_index_[chunks_[i].GetEntryName()].push_back(i);
+  }
+  indexed_chunks_ = chunks_.data();
+  indexed_size_ = chunks_.size();
+}
+
 const ImageChunk* ZipModeImage::FindChunkByName(const std::string& name, bool find_normal) const {
   if (name.empty()) {
     return nullptr;
   }
+
+  if (indexed_chunks_ == chunks_.data() && indexed_size_ == chunks_.size()) {
+    // The first chunk named |name|, or the one that only differs by a "-0" suffix, just as the
+    // scan below would find.
+    size_t found = chunks_.size();
+    auto find_first = [&](const std::string& key) {
+      auto it = name_index_.find(key);
+      if (it == name_index_.end()) return;
+      for (size_t i : it->second) {
+        if (i >= found) break;
+        if (find_normal || chunks_[i].GetType() == CHUNK_DEFLATE) {
+          found = i;
+          break;
+        }
+      }
+    };
+    find_first(name);
+    find_first(name + "-0");
+    if (android::base::EndsWith(name, "-0")) {
+      find_first(name.substr(0, name.size() - 2));
+    }
+    return found < chunks_.size() ? &chunks_[found] : nullptr;
+  }
+
   for (auto& chunk : chunks_) {
     if (chunk.GetType() != CHUNK_DEFLATE && !find_normal) {
       continue;
@@ -862,6 +1073,8 @@ ImageChunk* ZipModeImage::FindChunkByName(const std::string& name, bool find_nor
 }
 
 bool ZipModeImage::CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage* src_image) {
+  // The target chunks with a source to be diffed against, and their sources.
+  std::vector<std::pair<ImageChunk*, ImageChunk*>> pairs;
   for (auto& tgt_chunk : *tgt_image) {
     if (tgt_chunk.GetType() != CHUNK_DEFLATE) {
       continue;
@@ -877,14 +1090,34 @@ bool ZipModeImage::CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage*
       // trivial patch to the uncompressed data.
       tgt_chunk.ChangeDeflateChunkToNormal();
       src_chunk->ChangeDeflateChunkToNormal();
-    } else if (!tgt_chunk.ReconstructDeflateChunk()) {
+    } else {
+      pairs.emplace_back(&tgt_chunk, src_chunk);
+    }
+  }
+
+  // The target chunks are reconstructed on up to |jobs_| threads. The level that works for the
+  // first one is tried first for all the others, rather than the one of the previous chunk, so that
+  // the levels picked don't depend on the number of jobs.
+  int level_hint = 6;
+  std::vector<char> reconstructed(pairs.size());
+  if (!pairs.empty()) {
+    reconstructed[0] = pairs[0].first->ReconstructDeflateChunk(&level_hint);
+  }
+  RunInParallel(pairs.empty() ? 0 : pairs.size() - 1, tgt_image->jobs_, [&](size_t i) {
+    int hint = level_hint;
+    reconstructed[i + 1] = pairs[i + 1].first->ReconstructDeflateChunk(&hint);
+    return true;
+  });
+
+  for (size_t i = 0; i < pairs.size(); i++) {
+    if (!reconstructed[i]) {
       // We cannot recompress the data and get exactly the same bits as are in the input target
       // image. Treat the chunk as a normal non-deflated chunk.
-      LOG(WARNING) << "Failed to reconstruct target deflate chunk [" << tgt_chunk.GetEntryName()
-                   << "]; treating as normal";
+      LOG(WARNING) << "Failed to reconstruct target deflate chunk ["
+                   << pairs[i].first->GetEntryName() << "]; treating as normal";
 
-      tgt_chunk.ChangeDeflateChunkToNormal();
-      src_chunk->ChangeDeflateChunkToNormal();
+      pairs[i].first->ChangeDeflateChunkToNormal();
+      pairs[i].second->ChangeDeflateChunkToNormal();
     }
   }
 
@@ -892,20 +1125,32 @@ bool ZipModeImage::CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage*
   // filename, and normal chunks are patched using the entire source file as the source.
   if (tgt_image->limit_ == 0) {
     tgt_image->MergeAdjacentNormalChunks();
+    tgt_image->IndexChunks();
     tgt_image->DumpChunks();
   }
 
   return true;
 }
 
-// For each target chunk, look for the corresponding source chunk by the zip_entry name. If
-// found, add the range of this chunk in the original source file to the block aligned source
-// ranges. Construct the split src & tgt image once the size of source range reaches limit.
+// Returns the FNV-1a hash of |len| bytes at |data|.
+static uint64_t HashContent(const uint8_t* data, size_t len) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ data[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+// For each target chunk, look for the corresponding source chunk by the zip_entry name, or by
+// its content if the entry has been renamed. If found, add the range of this chunk in the original
+// source file to the block aligned source ranges. Construct the split src & tgt image once the
+// size of source range reaches limit.
 bool ZipModeImage::SplitZipModeImageWithLimit(const ZipModeImage& tgt_image,
                                               const ZipModeImage& src_image,
                                               std::vector<ZipModeImage>* split_tgt_images,
                                               std::vector<ZipModeImage>* split_src_images,
-                                              std::vector<SortedRangeSet>* split_src_ranges) {
+                                              std::vector<SortedRangeSet>* split_src_ranges,
+                                              size_t* unmatched_tgt_bytes) {
   CHECK_EQ(tgt_image.limit_, src_image.limit_);
   size_t limit = tgt_image.limit_;
 
@@ -920,14 +1165,51 @@ bool ZipModeImage::SplitZipModeImageWithLimit(const ZipModeImage& tgt_image,
   used_src_ranges.Insert(central_directory->GetStartOffset(),
                          central_directory->DataLengthForPatch());
 
+  // The source chunks by the hash of their raw data, which is only built if an entry can't be
+  // found by name. The central directory is left out.
+  std::unordered_multimap<uint64_t, const ImageChunk*> content_index;
+  bool content_indexed = false;
+  auto find_by_content = [&](const ImageChunk& tgt) -> const ImageChunk* {
+    if (tgt.GetEntryName().empty() || tgt.GetRawDataLength() == 0) {
+      return nullptr;
+    }
+    if (!content_indexed) {
+      for (auto src = src_image.cbegin(); src != central_directory; src++) {
+        content_index.emplace(HashContent(src_image.file_content_.data() + src->GetStartOffset(),
+                                          src->GetRawDataLength()),
+                              &*src);
+      }
+      content_indexed = true;
+    }
+    const uint8_t* data = tgt_image.file_content_.data() + tgt.GetStartOffset();
+    size_t len = tgt.GetRawDataLength();
+    auto candidates = content_index.equal_range(HashContent(data, len));
+    for (auto it = candidates.first; it != candidates.second; it++) {
+      const ImageChunk* src = it->second;
+      if (src->GetRawDataLength() == len &&
+          memcmp(src_image.file_content_.data() + src->GetStartOffset(), data, len) == 0) {
+        return src;
+      }
+    }
+    return nullptr;
+  };
+
   SortedRangeSet src_ranges;
   std::vector<ImageChunk> split_src_chunks;
   std::vector<ImageChunk> split_tgt_chunks;
   for (auto tgt = tgt_image.cbegin(); tgt != tgt_image.cend(); tgt++) {
     const ImageChunk* src = src_image.FindChunkByName(tgt->GetEntryName(), true);
+    bool renamed = false;
+    if (src == nullptr) {
+      src = find_by_content(*tgt);
+      renamed = src != nullptr;
+    }
     if (src == nullptr) {
       split_tgt_chunks.emplace_back(CHUNK_NORMAL, tgt->GetStartOffset(), &tgt_image.file_content_,
                                     tgt->GetRawDataLength());
+      if (unmatched_tgt_bytes != nullptr && !tgt->GetEntryName().empty()) {
+        *unmatched_tgt_bytes += tgt->GetRawDataLength();
+      }
       continue;
     }
 
@@ -942,11 +1224,15 @@ bool ZipModeImage::SplitZipModeImageWithLimit(const ZipModeImage& tgt_image,
     if (!RemoveUsedBlocks(&src_offset, &src_length, used_src_ranges)) {
       split_tgt_chunks.emplace_back(CHUNK_NORMAL, tgt->GetStartOffset(), &tgt_image.file_content_,
                                     tgt->GetRawDataLength());
+      if (unmatched_tgt_bytes != nullptr) {
+        *unmatched_tgt_bytes += tgt->GetRawDataLength();
+      }
     } else if (src_ranges.blocks() * BLOCK_SIZE + src_length <= limit) {
       src_ranges.Insert(src_offset, src_length);
 
-      // Add the deflate source chunk if it hasn't been aligned.
-      if (src->GetType() == CHUNK_DEFLATE && src_length == src->GetRawDataLength()) {
+      // Add the deflate source chunk if it hasn't been aligned. A renamed entry is diffed as a
+      // normal chunk, as the split source chunks are matched by name.
+      if (!renamed && src->GetType() == CHUNK_DEFLATE && src_length == src->GetRawDataLength()) {
         split_src_chunks.push_back(*src);
         split_tgt_chunks.push_back(*tgt);
       } else {
@@ -989,6 +1275,90 @@ bool ZipModeImage::SplitZipModeImageWithLimit(const ZipModeImage& tgt_image,
   return true;
 }
 
+bool DeviceProfile::Parse(const std::string& content) {
+  const std::map<std::string, size_t*> fields = {
+    { "memory_budget", &memory_budget }, { "read_rate", &read_rate },
+    { "split_ms", &split_ms },           { "split_bytes", &split_bytes },
+    { "bytes_per_second", &bytes_per_second },
+  };
+  for (const auto& line : android::base::Split(content, "\n")) {
+    std::string trimmed = android::base::Trim(line);
+    if (trimmed.empty() || trimmed[0] == '#') {
+      continue;
+    }
+    std::vector<std::string> pair = android::base::Split(trimmed, "=");
+    auto field = fields.find(android::base::Trim(pair[0]));
+    if (pair.size() != 2 || field == fields.end() ||
+        !android::base::ParseUint(android::base::Trim(pair[1]), field->second)) {
+      LOG(ERROR) << "Invalid device profile line: " << line;
+      return false;
+    }
+  }
+  if (memory_budget == 0 || read_rate == 0) {
+    LOG(ERROR) << "The device profile needs a memory budget and a read rate";
+    return false;
+  }
+  return true;
+}
+
+size_t ZipModeImage::ChooseBlockLimit(const std::string& src_name, const std::string& tgt_name,
+                                      const DeviceProfile& profile) {
+  // Applying a piece takes its source, and about as much again for its deflate chunks inflated and
+  // the target being written; the rest of the budget covers the inflation beyond that.
+  static constexpr size_t kApplyMemoryFactor = 4;
+  static constexpr size_t kMinBlocks = 16;
+  static constexpr size_t kMaxCandidates = 8;
+
+  size_t max_blocks = profile.memory_budget / (kApplyMemoryFactor * BLOCK_SIZE);
+  if (max_blocks < kMinBlocks) {
+    LOG(ERROR) << "Memory budget of " << profile.memory_budget << " bytes is too small to split by";
+    return 0;
+  }
+
+  size_t best_limit = 0;
+  double best_cost = 0;
+  for (size_t blocks = max_blocks, i = 0; blocks >= kMinBlocks && i < kMaxCandidates;
+       blocks /= 2, i++) {
+    // The splits only depend on the layout of the entries, so they're estimated without inflating.
+    ZipModeImage src_image(true, blocks * BLOCK_SIZE);
+    ZipModeImage tgt_image(false, blocks * BLOCK_SIZE);
+    src_image.layout_only_ = true;
+    tgt_image.layout_only_ = true;
+    if (!src_image.Initialize(src_name) || !tgt_image.Initialize(tgt_name)) {
+      return 0;
+    }
+
+    std::vector<ZipModeImage> split_tgt_images;
+    std::vector<ZipModeImage> split_src_images;
+    std::vector<SortedRangeSet> split_src_ranges;
+    size_t unmatched_bytes = 0;
+    if (!SplitZipModeImageWithLimit(tgt_image, src_image, &split_tgt_images, &split_src_images,
+                                    &split_src_ranges, &unmatched_bytes)) {
+      return 0;
+    }
+
+    size_t src_bytes = 0;
+    for (const auto& ranges : split_src_ranges) {
+      src_bytes += ranges.blocks() * BLOCK_SIZE;
+    }
+    size_t splits = split_tgt_images.size();
+    double seconds = static_cast<double>(src_bytes) / profile.read_rate +
+                     splits * profile.split_ms / 1000.0;
+    double cost = unmatched_bytes + static_cast<double>(splits) * profile.split_bytes +
+                  seconds * profile.bytes_per_second;
+    LOG(INFO) << "Block limit " << blocks << ": " << splits << " pieces, " << unmatched_bytes
+              << " bytes split from their source, " << seconds << " s to apply; cost " << cost;
+    if (best_limit == 0 || cost < best_cost) {
+      best_limit = blocks;
+      best_cost = cost;
+    }
+  }
+
+  LOG(INFO) << "Picked block limit " << best_limit << " for a memory budget of "
+            << profile.memory_budget << " bytes";
+  return best_limit;
+}
+
 bool ZipModeImage::AddSplitImageFromChunkList(const ZipModeImage& tgt_image,
                                               const ZipModeImage& src_image,
                                               const SortedRangeSet& split_src_ranges,
@@ -1043,8 +1413,8 @@ bool ZipModeImage::AddSplitImageFromChunkList(const ZipModeImage& tgt_image,
   std::vector<uint8_t> src_content;
   for (const auto& r : split_src_ranges) {
     size_t end = std::min(src_image.file_content_.size(), r.second * BLOCK_SIZE);
-    src_content.insert(src_content.end(), src_image.file_content_.begin() + r.first * BLOCK_SIZE,
-                       src_image.file_content_.begin() + end);
+    src_content.insert(src_content.end(), src_image.file_content_.data() + r.first * BLOCK_SIZE,
+                       src_image.file_content_.data() + end);
   }
 
   // We should not have an empty src in our design; otherwise we will encounter an error in
@@ -1097,53 +1467,67 @@ void ZipModeImage::ValidateSplitImages(const std::vector<ZipModeImage>& split_tg
 
 bool ZipModeImage::GeneratePatchesInternal(const ZipModeImage& tgt_image,
                                            const ZipModeImage& src_image,
-                                           std::vector<PatchChunk>* patch_chunks) {
+                                           std::vector<PatchChunk>* patch_chunks, size_t jobs,
+                                           SuffixArrayCache* sa_cache) {
   LOG(INFO) << "Constructing patches for " << tgt_image.NumOfChunks() << " chunks...";
   patch_chunks->clear();
 
-  bsdiff::SuffixArrayIndexInterface* bsdiff_cache = nullptr;
-  for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
-    const auto& tgt_chunk = tgt_image[i];
+  // The chunks are diffed in parallel into their own slots, and the patch chunks are assembled in
+  // order afterwards; so the output doesn't depend on the number of jobs. The workers share the
+  // suffix arrays in |sa_cache|, so the pseudo source in particular is only indexed once.
+  size_t num_chunks = tgt_image.NumOfChunks();
+  std::vector<std::vector<uint8_t>> patches(num_chunks);
+  std::vector<const ImageChunk*> src_chunks(num_chunks, nullptr);
+  ImageChunk pseudo_source = src_image.PseudoSource();
 
+  auto diff_chunk = [&](size_t i) {
+    const auto& tgt_chunk = tgt_image[i];
     if (PatchChunk::RawDataIsSmaller(tgt_chunk, 0)) {
-      patch_chunks->emplace_back(tgt_chunk);
-      continue;
+      return true;
     }
 
     const ImageChunk* src_chunk = (tgt_chunk.GetType() != CHUNK_DEFLATE)
                                       ? nullptr
                                       : src_image.FindChunkByName(tgt_chunk.GetEntryName());
 
-    const auto& src_ref = (src_chunk == nullptr) ? src_image.PseudoSource() : *src_chunk;
-    bsdiff::SuffixArrayIndexInterface** bsdiff_cache_ptr =
-        (src_chunk == nullptr) ? &bsdiff_cache : nullptr;
-
-    std::vector<uint8_t> patch_data;
-    if (!ImageChunk::MakePatch(tgt_chunk, src_ref, &patch_data, bsdiff_cache_ptr)) {
+    const auto& src_ref = (src_chunk == nullptr) ? pseudo_source : *src_chunk;
+    if (!ImageChunk::MakePatch(tgt_chunk, src_ref, &patches[i], sa_cache)) {
       LOG(ERROR) << "Failed to generate patch, name: " << tgt_chunk.GetEntryName();
       return false;
     }
+    src_chunks[i] = &src_ref;
 
-    LOG(INFO) << "patch " << i << " is " << patch_data.size() << " bytes (of "
+    LOG(INFO) << "patch " << i << " is " << patches[i].size() << " bytes (of "
               << tgt_chunk.GetRawDataLength() << ")";
+    return true;
+  };
+  if (!RunInParallel(num_chunks, jobs, diff_chunk)) {
+    return false;
+  }
 
-    if (PatchChunk::RawDataIsSmaller(tgt_chunk, patch_data.size())) {
+  for (size_t i = 0; i < num_chunks; i++) {
+    const auto& tgt_chunk = tgt_image[i];
+    if (src_chunks[i] == nullptr || PatchChunk::RawDataIsSmaller(tgt_chunk, patches[i].size())) {
       patch_chunks->emplace_back(tgt_chunk);
     } else {
-      patch_chunks->emplace_back(tgt_chunk, src_ref, std::move(patch_data));
+      patch_chunks->emplace_back(tgt_chunk, *src_chunks[i], std::move(patches[i]));
     }
   }
-  delete bsdiff_cache;
 
   CHECK_EQ(patch_chunks->size(), tgt_image.NumOfChunks());
   return true;
 }
 
 bool ZipModeImage::GeneratePatches(const ZipModeImage& tgt_image, const ZipModeImage& src_image,
-                                   const std::string& patch_name) {
+                                   const std::string& patch_name, size_t jobs,
+                                   SuffixArrayCache* sa_cache) {
   std::vector<PatchChunk> patch_chunks;
 
-  ZipModeImage::GeneratePatchesInternal(tgt_image, src_image, &patch_chunks);
+  SuffixArrayCache default_cache;
+  if (!ZipModeImage::GeneratePatchesInternal(tgt_image, src_image, &patch_chunks, jobs,
+                                             sa_cache != nullptr ? sa_cache : &default_cache)) {
+    return false;
+  }
 
   CHECK_EQ(tgt_image.NumOfChunks(), patch_chunks.size());
 
@@ -1162,7 +1546,8 @@ bool ZipModeImage::GeneratePatches(const std::vector<ZipModeImage>& split_tgt_im
                                    const std::vector<SortedRangeSet>& split_src_ranges,
                                    const std::string& patch_name,
                                    const std::string& split_info_file,
-                                   const std::string& debug_dir) {
+                                   const std::string& debug_dir, size_t jobs,
+                                   SuffixArrayCache* sa_cache) {
   LOG(INFO) << "Constructing patches for " << split_tgt_images.size() << " split images...";
 
   android::base::unique_fd patch_fd(
@@ -1172,14 +1557,27 @@ bool ZipModeImage::GeneratePatches(const std::vector<ZipModeImage>& split_tgt_im
     return false;
   }
 
+  // The splits are independent, so spread the jobs across them first and then across the chunks of
+  // each split. The patches are still written out in the split order.
+  size_t num_splits = split_tgt_images.size();
+  size_t split_jobs = std::max<size_t>(1, std::min(jobs, num_splits));
+  size_t chunk_jobs = std::max<size_t>(1, jobs / split_jobs);
+  std::vector<std::vector<PatchChunk>> split_patch_chunks(num_splits);
+  SuffixArrayCache default_cache;
+  if (sa_cache == nullptr) {
+    sa_cache = &default_cache;
+  }
+  if (!RunInParallel(num_splits, split_jobs, [&](size_t i) {
+        return ZipModeImage::GeneratePatchesInternal(split_tgt_images[i], split_src_images[i],
+                                                     &split_patch_chunks[i], chunk_jobs, sa_cache);
+      })) {
+    LOG(ERROR) << "Failed to generate split patch";
+    return false;
+  }
+
   std::vector<std::string> split_info_list;
-  for (size_t i = 0; i < split_tgt_images.size(); i++) {
-    std::vector<PatchChunk> patch_chunks;
-    if (!ZipModeImage::GeneratePatchesInternal(split_tgt_images[i], split_src_images[i],
-                                               &patch_chunks)) {
-      LOG(ERROR) << "Failed to generate split patch";
-      return false;
-    }
+  for (size_t i = 0; i < num_splits; i++) {
+    std::vector<PatchChunk> patch_chunks = std::move(split_patch_chunks[i]);
 
     size_t total_patch_size = 12;
     for (auto& p : patch_chunks) {
@@ -1275,7 +1673,7 @@ bool ImageModeImage::Initialize(const std::string& filename) {
       strm.zfree = Z_NULL;
       strm.opaque = Z_NULL;
       strm.avail_in = sz - pos;
-      strm.next_in = file_content_.data() + pos;
+      strm.next_in = const_cast<uint8_t*>(file_content_.data() + pos);
 
       // -15 means we are decoding a 'raw' deflate stream; zlib will
       // not expect zlib headers.
@@ -1392,6 +1790,7 @@ bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeI
     }
   }
 
+  int level_hint = 6;
   for (size_t i = 0; i < tgt_image->NumOfChunks(); ++i) {
     auto& tgt_chunk = (*tgt_image)[i];
     auto& src_chunk = (*src_image)[i];
@@ -1403,7 +1802,7 @@ bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeI
     if (tgt_chunk == src_chunk) {
       tgt_chunk.ChangeDeflateChunkToNormal();
       src_chunk.ChangeDeflateChunkToNormal();
-    } else if (!tgt_chunk.ReconstructDeflateChunk()) {
+    } else if (!tgt_chunk.ReconstructDeflateChunk(&level_hint)) {
       // We cannot recompress the data and get exactly the same bits as are in the input target
       // image, fall back to normal
       LOG(WARNING) << "Failed to reconstruct target deflate chunk " << i << " ["
@@ -1430,32 +1829,39 @@ bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeI
 // result to |patch_name|.
 bool ImageModeImage::GeneratePatches(const ImageModeImage& tgt_image,
                                      const ImageModeImage& src_image,
-                                     const std::string& patch_name) {
+                                     const std::string& patch_name, size_t jobs) {
   LOG(INFO) << "Constructing patches for " << tgt_image.NumOfChunks() << " chunks...";
-  std::vector<PatchChunk> patch_chunks;
-  patch_chunks.reserve(tgt_image.NumOfChunks());
-
-  for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
-    const auto& tgt_chunk = tgt_image[i];
-    const auto& src_chunk = src_image[i];
-
-    if (PatchChunk::RawDataIsSmaller(tgt_chunk, 0)) {
-      patch_chunks.emplace_back(tgt_chunk);
-      continue;
-    }
+  size_t num_chunks = tgt_image.NumOfChunks();
+  std::vector<std::vector<uint8_t>> patches(num_chunks);
+  // Not a vector<bool>, whose elements can't be written concurrently.
+  std::vector<uint8_t> diffed(num_chunks, 0);
+
+  if (!RunInParallel(num_chunks, jobs, [&](size_t i) {
+        const auto& tgt_chunk = tgt_image[i];
+        if (PatchChunk::RawDataIsSmaller(tgt_chunk, 0)) {
+          return true;
+        }
 
-    std::vector<uint8_t> patch_data;
-    if (!ImageChunk::MakePatch(tgt_chunk, src_chunk, &patch_data, nullptr)) {
-      LOG(ERROR) << "Failed to generate patch for target chunk " << i;
-      return false;
-    }
-    LOG(INFO) << "patch " << i << " is " << patch_data.size() << " bytes (of "
-              << tgt_chunk.GetRawDataLength() << ")";
+        if (!ImageChunk::MakePatch(tgt_chunk, src_image[i], &patches[i], nullptr)) {
+          LOG(ERROR) << "Failed to generate patch for target chunk " << i;
+          return false;
+        }
+        diffed[i] = 1;
+        LOG(INFO) << "patch " << i << " is " << patches[i].size() << " bytes (of "
+                  << tgt_chunk.GetRawDataLength() << ")";
+        return true;
+      })) {
+    return false;
+  }
 
-    if (PatchChunk::RawDataIsSmaller(tgt_chunk, patch_data.size())) {
+  std::vector<PatchChunk> patch_chunks;
+  patch_chunks.reserve(num_chunks);
+  for (size_t i = 0; i < num_chunks; i++) {
+    const auto& tgt_chunk = tgt_image[i];
+    if (!diffed[i] || PatchChunk::RawDataIsSmaller(tgt_chunk, patches[i].size())) {
       patch_chunks.emplace_back(tgt_chunk);
     } else {
-      patch_chunks.emplace_back(tgt_chunk, src_chunk, std::move(patch_data));
+      patch_chunks.emplace_back(tgt_chunk, src_image[i], std::move(patches[i]));
     }
   }
 
@@ -1478,12 +1884,15 @@ int imgdiff(int argc, const char** argv) {
   size_t blocks_limit = 0;
   std::string split_info_file;
   std::string debug_dir;
+  size_t jobs = 1;
+  size_t sa_cache_limit = SuffixArrayCache::kDefaultLimit;
+  std::string device_profile_file;
 
   int opt;
   int option_index;
   optind = 0;  // Reset the getopt state so that we can call it multiple times for test.
 
-  while ((opt = getopt_long(argc, const_cast<char**>(argv), "zb:v", OPTIONS, &option_index)) !=
+  while ((opt = getopt_long(argc, const_cast<char**>(argv), "zb:j:v", OPTIONS, &option_index)) !=
          -1) {
     switch (opt) {
       case 'z':
@@ -1509,6 +1918,12 @@ int imgdiff(int argc, const char** argv) {
         }
         break;
       }
+      case 'j':
+        if (!android::base::ParseUint(optarg, &jobs) || jobs == 0) {
+          LOG(ERROR) << "Failed to parse the number of jobs: " << optarg;
+          return 1;
+        }
+        break;
       case 'v':
         verbose = true;
         break;
@@ -1517,10 +1932,18 @@ int imgdiff(int argc, const char** argv) {
         if (name == "block-limit" && !android::base::ParseUint(optarg, &blocks_limit)) {
           LOG(ERROR) << "Failed to parse size blocks_limit: " << optarg;
           return 1;
+        } else if (name == "sa-cache-limit") {
+          if (!android::base::ParseUint(optarg, &sa_cache_limit)) {
+            LOG(ERROR) << "Failed to parse the suffix array cache limit: " << optarg;
+            return 1;
+          }
+          sa_cache_limit *= 1024 * 1024;
         } else if (name == "split-info") {
           split_info_file = optarg;
         } else if (name == "debug-dir") {
           debug_dir = optarg;
+        } else if (name == "device-profile") {
+          device_profile_file = optarg;
         }
         break;
       }
@@ -1539,6 +1962,8 @@ int imgdiff(int argc, const char** argv) {
     LOG(ERROR)
         << "  -z <zip-mode>,    Generate patches in zip mode, src and tgt should be zip files.\n"
            "  -b <bonus-file>,  Bonus file in addition to src, image mode only.\n"
+           "  -j, --jobs,       Number of threads to compute the chunk (and split) patches with;\n"
+           "                    the output is identical for any value. Defaults to 1.\n"
            "  --block-limit,    For large zips, split the src and tgt based on the block limit;\n"
            "                    and generate patches between each pair of pieces. Concatenate "
            "these\n"
@@ -1546,13 +1971,34 @@ int imgdiff(int argc, const char** argv) {
            "  --split-info,     Output the split information (patch_size, tgt_size, src_ranges);\n"
            "                    zip mode with block-limit only.\n"
            "  --debug-dir,      Debug directory to put the split srcs and patches, zip mode only.\n"
+           "  --sa-cache-limit, Size limit in MiB of the cached suffix arrays of the sources,\n"
+           "                    zip mode only. Defaults to 1024.\n"
+           "  --device-profile, Pick the block limit for the memory and rates of the devices in\n"
+           "                    the given profile, unless --block-limit is given; zip mode only.\n"
            "  -v, --verbose,    Enable verbose logging.";
     return 2;
   }
 
   if (zip_mode) {
-    ZipModeImage src_image(true, blocks_limit * BLOCK_SIZE);
-    ZipModeImage tgt_image(false, blocks_limit * BLOCK_SIZE);
+    if (blocks_limit == 0 && !device_profile_file.empty()) {
+      std::string content;
+      DeviceProfile profile;
+      if (!android::base::ReadFileToString(device_profile_file, &content)) {
+        PLOG(ERROR) << "Failed to read device profile " << device_profile_file;
+        return 1;
+      }
+      if (!profile.Parse(content)) {
+        return 1;
+      }
+      blocks_limit = ZipModeImage::ChooseBlockLimit(argv[optind], argv[optind + 1], profile);
+      if (blocks_limit == 0) {
+        return 1;
+      }
+    }
+
+    SuffixArrayCache sa_cache(sa_cache_limit);
+    ZipModeImage src_image(true, blocks_limit * BLOCK_SIZE, jobs);
+    ZipModeImage tgt_image(false, blocks_limit * BLOCK_SIZE, jobs);
 
     if (!src_image.Initialize(argv[optind])) {
       return 1;
@@ -1580,11 +2026,13 @@ int imgdiff(int argc, const char** argv) {
                                                &split_src_images, &split_src_ranges);
 
       if (!ZipModeImage::GeneratePatches(split_tgt_images, split_src_images, split_src_ranges,
-                                         argv[optind + 2], split_info_file, debug_dir)) {
+                                         argv[optind + 2], split_info_file, debug_dir, jobs,
+                                         &sa_cache)) {
         return 1;
       }
 
-    } else if (!ZipModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2])) {
+    } else if (!ZipModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2], jobs,
+                                              &sa_cache)) {
       return 1;
     }
   } else {
@@ -1606,7 +2054,7 @@ int imgdiff(int argc, const char** argv) {
       return 1;
     }
 
-    if (!ImageModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2])) {
+    if (!ImageModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2], jobs)) {
       return 1;
     }
   }
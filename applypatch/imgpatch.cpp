@@ -26,8 +26,14 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <future>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <android-base/logging.h>
@@ -38,6 +44,7 @@
 #include <zlib.h>
 
 #include "edify/expr.h"
+#include "otautil/thread_pool.h"
 
 static inline int64_t Read8(const void *address) {
   return android::base::get_unaligned<int64_t>(address);
@@ -47,10 +54,310 @@ static inline int32_t Read4(const void *address) {
   return android::base::get_unaligned<int32_t>(address);
 }
 
+// Deflate chunks that expand beyond this size are inflated on demand, instead of as a whole.
+static constexpr size_t kInflateOnDemandThreshold = 8 * 1024 * 1024;
+
+// Deflate chunks that expand beyond this size are patched and recompressed on worker threads, on up
+// to kMaxDeflateJobs of them.
+static constexpr size_t kParallelDeflateThreshold = 1024 * 1024;
+static constexpr unsigned int kMaxDeflateJobs = 4;
+
+namespace {
+
+// InflatedSource gives random access to the inflated data of a deflate chunk (followed by the
+// optional bonus data), while keeping only a bounded part of it in memory. An initial pass records
+// an access point at the deflate block boundaries about every span of output, together with the
+// 32 KiB window needed to resume inflating from there. Reads then inflate the spans they touch,
+// and keep the few most recently used ones.
+class InflatedSource {
+ public:
+  InflatedSource(const unsigned char* data, size_t len, size_t inflated_len,
+                 const unsigned char* bonus, size_t bonus_len)
+      : data_(data),
+        len_(len),
+        inflated_len_(inflated_len),
+        bonus_(bonus),
+        bonus_len_(bonus_len),
+        span_(std::max(kMinSpan, inflated_len / kMaxAccessPoints)) {}
+
+  // Inflates the chunk once to build the access points, and checks that it has the expected size.
+  bool Init();
+
+  bool Read(size_t offset, unsigned char* buffer, size_t length);
+
+  size_t size() const {
+    return inflated_len_ + bonus_len_;
+  }
+
+ private:
+  static constexpr size_t kMinSpan = 1024 * 1024;
+  static constexpr size_t kMaxAccessPoints = 256;
+  static constexpr size_t kCachedSpans = 4;
+
+  struct AccessPoint {
+    size_t out;  // offset in the inflated data
+    size_t in;   // offset of the first full byte in the compressed data
+    int bits;    // number of bits (1-7) of the previous byte that belong to the block, or 0
+    std::vector<unsigned char> window;
+  };
+
+  // Returns the inflated data of the span that starts at access point |index|.
+  const std::vector<unsigned char>* GetSpan(size_t index);
+
+  const unsigned char* data_;
+  size_t len_;
+  size_t inflated_len_;
+  const unsigned char* bonus_;
+  size_t bonus_len_;
+  size_t span_;
+
+  std::vector<AccessPoint> points_;
+  // The decoded spans, most recently used first.
+  std::list<std::pair<size_t, std::vector<unsigned char>>> spans_;
+};
+
+bool InflatedSource::Init() {
+  z_stream strm;
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+  strm.avail_in = len_;
+  strm.next_in = const_cast<unsigned char*>(data_);
+  int ret = inflateInit2(&strm, -15);
+  if (ret != Z_OK) {
+    printf("failed to init source inflation: %d\n", ret);
+    return false;
+  }
+
+  points_.push_back({ 0, 0, 0, {} });
+  std::vector<unsigned char> buffer(32768);
+  do {
+    strm.avail_out = buffer.size();
+    strm.next_out = buffer.data();
+    // Stop at the block boundaries, where the access points can be added.
+    ret = inflate(&strm, Z_BLOCK);
+    if (ret != Z_OK && ret != Z_STREAM_END) {
+      printf("source inflation returned %d\n", ret);
+      inflateEnd(&strm);
+      return false;
+    }
+    if (strm.total_out > inflated_len_) {
+      printf("source inflation exceeds %zu bytes\n", inflated_len_);
+      inflateEnd(&strm);
+      return false;
+    }
+
+    bool block_end = (strm.data_type & 128) != 0 && (strm.data_type & 64) == 0;
+    if (ret != Z_STREAM_END && block_end && strm.total_out - points_.back().out >= span_) {
+      AccessPoint point{ strm.total_out, strm.total_in, strm.data_type & 7,
+                         std::vector<unsigned char>(32768) };
+      unsigned int window_len = point.window.size();
+      if (inflateGetDictionary(&strm, point.window.data(), &window_len) != Z_OK) {
+        printf("failed to get the inflation window\n");
+        inflateEnd(&strm);
+        return false;
+      }
+      point.window.resize(window_len);
+      points_.push_back(std::move(point));
+    }
+  } while (ret != Z_STREAM_END);
+
+  size_t total_out = strm.total_out;
+  inflateEnd(&strm);
+  if (total_out != inflated_len_) {
+    printf("source inflation short by %zu bytes\n", inflated_len_ - total_out);
+    return false;
+  }
+  return true;
+}
+
+const std::vector<unsigned char>* InflatedSource::GetSpan(size_t index) {
+  for (auto it = spans_.begin(); it != spans_.end(); it++) {
+    if (it->first == index) {
+      spans_.splice(spans_.begin(), spans_, it);
+      return &spans_.front().second;
+    }
+  }
+
+  const AccessPoint& point = points_[index];
+  size_t end = (index + 1 < points_.size()) ? points_[index + 1].out : inflated_len_;
+
+  std::vector<unsigned char> span;
+  if (spans_.size() >= kCachedSpans) {
+    // Recycle the buffer of the least recently used span.
+    span = std::move(spans_.back().second);
+    spans_.pop_back();
+  }
+  span.resize(end - point.out);
+
+  z_stream strm;
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+  strm.avail_in = len_ - point.in;
+  strm.next_in = const_cast<unsigned char*>(data_ + point.in);
+  int ret = inflateInit2(&strm, -15);
+  if (ret != Z_OK) {
+    printf("failed to init source inflation: %d\n", ret);
+    return nullptr;
+  }
+  if (point.bits != 0) {
+    ret = inflatePrime(&strm, point.bits, data_[point.in - 1] >> (8 - point.bits));
+  }
+  if (ret == Z_OK && !point.window.empty()) {
+    ret = inflateSetDictionary(&strm, point.window.data(), point.window.size());
+  }
+  if (ret != Z_OK) {
+    printf("failed to resume source inflation at %zu: %d\n", point.out, ret);
+    inflateEnd(&strm);
+    return nullptr;
+  }
+
+  strm.avail_out = span.size();
+  strm.next_out = span.data();
+  while (strm.avail_out != 0) {
+    ret = inflate(&strm, Z_NO_FLUSH);
+    if (ret != Z_OK) {
+      break;
+    }
+  }
+  inflateEnd(&strm);
+  if (strm.avail_out != 0) {
+    printf("source inflation at %zu returned %d\n", point.out, ret);
+    return nullptr;
+  }
+
+  spans_.emplace_front(index, std::move(span));
+  return &spans_.front().second;
+}
+
+bool InflatedSource::Read(size_t offset, unsigned char* buffer, size_t length) {
+  if (offset + length > size()) {
+    return false;
+  }
+
+  while (length > 0 && offset < inflated_len_) {
+    // Find the span that covers |offset|.
+    auto it = std::upper_bound(points_.begin(), points_.end(), offset,
+                               [](size_t value, const AccessPoint& p) { return value < p.out; });
+    size_t index = std::distance(points_.begin(), it) - 1;
+    const std::vector<unsigned char>* span = GetSpan(index);
+    if (span == nullptr) {
+      return false;
+    }
+
+    size_t skip = offset - points_[index].out;
+    size_t count = std::min(length, span->size() - skip);
+    memcpy(buffer, span->data() + skip, count);
+    buffer += count;
+    offset += count;
+    length -= count;
+  }
+
+  if (length > 0) {
+    memcpy(buffer, bonus_ + (offset - inflated_len_), length);
+  }
+  return true;
+}
+
+// Keeps the inflated source of the recently patched deflate chunks, so that the patches sharing a
+// source chunk (e.g. those of a split image, or of several commands moving the same file) inflate
+// it once. A chunk is identified by the SHA-1 of its deflated data and its inflated length, so it
+// doesn't matter where the source is read from. The least recently used chunks are evicted to keep
+// the cache within its budget.
+class InflateCache {
+ public:
+  using Data = std::shared_ptr<const std::vector<unsigned char>>;
+
+  static InflateCache& Get() {
+    static InflateCache cache;
+    return cache;
+  }
+
+  void SetBudget(size_t budget) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    budget_ = budget;
+    Evict();
+  }
+
+  bool enabled() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return budget_ > 0;
+  }
+
+  size_t hits() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return hits_;
+  }
+
+  static std::string Key(const unsigned char* data, size_t len, size_t inflated_len) {
+    SHA_CTX ctx;
+    SHA1_Init(&ctx);
+    SHA1_Update(&ctx, data, len);
+    std::string key(SHA_DIGEST_LENGTH + sizeof(inflated_len), '\0');
+    SHA1_Final(reinterpret_cast<uint8_t*>(&key[0]), &ctx);
+    memcpy(&key[SHA_DIGEST_LENGTH], &inflated_len, sizeof(inflated_len));
+    return key;
+  }
+
+  Data Find(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+      return nullptr;
+    }
+    hits_++;
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return it->second->second;
+  }
+
+  void Insert(const std::string& key, Data data) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (data->size() > budget_ || index_.find(key) != index_.end()) {
+      return;
+    }
+    size_ += data->size();
+    entries_.emplace_front(key, std::move(data));
+    index_.emplace(key, entries_.begin());
+    Evict();
+  }
+
+ private:
+  InflateCache() = default;
+
+  // Drops the least recently used chunks until the rest fit in the budget.
+  void Evict() {
+    while (size_ > budget_) {
+      size_ -= entries_.back().second->size();
+      index_.erase(entries_.back().first);
+      entries_.pop_back();
+    }
+  }
+
+  std::mutex mutex_;
+  size_t budget_ = 0;
+  size_t size_ = 0;
+  size_t hits_ = 0;
+  // Most recently used first.
+  std::list<std::pair<std::string, Data>> entries_;
+  std::map<std::string, std::list<std::pair<std::string, Data>>::iterator> index_;
+};
+
+}  // namespace
+
+void SetInflateCacheBudget(size_t bytes) {
+  InflateCache::Get().SetBudget(bytes);
+}
+
+size_t InflateCacheHits() {
+  return InflateCache::Get().hits();
+}
+
 // This function is a wrapper of ApplyBSDiffPatch(). It has a custom sink function to deflate the
-// patched data and stream the deflated data to output.
-static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_len,
-                                            const Value& patch, size_t patch_offset,
+// patched data and stream the deflated data to output. The source data is read through |source| if
+// |src_data| is nullptr.
+static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, const SourceFn& source,
+                                            size_t src_len, const Value& patch, size_t patch_offset,
                                             const char* deflate_header, SinkFn sink, SHA_CTX* ctx) {
   size_t expected_target_length = static_cast<size_t>(Read8(deflate_header + 32));
   int level = Read4(deflate_header + 40);
@@ -76,13 +383,13 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
   size_t actual_target_length = 0;
   size_t total_written = 0;
   static constexpr size_t buffer_size = 32768;
+  std::vector<uint8_t> buffer(buffer_size);
   auto compression_sink = [&strm, &actual_target_length, &expected_target_length, &total_written,
-                           &ret, &ctx, &sink](const uint8_t* data, size_t len) -> size_t {
+                           &ret, &ctx, &sink, &buffer](const uint8_t* data, size_t len) -> size_t {
     // The input patch length for an update never exceeds INT_MAX.
     strm.avail_in = len;
     strm.next_in = data;
     do {
-      std::vector<uint8_t> buffer(buffer_size);
       strm.avail_out = buffer_size;
       strm.next_out = buffer.data();
       if (actual_target_length + len < expected_target_length) {
@@ -110,7 +417,10 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
   };
 
   int bspatch_result =
-      ApplyBSDiffPatch(src_data, src_len, patch, patch_offset, compression_sink, nullptr);
+      (src_data != nullptr)
+          ? ApplyBSDiffPatch(src_data, src_len, patch, patch_offset, compression_sink, nullptr)
+          : ApplyBSDiffPatchFromSource(source, src_len, patch, patch_offset, compression_sink,
+                                       nullptr);
   deflateEnd(&strm);
 
   if (bspatch_result != 0) {
@@ -132,32 +442,220 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
   return true;
 }
 
+// Applies the patch of the deflate chunk with the given header: inflates the source, applies the
+// bsdiff patch and recompresses the result to |sink|. |bonus| (of |bonus_size| bytes) is appended
+// to the inflated source.
+static bool ApplyDeflateChunk(const unsigned char* old_data, size_t old_size, const Value& patch,
+                              const char* deflate_header, const unsigned char* bonus,
+                              size_t bonus_size, SinkFn sink, SHA_CTX* ctx) {
+  size_t src_start = static_cast<size_t>(Read8(deflate_header));
+  size_t src_len = static_cast<size_t>(Read8(deflate_header + 8));
+  size_t patch_offset = static_cast<size_t>(Read8(deflate_header + 16));
+  size_t expanded_len = static_cast<size_t>(Read8(deflate_header + 24));
+
+  if (src_start + src_len > old_size) {
+    printf("source data too short\n");
+    return false;
+  }
+
+  // Decompress the source data; the chunk header tells us exactly
+  // how big we expect it to be when decompressed (including the bonus data).
+  if (bonus_size > expanded_len) {
+    printf("bonus data exceeds the expanded source\n");
+    return false;
+  }
+
+  // Large chunks (e.g. the ramdisk of a boot image) are inflated on demand as bspatch reads
+  // them, so that the memory to apply the patch doesn't grow with the chunk size.
+  if (expanded_len > kInflateOnDemandThreshold) {
+    InflatedSource inflated(old_data + src_start, src_len, expanded_len - bonus_size, bonus,
+                            bonus_size);
+    if (!inflated.Init()) {
+      return false;
+    }
+    SourceFn source = [&inflated](size_t offset, unsigned char* buffer, size_t length) {
+      return inflated.Read(offset, buffer, length);
+    };
+    if (!ApplyBSDiffPatchAndStreamOutput(nullptr, source, expanded_len, patch, patch_offset,
+                                         deflate_header, sink, ctx)) {
+      LOG(ERROR) << "Fail to apply streaming bspatch.";
+      return false;
+    }
+    return true;
+  }
+
+  // The chunks without bonus data are looked up in the cache of the inflated sources.
+  InflateCache& cache = InflateCache::Get();
+  std::string cache_key;
+  InflateCache::Data cached;
+  if (bonus_size == 0 && expanded_len != 0 && cache.enabled()) {
+    cache_key = InflateCache::Key(old_data + src_start, src_len, expanded_len);
+    cached = cache.Find(cache_key);
+  }
+  if (cached != nullptr) {
+    if (!ApplyBSDiffPatchAndStreamOutput(cached->data(), nullptr, expanded_len, patch, patch_offset,
+                                         deflate_header, sink, ctx)) {
+      LOG(ERROR) << "Fail to apply streaming bspatch.";
+      return false;
+    }
+    return true;
+  }
+
+  auto expanded = std::make_shared<std::vector<unsigned char>>(expanded_len);
+  std::vector<unsigned char>& expanded_source = *expanded;
+
+  // inflate() doesn't like strm.next_out being a nullptr even with
+  // avail_out being zero (Z_STREAM_ERROR).
+  if (expanded_len != 0) {
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = src_len;
+    strm.next_in = old_data + src_start;
+    strm.avail_out = expanded_len;
+    strm.next_out = expanded_source.data();
+
+    int ret = inflateInit2(&strm, -15);
+    if (ret != Z_OK) {
+      printf("failed to init source inflation: %d\n", ret);
+      return false;
+    }
+
+    // Because we've provided enough room to accommodate the output
+    // data, we expect one call to inflate() to suffice.
+    ret = inflate(&strm, Z_SYNC_FLUSH);
+    if (ret != Z_STREAM_END) {
+      printf("source inflation returned %d\n", ret);
+      return false;
+    }
+    // We should have filled the output buffer exactly, except
+    // for the bonus_size.
+    if (strm.avail_out != bonus_size) {
+      printf("source inflation short by %zu bytes\n", strm.avail_out - bonus_size);
+      return false;
+    }
+    inflateEnd(&strm);
+
+    if (bonus_size) {
+      memcpy(expanded_source.data() + (expanded_len - bonus_size), bonus, bonus_size);
+    }
+  }
+  if (!cache_key.empty()) {
+    cache.Insert(cache_key, expanded);
+  }
+
+  if (!ApplyBSDiffPatchAndStreamOutput(expanded_source.data(), nullptr, expanded_len, patch,
+                                       patch_offset, deflate_header, sink, ctx)) {
+    LOG(ERROR) << "Fail to apply streaming bspatch.";
+    return false;
+  }
+  return true;
+}
+
+// Returns the index and header of each deflate chunk in |patch| that expands beyond |threshold|.
+// The patch is assumed to be well formed; the scan just stops at anything malformed.
+static std::vector<std::pair<int, const char*>> FindLargeDeflateChunks(const Value& patch,
+                                                                      size_t threshold) {
+  std::vector<std::pair<int, const char*>> chunks;
+  const char* const patch_header = patch.bytes();
+  int num_chunks = Read4(patch_header + 8);
+  size_t pos = 12;
+  for (int i = 0; i < num_chunks && pos + 4 <= patch.size(); ++i) {
+    int type = Read4(patch_header + pos);
+    pos += 4;
+    if (type == CHUNK_NORMAL) {
+      pos += 24;
+    } else if (type == CHUNK_RAW) {
+      if (pos + 4 > patch.size()) {
+        break;
+      }
+      pos += 4 + static_cast<size_t>(Read4(patch_header + pos));
+    } else if (type == CHUNK_DEFLATE) {
+      if (pos + 60 > patch.size()) {
+        break;
+      }
+      if (static_cast<size_t>(Read8(patch_header + pos + 24)) > threshold) {
+        chunks.emplace_back(i, patch_header + pos);
+      }
+      pos += 60;
+    } else {
+      break;
+    }
+  }
+  return chunks;
+}
+
 int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const unsigned char* patch_data,
                     size_t patch_size, SinkFn sink) {
-  Value patch(VAL_BLOB, std::string(reinterpret_cast<const char*>(patch_data), patch_size));
+  Value patch(patch_data, patch_size);
   return ApplyImagePatch(old_data, old_size, patch, sink, nullptr, nullptr);
 }
 
 int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
                     SHA_CTX* ctx, const Value* bonus_data) {
-  if (patch.data.size() < 12) {
+  if (patch.size() < 12) {
     printf("patch too short to contain header\n");
     return -1;
   }
 
   // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW. (IMGDIFF1, which is no longer
   // supported, used CHUNK_NORMAL and CHUNK_GZIP.)
-  const char* const patch_header = patch.data.data();
+  const char* const patch_header = patch.bytes();
   if (memcmp(patch_header, "IMGDIFF2", 8) != 0) {
     printf("corrupt patch file header (magic number)\n");
     return -1;
   }
 
+  // Recompressing the patched data is what dominates applying the large deflate chunks. When there
+  // are several of them, they're patched ahead on the shared thread pool into buffers that are
+  // passed to the sink in order. Each chunk has its own deflate stream, so the output is just the
+  // same.
+  std::vector<std::pair<int, const char*>> large_chunks =
+      FindLargeDeflateChunks(patch, kParallelDeflateThreshold);
+  ThreadPool& pool = ThreadPool::Shared();
+  size_t jobs = 0;
+  if (large_chunks.size() > 1) {
+    jobs = std::max<size_t>(1, std::min<size_t>(pool.size(), kMaxDeflateJobs));
+  }
+  // The pending recompressions refer to |patch|, so they're waited for on every return path.
+  struct Recompressions : std::map<int, std::future<std::unique_ptr<std::string>>> {
+    ~Recompressions() {
+      for (auto& recompression : *this) {
+        ThreadPool::Shared().Await(recompression.second);
+      }
+    }
+  } recompressions;
+  size_t next_large_chunk = 0;
+  auto launch_recompressions = [&]() {
+    while (next_large_chunk < large_chunks.size() && recompressions.size() < jobs) {
+      int index = large_chunks[next_large_chunk].first;
+      const char* deflate_header = large_chunks[next_large_chunk].second;
+      next_large_chunk++;
+      size_t bonus_size = (index == 1 && bonus_data != NULL) ? bonus_data->size() : 0;
+      const unsigned char* bonus =
+          bonus_size ? reinterpret_cast<const unsigned char*>(bonus_data->bytes()) : nullptr;
+      recompressions.emplace(index, pool.Async([=, &patch]() -> std::unique_ptr<std::string> {
+        auto output = std::make_unique<std::string>();
+        auto buffer_sink = [&output](const unsigned char* data, size_t len) {
+          output->append(reinterpret_cast<const char*>(data), len);
+          return len;
+        };
+        if (!ApplyDeflateChunk(old_data, old_size, patch, deflate_header, bonus, bonus_size,
+                               buffer_sink, nullptr)) {
+          return nullptr;
+        }
+        return output;
+      }));
+    }
+  };
+  launch_recompressions();
+
   int num_chunks = Read4(patch_header + 8);
   size_t pos = 12;
   for (int i = 0; i < num_chunks; ++i) {
     // each chunk's header record starts with 4 bytes.
-    if (pos + 4 > patch.data.size()) {
+    if (pos + 4 > patch.size()) {
       printf("failed to read chunk %d record\n", i);
       return -1;
     }
@@ -167,7 +665,7 @@ int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value&
     if (type == CHUNK_NORMAL) {
       const char* normal_header = patch_header + pos;
       pos += 24;
-      if (pos > patch.data.size()) {
+      if (pos > patch.size()) {
         printf("failed to read chunk %d normal header data\n", i);
         return -1;
       }
@@ -187,14 +685,14 @@ int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value&
     } else if (type == CHUNK_RAW) {
       const char* raw_header = patch_header + pos;
       pos += 4;
-      if (pos > patch.data.size()) {
+      if (pos > patch.size()) {
         printf("failed to read chunk %d raw header data\n", i);
         return -1;
       }
 
       size_t data_len = static_cast<size_t>(Read4(raw_header));
 
-      if (pos + data_len > patch.data.size()) {
+      if (pos + data_len > patch.size()) {
         printf("failed to read chunk %d raw data\n", i);
         return -1;
       }
@@ -210,77 +708,42 @@ int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value&
       // deflate chunks have an additional 60 bytes in their chunk header.
       const char* deflate_header = patch_header + pos;
       pos += 60;
-      if (pos > patch.data.size()) {
+      if (pos > patch.size()) {
         printf("failed to read chunk %d deflate header data\n", i);
         return -1;
       }
 
-      size_t src_start = static_cast<size_t>(Read8(deflate_header));
-      size_t src_len = static_cast<size_t>(Read8(deflate_header + 8));
-      size_t patch_offset = static_cast<size_t>(Read8(deflate_header + 16));
-      size_t expanded_len = static_cast<size_t>(Read8(deflate_header + 24));
-
-      if (src_start + src_len > old_size) {
-        printf("source data too short\n");
-        return -1;
-      }
-
-      // Decompress the source data; the chunk header tells us exactly
-      // how big we expect it to be when decompressed.
-
-      // Note: expanded_len will include the bonus data size if
-      // the patch was constructed with bonus data.  The
-      // deflation will come up 'bonus_size' bytes short; these
-      // must be appended from the bonus_data value.
-      size_t bonus_size = (i == 1 && bonus_data != NULL) ? bonus_data->data.size() : 0;
-
-      std::vector<unsigned char> expanded_source(expanded_len);
-
-      // inflate() doesn't like strm.next_out being a nullptr even with
-      // avail_out being zero (Z_STREAM_ERROR).
-      if (expanded_len != 0) {
-        z_stream strm;
-        strm.zalloc = Z_NULL;
-        strm.zfree = Z_NULL;
-        strm.opaque = Z_NULL;
-        strm.avail_in = src_len;
-        strm.next_in = old_data + src_start;
-        strm.avail_out = expanded_len;
-        strm.next_out = expanded_source.data();
-
-        int ret = inflateInit2(&strm, -15);
-        if (ret != Z_OK) {
-          printf("failed to init source inflation: %d\n", ret);
+      // Note: expanded_len will include the bonus data size if the patch was constructed with bonus
+      // data. The deflation will come up 'bonus_size' bytes short; these must be appended from the
+      // bonus_data value.
+      size_t bonus_size = (i == 1 && bonus_data != NULL) ? bonus_data->size() : 0;
+      const unsigned char* bonus =
+          bonus_size ? reinterpret_cast<const unsigned char*>(bonus_data->bytes()) : nullptr;
+
+      auto recompression = recompressions.find(i);
+      if (recompression == recompressions.end()) {
+        if (!ApplyDeflateChunk(old_data, old_size, patch, deflate_header, bonus, bonus_size, sink,
+                               ctx)) {
           return -1;
         }
-
-        // Because we've provided enough room to accommodate the output
-        // data, we expect one call to inflate() to suffice.
-        ret = inflate(&strm, Z_SYNC_FLUSH);
-        if (ret != Z_STREAM_END) {
-          printf("source inflation returned %d\n", ret);
-          return -1;
-        }
-        // We should have filled the output buffer exactly, except
-        // for the bonus_size.
-        if (strm.avail_out != bonus_size) {
-          printf("source inflation short by %zu bytes\n", strm.avail_out - bonus_size);
-          return -1;
-        }
-        inflateEnd(&strm);
-
-        if (bonus_size) {
-          memcpy(expanded_source.data() + (expanded_len - bonus_size), &bonus_data->data[0],
-                 bonus_size);
-        }
+        continue;
       }
 
-      if (!ApplyBSDiffPatchAndStreamOutput(expanded_source.data(), expanded_len, patch,
-                                           patch_offset, deflate_header, sink, ctx)) {
-        LOG(ERROR) << "Fail to apply streaming bspatch.";
+      // The chunk has been patched ahead on the pool; pass on its output.
+      std::unique_ptr<std::string> output = pool.Await(recompression->second);
+      recompressions.erase(recompression);
+      if (output == nullptr) {
         return -1;
       }
-
+      if (ctx) {
+        SHA1_Update(ctx, output->data(), output->size());
+      }
+      if (sink(reinterpret_cast<const unsigned char*>(output->data()), output->size()) !=
+          output->size()) {
+        printf("failed to write chunk %d deflate data\n", i);
+        return -1;
+      }
+      launch_recompressions();
     } else {
       printf("patch chunk %d is unknown type %d\n", i, type);
       return -1;
@@ -36,6 +36,10 @@ struct FileContents {
 
 using SinkFn = std::function<size_t(const unsigned char*, size_t)>;
 
+// Reads the given number of bytes of the source data, starting at the given offset, into the
+// buffer. Returns false on errors.
+using SourceFn = std::function<bool(size_t, unsigned char*, size_t)>;
+
 // applypatch.cpp
 
 int ShowLicenses();
@@ -50,8 +54,18 @@ int applypatch(const char* source_filename,
                const std::vector<std::string>& patch_sha1_str,
                const std::vector<std::unique_ptr<Value>>& patch_data,
                const Value* bonus_data);
+// Like the above, but the patches are loaded by |load_patch| (given the index into
+// |patch_sha1_str|), which is only called for the patch that gets applied. A nullptr from it fails
+// the patching.
+using PatchLoader = std::function<const Value*(size_t index)>;
+int applypatch(const char* source_filename, const char* target_filename,
+               const char* target_sha1_str, size_t target_size,
+               const std::vector<std::string>& patch_sha1_str, const PatchLoader& load_patch,
+               const Value* bonus_data);
+// With |use_hash_cache|, an EMMC target may match the SHA-1 recorded by an earlier check, judged by
+// a sample of its blocks rather than all of them.
 int applypatch_check(const char* filename,
-                     const std::vector<std::string>& patch_sha1_str);
+                     const std::vector<std::string>& patch_sha1_str, bool use_hash_cache = false);
 int applypatch_flash(const char* source_filename, const char* target_filename,
                      const char* target_sha1_str, size_t target_size);
 
@@ -68,6 +82,11 @@ void ShowBSDiffLicense();
 int ApplyBSDiffPatch(const unsigned char* old_data, size_t old_size, const Value& patch,
                      size_t patch_offset, SinkFn sink, SHA_CTX* ctx);
 
+// Same as above, but reads the source data through 'source' on demand, so that it doesn't need to
+// be loaded into memory as a whole.
+int ApplyBSDiffPatchFromSource(const SourceFn& source, size_t old_size, const Value& patch,
+                               size_t patch_offset, SinkFn sink, SHA_CTX* ctx);
+
 // imgpatch.cpp
 
 // Applies the imgdiff-patch given in 'patch' to the source data given by (old_data, old_size), with
@@ -80,4 +99,10 @@ int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value&
 
 int MakeFreeSpaceOnCache(size_t bytes_needed);
 
+// Deletes the regular files directly in |dirs| that no process has open, the oldest first, until
+// |space_checker| reports at least |bytes_needed| bytes free on the filesystem of |dirs[0]|.
+// Returns 0 once there's enough space.
+int MakeFreeSpaceInDirectories(size_t bytes_needed, const std::vector<std::string>& dirs,
+                               const std::function<size_t(const std::string&)>& space_checker);
+
 #endif
@@ -21,9 +21,16 @@
 #include <stdio.h>
 #include <sys/types.h>
 
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include <android-base/macros.h>
 #include <bsdiff/bsdiff.h>
 #include <ziparchive/zip_archive.h>
 #include <zlib.h>
@@ -31,6 +38,43 @@
 #include "imgdiff.h"
 #include "otautil/rangeset.h"
 
+class SuffixArrayCache;
+
+// FileContent holds the content of an input file. It's either mapped in read-only from the file, so
+// that only the pages being diffed are resident, or owned in memory (e.g. for the split sources).
+class FileContent {
+ public:
+  FileContent() = default;
+  explicit FileContent(std::vector<uint8_t> data) : buffer_(std::move(data)) {}
+  FileContent(FileContent&& other) noexcept;
+  FileContent& operator=(FileContent&& other) noexcept;
+  ~FileContent();
+
+  // Maps the content of |filename|, replacing the current one. Returns false on error.
+  bool MapFile(const std::string& filename);
+
+  const uint8_t* data() const {
+    return mapped_ != nullptr ? mapped_ : buffer_.data();
+  }
+
+  size_t size() const {
+    return mapped_ != nullptr ? mapped_size_ : buffer_.size();
+  }
+
+  const uint8_t& operator[](size_t i) const {
+    return data()[i];
+  }
+
+ private:
+  void Unmap();
+
+  std::vector<uint8_t> buffer_;
+  uint8_t* mapped_{ nullptr };
+  size_t mapped_size_{ 0 };
+
+  DISALLOW_COPY_AND_ASSIGN(FileContent);
+};
+
 class ImageChunk {
  public:
   static constexpr auto WINDOWBITS = -15;  // 32kb window; negative to indicate a raw stream.
@@ -38,7 +82,7 @@ class ImageChunk {
   static constexpr auto METHOD = Z_DEFLATED;
   static constexpr auto STRATEGY = Z_DEFAULT_STRATEGY;
 
-  ImageChunk(int type, size_t start, const std::vector<uint8_t>* file_content, size_t raw_data_len,
+  ImageChunk(int type, size_t start, const FileContent* file_content, size_t raw_data_len,
              std::string entry_name = {});
 
   int GetType() const {
@@ -83,28 +127,30 @@ class ImageChunk {
   /*
    * Verify that we can reproduce exactly the same compressed data that we started with.  Sets the
    * level, method, windowBits, memLevel, and strategy fields in the chunk to the encoding
-   * parameters needed to produce the right output.
+   * parameters needed to produce the right output. |level_hint| (if not nullptr) is the level to
+   * try first, and is updated to the one that works.
    */
-  bool ReconstructDeflateChunk();
+  bool ReconstructDeflateChunk(int* level_hint = nullptr);
   bool IsAdjacentNormal(const ImageChunk& other) const;
   void MergeAdjacentNormal(const ImageChunk& other);
 
   /*
    * Compute a bsdiff patch between |src| and |tgt|; Store the result in the patch_data.
-   * |bsdiff_cache| can be used to cache the suffix array if the same |src| chunk is used
+   * |sa_cache| can be used to cache the suffix array if the same |src| data is used
    * repeatedly, pass nullptr if not needed.
    */
   static bool MakePatch(const ImageChunk& tgt, const ImageChunk& src,
-                        std::vector<uint8_t>* patch_data,
-                        bsdiff::SuffixArrayIndexInterface** bsdiff_cache);
+                        std::vector<uint8_t>* patch_data, SuffixArrayCache* sa_cache);
 
  private:
   const uint8_t* GetRawData() const;
-  bool TryReconstruction(int level);
+  // Compress the data with |level|, and compare the first |limit| bytes of the output against the
+  // raw data. The whole output is compared if |limit| covers the raw data.
+  bool TryReconstruction(int level, size_t limit);
 
   int type_;                                    // CHUNK_NORMAL, CHUNK_DEFLATE, CHUNK_RAW
   size_t start_;                                // offset of chunk in the original input file
-  const std::vector<uint8_t>* input_file_ptr_;  // ptr to the full content of original input file
+  const FileContent* input_file_ptr_;  // ptr to the full content of original input file
   size_t raw_data_len_;
 
   // deflate encoder parameters
@@ -155,12 +201,54 @@ class PatchChunk {
   std::vector<uint8_t> data_;  // storage for the patch data
 };
 
+// SuffixArrayCache keeps the bsdiff suffix arrays of the source data, keyed by the SHA-1 and the
+// length of the data, so that a source that's diffed against several targets is only indexed once.
+// The least recently used arrays are evicted once the estimated total size exceeds the limit,
+// though the latest one is always kept. It's safe to use from multiple threads.
+class SuffixArrayCache {
+ public:
+  // The default limit in bytes of the cached suffix arrays.
+  static constexpr size_t kDefaultLimit = 1024 * 1024 * 1024;
+
+  explicit SuffixArrayCache(size_t limit = kDefaultLimit) : limit_(limit) {}
+
+  // Runs bsdiff from |src| to |tgt| and writes the patch to |patch_name|, indexing |src| first
+  // unless its suffix array is already cached. Returns the result of bsdiff.
+  int Diff(const ImageChunk& src, const ImageChunk& tgt, const char* patch_name);
+
+  size_t hits() const {
+    return hits_;
+  }
+
+  size_t misses() const {
+    return misses_;
+  }
+
+ private:
+  struct Entry;
+
+  std::shared_ptr<Entry> Lookup(const uint8_t* data, size_t length);
+
+  size_t limit_;
+  size_t size_{ 0 };
+  size_t hits_{ 0 };
+  size_t misses_{ 0 };
+
+  std::mutex lock_;
+  std::map<std::string, std::shared_ptr<Entry>> entries_;
+  // The keys of |entries_|, most recently used first.
+  std::list<std::string> lru_;
+};
+
 // Interface for zip_mode and image_mode images. We initialize the image from an input file and
 // split the file content into a list of image chunks.
 class Image {
  public:
   explicit Image(bool is_source) : is_source_(is_source) {}
 
+  Image(Image&&) = default;
+  Image& operator=(Image&&) = default;
+
   virtual ~Image() {}
 
   // Create a list of image chunks from input file.
@@ -197,25 +285,48 @@ class Image {
   }
 
  protected:
-  bool ReadFile(const std::string& filename, std::vector<uint8_t>* file_content);
+  bool ReadFile(const std::string& filename, FileContent* file_content);
 
   bool is_source_;                     // True if it's for source chunks.
   std::vector<ImageChunk> chunks_;     // Internal storage of ImageChunk.
-  std::vector<uint8_t> file_content_;  // Store the whole input file in memory.
+  FileContent file_content_;           // The whole input file, mapped in memory.
+};
+
+// The resources of the devices that apply the patches, which the block limit to split large zips by
+// is picked for (see ZipModeImage::ChooseBlockLimit()). It's given to imgdiff as a file of
+// "key=value" lines, with the rates measured on the device by the recovery benchmarks.
+struct DeviceProfile {
+  // The memory in bytes that applying one piece of a split patch may take. Required.
+  size_t memory_budget = 0;
+  // The bytes per second that the source of a piece is read and patched at.
+  size_t read_rate = 64 * 1024 * 1024;
+  // The fixed costs of each piece: the milliseconds to set it up (stashing, hashing its source and
+  // target ranges), and the bytes of metadata it adds to the update.
+  size_t split_ms = 20;
+  size_t split_bytes = 512;
+  // The bytes of patch that one second of applying the update is worth.
+  size_t bytes_per_second = 1024 * 1024;
+
+  // Parses the profile from |content|, where empty lines and the ones starting with '#' are
+  // ignored. Returns false on an unknown key or a malformed value, or without a memory budget.
+  bool Parse(const std::string& content);
 };
 
 class ZipModeImage : public Image {
  public:
-  explicit ZipModeImage(bool is_source, size_t limit = 0) : Image(is_source), limit_(limit) {}
+  // The entries are inflated, and the target deflate chunks reconstructed, on up to |jobs| threads.
+  explicit ZipModeImage(bool is_source, size_t limit = 0, size_t jobs = 1)
+      : Image(is_source), limit_(limit), jobs_(jobs) {}
 
   bool Initialize(const std::string& filename) override;
 
   // Initialize a dummy ZipModeImage from an existing ImageChunk vector. For src img pieces, we
   // reconstruct a new file_content based on the source ranges; but it's not needed for the tgt img
   // pieces; because for each chunk both the data and their offset within the file are unchanged.
-  void Initialize(const std::vector<ImageChunk>& chunks, const std::vector<uint8_t>& file_content) {
+  void Initialize(const std::vector<ImageChunk>& chunks, std::vector<uint8_t> file_content) {
     chunks_ = chunks;
-    file_content_ = file_content;
+    file_content_ = FileContent(std::move(file_content));
+    IndexChunks();
   }
 
   // The pesudo source chunk for bsdiff if there's no match for the given target chunk. It's in
@@ -232,33 +343,54 @@ class ZipModeImage : public Image {
   // src and tgt are identical.
   static bool CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage* src_image);
 
-  // Compute the patch between tgt & src images, and write the data into |patch_name|.
+  // Compute the patch between tgt & src images, and write the data into |patch_name|. The chunks
+  // are diffed on up to |jobs| threads. The suffix arrays are kept in |sa_cache|, or in a cache
+  // with the default limit if it's nullptr.
   static bool GeneratePatches(const ZipModeImage& tgt_image, const ZipModeImage& src_image,
-                              const std::string& patch_name);
+                              const std::string& patch_name, size_t jobs = 1,
+                              SuffixArrayCache* sa_cache = nullptr);
 
   // Compute the patch based on the lists of split src and tgt images. Generate patches for each
   // pair of split pieces and write the data to |patch_name|. If |debug_dir| is specified, write
-  // each split src data and patch data into that directory.
+  // each split src data and patch data into that directory. The splits and their chunks are diffed
+  // on up to |jobs| threads in total, sharing the suffix arrays in |sa_cache| (or a default one).
   static bool GeneratePatches(const std::vector<ZipModeImage>& split_tgt_images,
                               const std::vector<ZipModeImage>& split_src_images,
                               const std::vector<SortedRangeSet>& split_src_ranges,
                               const std::string& patch_name, const std::string& split_info_file,
-                              const std::string& debug_dir);
+                              const std::string& debug_dir, size_t jobs = 1,
+                              SuffixArrayCache* sa_cache = nullptr);
 
-  // Split the tgt chunks and src chunks based on the size limit.
+  // Split the tgt chunks and src chunks based on the size limit. The bytes of the target chunks
+  // that end up without their source in the split are added to |unmatched_tgt_bytes|, if given.
   static bool SplitZipModeImageWithLimit(const ZipModeImage& tgt_image,
                                          const ZipModeImage& src_image,
                                          std::vector<ZipModeImage>* split_tgt_images,
                                          std::vector<ZipModeImage>* split_src_images,
-                                         std::vector<SortedRangeSet>* split_src_ranges);
+                                         std::vector<SortedRangeSet>* split_src_ranges,
+                                         size_t* unmatched_tgt_bytes = nullptr);
+
+  // Picks the block limit to split the zips |src_name| and |tgt_name| by, for the devices of
+  // |profile|. Among the limits whose pieces fit in the memory budget, it's the one with the lowest
+  // estimated cost: the target bytes split away from their source and the metadata of the pieces,
+  // plus the time to apply them weighed by |profile.bytes_per_second|. Returns 0 on error.
+  static size_t ChooseBlockLimit(const std::string& src_name, const std::string& tgt_name,
+                                 const DeviceProfile& profile);
 
  private:
   // Initialize image chunks based on the zip entries.
   bool InitializeChunks(const std::string& filename, ZipArchiveHandle handle);
-  // Add the a zip entry to the list.
-  bool AddZipEntryToChunks(ZipArchiveHandle handle, const std::string& entry_name, ZipEntry* entry);
+  // Add the a zip entry to the list. A deflated entry is added without its data, and its index and
+  // entry are appended to |inflations| for InflateEntries().
+  bool AddZipEntryToChunks(ZipArchiveHandle handle, const std::string& entry_name, ZipEntry* entry,
+                           std::vector<std::pair<size_t, ZipEntry>>* inflations);
+  // Extract the uncompressed data of the given deflate chunks.
+  bool InflateEntries(ZipArchiveHandle handle,
+                      const std::vector<std::pair<size_t, ZipEntry>>& inflations);
   // Return the real size of the zip file. (omit the trailing zeros that used for alignment)
   bool GetZipFileSize(size_t* input_file_size);
+  // Rebuild the index of the chunks by entry name, after the chunks have changed.
+  void IndexChunks();
 
   static void ValidateSplitImages(const std::vector<ZipModeImage>& split_tgt_images,
                                   const std::vector<ZipModeImage>& split_src_images,
@@ -277,11 +409,21 @@ class ZipModeImage : public Image {
 
   // Function that actually iterates the tgt_chunks and makes patches.
   static bool GeneratePatchesInternal(const ZipModeImage& tgt_image, const ZipModeImage& src_image,
-                                      std::vector<PatchChunk>* patch_chunks);
+                                      std::vector<PatchChunk>* patch_chunks, size_t jobs,
+                                      SuffixArrayCache* sa_cache);
 
   // size limit in bytes of each chunk. Also, if the length of one zip_entry exceeds the limit,
   // we'll split that entry into several smaller chunks in advance.
   size_t limit_;
+  size_t jobs_;
+  // Only lay out the chunks, without inflating the entries, e.g. to estimate the splits.
+  bool layout_only_{ false };
+
+  // The indices of the chunks with each entry name, in order. It's only used while it still
+  // describes |chunks_|, i.e. the chunks haven't been added or merged since it was built.
+  std::unordered_map<std::string, std::vector<size_t>> name_index_;
+  const ImageChunk* indexed_chunks_{ nullptr };
+  size_t indexed_size_{ 0 };
 };
 
 class ImageModeImage : public Image {
@@ -298,9 +440,9 @@ class ImageModeImage : public Image {
   static bool CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeImage* src_image);
 
   // In image mode, generate patches against the given source chunks and bonus_data; write the
-  // result to |patch_name|.
+  // result to |patch_name|. The chunks are diffed on up to |jobs| threads.
   static bool GeneratePatches(const ImageModeImage& tgt_image, const ImageModeImage& src_image,
-                              const std::string& patch_name);
+                              const std::string& patch_name, size_t jobs = 1);
 };
 
 #endif  // _APPLYPATCH_IMGDIFF_IMAGE_H
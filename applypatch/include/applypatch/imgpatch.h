@@ -26,4 +26,12 @@ using SinkFn = std::function<size_t(const unsigned char*, size_t)>;
 int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const unsigned char* patch_data,
                     size_t patch_size, SinkFn sink);
 
+// Sets the memory budget of the cache of inflated source chunks, which ApplyImagePatch() shares
+// across calls so that a deflate chunk in the source of several patches is inflated once. 0 (the
+// default) turns it off and drops the cached chunks.
+void SetInflateCacheBudget(size_t bytes);
+
+// Returns the number of source chunks that have been found in the cache.
+size_t InflateCacheHits();
+
 #endif  // _APPLYPATCH_IMGPATCH_H
@@ -19,6 +19,7 @@
 
 #include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -26,6 +27,8 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 #include "cutils/properties.h"
 
 #include <fs_mgr.h>
@@ -35,7 +38,8 @@
 
 using namespace android;
 
-static int append_sod(const char* opt_hash) {
+static int append_sod(const char* opt_hash, bool opt_sparse, bool opt_manifest,
+                      const char* opt_base) {
   const char* key;
   char value[PROPERTY_VALUE_MAX];
   char sodbuf[PROP_LINE_LEN * 10];
@@ -55,6 +59,17 @@ static int append_sod(const char* opt_hash) {
     int fd = open(part->vol->blk_device, O_RDONLY);
     part->size = part->used = lseek64(fd, 0, SEEK_END);
     close(fd);
+    if (opt_manifest) {
+      if (manifest_scan(part, opt_base) != 0) return -1;
+      part->used = sparse_entry_size(part) + manifest_entry_size(part);
+      logmsg("append_sod: %s has %zu changed extents, %llu bytes\n", part->name,
+             part->num_extents, (unsigned long long)part->used);
+    } else if (opt_sparse) {
+      if (sparse_scan(part) != 0) return -1;
+      part->used = sparse_entry_size(part);
+      logmsg("append_sod: %s has %zu extents, %llu bytes\n", part->name, part->num_extents,
+             (unsigned long long)part->used);
+    }
     p += sprintf(p, "fs.%s.size=%llu\n", part->name, (unsigned long long)part->size);
     p += sprintf(p, "fs.%s.used=%llu\n", part->name, (unsigned long long)part->used);
   }
@@ -66,26 +81,12 @@ static int append_sod(const char* opt_hash) {
 static int append_eod(const char* opt_hash) {
   char eodbuf[PROP_LINE_LEN * 10];
   char* p = eodbuf;
-  int n;
 
   p += sprintf(p, "hash.datalen=%lu\n", (unsigned long)hash_datalen);
 
-  unsigned char digest[HASH_MAX_LENGTH];
   char hexdigest[HASH_MAX_STRING_LENGTH];
-
-  if (!strcasecmp(opt_hash, "sha1")) {
-    SHA1_Final(digest, &sha_ctx);
-    for (n = 0; n < SHA_DIGEST_LENGTH; ++n) {
-      sprintf(hexdigest + 2 * n, "%02x", digest[n]);
-    }
-    p += sprintf(p, "hash.value=%s\n", hexdigest);
-  } else {  // default to md5
-    MD5_Final(digest, &md5_ctx);
-    for (n = 0; n < MD5_DIGEST_LENGTH; ++n) {
-      sprintf(hexdigest + 2 * n, "%02x", digest[n]);
-    }
-    p += sprintf(p, "hash.value=%s\n", hexdigest);
-  }
+  hash_final(&data_hash, hexdigest);
+  p += sprintf(p, "hash.value=%s\n", hexdigest);
 
   int rc = tar_append_file_contents(tar, "EOD", 0600, getuid(), getgid(), eodbuf, p - eodbuf);
   return rc;
@@ -106,21 +107,163 @@ static int tar_append_device_contents(TAR* t, const char* devname, const char* s
     return -1;
   }
   st.st_size = lseek64(fd, 0, SEEK_END);
-  close(fd);
 
   th_set_from_stat(t, &st);
   th_set_path(t, savename);
   if (th_write(t) != 0) {
     logmsg("tar_append_device_contents: th_write failed\n");
+    close(fd);
     return -1;
   }
-  if (tar_append_regfile(t, devname) != 0) {
-    logmsg("tar_append_device_contents: tar_append_regfile %s failed\n", devname);
+
+  // The device is read ahead while the previous buffer is hashed, compressed and sent.
+  int rc = 0;
+  {
+    DeviceReader reader(fd, { { 0, (uint64_t)st.st_size } });
+    const uint8_t* data;
+    size_t len;
+    while ((data = reader.Next(&len)) != nullptr) {
+      if (tar_data_write(t, data, len) != 0) {
+        rc = -1;
+        break;
+      }
+    }
+    if (reader.failed()) rc = -1;
+  }
+  close(fd);
+  if (rc == 0) {
+    rc = tar_data_pad(t, st.st_size);
+  }
+  if (rc != 0) {
+    logmsg("tar_append_device_contents: writing %s failed\n", devname);
+  }
+  return rc;
+}
+
+struct segment_source {
+  partspec* part;
+  int fd;
+  DeviceReader* reader;
+  uint64_t off;
+};
+
+static int segment_source_open(segment_source* src, partspec* part) {
+  src->part = part;
+  src->off = part->resume_off;
+  src->fd = open(part->vol->blk_device, O_RDONLY);
+  if (src->fd < 0) {
+    logmsg("segment_source_open: open %s failed\n", part->vol->blk_device);
     return -1;
   }
+  src->reader = new DeviceReader(src->fd, { { src->off, part->size - src->off } });
+  part_set(part);
+  part->off = src->off;
+  return 0;
+}
+
+static void segment_source_close(segment_source* src) {
+  delete src->reader;
+  close(src->fd);
+}
+
+// Appends the next segment of |src|, and its checksum.
+static int tar_append_segment(TAR* t, segment_source* src) {
+  uint64_t size = std::min<uint64_t>(SEGMENT_SIZE, src->part->size - src->off);
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s" SEGMENT_INFIX "%llx", src->part->name,
+           (unsigned long long)src->off);
+  if (tar_append_header(t, path, size) != 0) return -1;
+
+  // SEGMENT_SIZE is a multiple of the buffer size, so the buffers never span two segments.
+  part_select(src->part);
+  SHA256_CTX ctx;
+  SHA256_Init(&ctx);
+  uint64_t left = size;
+  while (left > 0) {
+    size_t len;
+    const uint8_t* data = src->reader->Next(&len);
+    if (data == NULL || len > left) {
+      logmsg("tar_append_segment: read of %s failed\n", path);
+      return -1;
+    }
+    SHA256_Update(&ctx, data, len);
+    if (tar_data_write(t, data, len) != 0) return -1;
+    left -= len;
+  }
+  if (tar_data_pad(t, size) != 0) return -1;
+
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  SHA256_Final(digest, &ctx);
+  char sumbuf[PROP_LINE_LEN];
+  char* p = sumbuf;
+  p += sprintf(p, "sha256=");
+  for (int n = 0; n < SHA256_DIGEST_LENGTH; ++n) {
+    p += sprintf(p, "%02x", digest[n]);
+  }
+  p += sprintf(p, "\n");
+  snprintf(path, sizeof(path), "%s" SEGMENT_SUM_INFIX "%llx", src->part->name,
+           (unsigned long long)src->off);
+  src->off += size;
+  return tar_append_file_contents(t, path, 0600, getuid(), getgid(), sumbuf, p - sumbuf);
+}
+
+// Sets where the partitions in |spec| ("<name>:<offset>[,...]", with the offsets in hex) start.
+static int parse_resume(char* spec) {
+  char* save;
+  for (char* item = strtok_r(spec, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+    char* colon = strchr(item, ':');
+    if (colon == NULL) {
+      logmsg("parse_resume: bad item \"%s\"\n", item);
+      return -1;
+    }
+    *colon = '\0';
+    partspec* part = part_find(item);
+    uint64_t off = strtoull(colon + 1, NULL, 16);
+    if (part == NULL || off % SEGMENT_SIZE != 0) {
+      logmsg("parse_resume: cannot resume %s at %llx\n", item, (unsigned long long)off);
+      return -1;
+    }
+    part->resume_off = off;
+    logmsg("parse_resume: %s from %llx\n", item, (unsigned long long)off);
+  }
   return 0;
 }
 
+// Appends the partitions as interleaved segments, |parallel| partitions at a time, which are all
+// read ahead at once.
+static int tar_append_segmented(TAR* t, int parallel) {
+  std::vector<segment_source> active;
+  int next = 0;
+  int rc = 0;
+  while (rc == 0) {
+    while ((int)active.size() < parallel) {
+      partspec* part = part_get(next);
+      if (part == NULL) break;
+      ++next;
+      segment_source src;
+      if (segment_source_open(&src, part) != 0) return -1;
+      active.push_back(src);
+    }
+    if (active.empty()) break;
+
+    for (size_t i = 0; i < active.size() && rc == 0;) {
+      if (active[i].off < active[i].part->size) {
+        rc = tar_append_segment(t, &active[i]);
+      }
+      if (active[i].off >= active[i].part->size) {
+        segment_source_close(&active[i]);
+        active.erase(active.begin() + i);
+        continue;
+      }
+      ++i;
+    }
+  }
+  for (auto& src : active) {
+    segment_source_close(&src);
+  }
+  return rc;
+}
+
 int do_backup(int argc, char** argv) {
   int rc = 1;
   int n;
@@ -128,6 +271,12 @@ int do_backup(int argc, char** argv) {
 
   const char* opt_compress = "gzip";
   const char* opt_hash = "md5";
+  bool opt_hash_thread = false;
+  bool opt_sparse = false;
+  int opt_parallel = 0;
+  bool opt_manifest = false;
+  char* opt_resume = NULL;
+  const char* opt_base = NULL;
 
   int optidx = 0;
   while (optidx < argc && argv[optidx][0] == '-' && argv[optidx][1] == '-') {
@@ -151,6 +300,28 @@ int do_backup(int argc, char** argv) {
     } else if (!strcmp(optname, "hash")) {
       opt_hash = optval;
       logmsg("do_backup: hash=%s\n", opt_hash);
+    } else if (!strcmp(optname, "hash-thread")) {
+      opt_hash_thread = atoi(optval) != 0;
+      logmsg("do_backup: hash-thread=%d\n", opt_hash_thread);
+    } else if (!strcmp(optname, "sparse")) {
+      opt_sparse = atoi(optval) != 0;
+      logmsg("do_backup: sparse=%d\n", opt_sparse);
+    } else if (!strcmp(optname, "manifest")) {
+      opt_manifest = atoi(optval) != 0;
+      logmsg("do_backup: manifest=%d\n", opt_manifest);
+    } else if (!strcmp(optname, "base")) {
+      opt_base = optval;
+      opt_manifest = true;
+      logmsg("do_backup: base=%s\n", opt_base);
+    } else if (!strcmp(optname, "resume")) {
+      opt_resume = optval;
+      logmsg("do_backup: resume=%s\n", opt_resume);
+    } else if (!strcmp(optname, "parallel")) {
+      opt_parallel = atoi(optval);
+      logmsg("do_backup: parallel=%d\n", opt_parallel);
+    } else if (!strcmp(optname, "threads")) {
+      compress_threads = atoi(optval);
+      logmsg("do_backup: threads=%d\n", compress_threads);
     } else {
       logmsg("do_backup: invalid option name \"%s\"\n", optname);
       return -1;
@@ -165,32 +336,71 @@ int do_backup(int argc, char** argv) {
     }
   }
 
+  // A resumed backup is a segmented one, made of the segments from the given offsets on.
+  if (opt_resume != NULL) {
+    if (parse_resume(opt_resume) != 0) return -1;
+    if (opt_parallel < 1) opt_parallel = 1;
+    opt_sparse = false;
+    opt_manifest = false;
+  }
+
   rc = create_tar(adb_ofd, opt_compress, "w");
   if (rc != 0) {
     logmsg("do_backup: cannot open tar stream\n");
     return rc;
   }
 
-  append_sod(opt_hash);
+  if (opt_manifest && (opt_sparse || opt_parallel > 1)) {
+    logmsg("do_backup: --sparse and --parallel do not apply to incremental backups\n");
+    opt_sparse = false;
+    opt_parallel = 0;
+  }
 
-  hash_name = strdup(opt_hash);
+  rc = append_sod(opt_hash, opt_sparse, opt_manifest, opt_base);
+  if (rc != 0) {
+    logmsg("do_backup: cannot write the SOD\n");
+    return rc;
+  }
 
-  for (i = 0; i < MAX_PART; ++i) {
-    partspec* curpart = part_get(i);
-    if (!curpart) break;
+  hash_name = strdup(opt_hash);
+  hash_init(&data_hash, opt_hash);
+  if (opt_hash_thread) hash_start_thread();
 
-    part_set(curpart);
-    rc = tar_append_device_contents(tar, curpart->vol->blk_device, curpart->name);
+  bool segmented = opt_parallel > 1 || opt_resume != NULL;
+  if (segmented && opt_sparse) {
+    logmsg("do_backup: --parallel does not apply to sparse backups\n");
+  }
+  if (segmented && !opt_sparse) {
+    rc = tar_append_segmented(tar, opt_parallel);
+  } else {
+    for (i = 0; i < MAX_PART; ++i) {
+      partspec* curpart = part_get(i);
+      if (!curpart) break;
+
+      part_set(curpart);
+      if (opt_manifest) {
+        rc = tar_append_delta_device(tar, curpart, curpart->name);
+        if (rc == 0) rc = tar_append_manifest(tar, curpart);
+      } else if (opt_sparse) {
+        rc = tar_append_sparse_device(tar, curpart, curpart->name);
+      } else {
+        rc = tar_append_device_contents(tar, curpart->vol->blk_device, curpart->name);
+      }
+    }
   }
 
   free(hash_name);
   hash_name = NULL;
 
   append_eod(opt_hash);
+  hash_stop_thread();
 
   tar_append_eof(tar);
 
-  if (opt_compress) gzflush(gzf, Z_FINISH);
+  if (finish_tar_stream() != 0) {
+    logmsg("do_backup: failed to finish the compressed stream\n");
+    rc = -1;
+  }
 
   logmsg("backup complete: rc=%d\n", rc);
 
@@ -126,6 +126,28 @@ bool UpdateAndSaveBootloaderControl(const char* misc_device, bootloader_control*
   return true;
 }
 
+// Opens a session on the misc device for a read-modify-write of the bootloader_control, which
+// then costs a single open and a single write and fsync.
+bool OpenBootloaderControl(const char* misc_device, MiscSession* misc) {
+  std::string err;
+  if (!misc->Open(misc_device, &err)) {
+    LOG(ERROR) << err;
+    return false;
+  }
+  return true;
+}
+
+bool CommitBootloaderControl(MiscSession* misc) {
+  bootloader_control* boot_ctrl = misc->boot_control();
+  boot_ctrl->crc32_le = BootloaderControlLECRC(boot_ctrl);
+  std::string err;
+  if (!misc->Commit(&err)) {
+    LOG(ERROR) << err;
+    return false;
+  }
+  return true;
+}
+
 void InitDefaultBootloaderControl(const boot_control_private_t* module,
                                   bootloader_control* boot_ctrl) {
   memset(boot_ctrl, 0, sizeof(*boot_ctrl));
@@ -256,15 +278,16 @@ unsigned int BootControl_getCurrentSlot(boot_control_module_t* module) {
 int BootControl_markBootSuccessful(boot_control_module_t* module) {
   boot_control_private_t* const bootctrl_module = reinterpret_cast<boot_control_private_t*>(module);
 
-  bootloader_control bootctrl;
-  if (!LoadBootloaderControl(bootctrl_module->misc_device, &bootctrl)) return -1;
+  MiscSession misc;
+  if (!OpenBootloaderControl(bootctrl_module->misc_device, &misc)) return -1;
+  bootloader_control& bootctrl = *misc.boot_control();
 
   bootctrl.slot_info[bootctrl_module->current_slot].successful_boot = 1;
   // tries_remaining == 0 means that the slot is not bootable anymore, make
   // sure we mark the current slot as bootable if it succeeds in the last
   // attempt.
   bootctrl.slot_info[bootctrl_module->current_slot].tries_remaining = 1;
-  if (!UpdateAndSaveBootloaderControl(bootctrl_module->misc_device, &bootctrl)) return -1;
+  if (!CommitBootloaderControl(&misc)) return -1;
   return 0;
 }
 
@@ -276,8 +299,9 @@ int BootControl_setActiveBootSlot(boot_control_module_t* module, unsigned int sl
     return -1;
   }
 
-  bootloader_control bootctrl;
-  if (!LoadBootloaderControl(bootctrl_module->misc_device, &bootctrl)) return -1;
+  MiscSession misc;
+  if (!OpenBootloaderControl(bootctrl_module->misc_device, &misc)) return -1;
+  bootloader_control& bootctrl = *misc.boot_control();
 
   // Set every other slot with a lower priority than the new "active" slot.
   const unsigned int kActivePriority = 15;
@@ -301,7 +325,7 @@ int BootControl_setActiveBootSlot(boot_control_module_t* module, unsigned int sl
   // slot would be flip.
   if (slot != bootctrl_module->current_slot) bootctrl.slot_info[slot].verity_corrupted = 0;
 
-  if (!UpdateAndSaveBootloaderControl(bootctrl_module->misc_device, &bootctrl)) return -1;
+  if (!CommitBootloaderControl(&misc)) return -1;
   return 0;
 }
 
@@ -313,14 +337,15 @@ int BootControl_setSlotAsUnbootable(struct boot_control_module* module, unsigned
     return -1;
   }
 
-  bootloader_control bootctrl;
-  if (!LoadBootloaderControl(bootctrl_module->misc_device, &bootctrl)) return -1;
+  MiscSession misc;
+  if (!OpenBootloaderControl(bootctrl_module->misc_device, &misc)) return -1;
+  bootloader_control& bootctrl = *misc.boot_control();
 
   // The only way to mark a slot as unbootable, regardless of the priority is to
   // set the tries_remaining to 0.
   bootctrl.slot_info[slot].successful_boot = 0;
   bootctrl.slot_info[slot].tries_remaining = 0;
-  if (!UpdateAndSaveBootloaderControl(bootctrl_module->misc_device, &bootctrl)) return -1;
+  if (!CommitBootloaderControl(&misc)) return -1;
   return 0;
 }
 
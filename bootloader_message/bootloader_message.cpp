@@ -18,8 +18,11 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <string.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
@@ -180,13 +183,13 @@ bool write_bootloader_message(const std::vector<std::string>& options, std::stri
 }
 
 bool update_bootloader_message(const std::vector<std::string>& options, std::string* err) {
-  bootloader_message boot;
-  if (!read_bootloader_message(&boot, err)) {
+  MiscSession misc;
+  if (!misc.Open(err)) {
     return false;
   }
-  update_bootloader_message_in_struct(&boot, options);
+  update_bootloader_message_in_struct(misc.boot(), options);
 
-  return write_bootloader_message(boot, err);
+  return misc.Commit(err);
 }
 
 bool update_bootloader_message_in_struct(bootloader_message* boot,
@@ -208,16 +211,17 @@ bool update_bootloader_message_in_struct(bootloader_message* boot,
 }
 
 bool write_reboot_bootloader(std::string* err) {
-  bootloader_message boot;
-  if (!read_bootloader_message(&boot, err)) {
+  MiscSession misc;
+  if (!misc.Open(err)) {
     return false;
   }
-  if (boot.command[0] != '\0') {
+  bootloader_message* boot = misc.boot();
+  if (boot->command[0] != '\0') {
     *err = "Bootloader command pending.";
     return false;
   }
-  strlcpy(boot.command, "bootonce-bootloader", sizeof(boot.command));
-  return write_bootloader_message(boot, err);
+  strlcpy(boot->command, "bootonce-bootloader", sizeof(boot->command));
+  return misc.Commit(err);
 }
 
 bool read_wipe_package(std::string* package_data, size_t size, std::string* err) {
@@ -239,6 +243,115 @@ bool write_wipe_package(const std::string& package_data, std::string* err) {
                               WIPE_PACKAGE_OFFSET_IN_MISC, err);
 }
 
+// The session covers everything up to the end of bootloader_message_ab, which also holds the
+// bootloader_control at its absolute offset in slot_suffix.
+static const size_t MISC_SESSION_SIZE =
+    BOOTLOADER_MESSAGE_OFFSET_IN_MISC + sizeof(bootloader_message_ab);
+static const size_t BOOTLOADER_CONTROL_OFFSET_IN_MISC =
+    offsetof(bootloader_message_ab, slot_suffix);
+
+static bool write_at(int fd, const void* p, size_t size, size_t offset) {
+  return lseek(fd, static_cast<off_t>(offset), SEEK_SET) == static_cast<off_t>(offset) &&
+         android::base::WriteFully(fd, p, size);
+}
+
+MiscSession::~MiscSession() {
+  if (fd_ != -1) {
+    close(fd_);
+  }
+}
+
+bool MiscSession::Open(std::string* err) {
+  std::string misc_blk_device = get_misc_blk_device(err);
+  if (misc_blk_device.empty()) {
+    return false;
+  }
+  return Open(misc_blk_device, err);
+}
+
+bool MiscSession::Open(const std::string& misc_blk_device, std::string* err) {
+  if (!wait_for_device(misc_blk_device, err)) {
+    return false;
+  }
+  android::base::unique_fd fd(open(misc_blk_device.c_str(), O_RDWR | O_CLOEXEC));
+  if (fd == -1) {
+    *err = android::base::StringPrintf("failed to open %s: %s", misc_blk_device.c_str(),
+                                       strerror(errno));
+    return false;
+  }
+  std::vector<uint8_t> buffer(MISC_SESSION_SIZE);
+  ssize_t read = TEMP_FAILURE_RETRY(pread(fd, buffer.data(), buffer.size(), 0));
+  if (read != static_cast<ssize_t>(buffer.size())) {
+    *err = android::base::StringPrintf("failed to read %s: %s", misc_blk_device.c_str(),
+                                       read == -1 ? strerror(errno) : "short read");
+    return false;
+  }
+
+  if (fd_ != -1) {
+    close(fd_);
+  }
+  fd_ = fd.release();
+  misc_blk_device_ = misc_blk_device;
+  committed_ = buffer;
+  buffer_ = std::move(buffer);
+  wipe_package_.clear();
+  has_wipe_package_ = false;
+  return true;
+}
+
+bootloader_message* MiscSession::boot() {
+  return reinterpret_cast<bootloader_message*>(&buffer_[BOOTLOADER_MESSAGE_OFFSET_IN_MISC]);
+}
+
+bootloader_control* MiscSession::boot_control() {
+  return reinterpret_cast<bootloader_control*>(&buffer_[BOOTLOADER_CONTROL_OFFSET_IN_MISC]);
+}
+
+void MiscSession::SetWipePackage(const std::string& package_data) {
+  wipe_package_ = package_data;
+  has_wipe_package_ = true;
+}
+
+bool MiscSession::Commit(std::string* err) {
+  if (fd_ == -1) {
+    *err = "misc session is not open";
+    return false;
+  }
+  // Only the range that differs from what's on the device gets written.
+  size_t begin = 0;
+  while (begin < buffer_.size() && buffer_[begin] == committed_[begin]) {
+    ++begin;
+  }
+  size_t end = buffer_.size();
+  while (end > begin && buffer_[end - 1] == committed_[end - 1]) {
+    --end;
+  }
+  if (begin == end && !has_wipe_package_) {
+    return true;
+  }
+
+  if (begin < end && !write_at(fd_, &buffer_[begin], end - begin, begin)) {
+    *err = android::base::StringPrintf("failed to write %s: %s", misc_blk_device_.c_str(),
+                                       strerror(errno));
+    return false;
+  }
+  if (has_wipe_package_ &&
+      !write_at(fd_, wipe_package_.data(), wipe_package_.size(), WIPE_PACKAGE_OFFSET_IN_MISC)) {
+    *err = android::base::StringPrintf("failed to write %s: %s", misc_blk_device_.c_str(),
+                                       strerror(errno));
+    return false;
+  }
+  if (fsync(fd_) == -1) {
+    *err = android::base::StringPrintf("failed to fsync %s: %s", misc_blk_device_.c_str(),
+                                       strerror(errno));
+    return false;
+  }
+  std::copy(buffer_.begin() + begin, buffer_.begin() + end, committed_.begin() + begin);
+  wipe_package_.clear();
+  has_wipe_package_ = false;
+  return true;
+}
+
 extern "C" bool write_reboot_bootloader(void) {
   std::string err;
   return write_reboot_bootloader(&err);
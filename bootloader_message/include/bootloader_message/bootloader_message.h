@@ -218,6 +218,43 @@ bool read_wipe_package(std::string* package_data, size_t size, std::string* err)
 // Write the wipe package into BCB (to offset WIPE_PACKAGE_OFFSET_IN_MISC).
 bool write_wipe_package(const std::string& package_data, std::string* err);
 
+// A read-modify-write session on the misc partition, for batching several updates (e.g. the BCB
+// and the wipe package, or the bootloader_control fields) into one commit. Open() reads the
+// bootloader_message and bootloader_message_ab regions once; Commit() writes back only the bytes
+// that changed, plus any pending wipe package, and issues a single fsync() for all of them.
+class MiscSession {
+ public:
+  MiscSession() = default;
+  ~MiscSession();
+  MiscSession(const MiscSession&) = delete;
+  MiscSession& operator=(const MiscSession&) = delete;
+
+  // Opens the /misc device from the default fstab and reads its messages.
+  bool Open(std::string* err);
+  // Same as above, but on the specified misc device.
+  bool Open(const std::string& misc_blk_device, std::string* err);
+
+  // The in-memory copies, to be updated in place before Commit().
+  bootloader_message* boot();
+  bootloader_control* boot_control();
+
+  // Queues |package_data| to be written at WIPE_PACKAGE_OFFSET_IN_MISC on Commit().
+  void SetWipePackage(const std::string& package_data);
+
+  // Writes the pending changes. A session can be committed more than once.
+  bool Commit(std::string* err);
+
+ private:
+  std::string misc_blk_device_;
+  int fd_ = -1;
+  // The misc partition from its start to the end of bootloader_message_ab, as last read or
+  // committed, and with the pending changes.
+  std::vector<uint8_t> committed_;
+  std::vector<uint8_t> buffer_;
+  std::string wipe_package_;
+  bool has_wipe_package_ = false;
+};
+
 #else
 
 #include <stdbool.h>
@@ -48,11 +48,14 @@ int adb_ifd;
 int adb_ofd;
 TAR* tar;
 gzFile gzf;
+StreamWriter* stream_writer;
+StreamReader* stream_reader;
+AsyncFdReader* socket_reader;
+int compress_threads;
 
 char* hash_name;
 size_t hash_datalen;
-SHA_CTX sha_ctx;
-MD5_CTX md5_ctx;
+hash_ctx data_hash;
 
 void ui_print(const char* format, ...) {
   char buffer[256];
@@ -139,6 +142,10 @@ void part_set(partspec* part) {
   curpart->off = 0;
 }
 
+void part_select(partspec* part) {
+  curpart = part;
+}
+
 int update_progress(uint64_t off) {
   static time_t last_time = 0;
   static int last_pct = 0;
@@ -154,6 +161,7 @@ int update_progress(uint64_t off) {
       last_pct = pct;
     }
   }
+  stats_report(false);
   return 0;
 }
 
@@ -168,10 +176,16 @@ static int tar_cb_close(int fd) {
 
 static ssize_t tar_cb_read(int fd, void* buf, size_t len) {
   ssize_t nread;
-  nread = ::read(fd, buf, len);
+  if (socket_reader != NULL) {
+    // The reading thread counts the socket time.
+    nread = socket_reader->Read(buf, len);
+  } else {
+    uint64_t start = stats_now();
+    nread = ::read(fd, buf, len);
+    stats_add(STAT_SOCKET, nread > 0 ? nread : 0, start);
+  }
   if (nread > 0 && hash_name) {
-    SHA1_Update(&sha_ctx, (u_char*)buf, nread);
-    MD5_Update(&md5_ctx, buf, nread);
+    hash_update(&data_hash, buf, nread);
     hash_datalen += nread;
   }
   update_progress(nread);
@@ -182,13 +196,14 @@ static ssize_t tar_cb_write(int fd, const void* buf, size_t len) {
   ssize_t written = 0;
 
   if (hash_name) {
-    SHA1_Update(&sha_ctx, (u_char*)buf, len);
-    MD5_Update(&md5_ctx, buf, len);
+    hash_update(&data_hash, buf, len);
     hash_datalen += len;
   }
 
   while (len > 0) {
+    uint64_t start = stats_now();
     ssize_t n = ::write(fd, buf, len);
+    stats_add(STAT_SOCKET, n > 0 ? n : 0, start);
     if (n < 0) {
       logmsg("tar_cb_write: error: n=%d\n", n);
       return n;
@@ -206,10 +221,11 @@ static tartype_t tar_io = { tar_cb_open, tar_cb_close, tar_cb_read, tar_cb_write
 
 static ssize_t tar_gz_cb_read(int fd, void* buf, size_t len) {
   int nread;
+  uint64_t start = stats_now();
   nread = gzread(gzf, buf, len);
+  stats_add(STAT_COMPRESS, nread > 0 ? nread : 0, start);
   if (nread > 0 && hash_name) {
-    SHA1_Update(&sha_ctx, (u_char*)buf, nread);
-    MD5_Update(&md5_ctx, buf, nread);
+    hash_update(&data_hash, buf, nread);
     hash_datalen += nread;
   }
   update_progress(nread);
@@ -220,13 +236,14 @@ static ssize_t tar_gz_cb_write(int fd, const void* buf, size_t len) {
   ssize_t written = 0;
 
   if (hash_name) {
-    SHA1_Update(&sha_ctx, (u_char*)buf, len);
-    MD5_Update(&md5_ctx, buf, len);
+    hash_update(&data_hash, buf, len);
     hash_datalen += len;
   }
 
   while (len > 0) {
+    uint64_t start = stats_now();
     ssize_t n = gzwrite(gzf, buf, len);
+    stats_add(STAT_COMPRESS, n > 0 ? n : 0, start);
     if (n < 0) {
       logmsg("tar_gz_cb_write: error: n=%d\n", n);
       return n;
@@ -242,13 +259,90 @@ static ssize_t tar_gz_cb_write(int fd, const void* buf, size_t len) {
 
 static tartype_t tar_io_gz = { tar_cb_open, tar_cb_close, tar_gz_cb_read, tar_gz_cb_write };
 
+static ssize_t tar_stream_cb_read(int fd, void* buf, size_t len) {
+  ssize_t nread;
+  uint64_t start = stats_now();
+  nread = stream_reader->Read(buf, len);
+  stats_add(STAT_COMPRESS, nread > 0 ? nread : 0, start);
+  if (nread > 0 && hash_name) {
+    hash_update(&data_hash, buf, nread);
+    hash_datalen += nread;
+  }
+  update_progress(nread);
+  return nread;
+}
+
+static ssize_t tar_stream_cb_write(int fd, const void* buf, size_t len) {
+  if (hash_name) {
+    hash_update(&data_hash, buf, len);
+    hash_datalen += len;
+  }
+
+  uint64_t start = stats_now();
+  ssize_t written = stream_writer->Write(buf, len);
+  stats_add(STAT_COMPRESS, written > 0 ? written : 0, start);
+  if (written < 0) {
+    logmsg("tar_stream_cb_write: error: n=%d\n", written);
+    return written;
+  }
+  update_progress(written);
+  return written;
+}
+
+static tartype_t tar_io_stream = { tar_cb_open, tar_cb_close, tar_stream_cb_read,
+                                   tar_stream_cb_write };
+
+int tar_append_header(TAR* t, const char* path, uint64_t size) {
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  st.st_mode = 0644 | S_IFREG;
+  st.st_mtime = time(NULL);
+  st.st_size = size;
+  th_set_from_stat(t, &st);
+  th_set_path(t, path);
+  if (th_write(t) != 0) {
+    logmsg("tar_append_header: th_write %s failed\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+int tar_data_write(TAR* t, const void* buf, size_t len) {
+  ssize_t n = (*t->type->writefunc)(t->fd, buf, len);
+  if (n != (ssize_t)len) {
+    logmsg("tar_data_write: short write (%d of %d)\n", (int)n, (int)len);
+    return -1;
+  }
+  return 0;
+}
+
+int tar_data_read(TAR* t, void* buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = (*t->type->readfunc)(t->fd, buf, len);
+    if (n <= 0) {
+      logmsg("tar_data_read: read failed (%d)\n", (int)n);
+      return -1;
+    }
+    buf = (char*)buf + n;
+    len -= n;
+  }
+  return 0;
+}
+
+int tar_data_pad(TAR* t, uint64_t size) {
+  char zeros[T_BLOCKSIZE];
+  if (size % T_BLOCKSIZE == 0) return 0;
+  memset(zeros, 0, sizeof(zeros));
+  return tar_data_write(t, zeros, T_BLOCKSIZE - size % T_BLOCKSIZE);
+}
+
 int create_tar(int fd, const char* compress, const char* mode) {
   int rc = -1;
 
-  SHA1_Init(&sha_ctx);
-  MD5_Init(&md5_ctx);
-
   if (!compress || strcasecmp(compress, "none") == 0) {
+    if (mode[0] == 'r') {
+      socket_reader = new AsyncFdReader(fd);
+    }
     rc = tar_fdopen(&tar, fd, "foobar", &tar_io, 0, /* oflags: unused */
                     0,                              /* mode: unused */
                     TAR_GNU | TAR_STORE_SELINUX /* options */);
@@ -259,10 +353,40 @@ int create_tar(int fd, const char* compress, const char* mode) {
                       0,                                /* mode: unused */
                       TAR_GNU | TAR_STORE_SELINUX /* options */);
     }
+  } else {
+    if (mode[0] == 'w') {
+      stream_writer = stream_writer_open(fd, compress, compress_threads);
+    } else {
+      stream_reader = stream_reader_open(fd, compress, compress_threads);
+    }
+    if (stream_writer != NULL || stream_reader != NULL) {
+      rc = tar_fdopen(&tar, 0, "foobar", &tar_io_stream, 0, /* oflags: unused */
+                      0,                                    /* mode: unused */
+                      TAR_GNU | TAR_STORE_SELINUX /* options */);
+    } else {
+      logmsg("create_tar: unknown compression %s\n", compress);
+    }
   }
   return rc;
 }
 
+int finish_tar_stream() {
+  int rc = 0;
+  if (gzf != NULL) {
+    if (gzflush(gzf, Z_FINISH) != Z_OK) rc = -1;
+  }
+  if (stream_writer != NULL) {
+    if (!stream_writer->Finish()) rc = -1;
+    delete stream_writer;
+    stream_writer = NULL;
+  }
+  delete stream_reader;
+  stream_reader = NULL;
+  delete socket_reader;
+  socket_reader = NULL;
+  return rc;
+}
+
 static void do_exit(int rc) {
   char rcstr[80];
   int len;
@@ -302,16 +426,30 @@ int main(int argc, char** argv) {
 
   load_volume_table();
 
+  stats_reset();
   if (!strcmp(opname, "backup")) {
     ui_print("Backup in progress...");
     rc = do_backup(argc - optidx, &argv[optidx]);
   } else if (!strcmp(opname, "restore")) {
     ui_print("Restore in progress...");
     rc = do_restore(argc - optidx, &argv[optidx]);
+  } else if (!strcmp(opname, "benchmark")) {
+    // A backup, with the same options, to /dev/null, to compare the compressions and hashes.
+    ui_print("Benchmark in progress...");
+    close(adb_ofd);
+    adb_ofd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    rc = do_backup(argc - optidx, &argv[optidx]);
+    uint64_t ms = max<uint64_t>(stats_elapsed_ms(), 1);
+    ui_print("Benchmark: %llu MB read, %llu MB written in %llu.%03llu s, %llu MB/s\n",
+             (unsigned long long)(stats_bytes(STAT_READ) >> 20),
+             (unsigned long long)(stats_bytes(STAT_SOCKET) >> 20), (unsigned long long)ms / 1000,
+             (unsigned long long)ms % 1000,
+             (unsigned long long)(stats_bytes(STAT_READ) / 1000 / ms));
   } else {
     logmsg("Unknown operation %s\n", opname);
     rc = 1;
   }
+  stats_report(true);
 
   close(adb_ofd);
   close(adb_ifd);
@@ -14,6 +14,14 @@
  * limitations under the License.
  */
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include <utils/String8.h>
 
 #include <lib/libtar.h>
@@ -28,10 +36,13 @@ extern "C" {
 #ifndef SHA_DIGEST_STRING_LENGTH
 #define SHA_DIGEST_STRING_LENGTH (SHA_DIGEST_LENGTH * 2 + 1)
 #endif
+#ifndef SHA256_DIGEST_STRING_LENGTH
+#define SHA256_DIGEST_STRING_LENGTH (SHA256_DIGEST_LENGTH * 2 + 1)
+#endif
 }
 
-#define HASH_MAX_LENGTH SHA_DIGEST_LENGTH
-#define HASH_MAX_STRING_LENGTH SHA_DIGEST_STRING_LENGTH
+#define HASH_MAX_LENGTH SHA256_DIGEST_LENGTH
+#define HASH_MAX_STRING_LENGTH SHA256_DIGEST_STRING_LENGTH
 
 #define PROP_LINE_LEN (PROPERTY_KEY_MAX + 1 + PROPERTY_VALUE_MAX + 1 + 1)
 
@@ -40,10 +51,76 @@ extern int adb_ofd;
 extern TAR* tar;
 extern gzFile gzf;
 
+// A compressed stream, written by the backup or read by the restore through the tar callbacks.
+class StreamWriter {
+ public:
+  virtual ~StreamWriter() {}
+  virtual ssize_t Write(const void* buf, size_t len) = 0;
+  // Flushes the rest of the stream.
+  virtual bool Finish() = 0;
+};
+
+class StreamReader {
+ public:
+  virtual ~StreamReader() {}
+  virtual ssize_t Read(void* buf, size_t len) = 0;
+};
+
+// Opens the multi-threaded compressor for |compress| ("pgzip" or "zstd") over |fd|, with
+// |threads| workers (or one per CPU if 0). Returns NULL for the other kinds of compression.
+extern StreamWriter* stream_writer_open(int fd, const char* compress, int threads);
+// Opens the decompressor for |compress| ("pgzip" or "zstd"), or returns NULL.
+extern StreamReader* stream_reader_open(int fd, const char* compress, int threads);
+// Returns whether |buf| starts with the header of a pgzip member, which the restore then inflates
+// in parallel, rather than as a plain gzip stream.
+extern bool is_pgzip_header(const void* buf, size_t len);
+
+class AsyncFdReader;
+
+extern StreamWriter* stream_writer;
+extern StreamReader* stream_reader;
+// Reads the uncompressed restore stream ahead of libtar.
+extern AsyncFdReader* socket_reader;
+extern int compress_threads;
+
+enum hash_type { HASH_MD5, HASH_SHA1, HASH_SHA256 };
+
+// The running hash of one algorithm. It can be copied to save the state.
+struct hash_ctx {
+  hash_type type;
+  union {
+    MD5_CTX md5;
+    SHA_CTX sha1;
+    SHA256_CTX sha256;
+  };
+};
+
+// Starts a hash of |name| ("md5", "sha1" or "sha256"). Falls back to md5, and returns -1, for an
+// unknown name.
+extern int hash_init(hash_ctx* ctx, const char* name);
+extern void hash_update(hash_ctx* ctx, const void* buf, size_t len);
+// Waits for the data queued for the hashing thread to be hashed (up to the hold, if any).
+extern void hash_sync();
+// Holds the hashing thread back from the data queued from now on, until hash_release(). The
+// restore holds it at each tar header, so that the hash of the data before the EOD header can
+// still be taken once the header turns out to be that. A hold stays where it was until released.
+extern void hash_hold();
+extern void hash_release();
+// Writes the digest to |hexdigest|, which holds HASH_MAX_STRING_LENGTH characters.
+extern void hash_final(hash_ctx* ctx, char* hexdigest);
+// Moves the work of hash_update() to a thread of its own, until hash_stop_thread().
+extern void hash_start_thread();
+extern void hash_stop_thread();
+
 extern char* hash_name;
 extern size_t hash_datalen;
-extern SHA_CTX sha_ctx;
-extern MD5_CTX md5_ctx;
+extern hash_ctx data_hash;
+
+// A range of a partition that holds data, in a sparse entry.
+struct sparse_extent {
+  uint64_t offset;
+  uint64_t length;
+};
 
 struct partspec {
   char* name;
@@ -52,8 +129,13 @@ struct partspec {
   uint64_t size;
   uint64_t used;
   uint64_t off;
+  uint64_t resume_off;  // Where a resumed segmented backup starts
+  sparse_extent* extents;  // Set by sparse_scan() or manifest_scan()
+  size_t num_extents;
+  uint8_t* chunk_hashes;  // Set by manifest_scan()
+  size_t num_chunks;
 };
-#define MAX_PART 8
+#define MAX_PART 32
 
 extern void logmsg(const char* fmt, ...);
 
@@ -61,10 +143,228 @@ extern int part_add(const char* name);
 extern partspec* part_get(int i);
 extern partspec* part_find(const char* name);
 extern void part_set(partspec* part);
+// Makes |part| the current partition again, keeping its progress.
+extern void part_select(partspec* part);
 
 extern int update_progress(uint64_t off);
 
+// The stages timed by stats_add(), and reported by stats_report():
+//   read:     reads of the partitions
+//   hash:     the hash of the data (on the hashing thread, with --hash-thread=1)
+//   compress: the compressor (or decompressor) calls of the tar callbacks, including their waits
+//             on the compression threads (and, for gzip and the readers, on the socket)
+//   write:    writes to the partitions
+//   socket:   time blocked writing to (or reading from) the adb socket
+enum bu_stat { STAT_READ, STAT_HASH, STAT_COMPRESS, STAT_WRITE, STAT_SOCKET, STAT_MAX };
+
+// Returns CLOCK_MONOTONIC in nanoseconds, the |start| of stats_add().
+extern uint64_t stats_now();
+// Adds |bytes| to |stat|, and the time since |start|.
+extern void stats_add(bu_stat stat, uint64_t bytes, uint64_t start);
+extern void stats_reset();
+extern uint64_t stats_bytes(bu_stat stat);
+extern uint64_t stats_elapsed_ms();
+// Logs the totals so far, at most once a second unless |final_report|.
+extern void stats_report(bool final_report);
+
+// The suffix of the tar entries that hold a partition in the sparse format.
+#define SPARSE_SUFFIX ".sparse"
+
+// Finds the extents of |part| that aren't all zeros.
+extern int sparse_scan(partspec* part);
+// Returns the size of the sparse entry of |part|, once scanned.
+extern uint64_t sparse_entry_size(const partspec* part);
+extern int tar_append_sparse_device(TAR* t, partspec* part, const char* savename);
+// Appends the extents of |part| as the DELTA_SUFFIX entry of an incremental backup.
+extern int tar_append_delta_device(TAR* t, partspec* part, const char* savename);
+// Extracts a sparse or a delta entry. Only the sparse entries zero the rest of the device.
+extern int tar_extract_sparse_device(TAR* t, const char* devname);
+
+// The incremental backups (--manifest=1, --base=<dir>). The manifest holds the SHA-256 of each
+// MANIFEST_CHUNK_SIZE chunk of a partition, and is stored as "<name>.manifest" in every backup
+// made with --manifest=1. Given the manifests of a previous backup in <dir>, only the chunks that
+// changed are stored, as "<name>.delta", to be restored over that previous backup.
+#define MANIFEST_SUFFIX ".manifest"
+#define DELTA_SUFFIX ".delta"
+#define MANIFEST_CHUNK_SIZE (1024 * 1024)
+
+// Hashes the chunks of |part|, and sets its extents to the chunks that differ from the manifest
+// in |base_dir| (all of them without one).
+extern int manifest_scan(partspec* part, const char* base_dir);
+// Returns the size of the manifest entry of |part|, once scanned.
+extern uint64_t manifest_entry_size(const partspec* part);
+extern int tar_append_manifest(TAR* t, partspec* part);
+
+// The infix of the tar entries that hold a segment of a partition, "<name>.seg.<offset>", with the
+// offset in hex. With --parallel=N, the segments of N partitions at a time are interleaved.
+#define SEGMENT_INFIX ".seg."
+#define SEGMENT_SIZE (16 * 1024 * 1024)
+// Each segment is followed by "<name>.sum.<offset>", which holds "sha256=<hex>" of its data. The
+// restore checks them, and a host that lost the connection checks them to find the last segment
+// it has whole, and asks for the rest with --resume=<name>:<offset>.
+#define SEGMENT_SUM_INFIX ".sum."
+
+// The buffers handed between the stages of the backup pipeline.
+#define PIPELINE_BUFFER_SIZE (1024 * 1024)
+#define PIPELINE_BUFFER_ALIGN 4096
+#define PIPELINE_BUFFERS 4
+
+struct pipe_buffer {
+  uint8_t* data;
+  size_t len;
+  uint64_t off;  // Where DeviceWriter writes it
+};
+
+// A fixed set of buffers, passed from a producer (full) to a consumer (free) and back.
+class BufferQueue {
+ public:
+  BufferQueue(size_t count, size_t size);
+  ~BufferQueue();
+
+  size_t buffer_size() const { return size_; }
+
+  // Both return nullptr once closed (GetFull only after the full buffers are taken).
+  pipe_buffer* GetFree();
+  pipe_buffer* GetFull();
+  // Like the above, but return nullptr rather than wait for a buffer.
+  pipe_buffer* TryGetFree();
+  pipe_buffer* TryGetFull();
+  void PutFull(pipe_buffer* buf);
+  void PutFree(pipe_buffer* buf);
+  void Close();
+  // Waits until every buffer has been given back.
+  void WaitIdle();
+
+ private:
+  size_t size_;
+  std::vector<pipe_buffer> buffers_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<pipe_buffer*> free_;
+  std::deque<pipe_buffer*> full_;
+  bool closed_;
+};
+
+// Runs the steps of a pipeline stage on the shared thread pool of otautil, one at a time. |step|
+// does a piece of the work, such as a buffer, and returns false when there's nothing to do for now;
+// Kick() has it run again once there may be. So a stage only takes a worker while it can make
+// progress, rather than holding one for as long as the stream lasts.
+class PoolStage {
+ public:
+  explicit PoolStage(std::function<bool()> step) : step_(step), running_(false), kicked_(false) {}
+  ~PoolStage() { Wait(); }
+
+  void Kick();
+  // Waits until the steps that have been kicked are done.
+  void Wait();
+
+ private:
+  void Run();
+
+  std::function<bool()> step_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool running_;  // A task is queued or running
+  bool kicked_;   // Kick() was called while it was running
+};
+
+// Reads |ranges| of |fd| ahead, in order, on the shared thread pool.
+class DeviceReader {
+ public:
+  DeviceReader(int fd, const std::vector<sparse_extent>& ranges);
+  ~DeviceReader();
+
+  // Returns the next piece of the data, valid until the next call, or nullptr at the end.
+  const uint8_t* Next(size_t* len);
+  bool failed() const { return failed_; }
+
+ private:
+  // Reads the next buffer.
+  bool Step();
+
+  int fd_;
+  std::vector<sparse_extent> ranges_;
+  BufferQueue queue_;
+  std::atomic<bool> failed_;
+  pipe_buffer* current_;
+  // Where the next buffer is read from, only touched by Step().
+  size_t range_;
+  uint64_t off_;
+  PoolStage stage_;
+};
+
+// Reads the stream |fd| ahead on the shared thread pool, as much as each read returns at a time.
+class AsyncFdReader {
+ public:
+  explicit AsyncFdReader(int fd);
+  ~AsyncFdReader();
+
+  // Like read(2): returns 0 at the end of the stream, and -1 if reading it failed.
+  ssize_t Read(void* data, size_t len);
+
+ private:
+  bool Step();
+
+  int fd_;
+  BufferQueue queue_;
+  std::atomic<bool> failed_;
+  pipe_buffer* current_;
+  // How much of |current_| has been read.
+  size_t pos_;
+  PoolStage stage_;
+};
+
+// Writes to |fd| on the shared thread pool.
+class AsyncFdWriter {
+ public:
+  explicit AsyncFdWriter(int fd);
+  ~AsyncFdWriter();
+
+  bool Write(const void* data, size_t len);
+  // Waits for everything written so far to reach the fd.
+  bool Flush();
+
+ private:
+  // Writes out the next full buffer.
+  bool Step();
+
+  int fd_;
+  BufferQueue queue_;
+  std::atomic<bool> failed_;
+  pipe_buffer* current_;
+  PoolStage stage_;
+};
+
+// Writes to the block device |fd| at the given offsets, on the shared thread pool.
+class DeviceWriter {
+ public:
+  explicit DeviceWriter(int fd);
+  ~DeviceWriter();
+
+  bool Write(uint64_t off, const void* data, size_t len);
+  // Waits for everything written so far to reach the device, and syncs it.
+  bool Finish();
+
+ private:
+  bool Step();
+
+  int fd_;
+  BufferQueue queue_;
+  std::atomic<bool> failed_;
+  pipe_buffer* current_;
+  PoolStage stage_;
+};
+
+// Writes the header of a regular file entry of |size| bytes.
+extern int tar_append_header(TAR* t, const char* path, uint64_t size);
+// Writes (or reads) the data of the current tar entry through the callbacks of |t|.
+extern int tar_data_write(TAR* t, const void* buf, size_t len);
+extern int tar_data_read(TAR* t, void* buf, size_t len);
+// Writes the zeros that pad an entry of |size| bytes to the tar block size.
+extern int tar_data_pad(TAR* t, uint64_t size);
+
 extern int create_tar(int fd, const char* compress, const char* mode);
+extern int finish_tar_stream();
 
 extern int do_backup(int argc, char** argv);
 extern int do_restore(int argc, char** argv);
@@ -0,0 +1,551 @@
+/*
+ * Copyright (C) 2019 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// The multi-threaded compressors for the backup stream.
+//
+// "pgzip" compresses the stream in chunks on the shared thread pool, pigz style, with at most
+// |threads| chunks at a time. Each chunk becomes a gzip member of its own, so the output is still a
+// valid gzip file, which gzip (and the gzip path of the restore) decompresses as a whole. Like
+// BGZF, each member carries its size in an extra field of the gzip header, which lets
+// ParallelGzipReader find the members as they arrive, and inflate them on the pool as well.
+//
+// "zstd" uses the worker threads of libzstd, where they're available, and is restored with
+// ZstdReader.
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <zlib.h>
+#include <zstd.h>
+
+#include <fs_mgr.h>
+#include "otautil/thread_pool.h"
+#include "roots.h"
+
+#include "bu.h"
+
+// The size of the chunks compressed by each worker.
+#define PGZIP_CHUNK_SIZE (1024 * 1024)
+
+// The number of chunks per worker that may be compressed, or waiting to be written, at a time.
+#define PGZIP_CHUNKS_PER_THREAD 2
+
+// The gzip header of the members: FEXTRA set, with a "BU" subfield holding the size of the member.
+#define PGZIP_HEADER_SIZE 20
+#define PGZIP_TRAILER_SIZE 8
+static const uint8_t kPgzipHeader[PGZIP_HEADER_SIZE - 4] = {
+  0x1f, 0x8b, Z_DEFLATED, 0x04, 0, 0, 0, 0, 0, 0xff, 8, 0, 'B', 'U', 4, 0,
+};
+
+struct pgzip_chunk {
+  std::vector<uint8_t> in;
+  std::vector<uint8_t> out;
+  bool done = false;
+  bool ok = false;
+};
+
+static void put_le32(uint8_t* p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static uint32_t get_le32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+bool is_pgzip_header(const void* buf, size_t len) {
+  return len >= PGZIP_HEADER_SIZE && memcmp(buf, kPgzipHeader, sizeof(kPgzipHeader)) == 0;
+}
+
+static bool read_fully(int fd, void* buf, size_t len, size_t* nread) {
+  *nread = 0;
+  while (*nread < len) {
+    uint64_t start = stats_now();
+    ssize_t n = ::read(fd, (uint8_t*)buf + *nread, len - *nread);
+    stats_add(STAT_SOCKET, n > 0 ? n : 0, start);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      logmsg("read_fully: error: %s\n", strerror(errno));
+      return false;
+    }
+    if (n == 0) break;
+    *nread += n;
+  }
+  return true;
+}
+
+static int default_threads(int threads) {
+  if (threads > 0) return threads;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return cpus > 0 ? cpus : 1;
+}
+
+// Runs |work| on the shared thread pool, or on the calling thread if the pool takes no more tasks.
+static void run_on_pool(const std::function<void()>& work) {
+  if (!ThreadPool::Shared().Submit(work)) {
+    work();
+  }
+}
+
+class ParallelGzipWriter : public StreamWriter {
+ public:
+  ParallelGzipWriter(int fd, int threads)
+      : out_(fd), threads_(threads), failed_(false), running_(0), stopping_(false) {
+    max_pending_ = threads * PGZIP_CHUNKS_PER_THREAD;
+    current_.reset(new pgzip_chunk);
+    current_->in.reserve(PGZIP_CHUNK_SIZE);
+  }
+
+  ~ParallelGzipWriter() override {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stopping_ = true;
+    done_cond_.wait(lock, [this] { return running_ == 0; });
+  }
+
+  ssize_t Write(const void* buf, size_t len) override {
+    const uint8_t* p = (const uint8_t*)buf;
+    size_t left = len;
+    while (left > 0) {
+      size_t n = std::min(left, PGZIP_CHUNK_SIZE - current_->in.size());
+      current_->in.insert(current_->in.end(), p, p + n);
+      p += n;
+      left -= n;
+      if (current_->in.size() == PGZIP_CHUNK_SIZE && !Submit()) {
+        return -1;
+      }
+    }
+    return len;
+  }
+
+  bool Finish() override {
+    if (!current_->in.empty() && !Submit()) {
+      return false;
+    }
+    return WriteDone(0) && out_.Flush();
+  }
+
+ private:
+  // Hands the current chunk to the workers, and writes out the chunks that are done, in order.
+  bool Submit() {
+    bool start;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_.push_back(current_);
+      queue_.push_back(current_.get());
+      start = running_ < threads_;
+      if (start) running_++;
+    }
+    if (start) {
+      run_on_pool([this] { Work(); });
+    }
+    current_.reset(new pgzip_chunk);
+    current_->in.reserve(PGZIP_CHUNK_SIZE);
+    return WriteDone(max_pending_ - 1);
+  }
+
+  // Writes out the chunks that are done, waiting for those needed to leave at most |max_pending|.
+  bool WriteDone(size_t max_pending) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!pending_.empty()) {
+      std::shared_ptr<pgzip_chunk> chunk = pending_.front();
+      if (!chunk->done) {
+        if (pending_.size() <= max_pending) break;
+        done_cond_.wait(lock, [&chunk] { return chunk->done; });
+      }
+      pending_.pop_front();
+      lock.unlock();
+      if (!chunk->ok || !out_.Write(chunk->out.data(), chunk->out.size())) {
+        failed_ = true;
+      }
+      lock.lock();
+    }
+    return !failed_;
+  }
+
+  // Compresses the queued chunks, one of at most |threads_| tasks on the pool at a time, until
+  // there are none left.
+  void Work() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_ && !queue_.empty()) {
+      pgzip_chunk* chunk = queue_.front();
+      queue_.pop_front();
+      lock.unlock();
+
+      bool ok = Compress(chunk);
+
+      lock.lock();
+      chunk->ok = ok;
+      chunk->done = true;
+      done_cond_.notify_all();
+    }
+    running_--;
+    done_cond_.notify_all();
+  }
+
+  // Compresses the chunk into a complete gzip member.
+  static bool Compress(pgzip_chunk* chunk) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    // The header and the trailer are written here, around the raw deflate data.
+    if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+      logmsg("pgzip: deflateInit2 failed\n");
+      return false;
+    }
+    chunk->out.resize(PGZIP_HEADER_SIZE + deflateBound(&strm, chunk->in.size()) +
+                      PGZIP_TRAILER_SIZE);
+    strm.next_in = chunk->in.data();
+    strm.avail_in = chunk->in.size();
+    strm.next_out = chunk->out.data() + PGZIP_HEADER_SIZE;
+    strm.avail_out = chunk->out.size() - PGZIP_HEADER_SIZE - PGZIP_TRAILER_SIZE;
+    int ret = deflate(&strm, Z_FINISH);
+    size_t size = PGZIP_HEADER_SIZE + strm.total_out + PGZIP_TRAILER_SIZE;
+    deflateEnd(&strm);
+    if (ret != Z_STREAM_END) {
+      logmsg("pgzip: deflate failed: %d\n", ret);
+      return false;
+    }
+
+    uint8_t* out = chunk->out.data();
+    memcpy(out, kPgzipHeader, sizeof(kPgzipHeader));
+    put_le32(out + sizeof(kPgzipHeader), size);
+    uint8_t* trailer = out + size - PGZIP_TRAILER_SIZE;
+    put_le32(trailer, crc32(0, chunk->in.data(), chunk->in.size()));
+    put_le32(trailer + 4, chunk->in.size());
+    chunk->out.resize(size);
+    std::vector<uint8_t>().swap(chunk->in);
+    return true;
+  }
+
+  AsyncFdWriter out_;
+  int threads_;
+  size_t max_pending_;
+  bool failed_;
+
+  std::shared_ptr<pgzip_chunk> current_;
+
+  std::mutex mutex_;
+  std::condition_variable done_cond_;
+  std::deque<std::shared_ptr<pgzip_chunk>> pending_;  // Submitted chunks, in stream order
+  std::deque<pgzip_chunk*> queue_;                    // Chunks not picked up by a worker yet
+  int running_;                                       // Work() tasks queued or running
+  bool stopping_;
+};
+
+class ZstdWriter : public StreamWriter {
+ public:
+  ZstdWriter(int fd, int threads) : writer_(fd), out_(ZSTD_CStreamOutSize()) {
+    cctx_ = ZSTD_createCCtx();
+    // This fails without the multi-threading support in libzstd, which then compresses on the
+    // calling thread.
+    size_t ret = ZSTD_CCtx_setParameter(cctx_, ZSTD_c_nbWorkers, threads);
+    if (ZSTD_isError(ret)) {
+      logmsg("zstd: no worker threads: %s\n", ZSTD_getErrorName(ret));
+    }
+  }
+
+  ~ZstdWriter() override {
+    ZSTD_freeCCtx(cctx_);
+  }
+
+  ssize_t Write(const void* buf, size_t len) override {
+    ZSTD_inBuffer in = { buf, len, 0 };
+    while (in.pos < in.size) {
+      if (!Compress(&in, ZSTD_e_continue)) return -1;
+    }
+    return len;
+  }
+
+  bool Finish() override {
+    ZSTD_inBuffer in = { nullptr, 0, 0 };
+    size_t remaining;
+    do {
+      ZSTD_outBuffer out = { out_.data(), out_.size(), 0 };
+      remaining = ZSTD_compressStream2(cctx_, &out, &in, ZSTD_e_end);
+      if (ZSTD_isError(remaining)) {
+        logmsg("zstd: compression failed: %s\n", ZSTD_getErrorName(remaining));
+        return false;
+      }
+      if (!writer_.Write(out_.data(), out.pos)) return false;
+    } while (remaining != 0);
+    return writer_.Flush();
+  }
+
+ private:
+  bool Compress(ZSTD_inBuffer* in, ZSTD_EndDirective mode) {
+    ZSTD_outBuffer out = { out_.data(), out_.size(), 0 };
+    size_t ret = ZSTD_compressStream2(cctx_, &out, in, mode);
+    if (ZSTD_isError(ret)) {
+      logmsg("zstd: compression failed: %s\n", ZSTD_getErrorName(ret));
+      return false;
+    }
+    return writer_.Write(out_.data(), out.pos);
+  }
+
+  AsyncFdWriter writer_;
+  ZSTD_CCtx* cctx_;
+  std::vector<uint8_t> out_;
+};
+
+class ZstdReader : public StreamReader {
+ public:
+  explicit ZstdReader(int fd) : fd_(fd), buf_(ZSTD_DStreamInSize()), in_{ buf_.data(), 0, 0 } {
+    dctx_ = ZSTD_createDCtx();
+  }
+
+  ~ZstdReader() override {
+    ZSTD_freeDCtx(dctx_);
+  }
+
+  ssize_t Read(void* buf, size_t len) override {
+    ZSTD_outBuffer out = { buf, len, 0 };
+    while (out.pos == 0) {
+      if (in_.pos == in_.size) {
+        uint64_t start = stats_now();
+        ssize_t n;
+        do {
+          n = ::read(fd_, buf_.data(), buf_.size());
+        } while (n < 0 && errno == EINTR);
+        stats_add(STAT_SOCKET, n > 0 ? n : 0, start);
+        if (n <= 0) return n;
+        in_.size = n;
+        in_.pos = 0;
+      }
+      size_t ret = ZSTD_decompressStream(dctx_, &out, &in_);
+      if (ZSTD_isError(ret)) {
+        logmsg("zstd: decompression failed: %s\n", ZSTD_getErrorName(ret));
+        errno = EIO;
+        return -1;
+      }
+    }
+    return out.pos;
+  }
+
+ private:
+  int fd_;
+  ZSTD_DCtx* dctx_;
+  std::vector<uint8_t> buf_;
+  ZSTD_inBuffer in_;
+};
+
+class ParallelGzipReader : public StreamReader {
+ public:
+  ParallelGzipReader(int fd, int threads)
+      : fd_(fd),
+        threads_(threads),
+        running_(0),
+        done_(false),
+        failed_(false),
+        stopping_(false),
+        pos_(0),
+        feeder_([this] { return Feed(); }) {
+    max_pending_ = threads * PGZIP_CHUNKS_PER_THREAD;
+    feeder_.Kick();
+  }
+
+  ~ParallelGzipReader() override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    feeder_.Wait();
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this] { return running_ == 0; });
+  }
+
+  ssize_t Read(void* buf, size_t len) override {
+    while (current_ == nullptr || pos_ == current_->out.size()) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      current_.reset();
+      cond_.wait(lock, [this] { return (!pending_.empty() && pending_.front()->done) ||
+                                       (pending_.empty() && done_); });
+      if (pending_.empty()) {
+        return failed_ ? -1 : 0;
+      }
+      current_ = pending_.front();
+      pending_.pop_front();
+      bool ok = current_->ok;
+      if (!ok) failed_ = true;
+      lock.unlock();
+      // There's room for another member now.
+      feeder_.Kick();
+      if (!ok) {
+        errno = EIO;
+        return -1;
+      }
+      pos_ = 0;
+    }
+    size_t n = std::min(len, current_->out.size() - pos_);
+    memcpy(buf, current_->out.data() + pos_, n);
+    pos_ += n;
+    return n;
+  }
+
+ private:
+  // Reads the next member off the fd, and queues it for the workers. Returns false while there's
+  // no room for it, and at the end of the stream.
+  bool Feed() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stopping_ || done_ || pending_.size() >= max_pending_) return false;
+    }
+
+    std::shared_ptr<pgzip_chunk> chunk(new pgzip_chunk);
+    uint8_t header[PGZIP_HEADER_SIZE];
+    size_t n;
+    if (!read_fully(fd_, header, sizeof(header), &n)) {
+      return FeedDone(false);
+    }
+    if (n == 0) return FeedDone(true);
+    if (!is_pgzip_header(header, n)) {
+      logmsg("pgzip: bad member header\n");
+      return FeedDone(false);
+    }
+    uint32_t size = get_le32(header + PGZIP_HEADER_SIZE - 4);
+    if (size < PGZIP_HEADER_SIZE + PGZIP_TRAILER_SIZE) {
+      logmsg("pgzip: bad member size %u\n", size);
+      return FeedDone(false);
+    }
+    chunk->in.resize(size - PGZIP_HEADER_SIZE);
+    if (!read_fully(fd_, chunk->in.data(), chunk->in.size(), &n) || n != chunk->in.size()) {
+      logmsg("pgzip: truncated member\n");
+      return FeedDone(false);
+    }
+
+    bool start;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stopping_) return false;
+      pending_.push_back(chunk);
+      queue_.push_back(chunk.get());
+      start = running_ < threads_;
+      if (start) running_++;
+    }
+    if (start) {
+      run_on_pool([this] { Work(); });
+    }
+    return true;
+  }
+
+  // Marks the end of the members. Returns false, for Feed() to stop.
+  bool FeedDone(bool ok) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!ok) failed_ = true;
+    done_ = true;
+    cond_.notify_all();
+    return false;
+  }
+
+  // Inflates the queued members, one of at most |threads_| tasks on the pool at a time, until there
+  // are none left.
+  void Work() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_ && !queue_.empty()) {
+      pgzip_chunk* chunk = queue_.front();
+      queue_.pop_front();
+      lock.unlock();
+
+      bool ok = Decompress(chunk);
+
+      lock.lock();
+      chunk->ok = ok;
+      chunk->done = true;
+      cond_.notify_all();
+    }
+    running_--;
+    cond_.notify_all();
+  }
+
+  // Inflates the member in |chunk->in| (past its header), and checks it against its trailer.
+  static bool Decompress(pgzip_chunk* chunk) {
+    const uint8_t* trailer = chunk->in.data() + chunk->in.size() - PGZIP_TRAILER_SIZE;
+    uint32_t crc = get_le32(trailer);
+    uint32_t isize = get_le32(trailer + 4);
+    if (isize > PGZIP_CHUNK_SIZE) {
+      logmsg("pgzip: bad member length %u\n", isize);
+      return false;
+    }
+    chunk->out.resize(isize);
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, -MAX_WBITS) != Z_OK) {
+      logmsg("pgzip: inflateInit2 failed\n");
+      return false;
+    }
+    strm.next_in = chunk->in.data();
+    strm.avail_in = chunk->in.size() - PGZIP_TRAILER_SIZE;
+    strm.next_out = chunk->out.data();
+    strm.avail_out = chunk->out.size();
+    int ret = inflate(&strm, Z_FINISH);
+    bool ok = ret == Z_STREAM_END && strm.total_out == isize;
+    inflateEnd(&strm);
+    if (!ok || crc32(0, chunk->out.data(), chunk->out.size()) != crc) {
+      logmsg("pgzip: corrupt member (%d)\n", ret);
+      return false;
+    }
+    std::vector<uint8_t>().swap(chunk->in);
+    return true;
+  }
+
+  int fd_;
+  int threads_;
+  size_t max_pending_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<std::shared_ptr<pgzip_chunk>> pending_;  // Members read, in stream order
+  std::deque<pgzip_chunk*> queue_;                    // Members not picked up by a worker yet
+  int running_;                                       // Work() tasks queued or running
+  bool done_;                                         // No more members will be read
+  bool failed_;
+  bool stopping_;
+
+  std::shared_ptr<pgzip_chunk> current_;  // The member Read() is returning
+  size_t pos_;
+
+  PoolStage feeder_;
+};
+
+StreamWriter* stream_writer_open(int fd, const char* compress, int threads) {
+  if (strcasecmp(compress, "pgzip") == 0) {
+    return new ParallelGzipWriter(fd, default_threads(threads));
+  }
+  if (strcasecmp(compress, "zstd") == 0) {
+    return new ZstdWriter(fd, default_threads(threads));
+  }
+  return nullptr;
+}
+
+StreamReader* stream_reader_open(int fd, const char* compress, int threads) {
+  if (strcasecmp(compress, "pgzip") == 0) {
+    return new ParallelGzipReader(fd, default_threads(threads));
+  }
+  if (strcasecmp(compress, "zstd") == 0) {
+    return new ZstdReader(fd);
+  }
+  return nullptr;
+}
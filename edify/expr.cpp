@@ -22,8 +22,11 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <memory>
+#include <numeric>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -47,6 +50,12 @@ bool Evaluate(State* state, const std::unique_ptr<Expr>& expr, std::string* resu
         return false;
     }
 
+    // Most arguments are literals; don't go through a Value for them.
+    if (expr->fn == Literal) {
+        *result = expr->name.c_str();
+        return true;
+    }
+
     std::unique_ptr<Value> v(expr->fn(expr->name.c_str(), state, expr->argv));
     if (!v) {
         return false;
@@ -61,6 +70,9 @@ bool Evaluate(State* state, const std::unique_ptr<Expr>& expr, std::string* resu
 }
 
 Value* EvaluateValue(State* state, const std::unique_ptr<Expr>& expr) {
+    if (state->evaluate_hook != nullptr && expr->fn != Literal) {
+        return state->evaluate_hook(state, *expr);
+    }
     return expr->fn(expr->name.c_str(), state, expr->argv);
 }
 
@@ -128,14 +140,59 @@ Value* AssertFn(const char* name, State* state, const std::vector<std::unique_pt
             return nullptr;
         }
         if (result.empty()) {
-            int len = argv[i]->end - argv[i]->start;
-            state->errmsg = "assert failed: " + state->script.substr(argv[i]->start, len);
+            state->errmsg = "assert failed: " + state->Source(argv[i]->start, argv[i]->end);
             return nullptr;
         }
     }
     return StringValue("");
 }
 
+// parallel(expr1, expr2, ...)
+//   Evaluates the expressions concurrently, each on a thread of its own, and returns the value of
+//   the last one once all of them are done. Fails with the error of the first of them that fails.
+//   The expressions must not depend on one another, or write the same files or partitions. The
+//   progress they report with set_progress() counts towards the segment that's current when
+//   parallel() starts, each branch for an equal share.
+Value* ParallelFn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv) {
+    if (argv.empty()) {
+        return ErrorAbort(state, kArgsParsingFailure, "%s() expects at least 1 arg", name);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(state->branch_mutex);
+        state->branch_progress.assign(argv.size(), 0.0);
+    }
+    std::vector<std::unique_ptr<State>> states;
+    std::vector<std::unique_ptr<Value>> results(argv.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < argv.size(); ++i) {
+        states.push_back(std::make_unique<State>(state->script, state->script_len, state->cookie));
+        states[i]->is_retry = state->is_retry;
+        states[i]->parent = state;
+        states[i]->branch = i;
+        states[i]->evaluate_hook = state->evaluate_hook;
+        threads.emplace_back(
+            [&, i]() { results[i].reset(EvaluateValue(states[i].get(), argv[i])); });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    {
+        std::lock_guard<std::mutex> lock(state->branch_mutex);
+        state->branch_progress.clear();
+    }
+
+    for (size_t i = 0; i < argv.size(); ++i) {
+        if (!results[i]) {
+            state->errmsg = states[i]->errmsg;
+            state->error_code = states[i]->error_code;
+            state->cause_code = states[i]->cause_code;
+            return nullptr;
+        }
+    }
+    return results.back().release();
+}
+
 Value* SleepFn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv) {
     std::string val;
     if (!Evaluate(state, argv[0], &val)) {
@@ -243,12 +300,16 @@ Value* InequalityFn(const char* name, State* state,
     return StringValue(result);
 }
 
+// Evaluates each statement in turn, and returns the value of the last one. The parser builds
+// "a; b; c" as nested pairs; SimplifyExpr() turns a whole script into a single sequence.
 Value* SequenceFn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv) {
-    std::unique_ptr<Value> left(EvaluateValue(state, argv[0]));
-    if (!left) {
-        return nullptr;
+    for (size_t i = 0; i + 1 < argv.size(); ++i) {
+        std::unique_ptr<Value> v(EvaluateValue(state, argv[i]));
+        if (!v) {
+            return nullptr;
+        }
     }
-    return EvaluateValue(state, argv[1]);
+    return EvaluateValue(state, argv.back());
 }
 
 Value* LessThanIntFn(const char* name, State* state,
@@ -311,6 +372,102 @@ Value* Literal(const char* name, State* state, const std::vector<std::unique_ptr
     return StringValue(name);
 }
 
+// -----------------------------------------------------------------
+//   simplifying parsed expressions
+// -----------------------------------------------------------------
+
+static bool IsLiteral(const std::unique_ptr<Expr>& expr) {
+    return expr->fn == Literal;
+}
+
+// Replaces |expr| by |replacement|, which takes over its place in the script for error messages.
+static void Replace(std::unique_ptr<Expr>* expr, std::unique_ptr<Expr> replacement) {
+    replacement->start = (*expr)->start;
+    replacement->end = (*expr)->end;
+    *expr = std::move(replacement);
+}
+
+// Moves the operands of nested calls of |fn| into |expr| itself, so that "a + b + c" becomes one
+// concat() of three. This goes without recursion, since thousands of statements nest that deep.
+static void Flatten(Expr* expr) {
+    std::vector<std::unique_ptr<Expr>> pending;
+    for (auto it = expr->argv.rbegin(); it != expr->argv.rend(); ++it) {
+        pending.push_back(std::move(*it));
+    }
+    expr->argv.clear();
+    while (!pending.empty()) {
+        std::unique_ptr<Expr> arg = std::move(pending.back());
+        pending.pop_back();
+        if (arg->fn == expr->fn) {
+            for (auto it = arg->argv.rbegin(); it != arg->argv.rend(); ++it) {
+                pending.push_back(std::move(*it));
+            }
+        } else {
+            expr->argv.push_back(std::move(arg));
+        }
+    }
+}
+
+// Joins adjacent literal arguments of a concat(), so that 'a + b + x() + c + d' concatenates three
+// strings rather than five at run time.
+static void FoldLiteralRuns(Expr* expr) {
+    std::vector<std::unique_ptr<Expr>> argv;
+    for (auto& arg : expr->argv) {
+        if (IsLiteral(arg) && !argv.empty() && IsLiteral(argv.back())) {
+            Expr* run = argv.back().get();
+            run->name = std::string(run->name.c_str()) + arg->name.c_str();
+            run->end = arg->end;
+        } else {
+            argv.push_back(std::move(arg));
+        }
+    }
+    expr->argv = std::move(argv);
+}
+
+void SimplifyExpr(std::unique_ptr<Expr>* expr) {
+    Expr* e = expr->get();
+    if (e->fn == SequenceFn || e->fn == ConcatFn) {
+        Flatten(e);
+    }
+    for (auto& arg : e->argv) {
+        SimplifyExpr(&arg);
+    }
+
+    // Fold the operators whose operands are all literals, which can neither fail nor have side
+    // effects; and short-circuit the ones whose outcome a literal condition already decides.
+    if (e->fn == ConcatFn) {
+        FoldLiteralRuns(e);
+    }
+    if (e->fn == ConcatFn || e->fn == EqualityFn || e->fn == InequalityFn ||
+        e->fn == LogicalNotFn) {
+        if (!std::all_of(e->argv.begin(), e->argv.end(), IsLiteral)) {
+            return;
+        }
+        State state("", nullptr);
+        std::unique_ptr<Value> v(e->fn(e->name.c_str(), &state, e->argv));
+        if (v && v->type == VAL_STRING) {
+            Replace(expr, std::make_unique<Expr>(Literal, v->data, e->start, e->end));
+        }
+    } else if (e->fn == LogicalAndFn || e->fn == LogicalOrFn || e->fn == IfElseFn) {
+        if (e->argv.size() < 2 || e->argv.size() > 3 || !IsLiteral(e->argv[0])) {
+            return;
+        }
+        bool cond = BooleanString(e->argv[0]->name.c_str());
+        if (e->fn == LogicalAndFn) {
+            Replace(expr, cond ? std::move(e->argv[1])
+                               : std::make_unique<Expr>(Literal, "", e->start, e->end));
+        } else if (e->fn == LogicalOrFn) {
+            Replace(expr, cond ? std::move(e->argv[0]) : std::move(e->argv[1]));
+        } else if (cond) {
+            Replace(expr, std::move(e->argv[1]));
+        } else {
+            Replace(expr, e->argv.size() == 3
+                              ? std::move(e->argv[2])
+                              : std::make_unique<Expr>(Literal, "", e->start, e->end));
+        }
+    }
+}
+
 // -----------------------------------------------------------------
 //   the function table
 // -----------------------------------------------------------------
@@ -321,12 +478,17 @@ void RegisterFunction(const std::string& name, Function fn) {
     fn_table[name] = fn;
 }
 
-Function FindFunction(const std::string& name) {
-    if (fn_table.find(name) == fn_table.end()) {
-        return nullptr;
-    } else {
-        return fn_table[name];
+std::vector<std::string> RegisteredFunctionNames() {
+    std::vector<std::string> names;
+    for (const auto& entry : fn_table) {
+        names.push_back(entry.first);
     }
+    return names;
+}
+
+Function FindFunction(const std::string& name) {
+    auto it = fn_table.find(name);
+    return it == fn_table.end() ? nullptr : it->second;
 }
 
 void RegisterBuiltins() {
@@ -337,6 +499,7 @@ void RegisterBuiltins() {
     RegisterFunction("is_substring", SubstringFn);
     RegisterFunction("stdout", StdoutFn);
     RegisterFunction("sleep", SleepFn);
+    RegisterFunction("parallel", ParallelFn);
 
     RegisterFunction("less_than_int", LessThanIntFn);
     RegisterFunction("greater_than_int", GreaterThanIntFn);
@@ -373,6 +536,41 @@ bool ReadArgs(State* state, const std::vector<std::unique_ptr<Expr>>& argv,
     return true;
 }
 
+bool ReadArgs(State* state, const std::vector<std::unique_ptr<Expr>>& argv, StringArgs* args) {
+    return ReadArgs(state, argv, args, 0, argv.size());
+}
+
+bool ReadArgs(State* state, const std::vector<std::unique_ptr<Expr>>& argv, StringArgs* args,
+              size_t start, size_t len) {
+    if (args == nullptr) {
+        return false;
+    }
+    if (start + len > argv.size()) {
+        return false;
+    }
+    // Reserved up front so that the pointers into values_ stay put.
+    args->args_.clear();
+    args->values_.clear();
+    args->values_.reserve(len);
+    for (size_t i = start; i < start + len; ++i) {
+        const std::unique_ptr<Expr>& expr = argv[i];
+        // A literal reads up to its first NUL; anything containing one gets copied below.
+        if (expr->fn == Literal && memchr(expr->name.data(), '\0', expr->name.size()) == nullptr) {
+            args->args_.push_back(&expr->name);
+            continue;
+        }
+        std::string var;
+        if (!Evaluate(state, expr, &var)) {
+            args->args_.clear();
+            args->values_.clear();
+            return false;
+        }
+        args->values_.push_back(std::move(var));
+        args->args_.push_back(&args->values_.back());
+    }
+    return true;
+}
+
 // Evaluate the expressions in argv, and put the results of Value* in args. If any expression
 // evaluate to nullptr, return false. Return true on success.
 bool ReadValueArgs(State* state, const std::vector<std::unique_ptr<Expr>>& argv,
@@ -399,6 +597,28 @@ bool ReadValueArgs(State* state, const std::vector<std::unique_ptr<Expr>>& argv,
     return true;
 }
 
+const Value* LazyArgs::Get(size_t i) {
+    if (!evaluated_[i]) {
+        values_[i].reset(EvaluateValue(state_, argv_[i]));
+        evaluated_[i] = true;
+    }
+    return values_[i].get();
+}
+
+double BranchProgress(State* state, double fraction) {
+    for (; state->parent != nullptr; state = state->parent) {
+        State* parent = state->parent;
+        std::lock_guard<std::mutex> lock(parent->branch_mutex);
+        if (state->branch >= parent->branch_progress.size()) {
+            break;
+        }
+        parent->branch_progress[state->branch] = fraction;
+        fraction = std::accumulate(parent->branch_progress.begin(), parent->branch_progress.end(),
+                                   0.0) / parent->branch_progress.size();
+    }
+    return fraction;
+}
+
 // Use printf-style arguments to compose an error message to put into
 // *state.  Returns nullptr.
 Value* ErrorAbort(State* state, const char* format, ...) {
@@ -422,4 +642,19 @@ Value* ErrorAbort(State* state, CauseCode cause_code, const char* format, ...) {
 }
 
 State::State(const std::string& script, void* cookie)
-    : script(script), cookie(cookie), error_code(kNoError), cause_code(kNoCause) {}
+    : State(script.data(), script.size(), cookie) {}
+
+State::State(const char* script, void* cookie) : State(script, strlen(script), cookie) {}
+
+State::State(const char* script, size_t script_len, void* cookie)
+    : script(script),
+      script_len(script_len),
+      cookie(cookie),
+      error_code(kNoError),
+      cause_code(kNoCause) {}
+
+std::string State::Source(int start, int end) const {
+    size_t from = std::min<size_t>(std::max(start, 0), script_len);
+    size_t to = std::max(std::min<size_t>(std::max(end, 0), script_len), from);
+    return std::string(script + from, to - from);
+}
@@ -20,18 +20,30 @@
 #include <unistd.h>
 
 #include <memory>
+#include <mutex>
 #include <string>
+#include <utility>
 #include <vector>
 
 // Forward declaration to avoid including "otautil/error_code.h".
 enum ErrorCode : int;
 enum CauseCode : int;
 
+struct Expr;
+struct Value;
+
 struct State {
   State(const std::string& script, void* cookie);
+  State(const char* script, void* cookie);
+  State(const char* script, size_t script_len, void* cookie);
+
+  // The source of the original script, which has to outlive the State. It isn't necessarily
+  // null-terminated, e.g. when it's the entry in the mapped package.
+  const char* script;
+  size_t script_len;
 
-  // The source of the original script.
-  const std::string& script;
+  // Returns the source of the script between the offsets |start| and |end| (as in an Expr).
+  std::string Source(int start, int end) const;
 
   // Optional pointer to app-specific data; the core of edify never
   // uses this value.
@@ -51,6 +63,19 @@ struct State {
   CauseCode cause_code;
 
   bool is_retry = false;
+
+  // In a branch of parallel(): the state that called parallel(), and the index of the branch.
+  State* parent = nullptr;
+  size_t branch = 0;
+
+  // While this state runs parallel(): the progress last reported by each of the branches. See
+  // BranchProgress().
+  std::mutex branch_mutex;
+  std::vector<double> branch_progress;
+
+  // If set, EvaluateValue() hands each function call to it rather than calling the function, e.g.
+  // to profile the script. It has to call expr.fn itself.
+  Value* (*evaluate_hook)(State* state, const Expr& expr) = nullptr;
 };
 
 enum ValueType {
@@ -66,6 +91,25 @@ struct Value {
     Value(ValueType type, const std::string& str) :
         type(type),
         data(str) {}
+
+    // A VAL_BLOB that refers to memory owned elsewhere, such as a stored entry of the mapped
+    // package, instead of holding a copy in 'data'. 'owner' (if any) keeps that memory alive for
+    // as long as the value.
+    Value(const void* addr, size_t len, std::shared_ptr<const void> owner = nullptr) :
+        type(VAL_BLOB),
+        view_(static_cast<const char*>(addr)),
+        view_len_(len),
+        owner_(std::move(owner)) {}
+
+    // The contents, wherever they live. Functions taking blobs read them through these rather
+    // than 'data', which is empty for a referenced blob.
+    const char* bytes() const { return view_ != nullptr ? view_ : data.data(); }
+    size_t size() const { return view_ != nullptr ? view_len_ : data.size(); }
+
+  private:
+    const char* view_ = nullptr;
+    size_t view_len_ = 0;
+    std::shared_ptr<const void> owner_;
 };
 
 struct Expr;
@@ -79,9 +123,9 @@ struct Expr {
   std::vector<std::unique_ptr<Expr>> argv;
   int start, end;
 
-  Expr(Function fn, const std::string& name, int start, int end) :
+  Expr(Function fn, std::string name, int start, int end) :
     fn(fn),
-    name(name),
+    name(std::move(name)),
     start(start),
     end(end) {}
 };
@@ -113,6 +157,7 @@ Value* SequenceFn(const char* name, State* state, const std::vector<std::unique_
 Value* IfElseFn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv);
 Value* AssertFn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv);
 Value* AbortFn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv);
+Value* ParallelFn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv);
 
 // Register a new function.  The same Function may be registered under
 // multiple names, but a given name should only be used once.
@@ -125,6 +170,9 @@ void RegisterBuiltins();
 // exists.
 Function FindFunction(const std::string& name);
 
+// Return the names of all the registered functions.
+std::vector<std::string> RegisteredFunctionNames();
+
 // --- convenience functions for use in functions ---
 
 // Evaluate the expressions in argv, and put the results of strings in args. If any expression
@@ -134,6 +182,29 @@ bool ReadArgs(State* state, const std::vector<std::unique_ptr<Expr>>& argv,
 bool ReadArgs(State* state, const std::vector<std::unique_ptr<Expr>>& argv,
               std::vector<std::string>* args, size_t start, size_t len);
 
+// The string arguments of a function, as read by the ReadArgs() overloads below. A literal argument
+// refers to the text of the parsed script instead of a copy, so the strings are only valid for as
+// long as the Expr they came from.
+class StringArgs {
+  public:
+    size_t size() const { return args_.size(); }
+    bool empty() const { return args_.empty(); }
+    const std::string& operator[](size_t i) const { return *args_[i]; }
+
+  private:
+    friend bool ReadArgs(State* state, const std::vector<std::unique_ptr<Expr>>& argv,
+                         StringArgs* args, size_t start, size_t len);
+
+    std::vector<const std::string*> args_;
+    // The results of the arguments that aren't literals.
+    std::vector<std::string> values_;
+};
+
+// Like the above, but without copying the literal arguments.
+bool ReadArgs(State* state, const std::vector<std::unique_ptr<Expr>>& argv, StringArgs* args);
+bool ReadArgs(State* state, const std::vector<std::unique_ptr<Expr>>& argv, StringArgs* args,
+              size_t start, size_t len);
+
 // Evaluate the expressions in argv, and put the results of Value* in args. If any
 // expression evaluate to nullptr, return false. Return true on success.
 bool ReadValueArgs(State* state, const std::vector<std::unique_ptr<Expr>>& argv,
@@ -141,6 +212,31 @@ bool ReadValueArgs(State* state, const std::vector<std::unique_ptr<Expr>>& argv,
 bool ReadValueArgs(State* state, const std::vector<std::unique_ptr<Expr>>& argv,
                    std::vector<std::unique_ptr<Value>>* args, size_t start, size_t len);
 
+// The arguments of a function, evaluated only when they're first asked for and kept from then on,
+// for functions that may not need all of them.
+class LazyArgs {
+  public:
+    LazyArgs(State* state, const std::vector<std::unique_ptr<Expr>>& argv)
+        : state_(state), argv_(argv), values_(argv.size()), evaluated_(argv.size(), false) {}
+
+    size_t size() const { return argv_.size(); }
+
+    // Returns the value of argument |i|, evaluating it on the first call. Returns nullptr (every
+    // time) if the evaluation failed, with the error left in the State.
+    const Value* Get(size_t i);
+
+  private:
+    State* state_;
+    const std::vector<std::unique_ptr<Expr>>& argv_;
+    std::vector<std::unique_ptr<Value>> values_;
+    std::vector<bool> evaluated_;
+};
+
+// Returns the progress to report for the |fraction| of the current progress segment that a function
+// running in |state| has done. Inside parallel(), that's the mean over all of its branches (which
+// may be nested); otherwise it's |fraction| itself.
+double BranchProgress(State* state, double fraction);
+
 // Use printf-style arguments to compose an error message to put into
 // *state.  Returns NULL.
 Value* ErrorAbort(State* state, const char* format, ...)
@@ -156,6 +252,17 @@ Value* StringValue(const char* str);
 
 Value* StringValue(const std::string& str);
 
+// Parses the script in 'str' into '*root', and simplifies it with SimplifyExpr().
 int parse_string(const char* str, std::unique_ptr<Expr>* root, int* error_count);
 
+// Like the above, for the 'len' bytes at 'str' (which don't have to be null-terminated). The lexer
+// reads them a buffer at a time, so that a large script can be parsed from where it lies, such as
+// a stored entry of the mapped package, without a copy of it.
+int parse_string(const char* str, size_t len, std::unique_ptr<Expr>* root, int* error_count);
+
+// Rewrites a parsed expression into an equivalent one that is cheaper to evaluate: chains of ';'
+// and '+' become a single call each, operators on literals are folded (as are runs of literal
+// arguments to concat()), and branches on literal conditions are decided.
+void SimplifyExpr(std::unique_ptr<Expr>* expr);
+
 #endif  // _EXPRESSION_H
@@ -16,6 +16,8 @@
  */
 
 #include <string.h>
+
+#include <algorithm>
 #include <string>
 
 #include "edify/expr.h"
@@ -28,6 +30,20 @@ int gPos = 0;
 
 std::string string_buffer;
 
+// The rest of the script being scanned, which flex copies in a buffer at a time rather than all at
+// once. See yy_scan_view().
+static const char* input_data = nullptr;
+static size_t input_left = 0;
+
+#define YY_INPUT(buf, result, max_size) \
+    do { \
+        size_t n = std::min(static_cast<size_t>(max_size), input_left); \
+        memcpy(buf, input_data, n); \
+        input_data += n; \
+        input_left -= n; \
+        result = n; \
+    } while (0)
+
 #define ADVANCE do {yylloc.start=gPos; yylloc.end=gPos+yyleng; \
                     gColumn+=yyleng; gPos+=yyleng;} while(0)
 
@@ -38,6 +54,7 @@ std::string string_buffer;
 %option noinput
 %option nounput
 %option noyywrap
+%option never-interactive
 
 %%
 
@@ -55,7 +72,7 @@ std::string string_buffer;
       ++gColumn;
       ++gPos;
       BEGIN(INITIAL);
-      yylval.str = strdup(string_buffer.c_str());
+      yylval.str = new std::string(std::move(string_buffer));
       yylloc.end = gPos;
       return STRING;
   }
@@ -94,7 +111,7 @@ endif             ADVANCE; return ENDIF;
 
 [a-zA-Z0-9_:/.]+ {
   ADVANCE;
-  yylval.str = strdup(yytext);
+  yylval.str = new std::string(yytext, yyleng);
   return STRING;
 }
 
@@ -110,3 +127,16 @@ endif             ADVANCE; return ENDIF;
 (#.*)?\n          gPos += yyleng; ++gLine; gColumn = 1;
 
 .                 return BAD;
+
+%%
+
+struct yy_buffer_state* yy_scan_view(const char* data, size_t len) {
+    input_data = data;
+    input_left = len;
+    gLine = 1;
+    gColumn = 1;
+    gPos = 0;
+    // In case the last script ended inside a string.
+    BEGIN(INITIAL);
+    return yy_create_buffer(nullptr, YY_BUF_SIZE);
+}
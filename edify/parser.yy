@@ -37,7 +37,8 @@ int yyparse(std::unique_ptr<Expr>* root, int* error_count);
 
 struct yy_buffer_state;
 void yy_switch_to_buffer(struct yy_buffer_state* new_buffer);
-struct yy_buffer_state* yy_scan_string(const char* yystr);
+void yy_delete_buffer(struct yy_buffer_state* buffer);
+struct yy_buffer_state* yy_scan_view(const char* data, size_t len);
 
 // Convenience function for building expressions with a fixed number
 // of arguments.
@@ -57,7 +58,7 @@ static Expr* Build(Function fn, YYLTYPE loc, size_t count, ...) {
 %locations
 
 %union {
-    char* str;
+    std::string* str;
     Expr* expr;
     std::vector<std::unique_ptr<Expr>>* args;
 }
@@ -67,6 +68,7 @@ static Expr* Build(Function fn, YYLTYPE loc, size_t count, ...) {
 %type <expr> expr
 %type <args> arglist
 
+%destructor { delete $$; } STRING
 %destructor { delete $$; } expr
 %destructor { delete $$; } arglist
 
@@ -89,7 +91,8 @@ input:  expr           { root->reset($1); }
 ;
 
 expr:  STRING {
-    $$ = new Expr(Literal, $1, @$.start, @$.end);
+    $$ = new Expr(Literal, std::move(*$1), @$.start, @$.end);
+    delete $1;
 }
 |  '(' expr ')'                      { $$ = $2; $$->start=@$.start; $$->end=@$.end; }
 |  expr ';'                          { $$ = $1; $$->start=@1.start; $$->end=@1.end; }
@@ -104,14 +107,19 @@ expr:  STRING {
 |  IF expr THEN expr ENDIF           { $$ = Build(IfElseFn, @$, 2, $2, $4); }
 |  IF expr THEN expr ELSE expr ENDIF { $$ = Build(IfElseFn, @$, 3, $2, $4, $6); }
 | STRING '(' arglist ')' {
-    Function fn = FindFunction($1);
+    Function fn = FindFunction(*$1);
     if (fn == nullptr) {
-        std::string msg = "unknown function \"" + std::string($1) + "\"";
+        std::string msg = "unknown function \"" + *$1 + "\"";
         yyerror(root, error_count, msg.c_str());
+        // YYERROR leaves the symbols of the rule to us.
+        delete $1;
+        delete $3;
         YYERROR;
     }
-    $$ = new Expr(fn, $1, @$.start, @$.end);
+    $$ = new Expr(fn, std::move(*$1), @$.start, @$.end);
     $$->argv = std::move(*$3);
+    delete $1;
+    delete $3;
 }
 ;
 
@@ -139,6 +147,16 @@ void yyerror(std::unique_ptr<Expr>* root, int* error_count, const char* s) {
 }
 
 int parse_string(const char* str, std::unique_ptr<Expr>* root, int* error_count) {
-    yy_switch_to_buffer(yy_scan_string(str));
-    return yyparse(root, error_count);
+    return parse_string(str, strlen(str), root, error_count);
+}
+
+int parse_string(const char* str, size_t len, std::unique_ptr<Expr>* root, int* error_count) {
+    struct yy_buffer_state* buffer = yy_scan_view(str, len);
+    yy_switch_to_buffer(buffer);
+    int result = yyparse(root, error_count);
+    yy_delete_buffer(buffer);
+    if (result == 0 && *error_count == 0 && *root) {
+        SimplifyExpr(root);
+    }
+    return result;
 }
@@ -28,32 +28,48 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <functional>
+#include <vector>
 
 #include <android-base/file.h>
 
 #include "fuse_sideload.h"
 
+// The sdcard is read in chunks of this size, which the blocks are then served from. The latency of
+// each request dominates on the slow cards, far more than the bytes read past what's needed.
+static constexpr size_t READ_AHEAD_SIZE = 1024 * 1024;
+
 struct file_data {
   int fd;  // the underlying sdcard file
 
   uint64_t file_size;
   uint32_t block_size;
-};
 
-static int read_block_file(const file_data& fd, uint32_t block, uint8_t* buffer,
-                           uint32_t fetch_size) {
-  off64_t offset = static_cast<off64_t>(block) * fd.block_size;
-  if (TEMP_FAILURE_RETRY(lseek64(fd.fd, offset, SEEK_SET)) == -1) {
-    fprintf(stderr, "seek on sdcard failed: %s\n", strerror(errno));
-    return -EIO;
-  }
+  // The chunk most recently read from the sdcard, holding |read_ahead_size| bytes of the file from
+  // |read_ahead_offset|.
+  std::vector<uint8_t> read_ahead;
+  uint64_t read_ahead_offset;
+  size_t read_ahead_size;
+};
 
-  if (!android::base::ReadFully(fd.fd, buffer, fetch_size)) {
-    fprintf(stderr, "read on sdcard failed: %s\n", strerror(errno));
-    return -EIO;
+// Called by one thread at a time, as run_fuse_sideload() serializes the calls into the provider.
+static int read_block_file(file_data* fd, uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
+  uint64_t offset = static_cast<uint64_t>(block) * fd->block_size;
+  if (offset < fd->read_ahead_offset ||
+      offset + fetch_size > fd->read_ahead_offset + fd->read_ahead_size) {
+    size_t size = std::max<uint64_t>(fetch_size, std::min<uint64_t>(fd->read_ahead.size(),
+                                                                     fd->file_size - offset));
+    fd->read_ahead_size = 0;
+    if (!android::base::ReadFullyAtOffset(fd->fd, fd->read_ahead.data(), size, offset)) {
+      fprintf(stderr, "read on sdcard failed: %s\n", strerror(errno));
+      return -EIO;
+    }
+    fd->read_ahead_offset = offset;
+    fd->read_ahead_size = size;
   }
 
+  memcpy(buffer, fd->read_ahead.data() + (offset - fd->read_ahead_offset), fetch_size);
   return 0;
 }
 
@@ -84,9 +100,15 @@ static void* run_sdcard_fuse(void* cookie) {
   }
   fd.file_size = sb.st_size;
   fd.block_size = 65536;
-
-  vtab.read_block = std::bind(&read_block_file, fd, std::placeholders::_1, std::placeholders::_2,
-                              std::placeholders::_3);
+  fd.read_ahead.resize(std::max<size_t>(READ_AHEAD_SIZE, fd.block_size));
+  fd.read_ahead_offset = 0;
+  fd.read_ahead_size = 0;
+  // The kernel reads ahead further as well.
+  posix_fadvise(fd.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  vtab.read_block = [&fd](uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
+    return read_block_file(&fd, block, buffer, fetch_size);
+  };
   vtab.close = [&fd]() { close(fd.fd); };
 
   t->result = run_fuse_sideload(vtab, fd.file_size, fd.block_size);
@@ -38,6 +38,16 @@
 // causes the filesystem to be unmounted and the adb process on the
 // device shut down.
 //
+// If the package carries signed chunk digests (see CHUNK_DIGESTS_ENTRY),
+// every block is also checked against them before it's served, and
+// "/sideload/chunks_verified" appears, telling the installer that the
+// whole-file verification pass can be skipped.
+//
+// Optionally, the verified blocks are also kept in a spill file on the
+// device, along with their hashes. If the sideload fails partway through,
+// retrying it with the same package only fetches the blocks that didn't
+// make it there.
+//
 // Note that only the minimal set of file operations needed for these
 // two files is implemented.  In particular, you can't opendir() or
 // readdir() on the "/sideload" directory; ls on it won't work.
@@ -46,33 +56,116 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>  // PATH_MAX
 #include <linux/fuse.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
 #include <sys/param.h>  // MIN
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <android-base/file.h>
 #include <android-base/stringprintf.h>
 #include <android-base/unique_fd.h>
 #include <openssl/sha.h>
 
+#include "otautil/memory_budget.h"
+#include "verifier.h"
+
 static constexpr uint64_t PACKAGE_FILE_ID = FUSE_ROOT_ID + 1;
+static constexpr uint64_t CHUNKS_VERIFIED_FILE_ID = FUSE_ROOT_ID + 2;
+
+static constexpr const char* PUBLIC_KEYS_FILE = "/res/keys";
 
 static constexpr int NO_STATUS = 1;
 
-using SHA256Digest = std::array<uint8_t, SHA256_DIGEST_LENGTH>;
+static constexpr uint32_t NO_SLOT = UINT32_MAX;
+
+// The first half of the SHA-256 of a block, which keeps the hashes of all the blocks of a large
+// package compact while still leaving 128 bits to forge.
+using BlockDigest = std::array<uint8_t, SHA256_DIGEST_LENGTH / 2>;
+
+// The number of block requests kept in flight to the provider while the file is read sequentially.
+static constexpr uint32_t READ_AHEAD_BLOCKS = 16;
 
-#define INSTALL_REQUIRED_MEMORY (100 * 1024 * 1024)
+// The number of threads taking the requests from the kernel, so that a read waiting on the provider
+// only holds up its own thread rather than every other request.
+static constexpr uint32_t FUSE_WORKERS = 4;
+
+// How often the size of the block cache is revisited, following the memory use of the installer.
+static constexpr auto BLOCK_CACHE_RESIZE_INTERVAL = std::chrono::seconds(1);
+
+// The largest read we take from the kernel (unless the blocks are larger), which is answered in a
+// single reply straight from the cached blocks.
+static constexpr uint32_t MAX_READ_SIZE = 1024 * 1024;
+
+// The spill file starts with a SpillHeader, followed by a SpillRecord for each block of the
+// package. The data of the blocks comes next, from a block-aligned offset, and the file stays
+// sparse until they're written. The file is keyed by the hash of the last block of the package,
+// which holds the end of central directory and the signature of a signed one.
+static constexpr char SPILL_MAGIC[8] = { 'S', 'P', 'I', 'L', 'L', '0', '0', '2' };
+
+struct SpillHeader {
+  char magic[8];
+  uint64_t file_size;
+  uint32_t block_size;
+  uint32_t reserved;
+  BlockDigest footer_hash;
+};
+
+struct SpillRecord {
+  BlockDigest hash;
+  uint8_t present;  // Written along with the hash, once the data is
+};
+
+// The reads are counted by latency in buckets of powers of two microseconds, with the last bucket
+// taking everything slower.
+static constexpr size_t READ_LATENCY_BUCKETS = 20;
+
+// What the sideload spent its time on, to tell a slow host or transport from hashing or a
+// thrashing cache. The fields are atomic, as the workers and the receiver thread all update them.
+struct sideload_stats {
+  std::atomic<uint64_t> reads;           // FUSE read requests
+  std::atomic<uint64_t> read_bytes;      // Bytes returned by them
+  std::atomic<uint64_t> read_ns;         // Time spent answering them
+  std::atomic<uint64_t> cache_hits;      // Blocks read that were in the cache
+  std::atomic<uint64_t> cache_misses;    // Blocks read that had to be fetched, or waited for
+  std::atomic<uint64_t> spill_hits;      // Blocks loaded from the spill file
+  std::atomic<uint64_t> blocks_fetched;  // Blocks received from the provider
+  std::atomic<uint64_t> bytes_fetched;   // Bytes received from the provider
+  std::atomic<uint64_t> transport_ns;    // Time spent waiting on the provider
+  std::atomic<uint64_t> hash_ns;         // Time spent hashing blocks
+  std::array<std::atomic<uint64_t>, READ_LATENCY_BUCKETS> read_latency;  // Bucket i: < 2^(i+1) us
+};
+
+// The state of each of the threads that take the requests from the kernel.
+struct fuse_worker {
+  uint32_t curr_block;        // cache the block most recently fetched by this worker
+  uint8_t* block_data;
+  uint8_t* read_data;         // storage for the blocks of a read that aren't in the cache
+  std::vector<uint32_t> pins;  // The slots pinned by the read being answered
+  std::vector<uint8_t> request;
+  std::thread thread;
+};
 
 struct fuse_data {
   android::base::unique_fd ffd;  // file descriptor for the fuse socket
@@ -87,82 +180,167 @@ struct fuse_data {
   uid_t uid;
   gid_t gid;
 
-  uint32_t curr_block;  // cache the block most recently used
+  uint32_t curr_block;  // cache the block most recently used, before the workers start
   uint8_t* block_data;
 
-  uint8_t* extra_block;  // another block of storage for reads that span two blocks
+  uint32_t max_read;                // the largest read the kernel sends us
+  uint32_t max_read_blocks;         // the most blocks a read may span
+  std::vector<uint8_t> zero_block;  // what the reads past the end of the file get
+
+  std::vector<BlockDigest> hashes;  // Hash of each block
+  std::vector<bool> hashed;         // Whether each block has been read (and its hash set) yet
+
+  std::unique_ptr<ChunkDigests> chunks;  // The signed chunk digests of the package, if any
+
+  android::base::unique_fd spill_fd;  // The spill file, if any
+  off64_t spill_data_offset;          // Where the data of the blocks starts in it
+  std::vector<bool> spilled;          // Whether each block is in the spill file
+
+  // Block cache, which keeps the blocks in the slots of a single allocation and evicts them in
+  // CLOCK order.
+  uint32_t block_cache_max_size;                // Number of slots in the cache
+  uint32_t block_cache_limit;                   // Number of slots it may use, given free memory
+  uint32_t block_cache_size;                    // Number of slots in use
+  uint8_t* block_cache;                         // Slot data, block_size bytes per slot
+  std::vector<uint32_t> block_cache_slots;      // Slot of each file block, or NO_SLOT
+  std::vector<uint32_t> block_cache_blocks;     // File block in each slot
+  std::vector<uint8_t> block_cache_referenced;  // Whether each slot has been used since last swept
+  std::vector<uint8_t> block_cache_pinned;      // Number of replies being sent from each slot
+  uint32_t block_cache_pinned_slots;            // Number of slots pinned by any reply
+  uint32_t block_cache_hand;                    // Next slot to consider for eviction
+  std::chrono::steady_clock::time_point block_cache_resized;
+
+  // The workers, which answer the requests concurrently. Once they run, |lock| guards the block
+  // cache, the hashes, the spill file, and the fields below, but not the provider: the blocks are
+  // fetched and hashed without it, one fetch at a time under |provider_lock|.
+  std::vector<fuse_worker> workers;
+  std::atomic<bool> stop_workers;
+  std::vector<bool> fetching;  // Blocks being fetched by a worker, which the other ones wait for
+  std::mutex provider_lock;
+
+  // Read-ahead. The responses are received and hashed by the receiver thread, which lands the
+  // blocks in the block cache, while the workers keep replying to the reads.
+  uint32_t last_read_block;                // The block most recently asked for by a read
+  std::deque<uint32_t> read_ahead_blocks;  // Blocks requested from the provider, oldest first
+  std::vector<bool> rejected;              // Blocks received with a mismatching hash
+  int receive_error;                       // Set if receiving failed, which stops the read-ahead
+  bool stop_receiver;
+  std::thread receiver;
+  std::mutex lock;
+  std::condition_variable cond;
+
+  sideload_stats stats;
+};
 
-  std::vector<SHA256Digest>
-      hashes;  // SHA-256 hash of each block (all zeros if block hasn't been read yet)
+static uint64_t ns_since(std::chrono::steady_clock::time_point start) {
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+}
 
-  // Block cache
-  uint32_t block_cache_max_size;  // Max allowed block cache size
-  uint32_t block_cache_size;      // Current block cache size
-  uint8_t** block_cache;          // Block cache data
-};
+static bool block_cache_contains(const fuse_data* fd, uint32_t block) {
+  return fd->block_cache != nullptr && fd->block_cache_slots[block] != NO_SLOT;
+}
 
-static uint64_t free_memory() {
-  uint64_t mem = 0;
-  FILE* fp = fopen("/proc/meminfo", "r");
-  if (fp) {
-    char buf[256];
-    char* linebuf = buf;
-    size_t buflen = sizeof(buf);
-    while (getline(&linebuf, &buflen, fp) > 0) {
-      char* key = buf;
-      char* val = strchr(buf, ':');
-      *val = '\0';
-      ++val;
-      if (strcmp(key, "MemFree") == 0) {
-        mem += strtoul(val, nullptr, 0) * 1024;
-      }
-      if (strcmp(key, "Buffers") == 0) {
-        mem += strtoul(val, nullptr, 0) * 1024;
-      }
-      if (strcmp(key, "Cached") == 0) {
-        mem += strtoul(val, nullptr, 0) * 1024;
-      }
-    }
-    fclose(fp);
+// Returns the data of |block| if it's in the cache, and keeps it there until the reply of
+// |worker| that uses it has been sent (see block_cache_unpin_all()). Returns nullptr otherwise.
+static const uint8_t* block_cache_pin(struct fuse_data* fd, fuse_worker* worker, uint32_t block) {
+  if (!block_cache_contains(fd, block)) {
+    return nullptr;
   }
-  return mem;
+  uint32_t slot = fd->block_cache_slots[block];
+  fd->block_cache_referenced[slot] = 1;
+  if (fd->block_cache_pinned[slot]++ == 0) {
+    fd->block_cache_pinned_slots++;
+  }
+  worker->pins.push_back(slot);
+  return fd->block_cache + static_cast<size_t>(slot) * fd->block_size;
 }
 
-static int block_cache_fetch(struct fuse_data* fd, uint32_t block) {
-  if (fd->block_cache == nullptr) {
-    return -1;
-  }
-  if (fd->block_cache[block] == nullptr) {
-    return -1;
+static void block_cache_unpin_all(struct fuse_data* fd, fuse_worker* worker) {
+  for (uint32_t slot : worker->pins) {
+    if (--fd->block_cache_pinned[slot] == 0) {
+      fd->block_cache_pinned_slots--;
+    }
   }
-  memcpy(fd->block_data, fd->block_cache[block], fd->block_size);
-  return 0;
+  worker->pins.clear();
 }
 
-static void block_cache_enter(struct fuse_data* fd, uint32_t block) {
+static void block_cache_enter(struct fuse_data* fd, uint32_t block, const uint8_t* data) {
   if (!fd->block_cache) return;
-  if (fd->block_cache_size == fd->block_cache_max_size) {
-    // Evict a block from the cache.  Since the file is typically read
-    // sequentially, start looking from the block behind the current
-    // block and proceed backward.
-    int n;
-    for (n = fd->curr_block - 1; n != (int)fd->curr_block; --n) {
-      if (n < 0) {
-        n = fd->file_blocks - 1;
-      }
-      if (fd->block_cache[n]) {
-        free(fd->block_cache[n]);
-        fd->block_cache[n] = nullptr;
-        fd->block_cache_size--;
-        break;
-      }
+  if (block_cache_contains(fd, block)) return;
+
+  uint32_t slot;
+  if (fd->block_cache_size < fd->block_cache_limit) {
+    slot = fd->block_cache_size++;
+  } else {
+    // Leave the block out if everything is pinned (only possible with a tiny cache).
+    if (fd->block_cache_pinned_slots >= fd->block_cache_limit) {
+      return;
+    }
+    // Evict the first unpinned slot that hasn't been used since the hand last passed it, clearing
+    // the reference bits on the way. This finishes within two sweeps.
+    while (fd->block_cache_referenced[fd->block_cache_hand] ||
+           fd->block_cache_pinned[fd->block_cache_hand]) {
+      fd->block_cache_referenced[fd->block_cache_hand] = 0;
+      fd->block_cache_hand = (fd->block_cache_hand + 1) % fd->block_cache_limit;
     }
+    slot = fd->block_cache_hand;
+    fd->block_cache_hand = (fd->block_cache_hand + 1) % fd->block_cache_limit;
+    fd->block_cache_slots[fd->block_cache_blocks[slot]] = NO_SLOT;
   }
 
-  fd->block_cache[block] = (uint8_t*)malloc(fd->block_size);
-  memcpy(fd->block_cache[block], fd->block_data, fd->block_size);
+  memcpy(fd->block_cache + static_cast<size_t>(slot) * fd->block_size, data, fd->block_size);
+  fd->block_cache_slots[block] = slot;
+  fd->block_cache_blocks[slot] = block;
+  // Only a hit earns the block a second chance, so that the blocks that are used once (e.g. those
+  // of a sequential read) go before the ones that are read repeatedly.
+  fd->block_cache_referenced[slot] = 0;
+}
+
+// Evicts the blocks from the slots past |size|, and gives their memory back.
+static void block_cache_shrink(fuse_data* fd, uint32_t size) {
+  for (uint32_t slot = size; slot < fd->block_cache_size; ++slot) {
+    fd->block_cache_slots[fd->block_cache_blocks[slot]] = NO_SLOT;
+    fd->block_cache_referenced[slot] = 0;
+  }
+  // The slab is page aligned, so this only keeps the page the last remaining slot ends in.
+  uintptr_t page_size = sysconf(_SC_PAGESIZE);
+  uintptr_t base = reinterpret_cast<uintptr_t>(fd->block_cache);
+  uintptr_t start = (base + static_cast<uintptr_t>(size) * fd->block_size + page_size - 1) /
+                    page_size * page_size;
+  uintptr_t end = base + static_cast<uintptr_t>(fd->block_cache_size) * fd->block_size;
+  if (end > start) {
+    madvise(reinterpret_cast<void*>(start), end - start, MADV_DONTNEED);
+  }
+  fd->block_cache_size = size;
+  if (fd->block_cache_hand >= size) {
+    fd->block_cache_hand = 0;
+  }
+}
 
-  fd->block_cache_size++;
+// Lets the block cache use the memory the installer doesn't need, which it gives back as the
+// installer takes more (say for its patch buffers), and halves it under memory pressure. Called
+// when no slot is pinned.
+static void block_cache_resize(fuse_data* fd) {
+  // The read-ahead needs the room for the blocks pinned by the reads of every worker, plus as many
+  // as a read in flight.
+  uint32_t min_size = fd->receiver.joinable() ? (FUSE_WORKERS + 1) * fd->max_read_blocks : 2;
+
+  uint64_t used = static_cast<uint64_t>(fd->block_cache_size) * fd->block_size;
+  uint64_t target =
+      MemoryBudget::Instance().CacheLimit(used, fd->file_blocks * sizeof(uint32_t));
+  uint32_t limit = std::min<uint64_t>(target / fd->block_size, fd->block_cache_max_size);
+  limit = std::max(limit, std::min(min_size, fd->block_cache_max_size));
+
+  // Leave out the small changes, which come with any fluctuation of the free memory.
+  uint32_t step = std::max(fd->block_cache_max_size / 32, 1U);
+  if (limit + step > fd->block_cache_limit && fd->block_cache_limit + step > limit) return;
+
+  printf("resizing block cache from %u to %u blocks\n", fd->block_cache_limit, limit);
+  if (limit < fd->block_cache_size) {
+    block_cache_shrink(fd, limit);
+  }
+  fd->block_cache_limit = limit;
 }
 
 static void fuse_reply(const fuse_data* fd, uint64_t unique, const void* data, size_t len) {
@@ -195,7 +373,7 @@ static int handle_init(void* data, fuse_data* fd, const fuse_in_header* hdr) {
     return -1;
   }
 
-  fuse_init_out out;
+  fuse_init_out out = {};
   out.minor = MIN(req->minor, FUSE_KERNEL_MINOR_VERSION);
   size_t fuse_struct_size = sizeof(out);
 #if defined(FUSE_COMPAT_22_INIT_OUT_SIZE)
@@ -214,6 +392,18 @@ static int handle_init(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   out.max_background = 32;
   out.congestion_threshold = 32;
   out.max_write = 4096;
+  // Let the kernel send several reads at a time, which the workers answer concurrently.
+  if (req->flags & FUSE_ASYNC_READ) {
+    out.flags |= FUSE_ASYNC_READ;
+  }
+#if defined(FUSE_MAX_PAGES)
+  // Let the kernel send reads of up to fd->max_read bytes (7.28+); it defaults to 32 pages
+  // otherwise.
+  if (req->minor >= 28 && (req->flags & FUSE_MAX_PAGES)) {
+    out.flags |= FUSE_MAX_PAGES;
+    out.max_pages = fd->max_read / 4096;
+  }
+#endif
   fuse_reply(fd, hdr->unique, &out, fuse_struct_size);
 
   return NO_STATUS;
@@ -241,6 +431,8 @@ static int handle_getattr(void* /* data */, const fuse_data* fd, const fuse_in_h
     fill_attr(&(out.attr), fd, hdr->nodeid, 4096, S_IFDIR | 0555);
   } else if (hdr->nodeid == PACKAGE_FILE_ID) {
     fill_attr(&(out.attr), fd, PACKAGE_FILE_ID, fd->file_size, S_IFREG | 0444);
+  } else if (hdr->nodeid == CHUNKS_VERIFIED_FILE_ID && fd->chunks) {
+    fill_attr(&(out.attr), fd, CHUNKS_VERIFIED_FILE_ID, 0, S_IFREG | 0444);
   } else {
     return -ENOENT;
   }
@@ -261,6 +453,10 @@ static int handle_lookup(void* data, const fuse_data* fd, const fuse_in_header*
     out.nodeid = PACKAGE_FILE_ID;
     out.generation = PACKAGE_FILE_ID;
     fill_attr(&(out.attr), fd, PACKAGE_FILE_ID, fd->file_size, S_IFREG | 0444);
+  } else if (filename == FUSE_SIDELOAD_HOST_CHUNKS_VERIFIED_FILENAME && fd->chunks) {
+    out.nodeid = CHUNKS_VERIFIED_FILE_ID;
+    out.generation = CHUNKS_VERIFIED_FILE_ID;
+    fill_attr(&(out.attr), fd, CHUNKS_VERIFIED_FILE_ID, 0, S_IFREG | 0444);
   } else {
     return -ENOENT;
   }
@@ -286,70 +482,554 @@ static int handle_release(void* /* data */, fuse_data* /* fd */, const fuse_in_h
   return 0;
 }
 
-// Fetch a block from the host into fd->curr_block and fd->block_data.
-// Returns 0 on successful fetch, negative otherwise.
-static int fetch_block(fuse_data* fd, uint32_t block) {
-  if (block == fd->curr_block) {
-    return 0;
+// Returns the number of bytes the host sends for |block|, which is shorter than the block size for
+// the last (partial) block of the file.
+static uint32_t block_fetch_size(const fuse_data* fd, uint32_t block) {
+  uint64_t remaining = fd->file_size - static_cast<uint64_t>(block) * fd->block_size;
+  return remaining < fd->block_size ? remaining : fd->block_size;
+}
+
+static BlockDigest hash_block(fuse_data* fd, const uint8_t* data) {
+  auto start = std::chrono::steady_clock::now();
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256(data, fd->block_size, digest);
+  fd->stats.hash_ns += ns_since(start);
+  BlockDigest result;
+  std::copy(digest, digest + result.size(), result.begin());
+  return result;
+}
+
+// The calls into the provider, timed as the transport.
+static int provider_read_block(fuse_data* fd, uint32_t block, uint8_t* buffer,
+                               uint32_t fetch_size) {
+  auto start = std::chrono::steady_clock::now();
+  int result = fd->vtab.read_block(block, buffer, fetch_size);
+  fd->stats.transport_ns += ns_since(start);
+  if (result == 0) {
+    fd->stats.blocks_fetched++;
+    fd->stats.bytes_fetched += fetch_size;
   }
+  return result;
+}
 
-  if (block >= fd->file_blocks) {
-    memset(fd->block_data, 0, fd->block_size);
-    fd->curr_block = block;
+static int provider_request_blocks(fuse_data* fd, uint32_t block, uint32_t count) {
+  auto start = std::chrono::steady_clock::now();
+  int result = fd->vtab.request_blocks(block, count);
+  fd->stats.transport_ns += ns_since(start);
+  return result;
+}
+
+static int provider_receive_block(fuse_data* fd, uint8_t* buffer, uint32_t fetch_size) {
+  auto start = std::chrono::steady_clock::now();
+  int result = fd->vtab.receive_block(buffer, fetch_size);
+  fd->stats.transport_ns += ns_since(start);
+  if (result == 0) {
+    fd->stats.blocks_fetched++;
+    fd->stats.bytes_fetched += fetch_size;
+  }
+  return result;
+}
+
+// Writes a verified block to the spill file, unless it's there already.
+static void spill_store(fuse_data* fd, uint32_t block, const BlockDigest& hash,
+                        const uint8_t* data) {
+  if (fd->spill_fd == -1 || fd->spilled[block]) return;
+
+  // The data goes first, so a record is only written once its data is. (A block that doesn't make
+  // it to the disk in one piece fails its hash check when it's loaded back, and is fetched again.)
+  off64_t data_offset = fd->spill_data_offset + static_cast<off64_t>(block) * fd->block_size;
+  SpillRecord record = {};
+  record.hash = hash;
+  record.present = 1;
+  off64_t record_offset =
+      sizeof(SpillHeader) + static_cast<off64_t>(block) * sizeof(SpillRecord);
+  if (TEMP_FAILURE_RETRY(pwrite64(fd->spill_fd, data, fd->block_size, data_offset)) !=
+          static_cast<ssize_t>(fd->block_size) ||
+      TEMP_FAILURE_RETRY(pwrite64(fd->spill_fd, &record, sizeof(record), record_offset)) !=
+          static_cast<ssize_t>(sizeof(record))) {
+    fprintf(stderr, "failed to write block %u to the spill file: %s\n", block, strerror(errno));
+    fd->spill_fd.reset();
+    return;
+  }
+  fd->spilled[block] = true;
+}
+
+// Reads |block| from the spill file into |buffer|, checking it against the hash recorded with it.
+// Returns false if it isn't there (any more), in which case it needs to be fetched from the
+// provider, which still has to match the recorded hash.
+static bool spill_load(fuse_data* fd, uint32_t block, uint8_t* buffer) {
+  if (fd->spill_fd == -1 || !fd->spilled[block]) return false;
+
+  off64_t data_offset = fd->spill_data_offset + static_cast<off64_t>(block) * fd->block_size;
+  if (!android::base::ReadFullyAtOffset(fd->spill_fd, buffer, fd->block_size, data_offset) ||
+      hash_block(fd, buffer) != fd->hashes[block] ||
+      (fd->chunks && !fd->chunks->Verify(static_cast<uint64_t>(block) * fd->block_size, buffer,
+                                         fd->block_size))) {
+    fprintf(stderr, "block %u is missing from the spill file\n", block);
+    fd->spilled[block] = false;
+    return false;
+  }
+  fd->stats.spill_hits++;
+  return true;
+}
+
+static int verify_block(fuse_data* fd, uint32_t block, const BlockDigest& hash,
+                        const uint8_t* data);
+
+// Fetches |block| from the provider into fd->block_data, padded with zeros to the block size, and
+// puts its hash into |hash|.
+static bool fetch_block(fuse_data* fd, uint32_t block, BlockDigest* hash) {
+  uint32_t fetch_size = block_fetch_size(fd, block);
+  memset(fd->block_data + fetch_size, 0, fd->block_size - fetch_size);
+  if (provider_read_block(fd, block, fd->block_data, fetch_size) < 0) return false;
+  *hash = hash_block(fd, fd->block_data);
+  return true;
+}
+
+// Checks that the package being served is the one the blocks in the spill file came from, whose
+// footer has been matched already, by fetching its first block as well if that's in the spill file
+// (the installer reads it early on anyway). Called before any other block is read from the
+// provider.
+static bool spill_matches(fuse_data* fd) {
+  if (fd->file_blocks == 1 || !fd->spilled[0]) return true;
+  BlockDigest hash;
+  return fetch_block(fd, 0, &hash) && hash == fd->hashes[0];
+}
+
+// Opens the spill file at |path|, picking up the blocks left there by an earlier attempt at
+// sideloading the same package. Otherwise starts it afresh, if there's room for it. Either way, the
+// last block of the package is fetched first, as the key of the file, and kept in it.
+static void spill_open(fuse_data* fd, const char* path) {
+  if (fd->file_blocks == 0) return;
+
+  uint32_t last_block = fd->file_blocks - 1;
+  BlockDigest footer_hash;
+  if (!fetch_block(fd, last_block, &footer_hash)) {
+    fprintf(stderr, "failed to fetch the last block; not keeping a spill file\n");
+    return;
+  }
+  std::vector<uint8_t> footer(fd->block_data, fd->block_data + fd->block_size);
+
+  uint64_t records_size = sizeof(SpillHeader) + fd->file_blocks * sizeof(SpillRecord);
+  fd->spill_data_offset = (records_size + fd->block_size - 1) / fd->block_size * fd->block_size;
+  uint64_t spill_size =
+      fd->spill_data_offset + static_cast<uint64_t>(fd->file_blocks) * fd->block_size;
+  fd->spilled.resize(fd->file_blocks);
+
+  android::base::unique_fd spill(open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600));
+  if (spill == -1) {
+    fprintf(stderr, "failed to open spill file %s: %s\n", path, strerror(errno));
+    return;
+  }
+
+  SpillHeader header;
+  if (android::base::ReadFullyAtOffset(spill, &header, sizeof(header), 0) &&
+      memcmp(header.magic, SPILL_MAGIC, sizeof(SPILL_MAGIC)) == 0 &&
+      header.file_size == fd->file_size && header.block_size == fd->block_size &&
+      header.footer_hash == footer_hash) {
+    std::vector<SpillRecord> records(fd->file_blocks);
+    uint32_t count = 0;
+    if (android::base::ReadFullyAtOffset(spill, records.data(),
+                                         records.size() * sizeof(SpillRecord), sizeof(header))) {
+      for (uint32_t block = 0; block < fd->file_blocks; ++block) {
+        if (records[block].present) {
+          fd->hashes[block] = records[block].hash;
+          fd->hashed[block] = true;
+          fd->spilled[block] = true;
+          ++count;
+        }
+      }
+    }
+    if (count > 0 && fd->spilled[last_block] && fd->hashes[last_block] == footer_hash &&
+        spill_matches(fd)) {
+      printf("resuming sideload with %u of %u blocks from %s\n", count, fd->file_blocks, path);
+      fd->spill_fd = std::move(spill);
+      return;
+    }
+    std::fill(fd->hashed.begin(), fd->hashed.end(), false);
+    std::fill(fd->spilled.begin(), fd->spilled.end(), false);
+  }
+
+  // Leave at least as much space as the spill file may take for the installer.
+  struct statvfs vfs;
+  if (ftruncate(spill, 0) == -1 || fstatvfs(spill, &vfs) == -1 ||
+      static_cast<uint64_t>(vfs.f_bavail) * vfs.f_frsize < 2 * spill_size) {
+    printf("not keeping a spill file for the sideload in %s\n", path);
+    unlink(path);
+    return;
+  }
+
+  header = {};
+  memcpy(header.magic, SPILL_MAGIC, sizeof(SPILL_MAGIC));
+  header.file_size = fd->file_size;
+  header.block_size = fd->block_size;
+  header.footer_hash = footer_hash;
+  if (ftruncate64(spill, spill_size) == -1 ||
+      !android::base::WriteFully(spill, &header, sizeof(header))) {
+    fprintf(stderr, "failed to set up spill file %s: %s\n", path, strerror(errno));
+    unlink(path);
+    return;
+  }
+  fd->spill_fd = std::move(spill);
+  // The footer goes in right away, so that a later attempt can tell whether it's the same package.
+  if (verify_block(fd, last_block, footer_hash, footer.data()) != 0) {
+    fd->spill_fd.reset();
+    unlink(path);
+  }
+}
+
+// Reads |len| bytes at |offset| of the file straight from the provider, through fd->block_data.
+static bool read_range(fuse_data* fd, uint64_t offset, uint64_t len, std::string* out) {
+  out->clear();
+  fd->curr_block = -1;
+  while (len > 0) {
+    uint32_t block = offset / fd->block_size;
+    uint32_t fetch_size = block_fetch_size(fd, block);
+    if (provider_read_block(fd, block, fd->block_data, fetch_size) < 0) {
+      return false;
+    }
+    uint64_t skip = offset % fd->block_size;
+    uint64_t size = std::min<uint64_t>(len, fetch_size - skip);
+    out->append(reinterpret_cast<const char*>(fd->block_data) + skip, size);
+    offset += size;
+    len -= size;
+  }
+  return true;
+}
+
+static uint32_t get_le(const std::string& data, size_t offset, size_t size) {
+  uint32_t value = 0;
+  for (size_t i = size; i > 0; i--) {
+    value = (value << 8) | static_cast<uint8_t>(data[offset + i - 1]);
+  }
+  return value;
+}
+
+// Looks for the signed chunk digests of the package: finds the CHUNK_DIGESTS_ENTRY through the
+// end of central directory record and the central directory, and checks it against the keys. On
+// success, fd->chunks is set and every block gets checked against it from then on. Called before
+// the spill file is opened and the read-ahead starts.
+static void chunks_load(fuse_data* fd) {
+  static constexpr size_t EOCD_SIZE = 22;
+  static constexpr size_t CD_ENTRY_SIZE = 46;
+  static constexpr size_t LOCAL_HEADER_SIZE = 30;
+
+  if (fd->file_size < EOCD_SIZE) return;
+  uint64_t tail_offset = fd->file_size - std::min<uint64_t>(fd->file_size, EOCD_SIZE + 65535);
+  std::string tail;
+  if (!read_range(fd, tail_offset, fd->file_size - tail_offset, &tail)) return;
+
+  // The record whose comment runs to the end of the file.
+  size_t eocd = std::string::npos;
+  for (size_t pos = tail.size() - EOCD_SIZE + 1; pos-- > 0;) {
+    if (tail.compare(pos, 4, "PK\x05\x06") == 0 &&
+        pos + EOCD_SIZE + get_le(tail, pos + 20, 2) == tail.size()) {
+      eocd = pos;
+      break;
+    }
+  }
+  if (eocd == std::string::npos) return;
+  uint64_t cd_size = get_le(tail, eocd + 12, 4);
+  uint64_t cd_offset = get_le(tail, eocd + 16, 4);
+  if (cd_offset + cd_size > tail_offset + eocd) return;
+
+  std::string cd;
+  if (!read_range(fd, cd_offset, cd_size, &cd)) return;
+  std::string name(CHUNK_DIGESTS_ENTRY);
+  uint64_t local_offset = 0;
+  uint64_t data_size = 0;
+  bool found = false;
+  for (size_t pos = 0; pos + CD_ENTRY_SIZE <= cd.size() && get_le(cd, pos, 4) == 0x02014b50;) {
+    size_t name_len = get_le(cd, pos + 28, 2);
+    size_t entry_size = CD_ENTRY_SIZE + name_len + get_le(cd, pos + 30, 2) + get_le(cd, pos + 32, 2);
+    if (pos + entry_size > cd.size()) return;
+    if (cd.compare(pos + CD_ENTRY_SIZE, name_len, name) == 0 && name_len == name.size()) {
+      // Only a stored entry can be checked in place.
+      if (get_le(cd, pos + 10, 2) != 0) return;
+      data_size = get_le(cd, pos + 20, 4);
+      local_offset = get_le(cd, pos + 42, 4);
+      found = true;
+      break;
+    }
+    pos += entry_size;
+  }
+  if (!found) return;
+
+  std::string local;
+  if (!read_range(fd, local_offset, LOCAL_HEADER_SIZE, &local) ||
+      get_le(local, 0, 4) != 0x04034b50) {
+    return;
+  }
+  uint64_t data_offset =
+      local_offset + LOCAL_HEADER_SIZE + get_le(local, 26, 2) + get_le(local, 28, 2);
+  std::string manifest;
+  if (data_offset + data_size > fd->file_size ||
+      !read_range(fd, data_offset, data_size, &manifest)) {
+    return;
+  }
+
+  std::vector<Certificate> keys;
+  if (!load_keys(PUBLIC_KEYS_FILE, keys)) {
+    fprintf(stderr, "failed to load keys to check the chunk digests\n");
+    return;
+  }
+  std::unique_ptr<ChunkDigests> chunks =
+      ChunkDigests::Parse(manifest, data_offset, fd->file_size, keys);
+  if (!chunks) return;
+  if (fd->block_size % chunks->chunk_size() != 0 || chunks->covered_length() < tail_offset ||
+      !chunks->SetTail(tail.substr(chunks->covered_length() - tail_offset))) {
+    fprintf(stderr, "chunk digests of %u bytes can't be used with %u-byte blocks\n",
+            chunks->chunk_size(), fd->block_size);
+    return;
+  }
+  printf("verifying the package against its chunk digests as it's read\n");
+  fd->chunks = std::move(chunks);
+}
+
+// Checks the hash of a block that was just received with the given data.
+//
+// - If the package has chunk digests and the data doesn't match them, return -EIO.
+// - If the hash of the just-received data matches the stored hash for the block, accept it.
+// - If this is the first time we've read this block, store the new hash and accept the block.
+// - Otherwise, return -EIO for the read.
+static int verify_block(fuse_data* fd, uint32_t block, const BlockDigest& hash,
+                        const uint8_t* data) {
+  if (fd->chunks &&
+      !fd->chunks->Verify(static_cast<uint64_t>(block) * fd->block_size, data, fd->block_size)) {
+    fprintf(stderr, "block %u doesn't match the chunk digests\n", block);
+    return -EIO;
+  }
+  if (fd->hashed[block]) {
+    // The block was read (and possibly evicted) before; it must not have changed since.
+    if (hash != fd->hashes[block]) {
+      return -EIO;
+    }
+  } else {
+    fd->hashes[block] = hash;
+    fd->hashed[block] = true;
+  }
+  block_cache_enter(fd, block, data);
+  spill_store(fd, block, hash, data);
+  return 0;
+}
+
+// The receiver thread, which takes the responses to the read-ahead requests in order, and verifies
+// them into the block cache. When stopped, it still consumes the outstanding responses so that the
+// provider can shut down cleanly.
+static void receive_read_ahead_blocks(fuse_data* fd) {
+  std::vector<uint8_t> buffer(fd->block_size);
+  std::unique_lock<std::mutex> lock(fd->lock);
+  while (true) {
+    fd->cond.wait(lock, [fd] { return fd->stop_receiver || !fd->read_ahead_blocks.empty(); });
+    if (fd->read_ahead_blocks.empty()) {
+      return;
+    }
+    uint32_t block = fd->read_ahead_blocks.front();
+    lock.unlock();
+
+    // The hashing overlaps with the transfer of the following blocks, as well as with the replies
+    // to the reads of the blocks that are already in the cache.
+    uint32_t fetch_size = block_fetch_size(fd, block);
+    memset(buffer.data() + fetch_size, 0, fd->block_size - fetch_size);
+    int result = provider_receive_block(fd, buffer.data(), fetch_size);
+    BlockDigest hash;
+    if (result == 0) {
+      hash = hash_block(fd, buffer.data());
+    }
+
+    lock.lock();
+    fd->read_ahead_blocks.pop_front();
+    if (result < 0) {
+      // The responses can't be matched to the requests any more.
+      fd->receive_error = result;
+      fd->read_ahead_blocks.clear();
+      fd->cond.notify_all();
+      return;
+    }
+    if (verify_block(fd, block, hash, buffer.data()) != 0) {
+      fd->rejected[block] = true;
+    }
+    fd->cond.notify_all();
+  }
+}
+
+// Whether |block| can be had without asking the provider.
+static bool block_on_hand(const fuse_data* fd, uint32_t block) {
+  return block_cache_contains(fd, block) || (fd->spill_fd != -1 && fd->spilled[block]);
+}
+
+// Keeps up to READ_AHEAD_BLOCKS requests in flight for the blocks following |block|. Called with
+// fd->lock held.
+static void read_ahead(fuse_data* fd, uint32_t block) {
+  uint32_t next = block + 1;
+  if (!fd->read_ahead_blocks.empty()) {
+    next = std::max(next, fd->read_ahead_blocks.back() + 1);
+  }
+  // Don't request more than the cache could hold next to the blocks of the read that's being
+  // answered, or the blocks may be evicted before they're used.
+  uint32_t unpinned = fd->block_cache_limit - fd->block_cache_pinned_slots;
+  uint32_t window = std::min(READ_AHEAD_BLOCKS, unpinned / 2);
+  uint32_t end = std::min(fd->file_blocks, block + window + 1);
+  while (fd->read_ahead_blocks.size() < window && next < end) {
+    if (block_on_hand(fd, next)) {
+      ++next;
+      continue;
+    }
+    // Request the run of uncached blocks in one go.
+    uint32_t count = 1;
+    while (fd->read_ahead_blocks.size() + count < window && next + count < end &&
+           !block_on_hand(fd, next + count)) {
+      ++count;
+    }
+    if (provider_request_blocks(fd, next, count) < 0) {
+      return;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+      fd->rejected[next + i] = false;
+      fd->read_ahead_blocks.push_back(next + i);
+    }
+    next += count;
+  }
+  fd->cond.notify_all();
+}
+
+// Waits for the receiver thread to bring |block| into the cache, requesting the block if it isn't
+// on the way already (say for another worker). Called with fd->lock held through |lock|.
+static int wait_for_block(fuse_data* fd, uint32_t block, std::unique_lock<std::mutex>& lock) {
+  auto in_flight = [fd, block]() {
+    return std::find(fd->read_ahead_blocks.begin(), fd->read_ahead_blocks.end(), block) !=
+           fd->read_ahead_blocks.end();
+  };
+  while (!block_cache_contains(fd, block)) {
+    if (fd->receive_error != 0) {
+      return fd->receive_error;
+    }
+    if (!in_flight()) {
+      if (provider_request_blocks(fd, block, 1) < 0) {
+        return -EIO;
+      }
+      fd->rejected[block] = false;
+      fd->read_ahead_blocks.push_back(block);
+      fd->cond.notify_all();
+    }
+    fd->cond.wait(lock, [fd, &in_flight]() { return fd->receive_error != 0 || !in_flight(); });
+
+    if (fd->rejected[block]) {
+      fd->rejected[block] = false;
+      return -EIO;
+    }
+    // Otherwise the block is in the cache, unless it got evicted already, or we failed.
+  }
+  return 0;
+}
+
+// Fetch a block from the host into worker->curr_block and worker->block_data, without the receiver
+// thread. If another worker is fetching it already, waits for that one to put it in the cache
+// instead. Called with fd->lock held through |lock|, which is released while fetching. Returns 0
+// on successful fetch, negative otherwise.
+static int fetch_block(fuse_data* fd, fuse_worker* worker, uint32_t block,
+                       std::unique_lock<std::mutex>& lock) {
+  if (block == worker->curr_block) {
     return 0;
   }
+  while (fd->fetching[block]) {
+    fd->cond.wait(lock);
+    if (block_cache_contains(fd, block)) {
+      return 0;
+    }
+  }
 
-  if (block_cache_fetch(fd, block) == 0) {
-    fd->curr_block = block;
+  size_t fetch_size = block_fetch_size(fd, block);
+  // If we're reading the last (partial) block of the file, expect a shorter response from the
+  // host, and pad the rest of the block with zeroes.
+  memset(worker->block_data + fetch_size, 0, fd->block_size - fetch_size);
+
+  worker->curr_block = -1;
+  if (spill_load(fd, block, worker->block_data)) {
+    block_cache_enter(fd, block, worker->block_data);
+    worker->curr_block = block;
     return 0;
   }
 
-  size_t fetch_size = fd->block_size;
-  if (block * fd->block_size + fetch_size > fd->file_size) {
-    // If we're reading the last (partial) block of the file, expect a shorter response from the
-    // host, and pad the rest of the block with zeroes.
-    fetch_size = fd->file_size - (block * fd->block_size);
-    memset(fd->block_data + fetch_size, 0, fd->block_size - fetch_size);
+  fd->fetching[block] = true;
+  lock.unlock();
+  int result;
+  {
+    std::lock_guard<std::mutex> provider(fd->provider_lock);
+    result = provider_read_block(fd, block, worker->block_data, fetch_size);
+  }
+  BlockDigest hash;
+  if (result == 0) {
+    hash = hash_block(fd, worker->block_data);
   }
+  lock.lock();
 
-  int result = fd->vtab.read_block(block, fd->block_data, fetch_size);
-  if (result < 0) return result;
+  if (result == 0) {
+    result = verify_block(fd, block, hash, worker->block_data);
+  }
+  // The waiting workers find the block in the cache, or fetch it themselves if it couldn't be had.
+  fd->fetching[block] = false;
+  fd->cond.notify_all();
+  if (result != 0) return result;
 
-  fd->curr_block = block;
+  worker->curr_block = block;
+  return 0;
+}
 
-  // Verify the hash of the block we just got from the host.
-  //
-  // - If the hash of the just-received data matches the stored hash for the block, accept it.
-  // - If the stored hash is all zeroes, store the new hash and accept the block (this is the first
-  //   time we've read this block).
-  // - Otherwise, return -EINVAL for the read.
+// Gets the data of the |index|-th block of a read, which stays valid until the reply is sent.
+// It's called with fd->lock held through |lock|.
+static int get_block(fuse_data* fd, fuse_worker* worker, uint32_t block, uint32_t index,
+                     std::unique_lock<std::mutex>& lock, const uint8_t** data) {
+  if (block >= fd->file_blocks) {
+    *data = fd->zero_block.data();
+    return 0;
+  }
 
-  SHA256Digest hash;
-  SHA256(fd->block_data, fd->block_size, hash.data());
+  // Only read ahead when the file is read sequentially.
+  bool sequential = block == fd->last_read_block + 1;
+  fd->last_read_block = block;
 
-  const SHA256Digest& blockhash = fd->hashes[block];
-  if (hash == blockhash) {
-    return 0;
+  if (block_cache_contains(fd, block)) {
+    fd->stats.cache_hits++;
+  } else {
+    fd->stats.cache_misses++;
   }
 
-  for (uint8_t i : blockhash) {
-    if (i != 0) {
-      fd->curr_block = -1;
-      return -EIO;
+  if (fd->receiver.joinable()) {
+    // block_data is otherwise unused with the receiver thread.
+    if (!block_cache_contains(fd, block) && spill_load(fd, block, worker->block_data)) {
+      block_cache_enter(fd, block, worker->block_data);
     }
+    int result = wait_for_block(fd, block, lock);
+    if (result != 0) return result;
+    *data = block_cache_pin(fd, worker, block);
+    if (sequential) read_ahead(fd, block);
+    return 0;
   }
 
-  fd->hashes[block] = hash;
-  block_cache_enter(fd, block);
+  *data = block_cache_pin(fd, worker, block);
+  if (*data != nullptr) {
+    return 0;
+  }
+  int result = fetch_block(fd, worker, block, lock);
+  if (result != 0) return result;
+  *data = block_cache_pin(fd, worker, block);
+  if (*data == nullptr) {
+    // No room in the cache; keep a copy for the reply.
+    uint8_t* copy = worker->read_data + static_cast<size_t>(index) * fd->block_size;
+    memcpy(copy, worker->block_data, fd->block_size);
+    *data = copy;
+  }
   return 0;
 }
 
-static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
+static int handle_read(void* data, fuse_data* fd, fuse_worker* worker, const fuse_in_header* hdr) {
   if (hdr->nodeid != PACKAGE_FILE_ID) return -ENOENT;
 
   const fuse_read_in* req = static_cast<const fuse_read_in*>(data);
   uint64_t offset = req->offset;
   uint32_t size = req->size;
+  if (size > fd->max_read) return -EINVAL;
 
   // The docs on the fuse kernel interface are vague about what to do when a read request extends
   // past the end of the file. We can return a short read -- the return structure does include a
@@ -364,49 +1044,102 @@ static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   outhdr.error = 0;
   outhdr.unique = hdr->unique;
 
-  struct iovec vec[3];
-  vec[0].iov_base = &outhdr;
-  vec[0].iov_len = sizeof(outhdr);
-
-  uint32_t block = offset / fd->block_size;
-  int result = fetch_block(fd, block);
-  if (result != 0) return result;
+  // The reply points straight at the data of the blocks the read spans, which are pinned in the
+  // cache (or copied to worker->read_data if they can't be cached) until it's sent.
+  std::vector<iovec> vec;
+  vec.reserve(fd->max_read_blocks + 1);
+  vec.push_back({ &outhdr, sizeof(outhdr) });
 
-  // Two cases:
-  //
-  //   - the read request is entirely within this block. In this case we can reply immediately.
-  //
-  //   - the read request goes over into the next block. Note that since we mount the filesystem
-  //     with max_read=block_size, a read can never span more than two blocks. In this case we copy
-  //     the block to extra_block and issue a fetch for the following block.
+  std::unique_lock<std::mutex> lock(fd->lock);
 
-  uint32_t block_offset = offset - (block * fd->block_size);
-
-  int vec_used;
-  if (size + block_offset <= fd->block_size) {
-    // First case: the read fits entirely in the first block.
-
-    vec[1].iov_base = fd->block_data + block_offset;
-    vec[1].iov_len = size;
-    vec_used = 2;
-  } else {
-    // Second case: the read spills over into the next block.
+  uint32_t block = offset / fd->block_size;
+  uint32_t block_offset = offset - (static_cast<uint64_t>(block) * fd->block_size);
+  int result = 0;
+  for (uint32_t index = 0; size > 0; ++index, ++block, block_offset = 0) {
+    const uint8_t* block_data;
+    result = get_block(fd, worker, block, index, lock, &block_data);
+    if (result != 0) break;
+
+    uint32_t len = std::min(size, fd->block_size - block_offset);
+    vec.push_back({ const_cast<uint8_t*>(block_data) + block_offset, len });
+    size -= len;
+  }
 
-    memcpy(fd->extra_block, fd->block_data + block_offset, fd->block_size - block_offset);
-    vec[1].iov_base = fd->extra_block;
-    vec[1].iov_len = fd->block_size - block_offset;
+  // The pinned blocks stay put, so the reply is sent without holding up the other workers.
+  lock.unlock();
+  if (result == 0 && writev(fd->ffd, vec.data(), vec.size()) == -1) {
+    printf("*** READ REPLY FAILED: %s ***\n", strerror(errno));
+  }
+  lock.lock();
+  block_cache_unpin_all(fd, worker);
+  return result == 0 ? NO_STATUS : result;
+}
 
-    result = fetch_block(fd, block + 1);
-    if (result != 0) return result;
-    vec[2].iov_base = fd->block_data;
-    vec[2].iov_len = size - vec[1].iov_len;
-    vec_used = 3;
+static void record_read(fuse_data* fd, uint32_t size, uint64_t ns) {
+  fd->stats.reads++;
+  fd->stats.read_bytes += size;
+  fd->stats.read_ns += ns;
+  size_t bucket = 0;
+  for (uint64_t us = ns / 1000; us > 1 && bucket < READ_LATENCY_BUCKETS - 1; us >>= 1) {
+    ++bucket;
   }
+  fd->stats.read_latency[bucket]++;
+}
 
-  if (writev(fd->ffd, vec, vec_used) == -1) {
-    printf("*** READ REPLY FAILED: %s ***\n", strerror(errno));
+// Logs a summary of the stats, and writes them all to |stats_file| if set, as "key=value" lines.
+static void report_stats(const fuse_data* fd, uint64_t elapsed_ns, const char* stats_file) {
+  const sideload_stats& stats = fd->stats;
+  uint64_t reads = stats.reads;
+  if (reads == 0) return;
+
+  auto ms = [](uint64_t ns) { return ns / 1000000; };
+  uint64_t read_bytes = stats.read_bytes;
+  uint64_t read_ns = stats.read_ns;
+  uint64_t cache_hits = stats.cache_hits;
+  uint64_t cache_misses = stats.cache_misses;
+  uint64_t spill_hits = stats.spill_hits;
+  uint64_t blocks_fetched = stats.blocks_fetched;
+  uint64_t bytes_fetched = stats.bytes_fetched;
+  uint64_t transport_ns = stats.transport_ns;
+  uint64_t hash_ns = stats.hash_ns;
+  uint64_t blocks_read = cache_hits + cache_misses;
+  printf("sideload stats: %" PRIu64 " reads (%" PRIu64 " bytes) in %" PRIu64 " ms, %" PRIu64
+         " ms answering them\n",
+         reads, read_bytes, ms(elapsed_ns), ms(read_ns));
+  printf("  %" PRIu64 " blocks fetched (%" PRIu64 " bytes), %" PRIu64 " from the spill file\n",
+         blocks_fetched, bytes_fetched, spill_hits);
+  printf("  block cache: %" PRIu64 " hits, %" PRIu64 " misses (%" PRIu64 "%% hit rate)\n",
+         cache_hits, cache_misses, blocks_read == 0 ? 0 : cache_hits * 100 / blocks_read);
+  printf("  %" PRIu64 " ms waiting on the transport, %" PRIu64 " ms hashing\n", ms(transport_ns),
+         ms(hash_ns));
+
+  std::string latency;
+  for (size_t i = 0; i < READ_LATENCY_BUCKETS; ++i) {
+    uint64_t count = stats.read_latency[i];
+    if (count == 0) continue;
+    if (i < READ_LATENCY_BUCKETS - 1) {
+      latency += android::base::StringPrintf(" <%" PRIu64 "us:%" PRIu64, uint64_t{ 2 } << i, count);
+    } else {
+      latency += android::base::StringPrintf(" >=%" PRIu64 "us:%" PRIu64, uint64_t{ 1 } << i, count);
+    }
+  }
+  printf("  read latency:%s\n", latency.c_str());
+
+  if (stats_file == nullptr) return;
+  std::string content = android::base::StringPrintf(
+      "reads=%" PRIu64 "\nread_bytes=%" PRIu64 "\nread_ms=%" PRIu64 "\nelapsed_ms=%" PRIu64
+      "\ncache_hits=%" PRIu64 "\ncache_misses=%" PRIu64 "\nspill_hits=%" PRIu64
+      "\nblocks_fetched=%" PRIu64 "\nbytes_fetched=%" PRIu64 "\ntransport_ms=%" PRIu64
+      "\nhash_ms=%" PRIu64 "\n",
+      reads, read_bytes, ms(read_ns), ms(elapsed_ns), cache_hits, cache_misses, spill_hits,
+      blocks_fetched, bytes_fetched, ms(transport_ns), ms(hash_ns));
+  for (size_t i = 0; i < READ_LATENCY_BUCKETS; ++i) {
+    content += android::base::StringPrintf("read_latency_bucket_%zu=%" PRIu64 "\n", i,
+                                           stats.read_latency[i].load());
+  }
+  if (!android::base::WriteStringToFile(content, stats_file)) {
+    fprintf(stderr, "failed to write %s: %s\n", stats_file, strerror(errno));
   }
-  return NO_STATUS;
 }
 
 static volatile int terminated = 0;
@@ -414,8 +1147,109 @@ static void sig_term(int) {
   terminated = 1;
 }
 
+// Takes the requests from the kernel and answers them, until the sideload is terminated or the
+// filesystem goes away. Each worker runs it on its own thread.
+static int serve_requests(fuse_data* fd, fuse_worker* worker) {
+  int result = 0;
+  while (!terminated && !fd->stop_workers) {
+    if (fd->block_cache != nullptr) {
+      // Any worker may do it, as long as none of the others has a reply in progress.
+      std::lock_guard<std::mutex> lock(fd->lock);
+      auto now = std::chrono::steady_clock::now();
+      if (now - fd->block_cache_resized >= BLOCK_CACHE_RESIZE_INTERVAL &&
+          fd->block_cache_pinned_slots == 0) {
+        block_cache_resize(fd);
+        fd->block_cache_resized = now;
+      }
+    }
+
+    fd_set fds;
+    struct timeval tv;
+    FD_ZERO(&fds);
+    FD_SET(fd->ffd, &fds);
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    int rc = select(fd->ffd + 1, &fds, nullptr, nullptr, &tv);
+    if (rc <= 0) {
+      continue;
+    }
+    // The fd is non-blocking, as another worker may have taken the request already.
+    ssize_t len =
+        TEMP_FAILURE_RETRY(read(fd->ffd, worker->request.data(), worker->request.size()));
+    if (len == -1) {
+      if (errno == EAGAIN) {
+        continue;
+      }
+      perror("read request");
+      if (errno == ENODEV) {
+        fd->stop_workers = true;
+        return -1;
+      }
+      continue;
+    }
+
+    if (static_cast<size_t>(len) < sizeof(fuse_in_header)) {
+      fprintf(stderr, "request too short: len=%zd\n", len);
+      continue;
+    }
+
+    fuse_in_header* hdr = reinterpret_cast<fuse_in_header*>(worker->request.data());
+    void* data = worker->request.data() + sizeof(fuse_in_header);
+
+    result = -ENOSYS;
+
+    switch (hdr->opcode) {
+      case FUSE_INIT:
+        result = handle_init(data, fd, hdr);
+        break;
+
+      case FUSE_LOOKUP:
+        result = handle_lookup(data, fd, hdr);
+        break;
+
+      case FUSE_GETATTR:
+        result = handle_getattr(data, fd, hdr);
+        break;
+
+      case FUSE_OPEN:
+        result = handle_open(data, fd, hdr);
+        break;
+
+      case FUSE_READ: {
+        auto start = std::chrono::steady_clock::now();
+        result = handle_read(data, fd, worker, hdr);
+        record_read(fd, static_cast<const fuse_read_in*>(data)->size, ns_since(start));
+        break;
+      }
+
+      case FUSE_FLUSH:
+        result = handle_flush(data, fd, hdr);
+        break;
+
+      case FUSE_RELEASE:
+        result = handle_release(data, fd, hdr);
+        break;
+
+      default:
+        fprintf(stderr, "unknown fuse request opcode %d\n", hdr->opcode);
+        break;
+    }
+
+    if (result != NO_STATUS) {
+      fuse_out_header outhdr;
+      outhdr.len = sizeof(outhdr);
+      outhdr.error = result;
+      outhdr.unique = hdr->unique;
+      TEMP_FAILURE_RETRY(write(fd->ffd, &outhdr, sizeof(outhdr)));
+    }
+  }
+  return result;
+}
+
 int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t block_size,
-                      const char* mount_point) {
+                      const char* mount_point, const char* spill_file, const char* stats_file) {
+  auto start = std::chrono::steady_clock::now();
+
   // If something's already mounted on our mountpoint, try to remove it. (Mostly in case of a
   // previous abnormal exit.)
   umount2(mount_point, MNT_FORCE);
@@ -434,40 +1268,39 @@ int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t bl
   fd.vtab = vtab;
   fd.file_size = file_size;
   fd.block_size = block_size;
-  fd.file_blocks = (file_size == 0) ? 0 : (((file_size - 1) / block_size) + 1);
+  uint64_t file_blocks = (file_size == 0) ? 0 : (((file_size - 1) / block_size) + 1);
+  fd.file_blocks = std::min<uint64_t>(file_blocks, UINT32_MAX);
 
-  uint64_t mem = free_memory();
-  uint64_t avail = mem - (INSTALL_REQUIRED_MEMORY + fd.file_blocks * sizeof(uint8_t*));
+  uint64_t mem = MemoryBudget::AvailableMemory();
+  uint64_t avail =
+      mem - (MemoryBudget::Instance().reserve() + fd.file_blocks * sizeof(uint32_t));
 
   int result;
-  if (fd.file_blocks > (1 << 18)) {
-    fprintf(stderr, "file has too many blocks (%u)\n", fd.file_blocks);
+  if (file_blocks > (1 << 18)) {
+    fprintf(stderr, "file has too many blocks (%" PRIu64 ")\n", file_blocks);
     result = -1;
     goto done;
   }
 
-  // All hashes will be zero-initialized.
   fd.hashes.resize(fd.file_blocks);
+  fd.hashed.resize(fd.file_blocks);
   fd.uid = getuid();
   fd.gid = getgid();
 
   fd.curr_block = -1;
+  fd.last_read_block = -1;
   fd.block_data = static_cast<uint8_t*>(malloc(block_size));
   if (fd.block_data == nullptr) {
     fprintf(stderr, "failed to allocate %d bites for block_data\n", block_size);
     result = -1;
     goto done;
   }
-  fd.extra_block = static_cast<uint8_t*>(malloc(block_size));
-  if (fd.extra_block == nullptr) {
-    fprintf(stderr, "failed to allocate %d bites for extra_block\n", block_size);
-    result = -1;
-    goto done;
-  }
-
   fd.block_cache_max_size = 0;
+  fd.block_cache_limit = 0;
   fd.block_cache_size = 0;
   fd.block_cache = nullptr;
+  fd.block_cache_hand = 0;
+  fd.block_cache_resized = start;
   if (mem > avail) {
     uint32_t max_size = avail / fd.block_size;
     if (max_size > fd.file_blocks) {
@@ -476,14 +1309,73 @@ int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t bl
     // The cache must be at least 1% of the file size or two blocks,
     // whichever is larger.
     if (max_size >= fd.file_blocks / 100 && max_size >= 2) {
-      fd.block_cache_max_size = max_size;
-      fd.block_cache = (uint8_t**)calloc(fd.file_blocks, sizeof(uint8_t*));
+      // The slots are mapped at once, but the pages are only committed as they get used. Leave the
+      // cache room to grow into all of the free memory, should the installer not need it.
+      uint32_t capacity = std::min<uint64_t>(mem / fd.block_size, fd.file_blocks);
+      for (uint32_t size : { capacity, max_size }) {
+        void* slab = mmap(nullptr, static_cast<size_t>(size) * block_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (slab != MAP_FAILED) {
+          fd.block_cache = static_cast<uint8_t*>(slab);
+          fd.block_cache_max_size = size;
+          break;
+        }
+      }
+      if (fd.block_cache != nullptr) {
+        fd.block_cache_limit = max_size;
+        fd.block_cache_slots.resize(fd.file_blocks, NO_SLOT);
+        fd.block_cache_blocks.resize(fd.block_cache_max_size);
+        fd.block_cache_referenced.resize(fd.block_cache_max_size);
+        fd.block_cache_pinned.resize(fd.block_cache_max_size);
+      }
     }
   }
 
+  // The blocks of a read are pinned in the cache until the reply is sent, so keep the reads of all
+  // the workers together to a share of the cache, leaving room for the read-ahead.
+  fd.max_read = std::max(block_size, MAX_READ_SIZE);
+  if (fd.block_cache_limit / (FUSE_WORKERS + 1) >= 2) {
+    fd.max_read =
+        std::min(fd.max_read, (fd.block_cache_limit / (FUSE_WORKERS + 1) - 1) * block_size);
+  }
+  // A read that doesn't start on a block boundary spans one more block.
+  fd.max_read_blocks = fd.max_read / block_size + 1;
+  fd.zero_block.resize(block_size);
+  fd.fetching.resize(fd.file_blocks);
+
+  fd.workers.resize(FUSE_WORKERS);
+  for (auto& worker : fd.workers) {
+    worker.curr_block = -1;
+    worker.block_data = static_cast<uint8_t*>(malloc(block_size));
+    worker.read_data =
+        static_cast<uint8_t*>(malloc(static_cast<size_t>(fd.max_read_blocks) * block_size));
+    if (worker.block_data == nullptr || worker.read_data == nullptr) {
+      fprintf(stderr, "failed to allocate %u bites for read_data\n",
+              (fd.max_read_blocks + 1) * block_size);
+      result = -1;
+      goto done;
+    }
+    worker.pins.reserve(fd.max_read_blocks);
+    worker.request.resize(sizeof(fuse_in_header) + PATH_MAX * 8);
+  }
+
+  chunks_load(&fd);
+
+  if (spill_file != nullptr) {
+    spill_open(&fd, spill_file);
+  }
+
+  // Read ahead if the provider can take several requests at a time, and there's a cache to put the
+  // blocks in (with room to spare beside the blocks pinned by the reads of the workers).
+  if (fd.vtab.request_blocks && fd.vtab.receive_block &&
+      fd.block_cache_limit >= (FUSE_WORKERS + 1) * fd.max_read_blocks) {
+    fd.rejected.resize(fd.file_blocks);
+    fd.receiver = std::thread(receive_read_ahead_blocks, &fd);
+  }
+
   signal(SIGTERM, sig_term);
 
-  fd.ffd.reset(open("/dev/fuse", O_RDWR));
+  fd.ffd.reset(open("/dev/fuse", O_RDWR | O_NONBLOCK));
   if (!fd.ffd) {
     perror("open /dev/fuse");
     result = -1;
@@ -493,7 +1385,7 @@ int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t bl
   {
     std::string opts = android::base::StringPrintf(
         "fd=%d,user_id=%d,group_id=%d,max_read=%u,allow_other,rootmode=040000", fd.ffd.get(),
-        fd.uid, fd.gid, block_size);
+        fd.uid, fd.gid, fd.max_read);
 
     result = mount("/dev/fuse", mount_point, "fuse", MS_NOSUID | MS_NODEV | MS_RDONLY | MS_NOEXEC,
                    opts.c_str());
@@ -503,98 +1395,42 @@ int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t bl
     }
   }
 
-  uint8_t request_buffer[sizeof(fuse_in_header) + PATH_MAX * 8];
-  while (!terminated) {
-    fd_set fds;
-    struct timeval tv;
-    FD_ZERO(&fds);
-    FD_SET(fd.ffd, &fds);
-    tv.tv_sec = 1;
-    tv.tv_usec = 0;
-    int rc = select(fd.ffd + 1, &fds, nullptr, nullptr, &tv);
-    if (rc <= 0) {
-      continue;
-    }
-    ssize_t len = TEMP_FAILURE_RETRY(read(fd.ffd, request_buffer, sizeof(request_buffer)));
-    if (len == -1) {
-      perror("read request");
-      if (errno == ENODEV) {
-        result = -1;
-        break;
-      }
-      continue;
-    }
-
-    if (static_cast<size_t>(len) < sizeof(fuse_in_header)) {
-      fprintf(stderr, "request too short: len=%zd\n", len);
-      continue;
-    }
-
-    fuse_in_header* hdr = reinterpret_cast<fuse_in_header*>(request_buffer);
-    void* data = request_buffer + sizeof(fuse_in_header);
-
-    result = -ENOSYS;
-
-    switch (hdr->opcode) {
-      case FUSE_INIT:
-        result = handle_init(data, &fd, hdr);
-        break;
-
-      case FUSE_LOOKUP:
-        result = handle_lookup(data, &fd, hdr);
-        break;
-
-      case FUSE_GETATTR:
-        result = handle_getattr(data, &fd, hdr);
-        break;
-
-      case FUSE_OPEN:
-        result = handle_open(data, &fd, hdr);
-        break;
-
-      case FUSE_READ:
-        result = handle_read(data, &fd, hdr);
-        break;
-
-      case FUSE_FLUSH:
-        result = handle_flush(data, &fd, hdr);
-        break;
-
-      case FUSE_RELEASE:
-        result = handle_release(data, &fd, hdr);
-        break;
+  // The first worker runs on this thread.
+  for (size_t i = 1; i < fd.workers.size(); ++i) {
+    fd.workers[i].thread = std::thread(serve_requests, &fd, &fd.workers[i]);
+  }
+  result = serve_requests(&fd, &fd.workers[0]);
 
-      default:
-        fprintf(stderr, "unknown fuse request opcode %d\n", hdr->opcode);
-        break;
+done:
+  fd.stop_workers = true;
+  for (auto& worker : fd.workers) {
+    if (worker.thread.joinable()) {
+      worker.thread.join();
     }
-
-    if (result != NO_STATUS) {
-      fuse_out_header outhdr;
-      outhdr.len = sizeof(outhdr);
-      outhdr.error = result;
-      outhdr.unique = hdr->unique;
-      TEMP_FAILURE_RETRY(write(fd.ffd, &outhdr, sizeof(outhdr)));
+  }
+  if (fd.receiver.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(fd.lock);
+      fd.stop_receiver = true;
+      fd.cond.notify_all();
     }
+    fd.receiver.join();
   }
-
-done:
   fd.vtab.close();
+  report_stats(&fd, ns_since(start), stats_file);
 
   if (umount2(mount_point, MNT_DETACH) == -1) {
     fprintf(stderr, "fuse_sideload umount failed: %s\n", strerror(errno));
   }
 
-  if (fd.block_cache) {
-    uint32_t n;
-    for (n = 0; n < fd.file_blocks; ++n) {
-      free(fd.block_cache[n]);
-    }
-    free(fd.block_cache);
+  if (fd.block_cache != nullptr) {
+    munmap(fd.block_cache, static_cast<size_t>(fd.block_cache_max_size) * block_size);
   }
-
   free(fd.block_data);
-  free(fd.extra_block);
+  for (auto& worker : fd.workers) {
+    free(worker.block_data);
+    free(worker.read_data);
+  }
 
   return result;
 }
@@ -25,15 +25,37 @@ static constexpr const char* FUSE_SIDELOAD_HOST_MOUNTPOINT = "/sideload";
 static constexpr const char* FUSE_SIDELOAD_HOST_FILENAME = "package.zip";
 static constexpr const char* FUSE_SIDELOAD_HOST_PATHNAME = "/sideload/package.zip";
 
+// Exists while every block of the package is checked against its signed chunk digests as it's
+// served, which makes the whole-file signature check redundant.
+static constexpr const char* FUSE_SIDELOAD_HOST_CHUNKS_VERIFIED_FILENAME = "chunks_verified";
+static constexpr const char* FUSE_SIDELOAD_HOST_CHUNKS_VERIFIED_PATHNAME =
+    "/sideload/chunks_verified";
+
+// Where the blocks of an adb sideload are kept, so that a retry after a failure can resume.
+static constexpr const char* FUSE_SIDELOAD_SPILL_PATHNAME = "/cache/recovery/sideload.spill";
+
+// Where the stats of the last adb sideload are written, besides the summary in the log.
+static constexpr const char* FUSE_SIDELOAD_STATS_PATHNAME = "/tmp/sideload.stats";
+
 struct provider_vtab {
   // read a block
   std::function<int(uint32_t block, uint8_t* buffer, uint32_t fetch_size)> read_block;
 
+  // Optional, for the providers that answer the requests in order: send the request for |count|
+  // consecutive blocks without waiting for them, and read the data of the oldest outstanding
+  // block. These allow keeping several requests in flight to read ahead.
+  std::function<int(uint32_t block, uint32_t count)> request_blocks;
+  std::function<int(uint8_t* buffer, uint32_t fetch_size)> receive_block;
+
   // close down
   std::function<void(void)> close;
 };
 
+// Serves the file given by |vtab| at |mount_point| until asked to exit. If |spill_file| is set, the
+// blocks are also kept there, and the ones left by an earlier run for the same file are reused.
+// The stats of the run are logged on exit, and written to |stats_file| too if it's set.
 int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t block_size,
-                      const char* mount_point = FUSE_SIDELOAD_HOST_MOUNTPOINT);
+                      const char* mount_point = FUSE_SIDELOAD_HOST_MOUNTPOINT,
+                      const char* spill_file = nullptr, const char* stats_file = nullptr);
 
 #endif
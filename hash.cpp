@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2019 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// The hash of the backup data, recorded in the EOD and checked by the restore.
+//
+// Only the algorithm named by hash.name is updated. The SHA-1 and SHA-256 implementations of
+// BoringSSL pick the ARMv8 crypto extensions (or SHA-NI) at runtime where the CPU has them.
+//
+// With hash_start_thread(), hash_update() queues copies of the data for a thread of its own, so
+// hashing overlaps with the compression and the writes to the socket (or, on the restore, with
+// the reads and the device writes). hash_hold() keeps the thread from going past the data queued
+// so far, until hash_release().
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <fs_mgr.h>
+#include "roots.h"
+
+#include "bu.h"
+
+// The most data queued for the hashing thread, before hash_update() blocks.
+#define HASH_QUEUE_MAX_BYTES (8 * 1024 * 1024)
+
+static std::mutex hash_mutex;
+static std::condition_variable hash_cond;
+static std::deque<std::pair<hash_ctx*, std::vector<uint8_t>>> hash_queue;
+static size_t hash_queued_bytes;
+static bool hash_busy;
+static bool hash_stopping;
+static std::thread hash_thread;
+
+// The items queued and taken off the queue so far, and the first one held back with hash_hold().
+static uint64_t hash_queued_items;
+static uint64_t hash_taken_items;
+static bool hash_held;
+static uint64_t hash_hold_item;
+
+// Whether the thread has something to hash, with hash_mutex held.
+static bool hash_ready() {
+  return !hash_queue.empty() && (!hash_held || hash_taken_items < hash_hold_item);
+}
+
+static void hash_update_now(hash_ctx* ctx, const void* buf, size_t len) {
+  uint64_t start = stats_now();
+  switch (ctx->type) {
+    case HASH_MD5:
+      MD5_Update(&ctx->md5, buf, len);
+      break;
+    case HASH_SHA1:
+      SHA1_Update(&ctx->sha1, buf, len);
+      break;
+    case HASH_SHA256:
+      SHA256_Update(&ctx->sha256, buf, len);
+      break;
+  }
+  stats_add(STAT_HASH, len, start);
+}
+
+static void hash_thread_main() {
+  std::unique_lock<std::mutex> lock(hash_mutex);
+  while (true) {
+    hash_cond.wait(lock, [] { return hash_stopping || hash_ready(); });
+    if (!hash_ready()) {
+      // What's still held back when stopping is past the data that the EOD covers.
+      hash_queue.clear();
+      hash_queued_bytes = 0;
+      hash_held = false;
+      break;
+    }
+    auto item = std::move(hash_queue.front());
+    hash_queue.pop_front();
+    hash_taken_items++;
+    hash_busy = true;
+    lock.unlock();
+
+    hash_update_now(item.first, item.second.data(), item.second.size());
+
+    lock.lock();
+    hash_busy = false;
+    hash_queued_bytes -= item.second.size();
+    hash_cond.notify_all();
+  }
+}
+
+int hash_init(hash_ctx* ctx, const char* name) {
+  if (!strcasecmp(name, "md5")) {
+    ctx->type = HASH_MD5;
+    MD5_Init(&ctx->md5);
+  } else if (!strcasecmp(name, "sha1")) {
+    ctx->type = HASH_SHA1;
+    SHA1_Init(&ctx->sha1);
+  } else if (!strcasecmp(name, "sha256")) {
+    ctx->type = HASH_SHA256;
+    SHA256_Init(&ctx->sha256);
+  } else {
+    logmsg("hash_init: unknown hash %s, using md5\n", name);
+    ctx->type = HASH_MD5;
+    MD5_Init(&ctx->md5);
+    return -1;
+  }
+  return 0;
+}
+
+void hash_update(hash_ctx* ctx, const void* buf, size_t len) {
+  if (!hash_thread.joinable()) {
+    hash_update_now(ctx, buf, len);
+    return;
+  }
+
+  const uint8_t* p = (const uint8_t*)buf;
+  std::unique_lock<std::mutex> lock(hash_mutex);
+  hash_cond.wait(lock, [] { return hash_queued_bytes < HASH_QUEUE_MAX_BYTES; });
+  hash_queue.emplace_back(ctx, std::vector<uint8_t>(p, p + len));
+  hash_queued_items++;
+  hash_queued_bytes += len;
+  hash_cond.notify_all();
+}
+
+void hash_sync() {
+  std::unique_lock<std::mutex> lock(hash_mutex);
+  hash_cond.wait(lock, [] { return !hash_ready() && !hash_busy; });
+}
+
+void hash_hold() {
+  std::lock_guard<std::mutex> lock(hash_mutex);
+  if (hash_held) return;
+  hash_held = true;
+  hash_hold_item = hash_queued_items;
+}
+
+void hash_release() {
+  std::lock_guard<std::mutex> lock(hash_mutex);
+  hash_held = false;
+  hash_cond.notify_all();
+}
+
+void hash_final(hash_ctx* ctx, char* hexdigest) {
+  hash_sync();
+
+  unsigned char digest[HASH_MAX_LENGTH];
+  size_t digest_len;
+  switch (ctx->type) {
+    case HASH_SHA1:
+      SHA1_Final(digest, &ctx->sha1);
+      digest_len = SHA_DIGEST_LENGTH;
+      break;
+    case HASH_SHA256:
+      SHA256_Final(digest, &ctx->sha256);
+      digest_len = SHA256_DIGEST_LENGTH;
+      break;
+    default:
+      MD5_Final(digest, &ctx->md5);
+      digest_len = MD5_DIGEST_LENGTH;
+      break;
+  }
+  for (size_t n = 0; n < digest_len; ++n) {
+    sprintf(hexdigest + 2 * n, "%02x", digest[n]);
+  }
+}
+
+void hash_start_thread() {
+  if (hash_thread.joinable()) return;
+  hash_stopping = false;
+  hash_thread = std::thread(hash_thread_main);
+}
+
+void hash_stop_thread() {
+  if (!hash_thread.joinable()) return;
+  {
+    std::lock_guard<std::mutex> lock(hash_mutex);
+    hash_stopping = true;
+  }
+  hash_cond.notify_all();
+  hash_thread.join();
+}
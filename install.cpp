@@ -24,14 +24,15 @@
 #include <limits.h>
 #include <setjmp.h>
 #include <string.h>
+#include <signal.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include <algorithm>
-#include <atomic>
 #include <chrono>
-#include <condition_variable>
 #include <functional>
 #include <limits>
 #include <map>
@@ -47,27 +48,33 @@
 #include <android-base/properties.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 #include <vintf/VintfObjectRecovery.h>
 #include <ziparchive/zip_archive.h>
 
 #include <cutils/properties.h>
 
 #include "common.h"
+#include "fuse_sideload.h"
 #include "otautil/SysUtil.h"
-#include "otautil/ThermalUtil.h"
+#include "otautil/ZipUtil.h"
+#include "otautil/boot_trace.h"
+#include "otautil/command_pipe.h"
 #include "otautil/error_code.h"
+#include "otautil/sensor_service.h"
 #include "private/install.h"
 #include "roots.h"
 #include "ui.h"
 #include "verifier.h"
 
-using namespace std::chrono_literals;
-
 // Default allocation of progress bar segments to operations
 static constexpr int VERIFICATION_PROGRESS_TIME = 60;
 static constexpr float VERIFICATION_PROGRESS_FRACTION = 0.25;
 
-static std::condition_variable finish_log_temperature;
+// Packages up to this size are read in whole as they're mapped for verification.
+static constexpr off_t POPULATE_MAX_PACKAGE_SIZE = 256 * 1024 * 1024;
+// Version of the time_*_ms lines logged to last_install.
+static constexpr int INSTALL_REPORT_VERSION = 1;
 
 // This function parses and returns the build.version.incremental
 static std::string parse_build_number(const std::string& str) {
@@ -127,6 +134,17 @@ static void read_source_target_build(ZipArchiveHandle zip, std::vector<std::stri
   }
 }
 
+// Logs the time spent in an install |phase| between |start| and |end| to last_install, in
+// milliseconds.
+static void log_phase_time(
+    std::vector<std::string>* log_buffer, const char* phase,
+    std::chrono::steady_clock::time_point start,
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now()) {
+  long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+  log_buffer->push_back(android::base::StringPrintf("time_%s_ms: %lld", phase, elapsed));
+  TraceRecord(std::string("install_package/") + phase, start, end);
+}
+
 // Parses the metadata of the OTA package in |zip| and checks whether we are
 // allowed to accept this A/B package. Downgrading is not allowed unless
 // explicitly enabled in the package and only for incremental packages.
@@ -260,9 +278,45 @@ int update_binary_command_ab(const std::string& package, ZipArchiveHandle zip,
   return 0;
 }
 
+// Extracts the update binary |entry| into a sealed memfd, which can be executed through
+// /proc/self/fd without a copy under /tmp. Only ELF binaries qualify: the kernel can't run a script
+// from a close-on-exec descriptor, and the memfd must not leak into the updater. Returns -1 if
+// memfds aren't available or the entry doesn't qualify.
+static int extract_update_binary_to_memfd(ZipArchiveHandle zip, ZipEntry* entry) {
+#ifdef __NR_memfd_create
+  android::base::unique_fd fd(static_cast<int>(
+      syscall(__NR_memfd_create, "update-binary", MFD_CLOEXEC | MFD_ALLOW_SEALING)));
+  if (fd == -1) {
+    PLOG(WARNING) << "memfd_create failed";
+    return -1;
+  }
+  int32_t error = ExtractEntryToFile(zip, entry, fd);
+  if (error != 0) {
+    LOG(WARNING) << "Failed to extract the update binary to a memfd: " << ErrorCodeString(error);
+    return -1;
+  }
+  char magic[4];
+  if (TEMP_FAILURE_RETRY(pread(fd, magic, sizeof(magic), 0)) != sizeof(magic) ||
+      memcmp(magic, "\x7f" "ELF", sizeof(magic)) != 0) {
+    return -1;
+  }
+  if (fchmod(fd, 0755) == -1 ||
+      fcntl(fd, F_ADD_SEALS, F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE) == -1) {
+    PLOG(WARNING) << "Failed to seal the update binary memfd";
+    return -1;
+  }
+  return fd.release();
+#else
+  (void)zip;
+  (void)entry;
+  return -1;
+#endif
+}
+
 int update_binary_command_legacy(const std::string& package, ZipArchiveHandle zip,
                                  const std::string& binary_path, int retry_count, int status_fd,
-                                 std::vector<std::string>* cmd) {
+                                 std::vector<std::string>* cmd,
+                                 android::base::unique_fd* binary_fd) {
   CHECK(cmd != nullptr);
 
   // On traditional updates we extract the update binary from the package.
@@ -274,6 +328,23 @@ int update_binary_command_legacy(const std::string& package, ZipArchiveHandle zi
     return INSTALL_CORRUPT;
   }
 
+  // If asked to, run it from memory; the caller keeps |binary_fd| open until the exec.
+  if (binary_fd != nullptr) {
+    binary_fd->reset(extract_update_binary_to_memfd(zip, &binary_entry));
+    if (*binary_fd != -1) {
+      *cmd = {
+        android::base::StringPrintf("/proc/self/fd/%d", binary_fd->get()),
+        std::to_string(kRecoveryApiVersion),
+        std::to_string(status_fd),
+        package,
+      };
+      if (retry_count > 0) {
+        cmd->push_back("retry");
+      }
+      return 0;
+    }
+  }
+
   unlink(binary_path.c_str());
   int fd = open(binary_path.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0755);
   if (fd == -1) {
@@ -300,34 +371,12 @@ int update_binary_command_legacy(const std::string& package, ZipArchiveHandle zi
   return 0;
 }
 
-static void log_max_temperature(int* max_temperature, const std::atomic<bool>& logger_finished) {
-  CHECK(max_temperature != nullptr);
-  std::mutex mtx;
-  std::unique_lock<std::mutex> lck(mtx);
-  while (!logger_finished.load() &&
-         finish_log_temperature.wait_for(lck, 20s) == std::cv_status::timeout) {
-    *max_temperature = std::max(*max_temperature, GetMaxValueFromThermalZone());
-  }
-}
-
 static jmp_buf jb;
 static void sig_bus(int) {
   longjmp(jb, 1);
 }
 
-// If the package contains an update binary, extract it and run it.
-static int try_update_binary(const std::string& package, ZipArchiveHandle zip, bool* wipe_cache,
-                             std::vector<std::string>* log_buffer, int retry_count,
-                             int* max_temperature) {
-  read_source_target_build(zip, log_buffer);
-
-  int ret;
-  int pipefd[2];
-  pipe(pipefd);
-
-  std::vector<std::string> args;
-  bool ab_ota = false;
-
+static bool is_ab_package(ZipArchiveHandle zip) {
 #ifdef AB_OTA_UPDATER
   // A/B updates contain a payload.bin and a text file describing the payload.
   // We check for this file to see whether the update package has to be flashed using update_engine
@@ -336,16 +385,42 @@ static int try_update_binary(const std::string& package, ZipArchiveHandle zip, b
   ZipString property_name(AB_OTA_PAYLOAD_PROPERTIES);
   ZipEntry properties_entry;
   if (FindEntry(zip, property_name, &properties_entry) == 0) {
-    ab_ota = true;
+    return true;
   }
+#else
+  (void)zip;
 #endif
+  return false;
+}
+
+// If the package contains an update binary, extract it and run it.
+static int try_update_binary(const std::string& package, ZipArchiveHandle zip, bool* wipe_cache,
+                             std::vector<std::string>* log_buffer, int retry_count,
+                             int* max_temperature) {
+  read_source_target_build(zip, log_buffer);
+
+  int ret;
+  int pipefd[2];
+  pipe(pipefd);
 
+  std::vector<std::string> args;
+  android::base::unique_fd binary_fd;
+  auto extract_start = std::chrono::steady_clock::now();
+  bool ab_ota = is_ab_package(zip);
   if (ab_ota) {
     ret = update_binary_command_ab(package, zip, "/sbin/update_engine_sideload", retry_count,
                                    pipefd[1], &args);
   } else {
-    ret = update_binary_command_legacy(package, zip, "/tmp/update-binary", retry_count, pipefd[1],
-                                       &args);
+    // With ro.recovery.memfd_updater set, the update binary is executed from a memfd instead of
+    // a copy in /tmp.
+    ret = update_binary_command_legacy(
+        package, zip, "/tmp/update-binary", retry_count, pipefd[1], &args,
+        android::base::GetBoolProperty("ro.recovery.memfd_updater", false) ? &binary_fd : nullptr);
+    // Only for devices whose packages carry an updater that knows the flag (older ones take no more
+    // than six arguments). The reader below tells the formats apart either way.
+    if (ret == 0 && android::base::GetBoolProperty("ro.recovery.framed_updater_pipe", false)) {
+      args.push_back(kFramedCommandPipeFlag);
+    }
   }
   if (ret) {
     close(pipefd[0]);
@@ -353,6 +428,7 @@ static int try_update_binary(const std::string& package, ZipArchiveHandle zip, b
     log_buffer->push_back(android::base::StringPrintf("error: %d", kUpdateBinaryCommandFailure));
     return ret;
   }
+  log_phase_time(log_buffer, "extract_updater", extract_start);
 
   // When executing the update binary contained in the package, the
   // arguments passed are:
@@ -401,6 +477,10 @@ static int try_update_binary(const std::string& package, ZipArchiveHandle zip, b
   //   - an optional argument "retry" if this update is a retry of a failed
   //   update attempt.
   //
+  //   - an optional argument "--framed_pipe" if the updater may write the
+  //   commands above in binary frames, with the set_progress ones throttled
+  //   (see otautil/command_pipe.h).
+  //
 
   // Convert the vector to a NULL-terminated char* array suitable for execv.
   const char* chr_args[args.size() + 1];
@@ -409,6 +489,7 @@ static int try_update_binary(const std::string& package, ZipArchiveHandle zip, b
     chr_args[i] = args[i].c_str();
   }
 
+  auto updater_start = std::chrono::steady_clock::now();
   pid_t pid = fork();
 
   if (pid == -1) {
@@ -432,19 +513,13 @@ static int try_update_binary(const std::string& package, ZipArchiveHandle zip, b
   }
   close(pipefd[1]);
 
-  std::atomic<bool> logger_finished(false);
-  std::thread temperature_logger(log_max_temperature, max_temperature, std::ref(logger_finished));
-
   *wipe_cache = false;
   bool retry_update = false;
 
-  char buffer[1024];
-  FILE* from_child = fdopen(pipefd[0], "r");
-  while (fgets(buffer, sizeof(buffer), from_child) != nullptr) {
-    std::string line(buffer);
+  auto handle_command = [&](const std::string& line) {
     size_t space = line.find_first_of(" \n");
     std::string command(line.substr(0, space));
-    if (command.empty()) continue;
+    if (command.empty()) return;
 
     // Get rid of the leading and trailing space and/or newline.
     std::string args = space == std::string::npos ? "" : android::base::Trim(line.substr(space));
@@ -491,15 +566,20 @@ static int try_update_binary(const std::string& package, ZipArchiveHandle zip, b
     } else {
       LOG(ERROR) << "unknown command [" << command << "]";
     }
+  };
+  // Whole reads of the pipe at a time, with only the last set_progress of each read going to the
+  // UI, whichever format the updater writes.
+  CommandPipeReader from_child(pipefd[0]);
+  while (from_child.Read(handle_command, [](double fraction) { ui->SetProgress(fraction); })) {
   }
-  fclose(from_child);
+  close(pipefd[0]);
 
   int status;
   waitpid(pid, &status, 0);
+  log_phase_time(log_buffer, "updater", updater_start);
 
-  logger_finished.store(true);
-  finish_log_temperature.notify_one();
-  temperature_logger.join();
+  // The sensor service has been polling the thermal zones all along.
+  *max_temperature = std::max(*max_temperature, SensorService::Get().peak_temperature());
 
   if (retry_update) {
     return INSTALL_RETRY;
@@ -580,6 +660,20 @@ bool verify_package_compatibility(ZipArchiveHandle package_zip) {
   return false;
 }
 
+// The results of the checks of a package that only read it, which may run while its signature is
+// being verified. update_binary_command_ab() repeats the (cheap) A/B check.
+struct PreinstallChecks {
+  bool compatible = false;
+  int ab_build_check = 0;
+};
+
+static void run_preinstall_checks(ZipArchiveHandle zip, PreinstallChecks* checks) {
+  checks->compatible = verify_package_compatibility(zip);
+  if (checks->compatible && is_ab_package(zip)) {
+    checks->ab_build_check = check_newer_ab_build(zip);
+  }
+}
+
 static int really_install_package(std::string path, bool* wipe_cache, bool needs_mount,
                                   std::vector<std::string>* log_buffer, int retry_count,
                                   bool verify, int* max_temperature) {
@@ -617,38 +711,129 @@ static int really_install_package(std::string path, bool* wipe_cache, bool needs
     }
   }
 
+  // A smaller package that's about to be verified in full is read in as it's mapped, in large
+  // requests, instead of a page fault at a time. FUSE-backed packages can't be read in ahead of
+  // the host.
+  struct stat sb;
+  bool populate = verify && path[0] != '@' &&
+                  !android::base::StartsWith(path, FUSE_SIDELOAD_HOST_MOUNTPOINT) &&
+                  stat(path.c_str(), &sb) == 0 && sb.st_size <= POPULATE_MAX_PACKAGE_SIZE;
+
+  // Heavily fragmented block maps can be paged in from the device as they're read, instead of
+  // being set up one mapping per range.
+  SetLazyBlockMapThreshold(
+      android::base::GetUintProperty<size_t>("ro.recovery.lazy_block_map_ranges", SIZE_MAX));
+
+  auto map_start = std::chrono::steady_clock::now();
   MemMapping map;
-  if (!map.MapFile(path)) {
+  if (!map.MapFile(path, populate)) {
     LOG(ERROR) << "failed to map file";
     log_buffer->push_back(android::base::StringPrintf("error: %d", kMapFileFailure));
     return INSTALL_CORRUPT;
   }
+  log_phase_time(log_buffer, "map", map_start);
+
+  // A sideloaded package with signed chunk digests is checked block by block as fuse_sideload
+  // serves it, so any byte read from it is authentic.
+  if (verify && path == FUSE_SIDELOAD_HOST_PATHNAME &&
+      access(FUSE_SIDELOAD_HOST_CHUNKS_VERIFIED_PATHNAME, F_OK) == 0) {
+    ui->Print("Package is verified against its chunk digests as it's read.\n");
+    verify = false;
+  }
+
+  // With ro.recovery.parallel_checks set, the checks that only read the package (compatibility,
+  // A/B downgrade) run on another thread while the signature is verified. This parses the package
+  // before it's known to be authentic, which is why it's opt-in. FUSE-backed packages are left
+  // out, since a SIGBUS on the checker thread can't be recovered through |jb|.
+  ZipArchiveHandle zip = nullptr;
+  PreinstallChecks checks;
+  bool checked = false;
 
   // Verify package.
   set_perf_mode(true);
-  if (verify && !verify_package(map.addr, map.length)) {
-    log_buffer->push_back(android::base::StringPrintf("error: %d", kZipVerificationFailure));
-    set_perf_mode(false);
-    return INSTALL_UNVERIFIED;
+  if (verify) {
+    std::thread checker;
+    if (android::base::GetBoolProperty("ro.recovery.parallel_checks", false) &&
+        !android::base::StartsWith(path, FUSE_SIDELOAD_HOST_MOUNTPOINT)) {
+      if (OpenArchiveFromMemory(map.addr, map.length, path.c_str(), &zip) == 0) {
+        checker = std::thread(run_preinstall_checks, zip, &checks);
+        checked = true;
+      } else {
+        // Opened again (and the failure reported) below.
+        CloseArchive(zip);
+        zip = nullptr;
+      }
+    }
+    auto verify_start = std::chrono::steady_clock::now();
+    bool verified = verify_package(map.addr, map.length);
+    log_phase_time(log_buffer, "verify", verify_start);
+    if (checker.joinable()) {
+      checker.join();
+    }
+    if (!verified) {
+      log_buffer->push_back(android::base::StringPrintf("error: %d", kZipVerificationFailure));
+      if (zip != nullptr) {
+        CloseArchive(zip);
+      }
+      set_perf_mode(false);
+      return INSTALL_UNVERIFIED;
+    }
+  }
+
+  // From here on, the package is read through the central directory, an entry at a time.
+  map.Advise(MemAccess::RANDOM);
+
+  // Through FUSE, each page fault of a random read is a round trip to the host. Fetch the central
+  // directory in one go before it's walked, and the entries that are read here (rather than by the
+  // updater) front to back.
+  bool fuse_package = android::base::StartsWith(path, FUSE_SIDELOAD_HOST_MOUNTPOINT);
+  if (fuse_package) {
+    PrefetchZipDirectory(map.addr, map.length);
   }
 
   // Try to open the package.
-  ZipArchiveHandle zip;
-  int err = OpenArchiveFromMemory(map.addr, map.length, path.c_str(), &zip);
-  if (err != 0) {
-    LOG(ERROR) << "Can't open " << path << " : " << ErrorCodeString(err);
-    log_buffer->push_back(android::base::StringPrintf("error: %d", kZipOpenFailure));
+  if (zip == nullptr) {
+    int err = OpenArchiveFromMemory(map.addr, map.length, path.c_str(), &zip);
+    if (err != 0) {
+      LOG(ERROR) << "Can't open " << path << " : " << ErrorCodeString(err);
+      log_buffer->push_back(android::base::StringPrintf("error: %d", kZipOpenFailure));
+
+      CloseArchive(zip);
+      set_perf_mode(false);
+      return INSTALL_CORRUPT;
+    }
+  }
+  if (fuse_package) {
+    PrefetchZipEntries(zip, map.addr, map.length,
+                       { "META-INF/com/android/metadata", "compatibility.zip",
+                         "META-INF/com/google/android/update-binary", "payload_properties.txt" });
+  }
 
+  // Additionally verify the compatibility of the package. Checks that already ran alongside the
+  // verification don't get a time of their own.
+  auto compat_start = std::chrono::steady_clock::now();
+  if (checked ? !checks.compatible : !verify_package_compatibility(zip)) {
+    log_buffer->push_back(android::base::StringPrintf("error: %d", kPackageCompatibilityFailure));
     CloseArchive(zip);
-    set_perf_mode(false);
     return INSTALL_CORRUPT;
   }
+  if (checked && checks.ab_build_check != 0) {
+    log_buffer->push_back(android::base::StringPrintf("error: %d", kUpdateBinaryCommandFailure));
+    CloseArchive(zip);
+    set_perf_mode(false);
+    return checks.ab_build_check;
+  }
+  if (!checked) {
+    log_phase_time(log_buffer, "compat_check", compat_start);
+  }
 
-  // Additionally verify the compatibility of the package.
-  if (!verify_package_compatibility(zip)) {
-    log_buffer->push_back(android::base::StringPrintf("error: %d", kPackageCompatibilityFailure));
+  // The packages expect /tmp and /cache to be mounted, which has been going on during the
+  // verification.
+  if (wait_for_install_mounts() != 0) {
+    LOG(ERROR) << "failed to set up expected mounts for install; aborting";
     CloseArchive(zip);
-    return INSTALL_CORRUPT;
+    set_perf_mode(false);
+    return INSTALL_ERROR;
   }
 
   // Verify and install the contents of the package.
@@ -658,11 +843,13 @@ static int really_install_package(std::string path, bool* wipe_cache, bool needs
   }
   ui->SetEnableReboot(false);
   int result = try_update_binary(path, zip, wipe_cache, log_buffer, retry_count, max_temperature);
+  auto post_install_start = std::chrono::steady_clock::now();
   ui->SetEnableReboot(true);
   ui->Print("\n");
 
   CloseArchive(zip);
   set_perf_mode(false);
+  log_phase_time(log_buffer, "post_install", post_install_start);
   return result;
 }
 
@@ -674,18 +861,25 @@ int install_package(const std::string& path, bool* wipe_cache, const std::string
 
   modified_flash = true;
   auto start = std::chrono::system_clock::now();
+  TracePhase trace("install_package");
 
-  int start_temperature = GetMaxValueFromThermalZone();
+  SensorService& sensors = SensorService::Get();
+  int start_temperature = sensors.temperature();
   int max_temperature = start_temperature;
+  sensors.ResetPeakTemperature();
 
   int result;
   std::vector<std::string> log_buffer;
-  if (setup_install_mounts() != 0) {
+  // /tmp and /cache get mounted while the package is verified; really_install_package() waits for
+  // them before running the updater.
+  if (start_install_mounts() != 0) {
     LOG(ERROR) << "failed to set up expected mounts for install; aborting";
     result = INSTALL_ERROR;
   } else {
     result = really_install_package(path, wipe_cache, needs_mount, &log_buffer, retry_count, verify,
                                     &max_temperature);
+    // Settles the mounts if the install ended early.
+    wait_for_install_mounts();
   }
 
   // Measure the time spent to apply OTA update in seconds.
@@ -718,7 +912,7 @@ int install_package(const std::string& path, bool* wipe_cache, const std::string
     "retry: " + std::to_string(retry_count),
   };
 
-  int end_temperature = GetMaxValueFromThermalZone();
+  int end_temperature = sensors.temperature();
   max_temperature = std::max(end_temperature, max_temperature);
   if (start_temperature > 0) {
     log_buffer.push_back("temperature_start: " + std::to_string(start_temperature));
@@ -730,6 +924,12 @@ int install_package(const std::string& path, bool* wipe_cache, const std::string
     log_buffer.push_back("temperature_max: " + std::to_string(max_temperature));
   }
 
+  // The time_*_ms lines form the install report. Bump INSTALL_REPORT_VERSION whenever a line is
+  // renamed or changes meaning, so that it can be aggregated across builds and devices.
+  log_buffer.push_back("install_report_version: " + std::to_string(INSTALL_REPORT_VERSION));
+  log_buffer.push_back("device: " + android::base::GetProperty("ro.product.device", ""));
+  log_buffer.push_back("model: " + android::base::GetProperty("ro.product.model", ""));
+
   std::string log_content =
       android::base::Join(log_header, "\n") + "\n" + android::base::Join(log_buffer, "\n") + "\n";
   if (!android::base::WriteStringToFile(log_content, install_file)) {
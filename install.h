@@ -18,6 +18,7 @@
 #define RECOVERY_INSTALL_H_
 
 #include <string>
+
 #include <ziparchive/zip_archive.h>
 
 enum {
@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2019 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// The manifests of the incremental backups.
+//
+// A manifest is a manifest_header, followed by the SHA-256 of each chunk of the partition. The
+// host keeps the manifests of the last backup, and pushes them back to the device (to the --base
+// directory) for the next one.
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <android-base/file.h>
+#include <android-base/unique_fd.h>
+
+#include <fs_mgr.h>
+#include "roots.h"
+
+#include "bu.h"
+
+#define MANIFEST_MAGIC "BUMANIF1"
+
+static_assert(MANIFEST_CHUNK_SIZE == PIPELINE_BUFFER_SIZE, "a chunk must be one reader buffer");
+
+struct manifest_header {
+  char magic[8];
+  uint64_t dev_size;
+  uint32_t chunk_size;
+  uint32_t hash_size;
+  uint64_t num_chunks;
+};
+
+// Reads the chunk hashes of the manifest in |path|, if it describes a partition of |dev_size|.
+static bool load_manifest(const char* path, uint64_t dev_size, std::string* hashes) {
+  android::base::unique_fd fd(open(path, O_RDONLY | O_CLOEXEC));
+  if (fd == -1) {
+    logmsg("load_manifest: no manifest at %s\n", path);
+    return false;
+  }
+  manifest_header hdr;
+  if (!android::base::ReadFully(fd, &hdr, sizeof(hdr)) ||
+      memcmp(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic)) != 0) {
+    logmsg("load_manifest: %s is not a manifest\n", path);
+    return false;
+  }
+  if (hdr.dev_size != dev_size || hdr.chunk_size != MANIFEST_CHUNK_SIZE ||
+      hdr.hash_size != SHA256_DIGEST_LENGTH) {
+    logmsg("load_manifest: %s is for another partition layout\n", path);
+    return false;
+  }
+  hashes->resize(hdr.num_chunks * SHA256_DIGEST_LENGTH);
+  if (!android::base::ReadFully(fd, &(*hashes)[0], hashes->size())) {
+    logmsg("load_manifest: %s is truncated\n", path);
+    return false;
+  }
+  return true;
+}
+
+int manifest_scan(partspec* part, const char* base_dir) {
+  std::string base;
+  if (base_dir != NULL) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s%s", base_dir, part->name, MANIFEST_SUFFIX);
+    if (!load_manifest(path, part->size, &base)) {
+      base.clear();
+    }
+  }
+
+  int fd = open(part->vol->blk_device, O_RDONLY);
+  if (fd < 0) {
+    logmsg("manifest_scan: open %s failed\n", part->vol->blk_device);
+    return -1;
+  }
+
+  size_t num_chunks = (part->size + MANIFEST_CHUNK_SIZE - 1) / MANIFEST_CHUNK_SIZE;
+  free(part->chunk_hashes);
+  part->chunk_hashes = (uint8_t*)malloc(num_chunks * SHA256_DIGEST_LENGTH + 1);
+  part->num_chunks = num_chunks;
+  free(part->extents);
+  part->extents = NULL;
+  part->num_extents = 0;
+  size_t capacity = 0;
+
+  // MANIFEST_CHUNK_SIZE is the buffer size of the reader, so each buffer is one chunk.
+  int rc = 0;
+  {
+    DeviceReader reader(fd, { { 0, part->size } });
+    size_t chunk = 0;
+    uint64_t off = 0;
+    const uint8_t* data;
+    size_t len;
+    while ((data = reader.Next(&len)) != nullptr) {
+      uint8_t* hash = part->chunk_hashes + chunk * SHA256_DIGEST_LENGTH;
+      SHA256(data, len, hash);
+      bool changed = (chunk + 1) * SHA256_DIGEST_LENGTH > base.size() ||
+                     memcmp(hash, base.data() + chunk * SHA256_DIGEST_LENGTH,
+                            SHA256_DIGEST_LENGTH) != 0;
+      if (changed) {
+        sparse_extent* last = part->num_extents ? &part->extents[part->num_extents - 1] : NULL;
+        if (last != NULL && last->offset + last->length == off) {
+          last->length += len;
+        } else {
+          if (part->num_extents == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            part->extents =
+                (sparse_extent*)realloc(part->extents, capacity * sizeof(sparse_extent));
+          }
+          part->extents[part->num_extents].offset = off;
+          part->extents[part->num_extents].length = len;
+          part->num_extents++;
+        }
+      }
+      ++chunk;
+      off += len;
+    }
+    if (reader.failed() || chunk != num_chunks) rc = -1;
+  }
+  close(fd);
+
+  logmsg("manifest_scan: %s: %zu chunks, %zu changed extents, base %s\n", part->name, num_chunks,
+         part->num_extents, base.empty() ? "none" : "found");
+  return rc;
+}
+
+uint64_t manifest_entry_size(const partspec* part) {
+  return sizeof(manifest_header) + part->num_chunks * SHA256_DIGEST_LENGTH;
+}
+
+int tar_append_manifest(TAR* t, partspec* part) {
+  uint64_t size = manifest_entry_size(part);
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s%s", part->name, MANIFEST_SUFFIX);
+  if (tar_append_header(t, path, size) != 0) return -1;
+
+  manifest_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic));
+  hdr.dev_size = part->size;
+  hdr.chunk_size = MANIFEST_CHUNK_SIZE;
+  hdr.hash_size = SHA256_DIGEST_LENGTH;
+  hdr.num_chunks = part->num_chunks;
+  if (tar_data_write(t, &hdr, sizeof(hdr)) != 0 ||
+      tar_data_write(t, part->chunk_hashes, part->num_chunks * SHA256_DIGEST_LENGTH) != 0) {
+    return -1;
+  }
+  return tar_data_pad(t, size);
+}
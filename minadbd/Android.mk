@@ -31,7 +31,7 @@ LOCAL_MODULE := libminadbd
 LOCAL_CFLAGS := $(minadbd_cflags)
 LOCAL_C_INCLUDES := bootable/recovery system/core/adb
 LOCAL_WHOLE_STATIC_LIBRARIES := libadbd
-LOCAL_STATIC_LIBRARIES := libcrypto libbase
+LOCAL_STATIC_LIBRARIES := libcrypto libbase liblz4
 
 include $(BUILD_STATIC_LIBRARY)
 
@@ -46,7 +46,8 @@ LOCAL_CFLAGS := $(minadbd_cflags)
 LOCAL_C_INCLUDES := $(LOCAL_PATH) system/core/adb
 LOCAL_STATIC_LIBRARIES := \
     libBionicGtestMain \
-    libminadbd
+    libminadbd \
+    liblz4
 LOCAL_SHARED_LIBRARIES := \
     liblog \
     libbase \
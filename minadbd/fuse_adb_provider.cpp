@@ -17,40 +17,192 @@
 #include "fuse_adb_provider.h"
 
 #include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <functional>
+#include <vector>
+
+#include <lz4.h>
 
 #include "adb.h"
 #include "adb_io.h"
 #include "fuse_sideload.h"
 
-int read_block_adb(const adb_data& ad, uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
-  if (!WriteFdFmt(ad.sfd, "%08u", block)) {
-    fprintf(stderr, "failed to write to adb host: %s\n", strerror(errno));
+// Sends the requests for |count| host blocks from |block| on.
+static int request_host_blocks_adb(const adb_data& ad, uint64_t block, uint64_t count) {
+  while (count > 0) {
+    // With the multi-block protocol, the host streams back the blocks of a "%08u:%04u" request one
+    // after another, which is the same as what it sends for the single-block requests.
+    uint32_t n = ad.multi_block ? std::min<uint64_t>(count, kMaxSideloadRequestBlocks) : 1;
+    uint32_t host_block = static_cast<uint32_t>(block);
+    bool written = ad.multi_block ? WriteFdFmt(ad.sfd, "%08u:%04u", host_block, n)
+                                  : WriteFdFmt(ad.sfd, "%08u", host_block);
+    if (!written) {
+      fprintf(stderr, "failed to write to adb host: %s\n", strerror(errno));
+      return -EIO;
+    }
+    block += n;
+    count -= n;
+  }
+  return 0;
+}
+
+int request_blocks_adb(const adb_data& ad, uint32_t block, uint32_t count) {
+  if (ad.host_block_size == 0) {
+    return request_host_blocks_adb(ad, block, count);
+  }
+  // The last block may cover fewer host blocks than the others.
+  uint64_t per_block = ad.block_size / ad.host_block_size;
+  uint64_t host_blocks = (ad.file_size + ad.host_block_size - 1) / ad.host_block_size;
+  uint64_t start = block * per_block;
+  uint64_t end = std::min(host_blocks, (static_cast<uint64_t>(block) + count) * per_block);
+  return start < end ? request_host_blocks_adb(ad, start, end - start) : 0;
+}
+
+// Reads |len| bytes from the host, through ad.receive_buffer if there's one.
+static bool read_host_adb(const adb_data& ad, void* data, size_t len) {
+  adb_receive_buffer* rb = ad.receive_buffer;
+  if (rb == nullptr) {
+    return ReadFdExactly(ad.sfd, data, len);
+  }
+  uint8_t* dest = static_cast<uint8_t*>(data);
+  while (len > 0) {
+    if (rb->start == rb->end) {
+      // Large reads skip the buffer, rather than being copied out of it.
+      if (len >= kSideloadReceiveBufferSize / 2) {
+        return ReadFdExactly(ad.sfd, dest, len);
+      }
+      rb->data.resize(kSideloadReceiveBufferSize);
+      ssize_t n = TEMP_FAILURE_RETRY(read(ad.sfd, rb->data.data(), rb->data.size()));
+      if (n <= 0) {
+        if (n == 0) {
+          errno = 0;
+        }
+        return false;
+      }
+      rb->start = 0;
+      rb->end = n;
+    }
+    size_t n = std::min(len, rb->end - rb->start);
+    memcpy(dest, rb->data.data() + rb->start, n);
+    rb->start += n;
+    dest += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Reads the data of the oldest outstanding host block.
+static int receive_host_block_adb(const adb_data& ad, uint8_t* buffer, uint32_t fetch_size) {
+  if (!ad.lz4) {
+    if (!read_host_adb(ad, buffer, fetch_size)) {
+      fprintf(stderr, "failed to read from adb host: %s\n", strerror(errno));
+      return -EIO;
+    }
+    return 0;
+  }
+
+  uint8_t header[4];
+  if (!read_host_adb(ad, header, sizeof(header))) {
+    fprintf(stderr, "failed to read from adb host: %s\n", strerror(errno));
     return -EIO;
   }
+  uint32_t size = header[0] | (header[1] << 8) | (header[2] << 16) |
+                  (static_cast<uint32_t>(header[3]) << 24);
+  if (size & kSideloadBlockStored) {
+    if ((size & ~kSideloadBlockStored) != fetch_size) {
+      fprintf(stderr, "unexpected block size %u from adb host\n", size & ~kSideloadBlockStored);
+      return -EIO;
+    }
+    if (!read_host_adb(ad, buffer, fetch_size)) {
+      fprintf(stderr, "failed to read from adb host: %s\n", strerror(errno));
+      return -EIO;
+    }
+    return 0;
+  }
 
-  if (!ReadFdExactly(ad.sfd, buffer, fetch_size)) {
+  // The host doesn't send blocks that don't compress, so anything larger is bogus.
+  if (size > static_cast<uint32_t>(LZ4_compressBound(fetch_size))) {
+    fprintf(stderr, "unexpected compressed block size %u from adb host\n", size);
+    return -EIO;
+  }
+  std::vector<char> local;
+  std::vector<char>& compressed = ad.receive_buffer != nullptr ? ad.receive_buffer->compressed
+                                                               : local;
+  compressed.resize(size);
+  if (!read_host_adb(ad, compressed.data(), size)) {
     fprintf(stderr, "failed to read from adb host: %s\n", strerror(errno));
     return -EIO;
   }
+  if (LZ4_decompress_safe(compressed.data(), reinterpret_cast<char*>(buffer), size, fetch_size) !=
+      static_cast<int>(fetch_size)) {
+    fprintf(stderr, "failed to decompress block from adb host\n");
+    return -EIO;
+  }
+  return 0;
+}
 
+int receive_block_adb(const adb_data& ad, uint8_t* buffer, uint32_t fetch_size) {
+  if (ad.host_block_size == 0) {
+    return receive_host_block_adb(ad, buffer, fetch_size);
+  }
+  for (uint32_t done = 0; done < fetch_size;) {
+    uint32_t size = std::min(ad.host_block_size, fetch_size - done);
+    int result = receive_host_block_adb(ad, buffer + done, size);
+    if (result != 0) {
+      return result;
+    }
+    done += size;
+  }
   return 0;
 }
 
-int run_adb_fuse(int sfd, uint64_t file_size, uint32_t block_size) {
+int read_block_adb(const adb_data& ad, uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
+  int result = request_blocks_adb(ad, block, 1);
+  if (result != 0) {
+    return result;
+  }
+  return receive_block_adb(ad, buffer, fetch_size);
+}
+
+int run_adb_fuse(int sfd, uint64_t file_size, uint32_t block_size, bool multi_block, bool lz4) {
+  if (block_size == 0 || (file_size + block_size - 1) / block_size > kMaxSideloadHostBlocks) {
+    fprintf(stderr, "can't sideload %" PRIu64 " bytes in blocks of %u\n", file_size, block_size);
+    return -EINVAL;
+  }
+
   adb_data ad;
   ad.sfd = sfd;
   ad.file_size = file_size;
   ad.block_size = block_size;
+  ad.host_block_size = 0;
+  if (file_size >= kLargeSideloadFileSize && block_size < kLargeSideloadBlockSize &&
+      kLargeSideloadBlockSize % block_size == 0) {
+    ad.block_size = kLargeSideloadBlockSize;
+    ad.host_block_size = block_size;
+    printf("serving the package in blocks of %u (%u host blocks each)\n", ad.block_size,
+           ad.block_size / block_size);
+  }
+  ad.multi_block = multi_block;
+  ad.lz4 = lz4;
+  adb_receive_buffer receive_buffer;
+  ad.receive_buffer = &receive_buffer;
 
   provider_vtab vtab;
   vtab.read_block = std::bind(read_block_adb, ad, std::placeholders::_1, std::placeholders::_2,
                               std::placeholders::_3);
+  // The host answers the requests in order, so several of them can be in flight.
+  vtab.request_blocks =
+      std::bind(request_blocks_adb, ad, std::placeholders::_1, std::placeholders::_2);
+  vtab.receive_block =
+      std::bind(receive_block_adb, ad, std::placeholders::_1, std::placeholders::_2);
   vtab.close = [&ad]() { WriteFdExactly(ad.sfd, "DONEDONE"); };
 
-  return run_fuse_sideload(vtab, file_size, block_size);
+  return run_fuse_sideload(vtab, file_size, ad.block_size, FUSE_SIDELOAD_HOST_MOUNTPOINT,
+                           FUSE_SIDELOAD_SPILL_PATHNAME, FUSE_SIDELOAD_STATS_PATHNAME);
 }
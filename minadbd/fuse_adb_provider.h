@@ -17,16 +17,82 @@
 #ifndef __FUSE_ADB_PROVIDER_H
 #define __FUSE_ADB_PROVIDER_H
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include <vector>
+
+// What has been read from the adb channel ahead of the block being received, so that the small
+// reads (the LZ4 headers and the compressed blocks) don't take a syscall each. The data of the
+// stored blocks still goes straight from the socket into the caller's buffer once what's buffered
+// has been used up.
+struct adb_receive_buffer {
+  std::vector<uint8_t> data;
+  size_t start = 0;  // the first byte that hasn't been used
+  size_t end = 0;    // the end of what has been read
+  // Where the LZ4 blocks are put together before they're decompressed.
+  std::vector<char> compressed;
+};
+
 struct adb_data {
   int sfd;  // file descriptor for the adb channel
 
   uint64_t file_size;
+  // The blocks served to the fuse side.
   uint32_t block_size;
+  // The blocks the host sends, if they're smaller: each block is then fetched as the run of
+  // block_size / host_block_size host blocks it covers. 0 if they're the same.
+  uint32_t host_block_size;
+
+  // Whether the host takes the "<block>:<count>" requests for several blocks at once (see
+  // kFeatureSideloadMultiBlock), instead of one "<block>" request per block.
+  bool multi_block;
+
+  // Whether the host sends each block with a header, possibly LZ4 compressed (see
+  // kFeatureSideloadLz4).
+  bool lz4;
+
+  // If set, the reads from sfd go through it. All of them do then, and one at a time (the
+  // receiving is serialized by fuse_sideload already).
+  adb_receive_buffer* receive_buffer;
 };
 
+// The adb feature that tells the host supports the multi-block sideload requests.
+static constexpr const char* kFeatureSideloadMultiBlock = "sideload_multi_block";
+
+// The adb feature that tells the host can send the blocks LZ4 compressed. Each block then comes
+// after a little-endian uint32_t header: with kSideloadBlockStored set, the block follows as is;
+// otherwise the header gives the size of the LZ4 block that follows, which decompresses to the
+// whole block.
+static constexpr const char* kFeatureSideloadLz4 = "sideload_lz4";
+static constexpr uint32_t kSideloadBlockStored = 0x80000000U;
+
+// The most blocks asked for by a single multi-block request.
+static constexpr uint32_t kMaxSideloadRequestBlocks = 9999;
+
+// The requests carry the block numbers as 8 decimal digits.
+static constexpr uint64_t kMaxSideloadHostBlocks = 100000000;
+
+// Packages at least this large are served in blocks of kLargeSideloadBlockSize (if the host's are
+// smaller and divide it), which keeps the per-block digests, cache slots and requests of a
+// multi-GB package down.
+static constexpr uint64_t kLargeSideloadFileSize = 2ULL * 1024 * 1024 * 1024;
+static constexpr uint32_t kLargeSideloadBlockSize = 1024 * 1024;
+
+// How much of the channel is read at a time into an adb_receive_buffer.
+static constexpr size_t kSideloadReceiveBufferSize = 256 * 1024;
+
+// The send buffer that adbd gets for its end of the sideload socket, so that it can take in (and
+// acknowledge to the host) a few MB of blocks while the earlier ones are being verified, instead of
+// stalling the USB stream whenever the provider falls behind.
+static constexpr int kSideloadSocketBufferSize = 4 * 1024 * 1024;
+
+// Sends the request(s) for |count| consecutive blocks to the host, without waiting for the data.
+int request_blocks_adb(const adb_data& ad, uint32_t block, uint32_t count);
+// Reads the data of the oldest outstanding block.
+int receive_block_adb(const adb_data& ad, uint8_t* buffer, uint32_t fetch_size);
 int read_block_adb(const adb_data& ad, uint32_t block, uint8_t* buffer, uint32_t fetch_size);
-int run_adb_fuse(int sfd, uint64_t file_size, uint32_t block_size);
+int run_adb_fuse(int sfd, uint64_t file_size, uint32_t block_size, bool multi_block = false,
+                 bool lz4 = false);
 
 #endif
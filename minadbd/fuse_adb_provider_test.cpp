@@ -20,8 +20,11 @@
 #include <sys/socket.h>
 
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <gtest/gtest.h>
+#include <lz4.h>
 
 #include "adb_io.h"
 #include "fuse_adb_provider.h"
@@ -88,3 +91,211 @@ TEST(fuse_adb_provider, read_block_adb_fail_write) {
 
   close(sockets[0]);
 }
+
+TEST(fuse_adb_provider, request_block_adb_pipelined) {
+  adb_data data = {};
+  int sockets[2];
+
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+  data.sfd = sockets[0];
+
+  int host_socket = sockets[1];
+  fcntl(host_socket, F_SETFL, O_NONBLOCK);
+
+  // Both requests go out before any of the data is read.
+  ASSERT_EQ(0, request_blocks_adb(data, 1U, 1));
+  ASSERT_EQ(0, request_blocks_adb(data, 22U, 1));
+
+  char block_req[17] = {};
+  ASSERT_TRUE(ReadFdExactly(host_socket, block_req, 16));
+  ASSERT_STREQ("0000000100000022", block_req);
+
+  // The host answers them in order.
+  ASSERT_TRUE(WriteFdExactly(host_socket, "foobar"));
+  char block_data[4] = {};
+  ASSERT_EQ(0, receive_block_adb(data, reinterpret_cast<uint8_t*>(block_data), 3));
+  ASSERT_STREQ("foo", block_data);
+  ASSERT_EQ(0, receive_block_adb(data, reinterpret_cast<uint8_t*>(block_data), 3));
+  ASSERT_STREQ("bar", block_data);
+
+  close(sockets[0]);
+  close(sockets[1]);
+}
+
+TEST(fuse_adb_provider, request_blocks_adb) {
+  adb_data data = {};
+  int sockets[2];
+
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+  data.sfd = sockets[0];
+
+  int host_socket = sockets[1];
+  fcntl(host_socket, F_SETFL, O_NONBLOCK);
+
+  // Without the multi-block protocol, there is one request per block.
+  ASSERT_EQ(0, request_blocks_adb(data, 7U, 3));
+  char block_req[32] = {};
+  ASSERT_TRUE(ReadFdExactly(host_socket, block_req, 24));
+  ASSERT_STREQ("000000070000000800000009", block_req);
+
+  // With it, a single request covers the range.
+  data.multi_block = true;
+  ASSERT_EQ(0, request_blocks_adb(data, 7U, 3));
+  memset(block_req, 0, sizeof(block_req));
+  ASSERT_TRUE(ReadFdExactly(host_socket, block_req, 13));
+  ASSERT_STREQ("00000007:0003", block_req);
+
+  // Longer ranges are split.
+  ASSERT_EQ(0, request_blocks_adb(data, 0U, kMaxSideloadRequestBlocks + 1));
+  memset(block_req, 0, sizeof(block_req));
+  ASSERT_TRUE(ReadFdExactly(host_socket, block_req, 26));
+  ASSERT_STREQ("00000000:999900009999:0001", block_req);
+
+  // Check that nothing else was written to the socket.
+  char tmp;
+  errno = 0;
+  ASSERT_EQ(-1, read(host_socket, &tmp, 1));
+  ASSERT_EQ(EWOULDBLOCK, errno);
+
+  close(sockets[0]);
+  close(sockets[1]);
+}
+
+TEST(fuse_adb_provider, request_blocks_adb_host_blocks) {
+  adb_data data = {};
+  int sockets[2];
+
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+  data.sfd = sockets[0];
+  data.multi_block = true;
+  // Blocks of 3 host blocks, the last of which is short.
+  data.file_size = 20;
+  data.block_size = 12;
+  data.host_block_size = 4;
+
+  int host_socket = sockets[1];
+  fcntl(host_socket, F_SETFL, O_NONBLOCK);
+
+  ASSERT_EQ(0, request_blocks_adb(data, 0U, 1));
+  char block_req[32] = {};
+  ASSERT_TRUE(ReadFdExactly(host_socket, block_req, 13));
+  ASSERT_STREQ("00000000:0003", block_req);
+
+  // The last block only covers what's left of the file.
+  ASSERT_EQ(0, request_blocks_adb(data, 1U, 1));
+  memset(block_req, 0, sizeof(block_req));
+  ASSERT_TRUE(ReadFdExactly(host_socket, block_req, 13));
+  ASSERT_STREQ("00000003:0002", block_req);
+
+  // The host blocks are put back together, down to the short one at the end.
+  ASSERT_TRUE(WriteFdExactly(host_socket, "0123456789ab"));
+  ASSERT_TRUE(WriteFdExactly(host_socket, "cdefghij"));
+  char block_data[13] = {};
+  ASSERT_EQ(0, receive_block_adb(data, reinterpret_cast<uint8_t*>(block_data), 12));
+  ASSERT_STREQ("0123456789ab", block_data);
+  memset(block_data, 0, sizeof(block_data));
+  ASSERT_EQ(0, receive_block_adb(data, reinterpret_cast<uint8_t*>(block_data), 8));
+  ASSERT_STREQ("cdefghij", block_data);
+
+  close(sockets[0]);
+  close(sockets[1]);
+}
+
+TEST(fuse_adb_provider, receive_block_adb_lz4) {
+  adb_data data = {};
+  int sockets[2];
+
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+  data.sfd = sockets[0];
+  data.lz4 = true;
+
+  int host_socket = sockets[1];
+  fcntl(host_socket, F_SETFL, O_NONBLOCK);
+
+  auto write_header = [host_socket](uint32_t value) {
+    uint8_t header[4] = { static_cast<uint8_t>(value), static_cast<uint8_t>(value >> 8),
+                          static_cast<uint8_t>(value >> 16), static_cast<uint8_t>(value >> 24) };
+    return WriteFdExactly(host_socket, header, sizeof(header));
+  };
+
+  // A compressed block.
+  const std::string expected(4096, 'a');
+  std::vector<char> compressed(LZ4_compressBound(expected.size()));
+  int size = LZ4_compress_default(expected.data(), compressed.data(), expected.size(),
+                                  compressed.size());
+  ASSERT_GT(size, 0);
+  ASSERT_TRUE(write_header(size));
+  ASSERT_TRUE(WriteFdExactly(host_socket, compressed.data(), size));
+
+  std::string block(expected.size(), '\0');
+  ASSERT_EQ(0, receive_block_adb(data, reinterpret_cast<uint8_t*>(&block[0]), block.size()));
+  ASSERT_EQ(expected, block);
+
+  // A stored one.
+  ASSERT_TRUE(write_header(kSideloadBlockStored | 6));
+  ASSERT_TRUE(WriteFdExactly(host_socket, "foobar"));
+  char block_data[7] = {};
+  ASSERT_EQ(0, receive_block_adb(data, reinterpret_cast<uint8_t*>(block_data), 6));
+  ASSERT_STREQ("foobar", block_data);
+
+  // A block that decompresses to the wrong size.
+  ASSERT_TRUE(write_header(size));
+  ASSERT_TRUE(WriteFdExactly(host_socket, compressed.data(), size));
+  ASSERT_EQ(-EIO, receive_block_adb(data, reinterpret_cast<uint8_t*>(&block[0]), 2048));
+
+  close(sockets[0]);
+  close(sockets[1]);
+}
+
+TEST(fuse_adb_provider, receive_block_adb_buffered) {
+  adb_receive_buffer receive_buffer;
+  adb_data data = {};
+  int sockets[2];
+
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+  data.sfd = sockets[0];
+  data.lz4 = true;
+  data.receive_buffer = &receive_buffer;
+
+  int host_socket = sockets[1];
+
+  auto write_header = [host_socket](uint32_t value) {
+    uint8_t header[4] = { static_cast<uint8_t>(value), static_cast<uint8_t>(value >> 8),
+                          static_cast<uint8_t>(value >> 16), static_cast<uint8_t>(value >> 24) };
+    return WriteFdExactly(host_socket, header, sizeof(header));
+  };
+
+  // The host streams a compressed block, a small stored one and a large stored one back to back,
+  // which all get read ahead of the blocks being received.
+  const std::string expected(4096, 'a');
+  std::vector<char> compressed(LZ4_compressBound(expected.size()));
+  int size = LZ4_compress_default(expected.data(), compressed.data(), expected.size(),
+                                  compressed.size());
+  ASSERT_GT(size, 0);
+  ASSERT_TRUE(write_header(size));
+  ASSERT_TRUE(WriteFdExactly(host_socket, compressed.data(), size));
+  ASSERT_TRUE(write_header(kSideloadBlockStored | 6));
+  ASSERT_TRUE(WriteFdExactly(host_socket, "foobar"));
+  const std::string large(kSideloadReceiveBufferSize, 'b');
+  ASSERT_TRUE(write_header(kSideloadBlockStored | large.size()));
+  std::thread writer([host_socket, &large]() {
+    ASSERT_TRUE(WriteFdExactly(host_socket, large.data(), large.size()));
+  });
+
+  std::string block(expected.size(), '\0');
+  ASSERT_EQ(0, receive_block_adb(data, reinterpret_cast<uint8_t*>(&block[0]), block.size()));
+  ASSERT_EQ(expected, block);
+
+  char block_data[7] = {};
+  ASSERT_EQ(0, receive_block_adb(data, reinterpret_cast<uint8_t*>(block_data), 6));
+  ASSERT_STREQ("foobar", block_data);
+
+  block.assign(large.size(), '\0');
+  ASSERT_EQ(0, receive_block_adb(data, reinterpret_cast<uint8_t*>(&block[0]), block.size()));
+  ASSERT_EQ(large, block);
+  writer.join();
+  ASSERT_EQ(receive_buffer.start, receive_buffer.end);
+
+  close(sockets[0]);
+  close(sockets[1]);
+}
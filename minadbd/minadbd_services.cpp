@@ -19,8 +19,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+#include <functional>
 #include <string>
 #include <thread>
 
@@ -28,24 +30,28 @@
 #include "fdevent.h"
 #include "fuse_adb_provider.h"
 #include "sysdeps.h"
+#include "transport.h"
 
-static void sideload_host_service(int sfd, const std::string& args) {
-    int file_size;
-    int block_size;
-    if (sscanf(args.c_str(), "%d:%d", &file_size, &block_size) != 2) {
+static void sideload_host_service(int sfd, const std::string& args, bool multi_block, bool lz4) {
+    // The file size takes 64 bits: full OTAs can be larger than 2GiB.
+    uint64_t file_size;
+    uint32_t block_size;
+    if (sscanf(args.c_str(), "%" SCNu64 ":%" SCNu32, &file_size, &block_size) != 2) {
         printf("bad sideload-host arguments: %s\n", args.c_str());
         exit(1);
     }
 
-    printf("sideload-host file size %d block size %d\n", file_size, block_size);
+    printf("sideload-host file size %" PRIu64 " block size %" PRIu32 "%s%s\n", file_size,
+           block_size, multi_block ? " (multi-block)" : "", lz4 ? " (lz4)" : "");
 
-    int result = run_adb_fuse(sfd, file_size, block_size);
+    int result = run_adb_fuse(sfd, file_size, block_size, multi_block, lz4);
 
     printf("sideload_host finished\n");
     exit(result == 0 ? 0 : 1);
 }
 
-static int create_service_thread(void (*func)(int, const std::string&), const std::string& args) {
+static int create_service_thread(std::function<void(int, const std::string&)> func,
+                                 const std::string& args) {
     int s[2];
     if (adb_socketpair(s)) {
         printf("cannot create service socket pair\n");
@@ -58,7 +64,7 @@ static int create_service_thread(void (*func)(int, const std::string&), const st
     return s[0];
 }
 
-int service_to_fd(const char* name, atransport* /* transport */) {
+int service_to_fd(const char* name, atransport* transport) {
   int ret = -1;
 
   if (!strncmp(name, "sideload:", 9)) {
@@ -68,7 +74,24 @@ int service_to_fd(const char* name, atransport* /* transport */) {
     exit(3);
   } else if (!strncmp(name, "sideload-host:", 14)) {
     std::string arg(name + 14);
-    ret = create_service_thread(sideload_host_service, arg);
+    // Use the multi-block requests and the compressed blocks only if the host has told us it
+    // understands them.
+    bool multi_block = transport != nullptr && transport->has_feature(kFeatureSideloadMultiBlock);
+    bool lz4 = transport != nullptr && transport->has_feature(kFeatureSideloadLz4);
+    ret = create_service_thread(
+        [multi_block, lz4](int sfd, const std::string& args) {
+          sideload_host_service(sfd, args, multi_block, lz4);
+        },
+        arg);
+    // adbd only acknowledges a packet once it's all in the socket, so the host can't stream ahead
+    // of what fits in there. SO_SNDBUFFORCE goes past wmem_max, which the default is capped at.
+    if (ret >= 0) {
+      int size = kSideloadSocketBufferSize;
+      if (setsockopt(ret, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) == -1 &&
+          setsockopt(ret, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) == -1) {
+        printf("failed to enlarge the sideload socket buffer: %s\n", strerror(errno));
+      }
+    }
   }
   if (ret >= 0) {
     close_on_exec(ret);
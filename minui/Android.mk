@@ -94,3 +94,49 @@ LOCAL_CFLAGS := -Wall -Werror
 LOCAL_C_INCLUDES := $(LOCAL_PATH)/include
 LOCAL_EXPORT_C_INCLUDE_DIRS := $(LOCAL_PATH)/include
 include $(BUILD_SHARED_LIBRARY)
+
+# Pixel format flags shared with the surfaces pack tool, whose output must match the target's.
+minui_pixel_format_cflags :=
+ifeq ($(subst ",,$(TARGET_RECOVERY_PIXEL_FORMAT)),ABGR_8888)
+  minui_pixel_format_cflags += -DRECOVERY_ABGR
+endif
+ifeq ($(subst ",,$(TARGET_RECOVERY_PIXEL_FORMAT)),BGRA_8888)
+  minui_pixel_format_cflags += -DRECOVERY_BGRA
+endif
+
+# minui_surfaces_pack (host executable)
+# ===============================
+include $(CLEAR_VARS)
+LOCAL_MODULE := minui_surfaces_pack
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_SRC_FILES := \
+    resources.cpp \
+    tools/surfaces_pack.cpp
+LOCAL_STATIC_LIBRARIES := \
+    libpng \
+    libbase \
+    libz
+LOCAL_SHARED_LIBRARIES := \
+    liblog
+LOCAL_CFLAGS := -Wall -Werror $(minui_pixel_format_cflags)
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/include
+include $(BUILD_HOST_EXECUTABLE)
+
+# surfaces.pack, the res/images PNGs decoded at build time (opt-in)
+# ===============================
+ifeq ($(TARGET_RECOVERY_SURFACES_PACK),true)
+include $(CLEAR_VARS)
+LOCAL_MODULE := recovery_surfaces_pack
+LOCAL_MODULE_CLASS := ETC
+LOCAL_MODULE_STEM := surfaces.pack
+LOCAL_MODULE_PATH := $(TARGET_RECOVERY_ROOT_OUT)/res/images
+minui_surfaces_pack_density := $(if $(TARGET_RECOVERY_SURFACES_PACK_DENSITY),\
+    $(TARGET_RECOVERY_SURFACES_PACK_DENSITY),xhdpi)
+minui_surfaces_pack_images := $(LOCAL_PATH)/../res-$(strip $(minui_surfaces_pack_density))/images
+include $(BUILD_SYSTEM)/base_rules.mk
+$(LOCAL_BUILT_MODULE): PRIVATE_IMAGES := $(minui_surfaces_pack_images)
+$(LOCAL_BUILT_MODULE): $(HOST_OUT_EXECUTABLES)/minui_surfaces_pack \
+    $(wildcard $(minui_surfaces_pack_images)/*.png)
+	@mkdir -p $(dir $@)
+	$(HOST_OUT_EXECUTABLES)/minui_surfaces_pack $(PRIVATE_IMAGES) $@
+endif
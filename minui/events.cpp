@@ -261,6 +261,17 @@ int ev_get_input(int fd, uint32_t epevents, input_event* ev) {
     return -1;
 }
 
+int ev_get_inputs(int fd, uint32_t epevents, input_event* evs, size_t max) {
+  if (epevents & EPOLLIN) {
+    // evdev only hands out whole events, as many as fit.
+    ssize_t r = TEMP_FAILURE_RETRY(read(fd, evs, max * sizeof(*evs)));
+    if (r >= static_cast<ssize_t>(sizeof(*evs))) {
+      return r / sizeof(*evs);
+    }
+  }
+  return -1;
+}
+
 int ev_sync_key_state(const ev_set_key_callback& set_key_cb) {
   // Use unsigned long to match ioctl's parameter type.
   unsigned long ev_bits[BITS_TO_LONGS(EV_MAX)];    // NOLINT
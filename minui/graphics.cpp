@@ -17,12 +17,25 @@
 
 #include "graphics.h"
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <map>
 #include <memory>
+#include <new>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "font_10x18.h"
 #include "graphics_adf.h"
@@ -33,6 +46,7 @@
 static GRFont* gr_font = NULL;
 static GRFont* gr_font_menu = NULL;
 static MinuiBackend* gr_backend = nullptr;
+static const char* backend_name = nullptr;
 
 static int overscan_percent = OVERSCAN_PERCENT;
 static int overscan_offset_x = 0;
@@ -42,8 +56,58 @@ static uint32_t gr_current = ~0;
 static constexpr uint32_t alpha_mask = 0xff000000;
 
 static GRSurface* gr_draw = NULL;
+// The rotation of gr_draw relative to the screen, which the drawing functions apply to each pixel.
+// It's only set when the canvas below couldn't be allocated.
 static GRRotation rotation = ROTATION_NONE;
 
+// The buffer returned by the backend, the one that gets displayed on the next flip.
+static GRSurface* gr_scanout = nullptr;
+// With a rotated screen, everything gets drawn unrotated into the canvas, which gr_flip() rotates
+// into gr_scanout in one pass. That keeps the drawing functions on their row-by-row paths.
+static GRRotation screen_rotation = ROTATION_NONE;
+static GRSurface canvas;
+static std::unique_ptr<uint32_t[]> canvas_pixels;
+
+// The part of gr_draw that has been drawn to since the last flip, in its own (unrotated)
+// coordinates. Empty when x1 >= x2.
+static struct {
+  int x1, y1, x2, y2;
+} damage = { 0, 0, 0, 0 };
+
+// Adds the screen rectangle [x1, x2) x [y1, y2) to the damage, mapping it into gr_draw the same
+// way pixel_at() does.
+static void add_damage(int x1, int y1, int x2, int y2) {
+  int w = gr_draw->width;
+  int h = gr_draw->height;
+  int dx1, dy1, dx2, dy2;
+  switch (rotation) {
+    case ROTATION_RIGHT:
+      dx1 = w - y2 + 1, dx2 = w - y1 + 1, dy1 = x1, dy2 = x2;
+      break;
+    case ROTATION_DOWN:
+      dx1 = w - x2, dx2 = w - x1, dy1 = h - y2, dy2 = h - y1;
+      break;
+    case ROTATION_LEFT:
+      dx1 = y1, dx2 = y2, dy1 = h - x2, dy2 = h - x1;
+      break;
+    default:
+      dx1 = x1, dx2 = x2, dy1 = y1, dy2 = y2;
+      break;
+  }
+  dx1 = std::max(dx1, 0);
+  dy1 = std::max(dy1, 0);
+  dx2 = std::min(dx2, w);
+  dy2 = std::min(dy2, h);
+  if (dx1 >= dx2 || dy1 >= dy2) return;
+
+  if (damage.x1 >= damage.x2) {
+    damage = { dx1, dy1, dx2, dy2 };
+  } else {
+    damage = { std::min(damage.x1, dx1), std::min(damage.y1, dy1), std::max(damage.x2, dx2),
+               std::max(damage.y2, dy2) };
+  }
+}
+
 static bool outside(int x, int y) {
   return x < 0 || x >= (rotation % 2 ? gr_draw->height : gr_draw->width) || y < 0 ||
          y >= (rotation % 2 ? gr_draw->width : gr_draw->height);
@@ -84,22 +148,143 @@ static inline uint32_t pixel_blend(uint8_t alpha, uint32_t pix) {
   return (out_r & 0xff) | (out_g & 0xff00) | (out_b & 0xff0000) | (gr_current & 0xff000000);
 }
 
-// increments pixel pointer right, with current rotation.
-static void incr_x(uint32_t** p, int row_pixels) {
+// Divides x by 255, rounding down like pixel_blend() does. Exact for any x up to 255 * 255.
+static inline uint32_t div255(uint32_t x) {
+  return (x + 1 + (x >> 8)) >> 8;
+}
+
+#if defined(__ARM_NEON)
+static inline uint8x8_t div255_u16(uint16x8_t x) {
+  return vshrn_n_u16(vaddq_u16(vaddq_u16(x, vdupq_n_u16(1)), vshrq_n_u16(x, 8)), 8);
+}
+#elif defined(__SSE2__)
+static inline __m128i div255_epi16(__m128i x) {
+  return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(x, _mm_set1_epi16(1)), _mm_srli_epi16(x, 8)),
+                        8);
+}
+#endif
+
+// Blends gr_current with the given alpha onto n contiguous pixels, with the same result as
+// pixel_blend(). Four pixels at a time where NEON or SSE2 is available.
+static void fill_span(uint32_t* px, int n, uint8_t alpha) {
+  if (alpha == 255) {
+    std::fill(px, px + n, gr_current);
+    return;
+  }
+  int i = 0;
+#if defined(__ARM_NEON)
+  uint8x16_t cur = vreinterpretq_u8_u32(vdupq_n_u32(gr_current));
+  uint8x16_t alpha_lanes = vreinterpretq_u8_u32(vdupq_n_u32(alpha_mask));
+  uint16x8_t cur_a = vmull_u8(vget_low_u8(cur), vdup_n_u8(alpha));
+  uint8x8_t inv_a = vdup_n_u8(255 - alpha);
+  for (; i + 4 <= n; i += 4) {
+    uint8x16_t pix = vld1q_u8(reinterpret_cast<uint8_t*>(px + i));
+    uint8x8_t lo = div255_u16(vmlal_u8(cur_a, vget_low_u8(pix), inv_a));
+    uint8x8_t hi = div255_u16(vmlal_u8(cur_a, vget_high_u8(pix), inv_a));
+    vst1q_u8(reinterpret_cast<uint8_t*>(px + i), vbslq_u8(alpha_lanes, cur, vcombine_u8(lo, hi)));
+  }
+#elif defined(__SSE2__)
+  __m128i zero = _mm_setzero_si128();
+  __m128i cur = _mm_set1_epi32(static_cast<int>(gr_current));
+  __m128i alpha_lanes = _mm_set1_epi32(static_cast<int>(alpha_mask));
+  __m128i cur_a = _mm_mullo_epi16(_mm_unpacklo_epi8(cur, zero), _mm_set1_epi16(alpha));
+  __m128i inv_a = _mm_set1_epi16(255 - alpha);
+  for (; i + 4 <= n; i += 4) {
+    __m128i pix = _mm_loadu_si128(reinterpret_cast<__m128i*>(px + i));
+    __m128i lo = _mm_add_epi16(cur_a, _mm_mullo_epi16(_mm_unpacklo_epi8(pix, zero), inv_a));
+    __m128i hi = _mm_add_epi16(cur_a, _mm_mullo_epi16(_mm_unpackhi_epi8(pix, zero), inv_a));
+    __m128i out = _mm_packus_epi16(div255_epi16(lo), div255_epi16(hi));
+    out = _mm_or_si128(_mm_and_si128(alpha_lanes, cur), _mm_andnot_si128(alpha_lanes, out));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(px + i), out);
+  }
+#endif
+  for (; i < n; ++i) {
+    px[i] = pixel_blend(alpha, px[i]);
+  }
+}
+
+// Blends gr_current onto n contiguous pixels, with the coverage of each of them taken from mask
+// and scaled by alpha. Same result as calling pixel_blend() per pixel, which leaves the pixels
+// with no coverage untouched (alpha byte included).
+static void blend_span(const uint8_t* mask, uint32_t* px, int n, uint8_t alpha) {
+  int i = 0;
+#if defined(__ARM_NEON) || defined(__SSE2__)
+  for (; i + 4 <= n; i += 4) {
+    uint32_t coverage;
+    memcpy(&coverage, mask + i, sizeof(coverage));
+    if (coverage == 0) {
+      continue;
+    }
+    if (alpha < 255) {
+      coverage = div255((coverage & 0xff) * alpha) | div255(((coverage >> 8) & 0xff) * alpha) << 8 |
+                 div255(((coverage >> 16) & 0xff) * alpha) << 16 |
+                 div255((coverage >> 24) * alpha) << 24;
+    }
+    if (coverage == 0xffffffff) {
+      std::fill(px + i, px + i + 4, gr_current);
+      continue;
+    }
+#if defined(__ARM_NEON)
+    // Spread the coverage of each pixel over its four bytes.
+    uint8x8_t c = vreinterpret_u8_u32(vdup_n_u32(coverage));
+    uint8x8x2_t c2 = vzip_u8(c, c);
+    uint8x8x2_t c4 = vzip_u8(c2.val[0], c2.val[0]);
+    uint8x16_t a = vcombine_u8(c4.val[0], c4.val[1]);
+    uint8x16_t inv_a = vmvnq_u8(a);
+    uint8x16_t cur = vreinterpretq_u8_u32(vdupq_n_u32(gr_current));
+    uint8x16_t alpha_lanes = vreinterpretq_u8_u32(vdupq_n_u32(alpha_mask));
+    uint8x16_t pix = vld1q_u8(reinterpret_cast<uint8_t*>(px + i));
+    uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(pix), vget_low_u8(inv_a)), vget_low_u8(cur),
+                             vget_low_u8(a));
+    uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(pix), vget_high_u8(inv_a)), vget_high_u8(cur),
+                             vget_high_u8(a));
+    uint8x16_t out = vbslq_u8(alpha_lanes, cur, vcombine_u8(div255_u16(lo), div255_u16(hi)));
+    vst1q_u8(reinterpret_cast<uint8_t*>(px + i), vbslq_u8(vceqq_u8(a, vdupq_n_u8(0)), pix, out));
+#else
+    // Spread the coverage of each pixel over its four bytes.
+    __m128i zero = _mm_setzero_si128();
+    __m128i a = _mm_cvtsi32_si128(static_cast<int>(coverage));
+    a = _mm_unpacklo_epi8(a, a);
+    a = _mm_unpacklo_epi16(a, a);
+    __m128i inv_a = _mm_xor_si128(a, _mm_set1_epi8(-1));
+    __m128i cur = _mm_set1_epi32(static_cast<int>(gr_current));
+    __m128i alpha_lanes = _mm_set1_epi32(static_cast<int>(alpha_mask));
+    __m128i pix = _mm_loadu_si128(reinterpret_cast<__m128i*>(px + i));
+    __m128i lo = _mm_add_epi16(
+        _mm_mullo_epi16(_mm_unpacklo_epi8(pix, zero), _mm_unpacklo_epi8(inv_a, zero)),
+        _mm_mullo_epi16(_mm_unpacklo_epi8(cur, zero), _mm_unpacklo_epi8(a, zero)));
+    __m128i hi = _mm_add_epi16(
+        _mm_mullo_epi16(_mm_unpackhi_epi8(pix, zero), _mm_unpackhi_epi8(inv_a, zero)),
+        _mm_mullo_epi16(_mm_unpackhi_epi8(cur, zero), _mm_unpackhi_epi8(a, zero)));
+    __m128i out = _mm_packus_epi16(div255_epi16(lo), div255_epi16(hi));
+    out = _mm_or_si128(_mm_and_si128(alpha_lanes, cur), _mm_andnot_si128(alpha_lanes, out));
+    __m128i uncovered = _mm_cmpeq_epi8(a, zero);
+    out = _mm_or_si128(_mm_and_si128(uncovered, pix), _mm_andnot_si128(uncovered, out));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(px + i), out);
+#endif
+  }
+#endif
+  for (; i < n; ++i) {
+    uint8_t a = mask[i];
+    if (alpha < 255) a = div255(static_cast<uint32_t>(a) * alpha);
+    px[i] = pixel_blend(a, px[i]);
+  }
+}
+
+// Returns the pointer step for moving one pixel right, with current rotation.
+static ptrdiff_t step_x(int row_pixels) {
   if (rotation % 2) {
-    *p = *p + (rotation == 1 ? 1 : -1) * row_pixels;
-  } else {
-    *p = *p + (rotation ? -1 : 1);
+    return (rotation == 1 ? 1 : -1) * row_pixels;
   }
+  return rotation ? -1 : 1;
 }
 
-// increments pixel pointer down, with current rotation.
-static void incr_y(uint32_t** p, int row_pixels) {
+// Returns the pointer step for moving one pixel down, with current rotation.
+static ptrdiff_t step_y(int row_pixels) {
   if (rotation % 2) {
-    *p = *p + (rotation == 1 ? -1 : 1);
-  } else {
-    *p = *p + (rotation ? -1 : 1) * row_pixels;
+    return rotation == 1 ? -1 : 1;
   }
+  return (rotation ? -1 : 1) * row_pixels;
 }
 
 // returns pixel pointer at given coordinates with rotation adjustment.
@@ -120,19 +305,86 @@ static uint32_t* pixel_at(GRSurface* surf, int x, int y, int row_pixels) {
   return nullptr;
 }
 
-static void text_blend(uint8_t* src_p, int src_row_bytes, uint32_t* dst_p, int dst_row_pixels,
-                       int width, int height) {
+static void text_blend(const uint8_t* src_p, int src_row_bytes, uint32_t* dst_p,
+                       int dst_row_pixels, int width, int height) {
   uint8_t alpha_current = static_cast<uint8_t>((alpha_mask & gr_current) >> 24);
+  if (rotation == ROTATION_NONE) {
+    for (int j = 0; j < height; ++j) {
+      blend_span(src_p, dst_p, width, alpha_current);
+      src_p += src_row_bytes;
+      dst_p += dst_row_pixels;
+    }
+    return;
+  }
+
+  ptrdiff_t dx = step_x(dst_row_pixels);
+  ptrdiff_t dy = step_y(dst_row_pixels);
   for (int j = 0; j < height; ++j) {
-    uint8_t* sx = src_p;
+    const uint8_t* sx = src_p;
     uint32_t* px = dst_p;
-    for (int i = 0; i < width; ++i, incr_x(&px, dst_row_pixels)) {
+    for (int i = 0; i < width; ++i, px += dx) {
       uint8_t a = *sx++;
       if (alpha_current < 255) a = (static_cast<uint32_t>(a) * alpha_current) / 255;
       *px = pixel_blend(a, *px);
     }
     src_p += src_row_bytes;
-    incr_y(&dst_p, dst_row_pixels);
+    dst_p += dy;
+  }
+}
+
+// The coverage masks of recently drawn text, one per line (text, font and boldness), so that
+// redrawing the same text log each frame blends each row of a line in one go, instead of looking
+// up and blending the glyphs one at a time. The color is applied when the mask is blended, so it
+// isn't part of the key. The text console of the UI forgets its rows with gr_text_forget() as they
+// change or scroll out, which keeps the cache to about the rows on the screen; it's dropped as a
+// whole should it fill up anyway.
+struct TextRun {
+  std::vector<uint8_t> mask;
+  int width;
+};
+static std::map<std::tuple<std::string, const GRFont*, bool>, TextRun> text_runs;
+static constexpr size_t kMaxTextRuns = 256;
+
+static const TextRun& get_text_run(const GRFont* font, const char* s, bool bold) {
+  auto key = std::make_tuple(std::string(s), font, bold);
+  auto it = text_runs.find(key);
+  if (it != text_runs.end()) {
+    return it->second;
+  }
+  if (text_runs.size() >= kMaxTextRuns) {
+    text_runs.clear();
+  }
+
+  TextRun run;
+  size_t len = strlen(s);
+  run.width = static_cast<int>(len) * font->char_width;
+  run.mask.resize(static_cast<size_t>(run.width) * font->char_height);
+  for (size_t i = 0; i < len; ++i) {
+    unsigned char ch = s[i];
+    if (ch < ' ' || ch > '~') {
+      ch = '?';
+    }
+    const uint8_t* src_p = font->texture->data + ((ch - ' ') * font->char_width) +
+                           (bold ? font->char_height * font->texture->row_bytes : 0);
+    uint8_t* dst_p = run.mask.data() + i * font->char_width;
+    for (int j = 0; j < font->char_height; ++j) {
+      memcpy(dst_p, src_p, font->char_width);
+      src_p += font->texture->row_bytes;
+      dst_p += run.width;
+    }
+  }
+  return text_runs.emplace(std::move(key), std::move(run)).first->second;
+}
+
+void gr_text_forget(const char* s) {
+  if (*s == '\0') {
+    return;
+  }
+  // The runs of |s| are next to each other, as the text comes first in the key.
+  auto first = std::make_tuple(std::string(s), static_cast<const GRFont*>(nullptr), false);
+  auto it = text_runs.lower_bound(first);
+  while (it != text_runs.end() && std::get<0>(it->first) == s) {
+    it = text_runs.erase(it);
   }
 }
 
@@ -179,6 +431,25 @@ void gr_text(const GRFont* font, int x, int y, const char* s, bool bold) {
   x += overscan_offset_x;
   y += overscan_offset_y;
 
+  if (!rainbow_enabled) {
+    // Draw as many whole characters as fit, like the per-glyph loop below.
+    int count = 0;
+    for (const char* p = s; *p; ++p, ++count) {
+      int cx = x + count * font->char_width;
+      if (outside(cx, y) || outside(cx + font->char_width - 1, y + font->char_height - 1)) break;
+    }
+    if (count == 0) return;
+
+    const TextRun& run = get_text_run(font, s, bold);
+    int width = count * font->char_width;
+    int row_pixels = gr_draw->row_bytes / gr_draw->pixel_bytes;
+    uint32_t* dst_p = pixel_at(gr_draw, x, y, row_pixels);
+    text_blend(run.mask.data(), run.width, dst_p, row_pixels, width,
+               font->char_height);
+    add_damage(x, y, x + width, y + font->char_height);
+    return;
+  }
+
   unsigned char ch;
   while ((ch = *s++)) {
     if (rainbow_enabled) rainbow(x / font->char_width + (gr_fb_height() - y) / (font->char_height * 3));
@@ -196,6 +467,7 @@ void gr_text(const GRFont* font, int x, int y, const char* s, bool bold) {
 
     text_blend(src_p, font->texture->row_bytes, dst_p, row_pixels, font->char_width,
                font->char_height);
+    add_damage(x, y, x + font->char_width, y + font->char_height);
 
     x += font->char_width;
   }
@@ -219,6 +491,7 @@ void gr_texticon(int x, int y, GRSurface* icon) {
   uint32_t* dst_p = pixel_at(gr_draw, x, y, row_pixels);
 
   text_blend(src_p, icon->row_bytes, dst_p, row_pixels, icon->width, icon->height);
+  add_damage(x, y, x + icon->width, y + icon->height);
 }
 
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
@@ -231,6 +504,7 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
 }
 
 void gr_clear() {
+  damage = { 0, 0, gr_draw->width, gr_draw->height };
   if ((gr_current & 0xff) == ((gr_current >> 8) & 0xff) &&
       (gr_current & 0xff) == ((gr_current >> 16) & 0xff) &&
       (gr_current & 0xff) == ((gr_current >> 24) & 0xff) &&
@@ -260,14 +534,24 @@ void gr_fill(int x1, int y1, int x2, int y2) {
   int row_pixels = gr_draw->row_bytes / gr_draw->pixel_bytes;
   uint32_t* p = pixel_at(gr_draw, x1, y1, row_pixels);
   uint8_t alpha = static_cast<uint8_t>(((gr_current & alpha_mask) >> 24));
-  if (alpha > 0) {
-    for (int y = y1; y < y2; ++y) {
-      uint32_t* px = p;
-      for (int x = x1; x < x2; ++x) {
-        *px = pixel_blend(alpha, *px);
-        incr_x(&px, row_pixels);
-      }
-      incr_y(&p, row_pixels);
+  if (alpha == 0) return;
+  add_damage(x1, y1, x2, y2);
+
+  ptrdiff_t dy = step_y(row_pixels);
+  if (rotation == ROTATION_NONE || rotation == ROTATION_DOWN) {
+    // The rows are contiguous in memory, running leftwards when the screen is upside down.
+    int width = x2 - x1;
+    for (int y = y1; y < y2; ++y, p += dy) {
+      fill_span(rotation == ROTATION_NONE ? p : p - (width - 1), width, alpha);
+    }
+    return;
+  }
+
+  ptrdiff_t dx = step_x(row_pixels);
+  for (int y = y1; y < y2; ++y, p += dy) {
+    uint32_t* px = p;
+    for (int x = x1; x < x2; ++x, px += dx) {
+      *px = pixel_blend(alpha, *px);
     }
   }
 }
@@ -284,22 +568,29 @@ void gr_blit(GRSurface* source, int sx, int sy, int w, int h, int dx, int dy) {
   dy += overscan_offset_y;
 
   if (outside(dx, dy) || outside(dx + w - 1, dy + h - 1)) return;
+  add_damage(dx, dy, dx + w, dy + h);
 
   if (rotation) {
     int src_row_pixels = source->row_bytes / source->pixel_bytes;
     int row_pixels = gr_draw->row_bytes / gr_draw->pixel_bytes;
     uint32_t* src_py = reinterpret_cast<uint32_t*>(source->data) + sy * source->row_bytes / 4 + sx;
     uint32_t* dst_py = pixel_at(gr_draw, dx, dy, row_pixels);
+    ptrdiff_t step_dx = step_x(row_pixels);
+    ptrdiff_t step_dy = step_y(row_pixels);
 
     for (int y = 0; y < h; y += 1) {
-      uint32_t* src_px = src_py;
-      uint32_t* dst_px = dst_py;
-      for (int x = 0; x < w; x += 1) {
-        *dst_px = *src_px++;
-        incr_x(&dst_px, row_pixels);
+      if (rotation == ROTATION_DOWN) {
+        // The destination row is contiguous, just reversed.
+        std::reverse_copy(src_py, src_py + w, dst_py - (w - 1));
+      } else {
+        uint32_t* src_px = src_py;
+        uint32_t* dst_px = dst_py;
+        for (int x = 0; x < w; x += 1, dst_px += step_dx) {
+          *dst_px = *src_px++;
+        }
       }
       src_py += src_row_pixels;
-      incr_y(&dst_py, row_pixels);
+      dst_py += step_dy;
     }
   } else {
     unsigned char* src_p = source->data + sy * source->row_bytes + sx * source->pixel_bytes;
@@ -314,6 +605,48 @@ void gr_blit(GRSurface* source, int sx, int sy, int w, int h, int dx, int dy) {
   }
 }
 
+void gr_copy(int sx, int sy, int w, int h, int dx, int dy) {
+  if (w <= 0 || h <= 0) return;
+  sx += overscan_offset_x;
+  sy += overscan_offset_y;
+  dx += overscan_offset_x;
+  dy += overscan_offset_y;
+
+  if (outside(sx, sy) || outside(sx + w - 1, sy + h - 1) || outside(dx, dy) ||
+      outside(dx + w - 1, dy + h - 1)) {
+    return;
+  }
+  add_damage(dx, dy, dx + w, dy + h);
+
+  // Going against the vertical direction of the move keeps the source rows that overlap the
+  // destination intact until they've been copied.
+  int first = dy > sy ? h - 1 : 0;
+  int step = dy > sy ? -1 : 1;
+  int row_pixels = gr_draw->row_bytes / gr_draw->pixel_bytes;
+  if (rotation == ROTATION_NONE) {
+    for (int y = first; y >= 0 && y < h; y += step) {
+      memmove(pixel_at(gr_draw, dx, dy + y, row_pixels), pixel_at(gr_draw, sx, sy + y, row_pixels),
+              w * gr_draw->pixel_bytes);
+    }
+    return;
+  }
+
+  // The rows of the screen are strided in gr_draw, so go through a buffer that also takes care
+  // of the overlap within a row.
+  ptrdiff_t step_dx = step_x(row_pixels);
+  std::vector<uint32_t> row(w);
+  for (int y = first; y >= 0 && y < h; y += step) {
+    uint32_t* src_px = pixel_at(gr_draw, sx, sy + y, row_pixels);
+    for (int x = 0; x < w; ++x, src_px += step_dx) {
+      row[x] = *src_px;
+    }
+    uint32_t* dst_px = pixel_at(gr_draw, dx, dy + y, row_pixels);
+    for (int x = 0; x < w; ++x, dst_px += step_dx) {
+      *dst_px = row[x];
+    }
+  }
+}
+
 unsigned int gr_get_width(GRSurface* surface) {
   if (surface == NULL) {
     return 0;
@@ -352,6 +685,7 @@ int gr_init_font(const char* name, GRFont** dest) {
 }
 
 static void gr_init_font(void) {
+  text_runs.clear();
   int res = gr_init_font("font", &gr_font);
   if (res == 0) {
     res = gr_init_font("font_menu", &gr_font_menu);
@@ -386,23 +720,149 @@ static void gr_init_font(void) {
   gr_font->char_height = font.char_height;
 }
 
+// Returns where the canvas pixel (x, y) goes in gr_scanout, rotated by screen_rotation.
+static uint32_t* scanout_at(int x, int y) {
+  int row_pixels = gr_scanout->row_bytes / gr_scanout->pixel_bytes;
+  uint32_t* data = reinterpret_cast<uint32_t*>(gr_scanout->data);
+  switch (screen_rotation) {
+    case ROTATION_RIGHT:
+      return data + x * row_pixels + (gr_scanout->width - 1 - y);
+    case ROTATION_DOWN:
+      return data + (gr_scanout->height - 1 - y) * row_pixels + (gr_scanout->width - 1 - x);
+    case ROTATION_LEFT:
+      return data + (gr_scanout->height - 1 - x) * row_pixels + y;
+    default:
+      return data + y * row_pixels + x;
+  }
+}
+
+// Stores the columns of the 4x4 block of pixels whose rows are at src[0..3] at dst[0..3].
+static void transpose_4x4(const uint32_t* const src[4], uint32_t* const dst[4]) {
+#if defined(__ARM_NEON)
+  uint32x4x2_t ab = vtrnq_u32(vld1q_u32(src[0]), vld1q_u32(src[1]));
+  uint32x4x2_t cd = vtrnq_u32(vld1q_u32(src[2]), vld1q_u32(src[3]));
+  vst1q_u32(dst[0], vcombine_u32(vget_low_u32(ab.val[0]), vget_low_u32(cd.val[0])));
+  vst1q_u32(dst[1], vcombine_u32(vget_low_u32(ab.val[1]), vget_low_u32(cd.val[1])));
+  vst1q_u32(dst[2], vcombine_u32(vget_high_u32(ab.val[0]), vget_high_u32(cd.val[0])));
+  vst1q_u32(dst[3], vcombine_u32(vget_high_u32(ab.val[1]), vget_high_u32(cd.val[1])));
+#elif defined(__SSE2__)
+  __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src[0]));
+  __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src[1]));
+  __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src[2]));
+  __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src[3]));
+  __m128i ab_lo = _mm_unpacklo_epi32(a, b);
+  __m128i cd_lo = _mm_unpacklo_epi32(c, d);
+  __m128i ab_hi = _mm_unpackhi_epi32(a, b);
+  __m128i cd_hi = _mm_unpackhi_epi32(c, d);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(dst[0]), _mm_unpacklo_epi64(ab_lo, cd_lo));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(dst[1]), _mm_unpackhi_epi64(ab_lo, cd_lo));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(dst[2]), _mm_unpacklo_epi64(ab_hi, cd_hi));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(dst[3]), _mm_unpackhi_epi64(ab_hi, cd_hi));
+#else
+  for (int i = 0; i < 4; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      dst[i][j] = src[j][i];
+    }
+  }
+#endif
+}
+
+// Copies the rectangle [x1, x2) x [y1, y2) of the canvas into gr_scanout, rotated.
+static void rotate_canvas(int x1, int y1, int x2, int y2) {
+  const uint32_t* src = canvas_pixels.get();
+  if (screen_rotation == ROTATION_DOWN) {
+    // Each row only gets reversed.
+    for (int y = y1; y < y2; ++y) {
+      std::reverse_copy(src + y * canvas.width + x1, src + y * canvas.width + x2,
+                        scanout_at(x2 - 1, y));
+    }
+    return;
+  }
+
+  // A quarter turn is a transpose with one of the axes flipped. Going through the rectangle in
+  // tiles keeps the rows of both buffers that a tile touches in the cache, and each tile goes in
+  // 4x4 blocks that take a few vector instructions. For a right turn, the rows of a block go in
+  // reverse, so that the columns come out in the order of the scanout rows.
+  constexpr int kTile = 32;
+  bool right = screen_rotation == ROTATION_RIGHT;
+  for (int ty = y1; ty < y2; ty += kTile) {
+    int ty2 = std::min(ty + kTile, y2);
+    for (int tx = x1; tx < x2; tx += kTile) {
+      int tx2 = std::min(tx + kTile, x2);
+      int y = ty;
+      for (; y + 4 <= ty2; y += 4) {
+        int x = tx;
+        for (; x + 4 <= tx2; x += 4) {
+          const uint32_t* rows[4];
+          uint32_t* cols[4];
+          for (int i = 0; i < 4; ++i) {
+            rows[i] = src + (right ? y + 3 - i : y + i) * canvas.width + x;
+            cols[i] = scanout_at(x + i, right ? y + 3 : y);
+          }
+          transpose_4x4(rows, cols);
+        }
+        for (; x < tx2; ++x) {
+          for (int i = 0; i < 4; ++i) {
+            *scanout_at(x, y + i) = src[(y + i) * canvas.width + x];
+          }
+        }
+      }
+      for (; y < ty2; ++y) {
+        for (int x = tx; x < tx2; ++x) {
+          *scanout_at(x, y) = src[y * canvas.width + x];
+        }
+      }
+    }
+  }
+}
+
 void gr_flip() {
-  gr_draw = gr_backend->Flip();
+  if (gr_draw != &canvas) {
+    gr_scanout = gr_backend->FlipDamage(damage.x1, damage.y1, std::max(damage.x2 - damage.x1, 0),
+                                        std::max(damage.y2 - damage.y1, 0));
+    gr_draw = gr_scanout;
+    damage = { 0, 0, 0, 0 };
+    return;
+  }
+
+  // The damage is in canvas coordinates; rotate that part, and pass it on in scanout ones.
+  int x = 0, y = 0, w = 0, h = 0;
+  if (damage.x1 < damage.x2 && damage.y1 < damage.y2) {
+    rotate_canvas(damage.x1, damage.y1, damage.x2, damage.y2);
+    int dw = damage.x2 - damage.x1;
+    int dh = damage.y2 - damage.y1;
+    switch (screen_rotation) {
+      case ROTATION_RIGHT:
+        x = gr_scanout->width - damage.y2, y = damage.x1, w = dh, h = dw;
+        break;
+      case ROTATION_DOWN:
+        x = gr_scanout->width - damage.x2, y = gr_scanout->height - damage.y2, w = dw, h = dh;
+        break;
+      default:
+        x = damage.y1, y = gr_scanout->height - damage.x2, w = dh, h = dw;
+        break;
+    }
+  }
+  gr_scanout = gr_backend->FlipDamage(x, y, w, h);
+  damage = { 0, 0, 0, 0 };
 }
 
 int gr_init() {
   gr_init_font();
 
   auto backend = std::unique_ptr<MinuiBackend>{ std::make_unique<MinuiBackendAdf>() };
+  backend_name = "adf";
   gr_draw = backend->Init();
 
   if (!gr_draw) {
     backend = std::make_unique<MinuiBackendDrm>();
+    backend_name = "drm";
     gr_draw = backend->Init();
   }
 
   if (!gr_draw) {
     backend = std::make_unique<MinuiBackendFbdev>();
+    backend_name = "fbdev";
     gr_draw = backend->Init();
   }
 
@@ -411,6 +871,7 @@ int gr_init() {
   }
 
   gr_backend = backend.release();
+  gr_scanout = gr_draw;
 
   overscan_offset_x = gr_draw->width * overscan_percent / 100;
   overscan_offset_y = gr_draw->height * overscan_percent / 100;
@@ -428,7 +889,15 @@ int gr_init() {
 }
 
 void gr_exit() {
+  text_runs.clear();
+  canvas_pixels.reset();
+  gr_draw = gr_scanout;
   delete gr_backend;
+  gr_backend = nullptr;
+}
+
+const char* gr_backend_name() {
+  return gr_backend ? backend_name : "none";
 }
 
 int gr_fb_width() {
@@ -446,5 +915,26 @@ void gr_fb_blank(bool blank) {
 }
 
 void gr_rotate(GRRotation rot) {
-  rotation = rot;
+  screen_rotation = rot;
+  rotation = ROTATION_NONE;
+  canvas_pixels.reset();
+  gr_draw = gr_scanout;
+  if (rot != ROTATION_NONE) {
+    int width = rot % 2 ? gr_scanout->height : gr_scanout->width;
+    int height = rot % 2 ? gr_scanout->width : gr_scanout->height;
+    canvas_pixels.reset(new (std::nothrow) uint32_t[static_cast<size_t>(width) * height]());
+    if (canvas_pixels && gr_scanout->pixel_bytes == 4) {
+      canvas = { width, height, width * 4, 4,
+                 reinterpret_cast<unsigned char*>(canvas_pixels.get()) };
+      gr_draw = &canvas;
+    } else {
+      // Draw into the scanout buffer directly, rotating each pixel.
+      canvas_pixels.reset();
+      rotation = rot;
+    }
+  }
+  // The whole screen needs to make it to the scanout buffer on the next flip.
+  damage = { 0, 0, gr_draw->width, gr_draw->height };
+  overscan_offset_x = gr_draw->width * overscan_percent / 100;
+  overscan_offset_y = gr_draw->height * overscan_percent / 100;
 }
@@ -28,6 +28,13 @@ class MinuiBackend {
   // be displayed, and returns a new drawing surface.
   virtual GRSurface* Flip() = 0;
 
+  // Like Flip(), with a hint that only the given rectangle of the current drawing surface (in its
+  // unrotated coordinates) has been drawn to since the previous flip. An empty rectangle means
+  // nothing has changed. Backends that can't make use of the hint simply flip.
+  virtual GRSurface* FlipDamage(int /* x */, int /* y */, int /* width */, int /* height */) {
+    return Flip();
+  }
+
   // Blank (or unblank) the screen.
   virtual void Blank(bool) = 0;
 
@@ -17,12 +17,15 @@
 #include "graphics_drm.h"
 
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 #include <drm_fourcc.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
@@ -32,7 +35,16 @@
 #define ARRAY_SIZE(A) (sizeof(A)/sizeof(*(A)))
 
 MinuiBackendDrm::MinuiBackendDrm()
-    : GRSurfaceDrms(), main_monitor_crtc(nullptr), main_monitor_connector(nullptr), drm_fd(-1) {}
+    : GRSurfaceDrms(),
+      buffer_count(0),
+      current_buffer(0),
+      front_buffer(0),
+      pending_buffer(-1),
+      main_monitor_crtc(nullptr),
+      main_monitor_connector(nullptr),
+      drm_fd(-1),
+      last_damage(),
+      dirty_fb_supported(true) {}
 
 void MinuiBackendDrm::DrmDisableCrtc(int drm_fd, drmModeCrtc* crtc) {
   if (crtc) {
@@ -57,10 +69,11 @@ void MinuiBackendDrm::DrmEnableCrtc(int drm_fd, drmModeCrtc* crtc, GRSurfaceDrm*
 }
 
 void MinuiBackendDrm::Blank(bool blank) {
+  WaitForFlip();
   if (blank) {
     DrmDisableCrtc(drm_fd, main_monitor_crtc);
   } else {
-    DrmEnableCrtc(drm_fd, main_monitor_crtc, GRSurfaceDrms[current_buffer]);
+    DrmEnableCrtc(drm_fd, main_monitor_crtc, GRSurfaceDrms[front_buffer]);
   }
 }
 
@@ -365,29 +378,118 @@ GRSurface* MinuiBackendDrm::Init() {
     // GRSurfaceDrms and drm_fd should be freed in d'tor.
     return nullptr;
   }
+  buffer_count = 2;
+  for (; buffer_count < kMaxBuffers; ++buffer_count) {
+    GRSurfaceDrms[buffer_count] = DrmCreateSurface(width, height);
+    if (!GRSurfaceDrms[buffer_count]) break;
+  }
+  printf("drm: using %d buffers\n", buffer_count);
 
   current_buffer = 0;
+  front_buffer = 1;
+  pending_buffer = -1;
 
-  DrmEnableCrtc(drm_fd, main_monitor_crtc, GRSurfaceDrms[1]);
+  DrmEnableCrtc(drm_fd, main_monitor_crtc, GRSurfaceDrms[front_buffer]);
 
-  return GRSurfaceDrms[0];
+  return GRSurfaceDrms[current_buffer];
+}
+
+void MinuiBackendDrm::PageFlipHandler(int /* fd */, unsigned int /* sequence */,
+                                      unsigned int /* tv_sec */, unsigned int /* tv_usec */,
+                                      void* user_data) {
+  MinuiBackendDrm* backend = static_cast<MinuiBackendDrm*>(user_data);
+  backend->front_buffer = backend->pending_buffer;
+  backend->pending_buffer = -1;
+}
+
+void MinuiBackendDrm::WaitForFlip() {
+  drmEventContext event_context = {};
+  event_context.version = 2;
+  event_context.page_flip_handler = PageFlipHandler;
+
+  while (pending_buffer != -1) {
+    pollfd pfd = { drm_fd, POLLIN, 0 };
+    // A flip completes at the next vblank; don't hang the UI on a display that stopped sending
+    // them (e.g. while blanked).
+    int ret = TEMP_FAILURE_RETRY(poll(&pfd, 1, 1000));
+    if (ret <= 0) {
+      printf("timed out waiting for the page flip (%d)\n", ret);
+      front_buffer = pending_buffer;
+      pending_buffer = -1;
+      break;
+    }
+    if (drmHandleEvent(drm_fd, &event_context) != 0) {
+      printf("drmHandleEvent failed\n");
+      front_buffer = pending_buffer;
+      pending_buffer = -1;
+      break;
+    }
+  }
 }
 
 GRSurface* MinuiBackendDrm::Flip() {
+  // Only one flip can be queued at a time.
+  WaitForFlip();
   int ret = drmModePageFlip(drm_fd, main_monitor_crtc->crtc_id,
-                            GRSurfaceDrms[current_buffer]->fb_id, 0, nullptr);
+                            GRSurfaceDrms[current_buffer]->fb_id, DRM_MODE_PAGE_FLIP_EVENT, this);
   if (ret < 0) {
     printf("drmModePageFlip failed ret=%d\n", ret);
     return nullptr;
   }
-  current_buffer = 1 - current_buffer;
+  pending_buffer = current_buffer;
+
+  // Draw next into a buffer that is neither on the screen nor about to be. With only two of them,
+  // that's the one on the screen until the flip completes.
+  if (buffer_count < 3) {
+    WaitForFlip();
+  }
+  do {
+    current_buffer = (current_buffer + 1) % buffer_count;
+  } while (current_buffer == front_buffer || current_buffer == pending_buffer);
   return GRSurfaceDrms[current_buffer];
 }
 
+GRSurface* MinuiBackendDrm::FlipDamage(int x, int y, int width, int height) {
+  if (!dirty_fb_supported) {
+    return Flip();
+  }
+  // The buffer being shown missed the changes drawn into the other ones for the previous flips,
+  // so the screen changes by the damage of all of them.
+  drmModeClip clip = { static_cast<uint16_t>(x), static_cast<uint16_t>(y),
+                       static_cast<uint16_t>(x + width), static_cast<uint16_t>(y + height) };
+  drmModeClip hint = {};
+  for (int i = -1; i < buffer_count - 1; ++i) {
+    const drmModeClip& damage = i < 0 ? clip : last_damage[i];
+    if (damage.x2 <= damage.x1 || damage.y2 <= damage.y1) continue;
+    if (hint.x2 <= hint.x1 || hint.y2 <= hint.y1) {
+      hint = damage;
+    } else {
+      hint = { std::min(hint.x1, damage.x1), std::min(hint.y1, damage.y1),
+               std::max(hint.x2, damage.x2), std::max(hint.y2, damage.y2) };
+    }
+  }
+  for (int i = kMaxBuffers - 2; i > 0; --i) {
+    last_damage[i] = last_damage[i - 1];
+  }
+  last_damage[0] = clip;
+
+  // Panels that are refreshed on demand (command mode) only need to be sent the dirty region.
+  // Drivers that don't implement the ioctl fail it; stop asking them.
+  if (hint.x2 > hint.x1 && hint.y2 > hint.y1 &&
+      drmModeDirtyFB(drm_fd, GRSurfaceDrms[current_buffer]->fb_id, &hint, 1) != 0) {
+    dirty_fb_supported = false;
+  }
+  return Flip();
+}
+
 MinuiBackendDrm::~MinuiBackendDrm() {
+  if (main_monitor_crtc) {
+    WaitForFlip();
+  }
   DrmDisableCrtc(drm_fd, main_monitor_crtc);
-  DrmDestroySurface(GRSurfaceDrms[0]);
-  DrmDestroySurface(GRSurfaceDrms[1]);
+  for (int i = 0; i < kMaxBuffers; ++i) {
+    DrmDestroySurface(GRSurfaceDrms[i]);
+  }
   drmModeFreeCrtc(main_monitor_crtc);
   drmModeFreeConnector(main_monitor_connector);
   close(drm_fd);
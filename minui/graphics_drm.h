@@ -36,6 +36,7 @@ class MinuiBackendDrm : public MinuiBackend {
  public:
   GRSurface* Init() override;
   GRSurface* Flip() override;
+  GRSurface* FlipDamage(int x, int y, int width, int height) override;
   void Blank(bool) override;
   ~MinuiBackendDrm() override;
   MinuiBackendDrm();
@@ -47,12 +48,27 @@ class MinuiBackendDrm : public MinuiBackend {
   void DrmDestroySurface(GRSurfaceDrm* surface);
   void DisableNonMainCrtcs(int fd, drmModeRes* resources, drmModeCrtc* main_crtc);
   drmModeConnector* FindMainMonitor(int fd, drmModeRes* resources, uint32_t* mode_index);
+  // Waits for the queued page flip, if any, to complete.
+  void WaitForFlip();
+  static void PageFlipHandler(int fd, unsigned int sequence, unsigned int tv_sec,
+                              unsigned int tv_usec, void* user_data);
 
-  GRSurfaceDrm* GRSurfaceDrms[2];
+  // With a third buffer, the next frame can be drawn while the flip to the previous one is still
+  // queued. Falls back to two buffers if the third can't be allocated.
+  static constexpr int kMaxBuffers = 3;
+  GRSurfaceDrm* GRSurfaceDrms[kMaxBuffers];
+  int buffer_count;
+  // The buffer being drawn into.
   int current_buffer;
+  // The buffer being scanned out, and the one queued to replace it at the next vblank (or -1).
+  int front_buffer;
+  int pending_buffer;
   drmModeCrtc* main_monitor_crtc;
   drmModeConnector* main_monitor_connector;
   int drm_fd;
+  // The damage hinted at the previous flips, which went to the other buffers. The latest first.
+  drmModeClip last_damage[kMaxBuffers - 1];
+  bool dirty_fb_supported;
 };
 
 #endif  // _GRAPHICS_DRM_H_
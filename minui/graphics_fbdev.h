@@ -26,6 +26,7 @@ class MinuiBackendFbdev : public MinuiBackend {
  public:
   GRSurface* Init() override;
   GRSurface* Flip() override;
+  GRSurface* FlipDamage(int x, int y, int width, int height) override;
   void Blank(bool) override;
   ~MinuiBackendFbdev() override;
   MinuiBackendFbdev();
@@ -57,6 +57,8 @@ int gr_fb_height();
 
 void gr_flip();
 void gr_fb_blank(bool blank);
+// The name of the backend in use ("adf", "drm" or "fbdev").
+const char* gr_backend_name();
 
 void gr_clear();  // clear entire surface to current color
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a);
@@ -68,10 +70,15 @@ const GRFont* gr_sys_font();
 const GRFont* gr_menu_font();
 int gr_init_font(const char* name, GRFont** dest);
 void gr_text(const GRFont* font, int x, int y, const char* s, bool bold);
+// Drops what gr_text() keeps of the text |s| (in any font), once it's not going to be drawn again.
+void gr_text_forget(const char* s);
 int gr_measure(const GRFont* font, const char* s);
 void gr_font_size(const GRFont* font, int* x, int* y);
 
 void gr_blit(GRSurface* source, int sx, int sy, int w, int h, int dx, int dy);
+// Copies the w x h rectangle of the screen at (sx, sy) to (dx, dy). The two
+// may overlap.
+void gr_copy(int sx, int sy, int w, int h, int dx, int dy);
 unsigned int gr_get_width(GRSurface* surface);
 unsigned int gr_get_height(GRSurface* surface);
 
@@ -102,6 +109,9 @@ int ev_sync_key_state(const ev_set_key_callback& set_key_cb);
 int ev_wait(int timeout);
 
 int ev_get_input(int fd, uint32_t epevents, input_event* ev);
+// Reads up to 'max' pending events from 'fd' at once, into 'evs'. Returns the number of events
+// read, or -1 if there were none.
+int ev_get_inputs(int fd, uint32_t epevents, input_event* evs, size_t max);
 void ev_dispatch();
 int ev_get_epollfd();
 
@@ -120,6 +130,8 @@ bool matches_locale(const std::string& prefix, const std::string& locale);
 // color (with gr_text() or gr_texticon()).
 //
 // All these functions load PNG images from "/res/images/${name}.png".
+// The display and alpha surfaces are taken from "/res/images/surfaces.pack"
+// instead when the image has been decoded into that pack at build time.
 
 // Load a single display surface from a PNG image.
 int res_create_display_surface(const char* name, GRSurface** pSurface);
@@ -145,6 +157,16 @@ int res_create_localized_alpha_surface(const char* name, const char* locale,
 
 int res_create_scaled_surface(GRSurface** dst, GRSurface* src, float sx, float sy);
 
+// Stores the smallest rectangle of the display surface |frame| that holds all of its pixels that
+// differ from |previous| (one of the same size) in a new surface |*delta|, to be placed at (*x, *y)
+// by res_apply_delta_surface(). *delta is nullptr if the two are identical, and the whole of
+// |frame| if |previous| is nullptr. Returns 0 if no error, else negative.
+int res_create_delta_surface(GRSurface** delta, int* x, int* y, const GRSurface* previous,
+                             const GRSurface* frame);
+
+// Copies the display surface |delta| into |target| at (x, y), which must fit.
+void res_apply_delta_surface(GRSurface* target, const GRSurface* delta, int x, int y);
+
 // Return a list of locale strings embedded in |png_name|. Return a empty list in case of failure.
 std::vector<std::string> get_locales_in_png(const std::string& png_name);
 
@@ -152,6 +174,19 @@ std::vector<std::string> get_locales_in_png(const std::string& png_name);
 // functions.
 void res_free_surface(GRSurface* surface);
 
+// Changes the "/res/images" directory, for tools and tests. Must be
+// called before any surface is loaded.
+void res_set_resource_dir(const std::string& dirname);
+
+// Decodes the named images into a pack of surfaces at |path|, to be read by
+// the res_create_*_surface() functions of a build with the same pixel format.
+// Grayscale images are stored as alpha surfaces, the others as display
+// surfaces. The |localized_names| images get split into one surface per
+// locale, for res_create_localized_alpha_surface() and get_locales_in_png().
+// Used by the minui_surfaces_pack host tool.
+int res_write_surfaces_pack(const std::string& path, const std::vector<std::string>& names,
+                            const std::vector<std::string>& localized_names = {});
+
 void set_rainbow_mode(int enabled);
 void move_rainbow(int x);
 
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <errno.h>
 #include <fcntl.h>
 #include <linux/fb.h>
 #include <linux/kd.h>
@@ -22,16 +23,30 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <regex>
 #include <string>
+#include <tuple>
+#include <utility>
 #include <vector>
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <android-base/file.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 #include <png.h>
 
 #include "minui/minui.h"
@@ -48,6 +63,196 @@ static GRSurface* malloc_surface(size_t data_size) {
     return surface;
 }
 
+static std::string res_dir = "/res/images";
+
+void res_set_resource_dir(const std::string& dirname) {
+  res_dir = dirname;
+}
+
+// The surfaces decoded at build time, in "${res_dir}/surfaces.pack" (see
+// res_write_surfaces_pack()). The file has a SurfacePackHeader, followed by |count|
+// SurfacePackEntry's, followed by the pixel data of each entry, in the format
+// res_create_*_surface() would have produced. A localized image has one entry per locale, in
+// the order of the PNG, all under the name of the image.
+static constexpr char SURFACE_PACK_MAGIC[8] = { 'M', 'S', 'U', 'R', 'F', 'P', 'K', '2' };
+static constexpr uint32_t SURFACE_PACK_DISPLAY = 1;
+static constexpr uint32_t SURFACE_PACK_ALPHA = 2;
+static constexpr uint32_t SURFACE_PACK_LOCALIZED = 3;
+// The byte order of the display surfaces, which must match this build's.
+#if defined(RECOVERY_ABGR) || defined(RECOVERY_BGRA)
+static constexpr uint32_t SURFACE_PACK_FORMAT = 1;  // BGRX
+#else
+static constexpr uint32_t SURFACE_PACK_FORMAT = 0;  // RGBX
+#endif
+
+struct SurfacePackHeader {
+  char magic[8];
+  uint32_t format;
+  uint32_t count;
+};
+
+struct SurfacePackEntry {
+  char name[48];
+  // The locale of a SURFACE_PACK_LOCALIZED entry.
+  char locale[16];
+  uint32_t kind;
+  uint32_t width;
+  uint32_t height;
+  uint32_t row_bytes;
+  uint32_t pixel_bytes;
+  uint32_t reserved;
+  uint64_t offset;
+};
+
+static_assert(sizeof(SurfacePackEntry) == 96, "SurfacePackEntry must stay packed");
+
+class SurfacePack {
+ public:
+  ~SurfacePack() {
+    if (addr_ != MAP_FAILED) munmap(addr_, length_);
+  }
+
+  // Returns the pack of the resource directory, or nullptr if there's no usable one.
+  static const SurfacePack* Get();
+
+  // Returns a copy of the surface |name| of the given kind, or nullptr if it isn't in the pack.
+  GRSurface* Create(const char* name, uint32_t kind) const;
+
+  // Returns a copy of the part of the localized image |name| that is the first match for
+  // |locale|, or the last part if none matches, like res_create_localized_alpha_surface() would.
+  // Returns nullptr if the image isn't in the pack.
+  GRSurface* CreateLocalized(const char* name, const char* locale) const;
+
+  // Returns whether the localized image |name| is in the pack, and if so stores its locales.
+  bool GetLocales(const char* name, std::vector<std::string>* locales) const;
+
+ private:
+  bool Load(const std::string& path);
+  // Returns whether |entry| is the given kind of |name|.
+  static bool Matches(const SurfacePackEntry& entry, const char* name, uint32_t kind);
+  GRSurface* Copy(const SurfacePackEntry& entry) const;
+
+  void* addr_ = MAP_FAILED;
+  size_t length_ = 0;
+  const SurfacePackEntry* entries_ = nullptr;
+  uint32_t count_ = 0;
+};
+
+const SurfacePack* SurfacePack::Get() {
+  static SurfacePack* pack = nullptr;
+  static std::once_flag once;
+  std::call_once(once, [] {
+    std::unique_ptr<SurfacePack> loaded(new SurfacePack);
+    if (loaded->Load(res_dir + "/surfaces.pack")) {
+      pack = loaded.release();
+    }
+  });
+  return pack;
+}
+
+bool SurfacePack::Load(const std::string& path) {
+  android::base::unique_fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd == -1) {
+    return false;
+  }
+  struct stat sb;
+  if (fstat(fd, &sb) == -1 || static_cast<size_t>(sb.st_size) < sizeof(SurfacePackHeader)) {
+    return false;
+  }
+  length_ = sb.st_size;
+  addr_ = mmap(nullptr, length_, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (addr_ == MAP_FAILED) {
+    return false;
+  }
+
+  const SurfacePackHeader* header = static_cast<const SurfacePackHeader*>(addr_);
+  if (memcmp(header->magic, SURFACE_PACK_MAGIC, sizeof(SURFACE_PACK_MAGIC)) != 0) {
+    printf("%s: bad magic\n", path.c_str());
+    return false;
+  }
+  if (header->format != SURFACE_PACK_FORMAT) {
+    printf("%s: pixel format %u doesn't match %u\n", path.c_str(), header->format,
+           SURFACE_PACK_FORMAT);
+    return false;
+  }
+  if (header->count > (length_ - sizeof(*header)) / sizeof(SurfacePackEntry)) {
+    printf("%s: truncated\n", path.c_str());
+    return false;
+  }
+  count_ = header->count;
+  entries_ = reinterpret_cast<const SurfacePackEntry*>(header + 1);
+  return true;
+}
+
+bool SurfacePack::Matches(const SurfacePackEntry& entry, const char* name, uint32_t kind) {
+  return entry.kind == kind && strncmp(entry.name, name, sizeof(entry.name)) == 0;
+}
+
+GRSurface* SurfacePack::Copy(const SurfacePackEntry& entry) const {
+  uint64_t size = static_cast<uint64_t>(entry.row_bytes) * entry.height;
+  if (entry.offset > length_ || size > length_ - entry.offset ||
+      entry.row_bytes < static_cast<uint64_t>(entry.width) * entry.pixel_bytes) {
+    printf("surface pack: bad entry for %.*s\n", static_cast<int>(sizeof(entry.name)), entry.name);
+    return nullptr;
+  }
+  GRSurface* surface = malloc_surface(size);
+  if (surface == nullptr) {
+    return nullptr;
+  }
+  surface->width = entry.width;
+  surface->height = entry.height;
+  surface->row_bytes = entry.row_bytes;
+  surface->pixel_bytes = entry.pixel_bytes;
+  memcpy(surface->data, static_cast<const uint8_t*>(addr_) + entry.offset, size);
+  return surface;
+}
+
+GRSurface* SurfacePack::Create(const char* name, uint32_t kind) const {
+  for (uint32_t i = 0; i < count_; ++i) {
+    if (Matches(entries_[i], name, kind)) {
+      return Copy(entries_[i]);
+    }
+  }
+  return nullptr;
+}
+
+GRSurface* SurfacePack::CreateLocalized(const char* name, const char* locale) const {
+  const SurfacePackEntry* last = nullptr;
+  for (uint32_t i = 0; i < count_; ++i) {
+    const SurfacePackEntry& entry = entries_[i];
+    if (!Matches(entry, name, SURFACE_PACK_LOCALIZED)) {
+      continue;
+    }
+    std::string entry_locale(entry.locale, strnlen(entry.locale, sizeof(entry.locale)));
+    if (matches_locale(entry_locale, locale)) {
+      last = &entry;
+      break;
+    }
+    last = &entry;
+  }
+  if (last == nullptr) {
+    return nullptr;
+  }
+  printf("  %20s: %.*s (%u x %u, packed)\n", name, static_cast<int>(sizeof(last->locale)),
+         last->locale, last->width, last->height);
+  return Copy(*last);
+}
+
+bool SurfacePack::GetLocales(const char* name, std::vector<std::string>* locales) const {
+  bool found = false;
+  for (uint32_t i = 0; i < count_; ++i) {
+    const SurfacePackEntry& entry = entries_[i];
+    if (Matches(entry, name, SURFACE_PACK_LOCALIZED)) {
+      found = true;
+      std::string locale(entry.locale, strnlen(entry.locale, sizeof(entry.locale)));
+      if (!locale.empty()) {
+        locales->push_back(locale);
+      }
+    }
+  }
+  return found;
+}
+
 // This class handles the png file parsing. It also holds the ownership of the png pointer and the
 // opened file pointer. Both will be destroyed/closed when this object goes out of scope.
 class PngHandler {
@@ -98,7 +303,7 @@ class PngHandler {
 };
 
 PngHandler::PngHandler(const std::string& name) : error_code_(0), png_fp_(nullptr, fclose) {
-  std::string res_path = android::base::StringPrintf("/res/images/%s.png", name.c_str());
+  std::string res_path = android::base::StringPrintf("%s/%s.png", res_dir.c_str(), name.c_str());
   png_fp_.reset(fopen(res_path.c_str(), "rbe"));
   if (!png_fp_) {
     error_code_ = -1;
@@ -239,6 +444,11 @@ static void transform_rgb_to_draw(unsigned char* input_row,
 int res_create_display_surface(const char* name, GRSurface** pSurface) {
   *pSurface = nullptr;
 
+  const SurfacePack* pack = SurfacePack::Get();
+  if (pack != nullptr && (*pSurface = pack->Create(name, SURFACE_PACK_DISPLAY)) != nullptr) {
+    return 0;
+  }
+
   PngHandler png_handler(name);
   if (!png_handler) return png_handler.error_code();
 
@@ -351,6 +561,11 @@ exit:
 int res_create_alpha_surface(const char* name, GRSurface** pSurface) {
   *pSurface = nullptr;
 
+  const SurfacePack* pack = SurfacePack::Get();
+  if (pack != nullptr && (*pSurface = pack->Create(name, SURFACE_PACK_ALPHA)) != nullptr) {
+    return 0;
+  }
+
   PngHandler png_handler(name);
   if (!png_handler) return png_handler.error_code();
 
@@ -410,6 +625,12 @@ bool matches_locale(const std::string& prefix, const std::string& locale) {
 }
 
 std::vector<std::string> get_locales_in_png(const std::string& png_name) {
+  std::vector<std::string> packed;
+  const SurfacePack* pack = SurfacePack::Get();
+  if (pack != nullptr && pack->GetLocales(png_name.c_str(), &packed)) {
+    return packed;
+  }
+
   PngHandler png_handler(png_name);
   if (!png_handler) {
     printf("Failed to open %s, error: %d\n", png_name.c_str(), png_handler.error_code());
@@ -445,6 +666,13 @@ int res_create_localized_alpha_surface(const char* name,
     return 0;
   }
 
+  // The pack has the parts of the image already split, so there's no need to decode the ones
+  // before the match.
+  const SurfacePack* pack = SurfacePack::Get();
+  if (pack != nullptr && (*pSurface = pack->CreateLocalized(name, locale)) != nullptr) {
+    return 0;
+  }
+
   PngHandler png_handler(name);
   if (!png_handler) return png_handler.error_code();
 
@@ -493,62 +721,379 @@ int res_create_localized_alpha_surface(const char* name,
   return 0;
 }
 
-static uint32_t getpixel(GRSurface* surface, int x, int y) {
-  uint32_t* pixels = (uint32_t*)surface->data;
-  return pixels[y * surface->width + x];
+// Bilinear scaling in fixed point, with the weights in 1/128ths. Each source row gets scaled
+// horizontally once, into 16-bit channels, and two such rows get blended vertically into each
+// output row.
+static constexpr int kScaleBits = 7;
+static constexpr int kScaleOne = 1 << kScaleBits;
+
+struct ScaleTap {
+  int offset;   // Byte offset of the left source pixel.
+  int weight;   // Weight of the right one.
+};
+
+static void scale_row_horizontally(const uint8_t* src, const std::vector<ScaleTap>& taps,
+                                   uint16_t* out) {
+  for (const ScaleTap& tap : taps) {
+    const uint8_t* p = src + tap.offset;
+    for (int c = 0; c < 4; ++c) {
+      *out++ = p[c] * (kScaleOne - tap.weight) + p[c + 4] * tap.weight;
+    }
+  }
 }
 
-static void putpixel(GRSurface* surface, int x, int y, uint32_t color) {
-  uint32_t* pixels = (uint32_t*)surface->data;
-  pixels[y * surface->width + x] = color;
+// Blends the horizontally scaled rows a and b into the n channels of out, with b weighted by w.
+static void blend_rows_vertically(const uint16_t* a, const uint16_t* b, int w, int n,
+                                  uint8_t* out) {
+  constexpr int kShift = 2 * kScaleBits;
+  int i = 0;
+#if defined(__ARM_NEON)
+  uint16x4_t wa = vdup_n_u16(kScaleOne - w);
+  uint16x4_t wb = vdup_n_u16(w);
+  for (; i + 8 <= n; i += 8) {
+    uint16x8_t va = vld1q_u16(a + i);
+    uint16x8_t vb = vld1q_u16(b + i);
+    uint32x4_t lo = vmlal_u16(vmull_u16(vget_low_u16(va), wa), vget_low_u16(vb), wb);
+    uint32x4_t hi = vmlal_u16(vmull_u16(vget_high_u16(va), wa), vget_high_u16(vb), wb);
+    vst1_u8(out + i, vmovn_u16(vcombine_u16(vrshrn_n_u32(lo, kShift), vrshrn_n_u32(hi, kShift))));
+  }
+#elif defined(__SSE2__)
+  // The channels fit in int16_t (at most 255 * 128), so _mm_madd_epi16() can weigh and add each
+  // pair of them at once.
+  __m128i weights = _mm_set1_epi32((w << 16) | (kScaleOne - w));
+  __m128i round = _mm_set1_epi32(1 << (kShift - 1));
+  for (; i + 8 <= n; i += 8) {
+    __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+    __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+    __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(va, vb), weights);
+    __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(va, vb), weights);
+    lo = _mm_srai_epi32(_mm_add_epi32(lo, round), kShift);
+    hi = _mm_srai_epi32(_mm_add_epi32(hi, round), kShift);
+    __m128i packed = _mm_packs_epi32(lo, hi);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(packed, packed));
+  }
+#endif
+  for (; i < n; ++i) {
+    out[i] = (a[i] * (kScaleOne - w) + b[i] * w + (1 << (kShift - 1))) >> kShift;
+  }
 }
 
-static float lerp(float s, float e, float t) {
-  return s + (e - s) * t;
+static GRSurface* scale_surface(const GRSurface* src, int new_w, int new_h) {
+  GRSurface* scaled = init_display_surface(new_w, new_h);
+  if (scaled == nullptr) {
+    return nullptr;
+  }
+
+  // Output pixel x samples the source at x / new_w * (width - 1), and likewise for y.
+  int src_w = src->width;
+  int src_h = src->height;
+  std::vector<ScaleTap> taps(new_w);
+  for (int x = 0; x < new_w; ++x) {
+    int64_t gx = (static_cast<int64_t>(x) * (src_w - 1) << kScaleBits) / new_w;
+    int gxi = gx >> kScaleBits;
+    // A source one pixel wide has no right neighbour; weigh it with itself.
+    taps[x].offset = std::min(gxi, std::max(src_w - 2, 0)) * 4;
+    taps[x].weight = src_w > 1 ? gx & (kScaleOne - 1) : 0;
+  }
+
+  // The two source rows being blended, already scaled horizontally.
+  int channels = new_w * 4;
+  std::vector<uint16_t> rows[2] = { std::vector<uint16_t>(channels),
+                                    std::vector<uint16_t>(channels) };
+  int row_y[2] = { -1, -1 };
+  for (int y = 0; y < new_h; ++y) {
+    int64_t gy = (static_cast<int64_t>(y) * (src_h - 1) << kScaleBits) / new_h;
+    int gyi = gy >> kScaleBits;
+    int weight = gy & (kScaleOne - 1);
+    int wanted[2] = { gyi, std::min(gyi + 1, src_h - 1) };
+    // We walk down the source, so the lower row usually becomes the upper one.
+    if (row_y[1] == wanted[0]) {
+      std::swap(rows[0], rows[1]);
+      std::swap(row_y[0], row_y[1]);
+    }
+    for (int i = 0; i < 2; ++i) {
+      if (row_y[i] != wanted[i]) {
+        scale_row_horizontally(src->data + wanted[i] * src->row_bytes, taps, rows[i].data());
+        row_y[i] = wanted[i];
+      }
+    }
+    blend_rows_vertically(rows[0].data(), rows[1].data(), weight, channels,
+                          scaled->data + y * scaled->row_bytes);
+  }
+  return scaled;
 }
 
-static float blerp(float c00, float c10, float c01, float c11, float tx, float ty) {
-  return lerp(lerp(c00, c10, tx), lerp(c01, c11, tx), ty);
+// The UIs scale the same images again whenever they get set up; keep the last few results, keyed
+// by the source pixels (the source may well have been freed and reloaded), its size and the
+// scale factors.
+static constexpr size_t kMaxScaledSurfaces = 8;
+
+using ScaledSurfaceKey = std::tuple<uint64_t, int, int, float, float>;
+static std::map<ScaledSurfaceKey, std::unique_ptr<GRSurface, decltype(&free)>> scaled_surfaces;
+static std::mutex scaled_surfaces_mutex;
+
+static uint64_t hash_surface(const GRSurface* surface) {
+  // FNV-1a, a word at a time.
+  uint64_t hash = 14695981039346656037ULL;
+  for (int y = 0; y < surface->height; ++y) {
+    const uint8_t* row = surface->data + y * surface->row_bytes;
+    size_t length = surface->width * surface->pixel_bytes;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+      uint64_t word;
+      memcpy(&word, row + i, sizeof(word));
+      hash = (hash ^ word) * 1099511628211ULL;
+    }
+    for (; i < length; ++i) {
+      hash = (hash ^ row[i]) * 1099511628211ULL;
+    }
+  }
+  return hash;
 }
 
-static uint8_t getbyte(uint32_t value, int n) {
-  return (value >> (n * 8)) & 0xff;
+static GRSurface* copy_surface(const GRSurface* surface) {
+  size_t size = surface->row_bytes * surface->height;
+  GRSurface* copy = malloc_surface(size);
+  if (copy == nullptr) return nullptr;
+  copy->width = surface->width;
+  copy->height = surface->height;
+  copy->row_bytes = surface->row_bytes;
+  copy->pixel_bytes = surface->pixel_bytes;
+  memcpy(copy->data, surface->data, size);
+  return copy;
 }
 
 int res_create_scaled_surface(GRSurface** dst, GRSurface* src, float scalex, float scaley) {
   int new_w = (int)src->width * scalex;
   int new_h = (int)src->height * scaley;
-  GRSurface* scaled = init_display_surface(new_w, new_h);
-  if (scaled == NULL) {
+  if (new_w <= 0 || new_h <= 0 || src->pixel_bytes != 4) {
     return -8;  // Same as res_create_display_surface()
   }
 
-  int x, y;
-  for (y = 0; y < new_h; ++y) {
-    for (x = 0; x < new_w; ++x) {
-      float gx = x / (float)new_w * (src->width - 1);
-      float gy = y / (float)new_h * (src->height - 1);
-      int gxi = (int)gx;
-      int gyi = (int)gy;
-      uint32_t result = 0;
-      uint32_t c00 = getpixel(src, gxi, gyi);
-      uint32_t c10 = getpixel(src, gxi + 1, gyi);
-      uint32_t c01 = getpixel(src, gxi, gyi + 1);
-      uint32_t c11 = getpixel(src, gxi + 1, gyi + 1);
-      int i;
-      for (i = 0; i < 3; ++i) {
-        result |= (uint8_t)blerp(getbyte(c00, i), getbyte(c10, i), getbyte(c01, i), getbyte(c11, i),
-                                 gx - gxi, gy - gyi)
-                  << (8 * i);
+  ScaledSurfaceKey key(hash_surface(src), src->width, src->height, scalex, scaley);
+  {
+    std::lock_guard<std::mutex> lock(scaled_surfaces_mutex);
+    auto it = scaled_surfaces.find(key);
+    if (it != scaled_surfaces.end()) {
+      GRSurface* copy = copy_surface(it->second.get());
+      if (copy == nullptr) {
+        return -8;
       }
-      putpixel(scaled, x, y, result);
+      *dst = copy;
+      return 0;
     }
   }
 
+  GRSurface* scaled = scale_surface(src, new_w, new_h);
+  if (scaled == NULL) {
+    return -8;  // Same as res_create_display_surface()
+  }
+
+  // The caller owns (and frees) what we return, so the cache holds a copy of its own.
+  GRSurface* cached = copy_surface(scaled);
+  if (cached != nullptr) {
+    std::lock_guard<std::mutex> lock(scaled_surfaces_mutex);
+    if (scaled_surfaces.size() >= kMaxScaledSurfaces) {
+      scaled_surfaces.clear();
+    }
+    scaled_surfaces.emplace(key, std::unique_ptr<GRSurface, decltype(&free)>(cached, free));
+  }
+
   *dst = scaled;
   return 0;
 }
 
+// Whether the pixels [x1, x2) of row y are the same in both display surfaces.
+static bool same_pixels(const GRSurface* a, const GRSurface* b, int y, int x1, int x2) {
+  return memcmp(a->data + y * a->row_bytes + x1 * 4, b->data + y * b->row_bytes + x1 * 4,
+                (x2 - x1) * 4) == 0;
+}
+
+int res_create_delta_surface(GRSurface** delta, int* x, int* y, const GRSurface* previous,
+                             const GRSurface* frame) {
+  *delta = nullptr;
+  *x = 0;
+  *y = 0;
+  if (frame->pixel_bytes != 4 ||
+      (previous != nullptr &&
+       (previous->pixel_bytes != 4 || previous->width != frame->width ||
+        previous->height != frame->height))) {
+    return -1;
+  }
+
+  // The bounding box of the pixels that differ: the rows first, and then the columns within them.
+  int x1 = 0, y1 = 0, x2 = frame->width, y2 = frame->height;
+  if (previous != nullptr) {
+    while (y1 < y2 && same_pixels(previous, frame, y1, 0, frame->width)) ++y1;
+    while (y2 > y1 && same_pixels(previous, frame, y2 - 1, 0, frame->width)) --y2;
+    if (y1 == y2) {
+      return 0;
+    }
+    x1 = frame->width;
+    x2 = 0;
+    for (int row = y1; row < y2; ++row) {
+      const uint32_t* a = reinterpret_cast<const uint32_t*>(previous->data +
+                                                            row * previous->row_bytes);
+      const uint32_t* b = reinterpret_cast<const uint32_t*>(frame->data + row * frame->row_bytes);
+      int left = 0;
+      while (left < x1 && a[left] == b[left]) ++left;
+      x1 = left;
+      int right = frame->width;
+      while (right > x2 && a[right - 1] == b[right - 1]) --right;
+      x2 = right;
+    }
+  }
+
+  GRSurface* surface = init_display_surface(x2 - x1, y2 - y1);
+  if (surface == nullptr) {
+    return -8;
+  }
+  for (int row = y1; row < y2; ++row) {
+    memcpy(surface->data + (row - y1) * surface->row_bytes,
+           frame->data + row * frame->row_bytes + x1 * 4, surface->row_bytes);
+  }
+  *delta = surface;
+  *x = x1;
+  *y = y1;
+  return 0;
+}
+
+void res_apply_delta_surface(GRSurface* target, const GRSurface* delta, int x, int y) {
+  for (int row = 0; row < delta->height; ++row) {
+    memcpy(target->data + (y + row) * target->row_bytes + x * 4,
+           delta->data + row * delta->row_bytes, delta->width * 4);
+  }
+}
+
 void res_free_surface(GRSurface* surface) {
   free(surface);
 }
+
+// Splits the localized image |name| into one alpha surface per locale, in the order of the PNG.
+static int split_localized_png(const std::string& name, std::vector<SurfacePackEntry>* entries,
+                               std::vector<GRSurface*>* surfaces) {
+  PngHandler png_handler(name);
+  if (!png_handler) return png_handler.error_code();
+  if (png_handler.channels() != 1) {
+    return -7;
+  }
+
+  png_uint_32 width = png_handler.width();
+  png_uint_32 height = png_handler.height();
+  std::vector<unsigned char> row(width);
+  for (png_uint_32 y = 0; y < height; ++y) {
+    png_read_row(png_handler.png_ptr(), row.data(), nullptr);
+    png_uint_32 w = (row[1] << 8) | row[0];
+    png_uint_32 h = (row[3] << 8) | row[2];
+    std::string loc(reinterpret_cast<char*>(&row[5]), strnlen(reinterpret_cast<char*>(&row[5]),
+                                                               width > 5 ? width - 5 : 0));
+    if (w > width || h > height - y - 1 || loc.size() >= sizeof(SurfacePackEntry::locale)) {
+      printf("%s: bad localized part at row %u\n", name.c_str(), y);
+      return -7;
+    }
+    GRSurface* surface = malloc_surface(w * h);
+    if (surface == nullptr) {
+      return -8;
+    }
+    surface->width = w;
+    surface->height = h;
+    surface->row_bytes = w;
+    surface->pixel_bytes = 1;
+    for (png_uint_32 i = 0; i < h; ++i, ++y) {
+      png_read_row(png_handler.png_ptr(), row.data(), nullptr);
+      memcpy(surface->data + i * w, row.data(), w);
+    }
+
+    SurfacePackEntry entry = {};
+    strncpy(entry.name, name.c_str(), sizeof(entry.name) - 1);
+    strncpy(entry.locale, loc.c_str(), sizeof(entry.locale) - 1);
+    entry.kind = SURFACE_PACK_LOCALIZED;
+    entry.width = w;
+    entry.height = h;
+    entry.row_bytes = w;
+    entry.pixel_bytes = 1;
+    entries->push_back(entry);
+    surfaces->push_back(surface);
+  }
+  return 0;
+}
+
+int res_write_surfaces_pack(const std::string& path, const std::vector<std::string>& names,
+                            const std::vector<std::string>& localized_names) {
+  std::vector<SurfacePackEntry> entries;
+  std::vector<GRSurface*> surfaces;
+  int result = 0;
+  for (const auto& name : localized_names) {
+    if (name.size() >= sizeof(SurfacePackEntry::name)) {
+      printf("%s: name too long\n", name.c_str());
+      result = -1;
+      break;
+    }
+    result = split_localized_png(name, &entries, &surfaces);
+    if (result != 0) {
+      printf("%s: failed to split (%d)\n", name.c_str(), result);
+      break;
+    }
+  }
+  for (size_t i = 0; result == 0 && i < names.size(); ++i) {
+    const std::string& name = names[i];
+    if (name.size() >= sizeof(SurfacePackEntry::name)) {
+      printf("%s: name too long\n", name.c_str());
+      result = -1;
+      break;
+    }
+    // Grayscale images are used as alpha masks, the others get drawn as they are.
+    uint32_t kind;
+    {
+      PngHandler png_handler(name);
+      if (!png_handler) {
+        result = png_handler.error_code();
+        break;
+      }
+      kind = png_handler.channels() == 1 ? SURFACE_PACK_ALPHA : SURFACE_PACK_DISPLAY;
+    }
+    GRSurface* surface;
+    result = kind == SURFACE_PACK_ALPHA ? res_create_alpha_surface(name.c_str(), &surface)
+                                        : res_create_display_surface(name.c_str(), &surface);
+    if (result != 0) {
+      printf("%s: failed to decode (%d)\n", name.c_str(), result);
+      break;
+    }
+    SurfacePackEntry entry = {};
+    strncpy(entry.name, name.c_str(), sizeof(entry.name) - 1);
+    entry.kind = kind;
+    entry.width = surface->width;
+    entry.height = surface->height;
+    entry.row_bytes = surface->row_bytes;
+    entry.pixel_bytes = surface->pixel_bytes;
+    entries.push_back(entry);
+    surfaces.push_back(surface);
+  }
+
+  if (result == 0) {
+    SurfacePackHeader header = {};
+    memcpy(header.magic, SURFACE_PACK_MAGIC, sizeof(header.magic));
+    header.format = SURFACE_PACK_FORMAT;
+    header.count = entries.size();
+    uint64_t offset = sizeof(header) + entries.size() * sizeof(SurfacePackEntry);
+    std::string data;
+    for (size_t i = 0; i < entries.size(); ++i) {
+      entries[i].offset = offset + data.size();
+      data.append(reinterpret_cast<const char*>(surfaces[i]->data),
+                  static_cast<size_t>(surfaces[i]->row_bytes) * surfaces[i]->height);
+    }
+    std::string content(reinterpret_cast<const char*>(&header), sizeof(header));
+    content.append(reinterpret_cast<const char*>(entries.data()),
+                   entries.size() * sizeof(SurfacePackEntry));
+    content += data;
+    if (!android::base::WriteStringToFile(content, path)) {
+      printf("failed to write %s: %s\n", path.c_str(), strerror(errno));
+      result = -1;
+    }
+  }
+
+  for (GRSurface* surface : surfaces) {
+    res_free_surface(surface);
+  }
+  return result;
+}
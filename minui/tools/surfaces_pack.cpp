@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Decodes the PNG images of a res-*/images directory into the surfaces pack that minui loads
+// instead of them, i.e. "minui_surfaces_pack <images dir> <output>".
+
+#include <dirent.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <android-base/strings.h>
+
+#include "minui/minui.h"
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s <images dir> <output>\n", argv[0]);
+    return 2;
+  }
+
+  std::unique_ptr<DIR, decltype(&closedir)> dir(opendir(argv[1]), closedir);
+  if (!dir) {
+    fprintf(stderr, "failed to open %s\n", argv[1]);
+    return 1;
+  }
+  std::vector<std::string> names;
+  std::vector<std::string> localized_names;
+  dirent* de;
+  while ((de = readdir(dir.get())) != nullptr) {
+    std::string name = de->d_name;
+    if (!android::base::EndsWith(name, ".png")) {
+      continue;
+    }
+    name.resize(name.size() - 4);
+    // The localized images hold one part per locale, which get stored separately.
+    if (android::base::EndsWith(name, "_text")) {
+      localized_names.push_back(name);
+    } else {
+      names.push_back(name);
+    }
+  }
+  // Keep the output reproducible.
+  std::sort(names.begin(), names.end());
+  std::sort(localized_names.begin(), localized_names.end());
+
+  res_set_resource_dir(argv[1]);
+  if (res_write_surfaces_pack(argv[2], names, localized_names) != 0) {
+    fprintf(stderr, "failed to write %s\n", argv[2]);
+    return 1;
+  }
+  return 0;
+}
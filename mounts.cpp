@@ -20,10 +20,12 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <mntent.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mount.h>
+#include <unistd.h>
 
 #include <string>
 #include <vector>
@@ -39,7 +41,33 @@ struct MountedVolume {
 
 std::vector<MountedVolume*> g_mounts_state;
 
+// Whether g_mounts_state still matches the mount table. The kernel flags an open mount table file
+// with POLLPRI whenever the table changes, so rescanning can be skipped until then.
+static bool g_mounts_valid = false;
+static int g_mounts_poll_fd = -1;
+
+static bool mounts_changed() {
+    if (g_mounts_poll_fd == -1) {
+        g_mounts_poll_fd = open("/proc/self/mounts", O_RDONLY | O_CLOEXEC);
+        if (g_mounts_poll_fd == -1) {
+            return true;
+        }
+        // Consume the initial state; the scan that follows reads it.
+        pollfd pfd = { g_mounts_poll_fd, POLLPRI, 0 };
+        poll(&pfd, 1, 0);
+        return true;
+    }
+    pollfd pfd = { g_mounts_poll_fd, POLLPRI, 0 };
+    int ret = TEMP_FAILURE_RETRY(poll(&pfd, 1, 0));
+    return ret != 0 || !g_mounts_valid;
+}
+
 bool scan_mounted_volumes() {
+    if (!mounts_changed()) {
+        return true;
+    }
+    g_mounts_valid = false;
+
     for (size_t i = 0; i < g_mounts_state.size(); ++i) {
         delete g_mounts_state[i];
     }
@@ -60,6 +88,7 @@ bool scan_mounted_volumes() {
         g_mounts_state.push_back(v);
     }
     endmntent(fp);
+    g_mounts_valid = true;
     return true;
 }
 
@@ -78,6 +107,8 @@ int unmount_mounted_volume(MountedVolume* volume) {
   int result = umount(mount_point.c_str());
   if (result == -1) {
     PLOG(WARNING) << "Failed to umount " << mount_point;
+    // It's still mounted, whatever the entry says now.
+    g_mounts_valid = false;
   }
   return result;
 }
@@ -90,6 +121,7 @@ int unmount_mounted_volume_detach(MountedVolume* volume) {
   int result = umount2(mount_point.c_str(), MNT_DETACH);
   if (result == -1) {
     PLOG(WARNING) << "Failed to umount " << mount_point;
+    g_mounts_valid = false;
   }
   return result;
 }
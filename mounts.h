@@ -20,6 +20,7 @@
 
 struct MountedVolume;
 
+// Reads the mount table, unless it hasn't changed since the last call.
 bool scan_mounted_volumes();
 
 MountedVolume* find_mounted_volume_by_mount_point(const char* mount_point);
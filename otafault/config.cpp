@@ -17,6 +17,7 @@
 #include "otafault/config.h"
 
 #include <map>
+#include <mutex>
 #include <string>
 
 #include <android-base/stringprintf.h>
@@ -28,6 +29,7 @@
 
 static ZipArchiveHandle archive;
 static bool is_retry = false;
+static std::mutex should_inject_mutex;
 static std::map<std::string, bool> should_inject_cache;
 
 static std::string get_type_path(const char* io_type) {
@@ -43,10 +45,11 @@ void ota_io_init(ZipArchiveHandle za, bool retry) {
 bool should_fault_inject(const char* io_type) {
     // archive will be NULL if we used an entry point other
     // than updater/updater.cpp:main
-    if (archive == nullptr || is_retry) {
+    if (!kOtaFaultInjection || archive == nullptr || is_retry) {
         return false;
     }
     const std::string type_path = get_type_path(io_type);
+    std::lock_guard<std::mutex> lock(should_inject_mutex);
     if (should_inject_cache.find(type_path) != should_inject_cache.end()) {
         return should_inject_cache[type_path];
     }
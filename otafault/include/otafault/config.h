@@ -47,6 +47,17 @@
 #define OTAIO_FSYNC "FSYNC"
 #define OTAIO_CACHE "CACHE"
 
+/*
+ * Builds that define OTAFAULT_DISABLED never inject faults, whatever the
+ * package asks for, and the ota_* wrappers reduce to the plain calls (plus
+ * the I/O accounting, if it's enabled).
+ */
+#ifdef OTAFAULT_DISABLED
+constexpr bool kOtaFaultInjection = false;
+#else
+constexpr bool kOtaFaultInjection = true;
+#endif
+
 /*
  * Initialize libotafault by providing a reference to the OTA package.
  */
@@ -24,10 +24,14 @@
 #define _UPDATER_OTA_IO_H_
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/stat.h>  // mode_t
+#include <sys/types.h>  // off64_t
 
 #include <memory>
+#include <string>
+#include <vector>
 
 #include <android-base/unique_fd.h>
 
@@ -49,6 +53,10 @@ size_t ota_fwrite(const void* ptr, size_t size, size_t count, FILE* stream);
 
 ssize_t ota_write(int fd, const void* buf, size_t nbyte);
 
+ssize_t ota_pread(int fd, void* buf, size_t nbyte, off64_t offset);
+
+ssize_t ota_pwrite(int fd, const void* buf, size_t nbyte, off64_t offset);
+
 int ota_fsync(int fd);
 
 struct OtaCloser {
@@ -67,4 +75,39 @@ using unique_file = std::unique_ptr<FILE, OtaFcloser>;
 
 int ota_fclose(unique_file& fh);
 
+// I/O accounting. Once enabled, the wrappers above count the calls, bytes and latencies of the
+// reads (including pread), writes (including pwrite) and fsyncs, per file that was opened with
+// ota_open() or ota_fopen(). I/O on any other fd is counted under "(untracked)".
+enum OtaIoOp {
+  OTAIO_OP_READ,
+  OTAIO_OP_WRITE,
+  OTAIO_OP_FSYNC,
+  OTAIO_OP_COUNT,
+};
+
+// latency_us[i] counts the calls that took less than 2^i us (and at least 2^(i-1) us); the last
+// bucket takes everything longer.
+constexpr size_t kOtaIoLatencyBuckets = 24;
+
+struct OtaIoOpStats {
+  uint64_t calls = 0;
+  uint64_t bytes = 0;
+  uint64_t total_us = 0;
+  uint64_t latency_us[kOtaIoLatencyBuckets] = {};
+
+  // Returns the upper bound of the bucket that holds the given percentile (0-100) of the calls.
+  uint64_t LatencyPercentileUs(double percentile) const;
+};
+
+struct OtaIoFileStats {
+  std::string path;
+  OtaIoOpStats ops[OTAIO_OP_COUNT];
+};
+
+// Files opened before the accounting is enabled are counted as untracked.
+void ota_io_enable_stats();
+
+// Returns the counters of every file with any I/O so far, open or closed, sorted by path.
+std::vector<OtaIoFileStats> ota_io_stats();
+
 #endif
@@ -20,70 +20,271 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <chrono>
 #include <map>
 #include <mutex>
 #include <string>
+#include <unordered_set>
 
 #include <android-base/thread_annotations.h>
 
 #include "otafault/config.h"
 
-static std::mutex filename_mutex;
-static std::map<intptr_t, const char*> filename_cache GUARDED_BY(filename_mutex);
-static std::string read_fault_file_name = "";
-static std::string write_fault_file_name = "";
-static std::string fsync_fault_file_name = "";
+// The paths given to ota_open() and ota_fopen(), indexed by fd, to tell which file an I/O is on
+// when injecting faults. The slots are atomic so that the wrappers never take a lock; higher fds
+// aren't tracked and never get faults.
+static constexpr size_t kMaxTrackedFds = 1024;
+static std::atomic<const char*> fd_paths[kMaxTrackedFds];
+
+// The file to fail the I/O on, set up once by ota_set_fault_files(). |armed| is cleared by the
+// first fault, which is all that gets injected (unless it's the cache file being hit).
+struct FaultTarget {
+    std::atomic<bool> armed{ false };
+    std::string fname;
+};
+
+static FaultTarget read_fault;
+static FaultTarget write_fault;
+static FaultTarget fsync_fault;
+static bool hit_cache = false;
+
+// The counters of the files that are open, per fd like their paths, and of the untracked fds.
+struct LiveOpStats {
+    std::atomic<uint64_t> calls{ 0 };
+    std::atomic<uint64_t> bytes{ 0 };
+    std::atomic<uint64_t> total_us{ 0 };
+    std::atomic<uint64_t> latency_us[kOtaIoLatencyBuckets] = {};
+};
+
+static std::atomic<bool> stats_enabled{ false };
+static LiveOpStats fd_stats[kMaxTrackedFds][OTAIO_OP_COUNT];
+static LiveOpStats untracked_stats[OTAIO_OP_COUNT];
+
+static std::mutex stats_mutex;
+// The accounted files keep a copy of their path here, as the callers' strings may not outlive the
+// fd.
+static std::unordered_set<std::string> stats_paths GUARDED_BY(stats_mutex);
+// The counters of the files that have been closed.
+static std::map<std::string, OtaIoFileStats> closed_stats GUARDED_BY(stats_mutex);
+
+static const char* intern_path(const char* path) {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    return stats_paths.emplace(path).first->c_str();
+}
+
+static void add_stats(OtaIoOpStats* total, const LiveOpStats& live) {
+    total->calls += live.calls.load(std::memory_order_relaxed);
+    total->bytes += live.bytes.load(std::memory_order_relaxed);
+    total->total_us += live.total_us.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < kOtaIoLatencyBuckets; ++i) {
+        total->latency_us[i] += live.latency_us[i].load(std::memory_order_relaxed);
+    }
+}
+
+static void clear_stats(LiveOpStats* live) {
+    live->calls.store(0, std::memory_order_relaxed);
+    live->bytes.store(0, std::memory_order_relaxed);
+    live->total_us.store(0, std::memory_order_relaxed);
+    for (auto& bucket : live->latency_us) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+}
+
+static void track_fd(int fd, const char* path) {
+    if (fd < 0 || static_cast<size_t>(fd) >= kMaxTrackedFds) {
+        return;
+    }
+    if (stats_enabled.load(std::memory_order_relaxed)) {
+        if (path != nullptr) {
+            path = intern_path(path);
+        } else {
+            // Closing: keep the counters of the file before its fd gets reused.
+            const char* cached_path = fd_paths[fd].load(std::memory_order_acquire);
+            LiveOpStats* live = fd_stats[fd];
+            if (cached_path != nullptr &&
+                (live[OTAIO_OP_READ].calls || live[OTAIO_OP_WRITE].calls ||
+                 live[OTAIO_OP_FSYNC].calls)) {
+                std::lock_guard<std::mutex> lock(stats_mutex);
+                OtaIoFileStats& total = closed_stats[cached_path];
+                for (size_t op = 0; op < OTAIO_OP_COUNT; ++op) {
+                    add_stats(&total.ops[op], live[op]);
+                    clear_stats(&live[op]);
+                }
+            }
+        }
+    } else if (!kOtaFaultInjection) {
+        return;
+    }
+    fd_paths[fd].store(path, std::memory_order_release);
+}
+
+using io_clock = std::chrono::steady_clock;
+
+// Returns the start time of an I/O to account, or the epoch if the accounting is off.
+static io_clock::time_point io_start() {
+    return stats_enabled.load(std::memory_order_relaxed) ? io_clock::now() : io_clock::time_point();
+}
+
+static void account_io(int fd, OtaIoOp op, io_clock::time_point start, uint64_t bytes) {
+    if (start == io_clock::time_point()) {
+        return;
+    }
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(io_clock::now() - start)
+                      .count();
+    LiveOpStats* live = &untracked_stats[op];
+    if (fd >= 0 && static_cast<size_t>(fd) < kMaxTrackedFds &&
+        fd_paths[fd].load(std::memory_order_relaxed) != nullptr) {
+        live = &fd_stats[fd][op];
+    }
+    size_t bucket = 0;
+    while (bucket + 1 < kOtaIoLatencyBuckets && (us >> bucket) != 0) {
+        ++bucket;
+    }
+    live->calls.fetch_add(1, std::memory_order_relaxed);
+    live->bytes.fetch_add(bytes, std::memory_order_relaxed);
+    live->total_us.fetch_add(us, std::memory_order_relaxed);
+    live->latency_us[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+static void account_io(FILE* stream, OtaIoOp op, io_clock::time_point start, uint64_t bytes) {
+    if (start != io_clock::time_point()) {
+        account_io(fileno(stream), op, start, bytes);
+    }
+}
+
+void ota_io_enable_stats() {
+    stats_enabled = true;
+}
+
+uint64_t OtaIoOpStats::LatencyPercentileUs(double percentile) const {
+    if (calls == 0) {
+        return 0;
+    }
+    uint64_t count = 0;
+    for (size_t i = 0; i < kOtaIoLatencyBuckets; ++i) {
+        count += latency_us[i];
+        if (count > 0 && count * 100.0 >= calls * percentile) {
+            return uint64_t{ 1 } << i;
+        }
+    }
+    return uint64_t{ 1 } << (kOtaIoLatencyBuckets - 1);
+}
+
+std::vector<OtaIoFileStats> ota_io_stats() {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    std::map<std::string, OtaIoFileStats> all = closed_stats;
+    for (size_t fd = 0; fd < kMaxTrackedFds; ++fd) {
+        const char* path = fd_paths[fd].load(std::memory_order_acquire);
+        if (path == nullptr) {
+            continue;
+        }
+        OtaIoFileStats& total = all[path];
+        for (size_t op = 0; op < OTAIO_OP_COUNT; ++op) {
+            add_stats(&total.ops[op], fd_stats[fd][op]);
+        }
+    }
+    OtaIoFileStats untracked;
+    for (size_t op = 0; op < OTAIO_OP_COUNT; ++op) {
+        add_stats(&untracked.ops[op], untracked_stats[op]);
+    }
+    all["(untracked)"] = untracked;
+
+    std::vector<OtaIoFileStats> result;
+    for (auto& entry : all) {
+        const OtaIoOpStats* ops = entry.second.ops;
+        if (ops[OTAIO_OP_READ].calls == 0 && ops[OTAIO_OP_WRITE].calls == 0 &&
+            ops[OTAIO_OP_FSYNC].calls == 0) {
+            continue;
+        }
+        entry.second.path = entry.first;
+        result.push_back(entry.second);
+    }
+    return result;
+}
 
 static bool get_hit_file(const char* cached_path, const std::string& ffn) {
-    return should_hit_cache()
+    return hit_cache
         ? !strncmp(cached_path, OTAIO_CACHE_FNAME, strlen(cached_path))
         : !strncmp(cached_path, ffn.c_str(), strlen(cached_path));
 }
 
 void ota_set_fault_files() {
+    if (!kOtaFaultInjection) {
+        return;
+    }
+    hit_cache = should_hit_cache();
     if (should_fault_inject(OTAIO_READ)) {
-        read_fault_file_name = fault_fname(OTAIO_READ);
+        read_fault.fname = fault_fname(OTAIO_READ);
+        read_fault.armed = true;
     }
     if (should_fault_inject(OTAIO_WRITE)) {
-        write_fault_file_name = fault_fname(OTAIO_WRITE);
+        write_fault.fname = fault_fname(OTAIO_WRITE);
+        write_fault.armed = true;
     }
     if (should_fault_inject(OTAIO_FSYNC)) {
-        fsync_fault_file_name = fault_fname(OTAIO_FSYNC);
+        fsync_fault.fname = fault_fname(OTAIO_FSYNC);
+        fsync_fault.armed = true;
     }
 }
 
 bool have_eio_error = false;
 
+// Returns true, with errno set to EIO, if the I/O on |fd| should fail.
+static bool inject_fault(FaultTarget* fault, int fd) {
+    if (!kOtaFaultInjection || !fault->armed.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    if (fd < 0 || static_cast<size_t>(fd) >= kMaxTrackedFds) {
+        return false;
+    }
+    const char* cached_path = fd_paths[fd].load(std::memory_order_acquire);
+    if (cached_path == nullptr || !get_hit_file(cached_path, fault->fname)) {
+        return false;
+    }
+    if (!hit_cache && !fault->armed.exchange(false)) {
+        return false;
+    }
+    errno = EIO;
+    have_eio_error = true;
+    return true;
+}
+
+static bool inject_fault(FaultTarget* fault, FILE* stream) {
+    // fileno() takes the stream lock, so skip it unless there's a fault to inject.
+    return kOtaFaultInjection && fault->armed.load(std::memory_order_relaxed) &&
+           inject_fault(fault, fileno(stream));
+}
+
 int ota_open(const char* path, int oflags) {
     // Let the caller handle errors; we do not care if open succeeds or fails
     int fd = open(path, oflags);
-    std::lock_guard<std::mutex> lock(filename_mutex);
-    filename_cache[fd] = path;
+    track_fd(fd, path);
     return fd;
 }
 
 int ota_open(const char* path, int oflags, mode_t mode) {
     int fd = open(path, oflags, mode);
-    std::lock_guard<std::mutex> lock(filename_mutex);
-    filename_cache[fd] = path;
+    track_fd(fd, path);
     return fd;
 }
 
 FILE* ota_fopen(const char* path, const char* mode) {
     FILE* fh = fopen(path, mode);
-    std::lock_guard<std::mutex> lock(filename_mutex);
-    filename_cache[(intptr_t)fh] = path;
+    if (fh != nullptr) {
+        track_fd(fileno(fh), path);
+    }
     return fh;
 }
 
 static int __ota_close(int fd) {
     // descriptors can be reused, so make sure not to leave them in the cache
-    std::lock_guard<std::mutex> lock(filename_mutex);
-    filename_cache.erase(fd);
+    track_fd(fd, nullptr);
     return close(fd);
 }
 
@@ -96,8 +297,9 @@ int ota_close(unique_fd& fd) {
 }
 
 static int __ota_fclose(FILE* fh) {
-    std::lock_guard<std::mutex> lock(filename_mutex);
-    filename_cache.erase(reinterpret_cast<intptr_t>(fh));
+    if (fh != nullptr) {
+        track_fd(fileno(fh), nullptr);
+    }
     return fclose(fh);
 }
 
@@ -110,19 +312,12 @@ int ota_fclose(unique_file& fh) {
 }
 
 size_t ota_fread(void* ptr, size_t size, size_t nitems, FILE* stream) {
-    if (should_fault_inject(OTAIO_READ)) {
-        std::lock_guard<std::mutex> lock(filename_mutex);
-        auto cached = filename_cache.find((intptr_t)stream);
-        const char* cached_path = cached->second;
-        if (cached != filename_cache.end() &&
-                get_hit_file(cached_path, read_fault_file_name)) {
-            read_fault_file_name = "";
-            errno = EIO;
-            have_eio_error = true;
-            return 0;
-        }
+    if (inject_fault(&read_fault, stream)) {
+        return 0;
     }
+    io_clock::time_point start = io_start();
     size_t status = fread(ptr, size, nitems, stream);
+    account_io(stream, OTAIO_OP_READ, start, status * size);
     // If I/O error occurs, set the retry-update flag.
     if (status != nitems && errno == EIO) {
         have_eio_error = true;
@@ -131,19 +326,12 @@ size_t ota_fread(void* ptr, size_t size, size_t nitems, FILE* stream) {
 }
 
 ssize_t ota_read(int fd, void* buf, size_t nbyte) {
-    if (should_fault_inject(OTAIO_READ)) {
-        std::lock_guard<std::mutex> lock(filename_mutex);
-        auto cached = filename_cache.find(fd);
-        const char* cached_path = cached->second;
-        if (cached != filename_cache.end()
-                && get_hit_file(cached_path, read_fault_file_name)) {
-            read_fault_file_name = "";
-            errno = EIO;
-            have_eio_error = true;
-            return -1;
-        }
+    if (inject_fault(&read_fault, fd)) {
+        return -1;
     }
+    io_clock::time_point start = io_start();
     ssize_t status = read(fd, buf, nbyte);
+    account_io(fd, OTAIO_OP_READ, start, status > 0 ? status : 0);
     if (status == -1 && errno == EIO) {
         have_eio_error = true;
     }
@@ -151,19 +339,12 @@ ssize_t ota_read(int fd, void* buf, size_t nbyte) {
 }
 
 size_t ota_fwrite(const void* ptr, size_t size, size_t count, FILE* stream) {
-    if (should_fault_inject(OTAIO_WRITE)) {
-        std::lock_guard<std::mutex> lock(filename_mutex);
-        auto cached = filename_cache.find((intptr_t)stream);
-        const char* cached_path = cached->second;
-        if (cached != filename_cache.end() &&
-                get_hit_file(cached_path, write_fault_file_name)) {
-            write_fault_file_name = "";
-            errno = EIO;
-            have_eio_error = true;
-            return 0;
-        }
+    if (inject_fault(&write_fault, stream)) {
+        return 0;
     }
+    io_clock::time_point start = io_start();
     size_t status = fwrite(ptr, size, count, stream);
+    account_io(stream, OTAIO_OP_WRITE, start, status * size);
     if (status != count && errno == EIO) {
         have_eio_error = true;
     }
@@ -171,19 +352,38 @@ size_t ota_fwrite(const void* ptr, size_t size, size_t count, FILE* stream) {
 }
 
 ssize_t ota_write(int fd, const void* buf, size_t nbyte) {
-    if (should_fault_inject(OTAIO_WRITE)) {
-        std::lock_guard<std::mutex> lock(filename_mutex);
-        auto cached = filename_cache.find(fd);
-        const char* cached_path = cached->second;
-        if (cached != filename_cache.end() &&
-                get_hit_file(cached_path, write_fault_file_name)) {
-            write_fault_file_name = "";
-            errno = EIO;
-            have_eio_error = true;
-            return -1;
-        }
+    if (inject_fault(&write_fault, fd)) {
+        return -1;
     }
+    io_clock::time_point start = io_start();
     ssize_t status = write(fd, buf, nbyte);
+    account_io(fd, OTAIO_OP_WRITE, start, status > 0 ? status : 0);
+    if (status == -1 && errno == EIO) {
+        have_eio_error = true;
+    }
+    return status;
+}
+
+ssize_t ota_pread(int fd, void* buf, size_t nbyte, off64_t offset) {
+    if (inject_fault(&read_fault, fd)) {
+        return -1;
+    }
+    io_clock::time_point start = io_start();
+    ssize_t status = pread64(fd, buf, nbyte, offset);
+    account_io(fd, OTAIO_OP_READ, start, status > 0 ? status : 0);
+    if (status == -1 && errno == EIO) {
+        have_eio_error = true;
+    }
+    return status;
+}
+
+ssize_t ota_pwrite(int fd, const void* buf, size_t nbyte, off64_t offset) {
+    if (inject_fault(&write_fault, fd)) {
+        return -1;
+    }
+    io_clock::time_point start = io_start();
+    ssize_t status = pwrite64(fd, buf, nbyte, offset);
+    account_io(fd, OTAIO_OP_WRITE, start, status > 0 ? status : 0);
     if (status == -1 && errno == EIO) {
         have_eio_error = true;
     }
@@ -191,19 +391,12 @@ ssize_t ota_write(int fd, const void* buf, size_t nbyte) {
 }
 
 int ota_fsync(int fd) {
-    if (should_fault_inject(OTAIO_FSYNC)) {
-        std::lock_guard<std::mutex> lock(filename_mutex);
-        auto cached = filename_cache.find(fd);
-        const char* cached_path = cached->second;
-        if (cached != filename_cache.end() &&
-                get_hit_file(cached_path, fsync_fault_file_name)) {
-            fsync_fault_file_name = "";
-            errno = EIO;
-            have_eio_error = true;
-            return -1;
-        }
+    if (inject_fault(&fsync_fault, fd)) {
+        return -1;
     }
+    io_clock::time_point start = io_start();
     int status = fsync(fd);
+    account_io(fd, OTAIO_OP_FSYNC, start, 0);
     if (status == -1 && errno == EIO) {
         have_eio_error = true;
     }
@@ -18,16 +18,24 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <memory>
 #include <string>
+#include <vector>
 
+#include <android-base/unique_fd.h>
 #include <selinux/label.h>
 #include <selinux/selinux.h>
 
+#include "otautil/thread_pool.h"
+
 enum class DirStatus { DMISSING, DDIR, DILLEGAL };
 
 static DirStatus dir_status(const std::string& path) {
@@ -48,11 +56,53 @@ static DirStatus dir_status(const std::string& path) {
 
 int mkdir_recursively(const std::string& input_path, mode_t mode, bool strip_filename,
                       const selabel_handle* sehnd) {
-	return mkdir_recursively(input_path, mode, strip_filename, sehnd, NULL);
+  return mkdir_recursively(input_path, mode, strip_filename, sehnd, nullptr, nullptr);
+}
+
+int mkdir_recursively(const std::string& input_path, mode_t mode, bool strip_filename,
+                      const selabel_handle* sehnd, const struct utimbuf* timestamp) {
+  return mkdir_recursively(input_path, mode, strip_filename, sehnd, timestamp, nullptr);
+}
+
+// Creates the directory |name| in |dirfd|, labeled as |path| and timestamped as asked. A directory
+// that another process or thread created in the meantime is good as well.
+static int mkdir_at(int dirfd, const char* name, const std::string& path, mode_t mode,
+                    const selabel_handle* sehnd, const struct utimbuf* timestamp) {
+  char* secontext = nullptr;
+  if (sehnd) {
+    selabel_lookup(const_cast<selabel_handle*>(sehnd), &secontext, path.c_str(), mode);
+    setfscreatecon(secontext);
+  }
+  int err = mkdirat(dirfd, name, mode);
+  int saved_errno = errno;
+  if (secontext) {
+    freecon(secontext);
+    setfscreatecon(nullptr);
+  }
+  if (err != 0) {
+    struct stat sb;
+    if (saved_errno != EEXIST || fstatat(dirfd, name, &sb, 0) != 0) {
+      errno = saved_errno;
+      return -1;
+    }
+    if (!S_ISDIR(sb.st_mode)) {
+      errno = ENOTDIR;
+      return -1;
+    }
+    return 0;
+  }
+  if (timestamp != nullptr) {
+    struct timespec times[2] = { { timestamp->actime, 0 }, { timestamp->modtime, 0 } };
+    if (utimensat(dirfd, name, times, 0) != 0) {
+      return -1;
+    }
+  }
+  return 0;
 }
 
 int mkdir_recursively(const std::string& input_path, mode_t mode, bool strip_filename,
-                      const selabel_handle* sehnd, const struct utimbuf *timestamp) {
+                      const selabel_handle* sehnd, const struct utimbuf* timestamp,
+                      DirCache* cache) {
   // Check for an empty string before we bother making any syscalls.
   if (input_path.empty()) {
     errno = ENOENT;
@@ -74,96 +124,132 @@ int mkdir_recursively(const std::string& input_path, mode_t mode, bool strip_fil
     path.push_back('/');
   }
 
-  // See if it already exists.
-  DirStatus ds = dir_status(path);
-  if (ds == DirStatus::DDIR) {
+  // The ends of the components of the path, e.g. 1 and 3 for "a/b/".
+  std::vector<size_t> ends;
+  for (size_t i = 1; i < path.size(); ++i) {
+    if (path[i] == '/' && path[i - 1] != '/') {
+      ends.push_back(i);
+    }
+  }
+  if (ends.empty()) {
+    // Only the root (or slashes).
+    return dir_status(path) == DirStatus::DDIR ? 0 : -1;
+  }
+  if (cache != nullptr && cache->Contains(path.substr(0, ends.back()))) {
     return 0;
-  } else if (ds == DirStatus::DILLEGAL) {
-    return -1;
   }
 
-  // Walk up the path from the root and make each level.
-  size_t prev_end = 0;
-  while (prev_end < path.size()) {
-    size_t next_end = path.find('/', prev_end + 1);
-    if (next_end == std::string::npos) {
+  // Look for the deepest directory that exists already, starting from the path itself; usually
+  // only the last component or two are missing.
+  size_t existing = ends.size();
+  while (existing > 0) {
+    std::string dir_path = path.substr(0, ends[existing - 1]);
+    if (cache != nullptr && cache->Contains(dir_path)) {
       break;
     }
-    std::string dir_path = path.substr(0, next_end);
-    // Check this part of the path and make a new directory if necessary.
-    switch (dir_status(dir_path)) {
-      case DirStatus::DILLEGAL:
-        // Could happen if some other process/thread is messing with the filesystem.
+    DirStatus ds = dir_status(dir_path);
+    if (ds == DirStatus::DDIR) {
+      if (cache != nullptr) {
+        cache->Add(dir_path);
+      }
+      break;
+    }
+    if (ds == DirStatus::DILLEGAL) {
+      return -1;
+    }
+    existing--;
+  }
+  if (existing == ends.size()) {
+    return 0;
+  }
+
+  // Create the missing components one after the other, relative to the fd of their parent, so
+  // that the path doesn't get resolved over again for each of them.
+  size_t start = existing > 0 ? ends[existing - 1] : 0;
+  android::base::unique_fd dirfd;
+  if (existing > 0) {
+    dirfd.reset(open(path.substr(0, start).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  } else if (path[0] == '/') {
+    dirfd.reset(open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  } else {
+    dirfd.reset(open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  }
+  if (dirfd == -1) {
+    return -1;
+  }
+  for (size_t i = existing; i < ends.size(); ++i) {
+    size_t name_start = path.find_first_not_of('/', start);
+    std::string name = path.substr(name_start, ends[i] - name_start);
+    std::string dir_path = path.substr(0, ends[i]);
+    if (mkdir_at(dirfd, name.c_str(), dir_path, mode, sehnd, timestamp) != 0) {
+      return -1;
+    }
+    if (cache != nullptr) {
+      cache->Add(dir_path);
+    }
+    if (i + 1 < ends.size()) {
+      dirfd.reset(openat(dirfd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+      if (dirfd == -1) {
         return -1;
-      case DirStatus::DMISSING: {
-        char* secontext = nullptr;
-        if (sehnd) {
-          selabel_lookup(const_cast<selabel_handle*>(sehnd), &secontext, dir_path.c_str(), mode);
-          setfscreatecon(secontext);
-        }
-        int err = mkdir(dir_path.c_str(), mode);
-        if (secontext) {
-          freecon(secontext);
-          setfscreatecon(nullptr);
-        }
-        if (err != 0) {
-          return -1;
-        }
-        if (timestamp != NULL && utime(dir_path.c_str(), timestamp)) {
-          return -1;
-        }
-        break;
       }
-      default:
-        // Already exists.
-        break;
     }
-    prev_end = next_end;
+    start = ends[i];
   }
   return 0;
 }
 
-int
-dirUnlinkHierarchy(const char *path)
+// Removes |name| in the directory |parent| (or AT_FDCWD) and everything below it. Works from the
+// directory fds, so the paths aren't resolved over again for each entry.
+static int
+unlinkHierarchyAt(int parent, const char *name)
 {
     struct stat st;
+    int fd;
     DIR *dir;
     struct dirent *de;
     int fail = 0;
 
     /* is it a file or directory? */
-    if (lstat(path, &st) < 0) {
+    if (fstatat(parent, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
         return -1;
     }
 
     /* a file, so unlink it */
     if (!S_ISDIR(st.st_mode)) {
-        return unlink(path);
+        return unlinkat(parent, name, 0);
     }
 
     /* a directory, so open handle */
-    dir = opendir(path);
+    fd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    dir = fdopendir(fd);
     if (dir == NULL) {
+        int save = errno;
+        close(fd);
+        errno = save;
         return -1;
     }
 
     /* recurse over components */
     errno = 0;
     while ((de = readdir(dir)) != NULL) {
-        //TODO: don't blow the stack
-        char dn[PATH_MAX];
         if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
             continue;
         }
-        snprintf(dn, sizeof(dn), "%s/%s", path, de->d_name);
-        if (dirUnlinkHierarchy(dn) < 0) {
+        /* only the directories (or the entries of unknown type) need a closer look */
+        int ret = (de->d_type == DT_DIR || de->d_type == DT_UNKNOWN)
+                      ? unlinkHierarchyAt(fd, de->d_name)
+                      : unlinkat(fd, de->d_name, 0);
+        if (ret < 0) {
             fail = 1;
             break;
         }
         errno = 0;
     }
     /* in case readdir or unlink_recursive failed */
-    if (fail || errno < 0) {
+    if (fail || errno != 0) {
         int save = errno;
         closedir(dir);
         errno = save;
@@ -176,5 +262,122 @@ dirUnlinkHierarchy(const char *path)
     }
 
     /* delete target directory */
-    return rmdir(path);
+    return unlinkat(parent, name, AT_REMOVEDIR);
+}
+
+int
+dirUnlinkHierarchy(const char *path)
+{
+    return unlinkHierarchyAt(AT_FDCWD, path);
+}
+
+// A directory of the parallel unlink that's to be removed once the tasks below it are done.
+struct PendingDir {
+  int parent;
+  std::string name;
+  android::base::unique_fd fd;
+};
+
+// Removes the entries of the directory |fd|, at |depth| below the top of the hierarchy. The
+// subdirectories at |max_depth| are removed as tasks of |pool|, and the ones above are walked on
+// the calling thread and added to |dirs|. The first error of the tasks goes to |error|.
+
+static bool unlinkEntriesParallel(int fd, size_t depth, size_t max_depth, ThreadPool* pool,
+                                  std::vector<std::unique_ptr<PendingDir>>* dirs,
+                                  std::atomic<int>* error) {
+  int dup_fd = dup(fd);
+  if (dup_fd == -1) {
+    return false;
+  }
+  std::unique_ptr<DIR, decltype(&closedir)> dir(fdopendir(dup_fd), closedir);
+  if (!dir) {
+    close(dup_fd);
+    return false;
+  }
+  std::vector<std::string> subdirs;
+  errno = 0;
+  struct dirent* de;
+  while ((de = readdir(dir.get())) != nullptr) {
+    if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
+      continue;
+    }
+    bool is_dir = de->d_type == DT_DIR;
+    if (de->d_type == DT_UNKNOWN) {
+      struct stat st;
+      if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+        return false;
+      }
+      is_dir = S_ISDIR(st.st_mode);
+    }
+    if (is_dir) {
+      subdirs.emplace_back(de->d_name);
+    } else if (unlinkat(fd, de->d_name, 0) < 0) {
+      return false;
+    }
+    errno = 0;
+  }
+  if (errno != 0) {
+    return false;
+  }
+
+  for (const auto& name : subdirs) {
+    if (depth + 1 >= max_depth) {
+      pool->Submit([fd, name, error]() {
+        if (unlinkHierarchyAt(fd, name.c_str()) < 0) {
+          int expected = 0;
+          error->compare_exchange_strong(expected, errno ?: EIO);
+        }
+      });
+      continue;
+    }
+    std::unique_ptr<PendingDir> pending(new PendingDir{ fd, name, android::base::unique_fd() });
+    pending->fd.reset(openat(fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+    if (pending->fd == -1) {
+      return false;
+    }
+    int subdir_fd = pending->fd.get();
+    dirs->push_back(std::move(pending));
+    if (!unlinkEntriesParallel(subdir_fd, depth + 1, max_depth, pool, dirs, error)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int dirUnlinkHierarchy(const char* path, size_t jobs, size_t depth) {
+  struct stat st;
+  if (jobs <= 1 || depth == 0 || lstat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+    return dirUnlinkHierarchy(path);
+  }
+  android::base::unique_fd fd(open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+  if (fd == -1) {
+    return -1;
+  }
+
+  std::vector<std::unique_ptr<PendingDir>> dirs;
+  std::atomic<int> error(0);
+  bool walked;
+  {
+    // Joined before the directory fds go away.
+    ThreadPool pool(jobs);
+    walked = unlinkEntriesParallel(fd, 0, depth, &pool, &dirs, &error);
+    if (!walked) {
+      error.store(errno ?: EIO);
+      pool.Cancel();
+    }
+    pool.Wait();
+  }
+  if (error != 0) {
+    errno = error;
+    return -1;
+  }
+
+  // The deeper directories come later in |dirs|.
+  for (auto it = dirs.rbegin(); it != dirs.rend(); ++it) {
+    if (unlinkat((*it)->parent, (*it)->name.c_str(), AT_REMOVEDIR) < 0) {
+      return -1;
+    }
+  }
+  fd.reset();
+  return rmdir(path);
 }
@@ -18,12 +18,19 @@
 
 #include <errno.h>  // TEMP_FAILURE_RETRY
 #include <fcntl.h>
+#include <poll.h>
 #include <stdint.h>  // SIZE_MAX
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <iterator>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
@@ -31,14 +38,295 @@
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 
-bool MemMapping::MapFD(int fd) {
+#if defined(__linux__) && defined(__NR_userfaultfd) && __has_include(<linux/userfaultfd.h>)
+#include <linux/userfaultfd.h>
+#define HAVE_USERFAULTFD 1
+#endif
+
+bool AdviseMappedRange(const void* addr, size_t length, MemAccess access) {
+  if (length == 0) return true;
+  static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+  uintptr_t start = reinterpret_cast<uintptr_t>(addr) & ~(page_size - 1);
+  uintptr_t end = reinterpret_cast<uintptr_t>(addr) + length;
+
+  int advice;
+  switch (access) {
+    case MemAccess::SEQUENTIAL: advice = MADV_SEQUENTIAL; break;
+    case MemAccess::RANDOM: advice = MADV_RANDOM; break;
+    case MemAccess::WILLNEED: advice = MADV_WILLNEED; break;
+    default: advice = MADV_NORMAL; break;
+  }
+  // A block map leaves the address space past the last block reserved, but not backed by the
+  // device; ENOMEM for such holes still applies the advice to the rest. EINVAL means the advice
+  // doesn't apply to the memory (e.g. it's not a mapping of a file).
+  if (madvise(reinterpret_cast<void*>(start), end - start, advice) == -1 && errno != ENOMEM &&
+      errno != EINVAL) {
+    PLOG(WARNING) << "madvise(" << advice << ") on " << length << " bytes failed";
+    return false;
+  }
+  return true;
+}
+
+static size_t lazy_block_map_threshold = SIZE_MAX;
+
+void SetLazyBlockMapThreshold(size_t ranges) {
+  lazy_block_map_threshold = ranges;
+}
+
+// A range of the mapping [offset, offset + length), and where it's stored on the block device.
+struct BlockExtent {
+  size_t offset;
+  size_t length;
+  off64_t dev_offset;
+};
+
+// Fills the pages of a block map on demand: a thread waits for the missing-page faults on the
+// reserved address range and copies in the data from the block device, one aligned chunk around
+// the faulting page at a time.
+class LazyBlockMap {
+ public:
+  ~LazyBlockMap();
+
+  // Returns nullptr if userfaultfd isn't available, in which case the ranges should be mapped
+  // directly.
+  static std::unique_ptr<LazyBlockMap> Create(void* addr, size_t length, int block_fd,
+                                              const std::vector<BlockExtent>& extents);
+
+ private:
+  LazyBlockMap() = default;
+
+  void Serve();
+  // Copies in the chunk with the page at |fault|.
+  void Fill(uintptr_t fault);
+  // Copies in all the pages that are still missing, once the faults can't be waited for any
+  // more, so that no access is left blocked on a fault that nobody serves. Aborts if even that
+  // fails.
+  void FillRemaining();
+  // Reads [offset, offset + size) of the mapping from the block device into |buffer|.
+  bool Read(size_t offset, size_t size, uint8_t* buffer);
+
+  // Bytes read in for each fault, to not take a fault for every page in sequential reads.
+  static constexpr size_t kChunkSize = 64 * 1024;
+
+  uintptr_t base_ = 0;
+  size_t length_ = 0;
+  android::base::unique_fd uffd_;
+  android::base::unique_fd block_fd_;
+  // Written to stop the thread.
+  android::base::unique_fd wake_read_;
+  android::base::unique_fd wake_write_;
+  std::vector<BlockExtent> extents_;
+  std::vector<uint8_t> buffer_;
+  std::thread thread_;
+};
+
+#ifdef HAVE_USERFAULTFD
+
+std::unique_ptr<LazyBlockMap> LazyBlockMap::Create(void* addr, size_t length, int block_fd,
+                                                   const std::vector<BlockExtent>& extents) {
+  android::base::unique_fd uffd(
+      static_cast<int>(syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK)));
+  if (uffd == -1) {
+    PLOG(INFO) << "userfaultfd is unavailable";
+    return nullptr;
+  }
+  uffdio_api api = {};
+  api.api = UFFD_API;
+  if (ioctl(uffd, UFFDIO_API, &api) == -1) {
+    PLOG(WARNING) << "UFFDIO_API failed";
+    return nullptr;
+  }
+  uffdio_register reg = {};
+  reg.range.start = reinterpret_cast<uintptr_t>(addr);
+  reg.range.len = length;
+  reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+  if (ioctl(uffd, UFFDIO_REGISTER, &reg) == -1) {
+    PLOG(WARNING) << "UFFDIO_REGISTER failed";
+    return nullptr;
+  }
+  int wake[2];
+  if (pipe2(wake, O_CLOEXEC) == -1) {
+    PLOG(WARNING) << "pipe2 failed";
+    return nullptr;
+  }
+
+  std::unique_ptr<LazyBlockMap> lazy(new LazyBlockMap());
+  lazy->base_ = reinterpret_cast<uintptr_t>(addr);
+  lazy->length_ = length;
+  lazy->uffd_ = std::move(uffd);
+  lazy->block_fd_.reset(dup(block_fd));
+  lazy->wake_read_.reset(wake[0]);
+  lazy->wake_write_.reset(wake[1]);
+  lazy->extents_ = extents;
+  lazy->buffer_.resize(kChunkSize);
+  if (lazy->block_fd_ == -1) {
+    PLOG(WARNING) << "dup failed";
+    return nullptr;
+  }
+  lazy->thread_ = std::thread(&LazyBlockMap::Serve, lazy.get());
+  return lazy;
+}
+
+void LazyBlockMap::Serve() {
+  while (true) {
+    pollfd fds[2] = { { uffd_.get(), POLLIN, 0 }, { wake_read_.get(), POLLIN, 0 } };
+    if (TEMP_FAILURE_RETRY(poll(fds, 2, -1)) == -1) {
+      PLOG(ERROR) << "poll on userfaultfd failed";
+      FillRemaining();
+      return;
+    }
+    if (fds[1].revents != 0) {
+      return;
+    }
+    uffd_msg msg;
+    ssize_t n = TEMP_FAILURE_RETRY(read(uffd_.get(), &msg, sizeof(msg)));
+    if (n == -1 && errno == EAGAIN) {
+      continue;
+    }
+    if (n != static_cast<ssize_t>(sizeof(msg))) {
+      PLOG(ERROR) << "read on userfaultfd failed";
+      FillRemaining();
+      return;
+    }
+    if (msg.event == UFFD_EVENT_PAGEFAULT) {
+      Fill(msg.arg.pagefault.address);
+    }
+  }
+}
+
+void LazyBlockMap::Fill(uintptr_t fault) {
+  size_t offset = (fault - base_) & ~(kChunkSize - 1);
+  size_t size = std::min(kChunkSize, length_ - offset);
+  static const size_t page_size = sysconf(_SC_PAGESIZE);
+  if (!Read(offset, size, buffer_.data())) {
+    // There's no way to fail the access; the reader sees zeros, which the signature and CRC
+    // checks of the package catch.
+    PLOG(ERROR) << "failed to read the block map at " << offset;
+    std::fill(buffer_.begin(), buffer_.begin() + size, 0);
+  }
+
+  uffdio_copy copy = {};
+  copy.dst = base_ + offset;
+  copy.src = reinterpret_cast<uintptr_t>(buffer_.data());
+  copy.len = size;
+  if (ioctl(uffd_.get(), UFFDIO_COPY, &copy) == 0) {
+    return;
+  }
+  // Some pages of the chunk were already in; copy in just the one that faulted.
+  size_t page = (fault - base_) & ~(page_size - 1);
+  copy.dst = base_ + page;
+  copy.src = reinterpret_cast<uintptr_t>(buffer_.data() + (page - offset));
+  copy.len = page_size;
+  copy.copy = 0;
+  if (ioctl(uffd_.get(), UFFDIO_COPY, &copy) == -1 && errno == EEXIST) {
+    uffdio_range range = { base_ + page, page_size };
+    ioctl(uffd_.get(), UFFDIO_WAKE, &range);
+  }
+}
+
+void LazyBlockMap::FillRemaining() {
+  static const size_t page_size = sysconf(_SC_PAGESIZE);
+  LOG(WARNING) << "reading in the rest of the block map at once";
+  for (size_t offset = 0; offset < length_; offset += kChunkSize) {
+    size_t size = std::min(kChunkSize, length_ - offset);
+    if (!Read(offset, size, buffer_.data())) {
+      PLOG(ERROR) << "failed to read the block map at " << offset;
+      std::fill(buffer_.begin(), buffer_.begin() + size, 0);
+    }
+    uffdio_copy copy = {};
+    copy.dst = base_ + offset;
+    copy.src = reinterpret_cast<uintptr_t>(buffer_.data());
+    copy.len = size;
+    if (ioctl(uffd_.get(), UFFDIO_COPY, &copy) == 0) {
+      continue;
+    }
+    // Page by page, skipping the ones that are in already.
+    for (size_t page = 0; page < size; page += page_size) {
+      copy.dst = base_ + offset + page;
+      copy.src = reinterpret_cast<uintptr_t>(buffer_.data() + page);
+      copy.len = page_size;
+      copy.copy = 0;
+      if (ioctl(uffd_.get(), UFFDIO_COPY, &copy) == -1 && errno != EEXIST) {
+        PLOG(FATAL) << "failed to copy in the block map at " << offset + page;
+      }
+    }
+  }
+  // Every page is present now. Wake the accesses that raced with a page that was already in, and
+  // let any later fault be handled by the kernel.
+  uffdio_range range = { base_, length_ };
+  ioctl(uffd_.get(), UFFDIO_WAKE, &range);
+  if (ioctl(uffd_.get(), UFFDIO_UNREGISTER, &range) == -1) {
+    PLOG(WARNING) << "UFFDIO_UNREGISTER failed";
+  }
+}
+
+#else  // HAVE_USERFAULTFD
+
+std::unique_ptr<LazyBlockMap> LazyBlockMap::Create(void*, size_t, int,
+                                                   const std::vector<BlockExtent>&) {
+  return nullptr;
+}
+
+void LazyBlockMap::Serve() {}
+
+void LazyBlockMap::Fill(uintptr_t) {}
+
+void LazyBlockMap::FillRemaining() {}
+
+#endif  // HAVE_USERFAULTFD
+
+LazyBlockMap::~LazyBlockMap() {
+  if (thread_.joinable()) {
+    char c = 0;
+    TEMP_FAILURE_RETRY(write(wake_write_.get(), &c, 1));
+    thread_.join();
+  }
+}
+
+bool LazyBlockMap::Read(size_t offset, size_t size, uint8_t* buffer) {
+  auto it = std::upper_bound(
+      extents_.begin(), extents_.end(), offset,
+      [](size_t value, const BlockExtent& extent) { return value < extent.offset; });
+  if (it != extents_.begin()) --it;
+  while (size > 0) {
+    if (it == extents_.end() || offset < it->offset) {
+      // Past the last extent, in the rounding of the mapping to whole pages.
+      std::fill(buffer, buffer + size, 0);
+      return true;
+    }
+    size_t in_extent = std::min(size, it->offset + it->length - offset);
+    off64_t dev_offset = it->dev_offset + (offset - it->offset);
+    for (size_t done = 0; done < in_extent;) {
+      ssize_t n = TEMP_FAILURE_RETRY(
+          pread64(block_fd_.get(), buffer + done, in_extent - done, dev_offset + done));
+      if (n <= 0) {
+        if (n == 0) errno = EIO;
+        return false;
+      }
+      done += n;
+    }
+    buffer += in_extent;
+    offset += in_extent;
+    size -= in_extent;
+    ++it;
+  }
+  return true;
+}
+
+bool MemMapping::Advise(MemAccess access, size_t offset, size_t len) const {
+  if (offset >= length) return true;
+  return AdviseMappedRange(addr + offset, std::min(len, length - offset), access);
+}
+
+bool MemMapping::MapFD(int fd, bool populate) {
   struct stat sb;
   if (fstat(fd, &sb) == -1) {
     PLOG(ERROR) << "fstat(" << fd << ") failed";
     return false;
   }
 
-  void* memPtr = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  void* memPtr =
+      mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE | (populate ? MAP_POPULATE : 0), fd, 0);
   if (memPtr == MAP_FAILED) {
     PLOG(ERROR) << "mmap(" << sb.st_size << ", R, PRIVATE, " << fd << ", 0) failed";
     return false;
@@ -52,6 +340,49 @@ bool MemMapping::MapFD(int fd) {
   return true;
 }
 
+std::string BinaryBlockMap(const std::string& block_dev, uint64_t file_size, uint32_t block_size,
+                           const std::vector<uint64_t>& ranges) {
+  BlockMapHeader header = {};
+  std::copy(std::begin(BLOCK_MAP_MAGIC), std::end(BLOCK_MAP_MAGIC), header.magic);
+  header.version = BLOCK_MAP_VERSION;
+  header.block_size = block_size;
+  header.file_size = file_size;
+  header.range_count = ranges.size() / 2;
+  header.block_dev_length = block_dev.size();
+
+  std::string content(reinterpret_cast<const char*>(&header), sizeof(header));
+  content += block_dev;
+  content.resize((content.size() + 7) & ~static_cast<size_t>(7), '\0');
+  content.append(reinterpret_cast<const char*>(ranges.data()), ranges.size() * sizeof(uint64_t));
+  return content;
+}
+
+// Parses the binary block map (see BlockMapHeader) in the |map_size| bytes at |data|.
+static bool ParseBinaryBlockMap(const uint8_t* data, size_t map_size, const BlockMapHeader** header,
+                                std::string* block_dev, const uint64_t** ranges) {
+  *header = reinterpret_cast<const BlockMapHeader*>(data);
+  if ((*header)->version != BLOCK_MAP_VERSION) {
+    LOG(ERROR) << "Unsupported block map version " << (*header)->version;
+    return false;
+  }
+  if ((*header)->block_dev_length > map_size || (*header)->file_size > SIZE_MAX) {
+    LOG(ERROR) << "Invalid binary block map header";
+    return false;
+  }
+  size_t ranges_offset =
+      (sizeof(BlockMapHeader) + (*header)->block_dev_length + 7) & ~static_cast<size_t>(7);
+  if (ranges_offset > map_size || (*header)->range_count > (map_size - ranges_offset) / 16 ||
+      map_size != ranges_offset + (*header)->range_count * 16) {
+    LOG(ERROR) << "Invalid binary block map: size " << map_size << ", device path length "
+               << (*header)->block_dev_length << ", range_count " << (*header)->range_count;
+    return false;
+  }
+  block_dev->assign(reinterpret_cast<const char*>(data + sizeof(BlockMapHeader)),
+                    (*header)->block_dev_length);
+  *ranges = reinterpret_cast<const uint64_t*>(data + ranges_offset);
+  return true;
+}
+
 // A "block map" which looks like this (from uncrypt/uncrypt.cpp):
 //
 //   /dev/block/platform/msm_sdcc.1/by-name/userdata     # block device
@@ -62,10 +393,52 @@ bool MemMapping::MapFD(int fd) {
 //   30 33                                               # ... block range 2
 //
 // Each block range represents a half-open interval; the line "30 33" reprents the blocks
-// [30, 31, 32].
+// [30, 31, 32]. The same map may also come in the binary form of BlockMapHeader, which is mapped
+// and read in place rather than split into lines.
 bool MemMapping::MapBlockFile(const std::string& filename) {
+  android::base::unique_fd map_fd(TEMP_FAILURE_RETRY(open(filename.c_str(), O_RDONLY)));
+  if (map_fd == -1) {
+    PLOG(ERROR) << "Failed to open " << filename;
+    return false;
+  }
+  struct stat sb;
+  if (fstat(map_fd, &sb) == -1) {
+    PLOG(ERROR) << "Failed to stat " << filename;
+    return false;
+  }
+
+  BlockMapHeader magic = {};
+  if (static_cast<size_t>(sb.st_size) >= sizeof(BlockMapHeader) &&
+      TEMP_FAILURE_RETRY(pread(map_fd, &magic, sizeof(magic), 0)) ==
+          static_cast<ssize_t>(sizeof(magic)) &&
+      std::equal(std::begin(BLOCK_MAP_MAGIC), std::end(BLOCK_MAP_MAGIC), magic.magic)) {
+    size_t map_size = sb.st_size;
+    void* map_data = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, map_fd, 0);
+    if (map_data == MAP_FAILED) {
+      PLOG(ERROR) << "Failed to map " << filename;
+      return false;
+    }
+    const BlockMapHeader* header;
+    std::string block_dev;
+    const uint64_t* ranges;
+    bool success =
+        ParseBinaryBlockMap(static_cast<const uint8_t*>(map_data), map_size, &header, &block_dev,
+                            &ranges) &&
+        MapBlockRanges(block_dev, header->file_size, header->block_size, header->range_count,
+                       [ranges](size_t i, size_t* start, size_t* end) {
+                         if (ranges[2 * i] > SIZE_MAX || ranges[2 * i + 1] > SIZE_MAX) {
+                           return false;
+                         }
+                         *start = ranges[2 * i];
+                         *end = ranges[2 * i + 1];
+                         return true;
+                       });
+    munmap(map_data, map_size);
+    return success;
+  }
+
   std::string content;
-  if (!android::base::ReadFileToString(filename, &content)) {
+  if (!android::base::ReadFdToString(map_fd, &content)) {
     PLOG(ERROR) << "Failed to read " << filename;
     return false;
   }
@@ -88,75 +461,109 @@ bool MemMapping::MapBlockFile(const std::string& filename) {
     LOG(ERROR) << "Failed to parse block map header: " << lines[2];
     return false;
   }
+  if (lines.size() != 3 + range_count) {
+    LOG(ERROR) << "Invalid data in block map file: range_count " << range_count << ", lines "
+               << lines.size();
+    return false;
+  }
+
+  return MapBlockRanges(lines[0], size, blksize, range_count,
+                        [&lines](size_t i, size_t* start, size_t* end) {
+                          if (sscanf(lines[i + 3].c_str(), "%zu %zu\n", start, end) != 2) {
+                            LOG(ERROR) << "failed to parse range " << i << ": " << lines[i + 3];
+                            return false;
+                          }
+                          return true;
+                        });
+}
 
+bool MemMapping::MapBlockRanges(
+    const std::string& block_dev, size_t size, size_t blksize, size_t range_count,
+    const std::function<bool(size_t i, size_t* start, size_t* end)>& get_range) {
   size_t blocks;
   if (blksize != 0) {
     blocks = ((size - 1) / blksize) + 1;
   }
-  if (size == 0 || blksize == 0 || blocks > SIZE_MAX / blksize || range_count == 0 ||
-      lines.size() != 3 + range_count) {
+  if (size == 0 || blksize == 0 || blocks > SIZE_MAX / blksize || range_count == 0) {
     LOG(ERROR) << "Invalid data in block map file: size " << size << ", blksize " << blksize
-               << ", range_count " << range_count << ", lines " << lines.size();
-    return false;
-  }
-
-  // Reserve enough contiguous address space for the whole file.
-  void* reserve = mmap(nullptr, blocks * blksize, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
-  if (reserve == MAP_FAILED) {
-    PLOG(ERROR) << "failed to reserve address space";
+               << ", range_count " << range_count;
     return false;
   }
 
-  const std::string& block_dev = lines[0];
   android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(block_dev.c_str(), O_RDONLY)));
   if (fd == -1) {
     PLOG(ERROR) << "failed to open block device " << block_dev;
-    munmap(reserve, blocks * blksize);
     return false;
   }
 
-  ranges_.clear();
-
-  unsigned char* next = static_cast<unsigned char*>(reserve);
-  size_t remaining_size = blocks * blksize;
-  bool success = true;
+  std::vector<BlockExtent> extents;
+  size_t offset = 0;
   for (size_t i = 0; i < range_count; ++i) {
-    const std::string& line = lines[i + 3];
-
     size_t start, end;
-    if (sscanf(line.c_str(), "%zu %zu\n", &start, &end) != 2) {
-      LOG(ERROR) << "failed to parse range " << i << ": " << line;
-      success = false;
-      break;
+    if (!get_range(i, &start, &end)) {
+      return false;
     }
     size_t range_size = (end - start) * blksize;
-    if (end <= start || (end - start) > SIZE_MAX / blksize || range_size > remaining_size) {
+    if (end <= start || (end - start) > SIZE_MAX / blksize ||
+        range_size > blocks * blksize - offset) {
       LOG(ERROR) << "Invalid range: " << start << " " << end;
-      success = false;
-      break;
-    }
-
-    void* range_start = mmap(next, range_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd,
-                             static_cast<off_t>(start) * blksize);
-    if (range_start == MAP_FAILED) {
-      PLOG(ERROR) << "failed to map range " << i << ": " << line;
-      success = false;
-      break;
+      return false;
     }
-    ranges_.emplace_back(MappedRange{ range_start, range_size });
-
-    next += range_size;
-    remaining_size -= range_size;
+    extents.push_back({ offset, range_size, static_cast<off64_t>(start) * blksize });
+    offset += range_size;
   }
-  if (success && remaining_size != 0) {
-    LOG(ERROR) << "Invalid ranges: remaining_size " << remaining_size;
-    success = false;
+  if (offset != blocks * blksize) {
+    LOG(ERROR) << "Invalid ranges: remaining_size " << blocks * blksize - offset;
+    return false;
   }
-  if (!success) {
-    munmap(reserve, blocks * blksize);
+
+  // Reserve enough contiguous address space for the whole file.
+  bool lazy = range_count >= lazy_block_map_threshold;
+  void* reserve = mmap(nullptr, blocks * blksize, lazy ? PROT_READ : PROT_NONE,
+                       MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (reserve == MAP_FAILED) {
+    PLOG(ERROR) << "failed to reserve address space";
     return false;
   }
 
+  ranges_.clear();
+  lazy_.reset();
+
+  if (lazy) {
+    static const size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t reserved = (blocks * blksize + page_size - 1) & ~(page_size - 1);
+    lazy_ = LazyBlockMap::Create(reserve, reserved, fd, extents);
+    if (lazy_) {
+      ranges_.emplace_back(MappedRange{ reserve, blocks * blksize });
+      addr = static_cast<unsigned char*>(reserve);
+      length = size;
+      LOG(INFO) << "lazily mapped " << range_count << " ranges";
+      return true;
+    }
+    // Fall back to mapping the ranges directly.
+    munmap(reserve, blocks * blksize);
+    reserve = mmap(nullptr, blocks * blksize, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (reserve == MAP_FAILED) {
+      PLOG(ERROR) << "failed to reserve address space";
+      return false;
+    }
+  }
+
+  unsigned char* next = static_cast<unsigned char*>(reserve);
+  for (size_t i = 0; i < extents.size(); ++i) {
+    const BlockExtent& extent = extents[i];
+    void* range_start = mmap(next + extent.offset, extent.length, PROT_READ,
+                             MAP_PRIVATE | MAP_FIXED, fd, extent.dev_offset);
+    if (range_start == MAP_FAILED) {
+      PLOG(ERROR) << "failed to map range " << i << ": " << extent.dev_offset / blksize << " "
+                  << (extent.dev_offset + extent.length) / blksize;
+      munmap(reserve, blocks * blksize);
+      ranges_.clear();
+      return false;
+    }
+    ranges_.emplace_back(MappedRange{ range_start, extent.length });
+  }
+
   addr = static_cast<unsigned char*>(reserve);
   length = size;
 
@@ -165,7 +572,7 @@ bool MemMapping::MapBlockFile(const std::string& filename) {
   return true;
 }
 
-bool MemMapping::MapFile(const std::string& fn) {
+bool MemMapping::MapFile(const std::string& fn, bool populate) {
   if (fn.empty()) {
     LOG(ERROR) << "Empty filename";
     return false;
@@ -185,7 +592,7 @@ bool MemMapping::MapFile(const std::string& fn) {
       return false;
     }
 
-    if (!MapFD(fd)) {
+    if (!MapFD(fd, populate)) {
       LOG(ERROR) << "Map of '" << fn << "' failed";
       return false;
     }
@@ -194,6 +601,8 @@ bool MemMapping::MapFile(const std::string& fn) {
 }
 
 MemMapping::~MemMapping() {
+  // Stop serving the faults before the memory goes away.
+  lazy_.reset();
   for (const auto& range : ranges_) {
     if (munmap(range.addr, range.length) == -1) {
       PLOG(ERROR) << "Failed to munmap(" << range.addr << ", " << range.length << ")";
@@ -58,7 +58,7 @@ static std::vector<std::string> InitThermalPaths() {
   return thermal_paths;
 }
 
-int GetMaxValueFromThermalZone() {
+static int ReadMaxValueFromThermalZone() {
   static std::vector<std::string> thermal_paths = InitThermalPaths();
   int max_temperature = -1;
   for (const auto& path : thermal_paths) {
@@ -75,6 +75,41 @@ int GetMaxValueFromThermalZone() {
     }
     max_temperature = std::max(temperature, max_temperature);
   }
+  return max_temperature;
+}
+
+int GetMaxValueFromThermalZone() {
+  int max_temperature = ReadMaxValueFromThermalZone();
   LOG(INFO) << "current maximum temperature: " << max_temperature;
   return max_temperature;
 }
+
+// The share of the concurrency that's always allowed, however hot the device gets.
+static constexpr double kMinThermalLevel = 1.0 / 16;
+
+size_t ThermalGovernor::Limit(size_t max) {
+  auto now = std::chrono::steady_clock::now();
+  if (!sampled_ || now - last_sample_ >= interval_) {
+    sampled_ = true;
+    last_sample_ = now;
+    Update(ReadMaxValueFromThermalZone());
+  }
+  return std::max<size_t>(1, static_cast<size_t>(max * level_ + 0.5));
+}
+
+void ThermalGovernor::Update(int temperature) {
+  if (temperature < 0) {
+    return;
+  }
+  double level = level_;
+  if (temperature >= throttle_temperature_) {
+    level = std::max(kMinThermalLevel, level_ / 2);
+  } else if (temperature < throttle_temperature_ - hysteresis_) {
+    level = std::min(1.0, level_ + 0.25);
+  }
+  if (level != level_) {
+    LOG(INFO) << "temperature " << temperature << ": pacing the install at " << level * 100
+              << "% of its concurrency";
+    level_ = level;
+  }
+}
@@ -18,9 +18,18 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <utime.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
 
 #include <android-base/logging.h>
 #include <android-base/unique_fd.h>
@@ -29,13 +38,157 @@
 #include <ziparchive/zip_archive.h>
 
 #include "otautil/DirUtil.h"
+#include "otautil/SysUtil.h"
 
 static constexpr mode_t UNZIP_DIRMODE = 0755;
 static constexpr mode_t UNZIP_FILEMODE = 0644;
 
+std::unique_ptr<ZipIndex> ZipIndex::Build(ZipArchiveHandle zip) {
+    void* cookie;
+    int ret = StartIteration(zip, &cookie, nullptr, nullptr);
+    if (ret != 0) {
+        LOG(ERROR) << "failed to start iterating zip entries: " << ErrorCodeString(ret);
+        return nullptr;
+    }
+    std::unique_ptr<void, decltype(&EndIteration)> guard(cookie, EndIteration);
+
+    std::unique_ptr<ZipIndex> index(new ZipIndex);
+    ZipEntry entry;
+    ZipString name;
+    while ((ret = Next(cookie, &entry, &name)) == 0) {
+        index->entries_.emplace_back(std::string(name.name, name.name + name.name_length), entry);
+    }
+    if (ret != -1) {
+        LOG(ERROR) << "failed to iterate zip entries: " << ErrorCodeString(ret);
+        return nullptr;
+    }
+    std::sort(index->entries_.begin(), index->entries_.end(),
+              [](const Entries::value_type& a, const Entries::value_type& b) {
+                  return a.first < b.first;
+              });
+    return index;
+}
+
+bool ZipIndex::Find(const std::string& name, ZipEntry* entry) const {
+    auto it = std::lower_bound(entries_.begin(), entries_.end(), name,
+                               [](const Entries::value_type& a, const std::string& b) {
+                                   return a.first < b;
+                               });
+    if (it == entries_.end() || it->first != name) {
+        return false;
+    }
+    *entry = it->second;
+    return true;
+}
+
+std::pair<ZipIndex::Entries::const_iterator, ZipIndex::Entries::const_iterator>
+ZipIndex::EntriesWithPrefix(const std::string& prefix) const {
+    auto begin = std::lower_bound(entries_.begin(), entries_.end(), prefix,
+                                  [](const Entries::value_type& a, const std::string& b) {
+                                      return a.first < b;
+                                  });
+    auto end = std::find_if(begin, entries_.end(), [&](const Entries::value_type& a) {
+        return a.first.compare(0, prefix.size(), prefix) != 0;
+    });
+    return { begin, end };
+}
+
+// Files created ahead of the extraction, per job, so that the open fds stay bounded.
+static constexpr size_t kQueuedFilesPerJob = 8;
+
+// Inflates the queued entries into their (already created) files on |jobs| threads. Each file is
+// closed once it's written, without an fsync; the caller syncs them all at the end.
+class ParallelExtractor {
+  public:
+    ParallelExtractor(ZipArchiveHandle zip, size_t jobs) : zip_(zip) {
+        for (size_t i = 0; i < jobs; i++) {
+            threads_.emplace_back(&ParallelExtractor::Work, this);
+        }
+    }
+
+    ~ParallelExtractor() {
+        Finish();
+    }
+
+    // Returns false if an earlier entry has failed.
+    bool Add(const ZipEntry& entry, const std::string& path, android::base::unique_fd fd) {
+        std::unique_lock<std::mutex> lock(mu_);
+        cv_.wait(lock, [&] {
+            return failed_ || queue_.size() < threads_.size() * kQueuedFilesPerJob;
+        });
+        if (failed_) {
+            return false;
+        }
+        queue_.push_back({ entry, path, std::move(fd) });
+        cv_.notify_all();
+        return true;
+    }
+
+    // Waits for all the queued entries. Returns false if any of them failed.
+    bool Finish() {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            done_ = true;
+            cv_.notify_all();
+        }
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+        threads_.clear();
+        return !failed_;
+    }
+
+  private:
+    struct Job {
+        ZipEntry entry;
+        std::string path;
+        android::base::unique_fd fd;
+    };
+
+    void Work() {
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mu_);
+                cv_.wait(lock, [&] { return failed_ || done_ || !queue_.empty(); });
+                if (failed_ || queue_.empty()) {
+                    return;
+                }
+                job = std::move(queue_.front());
+                queue_.pop_front();
+                cv_.notify_all();
+            }
+
+            int err = ExtractEntryToFile(zip_, &job.entry, job.fd);
+            bool success = err == 0;
+            if (!success) {
+                LOG(ERROR) << "Error extracting \"" << job.path << "\" : " << ErrorCodeString(err);
+            } else if (close(job.fd.release()) != 0) {
+                PLOG(ERROR) << "Error closing \"" << job.path << "\"";
+                success = false;
+            }
+            if (!success) {
+                std::lock_guard<std::mutex> lock(mu_);
+                failed_ = true;
+                cv_.notify_all();
+                return;
+            }
+        }
+    }
+
+    ZipArchiveHandle zip_;
+    std::vector<std::thread> threads_;
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<Job> queue_;
+    bool done_ = false;
+    bool failed_ = false;
+};
+
 bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
                              const std::string& dest_path, const struct utimbuf* timestamp,
-                             struct selabel_handle* sehnd) {
+                             struct selabel_handle* sehnd, size_t jobs,
+                             const ZipIndex* index) {
     if (!zip_path.empty() && zip_path[0] == '/') {
         LOG(ERROR) << "ExtractPackageRecursive(): zip_path must be a relative path " << zip_path;
         return false;
@@ -45,7 +198,6 @@ bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
         return false;
     }
 
-    void* cookie;
     std::string target_dir(dest_path);
     if (dest_path.back() != '/') {
         target_dir += '/';
@@ -54,20 +206,40 @@ bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
     if (!zip_path.empty() && zip_path.back() != '/') {
         prefix_path += '/';
     }
-    const ZipString zip_prefix(prefix_path.c_str());
 
-    int ret = StartIteration(zip, &cookie, &zip_prefix, nullptr);
-    if (ret != 0) {
-        LOG(ERROR) << "failed to start iterating zip entries.";
-        return false;
+    ZipIndex::Entries scanned;
+    ZipIndex::Entries::const_iterator begin, end;
+    if (index != nullptr) {
+        std::tie(begin, end) = index->EntriesWithPrefix(prefix_path);
+    } else {
+        const ZipString zip_prefix(prefix_path.c_str());
+        void* cookie;
+        int ret = StartIteration(zip, &cookie, &zip_prefix, nullptr);
+        if (ret != 0) {
+            LOG(ERROR) << "failed to start iterating zip entries.";
+            return false;
+        }
+        std::unique_ptr<void, decltype(&EndIteration)> guard(cookie, EndIteration);
+        ZipEntry entry;
+        ZipString name;
+        while (Next(cookie, &entry, &name) == 0) {
+            scanned.emplace_back(std::string(name.name, name.name + name.name_length), entry);
+        }
+        begin = scanned.cbegin();
+        end = scanned.cend();
     }
 
-    std::unique_ptr<void, decltype(&EndIteration)> guard(cookie, EndIteration);
-    ZipEntry entry;
-    ZipString name;
+    std::unique_ptr<ParallelExtractor> extractor;
+    std::vector<std::string> extracted;
+    if (jobs > 1) {
+        extractor = std::make_unique<ParallelExtractor>(zip, jobs);
+    }
     int extractCount = 0;
-    while (Next(cookie, &entry, &name) == 0) {
-        std::string entry_name(name.name, name.name + name.name_length);
+    // The entries of a directory come together, so its parents are only looked up once.
+    DirCache dirs;
+    for (auto it = begin; it != end; ++it) {
+        const std::string& entry_name = it->first;
+        ZipEntry entry = it->second;
         CHECK_LE(prefix_path.size(), entry_name.size());
         std::string path = target_dir + entry_name.substr(prefix_path.size());
         // Skip dir.
@@ -75,7 +247,7 @@ bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
             continue;
         }
 
-        if (mkdir_recursively(path.c_str(), UNZIP_DIRMODE, true, sehnd, timestamp) != 0) {
+        if (mkdir_recursively(path, UNZIP_DIRMODE, true, sehnd, timestamp, &dirs) != 0) {
             LOG(ERROR) << "failed to create dir for " << path;
             return false;
         }
@@ -95,6 +267,14 @@ bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
             setfscreatecon(NULL);
         }
 
+        if (extractor) {
+            if (!extractor->Add(entry, path, std::move(fd))) {
+                return false;
+            }
+            extracted.push_back(path);
+            continue;
+        }
+
         int err = ExtractEntryToFile(zip, &entry, fd);
         if (err != 0) {
             LOG(ERROR) << "Error extracting \"" << path << "\" : " << ErrorCodeString(err);
@@ -115,6 +295,82 @@ bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
         ++extractCount;
     }
 
+    if (extractor) {
+        if (!extractor->Finish()) {
+            return false;
+        }
+        for (const auto& path : extracted) {
+            if (timestamp != nullptr && utime(path.c_str(), timestamp)) {
+                PLOG(ERROR) << "Error touching \"" << path << "\"";
+                return false;
+            }
+            LOG(INFO) << "Extracted file \"" << path << "\"";
+            ++extractCount;
+        }
+        // One sync of the filesystem for all the files, instead of an fsync per file.
+        if (!extracted.empty()) {
+            android::base::unique_fd dir_fd(open(target_dir.c_str(), O_RDONLY | O_DIRECTORY));
+            if (dir_fd == -1 || syncfs(dir_fd) != 0) {
+                PLOG(ERROR) << "Error syncing the files extracted to \"" << target_dir << "\"";
+                return false;
+            }
+        }
+    }
+
     LOG(INFO) << "Extracted " << extractCount << " file(s)";
     return true;
 }
+
+// The end of central directory record: its signature, its size without the comment, the offsets
+// of the fields that locate the central directory, and the longest comment it can have.
+static constexpr uint32_t EOCD_SIGNATURE = 0x06054b50;
+static constexpr size_t EOCD_SIZE = 22;
+static constexpr size_t EOCD_CD_SIZE_OFFSET = 12;
+static constexpr size_t EOCD_CD_OFFSET_OFFSET = 16;
+static constexpr size_t EOCD_MAX_COMMENT = 65535;
+
+static uint32_t ReadLe32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+bool PrefetchZipDirectory(const uint8_t* addr, size_t length) {
+    if (length < EOCD_SIZE) {
+        return false;
+    }
+    size_t tail = std::min(length, EOCD_SIZE + EOCD_MAX_COMMENT);
+    AdviseMappedRange(addr + length - tail, tail, MemAccess::WILLNEED);
+
+    // The record is normally at the very end, after an empty comment.
+    for (size_t offset = length - EOCD_SIZE + 1; offset-- > length - tail;) {
+        const uint8_t* eocd = addr + offset;
+        if (ReadLe32(eocd) != EOCD_SIGNATURE) {
+            continue;
+        }
+        uint64_t cd_size = ReadLe32(eocd + EOCD_CD_SIZE_OFFSET);
+        uint64_t cd_offset = ReadLe32(eocd + EOCD_CD_OFFSET_OFFSET);
+        if (cd_offset + cd_size > offset) {
+            continue;
+        }
+        AdviseMappedRange(addr + cd_offset, cd_size, MemAccess::WILLNEED);
+        return true;
+    }
+    return false;
+}
+
+void PrefetchZipEntries(ZipArchiveHandle zip, const uint8_t* addr, size_t length,
+                        const std::vector<std::string>& names) {
+    std::vector<ZipEntry> entries;
+    for (const auto& name : names) {
+        ZipString zip_name(name.c_str());
+        ZipEntry entry;
+        if (FindEntry(zip, zip_name, &entry) == 0 &&
+            static_cast<uint64_t>(entry.offset) + entry.compressed_length <= length) {
+            entries.push_back(entry);
+        }
+    }
+    std::sort(entries.begin(), entries.end(),
+              [](const ZipEntry& a, const ZipEntry& b) { return a.offset < b.offset; });
+    for (const auto& entry : entries) {
+        AdviseMappedRange(addr + entry.offset, entry.compressed_length, MemAccess::WILLNEED);
+    }
+}
@@ -17,13 +17,46 @@
 #ifndef _OTAUTIL_ZIPUTIL_H
 #define _OTAUTIL_ZIPUTIL_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <utime.h>
 
+#include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <selinux/label.h>
 #include <ziparchive/zip_archive.h>
 
+/*
+ * A table of all the entries of an archive, sorted by name, so that the
+ * entries under a directory can be listed without walking the whole central
+ * directory again. It's built once per archive, and stays valid for as long
+ * as the archive stays open.
+ */
+class ZipIndex {
+  public:
+    using Entries = std::vector<std::pair<std::string, ZipEntry>>;
+
+    /* Returns nullptr if the entries can't be iterated. */
+    static std::unique_ptr<ZipIndex> Build(ZipArchiveHandle zip);
+
+    /* Returns true and fills in entry if there's an entry named name. */
+    bool Find(const std::string& name, ZipEntry* entry) const;
+
+    /* Returns the entries whose names start with prefix, in name order. */
+    std::pair<Entries::const_iterator, Entries::const_iterator> EntriesWithPrefix(
+            const std::string& prefix) const;
+
+    size_t size() const {
+        return entries_.size();
+    }
+
+  private:
+    Entries entries_;
+};
+
 /*
  * Inflate all files under zip_path to the directory specified by
  * dest_path, which must exist and be a writable directory. The zip_path
@@ -48,10 +81,38 @@
  *
  * If timestamp is non-NULL, file timestamps will be set accordingly.
  *
+ * With jobs > 1, up to that many entries are inflated concurrently. The
+ * directories and files are still created, labeled and timestamped in the
+ * order of the entries, on the calling thread, and instead of an fsync per
+ * file, the filesystem is synced once all of them are written.
+ *
+ * If index is non-NULL, it must have been built from zip, and the entries are
+ * looked up there (in name order) instead of iterating the archive.
+ *
  * Returns true on success, false on failure.
  */
 bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
                              const std::string& dest_path, const struct utimbuf* timestamp,
-                             struct selabel_handle* sehnd);
+                             struct selabel_handle* sehnd, size_t jobs = 1,
+                             const ZipIndex* index = nullptr);
+
+/*
+ * Starts reading in the end of central directory record and then the central
+ * directory of the archive mapped at [addr, addr + length), as two bursts of
+ * readahead, ahead of OpenArchiveFromMemory() walking them a page at a time.
+ * It pays off where every page fault is a round trip, as with a package that
+ * fuse_sideload serves. Returns false if there's no end of central directory
+ * record, in which case the archive won't open either.
+ */
+bool PrefetchZipDirectory(const uint8_t* addr, size_t length);
+
+/*
+ * Starts reading in the data of the named entries of zip, which is mapped at
+ * [addr, addr + length), in the order they're laid out in the archive rather
+ * than the order of names, so that the reads reach the storage (or the host)
+ * front to back. The names that aren't in the archive are skipped.
+ */
+void PrefetchZipEntries(ZipArchiveHandle zip, const uint8_t* addr, size_t length,
+                        const std::vector<std::string>& names);
 
 #endif // _OTAUTIL_ZIPUTIL_H
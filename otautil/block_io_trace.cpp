@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/block_io_trace.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <atomic>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+
+constexpr uint8_t BlockIoRecord::kQueued;
+constexpr const char* BlockIoTrace::kMagic;
+
+static std::atomic<BlockIoTrace*> current_trace(nullptr);
+static thread_local int current_command = -1;
+
+BlockIoTrace::BlockIoTrace(dev_t dev, ino_t ino, dev_t rdev)
+    : dev_(dev), ino_(ino), rdev_(rdev), start_(std::chrono::steady_clock::now()) {}
+
+BlockIoTrace* BlockIoTrace::Get() {
+  return current_trace.load(std::memory_order_acquire);
+}
+
+bool BlockIoTrace::Start(const std::string& path) {
+  struct stat sb;
+  if (stat(path.c_str(), &sb) == -1) {
+    PLOG(ERROR) << "Failed to stat " << path;
+    return false;
+  }
+  BlockIoTrace* trace = S_ISBLK(sb.st_mode) ? new BlockIoTrace(0, 0, sb.st_rdev)
+                                            : new BlockIoTrace(sb.st_dev, sb.st_ino, 0);
+  delete current_trace.exchange(trace);
+  LOG(INFO) << "tracing the block I/O on " << path;
+  return true;
+}
+
+bool BlockIoTrace::Finish(const std::string& path) {
+  // The I/O is over by now, so nothing can be recording into the trace any more.
+  BlockIoTrace* trace = current_trace.exchange(nullptr);
+  if (trace == nullptr) {
+    return true;
+  }
+  bool success = path.empty() || Save(path, trace->records_);
+  if (!path.empty() && success) {
+    LOG(INFO) << "saved " << trace->records_.size() << " block I/O records to " << path;
+  }
+  delete trace;
+  return success;
+}
+
+void BlockIoTrace::SetCommand(int command) {
+  current_command = command;
+}
+
+bool BlockIoTrace::Traces(int fd) const {
+  struct stat sb;
+  if (fstat(fd, &sb) == -1) {
+    return false;
+  }
+  if (rdev_ != 0) {
+    return S_ISBLK(sb.st_mode) && sb.st_rdev == rdev_;
+  }
+  return sb.st_dev == dev_ && sb.st_ino == ino_;
+}
+
+uint64_t BlockIoTrace::Now() const {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+                                                              start_)
+      .count();
+}
+
+void BlockIoTrace::Record(int fd, uint8_t op, uint64_t offset, uint64_t length, uint64_t start_ns,
+                          uint8_t flags) {
+  uint64_t end_ns = Now();
+  if (!Traces(fd)) {
+    return;
+  }
+  BlockIoRecord record = {};
+  record.offset = offset;
+  record.length = length;
+  record.start_ns = start_ns;
+  record.duration_ns = end_ns - start_ns;
+  record.command = current_command;
+  record.op = op;
+  record.flags = flags;
+  std::lock_guard<std::mutex> lock(mutex_);
+  records_.push_back(record);
+}
+
+bool BlockIoTrace::Save(const std::string& path, const std::vector<BlockIoRecord>& records) {
+  android::base::unique_fd fd(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+  if (fd == -1) {
+    PLOG(ERROR) << "Failed to create " << path;
+    return false;
+  }
+  uint64_t count = records.size();
+  if (!android::base::WriteFully(fd, kMagic, strlen(kMagic)) ||
+      !android::base::WriteFully(fd, &count, sizeof(count)) ||
+      !android::base::WriteFully(fd, records.data(), records.size() * sizeof(BlockIoRecord))) {
+    PLOG(ERROR) << "Failed to write " << path;
+    return false;
+  }
+  return true;
+}
+
+bool BlockIoTrace::Load(const std::string& path, std::vector<BlockIoRecord>* records) {
+  android::base::unique_fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd == -1) {
+    PLOG(ERROR) << "Failed to open " << path;
+    return false;
+  }
+  char magic[8];
+  uint64_t count;
+  static_assert(sizeof(magic) == sizeof("BLKIOTR1") - 1, "magic size mismatch");
+  if (!android::base::ReadFully(fd, magic, sizeof(magic)) ||
+      memcmp(magic, kMagic, sizeof(magic)) != 0 ||
+      !android::base::ReadFully(fd, &count, sizeof(count))) {
+    LOG(ERROR) << path << " isn't a block I/O trace";
+    return false;
+  }
+  struct stat sb;
+  if (fstat(fd, &sb) == -1 ||
+      count > (static_cast<uint64_t>(sb.st_size) - sizeof(magic) - sizeof(count)) /
+                  sizeof(BlockIoRecord)) {
+    LOG(ERROR) << path << " is truncated";
+    return false;
+  }
+  records->resize(count);
+  if (!android::base::ReadFully(fd, records->data(), count * sizeof(BlockIoRecord))) {
+    PLOG(ERROR) << "Failed to read " << path;
+    return false;
+  }
+  return true;
+}
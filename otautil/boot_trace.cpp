@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/boot_trace.h"
+
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <mutex>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+
+static std::mutex trace_mutex;
+static std::vector<TraceEvent> trace_events;
+
+static int64_t BootTimeNs() {
+  timespec ts;
+  clock_gettime(CLOCK_BOOTTIME, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static void AddEvent(const std::string& name, int64_t start_ns, int64_t end_ns) {
+  int tid = static_cast<int>(syscall(SYS_gettid));
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  trace_events.push_back({ name, tid, start_ns, end_ns });
+}
+
+TracePhase::TracePhase(const char* name) : name_(name), start_ns_(BootTimeNs()), ended_(false) {}
+
+void TracePhase::End() {
+  if (!ended_) {
+    ended_ = true;
+    AddEvent(name_, start_ns_, BootTimeNs());
+  }
+}
+
+void TraceRecord(const std::string& name, std::chrono::steady_clock::time_point start,
+                 std::chrono::steady_clock::time_point end) {
+  // Move the times over to CLOCK_BOOTTIME, by their distance from now.
+  int64_t now_ns = BootTimeNs();
+  auto steady_now = std::chrono::steady_clock::now();
+  auto to_boot_time = [&](std::chrono::steady_clock::time_point t) {
+    return now_ns - std::chrono::duration_cast<std::chrono::nanoseconds>(steady_now - t).count();
+  };
+  AddEvent(name, to_boot_time(start), to_boot_time(end));
+}
+
+std::vector<TraceEvent> TraceEvents() {
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  return trace_events;
+}
+
+std::string TraceSummary(std::vector<TraceEvent> events) {
+  std::stable_sort(events.begin(), events.end(), [](const TraceEvent& a, const TraceEvent& b) {
+    return a.start_ns < b.start_ns;
+  });
+  std::string summary = android::base::StringPrintf("%10s %10s  %-6s %s\n", "start_ms", "dur_ms",
+                                                    "tid", "phase");
+  for (const auto& event : events) {
+    android::base::StringAppendF(&summary, "%10.1f %10.1f  %-6d %s\n", event.start_ns / 1e6,
+                                 (event.end_ns - event.start_ns) / 1e6, event.tid,
+                                 event.name.c_str());
+  }
+  return summary;
+}
+
+bool WriteChromeTrace(const std::string& path) {
+  std::vector<TraceEvent> events = TraceEvents();
+  std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  int pid = getpid();
+  for (size_t i = 0; i < events.size(); ++i) {
+    std::string name;
+    for (char c : events[i].name) {
+      if (c == '"' || c == '\\') {
+        name += '\\';
+      }
+      name += c;
+    }
+    android::base::StringAppendF(
+        &json, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+        i == 0 ? "" : ",", name.c_str(), events[i].start_ns / 1e3,
+        (events[i].end_ns - events[i].start_ns) / 1e3, pid, events[i].tid);
+  }
+  json += "\n]}\n";
+  if (!android::base::WriteStringToFile(json, path)) {
+    PLOG(ERROR) << "Failed to write " << path;
+    return false;
+  }
+  return true;
+}
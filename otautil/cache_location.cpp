@@ -19,6 +19,8 @@
 constexpr const char kDefaultCacheTempSource[] = "/cache/saved.file";
 constexpr const char kDefaultLastCommandFile[] = "/cache/recovery/last_command";
 constexpr const char kDefaultStashDirectoryBase[] = "/cache/recovery";
+constexpr const char kDefaultTransferTraceBase[] = "/cache/recovery/last_transfer_trace";
+constexpr const char kDefaultPartitionHashCache[] = "/cache/recovery/partition_hashes";
 
 CacheLocation& CacheLocation::location() {
   static CacheLocation cache_location;
@@ -28,4 +30,6 @@ CacheLocation& CacheLocation::location() {
 CacheLocation::CacheLocation()
     : cache_temp_source_(kDefaultCacheTempSource),
       last_command_file_(kDefaultLastCommandFile),
-      stash_directory_base_(kDefaultStashDirectoryBase) {}
+      stash_directory_base_(kDefaultStashDirectoryBase),
+      transfer_trace_base_(kDefaultTransferTraceBase),
+      partition_hash_cache_(kDefaultPartitionHashCache) {}
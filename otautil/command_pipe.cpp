@@ -0,0 +1,242 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/command_pipe.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parsedouble.h>
+#include <android-base/strings.h>
+
+static constexpr const char* kSetProgressPrefix = "set_progress ";
+
+// No command comes anywhere near this; a longer frame means the stream is garbage.
+static constexpr uint32_t kMaxFrameLength = 1024 * 1024;
+
+static constexpr size_t kReadSize = 64 * 1024;
+
+namespace {
+
+// The state behind the stream of OpenFramedCommandPipe().
+struct FramedWriter {
+  int fd;
+  // The start of a line that hasn't been finished yet.
+  std::string line;
+
+  bool has_progress = false;
+  double progress = 0;
+  std::chrono::steady_clock::time_point last_progress;
+
+  bool WriteFrame(CommandFrame::Type type, const void* payload, size_t length) {
+    CommandFrame header = {};
+    header.type = type;
+    header.length = length;
+    std::string frame(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (length > 0) {
+      frame.append(static_cast<const char*>(payload), length);
+    }
+    return android::base::WriteFully(fd, frame.data(), frame.size());
+  }
+
+  bool FlushProgress() {
+    if (!has_progress) {
+      return true;
+    }
+    has_progress = false;
+    last_progress = std::chrono::steady_clock::now();
+    return WriteFrame(CommandFrame::kSetProgress, &progress, sizeof(progress));
+  }
+
+  bool WriteLine(const std::string& command) {
+    double fraction;
+    if (android::base::StartsWith(command, kSetProgressPrefix) &&
+        android::base::ParseDouble(
+            android::base::Trim(command.substr(strlen(kSetProgressPrefix))).c_str(), &fraction)) {
+      progress = fraction;
+      has_progress = true;
+      if (std::chrono::steady_clock::now() - last_progress < kCommandProgressInterval) {
+        return true;
+      }
+      return FlushProgress();
+    }
+    // Anything else goes after the progress it followed.
+    return FlushProgress() && WriteFrame(CommandFrame::kCommand, command.data(), command.size());
+  }
+};
+
+}  // namespace
+
+static ssize_t framed_write(void* cookie, const char* buf, size_t size) {
+  FramedWriter* writer = static_cast<FramedWriter*>(cookie);
+  const char* end = buf + size;
+  for (const char* p = buf; p < end;) {
+    const char* newline = static_cast<const char*>(memchr(p, '\n', end - p));
+    if (newline == nullptr) {
+      writer->line.append(p, end);
+      break;
+    }
+    writer->line.append(p, newline);
+    bool success = writer->WriteLine(writer->line);
+    writer->line.clear();
+    if (!success) {
+      return 0;
+    }
+    p = newline + 1;
+  }
+  return size;
+}
+
+static int framed_close(void* cookie) {
+  FramedWriter* writer = static_cast<FramedWriter*>(cookie);
+  bool success = (writer->line.empty() || writer->WriteLine(writer->line)) &&
+                 writer->FlushProgress();
+  success = close(writer->fd) == 0 && success;
+  delete writer;
+  return success ? 0 : -1;
+}
+
+FILE* OpenFramedCommandPipe(int fd) {
+  FramedWriter* writer = new FramedWriter;
+  writer->fd = fd;
+  if (!writer->WriteFrame(CommandFrame::kHello, nullptr, 0)) {
+    PLOG(ERROR) << "Failed to write to the command pipe";
+    delete writer;
+    return nullptr;
+  }
+  cookie_io_functions_t functions = {};
+  functions.write = framed_write;
+  functions.close = framed_close;
+  FILE* stream = fopencookie(writer, "w", functions);
+  if (stream == nullptr) {
+    PLOG(ERROR) << "Failed to open the framed command pipe";
+    delete writer;
+    return nullptr;
+  }
+  return stream;
+}
+
+bool CommandPipeReader::Read(const std::function<void(const std::string&)>& on_command,
+                             const std::function<void(double)>& on_set_progress) {
+  buffer_.erase(buffer_.begin(), buffer_.begin() + start_);
+  start_ = 0;
+  size_t old_size = buffer_.size();
+  buffer_.resize(old_size + kReadSize);
+  ssize_t n = TEMP_FAILURE_RETRY(read(fd_, buffer_.data() + old_size, kReadSize));
+  buffer_.resize(old_size + std::max<ssize_t>(n, 0));
+  if (n <= 0) {
+    if (n == -1) {
+      PLOG(ERROR) << "Failed to read the command pipe";
+    }
+    // An unfinished last line still counts.
+    if (format_ == Format::kText && !buffer_.empty()) {
+      buffer_.push_back('\n');
+      ParseText(on_command);
+    }
+    FlushProgress(on_command, on_set_progress);
+    return false;
+  }
+
+  if (format_ == Format::kUnknown) {
+    // A text command never starts with a NUL.
+    format_ = buffer_[0] == CommandFrame::kHello ? Format::kFramed : Format::kText;
+  }
+  bool success = true;
+  if (format_ == Format::kText) {
+    ParseText(on_command);
+  } else {
+    success = ParseFrames(on_command, on_set_progress);
+  }
+  FlushProgress(on_command, on_set_progress);
+  return success;
+}
+
+void CommandPipeReader::FlushProgress(const std::function<void(const std::string&)>& on_command,
+                                      const std::function<void(double)>& on_set_progress) {
+  if (!has_progress_) {
+    return;
+  }
+  has_progress_ = false;
+  if (format_ == Format::kFramed) {
+    on_set_progress(progress_);
+  } else {
+    on_command(progress_line_);
+  }
+}
+
+void CommandPipeReader::ParseText(const std::function<void(const std::string&)>& on_command) {
+  const char* data = buffer_.data();
+  while (start_ < buffer_.size()) {
+    const char* newline =
+        static_cast<const char*>(memchr(data + start_, '\n', buffer_.size() - start_));
+    if (newline == nullptr) {
+      break;
+    }
+    std::string line(data + start_, newline);
+    start_ = newline - data + 1;
+    if (android::base::StartsWith(line, kSetProgressPrefix)) {
+      progress_line_ = std::move(line);
+      has_progress_ = true;
+      continue;
+    }
+    FlushProgress(on_command, nullptr);
+    on_command(line);
+  }
+}
+
+bool CommandPipeReader::ParseFrames(const std::function<void(const std::string&)>& on_command,
+                                    const std::function<void(double)>& on_set_progress) {
+  const char* data = buffer_.data();
+  while (buffer_.size() - start_ >= sizeof(CommandFrame)) {
+    CommandFrame header;
+    memcpy(&header, data + start_, sizeof(header));
+    if (header.length > kMaxFrameLength) {
+      LOG(ERROR) << "Invalid frame of " << header.length << " bytes in the command pipe";
+      return false;
+    }
+    if (buffer_.size() - start_ - sizeof(header) < header.length) {
+      break;
+    }
+    const char* payload = data + start_ + sizeof(header);
+    start_ += sizeof(header) + header.length;
+    switch (header.type) {
+      case CommandFrame::kHello:
+        break;
+      case CommandFrame::kCommand:
+        FlushProgress(on_command, on_set_progress);
+        on_command(std::string(payload, header.length));
+        break;
+      case CommandFrame::kSetProgress:
+        if (header.length != sizeof(progress_)) {
+          LOG(ERROR) << "Invalid set_progress frame of " << header.length << " bytes";
+          return false;
+        }
+        memcpy(&progress_, payload, sizeof(progress_));
+        has_progress_ = true;
+        break;
+      default:
+        // From a newer updater; skip it.
+        LOG(WARNING) << "Unknown frame type " << static_cast<int>(header.type)
+                     << " in the command pipe";
+        break;
+    }
+  }
+  return true;
+}
@@ -21,10 +21,29 @@
 #include <sys/stat.h>  // mode_t
 #include <utime.h> // utime/utimbuf
 
+#include <stddef.h>
+
 #include <string>
+#include <unordered_set>
 
 struct selabel_handle;
 
+// The directories that mkdir_recursively() has found or made, so that a series of calls for the
+// files of the same tree (e.g. an extraction) don't look them up again. It's up to the caller not
+// to remove them while the cache is in use. Not thread-safe.
+class DirCache {
+ public:
+  bool Contains(const std::string& dir) const {
+    return dirs_.find(dir) != dirs_.end();
+  }
+  void Add(const std::string& dir) {
+    dirs_.insert(dir);
+  }
+
+ private:
+  std::unordered_set<std::string> dirs_;
+};
+
 // Like "mkdir -p", try to guarantee that all directories specified in path are present, creating as
 // many directories as necessary. The specified mode is passed to all mkdir calls; no modifications
 // are made to umask.
@@ -42,7 +61,18 @@ int mkdir_recursively(const std::string& path, mode_t mode, bool strip_filename,
 int mkdir_recursively(const std::string& input_path, mode_t mode, bool strip_filename,
                       const selabel_handle* sehnd, const struct utimbuf *timestamp);
 
+// As above, skipping the directories in cache (if non-NULL) and adding the ones it finds or makes.
+// The missing directories are made relative to the fd of their parent.
+int mkdir_recursively(const std::string& input_path, mode_t mode, bool strip_filename,
+                      const selabel_handle* sehnd, const struct utimbuf* timestamp,
+                      DirCache* cache);
+
 // rm -rf <path>
 int dirUnlinkHierarchy(const char *path);
 
+// As above, with the subtrees at the given depth below path removed by up to jobs threads in
+// parallel. The directories above that are walked on the calling thread and kept open until the
+// end, which bounds what a wide tree costs in fds. Falls back to the serial removal for jobs <= 1.
+int dirUnlinkHierarchy(const char* path, size_t jobs, size_t depth = 2);
+
 #endif  // OTAUTIL_DIRUTIL_H_
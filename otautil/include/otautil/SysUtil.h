@@ -17,11 +17,54 @@
 #ifndef _OTAUTIL_SYSUTIL
 #define _OTAUTIL_SYSUTIL
 
+#include <stdint.h>
 #include <sys/types.h>
 
+#include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 
+// How a mapped range is about to be accessed, given to the kernel through madvise().
+enum class MemAccess {
+  NORMAL,
+  SEQUENTIAL,  // read once, front to back (e.g. the signature verification)
+  RANDOM,      // scattered small reads (e.g. the central directory and entry lookups)
+  WILLNEED,    // about to be read (e.g. the next entry to extract); starts the readahead now
+};
+
+// Applies |access| to the pages spanning [addr, addr + length). Returns false if madvise() fails.
+bool AdviseMappedRange(const void* addr, size_t length, MemAccess access);
+
+// The binary form of a block map, which uncrypt may write instead of the text one, and which
+// MapFile() accepts as well. All the fields are little-endian. The header is followed by the path
+// of the block device (|block_dev_length| bytes, not terminated), zero-padded to a multiple of 8
+// bytes, and then |range_count| pairs of uint64_t: the start and end block of each half-open range.
+struct BlockMapHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t block_size;
+  uint64_t file_size;
+  uint64_t range_count;
+  uint32_t block_dev_length;
+  uint32_t reserved;
+};
+
+static constexpr char BLOCK_MAP_MAGIC[8] = { 'B', 'L', 'K', 'M', 'A', 'P', '\0', '\0' };
+static constexpr uint32_t BLOCK_MAP_VERSION = 1;
+
+// Returns the binary block map of a |file_size|-byte file stored in the blocks of |block_dev|
+// listed by |ranges|, as flattened [start, end) pairs.
+std::string BinaryBlockMap(const std::string& block_dev, uint64_t file_size, uint32_t block_size,
+                           const std::vector<uint64_t>& ranges);
+
+// Block maps of at least |ranges| ranges are mapped lazily: the pages are read from the block
+// device as they're first touched (through userfaultfd, where the kernel allows it), instead of
+// setting up one mapping per range. SIZE_MAX, the default, turns it off.
+void SetLazyBlockMapThreshold(size_t ranges);
+
+class LazyBlockMap;
+
 /*
  * Use this to keep track of mapped segments.
  */
@@ -30,11 +73,16 @@ class MemMapping {
   ~MemMapping();
   // Map a file into a private, read-only memory segment. If 'filename' begins with an '@'
   // character, it is a map of blocks to be mapped, otherwise it is treated as an ordinary file.
-  bool MapFile(const std::string& filename);
+  // With |populate|, an ordinary file is read in as it's mapped (MAP_POPULATE), for a caller that
+  // is about to read all of it anyway.
+  bool MapFile(const std::string& filename, bool populate = false);
   size_t ranges() const {
     return ranges_.size();
   };
 
+  // Applies |access| to [offset, offset + len) of the mapped data, clamped to its length.
+  bool Advise(MemAccess access, size_t offset = 0, size_t len = SIZE_MAX) const;
+
   unsigned char* addr;  // start of data
   size_t length;        // length of data
 
@@ -45,9 +93,16 @@ class MemMapping {
   };
 
   bool MapBlockFile(const std::string& filename);
-  bool MapFD(int fd);
+  // Maps the |range_count| ranges of |block_dev| given by |get_range| (which stores the start and
+  // end block of the i-th range, or returns false if it's malformed) to a contiguous |size| bytes.
+  bool MapBlockRanges(const std::string& block_dev, size_t size, size_t blksize,
+                      size_t range_count,
+                      const std::function<bool(size_t i, size_t* start, size_t* end)>& get_range);
+  bool MapFD(int fd, bool populate);
 
   std::vector<MappedRange> ranges_;
+  // Serves the page faults of a lazily mapped block map.
+  std::unique_ptr<LazyBlockMap> lazy_;
 };
 
 #endif  // _OTAUTIL_SYSUTIL
@@ -17,8 +17,45 @@
 #ifndef OTAUTIL_THERMALUTIL_H
 #define OTAUTIL_THERMALUTIL_H
 
+#include <stddef.h>
+
+#include <chrono>
+
 // We can find the temperature reported by all sensors in /sys/class/thermal/thermal_zone*/temp.
 // Their values are in millidegree Celsius; and we will log the maximum one.
 int GetMaxValueFromThermalZone();
 
+// Paces the concurrency of an install by the temperature of the device, so that it runs as fast as
+// it can without heating the device up to where the kernel throttles the CPUs and the storage. Each
+// time the temperature is at or above |throttle_temperature|, the allowed share of the concurrency
+// is halved; once it drops below |throttle_temperature| - |hysteresis|, the share grows back a
+// quarter at a time. Not thread-safe.
+class ThermalGovernor {
+ public:
+  ThermalGovernor(int throttle_temperature, int hysteresis, std::chrono::milliseconds interval)
+      : throttle_temperature_(throttle_temperature),
+        hysteresis_(hysteresis),
+        interval_(interval) {}
+
+  // Samples the thermal zones if |interval| has passed since the last sample, and returns how many
+  // out of |max| workers (or requests in flight) may be used. Never returns less than 1.
+  size_t Limit(size_t max);
+
+  // Adjusts the allowed share for a reading of |temperature|. A negative reading (no sensors)
+  // leaves it unchanged.
+  void Update(int temperature);
+
+  double level() const {
+    return level_;
+  }
+
+ private:
+  const int throttle_temperature_;
+  const int hysteresis_;
+  const std::chrono::milliseconds interval_;
+  std::chrono::steady_clock::time_point last_sample_;
+  bool sampled_ = false;
+  double level_ = 1.0;
+};
+
 #endif  // OTAUTIL_THERMALUTIL_H
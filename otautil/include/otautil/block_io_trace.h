@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _OTAUTIL_BLOCK_IO_TRACE_H_
+#define _OTAUTIL_BLOCK_IO_TRACE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "android-base/macros.h"
+
+// One operation on the traced device, as stored in the trace file.
+struct BlockIoRecord {
+  enum Op : uint8_t {
+    kRead,
+    kWrite,
+    kDiscard,
+    kZeroOut,
+    kFsync,
+  };
+  // Set on the requests that were submitted together (through an io_uring), which share the start
+  // time and the duration of their batch.
+  static constexpr uint8_t kQueued = 1;
+
+  uint64_t offset;
+  uint64_t length;
+  // When the operation started and how long it took, in nanoseconds since the trace started.
+  uint64_t start_ns;
+  uint64_t duration_ns;
+  // The index of the transfer command that issued it, or -1 outside of the commands.
+  int32_t command;
+  uint8_t op;
+  uint8_t flags;
+  uint8_t reserved[2];
+};
+static_assert(sizeof(BlockIoRecord) == 40, "BlockIoRecord must stay 40 bytes");
+
+// Records the reads, writes, discards, zero-outs and fsyncs the updater issues to a block device
+// (or a file standing in for one), to be replayed later without any of the CPU work around them.
+// The I/O on files other than the traced one (e.g. the stashes) is left out. Thread-safe.
+class BlockIoTrace {
+ public:
+  // The trace of the process, or nullptr when not tracing.
+  static BlockIoTrace* Get();
+  // Starts tracing the I/O on |path|. Returns false if it can't be stat'ed.
+  static bool Start(const std::string& path);
+  // Writes the trace to |path| (if not empty) and stops tracing. Returns false on write errors.
+  static bool Finish(const std::string& path);
+
+  // Sets the command index recorded for the operations of the calling thread.
+  static void SetCommand(int command);
+
+  // Returns whether |fd| refers to the traced device.
+  bool Traces(int fd) const;
+  // Returns the timestamp to pass to Record() for an operation starting now.
+  uint64_t Now() const;
+  // Records an operation on |fd| that started at |start_ns|, unless |fd| isn't the traced device.
+  void Record(int fd, uint8_t op, uint64_t offset, uint64_t length, uint64_t start_ns,
+              uint8_t flags = 0);
+
+  const std::vector<BlockIoRecord>& records() const {
+    return records_;
+  }
+
+  // The file format: the magic, the number of records, and the records in the order they were
+  // issued.
+  static constexpr const char* kMagic = "BLKIOTR1";
+  static bool Save(const std::string& path, const std::vector<BlockIoRecord>& records);
+  static bool Load(const std::string& path, std::vector<BlockIoRecord>* records);
+
+ private:
+  BlockIoTrace(dev_t dev, ino_t ino, dev_t rdev);
+
+  // The identity of the traced device: its st_rdev for a block device, or its st_dev and st_ino
+  // for a file.
+  const dev_t dev_;
+  const ino_t ino_;
+  const dev_t rdev_;
+  const std::chrono::steady_clock::time_point start_;
+
+  std::mutex mutex_;
+  std::vector<BlockIoRecord> records_;
+
+  DISALLOW_COPY_AND_ASSIGN(BlockIoTrace);
+};
+
+#endif  // _OTAUTIL_BLOCK_IO_TRACE_H_
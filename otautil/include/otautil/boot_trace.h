@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _OTAUTIL_BOOT_TRACE_H_
+#define _OTAUTIL_BOOT_TRACE_H_
+
+#include <stdint.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "android-base/macros.h"
+
+// Lightweight tracing of where the time goes, e.g. from the start of recovery to the first byte of
+// an update. The phases are timed on CLOCK_BOOTTIME, so their start also tells how long after the
+// kernel boot they ran.
+struct TraceEvent {
+  std::string name;
+  int tid;
+  int64_t start_ns;
+  int64_t end_ns;
+};
+
+// Times a phase from its construction to its destruction (or End()), on the calling thread.
+class TracePhase {
+ public:
+  explicit TracePhase(const char* name);
+  ~TracePhase() {
+    End();
+  }
+
+  // Ends the phase early. Later calls do nothing.
+  void End();
+
+ private:
+  const char* name_;
+  int64_t start_ns_;
+  bool ended_;
+
+  DISALLOW_COPY_AND_ASSIGN(TracePhase);
+};
+
+// Records a phase that has been timed on the steady clock.
+void TraceRecord(const std::string& name, std::chrono::steady_clock::time_point start,
+                 std::chrono::steady_clock::time_point end);
+
+// Returns the phases that have ended so far, in the order they ended.
+std::vector<TraceEvent> TraceEvents();
+
+// Formats |events| as a table of their start (since boot) and duration, in ms, by start time.
+std::string TraceSummary(std::vector<TraceEvent> events);
+
+// Writes all the phases to |path| in the Chrome trace event format (for chrome://tracing or
+// Perfetto). Returns false on errors.
+bool WriteChromeTrace(const std::string& path);
+
+#endif  // _OTAUTIL_BOOT_TRACE_H_
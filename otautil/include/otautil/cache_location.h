@@ -49,6 +49,20 @@ class CacheLocation {
     stash_directory_base_ = base;
   }
 
+  std::string transfer_trace_base() const {
+    return transfer_trace_base_;
+  }
+  void set_transfer_trace_base(const std::string& base) {
+    transfer_trace_base_ = base;
+  }
+
+  std::string partition_hash_cache() const {
+    return partition_hash_cache_;
+  }
+  void set_partition_hash_cache(const std::string& cache) {
+    partition_hash_cache_ = cache;
+  }
+
  private:
   CacheLocation();
   DISALLOW_COPY_AND_ASSIGN(CacheLocation);
@@ -64,6 +78,14 @@ class CacheLocation {
 
   // The base directory to write stashes during update.
   std::string stash_directory_base_;
+
+  // The prefix of the per-partition traces of the block image updates, which record the time
+  // spent in each transfer command.
+  std::string transfer_trace_base_;
+
+  // The file that keeps the SHA-1s of the partitions checked by applypatch, along with a
+  // fingerprint of their state, so that the checks at each boot don't need to read them in full.
+  std::string partition_hash_cache_;
 };
 
 #endif  // _OTAUTIL_OTAUTIL_CACHE_LOCATION_H_
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _OTAUTIL_COMMAND_PIPE_H_
+#define _OTAUTIL_COMMAND_PIPE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "android-base/macros.h"
+
+// The command pipe from the updater to the recovery. Its commands are text lines ("ui_print ...",
+// "set_progress 0.5" and so on; see try_update_binary()), which the updater writes either as they
+// are or, when the recovery passes it kFramedCommandPipeFlag, in CommandFrames.
+//
+// A framed pipe starts with a kHello frame, so that the recovery can tell it apart from the text of
+// an updater that doesn't know the flag. kCommand frames hold a command line without the newline,
+// and kSetProgress frames the fraction of a set_progress command as a double. The updater sends
+// set_progress at most once per kCommandProgressInterval, however often the script reports it; it
+// keeps the latest fraction until it's due or until another command goes out.
+struct CommandFrame {
+  enum Type : uint8_t {
+    kHello = 0,
+    kCommand = 1,
+    kSetProgress = 2,
+  };
+
+  // Followed by |length| bytes of payload.
+  uint8_t type;
+  uint8_t reserved[3];
+  uint32_t length;
+};
+
+constexpr const char* kFramedCommandPipeFlag = "--framed_pipe";
+
+constexpr std::chrono::milliseconds kCommandProgressInterval(50);
+
+// Returns a stream that writes the command lines put into it to |fd| as CommandFrames, starting
+// with a kHello frame. The stream takes over |fd|. Returns nullptr on errors.
+FILE* OpenFramedCommandPipe(int fd);
+
+// Reads the commands from the updater's end of the pipe at |fd|, in either of the formats. It reads
+// as much as there is at a time, and delivers only the last of the set_progress commands since the
+// previous other command, so the work per read stays the same however chatty the updater is.
+class CommandPipeReader {
+ public:
+  explicit CommandPipeReader(int fd) : fd_(fd) {}
+
+  // Blocks until there's more to read, and calls |on_command| with each of the command lines
+  // (without the newline) and |on_set_progress| with the coalesced set_progress fractions, in the
+  // order they came in. (A set_progress line of the text format goes to |on_command|.) Returns
+  // false at the end of the pipe, or on errors.
+  bool Read(const std::function<void(const std::string&)>& on_command,
+            const std::function<void(double)>& on_set_progress);
+
+  // Whether the updater writes frames. Only known after the first Read().
+  bool framed() const {
+    return format_ == Format::kFramed;
+  }
+
+ private:
+  enum class Format { kUnknown, kText, kFramed };
+
+  // Delivers the pending set_progress, if any.
+  void FlushProgress(const std::function<void(const std::string&)>& on_command,
+                     const std::function<void(double)>& on_set_progress);
+  void ParseText(const std::function<void(const std::string&)>& on_command);
+  // Returns false on a malformed frame.
+  bool ParseFrames(const std::function<void(const std::string&)>& on_command,
+                   const std::function<void(double)>& on_set_progress);
+
+  int fd_;
+  Format format_ = Format::kUnknown;
+  // What has been read and not parsed yet.
+  std::vector<char> buffer_;
+  size_t start_ = 0;
+
+  // The latest set_progress since the last delivered command: the fraction of a frame, or the line
+  // of the text format.
+  bool has_progress_ = false;
+  double progress_ = 0;
+  std::string progress_line_;
+
+  DISALLOW_COPY_AND_ASSIGN(CommandPipeReader);
+};
+
+#endif  // _OTAUTIL_COMMAND_PIPE_H_
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _OTAUTIL_IO_URING_H_
+#define _OTAUTIL_IO_URING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <memory>
+#include <vector>
+
+#include "android-base/macros.h"
+
+// A positional read or write of |size| bytes at |offset| of |fd|.
+struct IoRequest {
+  int fd;
+  uint8_t* data;
+  size_t size;
+  off64_t offset;
+};
+
+// Submits batches of reads or writes through an io_uring, keeping up to |depth| requests in flight
+// so that the storage sees a queue depth greater than one. The queue isn't thread-safe; each thread
+// should own its instance.
+class IoUringQueue {
+ public:
+  ~IoUringQueue();
+
+  // Returns nullptr if io_uring isn't supported by the kernel (or at build time), in which case the
+  // callers should stay with synchronous I/O.
+  static std::unique_ptr<IoUringQueue> Create(unsigned depth);
+
+  // Performs all the requests, retrying the short transfers. Returns false with errno set if any of
+  // them fails (or reaches EOF, with errno set to EIO); the remaining requests are still waited
+  // for, so that the buffers can be released once the function returns.
+  bool Read(const std::vector<IoRequest>& requests);
+  bool Write(const std::vector<IoRequest>& requests);
+
+  unsigned depth() const {
+    return depth_;
+  }
+
+  // Caps the requests kept in flight to |limit|, within [1, depth()].
+  void set_max_in_flight(unsigned limit);
+
+ private:
+  IoUringQueue() = default;
+
+  bool Perform(uint8_t opcode, const std::vector<IoRequest>& requests);
+
+  int ring_fd_ = -1;
+  unsigned depth_ = 0;
+  unsigned max_in_flight_ = 0;
+
+  void* sq_ptr_ = nullptr;
+  size_t sq_size_ = 0;
+  void* cq_ptr_ = nullptr;
+  size_t cq_size_ = 0;
+  void* sqes_ptr_ = nullptr;
+  size_t sqes_size_ = 0;
+
+  // Pointers into the shared rings. The CQE array is kept as void* to keep <linux/io_uring.h> out
+  // of the header.
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned* sq_mask_ = nullptr;
+  unsigned* sq_array_ = nullptr;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned* cq_mask_ = nullptr;
+  void* cqes_ = nullptr;
+
+  DISALLOW_COPY_AND_ASSIGN(IoUringQueue);
+};
+
+#endif  // _OTAUTIL_IO_URING_H_
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _OTAUTIL_LINE_INDEX_H_
+#define _OTAUTIL_LINE_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "android-base/macros.h"
+
+// A read-only text file with an index of its lines, for viewing large logs. The file gets mapped
+// in, and a background thread scans it for the newlines, so the lines at the start of the file can
+// be read before the whole of it has been indexed. A trailing newline doesn't start another line.
+class LineIndex {
+ public:
+  LineIndex() = default;
+  // Stops the scan if it's still running.
+  ~LineIndex();
+
+  // Maps the file open at |fd| and starts indexing it. A file that can't be mapped (an empty one,
+  // or one from procfs) is read into memory instead. Returns false on errors.
+  bool Open(int fd);
+
+  const char* data() const {
+    return data_;
+  }
+  size_t size() const {
+    return size_;
+  }
+
+  // Waits until line |line| has been indexed, or the scan has finished. Returns whether that line
+  // exists.
+  bool WaitForLine(size_t line);
+
+  // Returns the number of lines, waiting for the scan to finish.
+  size_t WaitForAll();
+
+  // Returns the number of lines indexed so far, and whether that's all of them.
+  size_t IndexedLines(bool* done = nullptr);
+
+  // Returns the offset and the length (without the newline) of |line|, which must have been
+  // indexed already.
+  void GetLine(size_t line, size_t* offset, size_t* length);
+
+  // Returns the first line from |from_line| on that contains |needle|, or that starts with it if
+  // |at_line_start| is set. Returns SIZE_MAX if there's none.
+  size_t Find(const std::string& needle, size_t from_line, bool at_line_start = false);
+
+ private:
+  void Scan();
+  // Returns the line containing |offset|, waiting for it to be indexed.
+  size_t LineAt(size_t offset);
+
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  bool mapped_ = false;
+  std::string buffer_;
+
+  std::thread scanner_;
+  std::atomic<bool> stop_{ false };
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  // Guarded by mutex_: the offsets of the line starts found so far, and how far the scan got.
+  std::vector<size_t> starts_;
+  size_t scanned_ = 0;
+  bool done_ = false;
+
+  DISALLOW_COPY_AND_ASSIGN(LineIndex);
+};
+
+#endif  // _OTAUTIL_LINE_INDEX_H_
@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _OTAUTIL_MEMORY_BUDGET_H_
+#define _OTAUTIL_MEMORY_BUDGET_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "android-base/macros.h"
+
+// The memory budget of the process, shared by its caches and its large buffers. The budget is what
+// the system has available (so it also accounts for what the other processes of the install take,
+// e.g. the updater while recovery serves the package over fuse), less a reserve that's kept for the
+// allocations that don't go through here.
+//
+// The caches register a reclaimer, and the components that need a large buffer Acquire() it
+// first. When memory runs short (or the kernel reports memory pressure), the caches are asked to
+// give theirs back before the buffer gets allocated, rather than the process getting killed.
+class MemoryBudget {
+ public:
+  // Frees up to |bytes| of a cache, and returns how much it actually freed. It gets called from
+  // the thread asking for memory, and may Release() what it frees but not ask for memory.
+  using Reclaimer = std::function<size_t(size_t bytes)>;
+
+  // The bytes kept aside by default, for the allocations the budget doesn't see.
+  static constexpr uint64_t kDefaultReserve = 100 * 1024 * 1024;
+  // The share of the last 10 seconds (in percent) with tasks stalling on memory, from which on the
+  // caches are asked to shrink regardless of the available memory.
+  static constexpr double kPressureThreshold = 10.0;
+
+  // Returns the budget of the process, whose reserve comes from ro.recovery.memory_reserve.
+  static MemoryBudget& Instance();
+
+  explicit MemoryBudget(uint64_t reserve) : reserve_(reserve) {}
+  virtual ~MemoryBudget() = default;
+
+  uint64_t reserve() const {
+    return reserve_;
+  }
+
+  // Registers a cache, and returns the id to unregister it with. The caches are reclaimed from in
+  // the order they registered.
+  int Register(Reclaimer reclaimer);
+  void Unregister(int id);
+
+  // Returns whether |bytes| more can be allocated without cutting into the reserve, after asking
+  // the caches to give back what's missing. Doesn't account for the bytes; for the callers that
+  // only decide whether to keep something in memory.
+  bool HasRoom(size_t bytes);
+
+  // Like HasRoom(), and accounts for the bytes until they're given back with Release(). The
+  // caller may still go ahead if it returns false, for an allocation it can't do without.
+  bool Acquire(size_t bytes);
+  void Release(size_t bytes);
+
+  // Returns how large a cache that currently uses |used| bytes may grow: that plus what's
+  // available on top of the reserve and |extra_reserve| (the cache's own bookkeeping, say), or
+  // half of |used| under memory pressure.
+  uint64_t CacheLimit(uint64_t used, uint64_t extra_reserve = 0);
+
+  // The bytes acquired and not given back yet, and the most there have been.
+  uint64_t acquired() const;
+  uint64_t peak() const;
+
+  // Returns the memory available to new allocations: MemAvailable, or MemFree + Buffers + Cached
+  // on the kernels without it.
+  static uint64_t AvailableMemory();
+  // Returns the memory pressure (in the unit of kPressureThreshold), or 0 if the kernel doesn't
+  // report pressure stall information.
+  static double MemoryPressure();
+
+ protected:
+  // Overridden by the tests.
+  virtual uint64_t Available() {
+    return AvailableMemory();
+  }
+  virtual double Pressure() {
+    return MemoryPressure();
+  }
+
+ private:
+  // Asks the caches for |bytes|, and returns how much they freed.
+  size_t Reclaim(size_t bytes);
+
+  const uint64_t reserve_;
+
+  // Held while calling the reclaimers, so that a cache can't go away from under a reclaim.
+  std::mutex reclaim_mutex_;
+  mutable std::mutex mutex_;
+  std::vector<std::pair<int, Reclaimer>> reclaimers_;
+  int next_id_ = 0;
+  uint64_t acquired_ = 0;
+  uint64_t peak_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(MemoryBudget);
+};
+
+#endif  // _OTAUTIL_MEMORY_BUDGET_H_
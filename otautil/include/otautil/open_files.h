@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _OTAUTIL_OPEN_FILES_H_
+#define _OTAUTIL_OPEN_FILES_H_
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+// A snapshot of the files all the processes have open, taken from /proc in one pass. Each process
+// directory is opened once, its fd directory is listed with getdents64() and the links are read
+// with readlinkat() relative to it, so that a scan doesn't build and resolve a path per fd.
+class OpenFiles {
+ public:
+  enum class Kind {
+    kFd,
+    kMap,
+    kCwd,
+    kRoot,
+    kExe,
+  };
+
+  struct Entry {
+    pid_t pid;
+    Kind kind;
+    std::string path;
+  };
+
+  // Scans /proc. The file mappings from /proc/<pid>/maps are only collected if |with_maps| is
+  // set. Returns false if /proc can't be read; processes that go away or can't be inspected
+  // during the scan are skipped.
+  bool Scan(bool with_maps);
+
+  bool with_maps() const {
+    return with_maps_;
+  }
+  std::chrono::steady_clock::time_point taken() const {
+    return taken_;
+  }
+  // The entries, grouped by process in the order of /proc.
+  const std::vector<Entry>& entries() const {
+    return entries_;
+  }
+
+  // Returns a snapshot no older than |max_age|, reusing the last one taken through this function
+  // if it's recent enough (and has the maps if |with_maps| is set). Returns nullptr if /proc
+  // can't be read. Safe to call from multiple threads.
+  static std::shared_ptr<const OpenFiles> Get(std::chrono::milliseconds max_age, bool with_maps);
+
+  // Drops the snapshot kept by Get(), e.g. after signalling the processes in it.
+  static void Invalidate();
+
+ private:
+  void ScanProcess(int proc_fd, pid_t pid, bool with_maps);
+
+  bool with_maps_ = false;
+  std::chrono::steady_clock::time_point taken_;
+  std::vector<Entry> entries_;
+};
+
+#endif  // _OTAUTIL_OPEN_FILES_H_
@@ -17,7 +17,10 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 
+#include <iterator>
+#include <map>
 #include <string>
 #include <utility>
 #include <vector>
@@ -26,7 +29,108 @@ using Range = std::pair<size_t, size_t>;
 
 class RangeSet {
  public:
-  RangeSet() : blocks_(0) {}
+  // Iterates over the Ranges by value, as they're stored as 32-bit block numbers where possible.
+  // The Ranges can't be modified through the iterators.
+  template <bool kReverse>
+  class Iterator {
+   public:
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = Range;
+    using difference_type = ptrdiff_t;
+    using reference = Range;
+
+    // Holds the Range for operator->(), like the proxies of std::vector<bool>.
+    class pointer {
+     public:
+      explicit pointer(Range range) : range_(range) {}
+      const Range* operator->() const {
+        return &range_;
+      }
+
+     private:
+      Range range_;
+    };
+
+    Iterator() : rs_(nullptr), pos_(0) {}
+    Iterator(const RangeSet* rs, size_t pos) : rs_(rs), pos_(pos) {}
+
+    Range operator*() const {
+      return rs_->Get(kReverse ? rs_->size() - 1 - pos_ : pos_);
+    }
+    pointer operator->() const {
+      return pointer(**this);
+    }
+    Range operator[](difference_type n) const {
+      return *(*this + n);
+    }
+
+    Iterator& operator++() {
+      pos_++;
+      return *this;
+    }
+    Iterator operator++(int) {
+      Iterator it = *this;
+      pos_++;
+      return it;
+    }
+    Iterator& operator--() {
+      pos_--;
+      return *this;
+    }
+    Iterator operator--(int) {
+      Iterator it = *this;
+      pos_--;
+      return it;
+    }
+    Iterator& operator+=(difference_type n) {
+      pos_ += n;
+      return *this;
+    }
+    Iterator& operator-=(difference_type n) {
+      pos_ -= n;
+      return *this;
+    }
+    Iterator operator+(difference_type n) const {
+      return Iterator(rs_, pos_ + n);
+    }
+    friend Iterator operator+(difference_type n, const Iterator& it) {
+      return it + n;
+    }
+    Iterator operator-(difference_type n) const {
+      return Iterator(rs_, pos_ - n);
+    }
+    difference_type operator-(const Iterator& other) const {
+      return static_cast<difference_type>(pos_) - static_cast<difference_type>(other.pos_);
+    }
+
+    bool operator==(const Iterator& other) const {
+      return pos_ == other.pos_;
+    }
+    bool operator!=(const Iterator& other) const {
+      return pos_ != other.pos_;
+    }
+    bool operator<(const Iterator& other) const {
+      return pos_ < other.pos_;
+    }
+    bool operator>(const Iterator& other) const {
+      return pos_ > other.pos_;
+    }
+    bool operator<=(const Iterator& other) const {
+      return pos_ <= other.pos_;
+    }
+    bool operator>=(const Iterator& other) const {
+      return pos_ >= other.pos_;
+    }
+
+   private:
+    const RangeSet* rs_;
+    size_t pos_;
+  };
+
+  using const_iterator = Iterator<false>;
+  using const_reverse_iterator = Iterator<true>;
+
+  RangeSet() : blocks_(0), wide_(false) {}
 
   explicit RangeSet(std::vector<Range>&& pairs);
 
@@ -34,6 +138,10 @@ class RangeSet {
   // errors.
   static RangeSet Parse(const std::string& range_text);
 
+  // Same as above, but parses the |len| chars at |text|, which don't need to be null-terminated.
+  // The text isn't copied or split, so it can point into a larger buffer, e.g. a transfer list.
+  static RangeSet Parse(const char* text, size_t len);
+
   // Appends the given Range to the current RangeSet.
   bool PushBack(Range range);
 
@@ -59,7 +167,7 @@ class RangeSet {
 
   // Returns the number of Range's in this RangeSet.
   size_t size() const {
-    return ranges_.size();
+    return words_.size() / (wide_ ? 4 : 2);
   }
 
   // Returns the total number of blocks in this RangeSet.
@@ -67,61 +175,79 @@ class RangeSet {
     return blocks_;
   }
 
-  std::vector<Range>::const_iterator cbegin() const {
-    return ranges_.cbegin();
-  }
-
-  std::vector<Range>::const_iterator cend() const {
-    return ranges_.cend();
-  }
-
-  std::vector<Range>::iterator begin() {
-    return ranges_.begin();
+  const_iterator cbegin() const {
+    return const_iterator(this, 0);
   }
 
-  std::vector<Range>::iterator end() {
-    return ranges_.end();
+  const_iterator cend() const {
+    return const_iterator(this, size());
   }
 
-  std::vector<Range>::const_iterator begin() const {
-    return ranges_.begin();
+  const_iterator begin() const {
+    return cbegin();
   }
 
-  std::vector<Range>::const_iterator end() const {
-    return ranges_.end();
+  const_iterator end() const {
+    return cend();
   }
 
   // Reverse const iterators for MoveRange().
-  std::vector<Range>::const_reverse_iterator crbegin() const {
-    return ranges_.crbegin();
+  const_reverse_iterator crbegin() const {
+    return const_reverse_iterator(this, 0);
   }
 
-  std::vector<Range>::const_reverse_iterator crend() const {
-    return ranges_.crend();
+  const_reverse_iterator crend() const {
+    return const_reverse_iterator(this, size());
   }
 
   // Returns whether the RangeSet is valid (i.e. non-empty).
   explicit operator bool() const {
-    return !ranges_.empty();
+    return !words_.empty();
   }
 
-  const Range& operator[](size_t i) const {
-    return ranges_[i];
+  Range operator[](size_t i) const {
+    return Get(i);
   }
 
   bool operator==(const RangeSet& other) const {
-    // The orders of Range's matter. "4,1,5,8,10" != "4,8,10,1,5".
-    return (ranges_ == other.ranges_);
+    // The orders of Range's matter. "4,1,5,8,10" != "4,8,10,1,5". A RangeSet only goes wide for a
+    // block number that doesn't fit in 32 bits, so equal ones are always stored the same way.
+    return wide_ == other.wide_ && words_ == other.words_;
   }
 
   bool operator!=(const RangeSet& other) const {
-    return ranges_ != other.ranges_;
+    return !(*this == other);
   }
 
  protected:
-  // Actual limit for each value and the total number are both INT_MAX.
-  std::vector<Range> ranges_;
+  Range Get(size_t i) const {
+    if (!wide_) {
+      return Range(words_[2 * i], words_[2 * i + 1]);
+    }
+    const uint32_t* w = &words_[4 * i];
+    return Range(Widen(w[0], w[1]), Widen(w[2], w[3]));
+  }
+
+  // Appends |range| without checking it, after PushBack() or the callers have.
+  void Append(Range range);
+
+  // Returns a copy of the Ranges.
+  std::vector<Range> ToVector() const {
+    return std::vector<Range>(cbegin(), cend());
+  }
+
+  // The Ranges, as pairs of 32-bit block numbers. Once a block number doesn't fit (which Parse()
+  // never allows, as the limit of each value is INT_MAX), all of them are stored as the low and
+  // high words of 64-bit ones instead. That halves the memory of the RangeSets in the transfer
+  // lists compared to a vector of Range's.
+  std::vector<uint32_t> words_;
   size_t blocks_;
+  bool wide_;
+
+ private:
+  static size_t Widen(uint32_t low, uint32_t high) {
+    return static_cast<size_t>((static_cast<uint64_t>(high) << 32) | low);
+  }
 };
 
 // The class is a sorted version of a RangeSet; and it's useful in imgdiff to split the input
@@ -168,3 +294,57 @@ class SortedRangeSet : public RangeSet {
   // + 10) in a range represented by this SortedRangeSet.
   size_t GetOffsetInRangeSet(size_t old_offset) const;
 };
+
+// An index of the blocks covered by a changing collection of RangeSets, for the overlap and
+// containment queries in O(log n) rather than scanning every range of every set. Each block is
+// reference counted, so a RangeSet can be removed again without affecting the blocks that other
+// RangeSets still cover.
+class RangeIndex {
+ public:
+  RangeIndex() : blocks_(0) {}
+
+  // Adds a reference to each block of |rs|. This is the union of the index and |rs|.
+  void Insert(const RangeSet& rs);
+
+  // Drops a reference to each block of |rs|, which must have been inserted before.
+  void Remove(const RangeSet& rs);
+
+  void Clear() {
+    segments_.clear();
+    blocks_ = 0;
+  }
+
+  // Returns whether any of the indexed blocks is within |rs|.
+  bool Overlaps(const RangeSet& rs) const;
+
+  // Returns whether all the blocks of |rs| are indexed.
+  bool Contains(const RangeSet& rs) const;
+
+  // Returns the blocks of |rs| that are indexed, sorted by the block numbers.
+  RangeSet Intersect(const RangeSet& rs) const;
+
+  // Returns the number of distinct blocks being indexed.
+  size_t blocks() const {
+    return blocks_;
+  }
+
+  bool empty() const {
+    return segments_.empty();
+  }
+
+ private:
+  struct Segment {
+    size_t end;
+    size_t refs;
+  };
+
+  bool Overlaps(const Range& range) const;
+
+  // Splits the segment that covers |block| at it, so that a segment starts at |block| if covered.
+  void SplitAt(size_t block);
+
+  // Disjoint segments of blocks with the same reference count, keyed by their start blocks. The
+  // blocks that aren't indexed have no segment.
+  std::map<size_t, Segment> segments_;
+  size_t blocks_;
+};
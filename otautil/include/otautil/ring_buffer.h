@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _OTAUTIL_RING_BUFFER_H_
+#define _OTAUTIL_RING_BUFFER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+#include "android-base/macros.h"
+
+// A bounded single-producer single-consumer byte queue. The two sides only exchange the atomic
+// read and write cursors as long as the buffer is neither full nor empty; the mutex and condition
+// variable are only used to put the producer (resp. the consumer) to sleep when it can't proceed.
+class RingBuffer {
+ public:
+  explicit RingBuffer(size_t capacity);
+
+  // Appends |size| bytes to the buffer, blocking while it's full. Returns false if the reader side
+  // has been closed, in which case some of the data may have been discarded.
+  bool Write(const uint8_t* data, size_t size);
+
+  // Reads up to |size| bytes, blocking until there's some data available. Returns the number of
+  // bytes read, or 0 if the writer side has been closed and all the data has been consumed.
+  size_t Read(uint8_t* data, size_t size);
+
+  // Called by the producer once it has written all the data.
+  void CloseWrite();
+
+  // Called by the consumer to stop accepting data, which unblocks a waiting producer.
+  void CloseRead();
+
+  size_t capacity() const {
+    return capacity_;
+  }
+
+ private:
+  void WakeUp();
+
+  const size_t capacity_;
+  std::unique_ptr<uint8_t[]> data_;
+
+  // Total number of bytes that have been written to / read from the buffer. The offset into data_
+  // is the cursor modulo capacity_.
+  std::atomic<uint64_t> write_pos_;
+  std::atomic<uint64_t> read_pos_;
+
+  std::atomic<bool> write_closed_;
+  std::atomic<bool> read_closed_;
+  // Set by either side before going to sleep, so that the other one knows it needs to wake it up.
+  std::atomic<bool> waiting_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+
+  DISALLOW_COPY_AND_ASSIGN(RingBuffer);
+};
+
+#endif  // _OTAUTIL_RING_BUFFER_H_
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _OTAUTIL_SENSOR_SERVICE_H_
+#define _OTAUTIL_SENSOR_SERVICE_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "android-base/macros.h"
+
+struct BatteryReading {
+  // Unknown charge statuses count as charged.
+  bool charged = true;
+  // In percent. Devices that can't report it (e.g. ones without a battery) read 100.
+  int capacity = 100;
+  // Whether |capacity| came from the battery driver.
+  bool capacity_valid = false;
+};
+
+// Polls the battery, the charger and the thermal zones on a background thread, and publishes the
+// latest readings through atomics. The UI and the install paths read those instead of going to
+// healthd or sysfs themselves, so they never block on the sensors.
+class SensorService {
+ public:
+  using BatteryReader = std::function<BatteryReading()>;
+  using TemperatureReader = std::function<int()>;
+
+  SensorService() = default;
+  ~SensorService() {
+    Stop();
+  }
+
+  // The instance shared by recovery.
+  static SensorService& Get();
+
+  // Starts polling the battery with |battery_reader| every |battery_interval|, and the
+  // temperature with |temperature_reader| (by default the max of the thermal zones) every
+  // |thermal_interval|. Does nothing if the service is already running.
+  void Start(BatteryReader battery_reader, std::chrono::milliseconds battery_interval,
+             std::chrono::milliseconds thermal_interval,
+             TemperatureReader temperature_reader = nullptr);
+  void Stop();
+
+  bool running() const {
+    return running_.load();
+  }
+
+  // The latest battery reading. The defaults until the first poll.
+  BatteryReading battery() const;
+
+  // Waits up to |timeout| for a battery reading newer than |seq|, starting with 0, and returns the
+  // sequence number of the latest one.
+  uint64_t WaitForBatteryReading(uint64_t seq, std::chrono::milliseconds timeout);
+
+  // The latest maximum temperature of the thermal zones, in millidegree Celsius, or -1 if unknown.
+  // Reads the thermal zones directly when the service isn't running.
+  int temperature() const;
+
+  // The highest temperature polled since the last ResetPeakTemperature(), or -1.
+  int peak_temperature() const {
+    return peak_temperature_.load();
+  }
+  void ResetPeakTemperature() {
+    peak_temperature_.store(temperature_.load());
+  }
+
+ private:
+  void Run(std::chrono::milliseconds battery_interval, std::chrono::milliseconds thermal_interval);
+  void PublishTemperature(int temperature);
+
+  BatteryReader battery_reader_;
+  TemperatureReader temperature_reader_;
+
+  // The battery reading, packed as the capacity in the low 32 bits and the flags above it, so that
+  // it's published in one store. 0 until the first poll.
+  std::atomic<uint64_t> battery_{ 0 };
+  std::atomic<int> temperature_{ -1 };
+  std::atomic<int> peak_temperature_{ -1 };
+
+  std::atomic<bool> running_{ false };
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  // Guarded by mutex_.
+  uint64_t battery_seq_ = 0;
+  bool stop_ = false;
+
+  DISALLOW_COPY_AND_ASSIGN(SensorService);
+};
+
+#endif  // _OTAUTIL_SENSOR_SERVICE_H_
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _OTAUTIL_SPARSE_IMAGE_H_
+#define _OTAUTIL_SPARSE_IMAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "android-base/macros.h"
+
+// The headers of the Android sparse image format (as written by img2simg and read by fastboot):
+// a SparseHeader, followed by |total_chunks| chunks of a SparseChunkHeader and its payload each.
+struct SparseHeader {
+  uint32_t magic;
+  uint16_t major_version;
+  uint16_t minor_version;
+  uint16_t file_hdr_sz;
+  uint16_t chunk_hdr_sz;
+  uint32_t blk_sz;
+  uint32_t total_blks;
+  uint32_t total_chunks;
+  uint32_t image_checksum;
+};
+
+struct SparseChunkHeader {
+  uint16_t chunk_type;
+  uint16_t reserved1;
+  // In blocks of the output image.
+  uint32_t chunk_sz;
+  // In bytes of the input, including this header.
+  uint32_t total_sz;
+};
+
+constexpr uint32_t kSparseHeaderMagic = 0xed26ff3a;
+// The payload is |chunk_sz| blocks of data.
+constexpr uint16_t kSparseChunkRaw = 0xcac1;
+// The payload is a 4-byte pattern to repeat over |chunk_sz| blocks.
+constexpr uint16_t kSparseChunkFill = 0xcac2;
+// No payload; the blocks are left as they are.
+constexpr uint16_t kSparseChunkDontCare = 0xcac3;
+// The payload is a CRC32 of the image so far, which isn't checked.
+constexpr uint16_t kSparseChunkCrc32 = 0xcac4;
+
+// Returns whether |data| starts with a header of a sparse image of a version we can read.
+bool IsSparseImage(const uint8_t* data, size_t len);
+
+// Expands a sparse image into the file or the block device at |fd| as its bytes are passed in, in
+// pieces of any size. RAW chunks are written from the input as they come, DONT_CARE chunks are
+// skipped (the blocks keep their contents), and FILL chunks of zeros on block devices are discarded
+// with BLKZEROOUT. In kVerify mode, nothing is written; the RAW and FILL chunks are read back from
+// |fd| and compared instead.
+class SparseImageStream {
+ public:
+  enum class Mode { kWrite, kVerify };
+
+  SparseImageStream(int fd, Mode mode);
+
+  // Takes the next |len| bytes of the image. Returns false if the image is malformed, or on I/O
+  // errors or a mismatch, and for everything passed in after that.
+  bool Write(const uint8_t* data, size_t len);
+
+  // Checks that the image was complete. When writing to a regular file, it also extends the file to
+  // the size of the expanded image, which the DONT_CARE chunks at the end would leave it short of.
+  bool Finish();
+
+  // The size of the expanded image, once its header is in.
+  uint64_t size() const {
+    return static_cast<uint64_t>(header_.total_blks) * header_.blk_sz;
+  }
+
+  // The bytes written (or compared) from RAW and FILL chunks, and those of them that went to
+  // BLKZEROOUT, so far.
+  uint64_t bytes_written() const {
+    return bytes_written_;
+  }
+  uint64_t bytes_zeroed() const {
+    return bytes_zeroed_;
+  }
+
+ private:
+  enum class State { kFileHeader, kChunkHeader, kRaw, kFill, kSkip, kDone, kError };
+
+  // Collects the bytes of a header (or of a fill pattern) into |pending_| until it has |size| of
+  // them. Returns whether it's complete.
+  bool Gather(const uint8_t** data, size_t* len, size_t size);
+  bool ParseFileHeader();
+  bool ParseChunkHeader();
+  bool WriteRaw(const uint8_t* data, size_t len);
+  bool WriteFill(uint32_t pattern, uint64_t len);
+  // Moves on to the next chunk header, or to kDone after the last chunk.
+  void NextChunk();
+
+  int fd_;
+  Mode mode_;
+  bool block_device_;
+  // Cleared once BLKZEROOUT has failed, as the device doesn't support it then.
+  bool zero_out_;
+
+  State state_ = State::kFileHeader;
+  SparseHeader header_ = {};
+  std::vector<uint8_t> pending_;
+  // The chunks and the output blocks seen so far.
+  uint32_t chunks_ = 0;
+  uint32_t blocks_ = 0;
+  // Where the current chunk goes, and the bytes left of it (or of what's being skipped).
+  uint64_t offset_ = 0;
+  uint64_t remaining_ = 0;
+  // A buffer of the fill pattern, and one of what's read back in kVerify mode.
+  std::vector<uint8_t> fill_buffer_;
+  std::vector<uint8_t> read_buffer_;
+
+  uint64_t bytes_written_ = 0;
+  uint64_t bytes_zeroed_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(SparseImageStream);
+};
+
+#endif  // _OTAUTIL_SPARSE_IMAGE_H_
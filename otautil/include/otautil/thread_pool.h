@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _OTAUTIL_THREAD_POOL_H_
+#define _OTAUTIL_THREAD_POOL_H_
+
+#include <stddef.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "android-base/macros.h"
+
+// A fixed set of worker threads that run the submitted tasks. Each worker has its own queues, one
+// per priority; a task submitted from a worker goes to that worker's queue, and the other ones to
+// the workers in turn. An idle worker takes the most recent task from its own queues, or steals the
+// oldest one from another worker's, always going for the higher priorities first.
+//
+// The number of queued tasks is bounded: Submit() blocks while the queues are full, except on the
+// workers themselves, which run the task inline instead so that nested tasks can't deadlock.
+class ThreadPool {
+ public:
+  enum class Priority { kHigh = 0, kNormal = 1, kLow = 2 };
+
+  static constexpr size_t kDefaultMaxQueued = 1024;
+
+  struct Options {
+    // The number of workers, or 0 for one per CPU.
+    size_t threads = 0;
+    // The maximum number of tasks waiting to run.
+    size_t max_queued = kDefaultMaxQueued;
+    // The CPUs that the workers may run on, or empty for all of them.
+    std::vector<int> cpus;
+  };
+
+  explicit ThreadPool(size_t threads) : ThreadPool(MakeOptions(threads)) {}
+  explicit ThreadPool(const Options& options);
+  // Runs the tasks already queued, unless the pool has been cancelled, and joins the workers.
+  ~ThreadPool();
+
+  // Queues |task| to run on a worker. Returns false if the pool has been cancelled, in which case
+  // the task is dropped.
+  bool Submit(std::function<void()> task, Priority priority = Priority::kNormal);
+
+  // Queues |func| and returns the future of its result. Dropping the task with Cancel() breaks the
+  // promise, so the result of a cancelled task mustn't be waited for.
+  template <typename Func>
+  std::future<typename std::result_of<Func()>::type> Async(Func&& func,
+                                                           Priority priority = Priority::kNormal) {
+    using Result = typename std::result_of<Func()>::type;
+    auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<Func>(func));
+    std::future<Result> future = task->get_future();
+    Submit([task]() { (*task)(); }, priority);
+    return future;
+  }
+
+  // Waits until all the submitted tasks have run or been dropped.
+  void Wait();
+
+  // Runs one of the queued tasks on the calling thread. Returns false if none was queued.
+  bool RunQueuedTask();
+
+  // Waits for the result of a task queued with Async(), running the other queued tasks meanwhile,
+  // so that a worker waiting for a task it submitted doesn't take a thread away from the pool.
+  template <typename Result>
+  Result Await(std::future<Result>& future) {
+    while (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+      if (!RunQueuedTask()) {
+        future.wait_for(std::chrono::milliseconds(1));
+      }
+    }
+    return future.get();
+  }
+
+  // Drops the tasks that haven't started yet, and rejects the later ones. The running tasks may
+  // check cancelled() to stop early. Returns the number of dropped tasks.
+  size_t Cancel();
+
+  bool cancelled() const {
+    return cancelled_.load();
+  }
+
+  size_t size() const {
+    return workers_.size();
+  }
+
+  // Runs |work| for each index in [0, |count|) on the workers and the calling thread, and stops
+  // handing out indices once it returns false. At most |max_threads| threads, the calling one
+  // included, run it at the same time (0 for no limit). Returns whether all the calls succeeded.
+  bool ParallelFor(size_t count, const std::function<bool(size_t)>& work, size_t max_threads = 0);
+
+  // The pool shared by the recovery components, with one worker per CPU.
+  static ThreadPool& Shared();
+
+  // The index of the calling worker in its pool, or -1 if it's not a worker.
+  static int CurrentWorker();
+
+ private:
+  using Task = std::function<void()>;
+  static constexpr size_t kPriorities = 3;
+
+  struct Worker {
+    std::mutex mutex;
+    std::deque<Task> queues[kPriorities];
+  };
+
+  static Options MakeOptions(size_t threads) {
+    Options options;
+    options.threads = threads;
+    return options;
+  }
+
+  void Run(size_t index, const std::vector<int>& cpus);
+  // Takes a task for the worker |index| (or for a thread outside of the pool with -1).
+  bool TakeTask(int index, Task* task);
+  void FinishTask();
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::thread> threads_;
+  const size_t max_queued_;
+  std::atomic<size_t> next_worker_{ 0 };
+  std::atomic<bool> cancelled_{ false };
+
+  std::mutex mutex_;
+  // Signaled when a task gets queued, or the pool is stopping.
+  std::condition_variable work_cv_;
+  // Signaled when a queued task is taken, or all the tasks are done.
+  std::condition_variable space_cv_;
+  // Guarded by mutex_.
+  size_t queued_ = 0;
+  size_t pending_ = 0;
+  bool stopping_ = false;
+
+  DISALLOW_COPY_AND_ASSIGN(ThreadPool);
+};
+
+#endif  // _OTAUTIL_THREAD_POOL_H_
@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/io_uring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+
+#include <android-base/logging.h>
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+
+IoUringQueue::~IoUringQueue() {
+  if (sqes_ptr_ != nullptr) munmap(sqes_ptr_, sqes_size_);
+  if (cq_ptr_ != nullptr) munmap(cq_ptr_, cq_size_);
+  if (sq_ptr_ != nullptr) munmap(sq_ptr_, sq_size_);
+  if (ring_fd_ != -1) close(ring_fd_);
+}
+
+void IoUringQueue::set_max_in_flight(unsigned limit) {
+  max_in_flight_ = std::max(1U, std::min(limit, depth_));
+}
+
+#ifdef HAVE_IO_URING
+
+std::unique_ptr<IoUringQueue> IoUringQueue::Create(unsigned depth) {
+  io_uring_params params = {};
+  int ring_fd = syscall(__NR_io_uring_setup, depth, &params);
+  if (ring_fd == -1) {
+    PLOG(INFO) << "io_uring is unavailable";
+    return nullptr;
+  }
+
+  std::unique_ptr<IoUringQueue> queue(new IoUringQueue());
+  queue->ring_fd_ = ring_fd;
+  // The completion queue is at least twice as large as the submission queue, so it never overflows
+  // as long as we don't have more than sq_entries requests in flight.
+  queue->depth_ = std::min(depth, params.sq_entries);
+  queue->max_in_flight_ = queue->depth_;
+
+  queue->sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  queue->sq_ptr_ = mmap(nullptr, queue->sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring_fd, IORING_OFF_SQ_RING);
+  if (queue->sq_ptr_ == MAP_FAILED) {
+    queue->sq_ptr_ = nullptr;
+    PLOG(ERROR) << "Failed to map the io_uring submission queue";
+    return nullptr;
+  }
+
+  queue->cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  queue->cq_ptr_ = mmap(nullptr, queue->cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring_fd, IORING_OFF_CQ_RING);
+  if (queue->cq_ptr_ == MAP_FAILED) {
+    queue->cq_ptr_ = nullptr;
+    PLOG(ERROR) << "Failed to map the io_uring completion queue";
+    return nullptr;
+  }
+
+  queue->sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  queue->sqes_ptr_ = mmap(nullptr, queue->sqes_size_, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (queue->sqes_ptr_ == MAP_FAILED) {
+    queue->sqes_ptr_ = nullptr;
+    PLOG(ERROR) << "Failed to map the io_uring submission entries";
+    return nullptr;
+  }
+
+  uint8_t* sq = static_cast<uint8_t*>(queue->sq_ptr_);
+  queue->sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  queue->sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  queue->sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  queue->sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  uint8_t* cq = static_cast<uint8_t*>(queue->cq_ptr_);
+  queue->cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  queue->cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  queue->cq_mask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  queue->cqes_ = cq + params.cq_off.cqes;
+
+  return queue;
+}
+
+bool IoUringQueue::Perform(uint8_t opcode, const std::vector<IoRequest>& requests) {
+  std::vector<iovec> iovs(requests.size());
+  std::vector<size_t> done(requests.size(), 0);
+  std::deque<size_t> pending;
+  for (size_t i = 0; i < requests.size(); i++) {
+    if (requests[i].size > 0) pending.push_back(i);
+  }
+
+  io_uring_sqe* sqes = static_cast<io_uring_sqe*>(sqes_ptr_);
+  io_uring_cqe* cqes = static_cast<io_uring_cqe*>(cqes_);
+  size_t in_flight = 0;
+  int error = 0;
+  while (in_flight > 0 || (error == 0 && !pending.empty())) {
+    // Queue up as many requests as the ring allows; stop submitting new ones after an error.
+    unsigned tail = *sq_tail_;
+    while (error == 0 && !pending.empty() && in_flight < max_in_flight_) {
+      size_t index = pending.front();
+      pending.pop_front();
+      const IoRequest& request = requests[index];
+      iovs[index].iov_base = request.data + done[index];
+      iovs[index].iov_len = request.size - done[index];
+
+      unsigned slot = tail & *sq_mask_;
+      io_uring_sqe* sqe = &sqes[slot];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = opcode;
+      sqe->fd = request.fd;
+      sqe->addr = reinterpret_cast<uintptr_t>(&iovs[index]);
+      sqe->len = 1;
+      sqe->off = request.offset + done[index];
+      sqe->user_data = index;
+      sq_array_[slot] = slot;
+      tail++;
+      in_flight++;
+    }
+    __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+
+    // Submit whatever the kernel hasn't consumed yet, and wait for at least one completion.
+    unsigned to_submit = tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (syscall(__NR_io_uring_enter, ring_fd_, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0) ==
+        -1) {
+      if (errno == EINTR) continue;
+      if (to_submit == 0) {
+        // We can't reap the requests that are in flight, which may still be using the buffers.
+        PLOG(FATAL) << "Failed to wait for " << in_flight << " io_uring request(s)";
+      }
+      PLOG(ERROR) << "Failed to submit " << to_submit << " io_uring request(s)";
+      error = errno;
+      // Take back the entries that the kernel hasn't consumed, and wait for the rest.
+      unsigned sq_head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+      in_flight -= tail - sq_head;
+      __atomic_store_n(sq_tail_, sq_head, __ATOMIC_RELEASE);
+    }
+
+    unsigned head = *cq_head_;
+    unsigned cq_tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != cq_tail; head++) {
+      const io_uring_cqe& cqe = cqes[head & *cq_mask_];
+      size_t index = cqe.user_data;
+      in_flight--;
+      if (cqe.res < 0) {
+        error = -cqe.res;
+      } else if (cqe.res == 0) {
+        // Unexpected EOF.
+        error = EIO;
+      } else {
+        done[index] += cqe.res;
+        if (done[index] < requests[index].size) {
+          pending.push_back(index);
+        }
+      }
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+
+  if (error != 0) {
+    errno = error;
+    return false;
+  }
+  return true;
+}
+
+bool IoUringQueue::Read(const std::vector<IoRequest>& requests) {
+  return Perform(IORING_OP_READV, requests);
+}
+
+bool IoUringQueue::Write(const std::vector<IoRequest>& requests) {
+  return Perform(IORING_OP_WRITEV, requests);
+}
+
+#else  // HAVE_IO_URING
+
+std::unique_ptr<IoUringQueue> IoUringQueue::Create(unsigned) {
+  return nullptr;
+}
+
+bool IoUringQueue::Perform(uint8_t, const std::vector<IoRequest>&) {
+  errno = ENOSYS;
+  return false;
+}
+
+bool IoUringQueue::Read(const std::vector<IoRequest>& requests) {
+  return Perform(0, requests);
+}
+
+bool IoUringQueue::Write(const std::vector<IoRequest>& requests) {
+  return Perform(0, requests);
+}
+
+#endif  // HAVE_IO_URING
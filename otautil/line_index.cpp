@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/line_index.h"
+
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+
+// The scan publishes the line starts it has found after each chunk of this size.
+static constexpr size_t kScanChunkSize = 1024 * 1024;
+
+LineIndex::~LineIndex() {
+  stop_ = true;
+  if (scanner_.joinable()) {
+    scanner_.join();
+  }
+  if (mapped_) {
+    munmap(const_cast<char*>(data_), size_);
+  }
+}
+
+bool LineIndex::Open(int fd) {
+  CHECK(data_ == nullptr) << "Already opened";
+  struct stat sb;
+  if (fstat(fd, &sb) == -1) {
+    PLOG(ERROR) << "Failed to stat " << fd;
+    return false;
+  }
+  void* addr = sb.st_size > 0 ? mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+                              : MAP_FAILED;
+  if (addr != MAP_FAILED) {
+    data_ = static_cast<const char*>(addr);
+    size_ = sb.st_size;
+    mapped_ = true;
+    // The scan and the viewer both go through the file in order.
+    madvise(addr, size_, MADV_SEQUENTIAL);
+  } else {
+    if (!android::base::ReadFdToString(fd, &buffer_)) {
+      PLOG(ERROR) << "Failed to read " << fd;
+      return false;
+    }
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+  }
+
+  scanner_ = std::thread(&LineIndex::Scan, this);
+  return true;
+}
+
+void LineIndex::Scan() {
+  std::vector<size_t> found;
+  if (size_ > 0) {
+    found.push_back(0);
+  }
+  size_t offset = 0;
+  while (offset < size_ && !stop_) {
+    size_t end = std::min(size_, offset + kScanChunkSize);
+    // memchr() is vectorized, and most of the time goes to the bytes between the newlines.
+    for (const char* p = data_ + offset;
+         (p = static_cast<const char*>(memchr(p, '\n', data_ + end - p))) != nullptr;) {
+      ++p;
+      if (p < data_ + size_) {
+        found.push_back(p - data_);
+      }
+    }
+    offset = end;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    starts_.insert(starts_.end(), found.begin(), found.end());
+    scanned_ = offset;
+    found.clear();
+    cv_.notify_all();
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  starts_.insert(starts_.end(), found.begin(), found.end());
+  done_ = true;
+  cv_.notify_all();
+}
+
+bool LineIndex::WaitForLine(size_t line) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this, line]() { return line < starts_.size() || done_; });
+  return line < starts_.size();
+}
+
+size_t LineIndex::WaitForAll() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this]() { return done_; });
+  return starts_.size();
+}
+
+size_t LineIndex::IndexedLines(bool* done) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (done != nullptr) {
+    *done = done_;
+  }
+  return starts_.size();
+}
+
+void LineIndex::GetLine(size_t line, size_t* offset, size_t* length) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  CHECK_LT(line, starts_.size());
+  *offset = starts_[line];
+  size_t end;
+  if (line + 1 < starts_.size()) {
+    end = starts_[line + 1] - 1;
+  } else {
+    // The next line may not have been indexed yet.
+    lock.unlock();
+    const char* newline = static_cast<const char*>(memchr(data_ + *offset, '\n', size_ - *offset));
+    end = newline != nullptr ? newline - data_ : size_;
+  }
+  *length = end - *offset;
+}
+
+size_t LineIndex::LineAt(size_t offset) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this, offset]() { return offset < scanned_ || done_; });
+  auto it = std::upper_bound(starts_.begin(), starts_.end(), offset);
+  return it - starts_.begin() - 1;
+}
+
+size_t LineIndex::Find(const std::string& needle, size_t from_line, bool at_line_start) {
+  if (!WaitForLine(from_line)) {
+    return SIZE_MAX;
+  }
+  size_t offset;
+  size_t length;
+  GetLine(from_line, &offset, &length);
+  if (needle.empty()) {
+    return from_line;
+  }
+
+  while (offset < size_) {
+    const char* match = static_cast<const char*>(
+        memmem(data_ + offset, size_ - offset, needle.data(), needle.size()));
+    if (match == nullptr) {
+      return SIZE_MAX;
+    }
+    size_t match_offset = match - data_;
+    size_t line = LineAt(match_offset);
+    GetLine(line, &offset, &length);
+    // A match may not span lines.
+    if (match_offset + needle.size() <= offset + length &&
+        (!at_line_start || match_offset == offset)) {
+      return line;
+    }
+    offset = match_offset + 1;
+  }
+  return SIZE_MAX;
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/memory_budget.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/properties.h>
+#include <android-base/strings.h>
+
+constexpr uint64_t MemoryBudget::kDefaultReserve;
+constexpr double MemoryBudget::kPressureThreshold;
+
+MemoryBudget& MemoryBudget::Instance() {
+  static MemoryBudget* budget = new MemoryBudget(
+      android::base::GetUintProperty<uint64_t>("ro.recovery.memory_reserve", kDefaultReserve));
+  return *budget;
+}
+
+int MemoryBudget::Register(Reclaimer reclaimer) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  int id = next_id_++;
+  reclaimers_.emplace_back(id, std::move(reclaimer));
+  return id;
+}
+
+void MemoryBudget::Unregister(int id) {
+  // Waits for a reclaim that may be calling into the cache.
+  std::lock_guard<std::mutex> reclaim_lock(reclaim_mutex_);
+  std::lock_guard<std::mutex> lock(mutex_);
+  reclaimers_.erase(std::remove_if(reclaimers_.begin(), reclaimers_.end(),
+                                   [id](const std::pair<int, Reclaimer>& r) {
+                                     return r.first == id;
+                                   }),
+                    reclaimers_.end());
+}
+
+size_t MemoryBudget::Reclaim(size_t bytes) {
+  std::lock_guard<std::mutex> reclaim_lock(reclaim_mutex_);
+  std::vector<Reclaimer> reclaimers;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& r : reclaimers_) {
+      reclaimers.push_back(r.second);
+    }
+  }
+  size_t freed = 0;
+  for (const auto& reclaimer : reclaimers) {
+    if (freed >= bytes) break;
+    freed += reclaimer(bytes - freed);
+  }
+  if (freed > 0) {
+    LOG(INFO) << "reclaimed " << freed << " bytes of caches for " << bytes << " bytes";
+  }
+  return freed;
+}
+
+bool MemoryBudget::HasRoom(size_t bytes) {
+  uint64_t needed = reserve_ + bytes;
+  uint64_t available = Available();
+  bool pressure = Pressure() >= kPressureThreshold;
+  if (available >= needed && !pressure) {
+    return true;
+  }
+  // Under pressure, make room for the new bytes even if the memory looks available.
+  Reclaim(available < needed ? needed - available : bytes);
+  return Available() >= needed;
+}
+
+bool MemoryBudget::Acquire(size_t bytes) {
+  bool room = HasRoom(bytes);
+  std::lock_guard<std::mutex> lock(mutex_);
+  acquired_ += bytes;
+  peak_ = std::max(peak_, acquired_);
+  return room;
+}
+
+void MemoryBudget::Release(size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  acquired_ -= std::min<uint64_t>(acquired_, bytes);
+}
+
+uint64_t MemoryBudget::CacheLimit(uint64_t used, uint64_t extra_reserve) {
+  if (Pressure() >= kPressureThreshold) {
+    return used / 2;
+  }
+  uint64_t total = used + Available();
+  uint64_t reserved = reserve_ + extra_reserve;
+  return total > reserved ? total - reserved : 0;
+}
+
+uint64_t MemoryBudget::acquired() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return acquired_;
+}
+
+uint64_t MemoryBudget::peak() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return peak_;
+}
+
+uint64_t MemoryBudget::AvailableMemory() {
+  std::string content;
+  if (!android::base::ReadFileToString("/proc/meminfo", &content)) {
+    return 0;
+  }
+  uint64_t available = 0;
+  uint64_t fallback = 0;
+  bool has_available = false;
+  for (const auto& line : android::base::Split(content, "\n")) {
+    char key[32];
+    unsigned long long kb;
+    if (sscanf(line.c_str(), "%31[^:]: %llu", key, &kb) != 2) {
+      continue;
+    }
+    std::string name(key);
+    if (name == "MemAvailable") {
+      available = kb * 1024;
+      has_available = true;
+      break;
+    }
+    if (name == "MemFree" || name == "Buffers" || name == "Cached") {
+      fallback += kb * 1024;
+    }
+  }
+  return has_available ? available : fallback;
+}
+
+double MemoryBudget::MemoryPressure() {
+  std::string content;
+  double avg10;
+  if (!android::base::ReadFileToString("/proc/pressure/memory", &content) ||
+      sscanf(content.c_str(), "some avg10=%lf", &avg10) != 1) {
+    return 0;
+  }
+  return avg10;
+}
@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/open_files.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <mutex>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/unique_fd.h>
+
+// The layout getdents64() fills the buffer with.
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+// Calls |fn| with the name of each entry in the directory open at |dir_fd|, except "." and "..".
+template <typename Fn>
+static bool ForEachDirent(int dir_fd, Fn fn) {
+  alignas(linux_dirent64) char buf[8192];
+  while (true) {
+    long n = syscall(SYS_getdents64, dir_fd, buf, sizeof(buf));
+    if (n == -1) {
+      return false;
+    }
+    if (n == 0) {
+      return true;
+    }
+    for (long pos = 0; pos < n;) {
+      auto de = reinterpret_cast<const linux_dirent64*>(buf + pos);
+      pos += de->d_reclen;
+      if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+        fn(de->d_name);
+      }
+    }
+  }
+}
+
+static bool ReadLinkAt(int dir_fd, const char* name, std::string* target) {
+  char link[PATH_MAX];
+  ssize_t length = readlinkat(dir_fd, name, link, sizeof(link));
+  if (length <= 0 || static_cast<size_t>(length) >= sizeof(link)) {
+    return false;
+  }
+  target->assign(link, length);
+  return true;
+}
+
+void OpenFiles::ScanProcess(int proc_fd, pid_t pid, bool with_maps) {
+  std::string name = std::to_string(pid);
+  android::base::unique_fd pid_fd(
+      openat(proc_fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  if (pid_fd == -1) {
+    // Gone already.
+    return;
+  }
+
+  android::base::unique_fd fd_dir(openat(pid_fd, "fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  if (fd_dir != -1) {
+    std::string target;
+    ForEachDirent(fd_dir, [&](const char* fd_name) {
+      if (ReadLinkAt(fd_dir, fd_name, &target)) {
+        entries_.push_back({ pid, Kind::kFd, target });
+      }
+    });
+  }
+
+  if (with_maps) {
+    android::base::unique_fd maps_fd(openat(pid_fd, "maps", O_RDONLY | O_CLOEXEC));
+    std::string maps;
+    if (maps_fd != -1 && android::base::ReadFdToString(maps_fd, &maps)) {
+      // A file usually has several mappings in a row; only keep one entry for them.
+      std::string last;
+      for (size_t pos = 0; pos < maps.size();) {
+        size_t end = maps.find('\n', pos);
+        if (end == std::string::npos) end = maps.size();
+        size_t slash = maps.find('/', pos);
+        if (slash < end && maps.compare(slash, end - slash, last) != 0) {
+          last = maps.substr(slash, end - slash);
+          entries_.push_back({ pid, Kind::kMap, last });
+        }
+        pos = end + 1;
+      }
+    }
+  }
+
+  static const struct {
+    const char* name;
+    Kind kind;
+  } kLinks[] = {
+    { "cwd", Kind::kCwd },
+    { "root", Kind::kRoot },
+    { "exe", Kind::kExe },
+  };
+  for (const auto& link : kLinks) {
+    std::string target;
+    if (ReadLinkAt(pid_fd, link.name, &target)) {
+      entries_.push_back({ pid, link.kind, target });
+    }
+  }
+}
+
+bool OpenFiles::Scan(bool with_maps) {
+  entries_.clear();
+  with_maps_ = with_maps;
+  taken_ = std::chrono::steady_clock::now();
+
+  android::base::unique_fd proc_fd(open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  if (proc_fd == -1) {
+    PLOG(ERROR) << "Failed to open /proc";
+    return false;
+  }
+  // Collect the pids first, so that the listing of /proc isn't interleaved with the scans.
+  std::vector<pid_t> pids;
+  if (!ForEachDirent(proc_fd, [&pids](const char* name) {
+        pid_t pid;
+        if (android::base::ParseInt(name, &pid, 1)) {
+          pids.push_back(pid);
+        }
+      })) {
+    PLOG(ERROR) << "Failed to list /proc";
+    return false;
+  }
+  for (pid_t pid : pids) {
+    ScanProcess(proc_fd, pid, with_maps);
+  }
+  return true;
+}
+
+static std::mutex snapshot_mutex;
+static std::shared_ptr<const OpenFiles> snapshot;
+
+std::shared_ptr<const OpenFiles> OpenFiles::Get(std::chrono::milliseconds max_age,
+                                                bool with_maps) {
+  std::lock_guard<std::mutex> lock(snapshot_mutex);
+  if (snapshot && (snapshot->with_maps() || !with_maps) &&
+      std::chrono::steady_clock::now() - snapshot->taken() <= max_age) {
+    return snapshot;
+  }
+  auto files = std::make_shared<OpenFiles>();
+  if (!files->Scan(with_maps)) {
+    snapshot.reset();
+    return nullptr;
+  }
+  snapshot = files;
+  return snapshot;
+}
+
+void OpenFiles::Invalidate() {
+  std::lock_guard<std::mutex> lock(snapshot_mutex);
+  snapshot.reset();
+}
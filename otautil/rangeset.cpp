@@ -16,26 +16,28 @@
 
 #include "otautil/rangeset.h"
 
+#include <ctype.h>
 #include <limits.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
 #include <algorithm>
+#include <iterator>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include <android-base/logging.h>
-#include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
-#include <android-base/strings.h>
 
-RangeSet::RangeSet(std::vector<Range>&& pairs) {
-  blocks_ = 0;
+RangeSet::RangeSet(std::vector<Range>&& pairs) : blocks_(0), wide_(false) {
   if (pairs.empty()) {
     LOG(ERROR) << "Invalid number of tokens";
     return;
   }
 
+  words_.reserve(pairs.size() * 2);
   for (const auto& range : pairs) {
     if (!PushBack(range)) {
       Clear();
@@ -44,42 +46,83 @@ RangeSet::RangeSet(std::vector<Range>&& pairs) {
   }
 }
 
-RangeSet RangeSet::Parse(const std::string& range_text) {
-  std::vector<std::string> pieces = android::base::Split(range_text, ",");
-  if (pieces.size() < 3) {
-    LOG(ERROR) << "Invalid range text: " << range_text;
-    return {};
+// Parses the decimal number in [begin, end) into |value|, allowing leading whitespace. Fails on
+// anything else, or if the number is over INT_MAX.
+static bool ParseBlockNumber(const char* begin, const char* end, size_t* value) {
+  while (begin < end && isspace(static_cast<unsigned char>(*begin))) {
+    begin++;
+  }
+  if (begin == end) {
+    return false;
   }
+  size_t result = 0;
+  for (; begin < end; begin++) {
+    unsigned digit = static_cast<unsigned char>(*begin) - '0';
+    if (digit > 9) {
+      return false;
+    }
+    result = result * 10 + digit;
+    if (result > static_cast<size_t>(INT_MAX)) {
+      return false;
+    }
+  }
+  *value = result;
+  return true;
+}
 
+RangeSet RangeSet::Parse(const std::string& range_text) {
+  return Parse(range_text.data(), range_text.size());
+}
+
+RangeSet RangeSet::Parse(const char* text, size_t len) {
+  const char* end = text + len;
+  // Returns the end of the token at |p|, i.e. the next comma or |end|. memchr() is vectorized by
+  // the libc, which beats looking at each char by a wide margin on the long lists.
+  auto token_end = [end](const char* p) {
+    const char* comma = static_cast<const char*>(memchr(p, ',', end - p));
+    return comma == nullptr ? end : comma;
+  };
+
+  const char* p = text;
+  const char* q = token_end(p);
   size_t num;
-  if (!android::base::ParseUint(pieces[0], &num, static_cast<size_t>(INT_MAX))) {
-    LOG(ERROR) << "Failed to parse the number of tokens: " << range_text;
+  if (!ParseBlockNumber(p, q, &num)) {
+    LOG(ERROR) << "Failed to parse the number of tokens: " << std::string(text, len);
     return {};
   }
   if (num == 0) {
-    LOG(ERROR) << "Invalid number of tokens: " << range_text;
+    LOG(ERROR) << "Invalid number of tokens: " << std::string(text, len);
     return {};
   }
   if (num % 2 != 0) {
-    LOG(ERROR) << "Number of tokens must be even: " << range_text;
-    return {};
-  }
-  if (num != pieces.size() - 1) {
-    LOG(ERROR) << "Mismatching number of tokens: " << range_text;
+    LOG(ERROR) << "Number of tokens must be even: " << std::string(text, len);
     return {};
   }
 
-  std::vector<Range> pairs;
+  RangeSet result;
+  result.words_.reserve(num);
   for (size_t i = 0; i < num; i += 2) {
-    size_t first;
-    size_t second;
-    if (!android::base::ParseUint(pieces[i + 1], &first, static_cast<size_t>(INT_MAX)) ||
-        !android::base::ParseUint(pieces[i + 2], &second, static_cast<size_t>(INT_MAX))) {
+    size_t values[2];
+    for (size_t& value : values) {
+      if (q == end) {
+        LOG(ERROR) << "Mismatching number of tokens: " << std::string(text, len);
+        return {};
+      }
+      p = q + 1;
+      q = token_end(p);
+      if (!ParseBlockNumber(p, q, &value)) {
+        return {};
+      }
+    }
+    if (!result.PushBack({ values[0], values[1] })) {
       return {};
     }
-    pairs.emplace_back(first, second);
   }
-  return RangeSet(std::move(pairs));
+  if (q != end) {
+    LOG(ERROR) << "Mismatching number of tokens: " << std::string(text, len);
+    return {};
+  }
+  return result;
 }
 
 bool RangeSet::PushBack(Range range) {
@@ -93,18 +136,44 @@ bool RangeSet::PushBack(Range range) {
     return false;
   }
 
-  ranges_.push_back(std::move(range));
+  Append(range);
   blocks_ += sz;
   return true;
 }
 
+void RangeSet::Append(Range range) {
+  uint64_t first = range.first;
+  uint64_t second = range.second;
+  if (!wide_ && (first > UINT32_MAX || second > UINT32_MAX)) {
+    // Switches all the Ranges to 64-bit block numbers.
+    std::vector<uint32_t> words;
+    words.reserve(words_.size() * 2 + 4);
+    for (uint32_t word : words_) {
+      words.push_back(word);
+      words.push_back(0);
+    }
+    words_ = std::move(words);
+    wide_ = true;
+  }
+  if (!wide_) {
+    words_.push_back(static_cast<uint32_t>(first));
+    words_.push_back(static_cast<uint32_t>(second));
+    return;
+  }
+  for (uint64_t value : { first, second }) {
+    words_.push_back(static_cast<uint32_t>(value));
+    words_.push_back(static_cast<uint32_t>(value >> 32));
+  }
+}
+
 void RangeSet::Clear() {
-  ranges_.clear();
+  words_.clear();
   blocks_ = 0;
+  wide_ = false;
 }
 
 std::vector<RangeSet> RangeSet::Split(size_t groups) const {
-  if (ranges_.empty() || groups == 0) return {};
+  if (words_.empty() || groups == 0) return {};
 
   if (blocks_ < groups) {
     groups = blocks_;
@@ -118,7 +187,7 @@ std::vector<RangeSet> RangeSet::Split(size_t groups) const {
   std::vector<RangeSet> result;
 
   // Forward iterate Ranges and fill up each group with the desired number of blocks.
-  auto it = ranges_.cbegin();
+  auto it = cbegin();
   Range range = *it;
   for (const auto& blocks : blocks_per_group) {
     RangeSet buffer;
@@ -133,7 +202,7 @@ std::vector<RangeSet> RangeSet::Split(size_t groups) const {
       }
       buffer.PushBack(range);
       it++;
-      if (it != ranges_.cend()) {
+      if (it != cend()) {
         range = *it;
       }
       needed -= range_blocks;
@@ -144,11 +213,11 @@ std::vector<RangeSet> RangeSet::Split(size_t groups) const {
 }
 
 std::string RangeSet::ToString() const {
-  if (ranges_.empty()) {
+  if (words_.empty()) {
     return "";
   }
-  std::string result = std::to_string(ranges_.size() * 2);
-  for (const auto& r : ranges_) {
+  std::string result = std::to_string(size() * 2);
+  for (const auto& r : *this) {
     result += android::base::StringPrintf(",%zu,%zu", r.first, r.second);
   }
 
@@ -159,7 +228,7 @@ std::string RangeSet::ToString() const {
 size_t RangeSet::GetBlockNumber(size_t idx) const {
   CHECK_LT(idx, blocks_) << "Out of bound index " << idx << " (total blocks: " << blocks_ << ")";
 
-  for (const auto& range : ranges_) {
+  for (const auto& range : *this) {
     if (idx < range.second - range.first) {
       return range.first + idx;
     }
@@ -170,29 +239,63 @@ size_t RangeSet::GetBlockNumber(size_t idx) const {
   return 0;  // Unreachable, but to make compiler happy.
 }
 
+// Returns whether any two of the sorted ranges in [it1, end1) and [it2, end2) overlap.
+template <typename It1, typename It2>
+static bool SortedRangesOverlap(It1 it1, It1 end1, It2 it2, It2 end2) {
+  while (it1 != end1 && it2 != end2) {
+    if (it1->second <= it2->first) {
+      ++it1;
+    } else if (it2->second <= it1->first) {
+      ++it2;
+    } else {
+      return true;
+    }
+  }
+  return false;
+}
+
 // RangeSet has half-closed half-open bounds. For example, "3,5" contains blocks 3 and 4. So "3,5"
 // and "5,7" are not overlapped.
 bool RangeSet::Overlaps(const RangeSet& other) const {
-  for (const auto& range : ranges_) {
-    size_t start = range.first;
-    size_t end = range.second;
-    for (const auto& other_range : other.ranges_) {
-      size_t other_start = other_range.first;
-      size_t other_end = other_range.second;
-      // [start, end) vs [other_start, other_end)
-      if (!(other_start >= end || start >= other_end)) {
-        return true;
+  // Compare the ranges pairwise for small sets, which are the common case. Larger ones are sorted
+  // and swept in O((n + m) log(n + m)) instead of O(n * m).
+  static constexpr size_t kPairwiseLimit = 64;
+  if (size() * other.size() <= kPairwiseLimit) {
+    for (const auto& range : *this) {
+      size_t start = range.first;
+      size_t end = range.second;
+      for (const auto& other_range : other) {
+        size_t other_start = other_range.first;
+        size_t other_end = other_range.second;
+        // [start, end) vs [other_start, other_end)
+        if (!(other_start >= end || start >= other_end)) {
+          return true;
+        }
       }
     }
+    return false;
   }
-  return false;
+
+  // Most of the large sets are sorted already, which saves copying them.
+  if (std::is_sorted(cbegin(), cend()) && std::is_sorted(other.cbegin(), other.cend())) {
+    return SortedRangesOverlap(cbegin(), cend(), other.cbegin(), other.cend());
+  }
+  std::vector<Range> first = ToVector();
+  std::vector<Range> second = other.ToVector();
+  std::sort(first.begin(), first.end());
+  std::sort(second.begin(), second.end());
+  return SortedRangesOverlap(first.cbegin(), first.cend(), second.cbegin(), second.cend());
 }
 
-// Ranges in the the set should be mutually exclusive; and they're sorted by the start block.
-SortedRangeSet::SortedRangeSet(std::vector<Range>&& pairs) : RangeSet(std::move(pairs)) {
-  std::sort(ranges_.begin(), ranges_.end());
+static std::vector<Range> SortRanges(std::vector<Range>&& pairs) {
+  std::sort(pairs.begin(), pairs.end());
+  return std::move(pairs);
 }
 
+// Ranges in the the set should be mutually exclusive; and they're sorted by the start block.
+SortedRangeSet::SortedRangeSet(std::vector<Range>&& pairs)
+    : RangeSet(SortRanges(std::move(pairs))) {}
+
 void SortedRangeSet::Insert(const Range& to_insert) {
   SortedRangeSet rs({ to_insert });
   Insert(rs);
@@ -204,23 +307,23 @@ void SortedRangeSet::Insert(const SortedRangeSet& rs) {
     return;
   }
   // Merge and sort the two RangeSets.
-  std::vector<Range> temp = std::move(ranges_);
-  std::copy(rs.begin(), rs.end(), std::back_inserter(temp));
+  std::vector<Range> temp = ToVector();
+  temp.insert(temp.end(), rs.cbegin(), rs.cend());
   std::sort(temp.begin(), temp.end());
 
   Clear();
-  // Trim overlaps and insert the result back to ranges_.
+  // Trim overlaps and insert the result back to the RangeSet.
   Range to_insert = temp.front();
   for (auto it = temp.cbegin() + 1; it != temp.cend(); it++) {
     if (it->first <= to_insert.second) {
       to_insert.second = std::max(to_insert.second, it->second);
     } else {
-      ranges_.push_back(to_insert);
+      Append(to_insert);
       blocks_ += (to_insert.second - to_insert.first);
       to_insert = *it;
     }
   }
-  ranges_.push_back(to_insert);
+  Append(to_insert);
   blocks_ += (to_insert.second - to_insert.first);
 }
 
@@ -248,7 +351,7 @@ bool SortedRangeSet::Overlaps(size_t start, size_t len) const {
 size_t SortedRangeSet::GetOffsetInRangeSet(size_t old_offset) const {
   size_t old_block_start = old_offset / kBlockSize;
   size_t new_block_start = 0;
-  for (const auto& range : ranges_) {
+  for (const auto& range : *this) {
     // Find the index of old_block_start.
     if (old_block_start >= range.second) {
       new_block_start += (range.second - range.first);
@@ -265,3 +368,108 @@ size_t SortedRangeSet::GetOffsetInRangeSet(size_t old_offset) const {
                << " exceeds the limit of current RangeSet: " << this->ToString();
   return 0;
 }
+
+void RangeIndex::SplitAt(size_t block) {
+  auto it = segments_.upper_bound(block);
+  if (it == segments_.begin()) {
+    return;
+  }
+  --it;
+  if (it->first < block && block < it->second.end) {
+    segments_.emplace_hint(std::next(it), block, it->second);
+    it->second.end = block;
+  }
+}
+
+void RangeIndex::Insert(const RangeSet& rs) {
+  for (const auto& range : rs) {
+    SplitAt(range.first);
+    SplitAt(range.second);
+    size_t block = range.first;
+    auto it = segments_.lower_bound(block);
+    while (block < range.second) {
+      if (it != segments_.end() && it->first == block) {
+        it->second.refs++;
+        block = it->second.end;
+        ++it;
+        continue;
+      }
+      // Fill the gap up to the next segment.
+      size_t end = (it != segments_.end() && it->first < range.second) ? it->first : range.second;
+      segments_.emplace_hint(it, block, Segment{ end, 1 });
+      blocks_ += end - block;
+      block = end;
+    }
+  }
+}
+
+void RangeIndex::Remove(const RangeSet& rs) {
+  for (const auto& range : rs) {
+    SplitAt(range.first);
+    SplitAt(range.second);
+    for (auto it = segments_.lower_bound(range.first);
+         it != segments_.end() && it->first < range.second;) {
+      if (--it->second.refs == 0) {
+        blocks_ -= it->second.end - it->first;
+        it = segments_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+}
+
+bool RangeIndex::Overlaps(const Range& range) const {
+  auto it = segments_.lower_bound(range.first);
+  if (it != segments_.end() && it->first < range.second) {
+    return true;
+  }
+  return it != segments_.begin() && std::prev(it)->second.end > range.first;
+}
+
+bool RangeIndex::Overlaps(const RangeSet& rs) const {
+  return std::any_of(rs.cbegin(), rs.cend(), [this](const Range& range) { return Overlaps(range); });
+}
+
+bool RangeIndex::Contains(const RangeSet& rs) const {
+  for (const auto& range : rs) {
+    auto it = segments_.upper_bound(range.first);
+    if (it == segments_.begin()) {
+      return false;
+    }
+    --it;
+    // Walk through the adjacent segments until the end of the range.
+    size_t covered = range.first;
+    while (covered < range.second) {
+      if (it == segments_.end() || it->first > covered || it->second.end <= covered) {
+        return false;
+      }
+      covered = it->second.end;
+      ++it;
+    }
+  }
+  return true;
+}
+
+RangeSet RangeIndex::Intersect(const RangeSet& rs) const {
+  std::vector<Range> sorted(rs.cbegin(), rs.cend());
+  std::sort(sorted.begin(), sorted.end());
+
+  std::vector<Range> result;
+  for (const auto& range : sorted) {
+    auto it = segments_.upper_bound(range.first);
+    if (it != segments_.begin() && std::prev(it)->second.end > range.first) {
+      --it;
+    }
+    for (; it != segments_.end() && it->first < range.second; ++it) {
+      size_t start = std::max(it->first, range.first);
+      size_t end = std::min(it->second.end, range.second);
+      if (!result.empty() && result.back().second >= start) {
+        result.back().second = std::max(result.back().second, end);
+      } else {
+        result.emplace_back(start, end);
+      }
+    }
+  }
+  return result.empty() ? RangeSet() : RangeSet(std::move(result));
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/ring_buffer.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <android-base/logging.h>
+
+RingBuffer::RingBuffer(size_t capacity)
+    : capacity_(capacity),
+      data_(new uint8_t[capacity]),
+      write_pos_(0),
+      read_pos_(0),
+      write_closed_(false),
+      read_closed_(false),
+      waiting_(false) {
+  CHECK_GT(capacity, static_cast<size_t>(0));
+}
+
+// Wakes up the other side if it's sleeping. Both sides can't be waiting at the same time, since
+// the buffer can't be full and empty at once.
+void RingBuffer::WakeUp() {
+  if (waiting_) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    waiting_ = false;
+    cv_.notify_all();
+  }
+}
+
+bool RingBuffer::Write(const uint8_t* data, size_t size) {
+  while (size > 0) {
+    if (read_closed_) {
+      return false;
+    }
+
+    uint64_t write_pos = write_pos_;
+    uint64_t read_pos = read_pos_;
+    size_t space = capacity_ - static_cast<size_t>(write_pos - read_pos);
+    if (space == 0) {
+      // Set the waiting flag on every check, as a spurious wakeup may happen after the consumer has
+      // already cleared it.
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [&]() {
+        waiting_ = true;
+        return read_closed_ || read_pos_ != read_pos;
+      });
+      continue;
+    }
+
+    size_t count = std::min(size, space);
+    size_t offset = static_cast<size_t>(write_pos % capacity_);
+    size_t first = std::min(count, capacity_ - offset);
+    memcpy(data_.get() + offset, data, first);
+    memcpy(data_.get(), data + first, count - first);
+    write_pos_ = write_pos + count;
+    WakeUp();
+
+    data += count;
+    size -= count;
+  }
+  return true;
+}
+
+size_t RingBuffer::Read(uint8_t* data, size_t size) {
+  if (size == 0) {
+    return 0;
+  }
+
+  while (true) {
+    uint64_t read_pos = read_pos_;
+    // Load the closed flag before the write cursor, so we never miss the last piece of data.
+    bool write_closed = write_closed_;
+    uint64_t write_pos = write_pos_;
+    if (write_pos != read_pos) {
+      size_t count = std::min(size, static_cast<size_t>(write_pos - read_pos));
+      size_t offset = static_cast<size_t>(read_pos % capacity_);
+      size_t first = std::min(count, capacity_ - offset);
+      memcpy(data, data_.get() + offset, first);
+      memcpy(data + first, data_.get(), count - first);
+      read_pos_ = read_pos + count;
+      WakeUp();
+      return count;
+    }
+
+    if (write_closed || read_closed_) {
+      return 0;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [&]() {
+      waiting_ = true;
+      return write_closed_ || read_closed_ || write_pos_ != read_pos;
+    });
+  }
+}
+
+void RingBuffer::CloseWrite() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  write_closed_ = true;
+  cv_.notify_all();
+}
+
+void RingBuffer::CloseRead() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  read_closed_ = true;
+  cv_.notify_all();
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/sensor_service.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "otautil/ThermalUtil.h"
+
+static constexpr uint64_t kBatteryPolled = 1ULL << 32;
+static constexpr uint64_t kBatteryCharged = 1ULL << 33;
+static constexpr uint64_t kBatteryCapacityValid = 1ULL << 34;
+
+SensorService& SensorService::Get() {
+  static SensorService service;
+  return service;
+}
+
+void SensorService::Start(BatteryReader battery_reader, std::chrono::milliseconds battery_interval,
+                          std::chrono::milliseconds thermal_interval,
+                          TemperatureReader temperature_reader) {
+  if (running_.exchange(true)) {
+    return;
+  }
+  battery_reader_ = std::move(battery_reader);
+  temperature_reader_ =
+      temperature_reader ? std::move(temperature_reader) : GetMaxValueFromThermalZone;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = false;
+  }
+  thread_ = std::thread(&SensorService::Run, this, battery_interval, thermal_interval);
+}
+
+void SensorService::Stop() {
+  if (!running_.load()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+  running_.store(false);
+}
+
+BatteryReading SensorService::battery() const {
+  BatteryReading reading;
+  uint64_t packed = battery_.load();
+  if (packed & kBatteryPolled) {
+    reading.charged = (packed & kBatteryCharged) != 0;
+    reading.capacity = static_cast<int32_t>(packed & 0xffffffff);
+    reading.capacity_valid = (packed & kBatteryCapacityValid) != 0;
+  }
+  return reading;
+}
+
+uint64_t SensorService::WaitForBatteryReading(uint64_t seq, std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait_for(lock, timeout, [this, seq] { return battery_seq_ > seq || stop_; });
+  return battery_seq_;
+}
+
+int SensorService::temperature() const {
+  if (!running_.load()) {
+    return GetMaxValueFromThermalZone();
+  }
+  return temperature_.load();
+}
+
+void SensorService::PublishTemperature(int temperature) {
+  temperature_.store(temperature);
+  int peak = peak_temperature_.load();
+  while (temperature > peak && !peak_temperature_.compare_exchange_weak(peak, temperature)) {
+  }
+}
+
+void SensorService::Run(std::chrono::milliseconds battery_interval,
+                        std::chrono::milliseconds thermal_interval) {
+  auto next_battery = std::chrono::steady_clock::now();
+  auto next_thermal = next_battery;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stop_) {
+    auto now = std::chrono::steady_clock::now();
+    if (now >= next_battery) {
+      lock.unlock();
+      BatteryReading reading = battery_reader_();
+      battery_.store(kBatteryPolled | (reading.charged ? kBatteryCharged : 0) |
+                     (reading.capacity_valid ? kBatteryCapacityValid : 0) |
+                     static_cast<uint32_t>(reading.capacity));
+      lock.lock();
+      ++battery_seq_;
+      cv_.notify_all();
+      next_battery = now + battery_interval;
+    }
+    if (now >= next_thermal) {
+      lock.unlock();
+      PublishTemperature(temperature_reader_());
+      lock.lock();
+      next_thermal = now + thermal_interval;
+    }
+    cv_.wait_until(lock, std::min(next_battery, next_thermal), [this] { return stop_; });
+  }
+}
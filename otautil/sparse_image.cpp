@@ -0,0 +1,327 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/sparse_image.h"
+
+#include <errno.h>
+#include <linux/fs.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <android-base/logging.h>
+
+// The most that a fill pattern is expanded to, and that is read back at a time for verifying.
+static constexpr size_t kBufferSize = 1024 * 1024;
+
+static bool WriteFullyAt(int fd, const uint8_t* data, size_t len, uint64_t offset) {
+  while (len > 0) {
+    ssize_t written = TEMP_FAILURE_RETRY(pwrite64(fd, data, len, offset));
+    if (written <= 0) {
+      PLOG(ERROR) << "Failed to write " << len << " bytes at " << offset;
+      return false;
+    }
+    data += written;
+    len -= written;
+    offset += written;
+  }
+  return true;
+}
+
+static bool ReadFullyAt(int fd, uint8_t* data, size_t len, uint64_t offset) {
+  while (len > 0) {
+    ssize_t n = TEMP_FAILURE_RETRY(pread64(fd, data, len, offset));
+    if (n <= 0) {
+      if (n == 0) {
+        LOG(ERROR) << "Unexpected EOF at " << offset;
+      } else {
+        PLOG(ERROR) << "Failed to read " << len << " bytes at " << offset;
+      }
+      return false;
+    }
+    data += n;
+    len -= n;
+    offset += n;
+  }
+  return true;
+}
+
+bool IsSparseImage(const uint8_t* data, size_t len) {
+  if (len < sizeof(SparseHeader)) {
+    return false;
+  }
+  SparseHeader header;
+  memcpy(&header, data, sizeof(header));
+  return header.magic == kSparseHeaderMagic && header.major_version == 1 &&
+         header.file_hdr_sz >= sizeof(SparseHeader) &&
+         header.chunk_hdr_sz >= sizeof(SparseChunkHeader) && header.blk_sz > 0 &&
+         header.blk_sz % sizeof(uint32_t) == 0;
+}
+
+SparseImageStream::SparseImageStream(int fd, Mode mode) : fd_(fd), mode_(mode) {
+  struct stat sb;
+  block_device_ = fstat(fd, &sb) == 0 && S_ISBLK(sb.st_mode);
+  zero_out_ = block_device_;
+}
+
+bool SparseImageStream::Write(const uint8_t* data, size_t len) {
+  while (len > 0) {
+    bool success = true;
+    switch (state_) {
+      case State::kFileHeader:
+        if (!Gather(&data, &len, sizeof(SparseHeader))) {
+          return true;
+        }
+        success = ParseFileHeader();
+        break;
+      case State::kChunkHeader:
+        if (!Gather(&data, &len, header_.chunk_hdr_sz)) {
+          return true;
+        }
+        success = ParseChunkHeader();
+        break;
+      case State::kRaw: {
+        size_t n = std::min<uint64_t>(len, remaining_);
+        success = WriteRaw(data, n);
+        data += n;
+        len -= n;
+        offset_ += n;
+        remaining_ -= n;
+        if (remaining_ == 0) {
+          NextChunk();
+        }
+        break;
+      }
+      case State::kFill: {
+        if (!Gather(&data, &len, sizeof(uint32_t))) {
+          return true;
+        }
+        uint32_t pattern;
+        memcpy(&pattern, pending_.data(), sizeof(pattern));
+        pending_.clear();
+        success = WriteFill(pattern, remaining_);
+        offset_ += remaining_;
+        remaining_ = 0;
+        NextChunk();
+        break;
+      }
+      case State::kSkip: {
+        size_t n = std::min<uint64_t>(len, remaining_);
+        data += n;
+        len -= n;
+        remaining_ -= n;
+        if (remaining_ == 0) {
+          NextChunk();
+        }
+        break;
+      }
+      case State::kDone:
+        LOG(ERROR) << "Unexpected " << len << " bytes after the end of the sparse image";
+        success = false;
+        break;
+      case State::kError:
+        return false;
+    }
+    if (!success) {
+      state_ = State::kError;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool SparseImageStream::Finish() {
+  if (state_ == State::kError) {
+    return false;
+  }
+  if (state_ != State::kDone) {
+    LOG(ERROR) << "Sparse image ended after " << chunks_ << " of its " << header_.total_chunks
+               << " chunks";
+    return false;
+  }
+  if (blocks_ != header_.total_blks) {
+    LOG(ERROR) << "Sparse image has " << blocks_ << " blocks, expected " << header_.total_blks;
+    return false;
+  }
+  if (mode_ == Mode::kWrite && !block_device_) {
+    struct stat sb;
+    if (fstat(fd_, &sb) == -1) {
+      PLOG(ERROR) << "Failed to stat the expanded image";
+      return false;
+    }
+    if (static_cast<uint64_t>(sb.st_size) < size() && ftruncate64(fd_, size()) == -1) {
+      PLOG(ERROR) << "Failed to extend the expanded image to " << size() << " bytes";
+      return false;
+    }
+  }
+  return true;
+}
+
+bool SparseImageStream::Gather(const uint8_t** data, size_t* len, size_t size) {
+  size_t n = std::min(size - pending_.size(), *len);
+  pending_.insert(pending_.end(), *data, *data + n);
+  *data += n;
+  *len -= n;
+  return pending_.size() == size;
+}
+
+bool SparseImageStream::ParseFileHeader() {
+  if (!IsSparseImage(pending_.data(), pending_.size())) {
+    LOG(ERROR) << "Invalid sparse image header";
+    return false;
+  }
+  memcpy(&header_, pending_.data(), sizeof(header_));
+  pending_.clear();
+  LOG(INFO) << "Sparse image of " << header_.total_blks << " blocks of " << header_.blk_sz
+            << " bytes in " << header_.total_chunks << " chunks";
+
+  // Skip whatever a newer minor version added to the header.
+  state_ = State::kSkip;
+  remaining_ = header_.file_hdr_sz - sizeof(SparseHeader);
+  if (remaining_ == 0) {
+    NextChunk();
+  }
+  return true;
+}
+
+bool SparseImageStream::ParseChunkHeader() {
+  SparseChunkHeader chunk;
+  memcpy(&chunk, pending_.data(), sizeof(chunk));
+  pending_.clear();
+  chunks_++;
+
+  if (static_cast<uint64_t>(blocks_) + chunk.chunk_sz > header_.total_blks) {
+    LOG(ERROR) << "Sparse chunk " << chunks_ << " goes past the " << header_.total_blks
+               << " blocks of the image";
+    return false;
+  }
+  if (chunk.total_sz < header_.chunk_hdr_sz) {
+    LOG(ERROR) << "Invalid size " << chunk.total_sz << " of sparse chunk " << chunks_;
+    return false;
+  }
+  uint64_t payload = chunk.total_sz - header_.chunk_hdr_sz;
+  uint64_t output = static_cast<uint64_t>(chunk.chunk_sz) * header_.blk_sz;
+  uint64_t expected_payload;
+  switch (chunk.chunk_type) {
+    case kSparseChunkRaw:
+      state_ = State::kRaw;
+      remaining_ = output;
+      expected_payload = output;
+      break;
+    case kSparseChunkFill:
+      state_ = State::kFill;
+      remaining_ = output;
+      expected_payload = sizeof(uint32_t);
+      break;
+    case kSparseChunkDontCare:
+      state_ = State::kSkip;
+      remaining_ = 0;
+      expected_payload = 0;
+      break;
+    case kSparseChunkCrc32:
+      state_ = State::kSkip;
+      remaining_ = sizeof(uint32_t);
+      expected_payload = sizeof(uint32_t);
+      break;
+    default:
+      LOG(ERROR) << "Unknown type 0x" << std::hex << chunk.chunk_type << std::dec
+                 << " of sparse chunk " << chunks_;
+      return false;
+  }
+  if (payload != expected_payload) {
+    LOG(ERROR) << "Sparse chunk " << chunks_ << " of type 0x" << std::hex << chunk.chunk_type
+               << std::dec << " has " << payload << " bytes of payload, expected "
+               << expected_payload;
+    return false;
+  }
+
+  offset_ = static_cast<uint64_t>(blocks_) * header_.blk_sz;
+  blocks_ += chunk.chunk_sz;
+  if (state_ != State::kFill && remaining_ == 0) {
+    NextChunk();
+  }
+  return true;
+}
+
+void SparseImageStream::NextChunk() {
+  state_ = chunks_ == header_.total_chunks ? State::kDone : State::kChunkHeader;
+}
+
+bool SparseImageStream::WriteRaw(const uint8_t* data, size_t len) {
+  bytes_written_ += len;
+  if (mode_ == Mode::kWrite) {
+    return WriteFullyAt(fd_, data, len, offset_);
+  }
+
+  read_buffer_.resize(kBufferSize);
+  for (size_t p = 0; p < len; p += kBufferSize) {
+    size_t n = std::min(len - p, kBufferSize);
+    if (!ReadFullyAt(fd_, read_buffer_.data(), n, offset_ + p)) {
+      return false;
+    }
+    if (memcmp(read_buffer_.data(), data + p, n) != 0) {
+      LOG(ERROR) << "Sparse image mismatch in the " << n << " bytes at " << offset_ + p;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool SparseImageStream::WriteFill(uint32_t pattern, uint64_t len) {
+  bytes_written_ += len;
+  if (len == 0) {
+    return true;
+  }
+  if (mode_ == Mode::kWrite && pattern == 0 && zero_out_) {
+    uint64_t range[2] = { offset_, len };
+    if (ioctl(fd_, BLKZEROOUT, range) == 0) {
+      bytes_zeroed_ += len;
+      return true;
+    }
+    PLOG(WARNING) << "BLKZEROOUT failed, writing the zeros instead";
+    zero_out_ = false;
+  }
+
+  // The block size is a multiple of the pattern's, and thus so is every piece of the fill.
+  size_t fill_size = std::min<uint64_t>(len, kBufferSize);
+  fill_buffer_.resize(fill_size);
+  for (size_t i = 0; i < fill_size; i += sizeof(pattern)) {
+    memcpy(fill_buffer_.data() + i, &pattern, sizeof(pattern));
+  }
+  if (mode_ == Mode::kVerify) {
+    read_buffer_.resize(kBufferSize);
+  }
+  for (uint64_t p = 0; p < len; p += fill_size) {
+    size_t n = std::min<uint64_t>(len - p, fill_size);
+    if (mode_ == Mode::kWrite) {
+      if (!WriteFullyAt(fd_, fill_buffer_.data(), n, offset_ + p)) {
+        return false;
+      }
+    } else {
+      if (!ReadFullyAt(fd_, read_buffer_.data(), n, offset_ + p)) {
+        return false;
+      }
+      if (memcmp(read_buffer_.data(), fill_buffer_.data(), n) != 0) {
+        LOG(ERROR) << "Sparse image mismatch in the " << n << " filled bytes at " << offset_ + p;
+        return false;
+      }
+    }
+  }
+  return true;
+}
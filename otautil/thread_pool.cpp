@@ -0,0 +1,289 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/thread_pool.h"
+
+#include <sched.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <utility>
+
+#include <android-base/logging.h>
+
+constexpr size_t ThreadPool::kDefaultMaxQueued;
+constexpr size_t ThreadPool::kPriorities;
+
+// The pool and the index of the worker running on the current thread.
+static thread_local const ThreadPool* current_pool = nullptr;
+static thread_local int current_worker = -1;
+
+ThreadPool::ThreadPool(const Options& options)
+    : max_queued_(std::max<size_t>(options.max_queued, 1)) {
+  size_t threads = options.threads;
+  if (threads == 0) {
+    threads = std::thread::hardware_concurrency() ?: 4;
+  }
+  for (size_t i = 0; i < threads; i++) {
+    workers_.emplace_back(std::make_unique<Worker>());
+  }
+  for (size_t i = 0; i < threads; i++) {
+    threads_.emplace_back(&ThreadPool::Run, this, i, options.cpus);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  work_cv_.notify_all();
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+ThreadPool& ThreadPool::Shared() {
+  static ThreadPool pool(0);
+  return pool;
+}
+
+int ThreadPool::CurrentWorker() {
+  return current_worker;
+}
+
+bool ThreadPool::Submit(Task task, Priority priority) {
+  bool on_worker = current_pool == this;
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (on_worker && queued_ >= max_queued_) {
+    // Waiting for the other workers could deadlock if they're all submitting, so run it here.
+    if (cancelled_) {
+      return false;
+    }
+    pending_++;
+    lock.unlock();
+    task();
+    FinishTask();
+    return true;
+  }
+  space_cv_.wait(lock, [this]() { return queued_ < max_queued_ || cancelled_; });
+  if (cancelled_) {
+    return false;
+  }
+
+  size_t index = on_worker ? current_worker : next_worker_++ % workers_.size();
+  {
+    std::lock_guard<std::mutex> worker_lock(workers_[index]->mutex);
+    workers_[index]->queues[static_cast<size_t>(priority)].push_back(std::move(task));
+  }
+  queued_++;
+  pending_++;
+  lock.unlock();
+  work_cv_.notify_one();
+  return true;
+}
+
+bool ThreadPool::TakeTask(int index, Task* task) {
+  size_t count = workers_.size();
+  bool found = false;
+  for (size_t priority = 0; priority < kPriorities && !found; priority++) {
+    // The most recent task of our own, which is likely to be still in the cache.
+    if (index >= 0) {
+      Worker& own = *workers_[index];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.queues[priority].empty()) {
+        *task = std::move(own.queues[priority].back());
+        own.queues[priority].pop_back();
+        found = true;
+        break;
+      }
+    }
+    // Or the oldest one of another worker.
+    size_t first = index >= 0 ? index + 1 : 0;
+    for (size_t k = 0; k < count && !found; k++) {
+      size_t victim = (first + k) % count;
+      if (static_cast<int>(victim) == index) continue;
+      Worker& other = *workers_[victim];
+      std::lock_guard<std::mutex> lock(other.mutex);
+      if (!other.queues[priority].empty()) {
+        *task = std::move(other.queues[priority].front());
+        other.queues[priority].pop_front();
+        found = true;
+      }
+    }
+  }
+  if (!found) {
+    return false;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queued_--;
+  }
+  space_cv_.notify_one();
+  return true;
+}
+
+void ThreadPool::FinishTask() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (--pending_ == 0) {
+    space_cv_.notify_all();
+  }
+}
+
+void ThreadPool::Run(size_t index, const std::vector<int>& cpus) {
+  current_pool = this;
+  current_worker = index;
+
+#if defined(__linux__)
+  if (!cpus.empty()) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+      CPU_SET(cpu, &set);
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+      PLOG(WARNING) << "Failed to set the CPU affinity of thread pool worker " << index;
+    }
+  }
+#else
+  (void)cpus;
+#endif
+
+  while (true) {
+    Task task;
+    if (TakeTask(index, &task)) {
+      task();
+      // Destroys whatever the task holds before it counts as finished.
+      task = nullptr;
+      FinishTask();
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    work_cv_.wait(lock, [this]() { return queued_ > 0 || stopping_; });
+    if (stopping_ && queued_ == 0) {
+      break;
+    }
+  }
+}
+
+bool ThreadPool::RunQueuedTask() {
+  Task task;
+  if (!TakeTask(current_pool == this ? current_worker : -1, &task)) {
+    return false;
+  }
+  task();
+  task = nullptr;
+  FinishTask();
+  return true;
+}
+
+void ThreadPool::Wait() {
+  // Helps with the tasks instead of only waiting, which also lets a worker wait for its own.
+  while (true) {
+    if (RunQueuedTask()) {
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (pending_ == 0) {
+      return;
+    }
+    space_cv_.wait_for(lock, std::chrono::milliseconds(10),
+                       [this]() { return pending_ == 0 || queued_ > 0; });
+  }
+}
+
+size_t ThreadPool::Cancel() {
+  std::vector<Task> dropped;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cancelled_ = true;
+    for (auto& worker : workers_) {
+      std::lock_guard<std::mutex> worker_lock(worker->mutex);
+      for (auto& queue : worker->queues) {
+        std::move(queue.begin(), queue.end(), std::back_inserter(dropped));
+        queue.clear();
+      }
+    }
+    queued_ -= dropped.size();
+    pending_ -= dropped.size();
+  }
+  space_cv_.notify_all();
+  work_cv_.notify_all();
+  // The tasks are destroyed out of the locks, which breaks the promises of the Async() ones.
+  size_t count = dropped.size();
+  dropped.clear();
+  return count;
+}
+
+bool ThreadPool::ParallelFor(size_t count, const std::function<bool(size_t)>& work,
+                             size_t max_threads) {
+  std::atomic<size_t> next(0);
+  std::atomic<bool> failed(false);
+  auto run = [&]() {
+    for (size_t i; !failed && (i = next++) < count;) {
+      if (!work(i)) {
+        failed = true;
+      }
+    }
+  };
+
+  // Counts the helper tasks that are still around. A task holds its reference until it has been
+  // destroyed, whether it ran or got dropped by Cancel(), so nothing refers to this frame after.
+  struct Helpers {
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t alive = 0;
+  } helpers;
+  struct HelperRef {
+    explicit HelperRef(Helpers* h) : helpers(h) {}
+    ~HelperRef() {
+      std::lock_guard<std::mutex> lock(helpers->mutex);
+      if (--helpers->alive == 0) {
+        helpers->cv.notify_all();
+      }
+    }
+    Helpers* helpers;
+  };
+
+  size_t num_helpers = std::min(workers_.size(), count > 0 ? count - 1 : 0);
+  if (max_threads > 0) {
+    num_helpers = std::min(num_helpers, max_threads - 1);
+  }
+  for (size_t i = 0; i < num_helpers; i++) {
+    {
+      std::lock_guard<std::mutex> lock(helpers.mutex);
+      helpers.alive++;
+    }
+    auto ref = std::make_shared<HelperRef>(&helpers);
+    Submit([ref, &run]() { run(); });
+  }
+  run();
+
+  // A helper that hasn't started yet may be queued behind tasks waiting for this one, so run the
+  // queued tasks meanwhile rather than blocking on it.
+  std::unique_lock<std::mutex> lock(helpers.mutex);
+  while (helpers.alive > 0) {
+    lock.unlock();
+    bool took = RunQueuedTask();
+    lock.lock();
+    if (!took) {
+      helpers.cv.wait_for(lock, std::chrono::milliseconds(1), [&]() { return helpers.alive == 0; });
+    }
+  }
+  return !failed && next >= count;
+}
@@ -0,0 +1,396 @@
+/*
+ * Copyright (C) 2019 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// The stages of the backup pipeline around the tar stream.
+//
+// DeviceReader reads the partition ahead, and AsyncFdWriter writes the compressed stream to the adb
+// socket, on the shared thread pool, so that neither the flash nor the socket waits on the
+// compression (or the hashing) in between. On the restore, AsyncFdReader reads the socket ahead and
+// DeviceWriter does the writes of each partition, the same way. The stages hand over large aligned
+// buffers through bounded BufferQueues, and each runs as a PoolStage: a task that works through
+// the buffers it can take, and gets kicked again when the other side hands over another one.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <fs_mgr.h>
+#include "otautil/thread_pool.h"
+#include "roots.h"
+
+#include "bu.h"
+
+void PoolStage::Kick() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_) {
+      kicked_ = true;
+      return;
+    }
+    running_ = true;
+  }
+  if (!ThreadPool::Shared().Submit([this] { Run(); })) {
+    Run();
+  }
+}
+
+void PoolStage::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cond_.wait(lock, [this] { return !running_; });
+}
+
+void PoolStage::Run() {
+  while (true) {
+    while (step_()) {
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    // What was handed over before the last step gave up may have been missed by it.
+    if (kicked_) {
+      kicked_ = false;
+      continue;
+    }
+    running_ = false;
+    cond_.notify_all();
+    return;
+  }
+}
+
+BufferQueue::BufferQueue(size_t count, size_t size) : size_(size), closed_(false) {
+  for (size_t i = 0; i < count; ++i) {
+    void* data;
+    if (posix_memalign(&data, PIPELINE_BUFFER_ALIGN, size) != 0) break;
+    buffers_.push_back({ (uint8_t*)data, 0 });
+  }
+  for (auto& buf : buffers_) {
+    free_.push_back(&buf);
+  }
+}
+
+BufferQueue::~BufferQueue() {
+  for (auto& buf : buffers_) {
+    free(buf.data);
+  }
+}
+
+pipe_buffer* BufferQueue::GetFree() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cond_.wait(lock, [this] { return closed_ || !free_.empty(); });
+  if (closed_) return nullptr;
+  pipe_buffer* buf = free_.front();
+  free_.pop_front();
+  buf->len = 0;
+  return buf;
+}
+
+void BufferQueue::PutFull(pipe_buffer* buf) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  full_.push_back(buf);
+  cond_.notify_all();
+}
+
+pipe_buffer* BufferQueue::TryGetFree() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (closed_ || free_.empty()) return nullptr;
+  pipe_buffer* buf = free_.front();
+  free_.pop_front();
+  buf->len = 0;
+  return buf;
+}
+
+pipe_buffer* BufferQueue::GetFull() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cond_.wait(lock, [this] { return closed_ || !full_.empty(); });
+  if (full_.empty()) return nullptr;
+  pipe_buffer* buf = full_.front();
+  full_.pop_front();
+  return buf;
+}
+
+pipe_buffer* BufferQueue::TryGetFull() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (full_.empty()) return nullptr;
+  pipe_buffer* buf = full_.front();
+  full_.pop_front();
+  return buf;
+}
+
+void BufferQueue::PutFree(pipe_buffer* buf) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  free_.push_back(buf);
+  cond_.notify_all();
+}
+
+void BufferQueue::Close() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  closed_ = true;
+  cond_.notify_all();
+}
+
+void BufferQueue::WaitIdle() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cond_.wait(lock, [this] { return free_.size() == buffers_.size(); });
+}
+
+DeviceReader::DeviceReader(int fd, const std::vector<sparse_extent>& ranges)
+    : fd_(fd), ranges_(ranges), queue_(PIPELINE_BUFFERS, PIPELINE_BUFFER_SIZE), failed_(false),
+      current_(nullptr), range_(0), off_(ranges.empty() ? 0 : ranges[0].offset),
+      stage_([this] { return Step(); }) {
+  posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+  stage_.Kick();
+}
+
+DeviceReader::~DeviceReader() {
+  queue_.Close();
+  stage_.Wait();
+}
+
+bool DeviceReader::Step() {
+  while (range_ < ranges_.size() && off_ == ranges_[range_].offset + ranges_[range_].length) {
+    if (++range_ < ranges_.size()) off_ = ranges_[range_].offset;
+  }
+  if (range_ == ranges_.size()) {
+    queue_.Close();
+    return false;
+  }
+  pipe_buffer* buf = queue_.TryGetFree();
+  if (buf == nullptr) return false;
+  uint64_t end = ranges_[range_].offset + ranges_[range_].length;
+  size_t len = (size_t)std::min<uint64_t>(queue_.buffer_size(), end - off_);
+  uint64_t start = stats_now();
+  ssize_t n;
+  do {
+    n = pread64(fd_, buf->data, len, off_);
+  } while (n < 0 && errno == EINTR);
+  stats_add(STAT_READ, n > 0 ? n : 0, start);
+  if (n != (ssize_t)len) {
+    logmsg("DeviceReader: read at %llu failed: %s\n", (unsigned long long)off_,
+           n < 0 ? strerror(errno) : "short read");
+    failed_ = true;
+    queue_.PutFree(buf);
+    queue_.Close();
+    return false;
+  }
+  buf->len = len;
+  queue_.PutFull(buf);
+  off_ += len;
+  return true;
+}
+
+const uint8_t* DeviceReader::Next(size_t* len) {
+  if (current_ != nullptr) {
+    queue_.PutFree(current_);
+    stage_.Kick();
+  }
+  current_ = queue_.GetFull();
+  if (current_ == nullptr) return nullptr;
+  *len = current_->len;
+  return current_->data;
+}
+
+AsyncFdReader::AsyncFdReader(int fd)
+    : fd_(fd), queue_(PIPELINE_BUFFERS, PIPELINE_BUFFER_SIZE), failed_(false), current_(nullptr),
+      pos_(0), stage_([this] { return Step(); }) {
+  stage_.Kick();
+}
+
+AsyncFdReader::~AsyncFdReader() {
+  queue_.Close();
+  // Wake up the step if it's blocked on a socket that the host keeps open past the archive.
+  shutdown(fd_, SHUT_RD);
+  stage_.Wait();
+}
+
+bool AsyncFdReader::Step() {
+  pipe_buffer* buf = queue_.TryGetFree();
+  if (buf == nullptr) return false;
+  uint64_t start = stats_now();
+  ssize_t n;
+  do {
+    n = ::read(fd_, buf->data, queue_.buffer_size());
+  } while (n < 0 && errno == EINTR);
+  stats_add(STAT_SOCKET, n > 0 ? n : 0, start);
+  if (n <= 0) {
+    if (n < 0) {
+      logmsg("AsyncFdReader: read failed: %s\n", strerror(errno));
+      failed_ = true;
+    }
+    queue_.PutFree(buf);
+    queue_.Close();
+    return false;
+  }
+  buf->len = n;
+  queue_.PutFull(buf);
+  return true;
+}
+
+ssize_t AsyncFdReader::Read(void* data, size_t len) {
+  if (current_ != nullptr && pos_ == current_->len) {
+    queue_.PutFree(current_);
+    current_ = nullptr;
+    stage_.Kick();
+  }
+  if (current_ == nullptr) {
+    current_ = queue_.GetFull();
+    pos_ = 0;
+    if (current_ == nullptr) return failed_ ? -1 : 0;
+  }
+  size_t n = std::min(len, current_->len - pos_);
+  memcpy(data, current_->data + pos_, n);
+  pos_ += n;
+  return n;
+}
+
+AsyncFdWriter::AsyncFdWriter(int fd)
+    : fd_(fd), queue_(PIPELINE_BUFFERS, PIPELINE_BUFFER_SIZE), failed_(false), current_(nullptr),
+      stage_([this] { return Step(); }) {}
+
+AsyncFdWriter::~AsyncFdWriter() {
+  queue_.Close();
+  stage_.Wait();
+}
+
+bool AsyncFdWriter::Step() {
+  pipe_buffer* buf = queue_.TryGetFull();
+  if (buf == nullptr) return false;
+  const uint8_t* p = buf->data;
+  size_t left = buf->len;
+  uint64_t start = stats_now();
+  while (left > 0 && !failed_) {
+    ssize_t n = ::write(fd_, p, left);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      logmsg("AsyncFdWriter: write failed: %s\n", strerror(errno));
+      failed_ = true;
+      break;
+    }
+    p += n;
+    left -= n;
+  }
+  stats_add(STAT_SOCKET, buf->len - left, start);
+  queue_.PutFree(buf);
+  return true;
+}
+
+bool AsyncFdWriter::Write(const void* data, size_t len) {
+  const uint8_t* p = (const uint8_t*)data;
+  while (len > 0) {
+    if (failed_) return false;
+    if (current_ == nullptr) {
+      current_ = queue_.GetFree();
+      if (current_ == nullptr) return false;
+    }
+    size_t n = std::min(len, queue_.buffer_size() - current_->len);
+    memcpy(current_->data + current_->len, p, n);
+    current_->len += n;
+    p += n;
+    len -= n;
+    if (current_->len == queue_.buffer_size()) {
+      queue_.PutFull(current_);
+      current_ = nullptr;
+      stage_.Kick();
+    }
+  }
+  return true;
+}
+
+bool AsyncFdWriter::Flush() {
+  if (current_ != nullptr) {
+    queue_.PutFull(current_);
+    current_ = nullptr;
+    stage_.Kick();
+  }
+  queue_.WaitIdle();
+  return !failed_;
+}
+
+DeviceWriter::DeviceWriter(int fd)
+    : fd_(fd), queue_(PIPELINE_BUFFERS, PIPELINE_BUFFER_SIZE), failed_(false), current_(nullptr),
+      stage_([this] { return Step(); }) {}
+
+DeviceWriter::~DeviceWriter() {
+  queue_.Close();
+  stage_.Wait();
+}
+
+bool DeviceWriter::Step() {
+  pipe_buffer* buf = queue_.TryGetFull();
+  if (buf == nullptr) return false;
+  size_t done = 0;
+  uint64_t start = stats_now();
+  while (done < buf->len && !failed_) {
+    ssize_t n = pwrite64(fd_, buf->data + done, buf->len - done, buf->off + done);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      logmsg("DeviceWriter: write at %llu failed: %s\n", (unsigned long long)(buf->off + done),
+             strerror(errno));
+      failed_ = true;
+      break;
+    }
+    done += n;
+  }
+  stats_add(STAT_WRITE, done, start);
+  queue_.PutFree(buf);
+  return true;
+}
+
+bool DeviceWriter::Write(uint64_t off, const void* data, size_t len) {
+  const uint8_t* p = (const uint8_t*)data;
+  while (len > 0) {
+    if (failed_) return false;
+    // A buffer holds one contiguous range of the device.
+    if (current_ != nullptr && current_->off + current_->len != off) {
+      queue_.PutFull(current_);
+      current_ = nullptr;
+      stage_.Kick();
+    }
+    if (current_ == nullptr) {
+      current_ = queue_.GetFree();
+      if (current_ == nullptr) return false;
+      current_->off = off;
+    }
+    size_t n = std::min(len, queue_.buffer_size() - current_->len);
+    memcpy(current_->data + current_->len, p, n);
+    current_->len += n;
+    p += n;
+    off += n;
+    len -= n;
+    if (current_->len == queue_.buffer_size()) {
+      queue_.PutFull(current_);
+      current_ = nullptr;
+      stage_.Kick();
+    }
+  }
+  return true;
+}
+
+bool DeviceWriter::Finish() {
+  if (current_ != nullptr) {
+    queue_.PutFull(current_);
+    current_ = nullptr;
+    stage_.Kick();
+  }
+  queue_.WaitIdle();
+  if (!failed_ && fsync(fd_) != 0) {
+    logmsg("DeviceWriter: fsync failed: %s\n", strerror(errno));
+    failed_ = true;
+  }
+  return !failed_;
+}
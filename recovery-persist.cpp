@@ -30,15 +30,18 @@
 //    --force-persist  ignore /cache mount, always rotate in the contents.
 //
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <string>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/unique_fd.h>
 #include <private/android_logger.h> /* private pmsg functions */
 
 #include "rotate_logs.h"
@@ -49,33 +52,42 @@ static const char *LAST_KMSG_FILE = "/data/misc/recovery/last_kmsg";
 static const char *LAST_CONSOLE_FILE = "/sys/fs/pstore/console-ramoops-0";
 static const char *ALT_LAST_CONSOLE_FILE = "/sys/fs/pstore/console-ramoops";
 
-// close a file, log an error if the error indicator is set
-static void check_and_fclose(FILE *fp, const char *name) {
-    fflush(fp);
-    if (ferror(fp)) {
-        PLOG(ERROR) << "Error in " << name;
-    }
-    fclose(fp);
-}
-
 static void copy_file(const char* source, const char* destination) {
-  FILE* dest_fp = fopen(destination, "we");
-  if (dest_fp == nullptr) {
+  android::base::unique_fd dest_fd(
+      open(destination, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+  if (dest_fd == -1) {
     PLOG(ERROR) << "Can't open " << destination;
-  } else {
-    FILE* source_fp = fopen(source, "re");
-    if (source_fp != nullptr) {
-      char buf[4096];
-      size_t bytes;
-      while ((bytes = fread(buf, 1, sizeof(buf), source_fp)) != 0) {
-        fwrite(buf, 1, bytes, dest_fp);
-      }
-      check_and_fclose(source_fp, source);
+    return;
+  }
+  android::base::unique_fd source_fd(open(source, O_RDONLY | O_CLOEXEC));
+  if (source_fd == -1) {
+    return;
+  }
+  char buf[65536];
+  ssize_t bytes;
+  while ((bytes = TEMP_FAILURE_RETRY(read(source_fd, buf, sizeof(buf)))) > 0) {
+    if (!android::base::WriteFully(dest_fd, buf, bytes)) {
+      PLOG(ERROR) << "Error in " << destination;
+      return;
     }
-    check_and_fclose(dest_fp, destination);
+  }
+  if (bytes == -1) {
+    PLOG(ERROR) << "Error in " << source;
   }
 }
 
+// Returns whether |destination| holds exactly |buf|. The size is checked first, so that a changed
+// log doesn't need to be read back.
+static bool same_content(const std::string& destination, const char* buf, size_t len) {
+  struct stat sb;
+  if (stat(destination.c_str(), &sb) == -1 || static_cast<size_t>(sb.st_size) != len) {
+    return false;
+  }
+  std::string content;
+  return android::base::ReadFileToString(destination, &content) && content.size() == len &&
+         memcmp(content.data(), buf, len) == 0;
+}
+
 static bool rotated = false;
 
 ssize_t logsave(
@@ -88,15 +100,8 @@ ssize_t logsave(
     std::string destination("/data/misc/");
     destination += filename;
 
-    std::string buffer(buf, len);
-
-    {
-        std::string content;
-        android::base::ReadFileToString(destination, &content);
-
-        if (buffer.compare(content) == 0) {
-            return len;
-        }
+    if (same_content(destination, buf, len)) {
+        return len;
     }
 
     // ToDo: Any others that match? Are we pulling in multiple
@@ -106,7 +111,13 @@ ssize_t logsave(
     rotate_logs(LAST_LOG_FILE, LAST_KMSG_FILE);
     rotated = true;
 
-    return android::base::WriteStringToFile(buffer, destination.c_str());
+    android::base::unique_fd fd(open(destination.c_str(),
+                                     O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+    if (fd == -1 || !android::base::WriteFully(fd, buf, len)) {
+        PLOG(ERROR) << "Failed to write " << destination;
+        return -1;
+    }
+    return len;
 }
 
 int main(int argc, char **argv) {
@@ -45,27 +45,12 @@
 #include "rotate_logs.h"
 
 int main(int argc, char **argv) {
-    static const char filter[] = "recovery/";
     static const char force_rotate_flag[] = "--force-rotate";
     static const char rotate_flag[] = "--rotate";
-    ssize_t ret;
-    bool doRotate = false;
+    bool doRotate = argc > 1 && argv[1] && !strcmp(argv[1], force_rotate_flag);
+    bool rotateIfPresent = argc > 1 && argv[1] && !strcmp(argv[1], rotate_flag);
     // Take last pmsg contents and rewrite it to the current pmsg session.
-    if ((argc <= 1) || !argv[1] ||
-            (((doRotate = strcmp(argv[1], rotate_flag))) &&
-                strcmp(argv[1], force_rotate_flag))) {
-        doRotate = false;
-    } else if (!doRotate) {
-        // Do we need to rotate?
-        __android_log_pmsg_file_read(
-            LOG_ID_SYSTEM, ANDROID_LOG_INFO, filter,
-            logbasename, &doRotate);
-    }
-
-    // Take action to refresh pmsg contents
-    ret = __android_log_pmsg_file_read(
-        LOG_ID_SYSTEM, ANDROID_LOG_INFO, filter,
-        logrotate, &doRotate);
+    ssize_t ret = refresh_pmsg_logs(&doRotate, rotateIfPresent);
 
     return (ret < 0) ? ret : 0;
 }
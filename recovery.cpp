@@ -28,16 +28,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/klog.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <functional>
+#include <future>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
@@ -68,7 +76,9 @@
 #include "minadbd/minadbd.h"
 #include "minui/minui.h"
 #include "otautil/DirUtil.h"
+#include "otautil/boot_trace.h"
 #include "otautil/error_code.h"
+#include "otautil/sensor_service.h"
 #include "roots.h"
 #include "rotate_logs.h"
 #include "screen_ui.h"
@@ -182,6 +192,8 @@ static const char *TEMPORARY_LOG_FILE = "/tmp/recovery.log";
 static const char *TEMPORARY_INSTALL_FILE = "/tmp/last_install";
 static const char *LAST_KMSG_FILE = "/cache/recovery/last_kmsg";
 static const char *LAST_LOG_FILE = "/cache/recovery/last_log";
+static constexpr const char* TEMPORARY_TRACE_FILE = "/tmp/recovery_trace.json";
+static constexpr const char* LAST_TRACE_FILE = "/cache/recovery/last_trace.json";
 // We will try to apply the update package 5 times at most in case of an I/O error or
 // bspatch | imgpatch error.
 static const int RETRY_LIMIT = 4;
@@ -503,14 +515,18 @@ static void save_kernel_log(const char* destination) {
         return;
     }
 
-    std::string buffer(klog_buf_len, 0);
-    int n = klogctl(KLOG_READ_ALL, &buffer[0], klog_buf_len);
+    // The buffer can be large, so it's neither zeroed first nor copied again on the way out.
+    std::unique_ptr<char[]> buffer(new char[klog_buf_len]);
+    int n = klogctl(KLOG_READ_ALL, buffer.get(), klog_buf_len);
     if (n == -1) {
         PLOG(ERROR) << "Error in reading klog";
         return;
     }
-    buffer.resize(n);
-    android::base::WriteStringToFile(buffer, destination);
+    android::base::unique_fd fd(
+        open(destination, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+    if (fd == -1 || !android::base::WriteFully(fd, buffer.get(), n)) {
+        PLOG(ERROR) << "Failed to write " << destination;
+    }
 }
 
 // write content to the current pmsg session.
@@ -528,31 +544,88 @@ static void copy_log_file_to_pmsg(const char* source, const char* destination) {
 // How much of the temp log we have copied to the copy in cache.
 static off_t tmplog_offset = 0;
 
+// Copies [*offset, end) of |in_fd| to the current offset of |out_fd| with plain reads and writes.
+static bool copy_log_range(int in_fd, int out_fd, off_t* offset, off_t end) {
+  char buf[65536];
+  while (*offset < end) {
+    ssize_t bytes = TEMP_FAILURE_RETRY(
+        pread(in_fd, buf, std::min<off_t>(sizeof(buf), end - *offset), *offset));
+    if (bytes <= 0) {
+      return bytes == 0;
+    }
+    if (!android::base::WriteFully(out_fd, buf, bytes)) {
+      return false;
+    }
+    *offset += bytes;
+  }
+  return true;
+}
+
+// Copies |source| to |destination|, or with |append| adds what's been written to |source| since
+// the last call. The data is moved in the kernel with sendfile() where it can be. Nothing is synced
+// here; copy_logs() syncs once for all of the logs.
 static void copy_log_file(const char* source, const char* destination, bool append) {
-  FILE* dest_fp = fopen_path(destination, append ? "ae" : "we");
-  if (dest_fp == nullptr) {
+  if (ensure_path_mounted(destination) != 0) {
+    LOG(ERROR) << "Can't mount " << destination;
+    return;
+  }
+  mkdir_recursively(destination, 0777, true, sehandle);
+  // Not O_APPEND, which sendfile() doesn't take; the offset is moved to the end instead.
+  android::base::unique_fd dest_fd(
+      open(destination, O_WRONLY | O_CREAT | O_CLOEXEC | (append ? 0 : O_TRUNC), 0666));
+  if (dest_fd == -1 || (append && lseek(dest_fd, 0, SEEK_END) == -1)) {
     PLOG(ERROR) << "Can't open " << destination;
-  } else {
-    FILE* source_fp = fopen(source, "re");
-    if (source_fp != nullptr) {
-      if (append) {
-        fseeko(source_fp, tmplog_offset, SEEK_SET);  // Since last write
-      }
-      char buf[4096];
-      size_t bytes;
-      while ((bytes = fread(buf, 1, sizeof(buf), source_fp)) != 0) {
-        fwrite(buf, 1, bytes, dest_fp);
-      }
-      if (append) {
-        tmplog_offset = ftello(source_fp);
-      }
-      check_and_fclose(source_fp, source);
+    return;
+  }
+  android::base::unique_fd source_fd(open(source, O_RDONLY | O_CLOEXEC));
+  struct stat sb;
+  if (source_fd == -1 || fstat(source_fd, &sb) == -1) {
+    return;
+  }
+
+  off_t offset = append ? tmplog_offset : 0;  // Since last write
+  bool success = true;
+  while (offset < sb.st_size) {
+    ssize_t bytes = sendfile(dest_fd, source_fd, &offset, sb.st_size - offset);
+    if (bytes == -1 && (errno == EINVAL || errno == ENOSYS)) {
+      success = copy_log_range(source_fd, dest_fd, &offset, sb.st_size);
+      break;
+    }
+    if (bytes <= 0) {
+      success = bytes == 0;
+      break;
     }
-    check_and_fclose(dest_fp, destination);
   }
+  if (!success) {
+    PLOG(ERROR) << "Failed to copy " << source << " to " << destination;
+  }
+  if (append) {
+    tmplog_offset = offset;
+  }
+  if (close(dest_fd.release()) == -1) {
+    PLOG(ERROR) << "Failed to close " << destination;
+  }
+}
+
+// Prints the phases traced since the last call to the log, and with ro.recovery.trace set, writes
+// all of them out in the Chrome trace format.
+static void log_trace() {
+    static size_t reported = 0;
+    std::vector<TraceEvent> events = TraceEvents();
+    if (events.size() > reported) {
+        printf("Trace of the recovery phases:\n%s\n",
+               TraceSummary(std::vector<TraceEvent>(events.begin() + reported, events.end()))
+                   .c_str());
+        reported = events.size();
+    }
+    if (android::base::GetBoolProperty("ro.recovery.trace", false)) {
+        WriteChromeTrace(TEMPORARY_TRACE_FILE);
+    }
 }
 
 static void copy_logs() {
+    log_trace();
+
     // We only rotate and record the log of the current session if there are
     // actual attempts to modify the flash, such as wipes, installs from BCB
     // or menu selections. This is to avoid unnecessary rotation (and
@@ -572,12 +645,16 @@ static void copy_logs() {
 
     ensure_path_mounted(LAST_LOG_FILE);
     ensure_path_mounted(LAST_KMSG_FILE);
-    rotate_logs(LAST_LOG_FILE, LAST_KMSG_FILE);
+    rotate_logs(LAST_LOG_FILE, LAST_KMSG_FILE,
+                android::base::GetBoolProperty("ro.recovery.compress_logs", false));
 
     // Copy logs to cache so the system can find out what happened.
     copy_log_file(TEMPORARY_LOG_FILE, LOG_FILE, true);
     copy_log_file(TEMPORARY_LOG_FILE, LAST_LOG_FILE, false);
     copy_log_file(TEMPORARY_INSTALL_FILE, LAST_INSTALL_FILE, false);
+    if (access(TEMPORARY_TRACE_FILE, R_OK) == 0) {
+        copy_log_file(TEMPORARY_TRACE_FILE, LAST_TRACE_FILE, false);
+    }
     save_kernel_log(LAST_KMSG_FILE);
     chmod(LOG_FILE, 0600);
     chown(LOG_FILE, AID_SYSTEM, AID_SYSTEM);
@@ -585,7 +662,13 @@ static void copy_logs() {
     chown(LAST_KMSG_FILE, AID_SYSTEM, AID_SYSTEM);
     chmod(LAST_LOG_FILE, 0640);
     chmod(LAST_INSTALL_FILE, 0644);
-    sync();
+
+    // One sync of /cache for all of the logs, instead of one per file or of every filesystem.
+    android::base::unique_fd dir_fd(open(CACHE_LOG_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (dir_fd == -1 || syncfs(dir_fd) == -1) {
+        PLOG(WARNING) << "Failed to sync " << CACHE_LOG_DIR;
+        sync();
+    }
 }
 
 // Clear the recovery command and prepare to boot a (hopefully working) system,
@@ -618,8 +701,6 @@ static void finish_recovery() {
     }
     ensure_path_unmounted(CACHE_ROOT);
   }
-
-  sync();  // For good measure.
 }
 
 struct saved_log_file {
@@ -628,117 +709,196 @@ struct saved_log_file {
   std::string data;
 };
 
-static bool erase_volume(const char* volume) {
-  bool is_cache = (strcmp(volume, CACHE_ROOT) == 0);
-  bool is_data = (strcmp(volume, DATA_ROOT) == 0);
-
+// Saves the past logs (i.e. "/cache/recovery/last_*") and the current log ("/cache/recovery/log")
+// into memory, so we can restore them after reformatting /cache.
+static std::vector<saved_log_file> save_cache_logs() {
   std::vector<saved_log_file> log_files;
+  ensure_path_mounted(CACHE_ROOT);
+
+  struct dirent* de;
+  std::unique_ptr<DIR, decltype(&closedir)> d(opendir(CACHE_LOG_DIR), closedir);
+  if (d) {
+    while ((de = readdir(d.get())) != nullptr) {
+      if (strncmp(de->d_name, "last_", 5) == 0 || strcmp(de->d_name, "log") == 0) {
+        std::string path = android::base::StringPrintf("%s/%s", CACHE_LOG_DIR, de->d_name);
+
+        struct stat sb;
+        if (stat(path.c_str(), &sb) == 0) {
+          // truncate files to 512kb
+          if (sb.st_size > (1 << 19)) {
+            sb.st_size = 1 << 19;
+          }
 
-  if (is_cache) {
-    // If we're reformatting /cache, we load any past logs
-    // (i.e. "/cache/recovery/last_*") and the current log
-    // ("/cache/recovery/log") into memory, so we can restore them after
-    // the reformat.
-
-    ensure_path_mounted(volume);
-
-    struct dirent* de;
-    std::unique_ptr<DIR, decltype(&closedir)> d(opendir(CACHE_LOG_DIR), closedir);
-    if (d) {
-      while ((de = readdir(d.get())) != nullptr) {
-        if (strncmp(de->d_name, "last_", 5) == 0 || strcmp(de->d_name, "log") == 0) {
-          std::string path = android::base::StringPrintf("%s/%s", CACHE_LOG_DIR, de->d_name);
-
-          struct stat sb;
-          if (stat(path.c_str(), &sb) == 0) {
-            // truncate files to 512kb
-            if (sb.st_size > (1 << 19)) {
-              sb.st_size = 1 << 19;
-            }
-
-            std::string data(sb.st_size, '\0');
-            FILE* f = fopen(path.c_str(), "rbe");
-            fread(&data[0], 1, data.size(), f);
-            fclose(f);
+          std::string data(sb.st_size, '\0');
+          FILE* f = fopen(path.c_str(), "rbe");
+          fread(&data[0], 1, data.size(), f);
+          fclose(f);
 
-            log_files.emplace_back(saved_log_file{ path, sb, data });
-          }
+          log_files.emplace_back(saved_log_file{ path, sb, data });
         }
       }
-    } else {
-      if (errno != ENOENT) {
-        PLOG(ERROR) << "Failed to opendir " << CACHE_LOG_DIR;
+    }
+  } else {
+    if (errno != ENOENT) {
+      PLOG(ERROR) << "Failed to opendir " << CACHE_LOG_DIR;
+    }
+  }
+  return log_files;
+}
+
+static void restore_cache_logs(const std::vector<saved_log_file>& log_files) {
+  // Re-create the log dir and write back the log entries.
+  if (ensure_path_mounted(CACHE_LOG_DIR) == 0 &&
+      mkdir_recursively(CACHE_LOG_DIR, 0777, false, sehandle) == 0) {
+    for (const auto& log : log_files) {
+      if (!android::base::WriteStringToFile(log.data, log.name, log.sb.st_mode, log.sb.st_uid,
+                                            log.sb.st_gid)) {
+        PLOG(ERROR) << "Failed to write to " << log.name;
       }
     }
+  } else {
+    PLOG(ERROR) << "Failed to mount / create " << CACHE_LOG_DIR;
   }
 
-  ui->Print("Formatting %s...\n", volume);
+  // Any part of the log we'd copied to cache is now gone.
+  // Reset the pointer so we copy from the beginning of the temp
+  // log.
+  tmplog_offset = 0;
+  copy_logs();
+}
 
-  ui->SetBackground(RecoveryUI::ERASING);
-  ui->SetProgressType(RecoveryUI::INDETERMINATE);
+// Reformats the given volumes. They're independent of each other, so they get formatted at the
+// same time (unless ro.recovery.parallel_wipe is false); the whole takes about as long as the
+// largest one. Returns whether all of them succeeded.
+static bool erase_volumes(const std::vector<const char*>& volumes) {
+  struct EraseJob {
+    const char* volume;
+    // The directory to populate the new filesystem from, if any.
+    const char* directory;
+    bool skip;
+    int result;
+  };
 
-  ensure_path_unmounted(volume);
+  bool erase_cache = false;
+  std::vector<saved_log_file> log_files;
+  std::vector<EraseJob> jobs;
+  for (const char* volume : volumes) {
+    if (strcmp(volume, CACHE_ROOT) == 0) {
+      erase_cache = true;
+      log_files = save_cache_logs();
+    }
+    jobs.push_back(EraseJob{ volume, nullptr, false, -1 });
+    ui->Print("Formatting %s...\n", volume);
+  }
 
-  int result;
+  // The bar shows the average progress of the formats.
+  ui->SetBackground(RecoveryUI::ERASING);
+  ui->SetProgressType(RecoveryUI::DETERMINATE);
+  ui->ShowProgress(1.0, 0);
+  ui->SetProgress(0.0);
+
+  for (auto& job : jobs) {
+    ensure_path_unmounted(job.volume);
+
+    if (strcmp(job.volume, DATA_ROOT) == 0 && reason && strcmp(reason, "convert_fbe") == 0) {
+      // Create convert_fbe breadcrumb file to signal to init
+      // to convert to file based encryption, not full disk encryption
+      if (mkdir(CONVERT_FBE_DIR, 0700) != 0) {
+        ui->Print("Failed to make convert_fbe dir %s\n", strerror(errno));
+        job.skip = true;
+        continue;
+      }
+      FILE* f = fopen(CONVERT_FBE_FILE, "wbe");
+      if (!f) {
+        ui->Print("Failed to convert to file encryption %s\n", strerror(errno));
+        job.skip = true;
+        continue;
+      }
+      fclose(f);
+      job.directory = CONVERT_FBE_DIR;
+    }
+  }
 
-  if (is_data && reason && strcmp(reason, "convert_fbe") == 0) {
-    // Create convert_fbe breadcrumb file to signal to init
-    // to convert to file based encryption, not full disk encryption
-    if (mkdir(CONVERT_FBE_DIR, 0700) != 0) {
-      ui->Print("Failed to make convert_fbe dir %s\n", strerror(errno));
-      return true;
+  std::mutex progress_lock;
+  std::vector<float> progress;
+  for (const auto& job : jobs) {
+    progress.push_back(job.skip ? 1.0f : 0.0f);
+  }
+  auto format = [&jobs, &progress_lock, &progress](EraseJob* job) {
+    size_t index = job - jobs.data();
+    job->result = format_volume(job->volume, job->directory, [&](float fraction) {
+      std::lock_guard<std::mutex> lock(progress_lock);
+      progress[index] = fraction;
+      float total = 0;
+      for (float p : progress) {
+        total += p;
+      }
+      ui->SetProgress(total / progress.size());
+    });
+  };
+  if (jobs.size() > 1 && android::base::GetBoolProperty("ro.recovery.parallel_wipe", true)) {
+    std::vector<std::thread> threads;
+    for (auto& job : jobs) {
+      if (!job.skip) threads.emplace_back(format, &job);
     }
-    FILE* f = fopen(CONVERT_FBE_FILE, "wbe");
-    if (!f) {
-      ui->Print("Failed to convert to file encryption %s\n", strerror(errno));
-      return true;
+    for (auto& thread : threads) {
+      thread.join();
     }
-    fclose(f);
-    result = format_volume(volume, CONVERT_FBE_DIR);
-    remove(CONVERT_FBE_FILE);
-    rmdir(CONVERT_FBE_DIR);
   } else {
-    result = format_volume(volume);
+    for (auto& job : jobs) {
+      if (!job.skip) format(&job);
+    }
   }
 
-  if (is_cache) {
-    // Re-create the log dir and write back the log entries.
-    if (ensure_path_mounted(CACHE_LOG_DIR) == 0 &&
-        mkdir_recursively(CACHE_LOG_DIR, 0777, false, sehandle) == 0) {
-      for (const auto& log : log_files) {
-        if (!android::base::WriteStringToFile(log.data, log.name, log.sb.st_mode, log.sb.st_uid,
-                                              log.sb.st_gid)) {
-          PLOG(ERROR) << "Failed to write to " << log.name;
-        }
-      }
-    } else {
-      PLOG(ERROR) << "Failed to mount / create " << CACHE_LOG_DIR;
+  bool success = true;
+  for (const auto& job : jobs) {
+    if (job.directory != nullptr) {
+      remove(CONVERT_FBE_FILE);
+      rmdir(CONVERT_FBE_DIR);
     }
+    // A failure to set up convert_fbe doesn't fail the wipe.
+    if (!job.skip && job.result != 0) {
+      success = false;
+    }
+  }
 
-    // Any part of the log we'd copied to cache is now gone.
-    // Reset the pointer so we copy from the beginning of the temp
-    // log.
-    tmplog_offset = 0;
-    copy_logs();
+  if (erase_cache) {
+    restore_cache_logs(log_files);
   }
 
-  return (result == 0);
+  return success;
 }
 
-// Display a menu with the specified 'headers' and 'items'. Device specific HandleMenuKey() may
-// return a positive number beyond the given range. Caller sets 'menu_only' to true to ensure only
-// a menu item gets selected. 'initial_selection' controls the initial cursor location. Returns the
-// (non-negative) chosen item number, or -1 if timed out waiting for input.
-int get_menu_selection(bool menu_is_main, menu_type_t menu_type, const char* const* headers,
-                       const MenuItemVector& menu_items, bool menu_only, int initial_selection,
-                       Device* device, bool refreshable = false) {
-  // Throw away keys pressed previously, so user doesn't accidentally trigger menu items.
-  ui->FlushKeys();
+static bool erase_volume(const char* volume) {
+  return erase_volumes({ volume });
+}
 
-  ui->StartMenu(menu_is_main, menu_type, headers, menu_items, initial_selection);
+// Returns the character a letter, digit or punctuation key types, or 0 for any other key.
+static char key_to_char(int key) {
+  static const struct {
+    int first_key;
+    const char* chars;
+  } kRows[] = {
+    { KEY_1, "1234567890-=" },
+    { KEY_Q, "qwertyuiop[]" },
+    { KEY_A, "asdfghjkl;'" },
+    { KEY_Z, "zxcvbnm,./" },
+  };
+  for (const auto& row : kRows) {
+    if (key >= row.first_key && key < row.first_key + static_cast<int>(strlen(row.chars))) {
+      return row.chars[key - row.first_key];
+    }
+  }
+  return key == KEY_SPACE ? ' ' : 0;
+}
 
+// Handles the input for the menu that has just been started, until an item gets chosen.
+static int run_menu(size_t count, const MenuItemProvider& menu_item, bool menu_only,
+                    int initial_selection, Device* device, bool refreshable, bool type_ahead) {
   int selected = initial_selection;
   int chosen_item = -1;
+  std::string prefix;
+  auto last_typed = std::chrono::steady_clock::time_point();
   while (chosen_item < 0) {
     RecoveryUI::InputEvent evt = ui->WaitInputEvent();
     if (evt.type() == RecoveryUI::EVENT_TYPE_NONE) {  // WaitKey() timed out.
@@ -763,6 +923,23 @@ int get_menu_selection(bool menu_is_main, menu_type_t menu_type, const char* con
     } else {
       bool visible = ui->IsTextVisible();
       action = device->HandleMenuKey(evt.key(), visible);
+      char c = key_to_char(evt.key());
+      if (type_ahead && visible && action == Device::kNoAction && c != 0) {
+        // A pause starts a new search, like in most file pickers.
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_typed > std::chrono::seconds(1)) {
+          prefix.clear();
+        }
+        last_typed = now;
+        prefix += c;
+        for (size_t i = 0; i < count; i++) {
+          MenuItem item = menu_item(i);
+          if (strncasecmp(item.text().c_str(), prefix.c_str(), prefix.size()) == 0) {
+            selected = ui->SelectMenu(i);
+            break;
+          }
+        }
+      }
     }
 
     if (action < 0) {
@@ -815,12 +992,102 @@ int get_menu_selection(bool menu_is_main, menu_type_t menu_type, const char* con
   return chosen_item;
 }
 
-// Returns the selected filename, or an empty string.
-static std::string browse_directory(const std::string& path, Device* device) {
+// Display a menu with the specified 'headers' and 'items'. Device specific HandleMenuKey() may
+// return a positive number beyond the given range. Caller sets 'menu_only' to true to ensure only
+// a menu item gets selected. 'initial_selection' controls the initial cursor location. With
+// 'type_ahead', keys the device doesn't handle are collected into a prefix, and the highlight
+// jumps to the first item starting with it. Returns the (non-negative) chosen item number, or -1
+// if timed out waiting for input.
+int get_menu_selection(bool menu_is_main, menu_type_t menu_type, const char* const* headers,
+                       const MenuItemVector& menu_items, bool menu_only, int initial_selection,
+                       Device* device, bool refreshable = false, bool type_ahead = false) {
+  // Throw away keys pressed previously, so user doesn't accidentally trigger menu items.
+  ui->FlushKeys();
+
+  ui->StartMenu(menu_is_main, menu_type, headers, menu_items, initial_selection);
+  return run_menu(menu_items.size(), [&menu_items](size_t i) { return menu_items[i]; }, menu_only,
+                  initial_selection, device, refreshable, type_ahead);
+}
+
+// Like get_menu_selection(), for a menu of 'count' items that 'menu_item' produces as needed.
+static int get_lazy_menu_selection(bool menu_is_main, menu_type_t menu_type,
+                                   const char* const* headers, size_t count,
+                                   const MenuItemProvider& menu_item, bool menu_only,
+                                   int initial_selection, Device* device, bool refreshable = false,
+                                   bool type_ahead = false) {
+  ui->FlushKeys();
+
+  ui->StartLazyMenu(menu_is_main, menu_type, headers, count, menu_item, initial_selection);
+  return run_menu(count, menu_item, menu_only, initial_selection, device, refreshable, type_ahead);
+}
+
+// Sorted listings of the directories browse_directory() has shown: the zips, then the
+// subdirectories, behind "../". A listing is dropped as soon as inotify reports a change in its
+// directory, so going back and forth through a tree only reads each directory once.
+static constexpr size_t kMaxCachedListings = 64;
+static android::base::unique_fd browse_inotify_fd;
+static std::map<int, std::string> browse_watches;
+static std::map<std::string, std::vector<std::string>> browse_listings;
+
+static void forget_listings() {
+  for (const auto& watch : browse_watches) {
+    inotify_rm_watch(browse_inotify_fd, watch.first);
+  }
+  browse_watches.clear();
+  browse_listings.clear();
+}
+
+// Drops the listings of the directories that changed since the last call.
+static void process_browse_events() {
+  if (browse_inotify_fd == -1) return;
+  alignas(struct inotify_event) char buf[4096];
+  ssize_t len;
+  while ((len = read(browse_inotify_fd, buf, sizeof(buf))) > 0) {
+    for (char* p = buf; p < buf + len;) {
+      const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(p);
+      auto watch = browse_watches.find(event->wd);
+      if (watch != browse_watches.end()) {
+        browse_listings.erase(watch->second);
+        // The kernel drops the watch itself once the directory is gone or unmounted.
+        if (event->mask & IN_IGNORED) {
+          browse_watches.erase(watch);
+        }
+      }
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+}
+
+// Fills 'entries' with the listing of 'path', from the cache if it's still current.
+static bool list_directory(const std::string& path, std::vector<std::string>* entries) {
+  if (browse_inotify_fd == -1) {
+    browse_inotify_fd.reset(inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+  }
+  process_browse_events();
+  auto cached = browse_listings.find(path);
+  if (cached != browse_listings.end()) {
+    *entries = cached->second;
+    return true;
+  }
+
+  // Watch before reading, so that nothing changing in between goes unnoticed.
+  int wd = -1;
+  if (browse_inotify_fd != -1) {
+    if (browse_listings.size() >= kMaxCachedListings) {
+      forget_listings();
+    }
+    wd = inotify_add_watch(browse_inotify_fd, path.c_str(),
+                           IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF |
+                               IN_MOVE_SELF | IN_UNMOUNT | IN_ONLYDIR);
+  }
+
   std::unique_ptr<DIR, decltype(&closedir)> d(opendir(path.c_str()), closedir);
   if (!d) {
     PLOG(ERROR) << "error opening " << path;
-    return "";
+    if (wd != -1) {
+      inotify_rm_watch(browse_inotify_fd, wd);
+    }
+    return false;
   }
 
   std::vector<std::string> dirs;
@@ -840,21 +1107,36 @@ static std::string browse_directory(const std::string& path, Device* device) {
   }
 
   std::sort(dirs.begin(), dirs.end());
-  std::sort(zips.begin(), zips.end());
+  std::sort(zips.begin() + 1, zips.end());
 
   // Append dirs to the zips list.
   zips.insert(zips.end(), dirs.begin(), dirs.end());
 
-  MenuItemVector items;
-  for (size_t i = 0; i < zips.size(); i++) {
-    items.push_back(MenuItem(zips[i]));
+  // Without a watch there'd be no way to tell it went stale, so keep it out of the cache.
+  if (wd != -1) {
+    browse_watches[wd] = path;
+    browse_listings[path] = zips;
+  }
+  *entries = std::move(zips);
+  return true;
+}
+
+// Returns the selected filename, or an empty string.
+static std::string browse_directory(const std::string& path, Device* device) {
+  std::vector<std::string> entries;
+  if (!list_directory(path, &entries)) {
+    return "";
   }
 
   const char* headers[] = { "Choose a package to install:", path.c_str(), nullptr };
 
+  // The items are only made for the part of the listing on the screen, so even huge directories
+  // are shown in full.
+  auto menu_item = [&entries](size_t i) { return MenuItem(entries[i]); };
   int chosen_item = 0;
   while (true) {
-    chosen_item = get_menu_selection(false, MT_LIST, headers, items, true, chosen_item, device);
+    chosen_item = get_lazy_menu_selection(false, MT_LIST, headers, entries.size(), menu_item, true,
+                                          chosen_item, device, false, true);
     if (chosen_item == Device::kGoHome) {
       return "@";
     }
@@ -866,7 +1148,7 @@ static std::string browse_directory(const std::string& path, Device* device) {
       continue;
     }
 
-    const std::string& item = zips[chosen_item];
+    const std::string& item = entries[chosen_item];
 
     std::string new_path = path + "/" + item;
     if (new_path.back() == '/') {
@@ -916,13 +1198,14 @@ static bool wipe_data(Device* device) {
     ui->Print("\n-- Wiping data...\n");
     bool success = device->PreWipeData();
     if (success) {
-      success &= erase_volume(DATA_ROOT);
+      std::vector<const char*> volumes = { DATA_ROOT };
       if (has_cache) {
-        success &= erase_volume(CACHE_ROOT);
+        volumes.push_back(CACHE_ROOT);
       }
       if (volume_for_mount_point(METADATA_ROOT) != nullptr) {
-        success &= erase_volume(METADATA_ROOT);
+        volumes.push_back(METADATA_ROOT);
       }
+      success &= erase_volumes(volumes);
     }
     if (success) {
       success &= device->PostWipeData();
@@ -1000,21 +1283,38 @@ static bool wipe_system() {
 }
 
 // Secure-wipe a given partition. It uses BLKSECDISCARD, if supported. Otherwise, it goes with
-// BLKDISCARD (if device supports BLKDISCARDZEROES) or BLKZEROOUT.
-static bool secure_wipe_partition(const std::string& partition) {
+// BLKDISCARD (if device supports BLKDISCARDZEROES) or BLKZEROOUT. The range is split into chunks,
+// issued from a few threads (which multi-queue storage serves in parallel), and the share done so
+// far gets reported to 'progress'.
+static bool secure_wipe_partition(const std::string& partition,
+                                  const std::function<void(float)>& progress = nullptr) {
   android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(partition.c_str(), O_WRONLY)));
   if (fd == -1) {
     PLOG(ERROR) << "Failed to open \"" << partition << "\"";
     return false;
   }
 
-  uint64_t range[2] = { 0, 0 };
-  if (ioctl(fd, BLKGETSIZE64, &range[1]) == -1 || range[1] == 0) {
+  uint64_t size = 0;
+  if (ioctl(fd, BLKGETSIZE64, &size) == -1 || size == 0) {
     PLOG(ERROR) << "Failed to get partition size";
     return false;
   }
-  LOG(INFO) << "Secure-wiping \"" << partition << "\" from " << range[0] << " to " << range[1];
+  LOG(INFO) << "Secure-wiping \"" << partition << "\" from 0 to " << size;
 
+  // A multiple of any discard granularity.
+  static constexpr uint64_t kChunkSize = 256 * 1024 * 1024;
+  size_t chunks = (size + kChunkSize - 1) / kChunkSize;
+  auto chunk_range = [size](size_t chunk, uint64_t* range) {
+    range[0] = chunk * kChunkSize;
+    range[1] = std::min(kChunkSize, size - range[0]);
+  };
+
+  // Pick the strategy with the first chunk.
+  auto start = std::chrono::steady_clock::now();
+  uint64_t range[2];
+  chunk_range(0, range);
+  unsigned long request = BLKSECDISCARD;
+  const char* name = "BLKSECDISCARD";
   LOG(INFO) << "  Trying BLKSECDISCARD...";
   if (ioctl(fd, BLKSECDISCARD, &range) == -1) {
     PLOG(WARNING) << "  Failed";
@@ -1022,21 +1322,59 @@ static bool secure_wipe_partition(const std::string& partition) {
     // Use BLKDISCARD if it zeroes out blocks, otherwise use BLKZEROOUT.
     unsigned int zeroes;
     if (ioctl(fd, BLKDISCARDZEROES, &zeroes) == 0 && zeroes != 0) {
-      LOG(INFO) << "  Trying BLKDISCARD...";
-      if (ioctl(fd, BLKDISCARD, &range) == -1) {
-        PLOG(ERROR) << "  Failed";
-        return false;
-      }
+      request = BLKDISCARD;
+      name = "BLKDISCARD";
     } else {
-      LOG(INFO) << "  Trying BLKZEROOUT...";
-      if (ioctl(fd, BLKZEROOUT, &range) == -1) {
-        PLOG(ERROR) << "  Failed";
-        return false;
+      request = BLKZEROOUT;
+      name = "BLKZEROOUT";
+    }
+    LOG(INFO) << "  Trying " << name << "...";
+    if (ioctl(fd, request, &range) == -1) {
+      PLOG(ERROR) << "  Failed";
+      return false;
+    }
+  }
+
+  std::atomic<size_t> next_chunk(1);
+  std::atomic<size_t> done_chunks(1);
+  std::atomic<bool> failed(false);
+  std::mutex progress_lock;
+  if (progress) progress(1.0f / chunks);
+  auto wipe_chunks = [&]() {
+    size_t chunk;
+    while (!failed && (chunk = next_chunk++) < chunks) {
+      uint64_t chunk_range_bytes[2];
+      chunk_range(chunk, chunk_range_bytes);
+      if (ioctl(fd, request, &chunk_range_bytes) == -1) {
+        PLOG(ERROR) << "  " << name << " failed at " << chunk_range_bytes[0];
+        failed = true;
+        return;
+      }
+      size_t done = ++done_chunks;
+      if (progress) {
+        std::lock_guard<std::mutex> lock(progress_lock);
+        progress(static_cast<float>(done) / chunks);
       }
     }
+  };
+
+  size_t thread_count = std::min<size_t>(
+      std::max(1u, std::min(std::thread::hardware_concurrency(), 4u)), chunks - 1);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < thread_count; ++i) {
+    threads.emplace_back(wipe_chunks);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  if (failed) {
+    return false;
   }
 
-  LOG(INFO) << "  Done";
+  std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+  LOG(INFO) << "  Done with " << name << " in " << chunks << " chunks on " << thread_count + 1
+            << " threads, " << duration.count() << " s ("
+            << size / 1048576.0 / std::max(duration.count(), 0.001) << " MiB/s)";
   return true;
 }
 
@@ -1114,16 +1452,25 @@ static bool wipe_ab_device(size_t wipe_package_size) {
         return false;
     }
 
-    std::vector<std::string> lines = android::base::Split(partition_list, "\n");
-    for (const std::string& line : lines) {
+    std::vector<std::string> partitions;
+    for (const std::string& line : android::base::Split(partition_list, "\n")) {
         std::string partition = android::base::Trim(line);
         // Ignore '#' comment or empty lines.
         if (android::base::StartsWith(partition, "#") || partition.empty()) {
             continue;
         }
+        partitions.push_back(partition);
+    }
 
+    // Each partition gets an equal share of the progress bar.
+    ui->SetProgressType(RecoveryUI::DETERMINATE);
+    ui->ShowProgress(1.0, 0);
+    ui->SetProgress(0.0);
+    for (size_t i = 0; i < partitions.size(); ++i) {
         // Proceed anyway even if it fails to wipe some partition.
-        secure_wipe_partition(partition);
+        secure_wipe_partition(partitions[i], [i, &partitions](float fraction) {
+            ui->SetProgress((i + fraction) / partitions.size());
+        });
     }
     return true;
 }
@@ -1214,6 +1561,8 @@ static void run_graphics_test() {
     ui->SetProgress(fraction);
     usleep(100000);
   }
+
+  static_cast<ScreenRecoveryUI*>(ui)->BenchmarkRendering();
 }
 
 static int apply_from_storage(Device* device, VolumeInfo& vi, bool* wipe_cache) {
@@ -1221,7 +1570,8 @@ static int apply_from_storage(Device* device, VolumeInfo& vi, bool* wipe_cache)
 
   int status;
 
-  if (!VolumeManager::Instance()->volumeMount(vi.mId)) {
+  // Installing only reads the package, so don't make the user wait for a filesystem check
+  if (!VolumeManager::Instance()->volumeMount(vi.mId, true /* readOnly */)) {
     return INSTALL_ERROR;
   }
   ui->VolumesChanged();
@@ -1242,24 +1592,44 @@ static int apply_from_storage(Device* device, VolumeInfo& vi, bool* wipe_cache)
 
   ui->Print("\n-- Install %s ...\n", path.c_str());
   set_sdcard_update_bootloader_message();
-  void* token = start_sdcard_fuse(path.c_str());
-  if (!token) {
-    LOG(ERROR) << "Failed to start FUSE for sdcard install";
-    return INSTALL_ERROR;
+
+  // Packages on the internal storage, which can't go away or change under us, are mapped straight
+  // from the file. The descriptor keeps it reachable (for the updater as well) once the volume is
+  // detached below. Removable media go through FUSE instead, which turns their removal into read
+  // errors rather than a crash, and keeps serving the data that was verified.
+  std::string package;
+  android::base::unique_fd package_fd;
+  void* token = nullptr;
+  if (vi.mLabel == "emulated") {
+    package_fd.reset(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (package_fd == -1) {
+      PLOG(ERROR) << "Failed to open " << path;
+      return INSTALL_ERROR;
+    }
+    package = android::base::StringPrintf("/proc/%d/fd/%d", getpid(), package_fd.get());
+  } else {
+    token = start_sdcard_fuse(path.c_str());
+    if (!token) {
+      LOG(ERROR) << "Failed to start FUSE for sdcard install";
+      return INSTALL_ERROR;
+    }
+    package = FUSE_SIDELOAD_HOST_PATHNAME;
   }
 
   VolumeManager::Instance()->volumeUnmount(vi.mId, true);
 
   ui->UpdateScreenOnPrint(true);
-  status = install_package(FUSE_SIDELOAD_HOST_PATHNAME, wipe_cache, TEMPORARY_INSTALL_FILE, false,
-                           0 /*retry_count*/, true /*verify*/);
+  status = install_package(package, wipe_cache, TEMPORARY_INSTALL_FILE, false, 0 /*retry_count*/,
+                           true /*verify*/);
   if (status == INSTALL_UNVERIFIED && ask_to_continue_unverified_install(device)) {
-    status = install_package(FUSE_SIDELOAD_HOST_PATHNAME, wipe_cache, TEMPORARY_INSTALL_FILE, false,
-                             0 /*retry_count*/, false /*verify*/);
+    status = install_package(package, wipe_cache, TEMPORARY_INSTALL_FILE, false, 0 /*retry_count*/,
+                             false /*verify*/);
   }
   ui->UpdateScreenOnPrint(false);
 
-  finish_sdcard_fuse(token);
+  if (token) {
+    finish_sdcard_fuse(token);
+  }
   return status;
 }
 
@@ -1506,78 +1876,88 @@ void UiLogger(android::base::LogId /* id */, android::base::LogSeverity severity
   }
 }
 
-static bool is_battery_ok() {
+// Reads the battery through the health HAL. Runs on the SensorService thread.
+static BatteryReading read_battery() {
   using android::hardware::health::V1_0::BatteryStatus;
   using android::hardware::health::V2_0::Result;
-  using android::hardware::health::V2_0::toString;
   using android::hardware::health::V2_0::implementation::Health;
 
-  struct healthd_config healthd_config = {
-    .batteryStatusPath = android::String8(android::String8::kEmptyString),
-    .batteryHealthPath = android::String8(android::String8::kEmptyString),
-    .batteryPresentPath = android::String8(android::String8::kEmptyString),
-    .batteryCapacityPath = android::String8(android::String8::kEmptyString),
-    .batteryVoltagePath = android::String8(android::String8::kEmptyString),
-    .batteryTemperaturePath = android::String8(android::String8::kEmptyString),
-    .batteryTechnologyPath = android::String8(android::String8::kEmptyString),
-    .batteryCurrentNowPath = android::String8(android::String8::kEmptyString),
-    .batteryCurrentAvgPath = android::String8(android::String8::kEmptyString),
-    .batteryChargeCounterPath = android::String8(android::String8::kEmptyString),
-    .batteryFullChargePath = android::String8(android::String8::kEmptyString),
-    .batteryCycleCountPath = android::String8(android::String8::kEmptyString),
-    .energyCounter = NULL,
-    .boot_min_cap = 0,
-    .screen_on = NULL
-  };
+  static auto health = []() {
+    struct healthd_config healthd_config = {
+      .batteryStatusPath = android::String8(android::String8::kEmptyString),
+      .batteryHealthPath = android::String8(android::String8::kEmptyString),
+      .batteryPresentPath = android::String8(android::String8::kEmptyString),
+      .batteryCapacityPath = android::String8(android::String8::kEmptyString),
+      .batteryVoltagePath = android::String8(android::String8::kEmptyString),
+      .batteryTemperaturePath = android::String8(android::String8::kEmptyString),
+      .batteryTechnologyPath = android::String8(android::String8::kEmptyString),
+      .batteryCurrentNowPath = android::String8(android::String8::kEmptyString),
+      .batteryCurrentAvgPath = android::String8(android::String8::kEmptyString),
+      .batteryChargeCounterPath = android::String8(android::String8::kEmptyString),
+      .batteryFullChargePath = android::String8(android::String8::kEmptyString),
+      .batteryCycleCountPath = android::String8(android::String8::kEmptyString),
+      .energyCounter = NULL,
+      .boot_min_cap = 0,
+      .screen_on = NULL
+    };
+    return Health::initInstance(&healthd_config);
+  }();
+
+  auto charge_status = BatteryStatus::UNKNOWN;
+  health
+      ->getChargeStatus([&charge_status](auto res, auto out_status) {
+        if (res == Result::SUCCESS) {
+          charge_status = out_status;
+        }
+      })
+      .isOk();  // should not have transport error
+
+  Result res = Result::UNKNOWN;
+  int32_t capacity = INT32_MIN;
+  health
+      ->getCapacity([&res, &capacity](auto out_res, auto out_capacity) {
+        res = out_res;
+        capacity = out_capacity;
+      })
+      .isOk();  // should not have transport error
+
+  BatteryReading reading;
+  // Treat unknown status as charged.
+  reading.charged = (charge_status != BatteryStatus::DISCHARGING &&
+                     charge_status != BatteryStatus::NOT_CHARGING);
+  // If we can't read battery percentage, it may be a device without battery. In this
+  // situation, use 100 as a fake battery percentage.
+  reading.capacity_valid = (res == Result::SUCCESS);
+  reading.capacity = reading.capacity_valid ? capacity : 100;
+  return reading;
+}
 
-  auto health =
-      android::hardware::health::V2_0::implementation::Health::initInstance(&healthd_config);
+static bool is_battery_ok() {
+  TracePhase trace("battery_check");
+  SensorService& sensors = SensorService::Get();
 
   int wait_second = 0;
+  uint64_t seq = 0;
   while (true) {
-    auto charge_status = BatteryStatus::UNKNOWN;
-    health
-        ->getChargeStatus([&charge_status](auto res, auto out_status) {
-          if (res == Result::SUCCESS) {
-            charge_status = out_status;
-          }
-        })
-        .isOk();  // should not have transport error
-
-    // Treat unknown status as charged.
-    bool charged = (charge_status != BatteryStatus::DISCHARGING &&
-                    charge_status != BatteryStatus::NOT_CHARGING);
-
-    Result res = Result::UNKNOWN;
-    int32_t capacity = INT32_MIN;
-    health
-        ->getCapacity([&res, &capacity](auto out_res, auto out_capacity) {
-          res = out_res;
-          capacity = out_capacity;
-        })
-        .isOk();  // should not have transport error
-
-    ui_print("charge_status %d, charged %d, status %s, capacity %" PRId32 "\n", charge_status,
-             charged, toString(res).c_str(), capacity);
+    seq = sensors.WaitForBatteryReading(seq, std::chrono::seconds(BATTERY_READ_TIMEOUT_IN_SEC));
+    BatteryReading battery = sensors.battery();
+
+    ui_print("charged %d, capacity %d%s\n", battery.charged, battery.capacity,
+             battery.capacity_valid ? "" : " (unknown)");
     // At startup, the battery drivers in devices like N5X/N6P take some time to load
     // the battery profile. Before the load finishes, it reports value 50 as a fake
     // capacity. BATTERY_READ_TIMEOUT_IN_SEC is set that the battery drivers are expected
     // to finish loading the battery profile earlier than 10 seconds after kernel startup.
-    if (res == Result::SUCCESS && capacity == 50) {
+    // The sensor service polls the battery every second.
+    if (battery.capacity_valid && battery.capacity == 50) {
       if (wait_second < BATTERY_READ_TIMEOUT_IN_SEC) {
-        sleep(1);
         wait_second++;
         continue;
       }
     }
-    // If we can't read battery percentage, it may be a device without battery. In this
-    // situation, use 100 as a fake battery percentage.
-    if (res != Result::SUCCESS) {
-      capacity = 100;
-    }
-    return (charged && capacity >= BATTERY_WITH_CHARGER_OK_PERCENTAGE) ||
-           (!charged && capacity >= BATTERY_OK_PERCENTAGE);
-    }
+    return (battery.charged && battery.capacity >= BATTERY_WITH_CHARGER_OK_PERCENTAGE) ||
+           (!battery.charged && battery.capacity >= BATTERY_OK_PERCENTAGE);
+  }
 }
 
 // Set the retry count to |retry_count| in BCB.
@@ -1640,6 +2020,7 @@ static void copy_userdata_files() {
 }
 
 static void setup_adbd() {
+  TracePhase trace("setup_adbd");
   int tries;
   for (tries = 0; tries < 5; ++tries) {
     if (access(adb_keys_root, F_OK) == 0) {
@@ -1656,16 +2037,15 @@ static void setup_adbd() {
 int main(int argc, char **argv) {
   // We don't have logcat yet under recovery; so we'll print error on screen and
   // log to stdout (which is redirected to recovery.log) as we used to do.
+  TracePhase startup_trace("startup");
   android::base::InitLogging(argv, &UiLogger);
 
-  // Take last pmsg contents and rewrite it to the current pmsg session.
-  static const char filter[] = "recovery/";
-  // Do we need to rotate?
+  // Take last pmsg contents and rewrite it to the current pmsg session, rotating the logs if there
+  // are any.
   bool doRotate = false;
-
-  __android_log_pmsg_file_read(LOG_ID_SYSTEM, ANDROID_LOG_INFO, filter, logbasename, &doRotate);
-  // Take action to refresh pmsg contents
-  __android_log_pmsg_file_read(LOG_ID_SYSTEM, ANDROID_LOG_INFO, filter, logrotate, &doRotate);
+  TracePhase pmsg_trace("pmsg_rotate");
+  refresh_pmsg_logs(&doRotate, true);
+  pmsg_trace.End();
 
   // If this binary is started with the single argument "--adbd",
   // instead of being the normal recovery binary, it turns into kind
@@ -1721,7 +2101,9 @@ int main(int argc, char **argv) {
     setup_adbd();
   }
 
+  TracePhase args_trace("get_args");
   std::vector<std::string> args = get_args(argc, argv);
+  args_trace.End();
   std::vector<char*> args_to_parse(args.size());
   std::transform(args.cbegin(), args.cend(), args_to_parse.begin(),
                  [](const std::string& arg) { return const_cast<char*>(arg.c_str()); });
@@ -1813,24 +2195,61 @@ int main(int argc, char **argv) {
   printf("stage is [%s]\n", stage.c_str());
   printf("reason is [%s]\n", reason);
 
+  // Loading the UI resources (fonts, animation and localized images) takes the longest, so it runs
+  // on its own thread while the volume manager starts, the file contexts load and (for an update)
+  // the battery is checked. |ui| is only set once the UI is ready, so nothing prints to it midway.
   Device* device = make_device();
+  // The battery, the charger and the thermal zones get polled in the background from now on, for
+  // the status bar, the battery check and the install's temperature report.
+  SensorService::Get().Start(read_battery, std::chrono::seconds(1), std::chrono::seconds(20));
+  RecoveryUI* device_ui;
+  std::thread ui_thread;
   if (android::base::GetBoolProperty("ro.boot.quiescent", false)) {
     printf("Quiescent recovery mode.\n");
-    ui = new StubRecoveryUI();
+    device_ui = new StubRecoveryUI();
   } else {
-    ui = device->GetUI();
+    device_ui = device->GetUI();
+    ui_thread = std::thread([&device_ui]() {
+      TracePhase trace("ui_init");
+      if (!device_ui->Init(locale)) {
+        printf("Failed to initialize UI, use stub UI instead.\n");
+        device_ui = new StubRecoveryUI();
+      }
+    });
+  }
 
-    if (!ui->Init(locale)) {
-      printf("Failed to initialize UI, use stub UI instead.\n");
-      ui = new StubRecoveryUI();
-    }
+  std::future<bool> battery_ok;
+  if (update_package != nullptr) {
+    battery_ok = std::async(std::launch::async, is_battery_ok);
   }
 
+  TracePhase volmgr_trace("volume_manager");
   VolumeClient* volclient = new VolumeClient(device);
   VolumeManager* volmgr = VolumeManager::Instance();
   if (!volmgr->start(volclient)) {
     printf("Failed to start volume manager\n");
   }
+  volmgr_trace.End();
+
+  TracePhase sehandle_trace("file_contexts");
+  sehandle = selinux_android_file_context_handle();
+  selinux_android_set_sehandle(sehandle);
+  sehandle_trace.End();
+
+  printf("Command:");
+  for (const auto& arg : args) {
+    printf(" \"%s\"", arg.c_str());
+  }
+  printf("\n\n");
+
+  property_list(print_property, nullptr);
+  printf("\n");
+
+  if (ui_thread.joinable()) {
+    TracePhase trace("ui_wait");
+    ui_thread.join();
+  }
+  ui = device_ui;
 
   // Set background string to "installing security update" for security update,
   // otherwise set it to "installing system update".
@@ -1844,22 +2263,14 @@ int main(int argc, char **argv) {
   ui->SetBackground(RecoveryUI::NONE);
   if (show_text) ui->ShowText(true);
 
-  sehandle = selinux_android_file_context_handle();
-  selinux_android_set_sehandle(sehandle);
   if (!sehandle) {
     ui->Print("Warning: No file_contexts\n");
   }
 
   device->StartRecovery();
 
-  printf("Command:");
-  for (const auto& arg : args) {
-    printf(" \"%s\"", arg.c_str());
-  }
-  printf("\n\n");
-
-  property_list(print_property, nullptr);
-  printf("\n");
+  startup_trace.End();
+  log_trace();
 
   int status = INSTALL_SUCCESS;
 
@@ -1868,7 +2279,7 @@ int main(int argc, char **argv) {
     // to log the update attempt since update_package is non-NULL.
     modified_flash = true;
 
-    if (!is_battery_ok()) {
+    if (!battery_ok.get()) {
       ui->Print("battery capacity is not enough for installing package, needed is %d%%\n",
                 BATTERY_OK_PERCENTAGE);
       // Log the error code to last_install when installation skips due to
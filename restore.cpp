@@ -19,6 +19,7 @@
 #include <stdlib.h>
 
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -26,6 +27,10 @@
 #include <sys/vfs.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <map>
+#include <string>
+
 #include <cutils/properties.h>
 
 #include <lib/libtar.h>
@@ -95,6 +100,7 @@ static int verify_sod() {
     return -1;
   }
   hash_name = strdup(val_hashname);
+  hash_init(&data_hash, hash_name);
 
   if (!val_product[0]) {
     logmsg("verify_sod: did not find ro.product.device\n");
@@ -110,8 +116,7 @@ static int verify_sod() {
   return 0;
 }
 
-static int verify_eod(size_t actual_hash_datalen, SHA_CTX* actual_sha_ctx,
-                      MD5_CTX* actual_md5_ctx) {
+static int verify_eod(size_t actual_hash_datalen, hash_ctx* actual_hash) {
   int rc = -1;
   char eodbuf[PROP_LINE_LEN * 10];
   size_t len;
@@ -146,21 +151,8 @@ static int verify_eod(size_t actual_hash_datalen, SHA_CTX* actual_sha_ctx,
     }
   }
 
-  unsigned char digest[HASH_MAX_LENGTH];
   char hexdigest[HASH_MAX_STRING_LENGTH];
-
-  int n;
-  if (hash_name != NULL && !strcasecmp(hash_name, "sha1")) {
-    SHA1_Final(digest, actual_sha_ctx);
-    for (n = 0; n < SHA_DIGEST_LENGTH; ++n) {
-      sprintf(hexdigest + 2 * n, "%02x", digest[n]);
-    }
-  } else {  // default to md5
-    MD5_Final(digest, actual_md5_ctx);
-    for (n = 0; n < MD5_DIGEST_LENGTH; ++n) {
-      sprintf(hexdigest + 2 * n, "%02x", digest[n]);
-    }
-  }
+  hash_final(actual_hash, hexdigest);
 
   logmsg("verify_eod: expected=%d,%s\n", actual_hash_datalen, hexdigest);
 
@@ -174,6 +166,118 @@ static int verify_eod(size_t actual_hash_datalen, SHA_CTX* actual_sha_ctx,
   return rc;
 }
 
+// Extracts the entry to the block device |devname| through a DeviceWriter, so that the writes
+// overlap with reading (and hashing) the data that comes after them.
+static int extract_device_file(TAR* t, const char* devname) {
+  static uint8_t buf[PIPELINE_BUFFER_SIZE];
+  int fd = open(devname, O_WRONLY);
+  if (fd < 0) {
+    logmsg("extract_device_file: open %s failed\n", devname);
+    return -1;
+  }
+  int rc = 0;
+  uint64_t size = th_get_size(t);
+  {
+    DeviceWriter writer(fd);
+    for (uint64_t off = 0; rc == 0 && off < size;) {
+      size_t len = (size_t)std::min<uint64_t>(sizeof(buf), size - off);
+      if (tar_data_read(t, buf, len) != 0 || !writer.Write(off, buf, len)) {
+        rc = -1;
+      }
+      off += len;
+    }
+    if (!writer.Finish()) {
+      logmsg("extract_device_file: writing %s failed\n", devname);
+      rc = -1;
+    }
+  }
+  close(fd);
+
+  // Skip the padding to the next tar header.
+  if (rc == 0 && size % T_BLOCKSIZE != 0) {
+    rc = tar_data_read(t, buf, T_BLOCKSIZE - size % T_BLOCKSIZE);
+  }
+  return rc;
+}
+
+// The partitions restored from segments, which get a writer thread each, so that the writes of
+// interleaved partitions overlap.
+struct segment_target {
+  int fd;
+  DeviceWriter* writer;
+};
+
+static std::map<std::string, segment_target> segment_targets;
+
+// The SHA-256 of the last segment, for the checksum entry that follows it.
+static std::string last_segment;
+static uint8_t last_segment_digest[SHA256_DIGEST_LENGTH];
+
+static int extract_segment(TAR* t, DeviceWriter* writer, const char* name, uint64_t off) {
+  static uint8_t buf[PIPELINE_BUFFER_SIZE];
+  char key[PATH_MAX];
+  snprintf(key, sizeof(key), "%s" SEGMENT_SUM_INFIX "%llx", name, (unsigned long long)off);
+  last_segment.clear();
+  SHA256_CTX ctx;
+  SHA256_Init(&ctx);
+  uint64_t size = th_get_size(t);
+  uint64_t left = size;
+  while (left > 0) {
+    size_t len = (size_t)std::min<uint64_t>(sizeof(buf), left);
+    if (tar_data_read(t, buf, len) != 0 || !writer->Write(off, buf, len)) return -1;
+    SHA256_Update(&ctx, buf, len);
+    off += len;
+    left -= len;
+  }
+  SHA256_Final(last_segment_digest, &ctx);
+  last_segment = key;
+  // Skip the padding to the next tar header.
+  if (size % T_BLOCKSIZE != 0) {
+    return tar_data_read(t, buf, T_BLOCKSIZE - size % T_BLOCKSIZE);
+  }
+  return 0;
+}
+
+// Checks the checksum entry |pathname| against the segment before it.
+static int verify_segment_sum(const char* pathname) {
+  char sumbuf[PROP_LINE_LEN];
+  size_t len = sizeof(sumbuf) - 1;
+  if (tar_extract_file_contents(tar, sumbuf, &len) != 0) {
+    logmsg("verify_segment_sum: failed to extract %s\n", pathname);
+    return -1;
+  }
+  sumbuf[len] = '\0';
+  if (last_segment != pathname) {
+    logmsg("verify_segment_sum: %s does not follow its segment\n", pathname);
+    return -1;
+  }
+  char hexdigest[SHA256_DIGEST_LENGTH * 2 + 1];
+  for (int n = 0; n < SHA256_DIGEST_LENGTH; ++n) {
+    sprintf(hexdigest + 2 * n, "%02x", last_segment_digest[n]);
+  }
+  const char* reported = strncmp(sumbuf, "sha256=", 7) == 0 ? sumbuf + 7 : "";
+  if (strncmp(reported, hexdigest, sizeof(hexdigest) - 1) != 0) {
+    logmsg("verify_segment_sum: %s mismatch\n", pathname);
+    return -1;
+  }
+  last_segment.clear();
+  return 0;
+}
+
+static int finish_segment_targets() {
+  int rc = 0;
+  for (auto& entry : segment_targets) {
+    if (!entry.second.writer->Finish()) {
+      logmsg("finish_segment_targets: writing %s failed\n", entry.first.c_str());
+      rc = -1;
+    }
+    delete entry.second.writer;
+    close(entry.second.fd);
+  }
+  segment_targets.clear();
+  return rc;
+}
+
 int do_restore(int argc, char** argv) {
   int rc = 0;
   ssize_t len;
@@ -189,21 +293,28 @@ int do_restore(int argc, char** argv) {
     logmsg("do_restore: peek returned %d\n", len);
     return -1;
   }
-  if (buf[0] == 0x1f && buf[1] == 0x8b) {
+  if (is_pgzip_header(buf, len)) {
+    logmsg("do_restore: is pgzip\n");
+    compress = "pgzip";
+  } else if (buf[0] == 0x1f && buf[1] == 0x8b) {
     logmsg("do_restore: is gzip\n");
     compress = "gzip";
+  } else if (len >= 4 && (uint8_t)buf[0] == 0x28 && (uint8_t)buf[1] == 0xb5 &&
+             (uint8_t)buf[2] == 0x2f && (uint8_t)buf[3] == 0xfd) {
+    logmsg("do_restore: is zstd\n");
+    compress = "zstd";
   }
 
   create_tar(adb_ifd, compress, "r");
+  // The data is hashed on a thread of its own, which is held back at each header until it's
+  // known not to be the EOD, whose hash covers what comes before it.
+  hash_start_thread();
 
-  size_t save_hash_datalen;
-  SHA_CTX save_sha_ctx;
-  MD5_CTX save_md5_ctx;
+  size_t eod_hash_datalen;
 
   while (1) {
-    save_hash_datalen = hash_datalen;
-    memcpy(&save_sha_ctx, &sha_ctx, sizeof(SHA_CTX));
-    memcpy(&save_md5_ctx, &md5_ctx, sizeof(MD5_CTX));
+    eod_hash_datalen = hash_datalen;
+    hash_hold();
     rc = th_read(tar);
     if (rc != 0) {
       if (rc == 1) {  // EOF
@@ -213,20 +324,72 @@ int do_restore(int argc, char** argv) {
     }
     char* pathname = th_get_pathname(tar);
     logmsg("do_restore: extract %s\n", pathname);
+    if (strcmp(pathname, "EOD") != 0) {
+      hash_release();
+    }
     if (!strcmp(pathname, "SOD")) {
       rc = verify_sod();
       logmsg("do_restore: tar_verify_sod returned %d\n", rc);
     } else if (!strcmp(pathname, "EOD")) {
-      rc = verify_eod(save_hash_datalen, &save_sha_ctx, &save_md5_ctx);
+      rc = verify_eod(eod_hash_datalen, &data_hash);
       logmsg("do_restore: tar_verify_eod returned %d\n", rc);
+    } else if (strlen(pathname) > strlen(MANIFEST_SUFFIX) &&
+               !strcmp(pathname + strlen(pathname) - strlen(MANIFEST_SUFFIX), MANIFEST_SUFFIX)) {
+      // The manifests are for the host, to make the next incremental backup.
+      rc = tar_skip_regfile(tar);
+    } else if (strstr(pathname, SEGMENT_SUM_INFIX) != NULL) {
+      rc = verify_segment_sum(pathname);
     } else {
+      // Sparse entries are named after the partition, plus SPARSE_SUFFIX (or DELTA_SUFFIX, in an
+      // incremental backup), and segments are named "<name>.seg.<offset>".
+      bool sparse = false;
+      bool segment = false;
+      uint64_t segment_off = 0;
+      size_t namelen = strlen(pathname);
+      size_t suffixlen = strlen(SPARSE_SUFFIX);
+      size_t deltalen = strlen(DELTA_SUFFIX);
+      char* infix = strstr(pathname, SEGMENT_INFIX);
+      if (namelen > suffixlen && !strcmp(pathname + namelen - suffixlen, SPARSE_SUFFIX)) {
+        pathname[namelen - suffixlen] = '\0';
+        sparse = true;
+      } else if (namelen > deltalen && !strcmp(pathname + namelen - deltalen, DELTA_SUFFIX)) {
+        pathname[namelen - deltalen] = '\0';
+        sparse = true;
+      } else if (infix != NULL) {
+        segment_off = strtoull(infix + strlen(SEGMENT_INFIX), NULL, 16);
+        *infix = '\0';
+        segment = true;
+      }
       char mnt[PATH_MAX];
       snprintf(mnt, sizeof(mnt), "/%s", pathname);
       Volume* vol = volume_for_mount_point(mnt);
       if (vol != NULL && vol->fs_type != NULL) {
         partspec* curpart = part_find(pathname);
-        part_set(curpart);
-        rc = tar_extract_file(tar, vol->blk_device);
+        if (segment) {
+          auto it = segment_targets.find(pathname);
+          if (it == segment_targets.end()) {
+            int fd = open(vol->blk_device, O_WRONLY);
+            if (fd < 0) {
+              logmsg("do_restore: open %s failed\n", vol->blk_device);
+              rc = -1;
+            } else {
+              part_set(curpart);
+              it = segment_targets.emplace(pathname, segment_target{ fd, new DeviceWriter(fd) })
+                       .first;
+            }
+          } else {
+            part_select(curpart);
+          }
+          if (rc == 0) {
+            rc = extract_segment(tar, it->second.writer, pathname, segment_off);
+          }
+        } else if (sparse) {
+          part_set(curpart);
+          rc = tar_extract_sparse_device(tar, vol->blk_device);
+        } else {
+          part_set(curpart);
+          rc = extract_device_file(tar, vol->blk_device);
+        }
       } else {
         logmsg("do_restore: cannot find volume for %s\n", mnt);
       }
@@ -238,7 +401,12 @@ int do_restore(int argc, char** argv) {
     }
   }
 
+  if (finish_segment_targets() != 0 && rc == 0) {
+    rc = -1;
+  }
   tar_close(tar);
+  finish_tar_stream();
+  hash_stop_thread();
   logmsg("do_restore: rc=%d\n", rc);
 
   free(hash_name);
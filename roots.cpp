@@ -20,9 +20,12 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <linux/fs.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -30,12 +33,18 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/logging.h>
 #include <android-base/properties.h>
 #include <android-base/stringprintf.h>
+#include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <cryptfs.h>
 #include <cutils/fs.h>
@@ -43,6 +52,7 @@
 #include <fs_mgr.h>
 
 #include "mounts.h"
+#include "otautil/boot_trace.h"
 
 #ifdef __bitwise
 #undef __bitwise
@@ -50,6 +60,8 @@
 #include <blkid/blkid.h>
 
 static struct fstab* fstab = nullptr;
+// Guards scanning the mounted volumes and (un)mounting based on that.
+static std::mutex mounted_volumes_lock;
 
 extern struct selabel_handle* sehandle;
 
@@ -73,6 +85,7 @@ Volume* get_device_volumes() {
 }
 
 void load_volume_table() {
+  TracePhase trace("load_volume_table");
   fstab = fs_mgr_read_fstab_default();
   if (!fstab) {
     LOG(ERROR) << "Failed to read default fstab";
@@ -186,6 +199,8 @@ int ensure_path_mounted_at(const char* path, const char* mount_point) {
     return 0;
   }
 
+  // The list of mounted volumes is shared; volumes get formatted from several threads at once.
+  std::lock_guard<std::mutex> lock(mounted_volumes_lock);
   if (!scan_mounted_volumes()) {
     LOG(ERROR) << "Failed to scan mounted volumes";
     return -1;
@@ -262,6 +277,7 @@ int ensure_volume_unmounted(const Volume* v, bool detach /* = false */) {
     return -1;
   }
 
+  std::lock_guard<std::mutex> lock(mounted_volumes_lock);
   if (!scan_mounted_volumes()) {
     LOG(ERROR) << "Failed to scan mounted volumes";
     return -1;
@@ -276,7 +292,10 @@ int ensure_volume_unmounted(const Volume* v, bool detach /* = false */) {
   return (detach ? unmount_mounted_volume_detach(mv) : unmount_mounted_volume(mv));
 }
 
-static int exec_cmd(const std::vector<std::string>& args) {
+// Runs the command, and hands what it writes to stdout to 'on_output' if given (it still ends up
+// in our stdout, i.e. the log, as well).
+static int exec_cmd(const std::vector<std::string>& args,
+                    const std::function<void(const char*, size_t)>& on_output = nullptr) {
   CHECK_NE(static_cast<size_t>(0), args.size());
 
   std::vector<char*> argv(args.size());
@@ -284,12 +303,31 @@ static int exec_cmd(const std::vector<std::string>& args) {
                  [](const std::string& arg) { return const_cast<char*>(arg.c_str()); });
   argv.push_back(nullptr);
 
+  int pipefd[2] = { -1, -1 };
+  if (on_output && pipe2(pipefd, O_CLOEXEC) == -1) {
+    PLOG(WARNING) << "Failed to create a pipe for " << args[0];
+  }
+
   pid_t child;
   if ((child = fork()) == 0) {
+    if (pipefd[1] != -1) {
+      dup2(pipefd[1], STDOUT_FILENO);
+    }
     execv(argv[0], argv.data());
     _exit(EXIT_FAILURE);
   }
 
+  if (pipefd[0] != -1) {
+    close(pipefd[1]);
+    char buf[4096];
+    ssize_t n;
+    while ((n = TEMP_FAILURE_RETRY(read(pipefd[0], buf, sizeof(buf)))) > 0) {
+      fwrite(buf, 1, n, stdout);
+      on_output(buf, n);
+    }
+    close(pipefd[0]);
+  }
+
   int status;
   waitpid(child, &status, 0);
   if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
@@ -321,7 +359,89 @@ static int64_t get_file_size(int fd, uint64_t reserve_len) {
   return computed_size;
 }
 
-int format_volume(const char* volume, const char* directory) {
+// Follows the counters mke2fs prints while it writes the group tables, the inode tables and the
+// superblocks (e.g. "Writing inode tables:  12/64", with backspaces before the next count), and
+// turns them into a fraction of the whole. Writing the inode tables takes most of the time.
+class Mke2fsProgress {
+ public:
+  explicit Mke2fsProgress(const std::function<void(float)>& progress) : progress_(progress) {}
+
+  void Parse(const char* data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+      char c = data[i];
+      if (c == ' ' || c == '\b' || c == '\n' || c == '\r') {
+        OnToken();
+        if (c == '\n') line_.clear();
+      } else {
+        token_ += c;
+      }
+    }
+  }
+
+ private:
+  void OnToken() {
+    if (token_.empty()) return;
+    unsigned long done, total;
+    char extra;
+    if (sscanf(token_.c_str(), "%lu/%lu%c", &done, &total, &extra) == 2 && total > 0) {
+      // The share of each phase, and where it starts.
+      float start, share;
+      if (line_.find("inode tables") != std::string::npos) {
+        start = 0.1f, share = 0.7f;
+      } else if (line_.find("superblocks") != std::string::npos) {
+        start = 0.8f, share = 0.2f;
+      } else if (line_.find("group tables") != std::string::npos) {
+        start = 0.0f, share = 0.1f;
+      } else {
+        token_.clear();
+        return;
+      }
+      float fraction = start + share * std::min(done, total) / total;
+      if (fraction > reported_ + 0.01f) {
+        reported_ = fraction;
+        progress_(fraction);
+      }
+    } else {
+      line_ += token_;
+      line_ += ' ';
+    }
+    token_.clear();
+  }
+
+  const std::function<void(float)>& progress_;
+  std::string line_;
+  std::string token_;
+  float reported_ = 0.0f;
+};
+
+// Discards the first 'length' bytes of the block device once, so that the mkfs tools (or the tools
+// run after them) don't have to. Returns whether that worked, and sets 'zeroes' to whether the
+// discarded blocks now read back as zeroes.
+static bool discard_block_device(const char* blk_device, uint64_t length, bool* zeroes) {
+  *zeroes = false;
+  android::base::unique_fd fd(open(blk_device, O_WRONLY | O_CLOEXEC));
+  if (fd == -1) {
+    PLOG(WARNING) << "Failed to open " << blk_device << " to discard it";
+    return false;
+  }
+  if (length == 0) {
+    length = get_block_device_size(fd);
+  }
+  uint64_t range[2] = { 0, length };
+  if (length == 0 || ioctl(fd, BLKDISCARD, &range) == -1) {
+    PLOG(INFO) << "Not discarding " << blk_device;
+    return false;
+  }
+  unsigned int discard_zeroes = 0;
+  *zeroes = ioctl(fd, BLKDISCARDZEROES, &discard_zeroes) == 0 && discard_zeroes != 0;
+  return true;
+}
+
+int format_volume(const char* volume, const char* directory,
+                  const std::function<void(float)>& progress) {
+  auto report = [&progress](float fraction) {
+    if (progress) progress(fraction);
+  };
   const Volume* v = volume_for_path(volume);
   if (v == nullptr) {
     LOG(ERROR) << "unknown volume \"" << volume << "\"";
@@ -381,6 +501,14 @@ int format_volume(const char* volume, const char* directory) {
     return -1;
   }
 
+  // mke2fs would discard the device itself, and make_f2fs too; do it here once, up to the end of
+  // the filesystem (which leaves a crypto footer alone), and tell them not to.
+  bool discard_zeroes;
+  bool discarded = discard_block_device(v->blk_device, length, &discard_zeroes);
+  // When populating from a directory, mkfs gets the first part of the progress, e2fsdroid or
+  // sload.f2fs the rest.
+  float mkfs_share = directory != nullptr ? 0.8f : 1.0f;
+
   if (strcmp(v->fs_type, "ext4") == 0) {
     static constexpr int kBlockSize = 4096;
     std::vector<std::string> mke2fs_args = {
@@ -393,17 +521,42 @@ int format_volume(const char* volume, const char* directory) {
     if (v->logical_blk_size != 0 && v->logical_blk_size < 8192) {
       raid_stride = 8192 / kBlockSize;
     }
+    std::vector<std::string> extended_options;
     if (v->erase_blk_size != 0 && v->logical_blk_size != 0) {
-      mke2fs_args.push_back("-E");
-      mke2fs_args.push_back(
+      extended_options.push_back(
           android::base::StringPrintf("stride=%d,stripe-width=%d", raid_stride, raid_stripe_width));
     }
+    if (discarded) {
+      extended_options.push_back("nodiscard");
+    }
+    // The "fast" profile (e.g. for factory lines) leaves zeroing the inode tables to the kernel,
+    // after the first mount, and skips zeroing the journal when the discard did that already. The
+    // default "secure" one lets mke2fs decide, as it always has.
+    if (android::base::GetProperty("ro.recovery.format_profile", "secure") == "fast") {
+      extended_options.push_back("lazy_itable_init=1");
+      if (discard_zeroes) {
+        extended_options.push_back("lazy_journal_init=1");
+      }
+    }
+    if (!extended_options.empty()) {
+      mke2fs_args.push_back("-E");
+      mke2fs_args.push_back(android::base::Join(extended_options, ','));
+    }
     mke2fs_args.push_back(v->blk_device);
     if (length != 0) {
       mke2fs_args.push_back(std::to_string(length / kBlockSize));
     }
 
-    int result = exec_cmd(mke2fs_args);
+    std::function<void(float)> mkfs_progress = [&report, mkfs_share](float fraction) {
+      report(fraction * mkfs_share);
+    };
+    Mke2fsProgress parser(mkfs_progress);
+    std::function<void(const char*, size_t)> on_output;
+    if (progress) {
+      on_output = [&parser](const char* data, size_t size) { parser.Parse(data, size); };
+    }
+    int result = exec_cmd(mke2fs_args, on_output);
+    report(mkfs_share);
     if (result == 0 && directory != nullptr) {
       std::vector<std::string> e2fsdroid_args = {
         "/sbin/e2fsdroid_static",
@@ -421,6 +574,7 @@ int format_volume(const char* volume, const char* directory) {
       PLOG(ERROR) << "format_volume: Failed to make ext4 on " << v->blk_device;
       return -1;
     }
+    report(1.0f);
     return 0;
   }
 
@@ -436,14 +590,20 @@ int format_volume(const char* volume, const char* directory) {
     "-O", "quota",
     "-O", "verity",
     "-w", std::to_string(kSectorSize),
-    v->blk_device,
   };
   // clang-format on
+  if (discarded) {
+    make_f2fs_cmd.push_back("-t");
+    make_f2fs_cmd.push_back("0");
+  }
+  make_f2fs_cmd.push_back(v->blk_device);
   if (length >= kSectorSize) {
     make_f2fs_cmd.push_back(std::to_string(length / kSectorSize));
   }
 
+  // make_f2fs doesn't tell how far along it is.
   int result = exec_cmd(make_f2fs_cmd);
+  report(mkfs_share);
   if (result == 0 && directory != nullptr) {
     cmd = "/sbin/sload.f2fs";
     // clang-format off
@@ -460,6 +620,7 @@ int format_volume(const char* volume, const char* directory) {
     PLOG(ERROR) << "format_volume: Failed " << cmd << " on " << v->blk_device;
     return -1;
   }
+  report(1.0f);
   return 0;
 }
 
@@ -467,35 +628,106 @@ int format_volume(const char* volume) {
   return format_volume(volume, nullptr);
 }
 
-int setup_install_mounts() {
-  if (fstab == nullptr) {
-    LOG(ERROR) << "can't set up install mounts: no fstab loaded";
+// The mounts of /tmp and /cache started by start_install_mounts(), and their result once waited
+// for.
+static std::future<int> pending_install_mounts;
+static int install_mounts_result = 0;
+
+// Unmounts the volumes that packages don't expect to find mounted, with the unmounts of each
+// nesting level issued in parallel. The mount points deeper in the tree go first, so that a volume
+// is never unmounted from under another one. Returns 0 if all of them are unmounted.
+static int unmount_install_volumes() {
+  struct Unmount {
+    std::string mount_point;
+    bool detach;
+    size_t depth;
+  };
+  std::vector<Unmount> unmounts;
+
+  std::lock_guard<std::mutex> lock(mounted_volumes_lock);
+  if (!scan_mounted_volumes()) {
+    LOG(ERROR) << "Failed to scan mounted volumes";
     return -1;
   }
   for (int i = 0; i < fstab->num_entries; ++i) {
     const Volume* v = fstab->recs + i;
-
-    // We don't want to do anything with "/".
-    if (strcmp(v->mount_point, "/") == 0) {
+    // We don't want to do anything with "/", and /tmp and /cache get mounted instead.
+    if (strcmp(v->mount_point, "/") == 0 || strcmp(v->mount_point, "/tmp") == 0 ||
+        strcmp(v->mount_point, "/cache") == 0) {
       continue;
     }
+    // Skip the volumes that aren't mounted, without going through the kernel.
+    if (find_mounted_volume_by_mount_point(v->mount_point) == nullptr) {
+      continue;
+    }
+    // /data must be unmounted with the detach flag to ensure that FUSE works.
+    bool detach = strcmp(v->mount_point, "/data") == 0;
+    std::string mount_point = v->mount_point;
+    unmounts.push_back({ mount_point, detach,
+                         static_cast<size_t>(std::count(mount_point.begin(), mount_point.end(),
+                                                        '/')) });
+  }
+  std::sort(unmounts.begin(), unmounts.end(),
+            [](const Unmount& a, const Unmount& b) { return a.depth > b.depth; });
+
+  // The umount() calls change the mount table, so the next scan reads it again. A volume that fails
+  // to unmount is still in there.
+  std::atomic<bool> failed(false);
+  for (auto level = unmounts.begin(); level != unmounts.end();) {
+    auto level_end = std::find_if(level, unmounts.end(), [&level](const Unmount& u) {
+      return u.depth != level->depth;
+    });
+    std::vector<std::thread> threads;
+    for (auto it = level; it != level_end; ++it) {
+      threads.emplace_back([it, &failed]() {
+        int result = it->detach ? umount2(it->mount_point.c_str(), MNT_DETACH)
+                                : umount(it->mount_point.c_str());
+        if (result == -1) {
+          PLOG(ERROR) << "Failed to unmount " << it->mount_point;
+          failed = true;
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    level = level_end;
+  }
+  return failed ? -1 : 0;
+}
 
-    if (strcmp(v->mount_point, "/tmp") == 0 || strcmp(v->mount_point, "/cache") == 0) {
-      if (ensure_path_mounted(v->mount_point) != 0) {
-        LOG(ERROR) << "Failed to mount " << v->mount_point;
-        return -1;
-      }
-    } else {
-      // datam must be unmounted with the detach flag to ensure that FUSE works.
-      bool detach = false;
-      if (strcmp(v->mount_point, "/data") == 0) {
-        detach = true;
-      }
-      if (ensure_volume_unmounted(v, detach) != 0) {
-        LOG(ERROR) << "Failed to unmount " << v->mount_point;
+int start_install_mounts() {
+  if (fstab == nullptr) {
+    LOG(ERROR) << "can't set up install mounts: no fstab loaded";
+    return -1;
+  }
+  wait_for_install_mounts();
+  if (unmount_install_volumes() != 0) {
+    return -1;
+  }
+  pending_install_mounts = std::async(std::launch::async, []() {
+    for (const char* mount_point : { "/tmp", "/cache" }) {
+      if (volume_for_mount_point(mount_point) != nullptr &&
+          ensure_path_mounted(mount_point) != 0) {
+        LOG(ERROR) << "Failed to mount " << mount_point;
         return -1;
       }
     }
-  }
+    return 0;
+  });
   return 0;
 }
+
+int wait_for_install_mounts() {
+  if (pending_install_mounts.valid()) {
+    install_mounts_result = pending_install_mounts.get();
+  }
+  return install_mounts_result;
+}
+
+int setup_install_mounts() {
+  if (start_install_mounts() != 0) {
+    return -1;
+  }
+  return wait_for_install_mounts();
+}
@@ -18,6 +18,7 @@
 #ifndef RECOVERY_ROOTS_H_
 #define RECOVERY_ROOTS_H_
 
+#include <functional>
 #include <string>
 
 typedef struct fstab_rec Volume;
@@ -50,12 +51,22 @@ int format_volume(const char* volume);
 // "/cache"), no paths permitted.  Attempts to unmount the volume if
 // it is mounted.
 // Copies 'directory' to root of the newly formatted volume
-int format_volume(const char* volume, const char* directory);
+// Reports how far along it is, from 0 to 1, to 'progress' if given.
+int format_volume(const char* volume, const char* directory,
+                  const std::function<void(float)>& progress = nullptr);
 
 // Ensure that all and only the volumes that packages expect to find
 // mounted (/tmp and /cache) are mounted.  Returns 0 on success.
 int setup_install_mounts();
 
+// Like setup_install_mounts(), but returns once the other volumes are
+// unmounted, with /tmp and /cache still being mounted in the background.
+// wait_for_install_mounts() returns the result of these mounts (0 if
+// they succeeded, or weren't started), and must be called before
+// starting another install.
+int start_install_mounts();
+int wait_for_install_mounts();
+
 int get_num_volumes();
 
 #define MAX_NUM_MANAGED_VOLUMES 10
@@ -16,17 +16,22 @@
 
 #include "rotate_logs.h"
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <string>
+#include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
 #include <private/android_logger.h> /* private pmsg functions */
+#include <zlib.h>
 
 static const std::string LAST_KMSG_FILTER = "recovery/last_kmsg";
 static const std::string LAST_LOG_FILTER = "recovery/last_log";
@@ -77,10 +82,102 @@ ssize_t logrotate(log_id_t id, char prio, const char* filename, const char* buf,
   return __android_log_pmsg_file_write(id, prio, name.c_str(), buf, len);
 }
 
+namespace {
+
+struct PmsgFile {
+  log_id_t id;
+  char prio;
+  std::string filename;
+  std::string data;
+};
+
+}  // namespace
+
+static ssize_t collect_pmsg_file(log_id_t id, char prio, const char* filename, const char* buf,
+                                 size_t len, void* arg) {
+  auto files = static_cast<std::vector<PmsgFile>*>(arg);
+  files->push_back({ id, prio, filename, std::string(buf, len) });
+  return len;
+}
+
+ssize_t refresh_pmsg_logs(bool* do_rotate, bool rotate_if_present) {
+  // Whether to rotate depends on all the files, so they're collected first rather than reading
+  // pmsg once to decide and once more to write.
+  std::vector<PmsgFile> files;
+  ssize_t ret = __android_log_pmsg_file_read(LOG_ID_SYSTEM, ANDROID_LOG_INFO, "recovery/",
+                                             collect_pmsg_file, &files);
+  if (!*do_rotate && rotate_if_present) {
+    for (const auto& file : files) {
+      logbasename(file.id, file.prio, file.filename.c_str(), nullptr, 0, do_rotate);
+    }
+  }
+  for (const auto& file : files) {
+    logrotate(file.id, file.prio, file.filename.c_str(), file.data.data(), file.data.size(),
+              do_rotate);
+  }
+  return ret;
+}
+
+// Compresses |source| into |destination| with gzip, and removes |source| on success.
+static bool compress_log(const std::string& source, const std::string& destination) {
+  android::base::unique_fd fd(open(source.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd == -1) {
+    return false;
+  }
+  std::string temp = destination + ".tmp";
+  gzFile gz = gzopen(temp.c_str(), "wbe");
+  if (gz == nullptr) {
+    PLOG(ERROR) << "Failed to open " << temp;
+    return false;
+  }
+  char buf[65536];
+  ssize_t n;
+  bool success = true;
+  while ((n = TEMP_FAILURE_RETRY(read(fd, buf, sizeof(buf)))) > 0) {
+    if (gzwrite(gz, buf, n) != n) {
+      success = false;
+      break;
+    }
+  }
+  if (gzclose(gz) != Z_OK || n == -1 || !success) {
+    LOG(ERROR) << "Failed to compress " << source;
+    unlink(temp.c_str());
+    return false;
+  }
+  if (rename(temp.c_str(), destination.c_str()) == -1) {
+    PLOG(ERROR) << "Failed to rename " << temp;
+    unlink(temp.c_str());
+    return false;
+  }
+  unlink(source.c_str());
+  return true;
+}
+
+// Moves log.$i to log.$(i+1), if present in either form. A plain log that's moved past log.1 gets
+// compressed when |compress| is set.
+static void rotate_log(const char* log_file, int i, bool compress) {
+  std::string old_log = android::base::StringPrintf("%s", log_file);
+  if (i > 0) {
+    old_log += "." + std::to_string(i);
+  }
+  std::string new_log = android::base::StringPrintf("%s.%d", log_file, i + 1);
+  // Ignore errors if old_log doesn't exist.
+  if (rename((old_log + ".gz").c_str(), (new_log + ".gz").c_str()) == 0) {
+    unlink(new_log.c_str());
+  }
+  if (compress && i > 0 && compress_log(old_log, new_log + ".gz")) {
+    unlink(new_log.c_str());
+    return;
+  }
+  if (rename(old_log.c_str(), new_log.c_str()) == 0) {
+    unlink((new_log + ".gz").c_str());
+  }
+}
+
 // Rename last_log -> last_log.1 -> last_log.2 -> ... -> last_log.$max.
 // Similarly rename last_kmsg -> last_kmsg.1 -> ... -> last_kmsg.$max.
 // Overwrite any existing last_log.$max and last_kmsg.$max.
-void rotate_logs(const char* last_log_file, const char* last_kmsg_file) {
+void rotate_logs(const char* last_log_file, const char* last_kmsg_file, bool compress) {
   // Logs should only be rotated once.
   static bool rotated = false;
   if (rotated) {
@@ -89,19 +186,7 @@ void rotate_logs(const char* last_log_file, const char* last_kmsg_file) {
   rotated = true;
 
   for (int i = KEEP_LOG_COUNT - 1; i >= 0; --i) {
-    std::string old_log = android::base::StringPrintf("%s", last_log_file);
-    if (i > 0) {
-      old_log += "." + std::to_string(i);
-    }
-    std::string new_log = android::base::StringPrintf("%s.%d", last_log_file, i + 1);
-    // Ignore errors if old_log doesn't exist.
-    rename(old_log.c_str(), new_log.c_str());
-
-    std::string old_kmsg = android::base::StringPrintf("%s", last_kmsg_file);
-    if (i > 0) {
-      old_kmsg += "." + std::to_string(i);
-    }
-    std::string new_kmsg = android::base::StringPrintf("%s.%d", last_kmsg_file, i + 1);
-    rename(old_kmsg.c_str(), new_kmsg.c_str());
+    rotate_log(last_log_file, i, compress);
+    rotate_log(last_kmsg_file, i, compress);
   }
 }
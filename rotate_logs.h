@@ -30,9 +30,16 @@ ssize_t logbasename(log_id_t id, char prio, const char* filename, const char* bu
 ssize_t logrotate(log_id_t id, char prio, const char* filename, const char* buf, size_t len,
                   void* arg);
 
+// Rewrites the recovery/ files of the last pmsg session into the current one, in a single pass over
+// pmsg. last_log and last_kmsg get rotated in pmsg (last_log -> last_log.1 ...) if |*do_rotate| is
+// set or, with |rotate_if_present|, if the last session has either of them; *do_rotate tells
+// whether they were. Returns the result of the pmsg read.
+ssize_t refresh_pmsg_logs(bool* do_rotate, bool rotate_if_present);
+
 // Rename last_log -> last_log.1 -> last_log.2 -> ... -> last_log.$max.
 // Similarly rename last_kmsg -> last_kmsg.1 -> ... -> last_kmsg.$max.
-// Overwrite any existing last_log.$max and last_kmsg.$max.
-void rotate_logs(const char* last_log_file, const char* last_kmsg_file);
+// Overwrite any existing last_log.$max and last_kmsg.$max. With |compress|, the logs older than
+// last_log.1 (resp. last_kmsg.1) are kept gzipped, as last_log.$i.gz.
+void rotate_logs(const char* last_log_file, const char* last_kmsg_file, bool compress = false);
 
 #endif //_ROTATE_LOG_H
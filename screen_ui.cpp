@@ -32,21 +32,33 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/properties.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <minui/minui.h>
 
-#include <healthd/BatteryMonitor.h>
-
 #include "common.h"
 #include "device.h"
+#include "otautil/boot_trace.h"
+#include "otautil/line_index.h"
+#include "otautil/sensor_service.h"
 #include "ui.h"
 
 // Return the current time as a double (including fractions of a second).
@@ -56,43 +68,6 @@ static double now() {
   return tv.tv_sec + tv.tv_usec / 1000000.0;
 }
 
-static void get_battery_status(bool& charged, int& capacity) {
-  struct healthd_config healthd_config = {
-    .batteryStatusPath = android::String8(android::String8::kEmptyString),
-    .batteryHealthPath = android::String8(android::String8::kEmptyString),
-    .batteryPresentPath = android::String8(android::String8::kEmptyString),
-    .batteryCapacityPath = android::String8(android::String8::kEmptyString),
-    .batteryVoltagePath = android::String8(android::String8::kEmptyString),
-    .batteryTemperaturePath = android::String8(android::String8::kEmptyString),
-    .batteryTechnologyPath = android::String8(android::String8::kEmptyString),
-    .batteryCurrentNowPath = android::String8(android::String8::kEmptyString),
-    .batteryCurrentAvgPath = android::String8(android::String8::kEmptyString),
-    .batteryChargeCounterPath = android::String8(android::String8::kEmptyString),
-    .batteryFullChargePath = android::String8(android::String8::kEmptyString),
-    .batteryCycleCountPath = android::String8(android::String8::kEmptyString),
-    .energyCounter = NULL,
-    .boot_min_cap = 0,
-    .screen_on = NULL
-  };
-  healthd_board_init(&healthd_config);
-
-  android::BatteryMonitor monitor;
-  monitor.init(&healthd_config);
-
-  int charge_status = monitor.getChargeStatus();
-  // Treat unknown status as charged.
-  charged = (charge_status != android::BATTERY_STATUS_DISCHARGING &&
-             charge_status != android::BATTERY_STATUS_NOT_CHARGING);
-  android::BatteryProperty prop;
-  android::status_t status = monitor.getProperty(android::BATTERY_PROP_CAPACITY, &prop);
-  // If we can't read battery percentage, it may be a device without battery. In this
-  // situation, use 100 as a fake battery percentage.
-  if (status != 0) {
-    prop.valueInt64 = 100;
-  }
-  capacity = (int)prop.valueInt64;
-}
-
 ScreenMenuItem::~ScreenMenuItem() {
   if (icon_) {
     res_free_surface(icon_);
@@ -129,12 +104,12 @@ ScreenRecoveryUI::ScreenRecoveryUI()
       progressScopeStart(0),
       progressScopeSize(0),
       progress(0),
-      pagesIdentical(false),
+      stalePages(kGraphicsPages),
+      benchmarking_(false),
       text_cols_(0),
       text_rows_(0),
-      text_(nullptr),
+      text_(&log_text_),
       text_col_(0),
-      text_row_(0),
       show_text(false),
       show_text_ever(false),
       previous_row_ended(false),
@@ -142,31 +117,125 @@ ScreenRecoveryUI::ScreenRecoveryUI()
       menu_is_main_(true),
       menu_type_(MT_NONE),
       menu_headers_(nullptr),
+      menu_count_(0),
       menu_start_y_(0),
       show_menu(false),
       menu_show_start(0),
       menu_show_count(0),
       menu_sel(0),
-      file_viewer_text_(nullptr),
+      pending_prints_(nullptr),
+      print_thread_running_(false),
+      print_mutex_(PTHREAD_MUTEX_INITIALIZER),
+      print_cond_(PTHREAD_COND_INITIALIZER),
+      print_thread_stop_(false),
       intro_frames(0),
       loop_frames(0),
       current_frame(0),
       intro_done(false),
+      animation_frame_(nullptr),
+      composed_intro_(false),
+      composed_frame_(-1),
+      redraw_frame_changes_(false),
       stage(-1),
       max_stage(-1),
       locale_(""),
       rtl_locale_(false),
       updateMutex(PTHREAD_MUTEX_INITIALIZER),
+      progressCond(PTHREAD_COND_INITIALIZER),
       rainbow(false),
       wrap_count(0) {}
 
-GRSurface* ScreenRecoveryUI::GetCurrentFrame() const {
+// Adds the time spent in its scope to |times|, unless that's nullptr.
+class StageTimer {
+ public:
+  explicit StageTimer(std::vector<int64_t>* times)
+      : times_(times), start_(std::chrono::steady_clock::now()) {}
+  ~StageTimer() {
+    if (times_ != nullptr) {
+      times_->push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - start_)
+                            .count());
+    }
+  }
+
+ private:
+  std::vector<int64_t>* times_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+std::vector<int64_t>* ScreenRecoveryUI::StageTimes(DrawStage stage) {
+  return benchmarking_ ? &stage_times_[stage] : nullptr;
+}
+
+GRSurface* ScreenRecoveryUI::GetCurrentFrame() {
   if (currentIcon == INSTALLING_UPDATE || currentIcon == ERASING) {
-    return intro_done ? loopFrames[current_frame] : introFrames[current_frame];
+    ComposeFrameLocked();
+    return animation_frame_;
   }
   return nullptr;
 }
 
+bool ScreenRecoveryUI::ComposeFrameLocked() {
+  bool intro = !intro_done;
+  AnimationFrame* frames = intro ? introFrames : loopFrames;
+  int target = frames[current_frame].loaded ? static_cast<int>(current_frame) : 0;
+  bool same_sequence = composed_frame_ >= 0 && composed_intro_ == intro;
+  if (same_sequence && composed_frame_ == target) {
+    return false;
+  }
+
+  FrameRect changed;
+  int first;
+  if (same_sequence && composed_frame_ < target) {
+    first = composed_frame_ + 1;
+  } else {
+    // Start over from the whole first frame (going from the intro to the loop, or around it).
+    const GRSurface* key = frames[0].pixels;
+    if (key == nullptr) {
+      return false;
+    }
+    if (animation_frame_ == nullptr || animation_frame_->width != key->width ||
+        animation_frame_->height != key->height) {
+      FreeBitmap(animation_frame_);
+      int x, y;
+      animation_frame_ = nullptr;
+      if (res_create_delta_surface(&animation_frame_, &x, &y, nullptr, key) < 0) {
+        LOG(ERROR) << "Failed to allocate the animation frame";
+        return false;
+      }
+    } else {
+      res_apply_delta_surface(animation_frame_, key, 0, 0);
+    }
+    changed = { 0, 0, key->width, key->height };
+    first = 1;
+  }
+  for (int i = first; i <= target; i++) {
+    const AnimationFrame& frame = frames[i];
+    if (frame.pixels == nullptr) {
+      continue;
+    }
+    res_apply_delta_surface(animation_frame_, frame.pixels, frame.x, frame.y);
+    FrameRect rect = { frame.x, frame.y, frame.x + frame.pixels->width,
+                       frame.y + frame.pixels->height };
+    if (changed.x1 >= changed.x2) {
+      changed = rect;
+    } else {
+      changed = { std::min(changed.x1, rect.x1), std::min(changed.y1, rect.y1),
+                  std::max(changed.x2, rect.x2), std::max(changed.y2, rect.y2) };
+    }
+  }
+  composed_intro_ = intro;
+  composed_frame_ = target;
+  if (changed.x1 >= changed.x2) {
+    return false;
+  }
+  for (int i = kGraphicsPages - 1; i > 0; i--) {
+    frame_changes_[i] = frame_changes_[i - 1];
+  }
+  frame_changes_[0] = changed;
+  return true;
+}
+
 GRSurface* ScreenRecoveryUI::GetCurrentText() const {
   switch (currentIcon) {
     case ERASING:
@@ -186,6 +255,28 @@ int ScreenRecoveryUI::PixelsFromDp(int dp) const {
   return dp * kDensity;
 }
 
+int ScreenRecoveryUI::MenuItemCount() const {
+  return menu_provider_ ? menu_count_ : static_cast<int>(menu_items_.size());
+}
+
+ScreenMenuItem& ScreenRecoveryUI::MenuItemAt(int i) {
+  if (!menu_provider_) {
+    return menu_items_.at(i);
+  }
+  auto it = menu_lazy_items_.find(i);
+  if (it == menu_lazy_items_.end()) {
+    // A redraw only holds on to the item it's drawing, so they can all go.
+    if (menu_lazy_items_.size() >= kMaxLazyMenuItems) {
+      menu_lazy_items_.clear();
+    }
+    it = menu_lazy_items_
+             .emplace(std::piecewise_construct, std::forward_as_tuple(i),
+                      std::forward_as_tuple(menu_provider_(i)))
+             .first;
+  }
+  return it->second;
+}
+
 // Here's the intended layout:
 
 //          | portrait    large        landscape      large
@@ -211,7 +302,8 @@ static constexpr int kLayouts[LAYOUT_MAX][DIMENSION_MAX] = {
 };
 
 int ScreenRecoveryUI::GetAnimationBaseline() const {
-  return GetTextBaseline() - PixelsFromDp(kLayouts[layout_][ICON]) - gr_get_height(loopFrames[0]);
+  return GetTextBaseline() - PixelsFromDp(kLayouts[layout_][ICON]) -
+         gr_get_height(loopFrames[0].pixels);
 }
 
 int ScreenRecoveryUI::GetTextBaseline() const {
@@ -219,8 +311,12 @@ int ScreenRecoveryUI::GetTextBaseline() const {
          gr_get_height(installing_text);
 }
 
+int ScreenRecoveryUI::GetAnimationFps() const {
+  return kAnimationFps;
+}
+
 int ScreenRecoveryUI::GetProgressBaseline() const {
-  int elements_sum = gr_get_height(loopFrames[0]) + PixelsFromDp(kLayouts[layout_][ICON]) +
+  int elements_sum = gr_get_height(loopFrames[0].pixels) + PixelsFromDp(kLayouts[layout_][ICON]) +
                      gr_get_height(installing_text) + PixelsFromDp(kLayouts[layout_][TEXT]) +
                      gr_get_height(progressBarFill);
   int bottom_gap = (ScreenHeight() - elements_sum) / 2;
@@ -256,7 +352,23 @@ void ScreenRecoveryUI::draw_foreground_locked(int& y) {
     int frame_height = gr_get_height(frame);
     int frame_x = kMarginWidth + (ScreenWidth() - frame_width) / 2;
     int frame_y = kMarginHeight + GetAnimationBaseline();
-    DrawSurface(frame, 0, 0, frame_width, frame_height, frame_x, frame_y);
+    if (redraw_frame_changes_) {
+      // The page holds one of the last few frames; draw what changed since any of them.
+      FrameRect rect = frame_changes_[0];
+      for (int i = 1; i < kGraphicsPages; i++) {
+        const FrameRect& change = frame_changes_[i];
+        if (change.x1 < change.x2) {
+          rect = { std::min(rect.x1, change.x1), std::min(rect.y1, change.y1),
+                   std::max(rect.x2, change.x2), std::max(rect.y2, change.y2) };
+        }
+      }
+      if (rect.x1 < rect.x2) {
+        DrawSurface(frame, rect.x1, rect.y1, rect.x2 - rect.x1, rect.y2 - rect.y1,
+                    frame_x + rect.x1, frame_y + rect.y1);
+      }
+    } else {
+      DrawSurface(frame, 0, 0, frame_width, frame_height, frame_x, frame_y);
+    }
     y = frame_y + frame_height;
 
     if (progressBarType != EMPTY) {
@@ -397,7 +509,7 @@ void ScreenRecoveryUI::SelectAndShowBackgroundText(const std::vector<std::string
     text_y += gr_get_height(p.second.get());
   }
   // Update the whole screen.
-  gr_flip();
+  flip_locked();
   pthread_mutex_unlock(&updateMutex);
 }
 
@@ -431,6 +543,87 @@ void ScreenRecoveryUI::CheckBackgroundTextImages(const std::string& saved_locale
   SetLocale(saved_locale);
 }
 
+void ScreenRecoveryUI::BenchmarkRendering() {
+  static constexpr int kFrames = 120;
+  static constexpr const char* kNames[kDrawStages] = { "background", "header", "menu", "text",
+                                                       "foreground", "flip",   "frame" };
+  static const char* kHeaders[] = { "Rendering benchmark", nullptr };
+
+  pthread_mutex_lock(&updateMutex);
+  for (auto& times : stage_times_) {
+    times.clear();
+  }
+  pthread_mutex_unlock(&updateMutex);
+
+  // Draws kFrames frames, each with |draw| under updateMutex, timing every stage.
+  auto run_frames = [this](const std::function<void(int)>& draw) {
+    for (int i = 0; i < kFrames; ++i) {
+      pthread_mutex_lock(&updateMutex);
+      benchmarking_ = true;
+      {
+        StageTimer frame_timer(StageTimes(STAGE_FRAME));
+        draw(i);
+      }
+      benchmarking_ = false;
+      pthread_mutex_unlock(&updateMutex);
+    }
+  };
+
+  pthread_mutex_lock(&updateMutex);
+  Icon icon = currentIcon;
+  pthread_mutex_unlock(&updateMutex);
+  bool text_visible = IsTextVisible();
+  ShowText(false);
+
+  // The installing screen, with full redraws and then progress bar updates.
+  SetBackground(INSTALLING_UPDATE);
+  SetProgressType(DETERMINATE);
+  run_frames([this](int i) {
+    progress = static_cast<float>(i) / kFrames;
+    update_screen_locked();
+  });
+  run_frames([this](int i) {
+    progress = static_cast<float>(i) / kFrames;
+    update_progress_locked();
+  });
+  SetProgressType(EMPTY);
+
+  ShowText(true);
+  run_frames([this](int) { update_screen_locked(); });
+
+  MenuItemVector items;
+  for (int i = 0; i < 10; ++i) {
+    items.emplace_back("Menu item " + std::to_string(i));
+  }
+  StartMenu(false, MT_LIST, kHeaders, items, 0);
+  run_frames([this](int i) {
+    menu_sel = i % MenuItemCount();
+    update_screen_locked();
+  });
+  EndMenu();
+
+  ShowText(text_visible);
+  SetBackground(icon);
+
+  pthread_mutex_lock(&updateMutex);
+  LOG(INFO) << "Rendering benchmark on " << gr_backend_name() << ", " << gr_fb_width() << "x"
+            << gr_fb_height() << " (times in ms):";
+  int64_t frame_p90 = 0;
+  for (int i = 0; i < kDrawStages; ++i) {
+    std::vector<int64_t>& times = stage_times_[i];
+    if (times.empty()) continue;
+    std::sort(times.begin(), times.end());
+    auto percentile = [&times](int p) { return times[(times.size() - 1) * p / 100] / 1000.0; };
+    LOG(INFO) << android::base::StringPrintf(
+        "  %-10s n=%4zu p50 %7.2f p90 %7.2f p99 %7.2f max %7.2f", kNames[i], times.size(),
+        percentile(50), percentile(90), percentile(99), times.back() / 1000.0);
+    if (i == STAGE_FRAME) frame_p90 = times[(times.size() - 1) * 90 / 100];
+  }
+  pthread_mutex_unlock(&updateMutex);
+  Print("Rendering on %s: %.2f ms per frame (p90). See the log for the stages.\n",
+        gr_backend_name(), frame_p90 / 1000.0);
+}
+
 int ScreenRecoveryUI::ScreenWidth() const {
   return gr_fb_width();
 }
@@ -509,10 +702,8 @@ void ScreenRecoveryUI::draw_statusbar_locked() {
 
   int icon_x, icon_y, icon_h, icon_w;
 
-  // Battery status
-  bool batt_charged;
-  int batt_capacity;
-  get_battery_status(batt_charged, batt_capacity);
+  // Battery status, as last polled by the sensor service.
+  int batt_capacity = SensorService::Get().battery().capacity;
   char batt_capacity_str[3 + 1 + 1];
   snprintf(batt_capacity_str, sizeof(batt_capacity_str), "%d%%", batt_capacity);
 
@@ -599,8 +790,12 @@ void ScreenRecoveryUI::draw_text_menu_locked(int& y) {
   // An item should not be displayed if it's shown height would be less than 75% of its true height
   static const int kMinItemHeight = MenuItemHeight() * 3 / 4;
 
-  draw_statusbar_locked();
-  draw_header_locked(y);
+  {
+    StageTimer header_timer(StageTimes(STAGE_HEADER));
+    draw_statusbar_locked();
+    draw_header_locked(y);
+  }
+  StageTimer menu_timer(StageTimes(STAGE_MENU));
 
   if (menu_headers_) {
     SetColor(HEADER);
@@ -613,9 +808,8 @@ void ScreenRecoveryUI::draw_text_menu_locked(int& y) {
 
   menu_start_y_ = y;
   int i;
-  for (i = menu_show_start; i < (int)menu_items_.size() && y + kMinItemHeight < gr_fb_height();
-       ++i) {
-    const ScreenMenuItem& item = menu_items_.at(i);
+  for (i = menu_show_start; i < MenuItemCount() && y + kMinItemHeight < gr_fb_height(); ++i) {
+    const ScreenMenuItem& item = MenuItemAt(i);
     if (i == menu_sel) {
       SetColor(MENU_SEL_FG);
       y += menu_char_height_;
@@ -660,13 +854,17 @@ void ScreenRecoveryUI::draw_grid_menu_locked(int& y) {
   int grid_w = h_unit * 3;
   int grid_h = v_unit * 3;
 
-  draw_statusbar_locked();
-  draw_header_locked(y);
+  {
+    StageTimer header_timer(StageTimes(STAGE_HEADER));
+    draw_statusbar_locked();
+    draw_header_locked(y);
+  }
+  StageTimer menu_timer(StageTimes(STAGE_MENU));
 
   menu_start_y_ = y;
   int i;
-  for (i = menu_show_start; i < (int)menu_items_.size() && y + grid_h < gr_fb_height(); ++i) {
-    ScreenMenuItem& item = menu_items_.at(i);
+  for (i = menu_show_start; i < MenuItemCount() && y + grid_h < gr_fb_height(); ++i) {
+    ScreenMenuItem& item = MenuItemAt(i);
     int grid_x = kMarginWidth + ((i % 2) ? h_unit * 5 : h_unit * 1);
     int grid_y = y;
     if (item.icon()) {
@@ -695,9 +893,12 @@ void ScreenRecoveryUI::draw_grid_menu_locked(int& y) {
 // Redraws everything on the screen. Does not flip pages. Should only be called with updateMutex
 // locked.
 void ScreenRecoveryUI::draw_screen_locked() {
-  pagesIdentical = false;
-  gr_color(0, 0, 0, 255);
-  gr_clear();
+  stalePages = kGraphicsPages - 1;
+  {
+    StageTimer clear_timer(StageTimes(STAGE_BACKGROUND));
+    gr_color(0, 0, 0, 255);
+    gr_clear();
+  }
 
   int y = kMarginHeight;
   if (show_menu) {
@@ -724,43 +925,80 @@ void ScreenRecoveryUI::draw_screen_locked() {
       DrawTextLine(text_x, text_y, lineage_version_.c_str(), false);
     }
   } else {
-    draw_background_locked();
-    draw_foreground_locked(y);
+    {
+      StageTimer background_timer(StageTimes(STAGE_BACKGROUND));
+      draw_background_locked();
+    }
+    {
+      StageTimer foreground_timer(StageTimes(STAGE_FOREGROUND));
+      draw_foreground_locked(y);
+    }
 
     if (show_text) {
+      StageTimer text_timer(StageTimes(STAGE_TEXT));
       // Display from the bottom up, until we hit the top of the screen, the
       // bottom of the foreground, or we've displayed the entire text buffer.
       SetColor(LOG);
-      int row = (text_rows_ - 1) % text_rows_;
       size_t count = 0;
       for (int ty = gr_fb_height() - kMarginHeight - char_height_; ty >= y && count < text_rows_;
            ty -= char_height_, ++count) {
-        DrawTextLine(kMarginWidth, ty, text_[row], false);
-        --row;
-        if (row < 0) row = text_rows_ - 1;
+        DrawTextLine(kMarginWidth, ty, text_->Row(count), false);
       }
     }
   }
+
+  if (benchmarking_) {
+    draw_benchmark_overlay_locked();
+  }
+}
+
+// Shows the time each stage took to draw the previous frame, in the top left corner.
+void ScreenRecoveryUI::draw_benchmark_overlay_locked() {
+  static constexpr const char* kNames[kDrawStages] = { "bg",   "header", "menu", "text",
+                                                       "fg",   "flip",   "frame" };
+  std::string line;
+  for (int i = 0; i < kDrawStages; ++i) {
+    if (stage_times_[i].empty()) continue;
+    line += android::base::StringPrintf("%s %.1f ", kNames[i], stage_times_[i].back() / 1000.0);
+  }
+  if (line.empty()) return;
+  line += "ms";
+  gr_color(0, 0, 0, 255);
+  gr_fill(0, 0, gr_measure(gr_sys_font(), line.c_str()) + 2 * kMarginWidth,
+          kMarginHeight + char_height_);
+  SetColor(INFO);
+  gr_text(gr_sys_font(), kMarginWidth, kMarginHeight, line.c_str(), false);
 }
 
 // Redraw everything on the screen and flip the screen (make it visible).
 // Should only be called with updateMutex locked.
 void ScreenRecoveryUI::update_screen_locked() {
   draw_screen_locked();
+  StageTimer flip_timer(StageTimes(STAGE_FLIP));
+  flip_locked();
+}
+
+// Should only be called with updateMutex locked.
+void ScreenRecoveryUI::flip_locked() {
   gr_flip();
 }
 
 // Updates only the progress bar, if possible, otherwise redraws the screen.
 // Should only be called with updateMutex locked.
 void ScreenRecoveryUI::update_progress_locked() {
-  if (!pagesIdentical) {
+  if (stalePages > 0) {
+    int remaining = stalePages - 1;
     draw_screen_locked();
-    pagesIdentical = true;
+    stalePages = remaining;
   } else {
+    StageTimer foreground_timer(StageTimes(STAGE_FOREGROUND));
     int y = kMarginHeight;
+    redraw_frame_changes_ = true;
     draw_foreground_locked(y);
+    redraw_frame_changes_ = false;
   }
-  gr_flip();
+  StageTimer flip_timer(StageTimes(STAGE_FLIP));
+  flip_locked();
 }
 
 // Keeps the progress bar updated, even when the process is otherwise busy.
@@ -770,16 +1008,36 @@ void* ScreenRecoveryUI::ProgressThreadStartRoutine(void* data) {
 }
 
 void ScreenRecoveryUI::ProgressThreadLoop() {
-  double interval = 1.0 / kAnimationFps;
-  while (true) {
+  double interval = 1.0 / GetAnimationFps();
+  double next_frame = now();
+  pthread_mutex_lock(&updateMutex);
+  while (progressBarType != EMPTY) {
+    // Only the installation animation and a timed progress bar move on their own. Without either,
+    // sleep until SetBackground(), SetProgressType() or ShowProgress() changes that; everything
+    // else redraws the screen itself.
+    bool animating = currentIcon == INSTALLING_UPDATE || currentIcon == ERASING;
+    int duration = progressScopeDuration;
+    bool timed = progressBarType == DETERMINATE && duration > 0 && progress < 1.0;
+    if (!animating && !timed) {
+      pthread_cond_wait(&progressCond, &updateMutex);
+      next_frame = now();
+      continue;
+    }
+
     double start = now();
-    pthread_mutex_lock(&updateMutex);
+    if (start < next_frame) {
+      // Wait for the next frame, or for a change that calls for another look.
+      timespec deadline;
+      deadline.tv_sec = static_cast<time_t>(next_frame);
+      deadline.tv_nsec = static_cast<long>((next_frame - deadline.tv_sec) * 1000000000);
+      pthread_cond_timedwait(&progressCond, &updateMutex, &deadline);
+      continue;
+    }
 
     bool redraw = false;
 
     // update the installation animation, if active
-    // skip this if we have a text overlay (too expensive to update)
-    if ((currentIcon == INSTALLING_UPDATE || currentIcon == ERASING)) {
+    if (animating) {
       if (!intro_done) {
         if (current_frame == intro_frames - 1) {
           intro_done = true;
@@ -790,34 +1048,31 @@ void ScreenRecoveryUI::ProgressThreadLoop() {
       } else {
         current_frame = (current_frame + 1) % loop_frames;
       }
-
-      redraw = true;
+      // A repeated frame (or a single-frame loop) doesn't need redrawing.
+      redraw = ComposeFrameLocked();
     }
 
     // move the progress bar forward on timed intervals, if configured
-    int duration = progressScopeDuration;
-    if (progressBarType == DETERMINATE && duration > 0) {
+    if (timed) {
       double elapsed = now() - progressScopeTime;
       float p = 1.0 * elapsed / duration;
       if (p > 1.0) p = 1.0;
       if (p > progress) {
+        // Skip updates that aren't visibly different.
+        float scale = gr_get_width(progressBarEmpty) * progressScopeSize;
+        if (static_cast<int>(progress * scale) != static_cast<int>(p * scale)) {
+          redraw = true;
+        }
         progress = p;
-        redraw = true;
       }
     }
 
     if (redraw) update_progress_locked();
 
-    pthread_mutex_unlock(&updateMutex);
-
-    if (progressBarType == EMPTY) break;
-
-    double end = now();
     // minimum of 20ms delay between frames
-    double delay = interval - (end - start);
-    if (delay < 0.02) delay = 0.02;
-    usleep(static_cast<useconds_t>(delay * 1000000));
+    next_frame = std::max(start + interval, now() + 0.02);
   }
+  pthread_mutex_unlock(&updateMutex);
 }
 
 void ScreenRecoveryUI::LoadBitmap(const char* filename, GRSurface** surface) {
@@ -838,13 +1093,43 @@ void ScreenRecoveryUI::LoadLocalizedBitmap(const char* filename, GRSurface** sur
   }
 }
 
-static char** Alloc2d(size_t rows, size_t cols) {
-  char** result = new char*[rows];
-  for (size_t i = 0; i < rows; ++i) {
-    result[i] = new char[cols];
-    memset(result[i], 0, cols);
+void TextRing::Init(size_t capacity, size_t cols) {
+  capacity_ = std::max<size_t>(capacity, 1);
+  cols_ = cols;
+  data_.assign(capacity_ * (cols_ + 1), '\0');
+  head_ = 0;
+  count_ = 1;
+}
+
+const char* TextRing::Row(size_t n) const {
+  if (n >= count_) {
+    return "";
+  }
+  return &data_[(head_ + capacity_ - n) % capacity_ * (cols_ + 1)];
+}
+
+char* TextRing::Bottom() {
+  char* row = &data_[head_ * (cols_ + 1)];
+  gr_text_forget(row);
+  return row;
+}
+
+void TextRing::NewLine() {
+  head_ = (head_ + 1) % capacity_;
+  char* row = &data_[head_ * (cols_ + 1)];
+  if (count_ == capacity_) {
+    gr_text_forget(row);
   }
-  return result;
+  row[0] = '\0';
+  count_ = std::min(count_ + 1, capacity_);
+}
+
+void TextRing::Clear() {
+  for (size_t n = 0; n < count_; n++) {
+    gr_text_forget(Row(n));
+  }
+  data_[head_ * (cols_ + 1)] = '\0';
+  count_ = 1;
 }
 
 // Choose the right background string to display during update.
@@ -869,11 +1154,14 @@ bool ScreenRecoveryUI::InitTextParams() {
 }
 
 bool ScreenRecoveryUI::Init(const std::string& locale) {
+  TracePhase trace("ScreenRecoveryUI::Init");
   RecoveryUI::Init(locale);
 
+  TracePhase graphics_trace("gr_init");
   if (!InitTextParams()) {
     return false;
   }
+  graphics_trace.End();
 
 #ifdef RECOVERY_UI_BLANK_UNBLANK_ON_INIT
   gr_fb_blank(true);
@@ -885,15 +1173,19 @@ bool ScreenRecoveryUI::Init(const std::string& locale) {
   // Are we the large variant of our base layout?
   if (gr_fb_height() > PixelsFromDp(800)) ++layout_;
 
-  text_ = Alloc2d(text_rows_, text_cols_ + 1);
-  file_viewer_text_ = Alloc2d(text_rows_, text_cols_ + 1);
-
-  text_row_ = text_rows_ - 1;  // Printed text grows bottom up
+  // Printed text grows bottom up. The history past the screen is only kept if asked for.
+  size_t history = android::base::GetUintProperty<size_t>("ro.recovery.log_history", 0);
+  log_text_.Init(std::max(text_rows_, history), text_cols_);
+  file_viewer_text_.Init(text_rows_, text_cols_);
   text_col_ = 0;
 
+  print_thread_running_ = true;
+  pthread_create(&print_thread_, nullptr, PrintThreadStartRoutine, this);
+
   // Set up the locale info.
   SetLocale(locale);
 
+  TracePhase bitmaps_trace("load_bitmaps");
   // Load logo and scale it if necessary
   // Note 2/45 is our standard margin on each side so the maximum image
   // width is 41/45 of the screen width.
@@ -927,13 +1219,26 @@ bool ScreenRecoveryUI::Init(const std::string& locale) {
   LoadLocalizedBitmap("erasing_text", &erasing_text);
   LoadLocalizedBitmap("no_command_text", &no_command_text);
   LoadLocalizedBitmap("error_text", &error_text);
+  bitmaps_trace.End();
 
+  TracePhase animation_trace("load_animation");
   LoadAnimation();
 
   return true;
 }
 
 void ScreenRecoveryUI::Stop() {
+  if (print_thread_running_) {
+    pthread_mutex_lock(&print_mutex_);
+    print_thread_stop_ = true;
+    pthread_cond_signal(&print_cond_);
+    pthread_mutex_unlock(&print_mutex_);
+    pthread_join(print_thread_, nullptr);
+    print_thread_running_ = false;
+  }
+  pthread_mutex_lock(&updateMutex);
+  ApplyPendingPrintsLocked();
+  pthread_mutex_unlock(&updateMutex);
   RecoveryUI::Stop();
   gr_fb_blank(true);
 }
@@ -964,15 +1269,128 @@ void ScreenRecoveryUI::LoadAnimation() {
   std::sort(intro_frame_names.begin(), intro_frame_names.end());
   std::sort(loop_frame_names.begin(), loop_frame_names.end());
 
-  introFrames = new GRSurface*[intro_frames];
-  for (size_t i = 0; i < intro_frames; i++) {
-    LoadBitmap(intro_frame_names.at(i).c_str(), &introFrames[i]);
+  introFrames = new AnimationFrame[intro_frames];
+  loopFrames = new AnimationFrame[loop_frames];
+
+  // Only the first frames are needed to start with: the intro's to show, and the loop's for the
+  // layout. The rest get decoded in the background, while the animation starts.
+  if (intro_frames > 0) {
+    LoadBitmap(intro_frame_names[0].c_str(), &introFrames[0].pixels);
+    introFrames[0].loaded = true;
   }
+  LoadBitmap(loop_frame_names[0].c_str(), &loopFrames[0].pixels);
+  loopFrames[0].loaded = true;
 
-  loopFrames = new GRSurface*[loop_frames];
+  std::vector<std::pair<std::string, AnimationFrame*>> frames;
+  for (size_t i = 0; i < intro_frames; i++) {
+    frames.emplace_back(intro_frame_names[i], &introFrames[i]);
+  }
   for (size_t i = 0; i < loop_frames; i++) {
-    LoadBitmap(loop_frame_names.at(i).c_str(), &loopFrames[i]);
+    frames.emplace_back(loop_frame_names[i], &loopFrames[i]);
+  }
+  std::thread(&ScreenRecoveryUI::LoadAnimationFrames, this, std::move(frames)).detach();
+}
+
+void ScreenRecoveryUI::LoadAnimationFrames(
+    std::vector<std::pair<std::string, AnimationFrame*>> frames) {
+  size_t thread_count = std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1U), 4);
+  // The frames get decoded in parallel but encoded in order, as each of them is compared with the
+  // one before. The decoders stay within a few frames of the encoding, so that only that many
+  // whole frames are around at a time.
+  const size_t window = thread_count * 2;
+  std::mutex mutex;
+  std::condition_variable encoded_cv;
+  size_t next_decode = 0;
+  size_t next_encode = 0;
+  // The decoded frames waiting to be encoded, and whether they're done (nullptr on errors).
+  std::vector<GRSurface*> decoded(frames.size(), nullptr);
+  std::vector<bool> decode_done(frames.size(), false);
+  // The last whole frame of the sequence being encoded, and whether it's ours to free (rather than
+  // the first frame, which is kept).
+  GRSurface* previous = nullptr;
+  bool owns_previous = false;
+  size_t delta_bytes = 0;
+  size_t whole_bytes = 0;
+
+  // Encodes the frames that are next in order and decoded. Called with |mutex| held.
+  auto encode = [&]() {
+    while (next_encode < frames.size() && decode_done[next_encode]) {
+      AnimationFrame* frame = frames[next_encode].second;
+      GRSurface* surface = decoded[next_encode];
+      decoded[next_encode] = nullptr;
+      if (frame->loaded) {
+        // The first frame of a sequence, loaded up front.
+        if (owns_previous) {
+          FreeBitmap(previous);
+        }
+        previous = frame->pixels;
+        owns_previous = false;
+      } else {
+        GRSurface* delta = nullptr;
+        int x = 0, y = 0;
+        if (surface != nullptr && previous != nullptr &&
+            res_create_delta_surface(&delta, &x, &y, previous, surface) < 0) {
+          LOG(ERROR) << "Animation frame " << frames[next_encode].first
+                     << " doesn't match the size of the one before; skipping it";
+          FreeBitmap(surface);
+          surface = nullptr;
+        }
+        if (delta != nullptr) {
+          delta_bytes += delta->height * delta->row_bytes;
+        }
+        if (surface != nullptr) {
+          whole_bytes += surface->height * surface->row_bytes;
+          if (owns_previous) {
+            FreeBitmap(previous);
+          }
+          previous = surface;
+          owns_previous = true;
+        }
+        pthread_mutex_lock(&updateMutex);
+        frame->pixels = delta;
+        frame->x = x;
+        frame->y = y;
+        frame->loaded = true;
+        pthread_mutex_unlock(&updateMutex);
+      }
+      next_encode++;
+    }
+    encoded_cv.notify_all();
+  };
+
+  auto worker = [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      encoded_cv.wait(lock, [&]() { return next_decode < next_encode + window; });
+      size_t i = next_decode++;
+      if (i >= frames.size()) {
+        return;
+      }
+      GRSurface* surface = nullptr;
+      if (!frames[i].second->loaded) {
+        lock.unlock();
+        LoadBitmap(frames[i].first.c_str(), &surface);
+        lock.lock();
+      }
+      decoded[i] = surface;
+      decode_done[i] = true;
+      encode();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < thread_count; i++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
   }
+  if (owns_previous) {
+    FreeBitmap(previous);
+  }
+  LOG(INFO) << "Loaded " << frames.size() << " animation frames (" << delta_bytes
+            << " bytes of changes for " << whole_bytes << " bytes of frames)";
 }
 
 void ScreenRecoveryUI::SetBackground(Icon icon) {
@@ -980,6 +1398,7 @@ void ScreenRecoveryUI::SetBackground(Icon icon) {
 
   if (icon != currentIcon) {
     currentIcon = icon;
+    pthread_cond_signal(&progressCond);
   }
 
   pthread_mutex_unlock(&updateMutex);
@@ -992,6 +1411,7 @@ void ScreenRecoveryUI::SetProgressType(ProgressType type) {
     progressScopeStart = 0;
     progressScopeSize = 0;
     progress = 0;
+    pthread_cond_signal(&progressCond);
     if (progressBarType != EMPTY) {
       update_screen_locked();
       pthread_create(&progress_thread_, nullptr, ProgressThreadStartRoutine, this);
@@ -1009,6 +1429,7 @@ void ScreenRecoveryUI::ShowProgress(float portion, float seconds) {
   progressScopeDuration = seconds;
   progress = 0;
   update_progress_locked();
+  pthread_cond_signal(&progressCond);
   pthread_mutex_unlock(&updateMutex);
 }
 
@@ -1036,15 +1457,84 @@ void ScreenRecoveryUI::SetStage(int current, int max) {
 }
 
 void ScreenRecoveryUI::NewLine() {
-  // Shift the rows array up
-  char* p = text_[0];
-  for (size_t i = 0; i < text_rows_ - 1; i++) {
-    text_[i] = text_[i + 1];
+  text_->NewLine();
+  text_col_ = 0;
+}
+
+void ScreenRecoveryUI::AppendTextLocked(const char* str) {
+  if (text_rows_ == 0 || text_cols_ == 0) {
+    return;
+  }
+  if (previous_row_ended) {
+    NewLine();
   }
-  text_[text_rows_ - 1] = p;
-  memset(text_[text_rows_ - 1], 0, text_cols_ + 1);
+  previous_row_ended = false;
+
+  char* row = text_->Bottom();
+  for (const char* ptr = str; *ptr != '\0'; ++ptr) {
+    if (*ptr == '\n' && *(ptr + 1) == '\0') {
+      // Scroll on the next print
+      row[text_col_] = '\0';
+      previous_row_ended = true;
+    } else if ((*ptr == '\n' && *(ptr + 1) != '\0') || text_col_ >= text_cols_) {
+      // We need to keep printing, scroll now
+      row[text_col_] = '\0';
+      NewLine();
+      row = text_->Bottom();
+    }
+    if (*ptr != '\n') row[text_col_++] = *ptr;
+  }
+  row[text_col_] = '\0';
+}
 
-  text_col_ = 0;
+bool ScreenRecoveryUI::ApplyPendingPrintsLocked() {
+  PendingPrint* pending = pending_prints_.exchange(nullptr);
+  if (pending == nullptr) {
+    return false;
+  }
+  // The list is newest first.
+  PendingPrint* oldest = nullptr;
+  while (pending != nullptr) {
+    PendingPrint* next = pending->next;
+    pending->next = oldest;
+    oldest = pending;
+    pending = next;
+  }
+  while (oldest != nullptr) {
+    AppendTextLocked(oldest->text.c_str());
+    PendingPrint* next = oldest->next;
+    delete oldest;
+    oldest = next;
+  }
+  return true;
+}
+
+void* ScreenRecoveryUI::PrintThreadStartRoutine(void* data) {
+  reinterpret_cast<ScreenRecoveryUI*>(data)->PrintThreadLoop();
+  return nullptr;
+}
+
+void ScreenRecoveryUI::PrintThreadLoop() {
+  while (true) {
+    pthread_mutex_lock(&print_mutex_);
+    while (pending_prints_.load() == nullptr && !print_thread_stop_) {
+      pthread_cond_wait(&print_cond_, &print_mutex_);
+    }
+    bool stop = print_thread_stop_;
+    pthread_mutex_unlock(&print_mutex_);
+    if (stop) {
+      return;
+    }
+
+    pthread_mutex_lock(&updateMutex);
+    if (ApplyPendingPrintsLocked() && show_text && update_screen_on_print) {
+      update_screen_locked();
+    }
+    pthread_mutex_unlock(&updateMutex);
+
+    // Let the prints that come meanwhile pile up into the next batch.
+    usleep(1000000 / kAnimationFps);
+  }
 }
 
 void ScreenRecoveryUI::PrintV(const char* fmt, bool copy_to_stdout, va_list ap) {
@@ -1055,33 +1545,25 @@ void ScreenRecoveryUI::PrintV(const char* fmt, bool copy_to_stdout, va_list ap)
     fputs(str.c_str(), stdout);
   }
 
-  pthread_mutex_lock(&updateMutex);
-  if (text_rows_ > 0 && text_cols_ > 0) {
-    if (previous_row_ended) {
-      NewLine();
-    }
-    previous_row_ended = false;
-
-    size_t row = text_rows_ - 1;
-    for (const char* ptr = str.c_str(); *ptr != '\0'; ++ptr) {
-      if (*ptr == '\n' && *(ptr + 1) == '\0') {
-        // Scroll on the next print
-        text_[row][text_col_] = '\0';
-        previous_row_ended = true;
-      } else if ((*ptr == '\n' && *(ptr + 1) != '\0') || text_col_ >= text_cols_) {
-        // We need to keep printing, scroll now
-        text_[row][text_col_] = '\0';
-        NewLine();
-      }
-      if (*ptr != '\n') text_[row][text_col_++] = *ptr;
-    }
-    text_[row][text_col_] = '\0';
-
+  if (!print_thread_running_) {
+    pthread_mutex_lock(&updateMutex);
+    AppendTextLocked(str.c_str());
     if (show_text && update_screen_on_print) {
       update_screen_locked();
     }
+    pthread_mutex_unlock(&updateMutex);
+    return;
+  }
+
+  PendingPrint* print = new PendingPrint{ std::move(str), pending_prints_.load() };
+  while (!pending_prints_.compare_exchange_weak(print->next, print)) {
+  }
+  // Only the first print of a batch needs to wake up the print thread.
+  if (print->next == nullptr) {
+    pthread_mutex_lock(&print_mutex_);
+    pthread_cond_signal(&print_cond_);
+    pthread_mutex_unlock(&print_mutex_);
   }
-  pthread_mutex_unlock(&updateMutex);
 }
 
 void ScreenRecoveryUI::Print(const char* fmt, ...) {
@@ -1098,80 +1580,152 @@ void ScreenRecoveryUI::PrintOnScreenOnly(const char *fmt, ...) {
   va_end(ap);
 }
 
-void ScreenRecoveryUI::PutChar(char ch) {
+void ScreenRecoveryUI::ClearText() {
   pthread_mutex_lock(&updateMutex);
-  if (ch != '\n') text_[text_row_][text_col_++] = ch;
-  if (ch == '\n' || text_col_ >= text_cols_) {
-    text_col_ = 0;
-    ++text_row_;
-  }
+  ApplyPendingPrintsLocked();
+  text_col_ = 0;
+  text_->Clear();
   pthread_mutex_unlock(&updateMutex);
 }
 
-void ScreenRecoveryUI::ClearText() {
+// A position in the file viewer: a line of the file, and a row of it once wrapped to the screen.
+struct ViewerPosition {
+  size_t line;
+  size_t row;
+};
+
+// Returns the number of screen rows |line| takes up, wrapped at |cols| columns.
+static size_t WrappedRows(LineIndex& index, size_t line, size_t cols) {
+  size_t offset;
+  size_t length;
+  index.GetLine(line, &offset, &length);
+  return std::max<size_t>((length + cols - 1) / cols, 1);
+}
+
+// Moves |pos| |rows| rows further into the file. Returns false, leaving |pos| alone, if that goes
+// past the end.
+static bool AdvanceRows(LineIndex& index, size_t cols, size_t rows, ViewerPosition* pos) {
+  ViewerPosition next = *pos;
+  for (size_t i = 0; i < rows; i++) {
+    if (!index.WaitForLine(next.line)) {
+      return false;
+    }
+    if (++next.row >= WrappedRows(index, next.line, cols)) {
+      next.line++;
+      next.row = 0;
+    }
+  }
+  if (!index.WaitForLine(next.line)) {
+    return false;
+  }
+  *pos = next;
+  return true;
+}
+
+// Moves |pos| |rows| rows back, stopping at the start of the file.
+static void RetreatRows(LineIndex& index, size_t cols, size_t rows, ViewerPosition* pos) {
+  for (size_t i = 0; i < rows && (pos->line > 0 || pos->row > 0); i++) {
+    if (pos->row > 0) {
+      pos->row--;
+    } else {
+      pos->line--;
+      pos->row = WrappedRows(index, pos->line, cols) - 1;
+    }
+  }
+}
+
+void ScreenRecoveryUI::DrawFileViewerPage(LineIndex& index, const ViewerPosition& top,
+                                          const std::string& status) {
+  // Gathers the rows first, as the lines may not have been indexed yet.
+  size_t page_rows = text_rows_ - 1;
+  std::vector<std::pair<const char*, size_t>> rows;
+  ViewerPosition pos = top;
+  while (rows.size() < page_rows && index.WaitForLine(pos.line)) {
+    size_t offset;
+    size_t length;
+    index.GetLine(pos.line, &offset, &length);
+    size_t start = std::min(pos.row * text_cols_, length);
+    rows.emplace_back(index.data() + offset + start, std::min(length - start, text_cols_));
+    if (++pos.row >= WrappedRows(index, pos.line, text_cols_)) {
+      pos.line++;
+      pos.row = 0;
+    }
+  }
+
   pthread_mutex_lock(&updateMutex);
-  text_col_ = 0;
-  text_row_ = 0;
-  for (size_t i = 0; i < text_rows_; ++i) {
-    memset(text_[i], 0, text_cols_ + 1);
+  ApplyPendingPrintsLocked();
+  text_->Clear();
+  for (size_t i = 0; i < page_rows; i++) {
+    char* row = text_->Bottom();
+    size_t length = i < rows.size() ? rows[i].second : 0;
+    if (length > 0) {
+      memcpy(row, rows[i].first, length);
+    }
+    row[length] = '\0';
+    text_->NewLine();
   }
+  size_t length = std::min(status.size(), text_cols_);
+  char* row = text_->Bottom();
+  memcpy(row, status.data(), length);
+  row[length] = '\0';
+  text_col_ = 0;
   pthread_mutex_unlock(&updateMutex);
 }
 
-int ScreenRecoveryUI::ShowFile(FILE* fp) {
-  std::vector<off_t> offsets;
-  offsets.push_back(ftello(fp));
-  ClearText();
-
-  struct stat sb;
-  fstat(fileno(fp), &sb);
+// Pages through the file with the volume keys, showing one screen of it at a time. The END key
+// jumps to the last page, and SEARCH (or '/') to the next error logged by recovery.
+int ScreenRecoveryUI::ShowFile(LineIndex& index) {
+  static constexpr const char kErrorPrefix[] = "E:";
+  if (text_rows_ < 2 || text_cols_ == 0) {
+    return -1;
+  }
+  size_t page_rows = text_rows_ - 1;
 
-  bool show_prompt = false;
+  ViewerPosition top = { 0, 0 };
+  std::string note;
   while (true) {
-    if (show_prompt) {
-      PrintOnScreenOnly("--(%d%% of %d bytes)--",
-                        static_cast<int>(100 * (double(ftello(fp)) / double(sb.st_size))),
-                        static_cast<int>(sb.st_size));
-      Redraw();
-      while (show_prompt) {
-        show_prompt = false;
-        RecoveryUI::InputEvent evt = WaitInputEvent();
-        if (evt.type() != RecoveryUI::EVENT_TYPE_KEY) {
-          show_prompt = true;
-          continue;
-        }
-        if (evt.key() == KEY_POWER || evt.key() == KEY_ENTER || evt.key() == KEY_BACKSPACE ||
-            evt.key() == KEY_BACK || evt.key() == KEY_HOME || evt.key() == KEY_HOMEPAGE) {
-          return evt.key();
-        } else if (evt.key() == KEY_UP || evt.key() == KEY_VOLUMEUP) {
-          if (offsets.size() <= 1) {
-            show_prompt = true;
-          } else {
-            offsets.pop_back();
-            fseek(fp, offsets.back(), SEEK_SET);
-          }
-        } else {
-          if (feof(fp)) {
-            return -1;
-          }
-          offsets.push_back(ftello(fp));
-        }
-      }
-      ClearText();
+    bool indexed;
+    size_t lines = index.IndexedLines(&indexed);
+    size_t offset = 0;
+    if (index.WaitForLine(top.line)) {
+      size_t length;
+      index.GetLine(top.line, &offset, &length);
+    } else {
+      offset = index.size();
     }
+    std::string status = android::base::StringPrintf(
+        "--(line %zu of %zu%s, %d%% of %zu bytes)--%s", std::min(top.line + 1, lines), lines,
+        indexed ? "" : "+",
+        index.size() == 0 ? 100 : static_cast<int>(100 * (double(offset) / double(index.size()))),
+        index.size(), note.c_str());
+    note.clear();
+    DrawFileViewerPage(index, top, status);
+    Redraw();
 
-    int ch = getc(fp);
-    if (ch == EOF) {
-      while (text_row_ < text_rows_ - 1) PutChar('\n');
-      show_prompt = true;
-    } else {
-      PutChar(ch);
-      if (text_col_ == 0 && text_row_ >= text_rows_ - 1) {
-        show_prompt = true;
+    RecoveryUI::InputEvent evt = WaitInputEvent();
+    if (evt.type() != RecoveryUI::EVENT_TYPE_KEY) {
+      continue;
+    }
+    int key = evt.key();
+    if (key == KEY_POWER || key == KEY_ENTER || key == KEY_BACKSPACE || key == KEY_BACK ||
+        key == KEY_HOME || key == KEY_HOMEPAGE) {
+      return key;
+    } else if (key == KEY_UP || key == KEY_VOLUMEUP) {
+      RetreatRows(index, text_cols_, page_rows, &top);
+    } else if (key == KEY_END) {
+      top = { index.WaitForAll(), 0 };
+      RetreatRows(index, text_cols_, page_rows, &top);
+    } else if (key == KEY_SEARCH || key == KEY_SLASH) {
+      size_t line = index.Find(kErrorPrefix, top.line + 1, true);
+      if (line == SIZE_MAX) {
+        note = " no more errors";
+      } else {
+        top = { line, 0 };
       }
+    } else if (!AdvanceRows(index, text_cols_, page_rows, &top)) {
+      return -1;
     }
   }
-  return -1;
 }
 
 int ScreenRecoveryUI::ShowFile(const char* filename) {
@@ -1180,24 +1734,38 @@ int ScreenRecoveryUI::ShowFile(const char* filename) {
     Print("  Unable to open %s: %s\n", filename, strerror(errno));
     return -1;
   }
+  // The mapping outlives the stream.
+  LineIndex index;
+  bool opened = index.Open(fileno(fp));
+  fclose(fp);
+  if (!opened) {
+    Print("  Unable to read %s\n", filename);
+    return -1;
+  }
 
   Icon oldIcon = currentIcon;
   currentIcon = NONE;
 
-  char** old_text = text_;
+  // The prints so far belong on the main screen, not the file viewer.
+  pthread_mutex_lock(&updateMutex);
+  ApplyPendingPrintsLocked();
+  pthread_mutex_unlock(&updateMutex);
+
+  TextRing* old_text = text_;
   size_t old_text_col = text_col_;
-  size_t old_text_row = text_row_;
 
   // Swap in the alternate screen and clear it.
-  text_ = file_viewer_text_;
+  text_ = &file_viewer_text_;
   ClearText();
 
-  int key = ShowFile(fp);
-  fclose(fp);
+  int key = ShowFile(index);
+
+  pthread_mutex_lock(&updateMutex);
+  ApplyPendingPrintsLocked();
+  pthread_mutex_unlock(&updateMutex);
 
   text_ = old_text;
   text_col_ = old_text_col;
-  text_row_ = old_text_row;
   currentIcon = oldIcon;
   return key;
 }
@@ -1205,12 +1773,28 @@ int ScreenRecoveryUI::ShowFile(const char* filename) {
 void ScreenRecoveryUI::StartMenu(bool is_main, menu_type_t type, const char* const* headers,
                                  const MenuItemVector& items, int initial_selection) {
   pthread_mutex_lock(&updateMutex);
-  menu_is_main_ = is_main;
-  menu_type_ = type;
-  menu_headers_ = headers;
   for (auto& item : items) {
     menu_items_.push_back(ScreenMenuItem(item));
   }
+  StartMenuLocked(is_main, type, headers, initial_selection);
+  pthread_mutex_unlock(&updateMutex);
+}
+
+void ScreenRecoveryUI::StartLazyMenu(bool is_main, menu_type_t type, const char* const* headers,
+                                     size_t count, const MenuItemProvider& provider,
+                                     int initial_selection) {
+  pthread_mutex_lock(&updateMutex);
+  menu_provider_ = provider;
+  menu_count_ = static_cast<int>(count);
+  StartMenuLocked(is_main, type, headers, initial_selection);
+  pthread_mutex_unlock(&updateMutex);
+}
+
+void ScreenRecoveryUI::StartMenuLocked(bool is_main, menu_type_t type, const char* const* headers,
+                                       int initial_selection) {
+  menu_is_main_ = is_main;
+  menu_type_ = type;
+  menu_headers_ = headers;
   show_menu = true;
   menu_sel = initial_selection;
   menu_show_start = 0;
@@ -1219,7 +1803,6 @@ void ScreenRecoveryUI::StartMenu(bool is_main, menu_type_t type, const char* con
     menu_show_start = menu_sel - (menu_show_count - 1);
   }
   update_screen_locked();
-  pthread_mutex_unlock(&updateMutex);
 }
 
 int ScreenRecoveryUI::SelectMenu(int sel) {
@@ -1231,10 +1814,10 @@ int ScreenRecoveryUI::SelectMenu(int sel) {
     // Handle wrapping and back item
     menu_sel = sel;
     if (sel < 0 && (menu_is_main_ || sel < -1)) {
-      menu_sel = (int)menu_items_.size() - 1;
+      menu_sel = MenuItemCount() - 1;
       wrapped = -1;
     }
-    if (sel >= (int)menu_items_.size()) {
+    if (sel >= MenuItemCount()) {
       menu_sel = (menu_is_main_ ? 0 : -1);
       wrapped = 1;
     }
@@ -1300,7 +1883,7 @@ int ScreenRecoveryUI::SelectMenu(const Point& point) {
         default:
           break;
       }
-      if (sel >= (int)menu_items_.size()) {
+      if (sel >= MenuItemCount()) {
         sel = Device::kNoAction;
       }
     }
@@ -1316,7 +1899,7 @@ int ScreenRecoveryUI::SelectMenu(const Point& point) {
 
 int ScreenRecoveryUI::ScrollMenu(int updown) {
   pthread_mutex_lock(&updateMutex);
-  if ((updown > 0 && menu_show_start + menu_show_count < (int)menu_items_.size()) ||
+  if ((updown > 0 && menu_show_start + menu_show_count < MenuItemCount()) ||
       (updown < 0 && menu_show_start > 0)) {
     menu_show_start += updown;
 
@@ -1347,6 +1930,9 @@ void ScreenRecoveryUI::EndMenu() {
   menu_type_ = MT_NONE;
   menu_headers_ = nullptr;
   menu_items_.clear();
+  menu_provider_ = nullptr;
+  menu_count_ = 0;
+  menu_lazy_items_.clear();
   pthread_mutex_unlock(&updateMutex);
 }
 
@@ -1373,6 +1959,7 @@ void ScreenRecoveryUI::ShowText(bool visible) {
 
 void ScreenRecoveryUI::Redraw() {
   pthread_mutex_lock(&updateMutex);
+  ApplyPendingPrintsLocked();
   update_screen_locked();
   pthread_mutex_unlock(&updateMutex);
 }
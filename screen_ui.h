@@ -21,7 +21,10 @@
 #include <pthread.h>
 #include <stdio.h>
 
+#include <atomic>
+#include <map>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "ui.h"
@@ -31,6 +34,9 @@
 // From minui/minui.h.
 struct GRSurface;
 
+class LineIndex;
+struct ViewerPosition;
+
 class ScreenMenuItem {
  public:
   ScreenMenuItem() : icon_(nullptr), icon_sel_(nullptr) {}
@@ -57,6 +63,54 @@ class ScreenMenuItem {
 };
 typedef std::vector<ScreenMenuItem> ScreenMenuItemVector;
 
+// The rows of a text console, the newest at the bottom. They're kept in a ring, allocated once by
+// Init(), so starting a row is O(1) however deep the history is.
+class TextRing {
+ public:
+  // Makes room for |capacity| rows of up to |cols| characters each.
+  void Init(size_t capacity, size_t cols);
+
+  size_t capacity() const {
+    return capacity_;
+  }
+
+  // Returns the row |n| rows above the bottom one, or an empty one past the rows written since
+  // the last Clear().
+  const char* Row(size_t n) const;
+
+  // Returns the bottom row, which may be written up to its cols() characters and a NUL. What minui
+  // keeps of the text it held for gr_text() is dropped, as that's about to change.
+  char* Bottom();
+
+  // Starts an empty bottom row, dropping the oldest row (and what minui keeps of it) once the ring
+  // is full.
+  void NewLine();
+
+  // Leaves a single empty row, dropping what minui keeps of the others.
+  void Clear();
+
+ private:
+  std::vector<char> data_;
+  size_t capacity_ = 0;
+  size_t cols_ = 0;
+  // The index of the bottom row, and the number of rows in use.
+  size_t head_ = 0;
+  size_t count_ = 0;
+};
+
+// A frame of the installing animation. The first frames of the intro and of the loop are kept
+// whole; the others only as the rectangle that differs from the frame before them, which the
+// playback copies over that one. Consecutive frames mostly share the same background, so this
+// takes a fraction of the memory of keeping every frame whole.
+struct AnimationFrame {
+  // Whether the frame has been decoded yet.
+  bool loaded = false;
+  // The pixels of the frame at (x, y), or nullptr for a repeat of the frame before.
+  GRSurface* pixels = nullptr;
+  int x = 0;
+  int y = 0;
+};
+
 // Implementation of RecoveryUI appropriate for devices with a screen
 // (shows an icon + a progress bar, text logging, menu, etc.)
 class ScreenRecoveryUI : public RecoveryUI {
@@ -105,6 +159,8 @@ class ScreenRecoveryUI : public RecoveryUI {
   // menu display
   void StartMenu(bool is_main, menu_type_t type, const char* const* headers,
                  const MenuItemVector& items, int initial_selection) override;
+  void StartLazyMenu(bool is_main, menu_type_t type, const char* const* headers, size_t count,
+                     const MenuItemProvider& provider, int initial_selection) override;
   int SelectMenu(int sel) override;
   int SelectMenu(const Point& point) override;
   int ScrollMenu(int updown) override;
@@ -133,6 +189,10 @@ class ScreenRecoveryUI : public RecoveryUI {
   // embedded in the png file, and power button to go back to recovery main menu.
   void CheckBackgroundTextImages(const std::string& saved_locale);
 
+  // Draws the usual screens (installing, log text, menu) for a while, with the time each drawing
+  // stage took shown on the screen, and logs their percentiles.
+  void BenchmarkRendering();
+
  protected:
   // The margin that we don't want to use for showing texts (e.g. round screen, or screen with
   // rounded corners).
@@ -156,28 +216,51 @@ class ScreenRecoveryUI : public RecoveryUI {
   virtual void draw_screen_locked();
   virtual void update_screen_locked();
   virtual void update_progress_locked();
-
-  GRSurface* GetCurrentFrame() const;
+  // Makes what has been drawn visible.
+  virtual void flip_locked();
+
+  // Returns the current animation frame, or nullptr if there's no animation.
+  GRSurface* GetCurrentFrame();
+  // Brings animation_frame_ up to the current frame of the animation. Frames that are still being
+  // decoded in the background are stood in for by the first one. Returns whether it changed.
+  bool ComposeFrameLocked();
   GRSurface* GetCurrentText() const;
 
   static void* ProgressThreadStartRoutine(void* data);
   void ProgressThreadLoop();
 
-  virtual int ShowFile(FILE*);
+  virtual int ShowFile(LineIndex& index);
+  // Fills the file viewer screen with the rows of |index| from |top| on, and |status| below them.
+  void DrawFileViewerPage(LineIndex& index, const ViewerPosition& top, const std::string& status);
   virtual void PrintV(const char*, bool, va_list);
+  // Appends |str| to the log text. Should only be called with updateMutex locked.
+  void AppendTextLocked(const char* str);
+  // Moves the pending prints into the log text, oldest first. Returns whether there were any.
+  // Should only be called with updateMutex locked.
+  bool ApplyPendingPrintsLocked();
+  static void* PrintThreadStartRoutine(void* data);
+  void PrintThreadLoop();
   void NewLine();
-  void PutChar(char);
   void ClearText();
 
   void LoadAnimation();
+  // Decodes the given animation frames into their slots on a few threads, and keeps each of them as
+  // the difference from the one before. The frames that are loaded already start a new sequence.
+  void LoadAnimationFrames(std::vector<std::pair<std::string, AnimationFrame*>> frames);
   void LoadBitmap(const char* filename, GRSurface** surface);
   void FreeBitmap(GRSurface* surface);
   void LoadLocalizedBitmap(const char* filename, GRSurface** surface);
 
   int PixelsFromDp(int dp) const;
+  // The number of items of the current menu.
+  int MenuItemCount() const;
+  // Returns the item |i| of the current menu, producing it first if the menu is a lazy one.
+  ScreenMenuItem& MenuItemAt(int i);
   virtual int GetAnimationBaseline() const;
   virtual int GetProgressBaseline() const;
   virtual int GetTextBaseline() const;
+  // Returns the frame rate of the animation and of the timed progress bar.
+  virtual int GetAnimationFps() const;
 
   // Returns pixel width of draw buffer.
   virtual int ScreenWidth() const;
@@ -218,8 +301,8 @@ class ScreenRecoveryUI : public RecoveryUI {
   GRSurface* installing_text;
   GRSurface* no_command_text;
 
-  GRSurface** introFrames;
-  GRSurface** loopFrames;
+  AnimationFrame* introFrames;
+  AnimationFrame* loopFrames;
 
   GRSurface* progressBarEmpty;
   GRSurface* progressBarFill;
@@ -231,14 +314,38 @@ class ScreenRecoveryUI : public RecoveryUI {
   float progressScopeStart, progressScopeSize, progress;
   double progressScopeTime, progressScopeDuration;
 
-  // true when both graphics pages are the same (except for the progress bar).
-  bool pagesIdentical;
+  // The number of graphics pages that still hold an older screen, rather than the current one with
+  // a different progress bar. minui backends flip between up to kGraphicsPages of them.
+  static constexpr int kGraphicsPages = 3;
+  int stalePages;
+
+  // The stages of drawing a frame that BenchmarkRendering() times.
+  enum DrawStage {
+    STAGE_BACKGROUND,
+    STAGE_HEADER,
+    STAGE_MENU,
+    STAGE_TEXT,
+    STAGE_FOREGROUND,
+    STAGE_FLIP,
+    STAGE_FRAME,
+    kDrawStages
+  };
+  // Returns where to add the time spent in |stage|, or nullptr when not benchmarking.
+  std::vector<int64_t>* StageTimes(DrawStage stage);
+  void draw_benchmark_overlay_locked();
+  // Whether the frame being drawn is timed, and the times so far (in microseconds).
+  bool benchmarking_;
+  std::vector<int64_t> stage_times_[kDrawStages];
 
   size_t text_cols_, text_rows_;
 
-  // Log text overlay, displayed when a magic key is pressed.
-  char** text_;
-  size_t text_col_, text_row_;
+  // Log text overlay, displayed when a magic key is pressed. It may keep more rows than fit on
+  // the screen, as set by ro.recovery.log_history.
+  TextRing log_text_;
+  // The text on the screen: log_text_, or file_viewer_text_ while viewing a file.
+  TextRing* text_;
+  // The column of the cursor, in the bottom row of text_.
+  size_t text_col_;
 
   bool show_text;
   bool show_text_ever;  // has show_text ever been true?
@@ -250,17 +357,39 @@ class ScreenRecoveryUI : public RecoveryUI {
   menu_type_t menu_type_;
   const char* const* menu_headers_;
   ScreenMenuItemVector menu_items_;
+  // The provider of a menu started with StartLazyMenu(), and the items it has produced for the
+  // recent redraws. Those are dropped once there are kMaxLazyMenuItems of them.
+  static constexpr size_t kMaxLazyMenuItems = 128;
+  MenuItemProvider menu_provider_;
+  int menu_count_;
+  std::map<int, ScreenMenuItem> menu_lazy_items_;
   int menu_start_y_;
   bool show_menu;
   int menu_show_start;
   int menu_show_count;
   int menu_sel;
 
-  // An alternate text screen, swapped with 'text_' when we're viewing a log file.
-  char** file_viewer_text_;
+  // An alternate text screen, swapped in as 'text_' when we're viewing a log file.
+  TextRing file_viewer_text_;
 
   pthread_t progress_thread_;
 
+  // Prints that are yet to reach the log text, newest first. PrintV() only pushes onto this list,
+  // so that chatty callers (e.g. the updater's ui_print) don't wait on updateMutex or on redraws;
+  // the print thread applies them in batches, with one redraw per batch and at most
+  // kAnimationFps batches a second.
+  struct PendingPrint {
+    std::string text;
+    PendingPrint* next;
+  };
+  std::atomic<PendingPrint*> pending_prints_;
+  pthread_t print_thread_;
+  std::atomic<bool> print_thread_running_;
+  // Only used to put the print thread to sleep while there's nothing to print.
+  pthread_mutex_t print_mutex_;
+  pthread_cond_t print_cond_;
+  bool print_thread_stop_;
+
   // Number of intro frames and loop frames in the animation.
   size_t intro_frames;
   size_t loop_frames;
@@ -268,6 +397,24 @@ class ScreenRecoveryUI : public RecoveryUI {
   size_t current_frame;
   bool intro_done;
 
+  // A rectangle [x1, x2) x [y1, y2) of animation_frame_.
+  struct FrameRect {
+    int x1 = 0;
+    int y1 = 0;
+    int x2 = 0;
+    int y2 = 0;
+  };
+  // The frames are played back into animation_frame_, which holds frame composed_frame_ (or none
+  // if it's -1) of the intro or of the loop.
+  GRSurface* animation_frame_;
+  bool composed_intro_;
+  int composed_frame_;
+  // The parts of animation_frame_ that changed with each of the last kGraphicsPages changes, most
+  // recent first. When a page is drawn on top of what it held, only those need drawing again.
+  FrameRect frame_changes_[kGraphicsPages];
+  // Set while update_progress_locked() draws on top of the previous screen.
+  bool redraw_frame_changes_;
+
   int stage, max_stage;
 
   int char_width_;
@@ -281,6 +428,8 @@ class ScreenRecoveryUI : public RecoveryUI {
   bool rtl_locale_;
 
   pthread_mutex_t updateMutex;
+  // Wakes up the progress thread when the animation or the progress bar changes.
+  pthread_cond_t progressCond;
 
  private:
   bool rainbow;
@@ -288,6 +437,10 @@ class ScreenRecoveryUI : public RecoveryUI {
 
   void SetLocale(const std::string&);
 
+  // Shows the menu whose items have been set up by StartMenu() or StartLazyMenu().
+  void StartMenuLocked(bool is_main, menu_type_t type, const char* const* headers,
+                       int initial_selection);
+
   // Display the background texts for "erasing", "error", "no_command" and "installing" for the
   // selected locale.
   void SelectAndShowBackgroundText(const std::vector<std::string>& locales_entries, size_t sel);
@@ -0,0 +1,275 @@
+/*
+ * Copyright (C) 2019 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// The sparse partition entries of the backup (--sparse=1).
+//
+// Before the SOD is written, the block device is read once locally, and the blocks that are all
+// zeros (free space on a discarded or freshly formatted partition) are left out. The partition is
+// then stored as "<name>.sparse", which holds a sparse_header, the table of the extents that hold
+// data, and the data of those extents in order. The restore writes the extents, and zeroes the gaps
+// with BLKZEROOUT, which the kernel turns into a discard or a write-zeroes on flash that has them.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <lib/libtar.h>
+
+#include <fs_mgr.h>
+#include "roots.h"
+
+#include "bu.h"
+
+#define SPARSE_MAGIC "BUSPARS1"
+// The same layout, for the changed extents of an incremental backup. The gaps are left alone.
+#define DELTA_MAGIC "BUDELTA1"
+
+// The granularity of the zero detection.
+#define SPARSE_BLOCK_SIZE 4096
+
+// The size of the reads and writes of the device.
+#define SPARSE_IO_SIZE (1024 * 1024)
+
+struct sparse_header {
+  char magic[8];
+  uint64_t dev_size;
+  uint64_t num_extents;
+};
+
+static bool is_zero(const uint8_t* buf, size_t len) {
+  return buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0;
+}
+
+int sparse_scan(partspec* part) {
+  int fd = open(part->vol->blk_device, O_RDONLY);
+  if (fd < 0) {
+    logmsg("sparse_scan: open %s failed\n", part->vol->blk_device);
+    return -1;
+  }
+
+  uint8_t* buf = (uint8_t*)malloc(SPARSE_IO_SIZE);
+  size_t capacity = 0;
+  free(part->extents);
+  part->extents = NULL;
+  part->num_extents = 0;
+
+  int rc = 0;
+  uint64_t off = 0;
+  while (off < part->size) {
+    size_t len = (size_t)std::min<uint64_t>(SPARSE_IO_SIZE, part->size - off);
+    ssize_t n = pread64(fd, buf, len, off);
+    if (n <= 0) {
+      logmsg("sparse_scan: read %s at %llu failed\n", part->vol->blk_device,
+             (unsigned long long)off);
+      rc = -1;
+      break;
+    }
+    for (ssize_t pos = 0; pos < n; pos += SPARSE_BLOCK_SIZE) {
+      size_t block_len = std::min<size_t>(SPARSE_BLOCK_SIZE, n - pos);
+      if (is_zero(buf + pos, block_len)) continue;
+
+      uint64_t block_off = off + pos;
+      sparse_extent* last = part->num_extents ? &part->extents[part->num_extents - 1] : NULL;
+      if (last != NULL && last->offset + last->length == block_off) {
+        last->length += block_len;
+        continue;
+      }
+      if (part->num_extents == capacity) {
+        capacity = capacity ? capacity * 2 : 64;
+        part->extents = (sparse_extent*)realloc(part->extents, capacity * sizeof(sparse_extent));
+      }
+      part->extents[part->num_extents].offset = block_off;
+      part->extents[part->num_extents].length = block_len;
+      part->num_extents++;
+    }
+    off += n;
+  }
+
+  free(buf);
+  close(fd);
+  return rc;
+}
+
+uint64_t sparse_entry_size(const partspec* part) {
+  uint64_t size = sizeof(sparse_header) + part->num_extents * sizeof(sparse_extent);
+  for (size_t i = 0; i < part->num_extents; ++i) {
+    size += part->extents[i].length;
+  }
+  return size;
+}
+
+static int tar_append_extents(TAR* t, partspec* part, const char* path, const char* magic) {
+  uint64_t size = sparse_entry_size(part);
+  if (tar_append_header(t, path, size) != 0) return -1;
+
+  sparse_header hdr;
+  memcpy(hdr.magic, magic, sizeof(hdr.magic));
+  hdr.dev_size = part->size;
+  hdr.num_extents = part->num_extents;
+  if (tar_data_write(t, &hdr, sizeof(hdr)) != 0 ||
+      tar_data_write(t, part->extents, part->num_extents * sizeof(sparse_extent)) != 0) {
+    return -1;
+  }
+
+  int fd = open(part->vol->blk_device, O_RDONLY);
+  if (fd < 0) {
+    logmsg("tar_append_extents: open %s failed\n", part->vol->blk_device);
+    return -1;
+  }
+  int rc = 0;
+  {
+    DeviceReader reader(fd, std::vector<sparse_extent>(part->extents,
+                                                       part->extents + part->num_extents));
+    const uint8_t* data;
+    size_t len;
+    while ((data = reader.Next(&len)) != nullptr) {
+      if (tar_data_write(t, data, len) != 0) {
+        rc = -1;
+        break;
+      }
+    }
+    if (reader.failed()) rc = -1;
+  }
+  close(fd);
+
+  if (rc == 0) {
+    rc = tar_data_pad(t, size);
+  }
+  return rc;
+}
+
+int tar_append_sparse_device(TAR* t, partspec* part, const char* savename) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s%s", savename, SPARSE_SUFFIX);
+  return tar_append_extents(t, part, path, SPARSE_MAGIC);
+}
+
+int tar_append_delta_device(TAR* t, partspec* part, const char* savename) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s%s", savename, DELTA_SUFFIX);
+  return tar_append_extents(t, part, path, DELTA_MAGIC);
+}
+
+static int zero_range(int fd, uint64_t off, uint64_t len, uint8_t* buf) {
+  if (len == 0) return 0;
+  uint64_t range[2] = { off, len };
+  if (ioctl(fd, BLKZEROOUT, range) == 0) return 0;
+
+  memset(buf, 0, SPARSE_IO_SIZE);
+  while (len > 0) {
+    size_t n = (size_t)std::min<uint64_t>(SPARSE_IO_SIZE, len);
+    if (pwrite64(fd, buf, n, off) != (ssize_t)n) {
+      logmsg("zero_range: write at %llu failed\n", (unsigned long long)off);
+      return -1;
+    }
+    off += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int tar_extract_sparse_device(TAR* t, const char* devname) {
+  uint64_t size = th_get_size(t);
+  uint64_t consumed = 0;
+
+  sparse_header hdr;
+  if (size < sizeof(hdr) || tar_data_read(t, &hdr, sizeof(hdr)) != 0) return -1;
+  consumed += sizeof(hdr);
+  bool delta = memcmp(hdr.magic, DELTA_MAGIC, sizeof(hdr.magic)) == 0;
+  if (!delta && memcmp(hdr.magic, SPARSE_MAGIC, sizeof(hdr.magic)) != 0) {
+    logmsg("tar_extract_sparse_device: bad magic\n");
+    return -1;
+  }
+  if (hdr.num_extents > (size - consumed) / sizeof(sparse_extent)) {
+    logmsg("tar_extract_sparse_device: bad extent count %llu\n",
+           (unsigned long long)hdr.num_extents);
+    return -1;
+  }
+  size_t table_size = hdr.num_extents * sizeof(sparse_extent);
+  sparse_extent* extents = (sparse_extent*)malloc(table_size ? table_size : 1);
+  if (tar_data_read(t, extents, table_size) != 0) {
+    free(extents);
+    return -1;
+  }
+  consumed += table_size;
+
+  int fd = open(devname, O_WRONLY);
+  if (fd < 0) {
+    logmsg("tar_extract_sparse_device: open %s failed\n", devname);
+    free(extents);
+    return -1;
+  }
+  uint8_t* buf = (uint8_t*)malloc(SPARSE_IO_SIZE);
+  // The extents are written behind, while the next ones are read; the zeroed gaps between them
+  // don't overlap with them, and go straight to the device.
+  DeviceWriter* writer = new DeviceWriter(fd);
+  int rc = 0;
+  uint64_t pos = 0;
+  for (size_t i = 0; i < hdr.num_extents && rc == 0; ++i) {
+    uint64_t off = extents[i].offset;
+    uint64_t end = off + extents[i].length;
+    if (off < pos || end > hdr.dev_size || extents[i].length > size - consumed) {
+      logmsg("tar_extract_sparse_device: bad extent %zu\n", i);
+      rc = -1;
+      break;
+    }
+    if (!delta) {
+      rc = zero_range(fd, pos, off - pos, buf);
+    }
+    while (rc == 0 && off < end) {
+      size_t len = (size_t)std::min<uint64_t>(SPARSE_IO_SIZE, end - off);
+      if (tar_data_read(t, buf, len) != 0) {
+        rc = -1;
+        break;
+      }
+      if (!writer->Write(off, buf, len)) {
+        logmsg("tar_extract_sparse_device: write at %llu failed\n", (unsigned long long)off);
+        rc = -1;
+        break;
+      }
+      consumed += len;
+      off += len;
+    }
+    pos = end;
+  }
+  if (rc == 0 && !delta) {
+    rc = zero_range(fd, pos, hdr.dev_size - pos, buf);
+  }
+  // Finish() syncs the device, the zeroed ranges included.
+  if (!writer->Finish() && rc == 0) {
+    logmsg("tar_extract_sparse_device: writing %s failed\n", devname);
+    rc = -1;
+  }
+  delete writer;
+  close(fd);
+
+  // Skip the padding to the next tar header.
+  if (rc == 0 && size % T_BLOCKSIZE != 0) {
+    rc = tar_data_read(t, buf, T_BLOCKSIZE - size % T_BLOCKSIZE);
+  }
+  free(buf);
+  free(extents);
+  return rc;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2019 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// The throughput of the stages of a backup or a restore.
+//
+// Each stage adds the bytes it moved and the time it took, from whatever thread it runs on. Once
+// a second (and at the end) the totals go to the log as one line of key=value pairs:
+//
+//   bu-stats: final=0 elapsed_ms=2003 read_bytes=268435456 read_ms=1630 read_mbps=164.7 ...
+//
+// The time of a stage is the time it was busy (or blocked), so <stage>_mbps is the rate that stage
+// alone could sustain, and the stage with the lowest one is the bottleneck.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <fs_mgr.h>
+#include "roots.h"
+
+#include "bu.h"
+
+#define STATS_REPORT_INTERVAL_MS 1000
+
+static const char* const stat_names[STAT_MAX] = { "read", "hash", "compress", "write", "socket" };
+
+static std::atomic<uint64_t> stat_bytes[STAT_MAX];
+static std::atomic<uint64_t> stat_ns[STAT_MAX];
+static uint64_t stats_start;
+static uint64_t stats_last_report;
+
+uint64_t stats_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_add(bu_stat stat, uint64_t bytes, uint64_t start) {
+  stat_bytes[stat] += bytes;
+  stat_ns[stat] += stats_now() - start;
+}
+
+void stats_reset() {
+  for (int i = 0; i < STAT_MAX; ++i) {
+    stat_bytes[i] = 0;
+    stat_ns[i] = 0;
+  }
+  stats_start = stats_last_report = stats_now();
+}
+
+uint64_t stats_bytes(bu_stat stat) {
+  return stat_bytes[stat];
+}
+
+uint64_t stats_elapsed_ms() {
+  return (stats_now() - stats_start) / 1000000;
+}
+
+void stats_report(bool final_report) {
+  uint64_t now = stats_now();
+  if (!final_report && now - stats_last_report < (uint64_t)STATS_REPORT_INTERVAL_MS * 1000000) {
+    return;
+  }
+  stats_last_report = now;
+
+  char line[1024];
+  char* p = line;
+  char* end = line + sizeof(line);
+  p += snprintf(p, end - p, "bu-stats: final=%d elapsed_ms=%" PRIu64, final_report ? 1 : 0,
+                (now - stats_start) / 1000000);
+  for (int i = 0; i < STAT_MAX && p < end; ++i) {
+    uint64_t bytes = stat_bytes[i];
+    uint64_t ns = stat_ns[i];
+    double mbps = ns ? (double)bytes * 1000 / ns : 0;
+    p += snprintf(p, end - p, " %s_bytes=%" PRIu64 " %s_ms=%" PRIu64 " %s_mbps=%.1f",
+                  stat_names[i], bytes, stat_names[i], ns / 1000000, stat_names[i], mbps);
+  }
+  logmsg("%s\n", line);
+}
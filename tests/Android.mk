@@ -26,6 +26,7 @@ LOCAL_STATIC_LIBRARIES := \
     libminui \
     libotautil \
     libupdater \
+    libotafault \
     libziparchive \
     libutils \
     libz \
@@ -35,10 +36,25 @@ LOCAL_STATIC_LIBRARIES := \
 
 LOCAL_SRC_FILES := \
     unit/asn1_decoder_test.cpp \
+    unit/block_io_trace_test.cpp \
+    unit/boot_trace_test.cpp \
+    unit/command_pipe_test.cpp \
+    unit/delta_surface_test.cpp \
     unit/dirutil_test.cpp \
+    unit/io_uring_test.cpp \
+    unit/line_index_test.cpp \
     unit/locale_test.cpp \
+    unit/memory_budget_test.cpp \
+    unit/open_files_test.cpp \
+    unit/ota_io_test.cpp \
     unit/rangeset_test.cpp \
+    unit/ring_buffer_test.cpp \
+    unit/scaled_surface_test.cpp \
+    unit/sensor_service_test.cpp \
+    unit/sparse_image_test.cpp \
     unit/sysutil_test.cpp \
+    unit/thermalutil_test.cpp \
+    unit/thread_pool_test.cpp \
     unit/zip_test.cpp \
     unit/ziputil_test.cpp
 
@@ -167,6 +183,7 @@ LOCAL_STATIC_LIBRARIES := \
     libsquashfs_utils \
     libcutils \
     libbrotli \
+    liblz4 \
     libBionicGtestMain \
     $(tune2fs_static_libraries)
 
@@ -195,6 +212,136 @@ LOCAL_PICKUP_FILES := $(testdata_continuous_zip_prefix)
 
 include $(BUILD_NATIVE_TEST)
 
+# Benchmarks
+include $(CLEAR_VARS)
+LOCAL_CFLAGS := -Wall -Werror
+LOCAL_MODULE := recovery_benchmark
+LOCAL_C_INCLUDES := bootable/recovery
+LOCAL_SRC_FILES := \
+    benchmark/blockimg_benchmark.cpp
+LOCAL_STATIC_LIBRARIES := \
+    libupdater \
+    libapplypatch \
+    libedify \
+    libbsdiff \
+    libbspatch \
+    libotafault \
+    libbootloader_message \
+    libotautil \
+    libmounts \
+    libdivsufsort \
+    libdivsufsort64 \
+    libfs_mgr \
+    libselinux \
+    libext4_utils \
+    libsparse \
+    libcrypto_utils \
+    libcrypto \
+    libbz \
+    libziparchive \
+    liblog \
+    libutils \
+    libz \
+    libbase \
+    libtune2fs \
+    libfec \
+    libfec_rs \
+    libsquashfs_utils \
+    libcutils \
+    libbrotli \
+    liblz4 \
+    libgoogle-benchmark \
+    $(tune2fs_static_libraries)
+include $(BUILD_NATIVE_BENCHMARK)
+
+# Runs the block based updates of real OTA packages, on copies of their source images.
+include $(CLEAR_VARS)
+LOCAL_CFLAGS := -Wall -Werror
+LOCAL_MODULE := recovery_update_simulator
+LOCAL_C_INCLUDES := bootable/recovery
+LOCAL_SRC_FILES := \
+    benchmark/update_simulator.cpp
+LOCAL_STATIC_LIBRARIES := \
+    libupdater \
+    libapplypatch \
+    libedify \
+    libbspatch \
+    libotafault \
+    libbootloader_message \
+    libotautil \
+    libmounts \
+    libfs_mgr \
+    libselinux \
+    libext4_utils \
+    libsparse \
+    libcrypto_utils \
+    libcrypto \
+    libbz \
+    libziparchive \
+    liblog \
+    libutils \
+    libz \
+    libbase \
+    libtune2fs \
+    libfec \
+    libfec_rs \
+    libsquashfs_utils \
+    libcutils \
+    libbrotli \
+    liblz4 \
+    libgoogle-benchmark \
+    $(tune2fs_static_libraries)
+include $(BUILD_NATIVE_BENCHMARK)
+
+# applypatch / imgdiff benchmarks, which have a main() of their own to register the inputs.
+include $(CLEAR_VARS)
+LOCAL_CFLAGS := -Wall -Werror
+LOCAL_MODULE := recovery_applypatch_benchmark
+LOCAL_C_INCLUDES := bootable/recovery
+LOCAL_SRC_FILES := \
+    benchmark/applypatch_benchmark.cpp
+LOCAL_STATIC_LIBRARIES := \
+    libimgdiff \
+    libapplypatch \
+    libedify \
+    libotafault \
+    libotautil \
+    libbsdiff \
+    libbspatch \
+    libdivsufsort \
+    libdivsufsort64 \
+    libziparchive \
+    libutils \
+    libcrypto \
+    libbz \
+    libz \
+    libbase \
+    libgoogle-benchmark
+LOCAL_SHARED_LIBRARIES := \
+    liblog
+include $(BUILD_NATIVE_BENCHMARK)
+
+# otautil / verifier benchmarks, on generated inputs.
+include $(CLEAR_VARS)
+LOCAL_CFLAGS := -Wall -Werror
+LOCAL_MODULE := recovery_otautil_benchmark
+LOCAL_C_INCLUDES := bootable/recovery
+LOCAL_SRC_FILES := \
+    benchmark/otautil_benchmark.cpp
+LOCAL_STATIC_LIBRARIES := \
+    libverifier \
+    libotautil \
+    libziparchive \
+    libutils \
+    libcrypto \
+    libz \
+    libselinux \
+    libbase \
+    libgoogle-benchmark
+LOCAL_SHARED_LIBRARIES := \
+    liblog
+include $(BUILD_NATIVE_BENCHMARK)
+
 # Host tests
 include $(CLEAR_VARS)
 LOCAL_CFLAGS := -Wall -Werror
@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks the generation of imgdiff patches, and applying them with ApplyImagePatch(), as well
+// as applying plain bsdiff patches with ApplyBSDiffPatch(), on pairs of source and target files.
+//
+// It runs on the boot / recovery images and the zip files in the testdata by default. Set
+// APPLYPATCH_BENCHMARK_INPUTS to a comma-separated list of "<source>:<target>" pairs to run on
+// other files instead, e.g. real boot.img / recovery.img pairs or APKs. The pairs of .zip or .apk
+// files are diffed in zip mode, and the others in image mode.
+//
+// Besides the time and the throughput (of the target bytes), it reports the patch size, the peak
+// RSS of the process and the numbers of chunks of each type in the imgdiff patch. Note that the
+// peak RSS covers the whole process, so run a single benchmark (--benchmark_filter) to attribute
+// it.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+#include <android-base/test_utils.h>
+#include <benchmark/benchmark.h>
+#include <bsdiff/bsdiff.h>
+#include <openssl/sha.h>
+
+#include "applypatch/applypatch.h"
+#include "applypatch/imgdiff.h"
+#include "common/test_constants.h"
+#include "edify/expr.h"
+
+struct InputPair {
+  std::string name;
+  std::string source_file;
+  std::string target_file;
+  std::string source;
+  std::string target;
+  bool zip_mode;
+};
+
+static std::vector<InputPair> LoadInputs() {
+  std::vector<std::pair<std::string, std::string>> files;
+  const char* inputs = getenv("APPLYPATCH_BENCHMARK_INPUTS");
+  if (inputs != nullptr) {
+    for (const auto& pair : android::base::Split(inputs, ",")) {
+      std::vector<std::string> pieces = android::base::Split(pair, ":");
+      CHECK_EQ(2U, pieces.size()) << "Invalid input pair \"" << pair << "\"";
+      files.emplace_back(pieces[0], pieces[1]);
+    }
+  } else {
+    files.emplace_back(from_testdata_base("boot.img"), from_testdata_base("recovery.img"));
+    files.emplace_back(from_testdata_base("deflate_src.zip"),
+                       from_testdata_base("deflate_tgt.zip"));
+  }
+
+  auto is_zip = [](const std::string& path) {
+    return android::base::EndsWith(path, ".zip") || android::base::EndsWith(path, ".apk");
+  };
+  std::vector<InputPair> result;
+  for (const auto& pair : files) {
+    const std::string& source = pair.first;
+    const std::string& target = pair.second;
+    InputPair input;
+    input.name = android::base::Basename(source) + "-" + android::base::Basename(target);
+    input.source_file = source;
+    input.target_file = target;
+    CHECK(android::base::ReadFileToString(source, &input.source)) << "Failed to read " << source;
+    CHECK(android::base::ReadFileToString(target, &input.target)) << "Failed to read " << target;
+    input.zip_mode = is_zip(source) && is_zip(target);
+    result.push_back(std::move(input));
+  }
+  return result;
+}
+
+static std::string GenerateImgdiffPatch(const InputPair& input) {
+  TemporaryFile patch_file;
+  std::vector<const char*> args = { "imgdiff" };
+  if (input.zip_mode) {
+    args.push_back("-z");
+  }
+  args.push_back(input.source_file.c_str());
+  args.push_back(input.target_file.c_str());
+  args.push_back(patch_file.path);
+  CHECK_EQ(0, imgdiff(args.size(), args.data()));
+
+  std::string patch;
+  CHECK(android::base::ReadFileToString(patch_file.path, &patch));
+  return patch;
+}
+
+static int32_t Read4(const std::string& data, size_t pos) {
+  CHECK_LE(pos + 4, data.size());
+  int32_t value;
+  memcpy(&value, data.data() + pos, sizeof(value));
+  return value;
+}
+
+// Counts the chunks of each type in the given imgdiff patch.
+static void CountChunks(const std::string& patch, benchmark::State& state) {
+  CHECK_GE(patch.size(), 12U);
+  CHECK_EQ(0, memcmp(patch.data(), "IMGDIFF2", 8));
+  size_t normal = 0;
+  size_t deflate = 0;
+  size_t raw = 0;
+  int32_t num_chunks = Read4(patch, 8);
+  size_t pos = 12;
+  for (int32_t i = 0; i < num_chunks; i++) {
+    int32_t type = Read4(patch, pos);
+    pos += 4;
+    if (type == CHUNK_NORMAL) {
+      normal++;
+      pos += 24;
+    } else if (type == CHUNK_RAW) {
+      raw++;
+      pos += 4 + static_cast<size_t>(Read4(patch, pos));
+    } else if (type == CHUNK_DEFLATE) {
+      deflate++;
+      pos += 60;
+    } else {
+      LOG(FATAL) << "Unexpected chunk type " << type;
+    }
+  }
+  state.counters["normal_chunks"] = normal;
+  state.counters["deflate_chunks"] = deflate;
+  state.counters["raw_chunks"] = raw;
+}
+
+static void ReportUsage(benchmark::State& state, const InputPair& input, size_t patch_size) {
+  struct rusage usage;
+  CHECK_EQ(0, getrusage(RUSAGE_SELF, &usage));
+  state.SetBytesProcessed(state.iterations() * input.target.size());
+  state.counters["patch_size"] = patch_size;
+  state.counters["peak_rss_kb"] = usage.ru_maxrss;
+}
+
+// Runs |apply| on every iteration, and checks its output against the target.
+template <typename ApplyFn>
+static void ApplyPatch(benchmark::State& state, const InputPair& input, ApplyFn apply) {
+  uint8_t expected_sha1[SHA_DIGEST_LENGTH];
+  SHA1(reinterpret_cast<const uint8_t*>(input.target.data()), input.target.size(), expected_sha1);
+
+  for (auto _ : state) {
+    size_t output_size = 0;
+    SinkFn sink = [&output_size](const unsigned char* /* data */, size_t len) {
+      output_size += len;
+      return len;
+    };
+    SHA_CTX ctx;
+    SHA1_Init(&ctx);
+    CHECK_EQ(0, apply(sink, &ctx));
+
+    uint8_t sha1[SHA_DIGEST_LENGTH];
+    SHA1_Final(sha1, &ctx);
+    CHECK_EQ(input.target.size(), output_size);
+    CHECK_EQ(0, memcmp(expected_sha1, sha1, SHA_DIGEST_LENGTH));
+  }
+}
+
+static void BM_Imgdiff(benchmark::State& state, const InputPair& input) {
+  std::string patch;
+  for (auto _ : state) {
+    patch = GenerateImgdiffPatch(input);
+  }
+
+  CountChunks(patch, state);
+  ReportUsage(state, input, patch.size());
+}
+
+static void BM_ApplyImagePatch(benchmark::State& state, const InputPair& input) {
+  Value patch(VAL_BLOB, GenerateImgdiffPatch(input));
+  const auto* source = reinterpret_cast<const unsigned char*>(input.source.data());
+
+  ApplyPatch(state, input, [&](const SinkFn& sink, SHA_CTX* ctx) {
+    return ApplyImagePatch(source, input.source.size(), patch, sink, ctx, nullptr);
+  });
+
+  CountChunks(patch.data, state);
+  ReportUsage(state, input, patch.data.size());
+}
+
+static void BM_ApplyBSDiffPatch(benchmark::State& state, const InputPair& input) {
+  TemporaryFile patch_file;
+  const auto* source = reinterpret_cast<const unsigned char*>(input.source.data());
+  CHECK_EQ(0, bsdiff::bsdiff(source, input.source.size(),
+                             reinterpret_cast<const uint8_t*>(input.target.data()),
+                             input.target.size(), patch_file.path, nullptr));
+  std::string patch_data;
+  CHECK(android::base::ReadFileToString(patch_file.path, &patch_data));
+  Value patch(VAL_BLOB, patch_data);
+
+  ApplyPatch(state, input, [&](const SinkFn& sink, SHA_CTX* ctx) {
+    return ApplyBSDiffPatch(source, input.source.size(), patch, 0, sink, ctx);
+  });
+
+  ReportUsage(state, input, patch.data.size());
+}
+
+int main(int argc, char** argv) {
+  android::base::SetMinimumLogSeverity(android::base::WARNING);
+
+  // The inputs are registered as benchmarks of their own, so they need to be loaded first.
+  static std::vector<InputPair> inputs = LoadInputs();
+  for (const auto& input : inputs) {
+    benchmark::RegisterBenchmark(("BM_Imgdiff/" + input.name).c_str(),
+                                 [&input](benchmark::State& state) { BM_Imgdiff(state, input); })
+        ->Unit(benchmark::kMillisecond);
+    benchmark::RegisterBenchmark(
+        ("BM_ApplyImagePatch/" + input.name).c_str(),
+        [&input](benchmark::State& state) { BM_ApplyImagePatch(state, input); })
+        ->Unit(benchmark::kMillisecond);
+    benchmark::RegisterBenchmark(
+        ("BM_ApplyBSDiffPatch/" + input.name).c_str(),
+        [&input](benchmark::State& state) { BM_ApplyBSDiffPatch(state, input); })
+        ->Unit(benchmark::kMillisecond);
+  }
+
+  benchmark::Initialize(&argc, argv);
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
@@ -0,0 +1,307 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks block_image_update() on synthetic transfer lists. Each workload consists of the given
+// numbers of 'move', 'bsdiff', stashed 'move' and 'new' commands, each of which writes the given
+// number of blocks split into the given number of fragments. The commands read from the first half
+// of the image and write to the second half, with the fragments of all the commands interleaved.
+//
+// The image is a temporary file by default. Set BLOCKIMG_BENCHMARK_DEVICE to run against a block
+// device (e.g. a loop device) instead, which must be large enough and WILL BE OVERWRITTEN.
+//
+// Besides the throughput, it reports the peak RSS of the process, and the numbers of read and
+// write syscalls per update from /proc/self/io.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <android-base/test_utils.h>
+#include <android-base/unique_fd.h>
+#include <benchmark/benchmark.h>
+#include <bsdiff/bsdiff.h>
+#include <openssl/sha.h>
+#include <ziparchive/zip_archive.h>
+#include <ziparchive/zip_writer.h>
+
+#include "edify/expr.h"
+#include "otautil/SysUtil.h"
+#include "otautil/cache_location.h"
+#include "otautil/print_sha1.h"
+#include "updater/blockimg.h"
+#include "updater/install.h"
+#include "updater/updater.h"
+
+// For e2fsprogs
+extern "C" {
+const char* program_name = "updater";
+}
+
+struct selabel_handle* sehandle = nullptr;
+
+static constexpr size_t kBlockSize = 4096;
+
+static std::string Sha1(const std::string& content) {
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1(reinterpret_cast<const uint8_t*>(content.data()), content.size(), digest);
+  return print_sha1(digest);
+}
+
+// A synthetic update: the source image, the transfer list and the package entries it refers to.
+struct Workload {
+  std::string source;
+  std::vector<std::string> transfer_list;
+  std::string new_data;
+  std::string patch_data;
+  size_t written_blocks;
+};
+
+enum CommandType { kMove, kBsdiff, kStash, kNew };
+
+// Returns the ranges of the |index|-th of |count| commands in the half of the image that starts at
+// block |base|, and the blocks they cover in order.
+static std::string CommandRanges(size_t base, size_t index, size_t count, size_t blocks,
+                                 size_t fragments, std::vector<size_t>* block_list) {
+  size_t length = blocks / fragments;
+  std::string ranges = std::to_string(fragments * 2);
+  for (size_t i = 0; i < fragments; i++) {
+    size_t start = base + (i * count + index) * length;
+    ranges += android::base::StringPrintf(",%zu,%zu", start, start + length);
+    for (size_t b = start; b < start + length; b++) {
+      block_list->push_back(b);
+    }
+  }
+  return ranges;
+}
+
+static std::string GatherBlocks(const std::string& image, const std::vector<size_t>& block_list) {
+  std::string content;
+  content.reserve(block_list.size() * kBlockSize);
+  for (size_t b : block_list) {
+    content.append(image, b * kBlockSize, kBlockSize);
+  }
+  return content;
+}
+
+static Workload GenerateWorkload(size_t moves, size_t diffs, size_t stashes, size_t news,
+                                 size_t blocks, size_t fragments) {
+  CHECK_EQ(0U, blocks % fragments);
+  std::vector<CommandType> types;
+  types.insert(types.end(), moves, kMove);
+  types.insert(types.end(), diffs, kBsdiff);
+  types.insert(types.end(), stashes, kStash);
+  types.insert(types.end(), news, kNew);
+  // Interleave the command types the same way for every run.
+  std::shuffle(types.begin(), types.end(), std::mt19937(42));
+
+  size_t count = types.size();
+  size_t half = count * blocks;
+  Workload workload;
+  workload.written_blocks = half;
+
+  std::mt19937 rng(0);
+  std::uniform_int_distribution<int> byte(0, 255);
+  workload.source.resize(half * 2 * kBlockSize);
+  for (size_t i = 0; i < half * kBlockSize; i++) {
+    workload.source[i] = static_cast<char>(byte(rng));
+  }
+
+  std::vector<std::string>& lines = workload.transfer_list;
+  lines = { "4", std::to_string(half), "1", std::to_string(blocks) };
+  for (size_t i = 0; i < count; i++) {
+    std::vector<size_t> src_blocks;
+    std::vector<size_t> tgt_blocks;
+    std::string src = CommandRanges(0, i, count, blocks, fragments, &src_blocks);
+    std::string tgt = CommandRanges(half, i, count, blocks, fragments, &tgt_blocks);
+    std::string src_content = GatherBlocks(workload.source, src_blocks);
+
+    switch (types[i]) {
+      case kMove:
+        lines.push_back(android::base::StringPrintf("move %s %s %zu %s", Sha1(src_content).c_str(),
+                                                    tgt.c_str(), blocks, src.c_str()));
+        break;
+      case kStash: {
+        std::string id = Sha1(src_content);
+        lines.push_back("stash " + id + " " + src);
+        lines.push_back(android::base::StringPrintf("move %s %s %zu - %s:2,0,%zu", id.c_str(),
+                                                    tgt.c_str(), blocks, id.c_str(), blocks));
+        lines.push_back("free " + id);
+        break;
+      }
+      case kBsdiff: {
+        // Change a byte in each block, so that the patch has some work to do.
+        std::string tgt_content = src_content;
+        for (size_t b = 0; b < blocks; b++) {
+          tgt_content[b * kBlockSize + b % kBlockSize] ^= 0x5a;
+        }
+        TemporaryFile patch_file;
+        CHECK_EQ(0, bsdiff::bsdiff(reinterpret_cast<const uint8_t*>(src_content.data()),
+                                   src_content.size(),
+                                   reinterpret_cast<const uint8_t*>(tgt_content.data()),
+                                   tgt_content.size(), patch_file.path, nullptr));
+        std::string patch;
+        CHECK(android::base::ReadFileToString(patch_file.path, &patch));
+        lines.push_back(android::base::StringPrintf(
+            "bsdiff %zu %zu %s %s %s %zu %s", workload.patch_data.size(), patch.size(),
+            Sha1(src_content).c_str(), Sha1(tgt_content).c_str(), tgt.c_str(), blocks,
+            src.c_str()));
+        workload.patch_data += patch;
+        break;
+      }
+      case kNew:
+        lines.push_back("new " + tgt);
+        workload.new_data += src_content;
+        break;
+    }
+  }
+  return workload;
+}
+
+// Returns the read and write syscall counts of the process so far.
+static std::pair<uint64_t, uint64_t> SyscallCounts() {
+  std::string content;
+  uint64_t reads = 0;
+  uint64_t writes = 0;
+  if (android::base::ReadFileToString("/proc/self/io", &content)) {
+    for (const auto& line : android::base::Split(content, "\n")) {
+      unsigned long long value;
+      if (sscanf(line.c_str(), "syscr: %llu", &value) == 1) reads = value;
+      if (sscanf(line.c_str(), "syscw: %llu", &value) == 1) writes = value;
+    }
+  }
+  return { reads, writes };
+}
+
+static void BM_BlockImageUpdate(benchmark::State& state) {
+  Workload workload = GenerateWorkload(state.range(0), state.range(1), state.range(2),
+                                       state.range(3), state.range(4), state.range(5));
+
+  RegisterBuiltins();
+  RegisterInstallFunctions();
+  RegisterBlockImageFunctions();
+
+  TemporaryFile temp_saved_source;
+  TemporaryFile temp_last_command;
+  TemporaryDir temp_stash_base;
+  TemporaryDir temp_trace_dir;
+  CacheLocation::location().set_cache_temp_source(temp_saved_source.path);
+  CacheLocation::location().set_last_command_file(temp_last_command.path);
+  CacheLocation::location().set_stash_directory_base(temp_stash_base.path);
+  CacheLocation::location().set_transfer_trace_base(std::string(temp_trace_dir.path) + "/trace");
+
+  TemporaryFile zip_file;
+  {
+    FILE* zip_file_ptr = fdopen(zip_file.release(), "wb");
+    ZipWriter zip_writer(zip_file_ptr);
+    std::unordered_map<std::string, std::string> entries = {
+      { "new_data", workload.new_data },
+      { "patch_data", workload.patch_data },
+      { "transfer_list", android::base::Join(workload.transfer_list, '\n') },
+    };
+    for (const auto& entry : entries) {
+      CHECK_EQ(0, zip_writer.StartEntry(entry.first.c_str(), 0));
+      if (!entry.second.empty()) {
+        CHECK_EQ(0, zip_writer.WriteBytes(entry.second.data(), entry.second.size()));
+      }
+      CHECK_EQ(0, zip_writer.FinishEntry());
+    }
+    CHECK_EQ(0, zip_writer.Finish());
+    CHECK_EQ(0, fclose(zip_file_ptr));
+  }
+
+  MemMapping map;
+  CHECK(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  CHECK_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  TemporaryFile image_file;
+  const char* device = getenv("BLOCKIMG_BENCHMARK_DEVICE");
+  std::string image = device != nullptr ? device : image_file.path;
+  std::string script = "block_image_update(\"" + image +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  std::unique_ptr<Expr> expr;
+  int error_count = 0;
+  CHECK_EQ(0, parse_string(script.c_str(), &expr, &error_count));
+
+  uint64_t reads = 0;
+  uint64_t writes = 0;
+  for (auto _ : state) {
+    // Start over from the source image every time, as the commands skip the blocks that have the
+    // target contents already.
+    state.PauseTiming();
+    {
+      android::base::unique_fd fd(open(image.c_str(), O_WRONLY | O_CLOEXEC));
+      CHECK_NE(-1, fd.get());
+      CHECK(android::base::WriteFully(fd, workload.source.data(), workload.source.size()));
+      CHECK_EQ(0, fsync(fd));
+    }
+    TemporaryFile temp_pipe;
+    UpdaterInfo updater_info;
+    updater_info.package_zip = handle;
+    updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+    updater_info.package_zip_addr = map.addr;
+    updater_info.package_zip_len = map.length;
+    State updater_state(script, &updater_info);
+    auto before = SyscallCounts();
+    state.ResumeTiming();
+
+    std::string result;
+    CHECK(Evaluate(&updater_state, expr, &result));
+
+    state.PauseTiming();
+    CHECK_EQ("t", result) << updater_state.errmsg;
+    auto after = SyscallCounts();
+    reads += after.first - before.first;
+    writes += after.second - before.second;
+    CHECK_EQ(0, fclose(updater_info.cmd_pipe));
+    state.ResumeTiming();
+  }
+
+  CloseArchive(handle);
+
+  struct rusage usage;
+  CHECK_EQ(0, getrusage(RUSAGE_SELF, &usage));
+  state.SetBytesProcessed(state.iterations() * workload.written_blocks * kBlockSize);
+  state.counters["peak_rss_kb"] = usage.ru_maxrss;
+  state.counters["read_syscalls"] = benchmark::Counter(reads, benchmark::Counter::kAvgIterations);
+  state.counters["write_syscalls"] = benchmark::Counter(writes, benchmark::Counter::kAvgIterations);
+}
+
+// Args: moves, bsdiffs, stashed moves, news, blocks per command, fragments per command.
+BENCHMARK(BM_BlockImageUpdate)
+    ->Args({ 64, 0, 0, 0, 64, 1 })
+    ->Args({ 64, 0, 0, 0, 64, 16 })
+    ->Args({ 0, 16, 0, 0, 64, 1 })
+    ->Args({ 0, 0, 64, 0, 64, 1 })
+    ->Args({ 0, 0, 0, 64, 64, 1 })
+    ->Args({ 32, 8, 16, 32, 64, 4 })
+    ->Args({ 16, 2, 4, 8, 256, 8 })
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,409 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks the building blocks that the install paths lean on: the RangeSet / SortedRangeSet
+// operations, the ASN.1 decoder, mapping block maps with MemMapping, the whole-file signature
+// verification and the package extraction. All the inputs are generated, so it needs no testdata.
+// The temporary files go to the usual TemporaryFile / TemporaryDir location.
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <android-base/test_utils.h>
+#include <benchmark/benchmark.h>
+#include <openssl/bn.h>
+#include <openssl/obj_mac.h>
+#include <openssl/rsa.h>
+#include <openssl/sha.h>
+#include <ziparchive/zip_archive.h>
+#include <ziparchive/zip_writer.h>
+
+#include "asn1_decoder.h"
+#include "otautil/SysUtil.h"
+#include "otautil/ZipUtil.h"
+#include "otautil/rangeset.h"
+#include "verifier.h"
+
+static constexpr size_t kBlockSize = 4096;
+
+// Returns |count| disjoint ranges of 1 to 8 blocks with gaps of 1 to 8 blocks between them, in
+// ascending order.
+static std::vector<Range> GenerateRanges(size_t count, uint32_t seed = 0) {
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<size_t> length(1, 8);
+  std::vector<Range> ranges;
+  size_t block = 0;
+  for (size_t i = 0; i < count; i++) {
+    block += length(rng);
+    size_t end = block + length(rng);
+    ranges.emplace_back(block, end);
+    block = end;
+  }
+  return ranges;
+}
+
+// The text form of |ranges| that RangeSet::Parse() takes.
+static std::string RangesToText(const std::vector<Range>& ranges) {
+  std::string text = std::to_string(ranges.size() * 2);
+  for (const auto& range : ranges) {
+    text += android::base::StringPrintf(",%zu,%zu", range.first, range.second);
+  }
+  return text;
+}
+
+static void BM_RangeSetParse(benchmark::State& state) {
+  std::string text = RangesToText(GenerateRanges(state.range(0)));
+  for (auto _ : state) {
+    RangeSet rs = RangeSet::Parse(text);
+    CHECK(rs);
+    benchmark::DoNotOptimize(rs.blocks());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  state.SetBytesProcessed(state.iterations() * text.size());
+}
+// Args: ranges.
+BENCHMARK(BM_RangeSetParse)->Arg(16)->Arg(1024)->Arg(65536);
+
+static void BM_RangeSetSplit(benchmark::State& state) {
+  RangeSet rs(GenerateRanges(state.range(0)));
+  for (auto _ : state) {
+    std::vector<RangeSet> groups = rs.Split(state.range(1));
+    CHECK(!groups.empty());
+    benchmark::DoNotOptimize(groups.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+// Args: ranges, groups.
+BENCHMARK(BM_RangeSetSplit)->Args({ 1024, 4 })->Args({ 65536, 4 })->Args({ 65536, 64 });
+
+static void BM_RangeSetOverlaps(benchmark::State& state) {
+  // Two sets whose ranges interleave without overlapping, which is the worst case: every range of
+  // one is checked against the other.
+  std::vector<Range> ranges = GenerateRanges(state.range(0) * 2);
+  std::vector<Range> even;
+  std::vector<Range> odd;
+  for (size_t i = 0; i < ranges.size(); i++) {
+    (i % 2 == 0 ? even : odd).push_back(ranges[i]);
+  }
+  RangeSet first(std::move(even));
+  RangeSet second(std::move(odd));
+  for (auto _ : state) {
+    CHECK(!first.Overlaps(second));
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+// Args: ranges in each set.
+BENCHMARK(BM_RangeSetOverlaps)->Arg(16)->Arg(256)->Arg(4096);
+
+static void BM_SortedRangeSetInsert(benchmark::State& state) {
+  std::vector<Range> ranges = GenerateRanges(state.range(0));
+  std::shuffle(ranges.begin(), ranges.end(), std::mt19937(42));
+  for (auto _ : state) {
+    SortedRangeSet rs;
+    for (const auto& range : ranges) {
+      rs.Insert(range);
+    }
+    CHECK_EQ(ranges.size(), rs.size());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+// Args: ranges, inserted in random order.
+BENCHMARK(BM_SortedRangeSetInsert)->Arg(16)->Arg(256)->Arg(4096);
+
+static void BM_GetOffsetInRangeSet(benchmark::State& state) {
+  std::vector<Range> ranges = GenerateRanges(state.range(0));
+  // Looks up an offset in each of the ranges, in random order.
+  std::vector<size_t> offsets;
+  for (const auto& range : ranges) {
+    offsets.push_back(range.first * kBlockSize + 10);
+  }
+  SortedRangeSet rs(std::move(ranges));
+  std::shuffle(offsets.begin(), offsets.end(), std::mt19937(42));
+  for (auto _ : state) {
+    for (size_t offset : offsets) {
+      benchmark::DoNotOptimize(rs.GetOffsetInRangeSet(offset));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * offsets.size());
+}
+// Args: ranges.
+BENCHMARK(BM_GetOffsetInRangeSet)->Arg(16)->Arg(256)->Arg(4096);
+
+// Returns the DER encoding of the value with the given |tag| and |content|.
+static std::string Der(uint8_t tag, const std::string& content) {
+  std::string der(1, static_cast<char>(tag));
+  size_t length = content.size();
+  if (length < 0x80) {
+    der += static_cast<char>(length);
+  } else {
+    std::string bytes;
+    for (; length > 0; length >>= 8) {
+      bytes.insert(bytes.begin(), static_cast<char>(length & 0xff));
+    }
+    der += static_cast<char>(0x80 | bytes.size());
+    der += bytes;
+  }
+  return der + content;
+}
+
+// Returns a PKCS#7 SignedData holding |signature|, with as much of the structure as read_pkcs7()
+// in the verifier walks through: no certificates, and dummy algorithm identifiers.
+static std::string Pkcs7(const std::string& signature) {
+  static const std::string kSignedDataOid("\x2a\x86\x48\x86\xf7\x0d\x01\x07\x02", 9);
+  static const std::string kDataOid("\x2a\x86\x48\x86\xf7\x0d\x01\x07\x01", 9);
+  std::string version = Der(0x02, std::string(1, '\x01'));
+  std::string algorithm = Der(0x30, Der(0x06, kDataOid));
+  std::string signer_info = Der(
+      0x30, version + Der(0x30, Der(0x30, "") + Der(0x02, std::string(1, '\x01'))) + algorithm +
+                algorithm + Der(0x04, signature));
+  std::string signed_data =
+      Der(0x30, version + Der(0x31, algorithm) + Der(0x30, Der(0x06, kDataOid)) +
+                    Der(0xa0, "") + Der(0x31, signer_info));
+  return Der(0x30, Der(0x06, kSignedDataOid) + Der(0xa0, signed_data));
+}
+
+static void BM_Asn1DecodePkcs7(benchmark::State& state) {
+  std::string der = Pkcs7(std::string(256, '\x5a'));
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(der.data());
+  for (auto _ : state) {
+    // The same walk as read_pkcs7().
+    asn1_context ctx(data, der.size());
+    std::unique_ptr<asn1_context> pkcs7_seq(ctx.asn1_sequence_get());
+    CHECK(pkcs7_seq && pkcs7_seq->asn1_sequence_next());
+    std::unique_ptr<asn1_context> signed_data_app(pkcs7_seq->asn1_constructed_get());
+    CHECK(signed_data_app);
+    std::unique_ptr<asn1_context> signed_data_seq(signed_data_app->asn1_sequence_get());
+    CHECK(signed_data_seq && signed_data_seq->asn1_sequence_next() &&
+          signed_data_seq->asn1_sequence_next() && signed_data_seq->asn1_sequence_next() &&
+          signed_data_seq->asn1_constructed_skip_all());
+    std::unique_ptr<asn1_context> sig_set(signed_data_seq->asn1_set_get());
+    CHECK(sig_set);
+    std::unique_ptr<asn1_context> sig_seq(sig_set->asn1_sequence_get());
+    CHECK(sig_seq && sig_seq->asn1_sequence_next() && sig_seq->asn1_sequence_next() &&
+          sig_seq->asn1_sequence_next() && sig_seq->asn1_sequence_next());
+    const uint8_t* signature;
+    size_t length;
+    CHECK(sig_seq->asn1_octet_string_get(&signature, &length));
+    benchmark::DoNotOptimize(signature);
+  }
+  state.SetBytesProcessed(state.iterations() * der.size());
+}
+BENCHMARK(BM_Asn1DecodePkcs7);
+
+static void BM_Asn1DecodeSequence(benchmark::State& state) {
+  // A sequence of octet strings with long-form lengths, stepped through one at a time as the
+  // verifier does, and the OID at its end.
+  std::string content;
+  for (int64_t i = 0; i < state.range(0); i++) {
+    content += Der(0x04, std::string(200, 'x'));
+  }
+  content += Der(0x06, std::string("\x2a\x86\x48\x86\xf7\x0d\x01\x01\x0b", 9));
+  std::string der = Der(0x30, content);
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(der.data());
+  for (auto _ : state) {
+    asn1_context ctx(data, der.size());
+    std::unique_ptr<asn1_context> seq(ctx.asn1_sequence_get());
+    CHECK(seq);
+    for (int64_t i = 0; i < state.range(0); i++) {
+      CHECK(seq->asn1_sequence_next());
+    }
+    const uint8_t* oid;
+    size_t length;
+    CHECK(seq->asn1_oid_get(&oid, &length));
+    benchmark::DoNotOptimize(oid);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  state.SetBytesProcessed(state.iterations() * der.size());
+}
+// Args: elements.
+BENCHMARK(BM_Asn1DecodeSequence)->Arg(16)->Arg(1024);
+
+static void BM_MapBlockFile(benchmark::State& state) {
+  size_t range_count = state.range(0);
+  bool binary = state.range(1) != 0;
+  // Every other block of the "block device" belongs to the file, so no two ranges are adjacent.
+  TemporaryFile block_dev;
+  CHECK_EQ(0, ftruncate(block_dev.fd, range_count * 2 * kBlockSize));
+  std::vector<uint64_t> ranges;
+  for (size_t i = 0; i < range_count; i++) {
+    ranges.push_back(i * 2 + 1);
+    ranges.push_back(i * 2 + 2);
+  }
+  uint64_t file_size = range_count * kBlockSize;
+
+  std::string map;
+  if (binary) {
+    map = BinaryBlockMap(block_dev.path, file_size, kBlockSize, ranges);
+  } else {
+    map = android::base::StringPrintf("%s\n%" PRIu64 " %zu\n%zu\n", block_dev.path, file_size,
+                                      kBlockSize, range_count);
+    for (size_t i = 0; i < range_count; i++) {
+      map += android::base::StringPrintf("%" PRIu64 " %" PRIu64 "\n", ranges[i * 2],
+                                         ranges[i * 2 + 1]);
+    }
+  }
+  TemporaryFile map_file;
+  CHECK(android::base::WriteStringToFile(map, map_file.path));
+
+  std::string filename = std::string("@") + map_file.path;
+  for (auto _ : state) {
+    MemMapping mapping;
+    CHECK(mapping.MapFile(filename));
+    CHECK_EQ(file_size, mapping.length);
+  }
+  state.SetItemsProcessed(state.iterations() * range_count);
+}
+// Args: ranges, binary (1) or text (0) block map.
+BENCHMARK(BM_MapBlockFile)
+    ->Args({ 16, 0 })
+    ->Args({ 1024, 0 })
+    ->Args({ 1024, 1 })
+    ->Args({ 16384, 0 })
+    ->Args({ 16384, 1 })
+    ->Unit(benchmark::kMicrosecond);
+
+// Returns a |size|-byte package with a whole-file signature by |rsa|, in the layout verify_file()
+// expects: the data, an EOCD record and a comment ending in the signature and the footer. The
+// data isn't a valid zip, which verify_file() doesn't look into.
+static std::string GenerateSignedPackage(size_t size, RSA* rsa) {
+  std::mt19937 rng(0);
+  std::uniform_int_distribution<int> byte(0, 255);
+  std::string package(size, '\0');
+  for (auto& b : package) {
+    b = static_cast<char>(byte(rng));
+  }
+  // The EOCD record, up to the comment length.
+  package += std::string("PK\x05\x06", 4) + std::string(16, '\0');
+
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const uint8_t*>(package.data()), package.size(), digest);
+  std::string signature(RSA_size(rsa), '\0');
+  unsigned int signature_length;
+  CHECK_EQ(1, RSA_sign(NID_sha256, digest, sizeof(digest),
+                       reinterpret_cast<uint8_t*>(&signature[0]), &signature_length, rsa));
+  signature.resize(signature_length);
+
+  std::string comment = Pkcs7(signature);
+  size_t comment_size = comment.size() + 6;
+  comment += static_cast<char>(comment_size & 0xff);
+  comment += static_cast<char>(comment_size >> 8);
+  comment += "\xff\xff";
+  comment += static_cast<char>(comment_size & 0xff);
+  comment += static_cast<char>(comment_size >> 8);
+
+  package += static_cast<char>(comment_size & 0xff);
+  package += static_cast<char>(comment_size >> 8);
+  return package + comment;
+}
+
+static void BM_VerifyFile(benchmark::State& state) {
+  std::unique_ptr<RSA, RSADeleter> rsa(RSA_new());
+  std::unique_ptr<BIGNUM, decltype(&BN_free)> exponent(BN_new(), BN_free);
+  CHECK_EQ(1, BN_set_word(exponent.get(), RSA_F4));
+  CHECK_EQ(1, RSA_generate_key_ex(rsa.get(), 2048, exponent.get(), nullptr));
+
+  std::string package = GenerateSignedPackage(state.range(0) * 1024 * 1024, rsa.get());
+  TemporaryFile package_file;
+  CHECK(android::base::WriteStringToFile(package, package_file.path));
+  MemMapping mapping;
+  CHECK(mapping.MapFile(package_file.path));
+
+  std::vector<Certificate> keys;
+  keys.emplace_back(SHA256_DIGEST_LENGTH, Certificate::KEY_TYPE_RSA, std::move(rsa), nullptr);
+  for (auto _ : state) {
+    CHECK_EQ(VERIFY_SUCCESS, verify_file(mapping.addr, mapping.length, keys));
+  }
+  state.SetBytesProcessed(state.iterations() * package.size());
+}
+// Args: package size in MiB.
+BENCHMARK(BM_VerifyFile)->Arg(1)->Arg(16)->Arg(128)->Unit(benchmark::kMillisecond);
+
+static void BM_ExtractPackageRecursive(benchmark::State& state) {
+  size_t entries = state.range(0);
+  size_t entry_size = state.range(1);
+  size_t jobs = state.range(2);
+
+  // Compressible entries, half of them deflated, under a few directories.
+  TemporaryFile zip_file;
+  std::vector<std::string> names;
+  {
+    FILE* fp = fdopen(dup(zip_file.fd), "wb");
+    CHECK(fp != nullptr);
+    ZipWriter writer(fp);
+    std::mt19937 rng(0);
+    std::uniform_int_distribution<int> letter('a', 'h');
+    std::string content(entry_size, '\0');
+    for (size_t i = 0; i < entries; i++) {
+      for (auto& c : content) {
+        c = static_cast<char>(letter(rng));
+      }
+      names.push_back(android::base::StringPrintf("dir%zu/file%zu", i % 8, i));
+      CHECK_EQ(0, writer.StartEntry(names.back().c_str(), i % 2 ? ZipWriter::kCompress : 0));
+      CHECK_EQ(0, writer.WriteBytes(content.data(), content.size()));
+      CHECK_EQ(0, writer.FinishEntry());
+    }
+    CHECK_EQ(0, writer.Finish());
+    CHECK_EQ(0, fclose(fp));
+  }
+
+  ZipArchiveHandle zip;
+  CHECK_EQ(0, OpenArchive(zip_file.path, &zip));
+  for (auto _ : state) {
+    TemporaryDir dest;
+    CHECK(ExtractPackageRecursive(zip, "", dest.path, nullptr, nullptr, jobs));
+
+    state.PauseTiming();
+    std::string dest_path(dest.path);
+    for (const auto& name : names) {
+      CHECK_EQ(0, unlink((dest_path + "/" + name).c_str()));
+    }
+    for (size_t i = 0; i < std::min<size_t>(entries, 8); i++) {
+      CHECK_EQ(0, rmdir(android::base::StringPrintf("%s/dir%zu", dest.path, i).c_str()));
+    }
+    state.ResumeTiming();
+  }
+  CloseArchive(zip);
+  state.SetItemsProcessed(state.iterations() * entries);
+  state.SetBytesProcessed(state.iterations() * entries * entry_size);
+}
+// Args: entries, bytes per entry, jobs.
+BENCHMARK(BM_ExtractPackageRecursive)
+    ->Args({ 64, 4096, 1 })
+    ->Args({ 64, 4096, 4 })
+    ->Args({ 16, 1024 * 1024, 1 })
+    ->Args({ 16, 1024 * 1024, 4 })
+    ->Unit(benchmark::kMillisecond);
+
+int main(int argc, char** argv) {
+  // verify_file() and the extraction log every call otherwise.
+  android::base::SetMinimumLogSeverity(android::base::WARNING);
+  benchmark::Initialize(&argc, argv);
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
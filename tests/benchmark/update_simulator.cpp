@@ -0,0 +1,282 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Runs the block based updates of a real OTA package end to end, against file-backed copies of the
+// source partition images, so that the updater can be timed across versions on the same inputs:
+//
+//   $ export UPDATE_SIMULATOR_PACKAGE=ota.zip
+//   $ export UPDATE_SIMULATOR_IMAGES=system:system.img,vendor:vendor.img
+//   $ recovery_update_simulator --benchmark_format=json
+//
+// Each "<partition>:<source image>" pair runs block_image_update() with <partition>.transfer.list,
+// <partition>.new.dat(.br) and <partition>.patch.dat from the package. The image is copied (and
+// dropped from the page cache) before each iteration, as the commands skip the blocks that have
+// the target contents already.
+//
+// UPDATE_SIMULATOR_WORKERS and UPDATE_SIMULATOR_STASH_MEMORY_MB take comma-separated lists of the
+// parallel worker counts and of the caps on the stashes kept in memory to run with (0 for the
+// defaults of the device); every combination is a benchmark of its own. The working copies and the
+// stashes go to UPDATE_SIMULATOR_WORK_DIR, or to a temporary directory.
+//
+// Besides the time and the throughput (of the written bytes), it reports the peak RSS of each
+// update and the bytes it wrote and stashed.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+#include <android-base/test_utils.h>
+#include <android-base/unique_fd.h>
+#include <benchmark/benchmark.h>
+#include <ziparchive/zip_archive.h>
+
+#include "edify/expr.h"
+#include "otautil/SysUtil.h"
+#include "otautil/ZipUtil.h"
+#include "otautil/cache_location.h"
+#include "updater/blockimg.h"
+#include "updater/install.h"
+#include "updater/updater.h"
+
+// For e2fsprogs
+extern "C" {
+const char* program_name = "updater";
+}
+
+struct selabel_handle* sehandle = nullptr;
+
+struct Partition {
+  std::string name;
+  std::string source_image;
+  std::string new_data;
+};
+
+// The package, opened once for all the benchmarks.
+struct Package {
+  MemMapping map;
+  ZipArchiveHandle handle = nullptr;
+  std::unique_ptr<ZipIndex> index;
+};
+
+static std::vector<int64_t> ParseList(const char* name, const std::string& fallback) {
+  const char* value = getenv(name);
+  std::vector<int64_t> result;
+  for (const auto& item : android::base::Split(value != nullptr ? value : fallback, ",")) {
+    int64_t number;
+    CHECK(android::base::ParseInt(item, &number, static_cast<int64_t>(0)))
+        << "Invalid " << name << " \"" << item << "\"";
+    result.push_back(number);
+  }
+  return result;
+}
+
+static std::vector<Partition> LoadPartitions(const Package& package) {
+  std::vector<Partition> result;
+  const char* images = getenv("UPDATE_SIMULATOR_IMAGES");
+  CHECK(images != nullptr) << "UPDATE_SIMULATOR_IMAGES isn't set";
+  for (const auto& pair : android::base::Split(images, ",")) {
+    std::vector<std::string> pieces = android::base::Split(pair, ":");
+    CHECK_EQ(2U, pieces.size()) << "Invalid partition \"" << pair << "\"";
+    Partition partition;
+    partition.name = pieces[0];
+    partition.source_image = pieces[1];
+    CHECK_EQ(0, access(partition.source_image.c_str(), R_OK))
+        << "Can't read " << partition.source_image;
+
+    ZipEntry entry;
+    CHECK(package.index->Find(partition.name + ".transfer.list", &entry))
+        << "No transfer list for " << partition.name << " in the package";
+    partition.new_data = partition.name + ".new.dat.br";
+    if (!package.index->Find(partition.new_data, &entry)) {
+      partition.new_data = partition.name + ".new.dat";
+    }
+    result.push_back(std::move(partition));
+  }
+  return result;
+}
+
+// Copies |source| over |target|, and drops |target| from the page cache so that the update starts
+// from the storage as it would on a device.
+static void CopyImage(const std::string& source, const std::string& target) {
+  android::base::unique_fd in(open(source.c_str(), O_RDONLY | O_CLOEXEC));
+  CHECK_NE(-1, in.get()) << "Failed to open " << source;
+  android::base::unique_fd out(
+      open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+  CHECK_NE(-1, out.get()) << "Failed to create " << target;
+  std::vector<char> buffer(1024 * 1024);
+  ssize_t n;
+  while ((n = TEMP_FAILURE_RETRY(read(in, buffer.data(), buffer.size()))) > 0) {
+    CHECK(android::base::WriteFully(out, buffer.data(), n)) << "Failed to write " << target;
+  }
+  CHECK_EQ(0, n) << "Failed to read " << source;
+  CHECK_EQ(0, fsync(out));
+  CHECK_EQ(0, posix_fadvise(out, 0, 0, POSIX_FADV_DONTNEED));
+}
+
+// Resets the peak RSS of the process (VmHWM), so that it covers the next update only.
+static void ResetPeakRss() {
+  if (!android::base::WriteStringToFile("5", "/proc/self/clear_refs")) {
+    PLOG(WARNING) << "Failed to reset the peak RSS";
+  }
+}
+
+static uint64_t PeakRssKb() {
+  std::string status;
+  if (android::base::ReadFileToString("/proc/self/status", &status)) {
+    for (const auto& line : android::base::Split(status, "\n")) {
+      unsigned long long kb;
+      if (sscanf(line.c_str(), "VmHWM: %llu kB", &kb) == 1) {
+        return kb;
+      }
+    }
+  }
+  return 0;
+}
+
+// Returns the value of the "log <key>: <value>" line that the update wrote to the command pipe.
+static uint64_t LoggedValue(const std::string& pipe_content, const std::string& key) {
+  for (const auto& line : android::base::Split(pipe_content, "\n")) {
+    uint64_t value;
+    if (android::base::StartsWith(line, "log " + key + ": ") &&
+        android::base::ParseUint(line.substr(key.size() + 6), &value)) {
+      return value;
+    }
+  }
+  return 0;
+}
+
+// Args: parallel workers, stash memory limit in MiB.
+static void BM_UpdatePartition(benchmark::State& state, const Package& package,
+                               const Partition& partition, const std::string& work_dir) {
+  BlockImageTuning tuning;
+  tuning.max_workers = state.range(0);
+  tuning.stash_memory_limit = state.range(1) * 1024 * 1024;
+  SetBlockImageTuning(tuning);
+
+  // Named after the partition, which the updater takes the names of its logs from.
+  std::string image = work_dir + "/" + partition.name;
+  std::string script = "block_image_update(\"" + image + "\", package_extract_file(\"" +
+                       partition.name + ".transfer.list\"), \"" + partition.new_data + "\", \"" +
+                       partition.name + ".patch.dat\")";
+  std::unique_ptr<Expr> expr;
+  int error_count = 0;
+  CHECK_EQ(0, parse_string(script.c_str(), &expr, &error_count));
+
+  uint64_t written = 0;
+  uint64_t stashed = 0;
+  uint64_t peak_rss_kb = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    CopyImage(partition.source_image, image);
+    TemporaryFile temp_pipe;
+    UpdaterInfo updater_info;
+    updater_info.package_zip = package.handle;
+    updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+    updater_info.package_zip_addr = package.map.addr;
+    updater_info.package_zip_len = package.map.length;
+    updater_info.package_index = package.index.get();
+    State updater_state(script, &updater_info);
+    ResetPeakRss();
+    state.ResumeTiming();
+
+    std::string result;
+    CHECK(Evaluate(&updater_state, expr, &result)) << updater_state.errmsg;
+
+    state.PauseTiming();
+    CHECK_EQ("t", result) << "Failed to update " << partition.name << ": "
+                          << updater_state.errmsg;
+    peak_rss_kb = std::max(peak_rss_kb, PeakRssKb());
+    CHECK_EQ(0, fclose(updater_info.cmd_pipe));
+    std::string pipe_content;
+    CHECK(android::base::ReadFileToString(temp_pipe.path, &pipe_content));
+    written = LoggedValue(pipe_content, "bytes_written_" + partition.name);
+    stashed = LoggedValue(pipe_content, "bytes_stashed_" + partition.name);
+    state.ResumeTiming();
+  }
+  CHECK_EQ(0, unlink(image.c_str()));
+  SetBlockImageTuning(BlockImageTuning());
+
+  state.SetBytesProcessed(state.iterations() * written);
+  state.counters["peak_rss_kb"] = peak_rss_kb;
+  state.counters["bytes_written"] = written;
+  state.counters["bytes_stashed"] = stashed;
+}
+
+int main(int argc, char** argv) {
+  android::base::SetMinimumLogSeverity(android::base::WARNING);
+
+  const char* package_path = getenv("UPDATE_SIMULATOR_PACKAGE");
+  CHECK(package_path != nullptr) << "UPDATE_SIMULATOR_PACKAGE isn't set";
+  static Package package;
+  CHECK(package.map.MapFile(package_path)) << "Failed to map " << package_path;
+  CHECK_EQ(0, OpenArchiveFromMemory(package.map.addr, package.map.length, package_path,
+                                    &package.handle));
+  package.index = ZipIndex::Build(package.handle);
+  CHECK(package.index != nullptr) << "Failed to index " << package_path;
+
+  static TemporaryDir temp_dir;
+  const char* work_dir_env = getenv("UPDATE_SIMULATOR_WORK_DIR");
+  static std::string work_dir = work_dir_env != nullptr ? work_dir_env : temp_dir.path;
+  std::string stash_base = work_dir + "/stash";
+  CHECK(mkdir(stash_base.c_str(), 0700) == 0 || errno == EEXIST)
+      << "Failed to create " << stash_base;
+  CacheLocation::location().set_cache_temp_source(work_dir + "/saved.file");
+  CacheLocation::location().set_last_command_file(work_dir + "/last_command");
+  CacheLocation::location().set_stash_directory_base(stash_base);
+  CacheLocation::location().set_transfer_trace_base(work_dir + "/transfer_trace");
+  CacheLocation::location().set_partition_hash_cache(work_dir + "/partition_hashes");
+
+  RegisterBuiltins();
+  RegisterInstallFunctions();
+  RegisterBlockImageFunctions();
+
+  // The partitions are registered as benchmarks of their own, so they need to be loaded first.
+  static std::vector<Partition> partitions = LoadPartitions(package);
+  std::vector<int64_t> workers = ParseList("UPDATE_SIMULATOR_WORKERS", "0");
+  std::vector<int64_t> stash_memory = ParseList("UPDATE_SIMULATOR_STASH_MEMORY_MB", "0");
+  for (const auto& partition : partitions) {
+    auto* benchmark = benchmark::RegisterBenchmark(
+        ("BM_UpdatePartition/" + partition.name).c_str(),
+        [&partition](benchmark::State& state) {
+          BM_UpdatePartition(state, package, partition, work_dir);
+        });
+    for (int64_t count : workers) {
+      for (int64_t mb : stash_memory) {
+        benchmark->Args({ count, mb });
+      }
+    }
+    benchmark->ArgNames({ "workers", "stash_mb" })->Unit(benchmark::kMillisecond)->UseRealTime();
+  }
+
+  benchmark::Initialize(&argc, argv);
+  benchmark::RunSpecifiedBenchmarks();
+  CloseArchive(package.handle);
+  return 0;
+}
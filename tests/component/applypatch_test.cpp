@@ -14,10 +14,12 @@
  * limitations under the License.
  */
 
+#include <dirent.h>
 #include <fcntl.h>
 #include <gtest/gtest.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/types.h>
@@ -30,12 +32,14 @@
 #include <android-base/file.h>
 #include <android-base/stringprintf.h>
 #include <android-base/test_utils.h>
+#include <android-base/unique_fd.h>
 #include <bsdiff/bsdiff.h>
 #include <openssl/sha.h>
 
 #include "applypatch/applypatch.h"
 #include "applypatch/applypatch_modes.h"
 #include "common/test_constants.h"
+#include "edify/expr.h"
 #include "otautil/cache_location.h"
 #include "otautil/print_sha1.h"
 
@@ -78,6 +82,8 @@ class ApplyPatchTest : public ::testing::Test {
     srand(time(nullptr));
     bad_sha1_a = android::base::StringPrintf("%040x", rand());
     bad_sha1_b = android::base::StringPrintf("%040x", rand());
+
+    CacheLocation::location().set_partition_hash_cache(partition_hashes.path);
   }
 
   std::string old_file;
@@ -91,6 +97,8 @@ class ApplyPatchTest : public ::testing::Test {
 
   size_t old_size;
   size_t new_size;
+
+  TemporaryFile partition_hashes;
 };
 
 class ApplyPatchCacheTest : public ApplyPatchTest {
@@ -105,9 +113,11 @@ class ApplyPatchModesTest : public ::testing::Test {
  protected:
   void SetUp() override {
     CacheLocation::location().set_cache_temp_source(cache_source.path);
+    CacheLocation::location().set_partition_hash_cache(partition_hashes.path);
   }
 
   TemporaryFile cache_source;
+  TemporaryFile partition_hashes;
 };
 
 TEST_F(ApplyPatchTest, CheckModeSkip) {
@@ -166,6 +176,97 @@ TEST_F(ApplyPatchTest, CheckModeEmmcTarget) {
   ASSERT_EQ(0, applypatch_check(src_file.c_str(), sha1s));
 }
 
+TEST_F(ApplyPatchTest, LoadEmmcContentsLarge) {
+  // A partition that spans several reads, with candidate sizes that don't align to them.
+  std::string content(3 * 1024 * 1024 + 123, '\0');
+  for (size_t i = 0; i < content.size(); i++) {
+    content[i] = rand() % 256;
+  }
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+
+  auto prefix_sha1 = [&content](size_t size) {
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const uint8_t*>(content.data()), size, digest);
+    return print_sha1(digest);
+  };
+
+  // Stops at the match, without reaching the sizes past the end of the partition.
+  size_t size = 2 * 1024 * 1024 + 5;
+  std::string src_file = "EMMC:"s + temp_file.path + ":" + std::to_string(1024 * 1024 - 1) + ":" +
+                         bad_sha1_a + ":" + std::to_string(size) + ":" + prefix_sha1(size) + ":" +
+                         std::to_string(content.size() + 4096) + ":" + bad_sha1_b;
+  FileContents file;
+  ASSERT_EQ(0, LoadFileContents(src_file.c_str(), &file));
+  ASSERT_EQ(content.substr(0, size), std::string(file.data.cbegin(), file.data.cend()));
+  ASSERT_EQ(prefix_sha1(size), print_sha1(file.sha1));
+
+  // The whole partition.
+  src_file = "EMMC:"s + temp_file.path + ":" + std::to_string(content.size()) + ":" +
+             prefix_sha1(content.size());
+  ASSERT_EQ(0, LoadFileContents(src_file.c_str(), &file));
+  ASSERT_EQ(content, std::string(file.data.cbegin(), file.data.cend()));
+
+  // No match before running off the end of the partition.
+  src_file = "EMMC:"s + temp_file.path + ":" + std::to_string(size) + ":" + bad_sha1_a + ":" +
+             std::to_string(content.size() + 1) + ":" + bad_sha1_b;
+  ASSERT_EQ(-1, LoadFileContents(src_file.c_str(), &file));
+}
+
+TEST_F(ApplyPatchTest, CheckModeEmmcHashCache) {
+  std::string content(512 * 1024 + 17, '\0');
+  for (size_t i = 0; i < content.size(); i++) {
+    content[i] = rand() % 256;
+  }
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+  auto get_sha1 = [](const std::string& data) {
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const uint8_t*>(data.data()), data.size(), digest);
+    return print_sha1(digest);
+  };
+  std::string sha1 = get_sha1(content);
+  std::string src_file = "EMMC:"s + temp_file.path + ":" + std::to_string(content.size()) + ":" +
+                         sha1;
+
+  // Checks that don't ask for the cache leave it alone.
+  std::vector<std::string> sha1s;
+  ASSERT_EQ(0, applypatch_check(src_file.c_str(), sha1s));
+  std::string cache;
+  ASSERT_TRUE(android::base::ReadFileToString(partition_hashes.path, &cache));
+  ASSERT_EQ("", cache);
+
+  // The first check records the hash, which the next one finds.
+  ASSERT_EQ(0, applypatch_check(src_file.c_str(), sha1s, true));
+  ASSERT_TRUE(android::base::ReadFileToString(partition_hashes.path, &cache));
+  ASSERT_NE(std::string::npos, cache.find(std::string(temp_file.path) + " " +
+                                          std::to_string(content.size()) + " "));
+  ASSERT_NE(std::string::npos, cache.find(sha1));
+  ASSERT_EQ(0, applypatch_check(src_file.c_str(), sha1s, true));
+
+  // The cached hash doesn't satisfy a check that expects another one.
+  std::vector<std::string> sha1s_failure = { bad_sha1_a };
+  ASSERT_NE(0, applypatch_check(src_file.c_str(), sha1s_failure, true));
+
+  // Nor does it survive a change to the partition.
+  std::string new_content = content;
+  new_content[0] ^= 0x5a;
+  ASSERT_TRUE(android::base::WriteStringToFile(new_content, temp_file.path));
+  ASSERT_NE(0, applypatch_check(src_file.c_str(), sha1s, true));
+  std::string new_src_file = "EMMC:"s + temp_file.path + ":" + std::to_string(content.size()) +
+                             ":" + get_sha1(new_content);
+  ASSERT_EQ(0, applypatch_check(new_src_file.c_str(), sha1s, true));
+
+  // Flashing the partition drops its entry.
+  TemporaryFile image;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, image.path));
+  std::string tgt_file = "EMMC:"s + temp_file.path;
+  ASSERT_EQ(0, applypatch_flash(image.path, tgt_file.c_str(), sha1.c_str(), content.size()));
+  ASSERT_TRUE(android::base::ReadFileToString(partition_hashes.path, &cache));
+  ASSERT_EQ(std::string::npos, cache.find(temp_file.path));
+  ASSERT_EQ(0, applypatch_check(src_file.c_str(), sha1s, true));
+}
+
 TEST_F(ApplyPatchCacheTest, CheckCacheCorruptedSourceSingle) {
   TemporaryFile temp_file;
   mangle_file(temp_file.path);
@@ -230,6 +331,11 @@ TEST_F(ApplyPatchModesTest, PatchModeEmmcTarget) {
   };
   ASSERT_EQ(0, applypatch_modes(args.size(), args.data()));
 
+  // The source wasn't backed up to /cache, since it's on a different partition from the target.
+  struct stat st;
+  ASSERT_EQ(0, stat(cache_source.path, &st));
+  ASSERT_EQ(0, st.st_size);
+
   // applypatch <src-file> <tgt-file> <tgt-sha1> <tgt-size> <src-sha1>:<patch>
   TemporaryFile tmp2;
   patch = boot_img_sha1 + ":" + from_testdata_base("recovery-from-boot-with-bonus.p");
@@ -316,6 +422,83 @@ TEST_F(ApplyPatchModesTest, PatchModeEmmcTargetWithBsdiffPatch) {
   ASSERT_EQ(recovery_img_sha1, tgt_file_sha1);
 }
 
+// Ensures that reading the source data on demand gives the same output as patching it in memory.
+TEST(ApplyBSDiffPatchTest, FromSource) {
+  std::string src_content;
+  ASSERT_TRUE(android::base::ReadFileToString(from_testdata_base("boot.img"), &src_content));
+  std::string tgt_content;
+  ASSERT_TRUE(android::base::ReadFileToString(from_testdata_base("recovery.img"), &tgt_content));
+
+  TemporaryFile patch_file;
+  ASSERT_EQ(0,
+            bsdiff::bsdiff(reinterpret_cast<const uint8_t*>(src_content.data()), src_content.size(),
+                           reinterpret_cast<const uint8_t*>(tgt_content.data()), tgt_content.size(),
+                           patch_file.path, nullptr));
+  std::string patch_content;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch_content));
+  Value patch(VAL_BLOB, patch_content);
+
+  size_t source_reads = 0;
+  auto source = [&src_content, &source_reads](size_t offset, unsigned char* data, size_t size) {
+    if (offset + size > src_content.size()) {
+      return false;
+    }
+    memcpy(data, src_content.data() + offset, size);
+    source_reads++;
+    return true;
+  };
+  std::string patched;
+  auto sink = [&patched](const unsigned char* data, size_t len) {
+    patched.append(reinterpret_cast<const char*>(data), len);
+    return len;
+  };
+  SHA_CTX ctx;
+  SHA1_Init(&ctx);
+  ASSERT_EQ(0, ApplyBSDiffPatchFromSource(source, src_content.size(), patch, 0, sink, &ctx));
+  ASSERT_EQ(tgt_content, patched);
+  ASSERT_GT(source_reads, 0u);
+
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1_Final(digest, &ctx);
+  uint8_t expected[SHA_DIGEST_LENGTH];
+  SHA1(reinterpret_cast<const uint8_t*>(tgt_content.data()), tgt_content.size(), expected);
+  ASSERT_EQ(0, memcmp(expected, digest, SHA_DIGEST_LENGTH));
+}
+
+// The streams of a large BSDIFF40 patch are decoded on separate threads, which must give the same
+// output, and still catch a truncated patch.
+TEST(ApplyBSDiffPatchTest, ParallelDecode) {
+  std::string src_content;
+  ASSERT_TRUE(android::base::ReadFileToString(from_testdata_base("boot.img"), &src_content));
+  std::string tgt_content;
+  ASSERT_TRUE(android::base::ReadFileToString(from_testdata_base("recovery.img"), &tgt_content));
+
+  TemporaryFile patch_file;
+  ASSERT_EQ(0,
+            bsdiff::bsdiff(reinterpret_cast<const uint8_t*>(src_content.data()), src_content.size(),
+                           reinterpret_cast<const uint8_t*>(tgt_content.data()), tgt_content.size(),
+                           patch_file.path, nullptr));
+  std::string patch_content;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch_content));
+  ASSERT_EQ(0, patch_content.compare(0, 8, "BSDIFF40"));
+  ASSERT_GT(patch_content.size(), 64 * 1024u);
+
+  std::string patched;
+  auto sink = [&patched](const unsigned char* data, size_t len) {
+    patched.append(reinterpret_cast<const char*>(data), len);
+    return len;
+  };
+  Value patch(VAL_BLOB, patch_content);
+  ASSERT_EQ(0, ApplyBSDiffPatch(reinterpret_cast<const unsigned char*>(src_content.data()),
+                                src_content.size(), patch, 0, sink, nullptr));
+  ASSERT_EQ(tgt_content, patched);
+
+  patched.clear();
+  Value truncated(VAL_BLOB, patch_content.substr(0, patch_content.size() - 100));
+  ASSERT_NE(0, ApplyBSDiffPatch(reinterpret_cast<const unsigned char*>(src_content.data()),
+                                src_content.size(), truncated, 0, sink, nullptr));
+}
+
 TEST_F(ApplyPatchModesTest, PatchModeInvalidArgs) {
   // Invalid bonus file.
   ASSERT_NE(0, applypatch_modes(3, (const char* []){ "applypatch", "-b", "/doesntexist" }));
@@ -385,3 +568,80 @@ TEST_F(ApplyPatchModesTest, CheckModeInvalidArgs) {
 TEST_F(ApplyPatchModesTest, ShowLicenses) {
   ASSERT_EQ(0, applypatch_modes(2, (const char* []){ "applypatch", "-l" }));
 }
+
+class FreeCacheTest : public ::testing::Test {
+ protected:
+  static constexpr size_t kCapacity = 100;
+
+  void SetUp() override {
+    CacheLocation::location().set_cache_temp_source(std::string(cache_dir.path) + "/saved.file");
+  }
+
+  // Creates a file of |size| bytes modified at |mtime| in |cache_dir|.
+  std::string AddFile(const std::string& name, size_t size, time_t mtime) {
+    std::string path = std::string(cache_dir.path) + "/" + name;
+    EXPECT_TRUE(android::base::WriteStringToFile(std::string(size, 'x'), path));
+    struct timespec times[2] = { { mtime, 0 }, { mtime, 0 } };
+    EXPECT_EQ(0, utimensat(AT_FDCWD, path.c_str(), times, 0));
+    return path;
+  }
+
+  // Reports the space of |kCapacity| bytes that isn't taken by the files in |cache_dir|.
+  size_t FreeSpace(const std::string& dir) {
+    std::unique_ptr<DIR, decltype(&closedir)> d(opendir(dir.c_str()), closedir);
+    size_t used = 0;
+    struct dirent* de;
+    while ((de = readdir(d.get())) != nullptr) {
+      struct stat sb;
+      if (stat((dir + "/" + de->d_name).c_str(), &sb) == 0 && S_ISREG(sb.st_mode)) {
+        used += sb.st_size;
+      }
+    }
+    return used < kCapacity ? kCapacity - used : 0;
+  }
+
+  int MakeFreeSpace(size_t bytes_needed) {
+    return MakeFreeSpaceInDirectories(bytes_needed, { cache_dir.path },
+                                      [this](const std::string& dir) { return FreeSpace(dir); });
+  }
+
+  TemporaryDir cache_dir;
+};
+
+TEST_F(FreeCacheTest, DeletesOldestAndLargestFirst) {
+  std::string same_age_small = AddFile("same_age_small", 10, 100);
+  std::string same_age_large = AddFile("same_age_large", 20, 100);
+  std::string oldest = AddFile("oldest", 5, 50);
+  std::string newest = AddFile("newest", 40, 200);
+  ASSERT_EQ(25u, FreeSpace(cache_dir.path));
+
+  // Enough space already.
+  ASSERT_EQ(0, MakeFreeSpace(25));
+  ASSERT_EQ(0, access(oldest.c_str(), F_OK));
+
+  ASSERT_EQ(0, MakeFreeSpace(50));
+  ASSERT_EQ(-1, access(oldest.c_str(), F_OK));
+  ASSERT_EQ(-1, access(same_age_large.c_str(), F_OK));
+  ASSERT_EQ(0, access(same_age_small.c_str(), F_OK));
+  ASSERT_EQ(0, access(newest.c_str(), F_OK));
+}
+
+TEST_F(FreeCacheTest, KeepsTempSourceAndOpenFiles) {
+  std::string saved = AddFile("saved.file", 10, 10);
+  std::string old_file = AddFile("old", 10, 20);
+  std::string new_file = AddFile("new", 10, 30);
+
+  // A file opened after an earlier call is still spared by the next one.
+  ASSERT_EQ(0, MakeFreeSpace(80));
+  ASSERT_EQ(-1, access(old_file.c_str(), F_OK));
+  android::base::unique_fd fd(open(new_file.c_str(), O_RDONLY));
+  ASSERT_NE(-1, fd);
+  ASSERT_EQ(-1, MakeFreeSpace(100));
+  ASSERT_EQ(0, access(new_file.c_str(), F_OK));
+  ASSERT_EQ(0, access(saved.c_str(), F_OK));
+
+  fd.reset();
+  ASSERT_EQ(0, MakeFreeSpace(90));
+  ASSERT_EQ(-1, access(new_file.c_str(), F_OK));
+  ASSERT_EQ(0, access(saved.c_str(), F_OK));
+}
@@ -14,9 +14,13 @@
  * limitations under the License.
  */
 
+#include <string.h>
+#include <unistd.h>
+
 #include <string>
 #include <vector>
 
+#include <android-base/file.h>
 #include <android-base/strings.h>
 #include <android-base/test_utils.h>
 #include <bootloader_message/bootloader_message.h>
@@ -114,3 +118,40 @@ TEST(BootloaderMessageTest, update_bootloader_message_recovery_options_long) {
             std::string(boot.reserved, sizeof(boot.reserved)));
 }
 
+
+TEST(BootloaderMessageTest, misc_session_commit) {
+  TemporaryFile temp_misc;
+  ASSERT_EQ(0, ftruncate(temp_misc.fd, 64 * 1024));
+
+  bootloader_message boot = {};
+  strlcpy(boot.status, "status1", sizeof(boot.status));
+  std::string err;
+  ASSERT_TRUE(write_bootloader_message_to(boot, temp_misc.path, &err)) << err;
+
+  // Update the BCB and the wipe package in one session.
+  MiscSession misc;
+  ASSERT_TRUE(misc.Open(temp_misc.path, &err)) << err;
+  ASSERT_STREQ("status1", misc.boot()->status);
+  std::vector<std::string> options = { "option1", "option2" };
+  ASSERT_TRUE(update_bootloader_message_in_struct(misc.boot(), options));
+  misc.SetWipePackage("wipe package");
+  ASSERT_TRUE(misc.Commit(&err)) << err;
+
+  bootloader_message boot_verify;
+  ASSERT_TRUE(read_bootloader_message_from(&boot_verify, temp_misc.path, &err)) << err;
+  ASSERT_EQ("boot-recovery", std::string(boot_verify.command));
+  ASSERT_EQ("recovery\noption1\noption2\n", std::string(boot_verify.recovery));
+  ASSERT_EQ("status1", std::string(boot_verify.status));
+
+  std::string misc_content;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_misc.path, &misc_content));
+  ASSERT_EQ("wipe package", misc_content.substr(16 * 1024, strlen("wipe package")));
+
+  // Committing again without changes is a no-op, and later changes still get written.
+  ASSERT_TRUE(misc.Commit(&err)) << err;
+  strlcpy(misc.boot()->status, "status2", sizeof(misc.boot()->status));
+  ASSERT_TRUE(misc.Commit(&err)) << err;
+  ASSERT_TRUE(read_bootloader_message_from(&boot_verify, temp_misc.path, &err)) << err;
+  ASSERT_EQ("status2", std::string(boot_verify.status));
+  ASSERT_EQ("recovery\noption1\noption2\n", std::string(boot_verify.recovery));
+}
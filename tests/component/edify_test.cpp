@@ -14,8 +14,10 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <gtest/gtest.h>
 
@@ -168,3 +170,164 @@ TEST_F(EdifyTest, unknown_function) {
     EXPECT_EQ(1, parse_string(script3, &expr, &error_count));
     EXPECT_EQ(1, error_count);
 }
+
+TEST_F(EdifyTest, registered_function_names) {
+    std::vector<std::string> names = RegisteredFunctionNames();
+    EXPECT_NE(names.end(), std::find(names.begin(), names.end(), "ifelse"));
+    EXPECT_NE(names.end(), std::find(names.begin(), names.end(), "concat"));
+    EXPECT_EQ(names.end(), std::find(names.begin(), names.end(), "unknown_function"));
+}
+
+TEST_F(EdifyTest, long_script) {
+    // A script of many statements mustn't recurse once per statement when evaluated.
+    std::string script;
+    for (size_t i = 0; i < 200000; ++i) {
+        script += "a;\n";
+    }
+    script += "b";
+    expect(script.c_str(), "b");
+
+    std::string concat = "a";
+    for (size_t i = 0; i < 100000; ++i) {
+        concat += " + a";
+    }
+    expect(concat.c_str(), std::string(100001, 'a').c_str());
+}
+
+TEST_F(EdifyTest, simplified) {
+    expect("ifelse(a == a, b, abort())", "b");
+    expect("ifelse(a == b, abort())", "");
+    expect("a + b + c == abc && !\"\"", "t");
+    expect("(a == b) || concat(x, y + z)", "xyz");
+
+    // Folded expressions still report their own text.
+    const char* script = "a;\nassert(a + b == ab, \"\" == b);\nc";
+    std::unique_ptr<Expr> expr;
+    int error_count = 0;
+    ASSERT_EQ(0, parse_string(script, &expr, &error_count));
+    State state(script, nullptr);
+    std::string result;
+    EXPECT_FALSE(Evaluate(&state, expr, &result));
+    EXPECT_EQ("assert failed: \"\" == b", state.errmsg);
+}
+
+TEST_F(EdifyTest, string_args) {
+    const char* script = "stdout(a, \"b\" + c + stdout(\"\"), d)";
+    std::unique_ptr<Expr> expr;
+    int error_count = 0;
+    ASSERT_EQ(0, parse_string(script, &expr, &error_count));
+    ASSERT_EQ(3U, expr->argv.size());
+
+    State state(script, nullptr);
+    StringArgs args;
+    ASSERT_TRUE(ReadArgs(&state, expr->argv, &args));
+    ASSERT_EQ(3U, args.size());
+    EXPECT_EQ("a", args[0]);
+    EXPECT_EQ("bc", args[1]);
+    EXPECT_EQ("d", args[2]);
+    // Literals are read in place.
+    EXPECT_EQ(&expr->argv[0]->name, &args[0]);
+
+    ASSERT_TRUE(ReadArgs(&state, expr->argv, &args, 1, 2));
+    ASSERT_EQ(2U, args.size());
+    EXPECT_EQ("bc", args[0]);
+    EXPECT_FALSE(ReadArgs(&state, expr->argv, &args, 2, 2));
+}
+
+TEST_F(EdifyTest, parse_buffer) {
+    // Only the given bytes are parsed; they needn't be null-terminated.
+    std::string buffer = "concat(a, b);\nassert(\"\")unknown_function(";
+    size_t len = buffer.find("unknown");
+    std::unique_ptr<Expr> expr;
+    int error_count = 0;
+    ASSERT_EQ(0, parse_string(buffer.data(), len, &expr, &error_count));
+    ASSERT_EQ(0, error_count);
+    State state(buffer.data(), len, nullptr);
+    std::string result;
+    EXPECT_FALSE(Evaluate(&state, expr, &result));
+    // The offsets of a script start over from the beginning of it.
+    EXPECT_EQ("assert failed: \"\"", state.errmsg);
+
+    error_count = 0;
+    ASSERT_EQ(0, parse_string(buffer.data(), buffer.find(';'), &expr, &error_count));
+    State state2(buffer.data(), buffer.find(';'), nullptr);
+    ASSERT_TRUE(Evaluate(&state2, expr, &result));
+    EXPECT_EQ("ab", result);
+
+    // A script that ends in the middle of a string doesn't leave the next one inside the string.
+    error_count = 0;
+    EXPECT_NE(0, parse_string("\"abc", &expr, &error_count));
+    expect("a", "a");
+}
+
+static int lazy_args_calls = 0;
+
+static Value* CountedFn(const char* name, State* /* state */,
+                        const std::vector<std::unique_ptr<Expr>>& /* argv */) {
+    ++lazy_args_calls;
+    return StringValue(name);
+}
+
+TEST_F(EdifyTest, lazy_args) {
+    RegisterFunction("counted", CountedFn);
+    const char* script = "stdout(counted(), abort(), counted())";
+    std::unique_ptr<Expr> expr;
+    int error_count = 0;
+    ASSERT_EQ(0, parse_string(script, &expr, &error_count));
+
+    State state(script, nullptr);
+    lazy_args_calls = 0;
+    LazyArgs args(&state, expr->argv);
+    ASSERT_EQ(3U, args.size());
+    EXPECT_EQ(0, lazy_args_calls);
+
+    const Value* v = args.Get(2);
+    ASSERT_NE(nullptr, v);
+    EXPECT_EQ("counted", v->data);
+    EXPECT_EQ(1, lazy_args_calls);
+    // Evaluated only once.
+    EXPECT_EQ(v, args.Get(2));
+    EXPECT_EQ(1, lazy_args_calls);
+
+    EXPECT_EQ(nullptr, args.Get(1));
+    EXPECT_EQ(nullptr, args.Get(1));
+    EXPECT_EQ(1, lazy_args_calls);
+}
+
+TEST_F(EdifyTest, parallel) {
+    expect("parallel(a)", "a");
+    expect("parallel(a, b + c, ifelse(d, e))", "e");
+    expect("parallel(a, abort(), c)", nullptr);
+    expect("parallel(parallel(a, b), parallel(c, d))", "d");
+
+    const char* script = "parallel(a, assert(a == b), c)";
+    std::unique_ptr<Expr> expr;
+    int error_count = 0;
+    ASSERT_EQ(0, parse_string(script, &expr, &error_count));
+    State state(script, nullptr);
+    std::string result;
+    EXPECT_FALSE(Evaluate(&state, expr, &result));
+    EXPECT_EQ("assert failed: a == b", state.errmsg);
+}
+
+TEST_F(EdifyTest, branch_progress) {
+    State state("", nullptr);
+    EXPECT_DOUBLE_EQ(0.5, BranchProgress(&state, 0.5));
+
+    state.branch_progress.assign(2, 0.0);
+    State branch0("", nullptr);
+    branch0.parent = &state;
+    branch0.branch = 0;
+    State branch1("", nullptr);
+    branch1.parent = &state;
+    branch1.branch = 1;
+    EXPECT_DOUBLE_EQ(0.25, BranchProgress(&branch1, 0.5));
+    EXPECT_DOUBLE_EQ(0.75, BranchProgress(&branch0, 1.0));
+
+    // A nested parallel() gets the share of its branch.
+    branch1.branch_progress.assign(2, 0.0);
+    State nested("", nullptr);
+    nested.parent = &branch1;
+    nested.branch = 1;
+    EXPECT_DOUBLE_EQ(0.5 + 0.5 * 0.25, BranchProgress(&nested, 0.5));
+}
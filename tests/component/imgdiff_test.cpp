@@ -685,7 +685,7 @@ static void GenerateAndCheckSplitTarget(const std::string& debug_dir, size_t cou
 }
 
 std::vector<ImageChunk> ConstructImageChunks(
-    const std::vector<uint8_t>& content, const std::vector<std::tuple<std::string, size_t>>& info) {
+    const FileContent& content, const std::vector<std::tuple<std::string, size_t>>& info) {
   std::vector<ImageChunk> chunks;
   size_t start = 0;
   for (const auto& t : info) {
@@ -702,28 +702,29 @@ TEST(ImgdiffTest, zip_mode_split_image_smoke) {
   content.reserve(4096 * 50);
   uint8_t n = 0;
   generate_n(back_inserter(content), 4096 * 50, [&n]() { return n++ / 4096; });
+  FileContent file_content(content);
 
   ZipModeImage tgt_image(false, 4096 * 10);
-  std::vector<ImageChunk> tgt_chunks = ConstructImageChunks(content, { { "a", 100 },
-                                                                       { "b", 4096 * 2 },
-                                                                       { "c", 4096 * 3 },
-                                                                       { "d", 300 },
-                                                                       { "e-0", 4096 * 10 },
-                                                                       { "e-1", 4096 * 5 },
-                                                                       { "CD", 200 } });
+  std::vector<ImageChunk> tgt_chunks = ConstructImageChunks(file_content, { { "a", 100 },
+                                                                            { "b", 4096 * 2 },
+                                                                            { "c", 4096 * 3 },
+                                                                            { "d", 300 },
+                                                                            { "e-0", 4096 * 10 },
+                                                                            { "e-1", 4096 * 5 },
+                                                                            { "CD", 200 } });
   tgt_image.Initialize(std::move(tgt_chunks),
                        std::vector<uint8_t>(content.begin(), content.begin() + 82520));
 
   tgt_image.DumpChunks();
 
   ZipModeImage src_image(true, 4096 * 10);
-  std::vector<ImageChunk> src_chunks = ConstructImageChunks(content, { { "b", 4096 * 3 },
-                                                                       { "c-0", 4096 * 10 },
-                                                                       { "c-1", 4096 * 2 },
-                                                                       { "a", 4096 * 5 },
-                                                                       { "e-0", 4096 * 10 },
-                                                                       { "e-1", 10000 },
-                                                                       { "CD", 5000 } });
+  std::vector<ImageChunk> src_chunks = ConstructImageChunks(file_content, { { "b", 4096 * 3 },
+                                                                            { "c-0", 4096 * 10 },
+                                                                            { "c-1", 4096 * 2 },
+                                                                            { "a", 4096 * 5 },
+                                                                            { "e-0", 4096 * 10 },
+                                                                            { "e-1", 10000 },
+                                                                            { "CD", 5000 } });
   src_image.Initialize(std::move(src_chunks),
                        std::vector<uint8_t>(content.begin(), content.begin() + 137880));
 
@@ -758,6 +759,36 @@ TEST(ImgdiffTest, zip_mode_split_image_smoke) {
   ASSERT_EQ("2,30,34", split_src_ranges[3].ToString());
 }
 
+TEST(ImgdiffTest, zip_mode_split_image_renamed_entry) {
+  std::vector<uint8_t> content;
+  uint8_t n = 0;
+  generate_n(back_inserter(content), 4096 * 4, [&n]() { return n++ / 4096 + 1; });
+  FileContent file_content(content);
+
+  // The entry "a" has been renamed to "b", without any change to its content.
+  ZipModeImage tgt_image(false, 4096 * 10);
+  std::vector<ImageChunk> tgt_chunks =
+      ConstructImageChunks(file_content, { { "b", 4096 * 2 }, { "CD", 100 } });
+  tgt_image.Initialize(std::move(tgt_chunks),
+                       std::vector<uint8_t>(content.begin(), content.begin() + 8292));
+
+  ZipModeImage src_image(true, 4096 * 10);
+  std::vector<ImageChunk> src_chunks =
+      ConstructImageChunks(file_content, { { "a", 4096 * 2 }, { "CD", 100 } });
+  src_image.Initialize(std::move(src_chunks),
+                       std::vector<uint8_t>(content.begin(), content.begin() + 8292));
+
+  std::vector<ZipModeImage> split_tgt_images;
+  std::vector<ZipModeImage> split_src_images;
+  std::vector<SortedRangeSet> split_src_ranges;
+  ZipModeImage::SplitZipModeImageWithLimit(tgt_image, src_image, &split_tgt_images,
+                                           &split_src_images, &split_src_ranges);
+
+  // "b" is matched by its content, so the source of "a" is included in the split source.
+  ASSERT_EQ(static_cast<size_t>(1), split_src_ranges.size());
+  ASSERT_EQ("2,0,3", split_src_ranges[0].ToString());
+}
+
 TEST(ImgdiffTest, zip_mode_store_large_apk) {
   // Construct src and tgt zip files with limit = 10 blocks.
   //     src              tgt
@@ -1070,3 +1101,369 @@ TEST(ImgdiffTest, zip_mode_large_apk_skipped_small_target_chunk) {
   // src_piece 1: a-0 1 block, CD
   GenerateAndCheckSplitTarget(debug_dir.path, 2, tgt);
 }
+
+TEST(ImgdiffTest, zip_mode_jobs_deterministic) {
+  TemporaryFile tgt_file;
+  FILE* tgt_file_ptr = fdopen(tgt_file.release(), "wb");
+  ZipWriter tgt_writer(tgt_file_ptr);
+  construct_store_entry(
+      { { "a", 3, 'a' }, { "b", 3, 'b' }, { "c", 8, 'c' }, { "d", 12, 'd' }, { "e", 3, 'e' } },
+      &tgt_writer);
+  ASSERT_EQ(0, tgt_writer.Finish());
+  ASSERT_EQ(0, fclose(tgt_file_ptr));
+
+  TemporaryFile src_file;
+  FILE* src_file_ptr = fdopen(src_file.release(), "wb");
+  ZipWriter src_writer(src_file_ptr);
+  construct_store_entry({ { "d", 12, 'd' }, { "c", 8, 'c' }, { "b", 3, 'b' }, { "a", 3, 'a' } },
+                        &src_writer);
+  ASSERT_EQ(0, src_writer.Finish());
+  ASSERT_EQ(0, fclose(src_file_ptr));
+
+  // Generate the patch with and without the block limit, serially and with several jobs. The
+  // outputs are expected to be byte-for-byte identical.
+  for (const char* block_limit : { "--block-limit=0", "--block-limit=10" }) {
+    std::string expected_patch;
+    std::string expected_split_info;
+    for (const char* jobs : { "--jobs=1", "--jobs=3", "-j8" }) {
+      TemporaryFile patch_file;
+      TemporaryFile split_info_file;
+      std::string split_info_arg =
+          android::base::StringPrintf("--split-info=%s", split_info_file.path);
+      std::vector<const char*> args = {
+        "imgdiff",     "-z",          block_limit,     split_info_arg.c_str(), jobs,
+        src_file.path, tgt_file.path, patch_file.path,
+      };
+      ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+      std::string patch;
+      ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+      std::string split_info;
+      ASSERT_TRUE(android::base::ReadFileToString(split_info_file.path, &split_info));
+      if (expected_patch.empty()) {
+        expected_patch = patch;
+        expected_split_info = split_info;
+      } else {
+        ASSERT_EQ(expected_patch, patch) << block_limit << " " << jobs;
+        ASSERT_EQ(expected_split_info, split_info) << block_limit << " " << jobs;
+      }
+    }
+  }
+}
+
+TEST(ImgdiffTest, device_profile) {
+  DeviceProfile profile;
+  ASSERT_TRUE(profile.Parse("# measured on the device\nmemory_budget=1048576\n\nread_rate = 1000"));
+  ASSERT_EQ(static_cast<size_t>(1048576), profile.memory_budget);
+  ASSERT_EQ(static_cast<size_t>(1000), profile.read_rate);
+
+  ASSERT_FALSE(DeviceProfile().Parse("memory_budget=abc\n"));
+  ASSERT_FALSE(DeviceProfile().Parse("memory_budget=1048576\nunknown=1\n"));
+  ASSERT_FALSE(DeviceProfile().Parse("read_rate=1000\n"));
+}
+
+TEST(ImgdiffTest, zip_mode_device_profile) {
+  TemporaryFile tgt_file;
+  FILE* tgt_file_ptr = fdopen(tgt_file.release(), "wb");
+  ZipWriter tgt_writer(tgt_file_ptr);
+  construct_store_entry(
+      { { "a", 3, 'a' }, { "b", 3, 'b' }, { "c", 8, 'c' }, { "d", 12, 'd' }, { "e", 3, 'e' } },
+      &tgt_writer);
+  ASSERT_EQ(0, tgt_writer.Finish());
+  ASSERT_EQ(0, fclose(tgt_file_ptr));
+
+  TemporaryFile src_file;
+  FILE* src_file_ptr = fdopen(src_file.release(), "wb");
+  ZipWriter src_writer(src_file_ptr);
+  construct_store_entry({ { "d", 12, 'd' }, { "c", 8, 'c' }, { "b", 3, 'b' }, { "a", 3, 'a' } },
+                        &src_writer);
+  ASSERT_EQ(0, src_writer.Finish());
+  ASSERT_EQ(0, fclose(src_file_ptr));
+
+  // The pieces of the picked limit fit in the budget.
+  DeviceProfile profile;
+  profile.memory_budget = 64 * 4096 * 4;
+  size_t limit = ZipModeImage::ChooseBlockLimit(src_file.path, tgt_file.path, profile);
+  ASSERT_GE(limit, static_cast<size_t>(16));
+  ASSERT_LE(limit, static_cast<size_t>(64));
+
+  profile.memory_budget = 4096;
+  ASSERT_EQ(static_cast<size_t>(0),
+            ZipModeImage::ChooseBlockLimit(src_file.path, tgt_file.path, profile));
+
+  // imgdiff splits the zips by the limit picked from the profile file.
+  TemporaryFile profile_file;
+  ASSERT_TRUE(android::base::WriteStringToFile("memory_budget=1048576\n", profile_file.path));
+  TemporaryFile patch_file;
+  TemporaryFile split_info_file;
+  std::string profile_arg = android::base::StringPrintf("--device-profile=%s", profile_file.path);
+  std::string split_info_arg =
+      android::base::StringPrintf("--split-info=%s", split_info_file.path);
+  std::vector<const char*> args = {
+    "imgdiff",     "-z",          profile_arg.c_str(), split_info_arg.c_str(),
+    src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+  std::string split_info;
+  ASSERT_TRUE(android::base::ReadFileToString(split_info_file.path, &split_info));
+  ASSERT_FALSE(split_info.empty());
+}
+
+TEST(ImgdiffTest, invalid_jobs) {
+  TemporaryFile src_file;
+  TemporaryFile tgt_file;
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", "--jobs=0", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(1, imgdiff(args.size(), args.data()));
+}
+
+TEST(ImgdiffTest, suffix_array_cache) {
+  std::vector<uint8_t> src_data(4096 * 3, 'a');
+  std::fill_n(src_data.begin() + 4096, 4096, 'b');
+  std::vector<uint8_t> tgt_data(src_data);
+  std::fill_n(tgt_data.begin(), 100, 'c');
+
+  FileContent src1(src_data);
+  // Same content as |src1|, but in a different buffer.
+  FileContent src2(src_data);
+  FileContent src3(std::vector<uint8_t>(4096 * 2, 'c'));
+  FileContent tgt(tgt_data);
+
+  ImageChunk src1_chunk(CHUNK_NORMAL, 0, &src1, src1.size());
+  ImageChunk src2_chunk(CHUNK_NORMAL, 0, &src2, src2.size());
+  ImageChunk src3_chunk(CHUNK_NORMAL, 0, &src3, src3.size());
+  ImageChunk tgt_chunk(CHUNK_NORMAL, 0, &tgt, tgt.size());
+
+  std::vector<uint8_t> expected;
+  ASSERT_TRUE(ImageChunk::MakePatch(tgt_chunk, src1_chunk, &expected, nullptr));
+
+  // The source is indexed once, and the cached suffix array gives the same patch.
+  SuffixArrayCache cache;
+  std::vector<uint8_t> patch;
+  ASSERT_TRUE(ImageChunk::MakePatch(tgt_chunk, src1_chunk, &patch, &cache));
+  ASSERT_EQ(expected, patch);
+  ASSERT_TRUE(ImageChunk::MakePatch(tgt_chunk, src2_chunk, &patch, &cache));
+  ASSERT_EQ(expected, patch);
+  ASSERT_TRUE(ImageChunk::MakePatch(tgt_chunk, src3_chunk, &patch, &cache));
+  ASSERT_EQ(1U, cache.hits());
+  ASSERT_EQ(2U, cache.misses());
+
+  // With no room, only the latest suffix array is kept.
+  SuffixArrayCache small_cache(0);
+  ASSERT_TRUE(ImageChunk::MakePatch(tgt_chunk, src1_chunk, &patch, &small_cache));
+  ASSERT_TRUE(ImageChunk::MakePatch(tgt_chunk, src1_chunk, &patch, &small_cache));
+  ASSERT_TRUE(ImageChunk::MakePatch(tgt_chunk, src3_chunk, &patch, &small_cache));
+  ASSERT_TRUE(ImageChunk::MakePatch(tgt_chunk, src1_chunk, &patch, &small_cache));
+  ASSERT_EQ(expected, patch);
+  ASSERT_EQ(1U, small_cache.hits());
+  ASSERT_EQ(3U, small_cache.misses());
+}
+
+TEST(ImgdiffTest, file_content_map) {
+  TemporaryFile temp_file;
+  std::string content(4096 * 2 + 100, 'x');
+  content[4096] = 'y';
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+
+  FileContent file_content;
+  ASSERT_TRUE(file_content.MapFile(temp_file.path));
+  ASSERT_EQ(content.size(), file_content.size());
+  ASSERT_EQ(content, std::string(file_content.data(), file_content.data() + file_content.size()));
+  ASSERT_EQ('y', file_content[4096]);
+
+  // The mapping moves along with the content.
+  FileContent moved(std::move(file_content));
+  ASSERT_EQ(content.size(), moved.size());
+  ASSERT_EQ('y', moved[4096]);
+
+  TemporaryFile empty_file;
+  ASSERT_TRUE(moved.MapFile(empty_file.path));
+  ASSERT_EQ(0U, moved.size());
+
+  ASSERT_FALSE(moved.MapFile("/doesntexist"));
+}
+
+static std::vector<uint8_t> DeflateRaw(const std::vector<uint8_t>& data, int level) {
+  z_stream strm = {};
+  EXPECT_EQ(Z_OK, deflateInit2(&strm, level, ImageChunk::METHOD, ImageChunk::WINDOWBITS,
+                               ImageChunk::MEMLEVEL, ImageChunk::STRATEGY));
+  std::vector<uint8_t> compressed(deflateBound(&strm, data.size()));
+  strm.next_in = const_cast<uint8_t*>(data.data());
+  strm.avail_in = data.size();
+  strm.next_out = compressed.data();
+  strm.avail_out = compressed.size();
+  EXPECT_EQ(Z_STREAM_END, deflate(&strm, Z_FINISH));
+  compressed.resize(compressed.size() - strm.avail_out);
+  deflateEnd(&strm);
+  return compressed;
+}
+
+TEST(ImgdiffTest, reconstruct_deflate_chunk) {
+  // Words picked pseudo-randomly, which levels 6 and 9 compress differently.
+  const std::vector<std::string> words = { "alpha ", "beta ", "gamma ", "delta ",
+                                           "epsilon ", "zeta ", "eta ", "theta " };
+  std::string text;
+  uint32_t seed = 1;
+  while (text.size() < 200000) {
+    seed = seed * 1103515245 + 12345;
+    text += words[(seed >> 16) % words.size()];
+  }
+  std::vector<uint8_t> data(text.cbegin(), text.cend());
+  std::vector<uint8_t> level6 = DeflateRaw(data, 6);
+  std::vector<uint8_t> level9 = DeflateRaw(data, 9);
+  ASSERT_NE(level6, level9);
+
+  // The level that works is passed on to the next chunk.
+  int level_hint = 6;
+  for (const auto& p : { std::make_pair(9, &level9), std::make_pair(6, &level6) }) {
+    FileContent content(*p.second);
+    ImageChunk chunk(CHUNK_DEFLATE, 0, &content, content.size());
+    chunk.SetUncompressedData(data);
+    ASSERT_TRUE(chunk.ReconstructDeflateChunk(&level_hint));
+    ASSERT_EQ(p.first, level_hint);
+  }
+
+  // A mismatch past the probed prefix is still caught.
+  std::vector<uint8_t> corrupted(level9);
+  corrupted[corrupted.size() - 10] ^= 1;
+  FileContent content(corrupted);
+  ImageChunk chunk(CHUNK_DEFLATE, 0, &content, content.size());
+  chunk.SetUncompressedData(data);
+  ASSERT_FALSE(chunk.ReconstructDeflateChunk(&level_hint));
+}
+
+static std::string Gzip(const std::string& text) {
+  std::vector<uint8_t> data(text.cbegin(), text.cend());
+  std::vector<uint8_t> compressed = DeflateRaw(data, 6);
+  std::string gzip = { '\x1f', '\x8b', '\x08', '\x00', '\x00',
+                       '\x00', '\x00', '\x00', '\x00', '\x03' };
+  gzip.append(compressed.cbegin(), compressed.cend());
+  uint32_t crc = crc32(0, data.data(), data.size());
+  uint32_t size = data.size();
+  gzip.append(reinterpret_cast<const char*>(&crc), sizeof(crc));
+  gzip.append(reinterpret_cast<const char*>(&size), sizeof(size));
+  return gzip;
+}
+
+TEST(ImgpatchTest, image_mode_large_deflate_chunk) {
+  // A deflate chunk that's large enough to be inflated on demand while being patched.
+  std::string src_text;
+  uint32_t seed = 1;
+  while (src_text.size() < 12 * 1024 * 1024) {
+    seed = seed * 1103515245 + 12345;
+    src_text += android::base::StringPrintf("%u ", (seed >> 16) % 10000);
+  }
+  std::string tgt_text = "header " + src_text.substr(4096, 6 * 1024 * 1024) + "middle " +
+                         src_text.substr(0, 4096) + src_text.substr(6 * 1024 * 1024 + 4096);
+
+  std::string src = "abcdefgh" + Gzip(src_text);
+  std::string tgt = "abcdefgxyz" + Gzip(tgt_text);
+  TemporaryFile src_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(src, src_file.path));
+  TemporaryFile tgt_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(tgt, tgt_file.path));
+
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+
+  size_t num_normal;
+  size_t num_raw;
+  size_t num_deflate;
+  verify_patch_header(patch, &num_normal, &num_raw, &num_deflate);
+  ASSERT_EQ(1U, num_deflate);
+
+  verify_patched_image(src, patch, tgt);
+}
+
+TEST(ImgpatchTest, image_mode_parallel_deflate_chunks) {
+  // Several deflate chunks that are large enough to be recompressed on worker threads.
+  std::vector<std::string> src_texts;
+  std::vector<std::string> tgt_texts;
+  uint32_t seed = 1;
+  for (size_t i = 0; i < 5; i++) {
+    std::string text;
+    while (text.size() < 2 * 1024 * 1024) {
+      seed = seed * 1103515245 + 12345;
+      text += android::base::StringPrintf("%u ", (seed >> 16) % 10000);
+    }
+    src_texts.push_back(text);
+    tgt_texts.push_back(text.substr(1000) + std::to_string(i) + text.substr(0, 1000));
+  }
+
+  std::string src = "abcdefgh";
+  std::string tgt = "abcdefgxyz";
+  for (size_t i = 0; i < src_texts.size(); i++) {
+    src += Gzip(src_texts[i]) + "separator";
+    tgt += Gzip(tgt_texts[i]) + "separator";
+  }
+  TemporaryFile src_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(src, src_file.path));
+  TemporaryFile tgt_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(tgt, tgt_file.path));
+
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+
+  size_t num_normal;
+  size_t num_raw;
+  size_t num_deflate;
+  verify_patch_header(patch, &num_normal, &num_raw, &num_deflate);
+  ASSERT_EQ(5U, num_deflate);
+
+  // The output is assembled in order, and identical to the serial one.
+  verify_patched_image(src, patch, tgt);
+}
+
+TEST(ImgpatchTest, image_mode_inflate_cache) {
+  std::string src_text;
+  uint32_t seed = 1;
+  while (src_text.size() < 256 * 1024) {
+    seed = seed * 1103515245 + 12345;
+    src_text += android::base::StringPrintf("%u ", (seed >> 16) % 10000);
+  }
+  std::string tgt_text = src_text.substr(100) + "tail" + src_text.substr(0, 100);
+
+  std::string src = "abcdefgh" + Gzip(src_text);
+  std::string tgt = "abcdefgxyz" + Gzip(tgt_text);
+  TemporaryFile src_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(src, src_file.path));
+  TemporaryFile tgt_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(tgt, tgt_file.path));
+
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+
+  // The second application finds the inflated source in the cache, and gives the same output.
+  SetInflateCacheBudget(1024 * 1024);
+  size_t hits = InflateCacheHits();
+  verify_patched_image(src, patch, tgt);
+  ASSERT_EQ(hits, InflateCacheHits());
+  verify_patched_image(src, patch, tgt);
+  ASSERT_EQ(hits + 1, InflateCacheHits());
+
+  // A chunk that exceeds the budget isn't kept.
+  SetInflateCacheBudget(1024);
+  verify_patched_image(src, patch, tgt);
+  verify_patched_image(src, patch, tgt);
+  ASSERT_EQ(hits + 1, InflateCacheHits());
+  SetInflateCacheBudget(0);
+}
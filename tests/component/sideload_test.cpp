@@ -14,14 +14,23 @@
  * limitations under the License.
  */
 
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <deque>
+#include <functional>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/strings.h>
 #include <android-base/test_utils.h>
+#include <android-base/unique_fd.h>
 #include <gtest/gtest.h>
 
 #include "fuse_sideload.h"
@@ -96,3 +105,256 @@ TEST(SideloadTest, run_fuse_sideload) {
   ASSERT_EQ(0, WEXITSTATUS(status));
   ASSERT_EQ(EXIT_SUCCESS, WEXITSTATUS(status));
 }
+
+TEST(SideloadTest, run_fuse_sideload_read_ahead) {
+  std::string content;
+  for (size_t i = 0; i < 64; i++) {
+    content += std::string(4096, 'a' + i % 26);
+  }
+  // A partial last block.
+  content += std::string(100, 'z');
+
+  // A provider that answers the requests in order, like the adb host does. It's only used by the
+  // forked child, so no locking is needed.
+  std::deque<uint32_t> requests;
+  provider_vtab vtab;
+  vtab.close = [](void) {};
+  vtab.read_block = [&content](uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
+    content.copy(reinterpret_cast<char*>(buffer), fetch_size, block * 4096);
+    return 0;
+  };
+  vtab.request_blocks = [&requests](uint32_t block, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+      requests.push_back(block + i);
+    }
+    return 0;
+  };
+  vtab.receive_block = [&content, &requests](uint8_t* buffer, uint32_t fetch_size) {
+    if (requests.empty()) return -1;
+    content.copy(reinterpret_cast<char*>(buffer), fetch_size, requests.front() * 4096);
+    requests.pop_front();
+    return 0;
+  };
+
+  TemporaryDir mount_point;
+  TemporaryFile stats_file;
+  pid_t pid = fork();
+  if (pid == 0) {
+    run_fuse_sideload(vtab, content.size(), 4096, mount_point.path, nullptr, stats_file.path);
+    _exit(EXIT_SUCCESS);
+  }
+
+  std::string package = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+  static constexpr int kSideloadInstallTimeout = 10;
+  for (int i = 0; i < kSideloadInstallTimeout; ++i) {
+    struct stat sb;
+    if (stat(package.c_str(), &sb) == 0) {
+      break;
+    }
+    if (errno == ENOENT && i < kSideloadInstallTimeout - 1) {
+      sleep(1);
+      continue;
+    }
+    kill(pid, SIGTERM);
+    FAIL() << "Timed out waiting for the fuse-provided package.";
+  }
+
+  // Sequential reads are served through the read-ahead, and reads going backwards still work.
+  std::string content_via_fuse;
+  ASSERT_TRUE(android::base::ReadFileToString(package, &content_via_fuse));
+  ASSERT_EQ(content, content_via_fuse);
+
+  android::base::unique_fd fd(open(package.c_str(), O_RDONLY));
+  ASSERT_NE(-1, fd.get());
+  std::string block(4096, '\0');
+  for (int i = 63; i >= 0; i -= 7) {
+    ASSERT_TRUE(android::base::ReadFullyAtOffset(fd, &block[0], block.size(), i * 4096));
+    ASSERT_EQ(content.substr(i * 4096, 4096), block);
+  }
+
+  // A read spanning several blocks, up to the end of the file.
+  std::string span(10 * 4096, '\0');
+  size_t span_offset = 55 * 4096 + 1000;
+  ASSERT_TRUE(android::base::ReadFullyAtOffset(fd, &span[0], content.size() - span_offset,
+                                               span_offset));
+  span.resize(content.size() - span_offset);
+  ASSERT_EQ(content.substr(span_offset), span);
+
+  kill(pid, SIGTERM);
+  int status;
+  waitpid(pid, &status, 0);
+  ASSERT_TRUE(WIFEXITED(status));
+  ASSERT_EQ(EXIT_SUCCESS, WEXITSTATUS(status));
+
+  // Each block is only fetched once, and shows up in the stats.
+  std::string stats;
+  ASSERT_TRUE(android::base::ReadFileToString(stats_file.path, &stats));
+  std::vector<std::string> lines = android::base::Split(stats, "\n");
+  ASSERT_NE(lines.end(), std::find(lines.begin(), lines.end(), "blocks_fetched=65"));
+  ASSERT_NE(lines.end(), std::find(lines.begin(), lines.end(),
+                                   "bytes_fetched=" + std::to_string(content.size())));
+}
+
+TEST(SideloadTest, run_fuse_sideload_concurrent_reads) {
+  std::string content;
+  for (size_t i = 0; i < 32; i++) {
+    content += std::string(4096, 'a' + i % 26);
+  }
+
+  // A slow provider, so that the readers pile up on the blocks being fetched.
+  provider_vtab vtab;
+  vtab.close = [](void) {};
+  vtab.read_block = [&content](uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
+    usleep(2000);
+    content.copy(reinterpret_cast<char*>(buffer), fetch_size, block * 4096);
+    return 0;
+  };
+
+  TemporaryDir mount_point;
+  TemporaryFile stats_file;
+  pid_t pid = fork();
+  if (pid == 0) {
+    run_fuse_sideload(vtab, content.size(), 4096, mount_point.path, nullptr, stats_file.path);
+    _exit(EXIT_SUCCESS);
+  }
+
+  std::string package = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+  static constexpr int kSideloadInstallTimeout = 10;
+  for (int i = 0; i < kSideloadInstallTimeout; ++i) {
+    struct stat sb;
+    if (stat(package.c_str(), &sb) == 0) {
+      break;
+    }
+    if (errno == ENOENT && i < kSideloadInstallTimeout - 1) {
+      sleep(1);
+      continue;
+    }
+    kill(pid, SIGTERM);
+    FAIL() << "Timed out waiting for the fuse-provided package.";
+  }
+
+  // Several readers go through the blocks at once, from both ends.
+  std::vector<std::thread> readers;
+  std::vector<bool> matched(4);
+  for (size_t i = 0; i < matched.size(); i++) {
+    readers.emplace_back([&package, &content, &matched, i]() {
+      android::base::unique_fd fd(open(package.c_str(), O_RDONLY));
+      if (fd == -1) return;
+      std::string block(4096, '\0');
+      bool match = true;
+      for (size_t n = 0; n < 32 && match; n++) {
+        size_t index = i % 2 == 0 ? n : 31 - n;
+        match = android::base::ReadFullyAtOffset(fd, &block[0], block.size(), index * 4096) &&
+                content.compare(index * 4096, 4096, block) == 0;
+      }
+      matched[i] = match;
+    });
+  }
+  for (auto& reader : readers) {
+    reader.join();
+  }
+  ASSERT_EQ(std::vector<bool>(4, true), matched);
+
+  kill(pid, SIGTERM);
+  int status;
+  waitpid(pid, &status, 0);
+  ASSERT_TRUE(WIFEXITED(status));
+  ASSERT_EQ(EXIT_SUCCESS, WEXITSTATUS(status));
+
+  // The readers of the same block share a single fetch.
+  std::string stats;
+  ASSERT_TRUE(android::base::ReadFileToString(stats_file.path, &stats));
+  std::vector<std::string> lines = android::base::Split(stats, "\n");
+  ASSERT_NE(lines.end(), std::find(lines.begin(), lines.end(), "blocks_fetched=32"));
+}
+
+// Serves |content| with the given spill file, while the blocks for which |available| returns false
+// fail to be read from the provider. Returns whether the whole package could be read back.
+static bool SideloadWithSpill(const std::string& content, const std::string& spill_file,
+                              const std::function<bool(uint32_t)>& available) {
+  provider_vtab vtab;
+  vtab.close = [](void) {};
+  vtab.read_block = [&content, &available](uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
+    if (!available(block)) return -1;
+    content.copy(reinterpret_cast<char*>(buffer), fetch_size, block * 4096);
+    return 0;
+  };
+
+  TemporaryDir mount_point;
+  pid_t pid = fork();
+  if (pid == 0) {
+    run_fuse_sideload(vtab, content.size(), 4096, mount_point.path, spill_file.c_str());
+    _exit(EXIT_SUCCESS);
+  }
+
+  std::string package = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+  static constexpr int kSideloadInstallTimeout = 10;
+  for (int i = 0; i < kSideloadInstallTimeout; ++i) {
+    struct stat sb;
+    if (stat(package.c_str(), &sb) == 0) {
+      break;
+    }
+    if (errno == ENOENT && i < kSideloadInstallTimeout - 1) {
+      sleep(1);
+      continue;
+    }
+    ADD_FAILURE() << "Timed out waiting for the fuse-provided package.";
+  }
+
+  std::string content_via_fuse;
+  bool result = android::base::ReadFileToString(package, &content_via_fuse);
+  if (result) {
+    EXPECT_EQ(content, content_via_fuse);
+  }
+
+  kill(pid, SIGTERM);
+  int status;
+  waitpid(pid, &status, 0);
+  EXPECT_TRUE(WIFEXITED(status));
+  return result;
+}
+
+TEST(SideloadTest, run_fuse_sideload_resume) {
+  std::string content;
+  for (size_t i = 0; i < 16; i++) {
+    content += std::string(4096, 'a' + i);
+  }
+  content += std::string(100, 'z');
+  const uint32_t last_block = 16;
+
+  TemporaryDir spill_dir;
+  std::string spill_file = std::string(spill_dir.path) + "/sideload.spill";
+
+  // The transfer breaks at block 10, after the last block that keys the spill file was fetched.
+  ASSERT_FALSE(SideloadWithSpill(content, spill_file, [](uint32_t block) {
+    return block < 10 || block == last_block;
+  }));
+
+  // The retry only needs the rest, plus the first and the last blocks that identify the package.
+  ASSERT_TRUE(SideloadWithSpill(content, spill_file,
+                                [](uint32_t block) { return block == 0 || block >= 10; }));
+
+  // Nothing is left to fetch now.
+  ASSERT_TRUE(SideloadWithSpill(content, spill_file, [](uint32_t block) {
+    return block == 0 || block == last_block;
+  }));
+
+  // Without the last block, the spill file can't be matched, so it isn't used.
+  ASSERT_FALSE(SideloadWithSpill(content, spill_file,
+                                 [](uint32_t block) { return block != last_block; }));
+
+  // A package that only differs in its footer doesn't use the blocks of the old one either.
+  std::string other_footer = content;
+  other_footer.back() = 'z';
+  ASSERT_FALSE(SideloadWithSpill(other_footer, spill_file, [](uint32_t block) {
+    return block != 5;
+  }));
+
+  // A different package of the same size doesn't use the blocks of the old one.
+  std::string other = content;
+  other[5 * 4096] = 'x';
+  other.back() = 'y';
+  ASSERT_FALSE(SideloadWithSpill(other, spill_file, [](uint32_t block) { return block != 5; }));
+
+  ASSERT_EQ(0, unlink(spill_file.c_str()));
+}
@@ -15,8 +15,10 @@
  */
 
 #include <string>
+#include <vector>
 
 #include <android-base/file.h>
+#include <android-base/strings.h>
 #include <android-base/test_utils.h>
 #include <gtest/gtest.h>
 #include <update_verifier/update_verifier.h>
@@ -93,3 +95,60 @@ TEST_F(UpdateVerifierTest, verify_image_legacy_care_map) {
   ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
   ASSERT_TRUE(verify_image(temp_file.path));
 }
+
+TEST_F(UpdateVerifierTest, verify_image_progress) {
+  // This test relies on dm-verity support.
+  if (!verity_supported) {
+    GTEST_LOG_(INFO) << "Test skipped on devices without dm-verity support.";
+    return;
+  }
+
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile("system\n4,0,1,4,6", temp_file.path));
+  TemporaryFile progress_file;
+  ASSERT_TRUE(verify_image(temp_file.path, progress_file.path));
+
+  // The blocks that have been read are recorded, and the record is reused by another attempt.
+  std::string progress;
+  ASSERT_TRUE(android::base::ReadFileToString(progress_file.path, &progress));
+  ASSERT_TRUE(android::base::EndsWith(progress, "\nsystem\n4,0,1,4,6\n")) << progress;
+  ASSERT_TRUE(verify_image(temp_file.path, progress_file.path));
+
+  // A record for another care map is ignored, and gets replaced.
+  ASSERT_TRUE(android::base::WriteStringToFile("system\n2,0,1", temp_file.path));
+  ASSERT_TRUE(verify_image(temp_file.path, progress_file.path));
+  ASSERT_TRUE(android::base::ReadFileToString(progress_file.path, &progress));
+  ASSERT_TRUE(android::base::EndsWith(progress, "\nsystem\n2,0,1\n")) << progress;
+}
+
+TEST_F(UpdateVerifierTest, verify_image_v2_wrong_lines) {
+  // A v2 care map has a version line and then triplets.
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile("2\nsystem\n2,0,1", temp_file.path));
+  ASSERT_FALSE(verify_image(temp_file.path));
+
+  ASSERT_TRUE(android::base::WriteStringToFile("2\nsystem\n2,0,1\n-\nvendor", temp_file.path));
+  ASSERT_FALSE(verify_image(temp_file.path));
+}
+
+TEST_F(UpdateVerifierTest, verify_image_v2_deferred) {
+  // This test relies on dm-verity support.
+  if (!verity_supported) {
+    GTEST_LOG_(INFO) << "Test skipped on devices without dm-verity support.";
+    return;
+  }
+
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile("2\nsystem\n2,0,8\n2,2,4", temp_file.path));
+  std::vector<CareMapRanges> deferred;
+  ASSERT_TRUE(verify_image(temp_file.path, "", &deferred));
+
+  // Only the blocks outside of the boot set are left over.
+  ASSERT_EQ(1U, deferred.size());
+  ASSERT_EQ("system", deferred[0].partition);
+  ASSERT_EQ("4,0,2,4,8", deferred[0].ranges);
+  ASSERT_TRUE(verify_deferred(deferred));
+
+  // Without deferred, all of them are read before returning.
+  ASSERT_TRUE(verify_image(temp_file.path));
+}
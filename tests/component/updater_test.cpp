@@ -44,6 +44,7 @@
 #include "otautil/cache_location.h"
 #include "otautil/error_code.h"
 #include "otautil/print_sha1.h"
+#include "otautil/sparse_image.h"
 #include "updater/blockimg.h"
 #include "updater/install.h"
 #include "updater/updater.h"
@@ -115,11 +116,15 @@ class UpdaterTest : public ::testing::Test {
     CacheLocation::location().set_cache_temp_source(temp_saved_source_.path);
     CacheLocation::location().set_last_command_file(temp_last_command_.path);
     CacheLocation::location().set_stash_directory_base(temp_stash_base_.path);
+    CacheLocation::location().set_transfer_trace_base(std::string(temp_trace_dir_.path) + "/trace");
+    CacheLocation::location().set_partition_hash_cache(temp_partition_hashes_.path);
   }
 
   TemporaryFile temp_saved_source_;
   TemporaryFile temp_last_command_;
+  TemporaryFile temp_partition_hashes_;
   TemporaryDir temp_stash_base_;
+  TemporaryDir temp_trace_dir_;
 };
 
 TEST_F(UpdaterTest, getprop) {
@@ -293,6 +298,32 @@ TEST_F(UpdaterTest, delete) {
     expect("1", script3.c_str(), kNoCause);
 }
 
+TEST_F(UpdaterTest, delete_recursive) {
+  TemporaryDir td;
+  std::string dir = std::string(td.path) + "/dir";
+  ASSERT_EQ(0, mkdir(dir.c_str(), 0755));
+  ASSERT_EQ(0, mkdir((dir + "/subdir").c_str(), 0755));
+  ASSERT_TRUE(android::base::WriteStringToFile("abc", dir + "/file"));
+  ASSERT_TRUE(android::base::WriteStringToFile("abc", dir + "/subdir/file"));
+  std::string file = std::string(td.path) + "/file";
+  ASSERT_TRUE(android::base::WriteStringToFile("abc", file));
+  // What an interrupted background delete of |dir| left behind goes as well.
+  std::string leftover = std::string(td.path) + "/.dir.deleting.0.0";
+  ASSERT_EQ(0, mkdir(leftover.c_str(), 0755));
+  ASSERT_TRUE(android::base::WriteStringToFile("abc", leftover + "/file"));
+
+  std::string script =
+      "delete_recursive(\"" + dir + "\", \"" + file + "\", \"" + dir + "/doesntexist\")";
+  expect("2", script.c_str(), kNoCause);
+
+  // The paths are free right away, and nothing is left behind once the deletes are done.
+  ASSERT_EQ(-1, access(dir.c_str(), F_OK));
+  ASSERT_EQ(-1, access(file.c_str(), F_OK));
+  WaitForPendingDeletes();
+  ASSERT_EQ(0, rmdir(td.path));
+  ASSERT_EQ(0, mkdir(td.path, 0700));
+}
+
 TEST_F(UpdaterTest, rename) {
     // rename() expects two arguments.
     expect(nullptr, "rename()", kArgsParsingFailure);
@@ -373,6 +404,43 @@ TEST_F(UpdaterTest, symlink) {
     ASSERT_EQ(0, unlink(src2.c_str()));
 }
 
+TEST_F(UpdaterTest, set_metadata_recursive) {
+  TemporaryDir td;
+  std::string dir = std::string(td.path) + "/dir";
+  std::string subdir = dir + "/subdir";
+  std::string file = subdir + "/file";
+  std::string link = dir + "/link";
+  ASSERT_EQ(0, mkdir(dir.c_str(), 0700));
+  ASSERT_EQ(0, mkdir(subdir.c_str(), 0700));
+  ASSERT_TRUE(android::base::WriteStringToFile("", file));
+  ASSERT_EQ(0, chmod(file.c_str(), 0600));
+  ASSERT_EQ(0, symlink("subdir/file", link.c_str()));
+
+  std::string script = "set_metadata_recursive(\"" + std::string(td.path) + "\", \"uid\", \"" +
+                       std::to_string(getuid()) + "\", \"gid\", \"" + std::to_string(getgid()) +
+                       "\", \"dmode\", \"0751\", \"fmode\", \"0644\")";
+  expect("", script.c_str(), kNoCause);
+
+  struct stat sb;
+  ASSERT_EQ(0, stat(td.path, &sb));
+  ASSERT_EQ(0751U, sb.st_mode & 07777);
+  ASSERT_EQ(0, stat(subdir.c_str(), &sb));
+  ASSERT_EQ(0751U, sb.st_mode & 07777);
+  ASSERT_EQ(0, stat(file.c_str(), &sb));
+  ASSERT_EQ(0644U, sb.st_mode & 07777);
+  ASSERT_EQ(0, lstat(link.c_str(), &sb));
+  ASSERT_TRUE(S_ISLNK(sb.st_mode));
+
+  // A path that doesn't exist fails.
+  expect(nullptr, "set_metadata_recursive(\"/proc/self/dir\", \"mode\", \"0644\")",
+         kSetMetadataFailure);
+
+  ASSERT_EQ(0, unlink(link.c_str()));
+  ASSERT_EQ(0, unlink(file.c_str()));
+  ASSERT_EQ(0, rmdir(subdir.c_str()));
+  ASSERT_EQ(0, rmdir(dir.c_str()));
+}
+
 TEST_F(UpdaterTest, package_extract_dir) {
   // package_extract_dir expects 2 arguments.
   expect(nullptr, "package_extract_dir()", kArgsParsingFailure);
@@ -522,6 +590,143 @@ TEST_F(UpdaterTest, package_extract_file) {
   CloseArchive(handle);
 }
 
+TEST_F(UpdaterTest, package_extract_file_mapped) {
+  std::string zip_path = from_testdata_base("ziptest_valid.zip");
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_path.c_str(), &handle));
+
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  // "a.txt" is deflated, and gets extracted into the value.
+  std::string script = "sha1_check(package_extract_file(\"a.txt\"))";
+  expect(kATxtSha1Sum.c_str(), script.c_str(), kNoCause, &updater_info);
+
+  // "b.txt" is stored, so the value refers to the mapped package instead.
+  script = "sha1_check(package_extract_file(\"b.txt\"))";
+  expect(kBTxtSha1Sum.c_str(), script.c_str(), kNoCause, &updater_info);
+
+  CloseArchive(handle);
+}
+
+// Builds a sparse image of 4096-byte blocks: one RAW block of 'r', two blocks filled with
+// 0x01020304, and one DONT_CARE block.
+static std::string BuildSparseImage() {
+  constexpr uint32_t kBlockSize = 4096;
+  SparseHeader header = { kSparseHeaderMagic, 1, 0, sizeof(SparseHeader), sizeof(SparseChunkHeader),
+                          kBlockSize, 4, 3, 0 };
+  std::string image(reinterpret_cast<const char*>(&header), sizeof(header));
+  auto add_chunk = [&image](uint16_t type, uint32_t blocks, const std::string& payload) {
+    SparseChunkHeader chunk = { type, 0, blocks,
+                                static_cast<uint32_t>(sizeof(SparseChunkHeader) + payload.size()) };
+    image.append(reinterpret_cast<const char*>(&chunk), sizeof(chunk));
+    image += payload;
+  };
+  add_chunk(kSparseChunkRaw, 1, std::string(kBlockSize, 'r'));
+  add_chunk(kSparseChunkFill, 2, "\x04\x03\x02\x01");
+  add_chunk(kSparseChunkDontCare, 1, "");
+  return image;
+}
+
+TEST_F(UpdaterTest, package_extract_sparse_image) {
+  expect(nullptr, "package_extract_sparse_image(\"arg1\")", kArgsParsingFailure);
+  expect(nullptr, "package_extract_sparse_image(\"arg1\", \"arg2\", \"arg3\")",
+         kArgsParsingFailure);
+
+  std::string sparse_image = BuildSparseImage();
+  std::unordered_map<std::string, std::string> entries = {
+    { "sparse.img", sparse_image },
+    { "raw.img", std::string(4096, 'a') },
+  };
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchive(zip_file.path, &handle));
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+
+  // The DONT_CARE block keeps what was there.
+  std::string expanded = std::string(4096, 'r');
+  for (size_t i = 0; i < 2 * 4096 / 4; i++) {
+    expanded += "\x04\x03\x02\x01";
+  }
+  expanded += std::string(4096, 'x');
+  TemporaryFile dest;
+  ASSERT_TRUE(android::base::WriteStringToFile(std::string(4 * 4096, 'x'), dest.path));
+
+  std::string script = "package_extract_sparse_image(\"sparse.img\", \"" + std::string(dest.path) +
+                       "\", \"16384\", \"" + get_sha1(expanded) + "\")";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+  std::string data;
+  ASSERT_TRUE(android::base::ReadFileToString(dest.path, &data));
+  ASSERT_EQ(expanded, data);
+
+  // The size and the SHA-1 are those of the expanded image.
+  script = "package_extract_sparse_image(\"sparse.img\", \"" + std::string(dest.path) +
+           "\", \"" + std::to_string(sparse_image.size()) + "\", \"" + get_sha1(expanded) +
+           "\")";
+  expect("", script.c_str(), kNoCause, &updater_info);
+  script = "package_extract_sparse_image(\"sparse.img\", \"" + std::string(dest.path) +
+           "\", \"16384\", \"" + get_sha1(sparse_image) + "\")";
+  expect("", script.c_str(), kNoCause, &updater_info);
+
+  // An entry that isn't a sparse image is rejected before anything gets written.
+  script = "package_extract_sparse_image(\"raw.img\", \"" + std::string(dest.path) + "\")";
+  expect("", script.c_str(), kNoCause, &updater_info);
+  ASSERT_TRUE(android::base::ReadFileToString(dest.path, &data));
+  ASSERT_EQ(expanded, data);
+
+  // package_extract_file() writes the sparse image as it is.
+  script = "package_extract_file(\"sparse.img\", \"" + std::string(dest.path) + "\")";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+  ASSERT_TRUE(android::base::ReadFileToString(dest.path, &data));
+  ASSERT_EQ(sparse_image, data);
+
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, sha1_check_package_entry) {
+  std::string listed_content(1024 * 1024, 'l');
+  std::string unlisted_content = "not in the manifest";
+  // The manifest is trusted as it is, so a digest that isn't that of the entry gets returned.
+  std::string listed_sha1(40, 'a');
+  std::unordered_map<std::string, std::string> entries = {
+    { "listed", listed_content },
+    { "unlisted", unlisted_content },
+    { "META-INF/com/android/entry_sha1s", listed_sha1 + " listed\n" + "garbage\n" },
+  };
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchive(zip_file.path, &handle));
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+
+  std::string script = "sha1_check(package_extract_file(\"listed\"))";
+  expect(listed_sha1.c_str(), script.c_str(), kNoCause, &updater_info);
+  ASSERT_EQ(1u, updater_info.entry_sha1s.size());
+
+  // The entries that aren't listed get hashed.
+  std::string unlisted_sha1 = get_sha1(unlisted_content);
+  script = "sha1_check(package_extract_file(\"unlisted\"), \"wrong_sha1\", \"" +
+           unlisted_sha1 + "\")";
+  expect(unlisted_sha1.c_str(), script.c_str(), kNoCause, &updater_info);
+  script = "sha1_check(package_extract_file(\"unlisted\"), \"" + listed_sha1 + "\")";
+  expect("", script.c_str(), kNoCause, &updater_info);
+
+  // A missing entry aborts, as package_extract_file() does.
+  script = "sha1_check(package_extract_file(\"doesntexist\"))";
+  expect(nullptr, script.c_str(), kPackageExtractFileFailure, &updater_info);
+
+  CloseArchive(handle);
+}
+
 TEST_F(UpdaterTest, write_value) {
   // write_value() expects two arguments.
   expect(nullptr, "write_value()", kArgsParsingFailure);
@@ -1019,6 +1224,83 @@ TEST_F(UpdaterTest, last_command_update) {
   CloseArchive(handle);
 }
 
+TEST_F(UpdaterTest, last_command_update_skips_completed) {
+  std::string last_command_file = CacheLocation::location().last_command_file();
+  std::string completed_file = last_command_file + ".completed";
+
+  std::string block1 = std::string(4096, '1');
+  std::string block2 = std::string(4096, '2');
+  std::string block3 = std::string(4096, '3');
+  std::string block4 = std::string(4096, '4');
+  std::string new_block1 = std::string(4096, 'a');
+  std::string new_block2 = std::string(4096, 'b');
+
+  // None of the commands stashes, so the last command index stays unset. The 'zero' ends the
+  // window of commands that may run in parallel.
+  std::vector<std::string> transfer_list = {
+    "4",
+    "4",
+    "0",
+    "0",
+    "new 2,0,1",
+    "move " + get_sha1(block4) + " 2,1,2 1 2,3,4",
+    "zero 2,2,3",
+    "new 2,2,3",
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data_short", new_block1 },
+    { "new_data", new_block1 + new_block2 },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  // Build the update package.
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  // The first update runs out of new data at the last command.
+  TemporaryFile update_file;
+  ASSERT_TRUE(
+      android::base::WriteStringToFile(block1 + block2 + block3 + block4, update_file.path));
+  std::string script =
+      "block_image_update(\"" + std::string(update_file.path) +
+      R"(", package_extract_file("transfer_list"), "new_data_short", "patch_data"))";
+  expect("", script.c_str(), kNoCause, &updater_info);
+  std::string updated_contents;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated_contents));
+  ASSERT_EQ(new_block1 + block4 + std::string(4096, '\0') + block4, updated_contents);
+  ASSERT_EQ(0, access(completed_file.c_str(), R_OK));
+
+  // Clobber the target of the completed 'move', which only stays that way if it's skipped. The new
+  // data of the skipped 'new' is dropped, so the last command gets the second block.
+  std::string clobbered = std::string(4096, 'x');
+  ASSERT_TRUE(
+      android::base::WriteStringToFile(new_block1 + clobbered + block3 + block4, update_file.path));
+  std::string script_second_update =
+      "block_image_update(\"" + std::string(update_file.path) +
+      R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("t", script_second_update.c_str(), kNoCause, &updater_info);
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated_contents));
+  ASSERT_EQ(new_block1 + clobbered + new_block2 + block4, updated_contents);
+  ASSERT_EQ(-1, access(completed_file.c_str(), R_OK));
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
 TEST_F(UpdaterTest, last_command_update_unresumable) {
   std::string last_command_file = CacheLocation::location().last_command_file();
 
@@ -1145,3 +1427,609 @@ TEST_F(UpdaterTest, last_command_verify) {
   ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
   CloseArchive(handle);
 }
+
+TEST_F(UpdaterTest, block_image_update_parallel_commands) {
+  std::vector<std::string> blocks;
+  for (char c = '0'; c < '8'; c++) {
+    blocks.emplace_back(4096, c);
+  }
+  std::string new_data = std::string(4096, 'x') + std::string(4096, 'y') + std::string(4096, 'z');
+
+  // None of the commands uses the stash, so they can be scheduled together. The third 'move'
+  // overwrites the source of the first one, and the second 'new' overwrites the source of the
+  // second 'move'; the result must be the same as executing them one by one.
+  std::vector<std::string> transfer_list = {
+    "4",
+    "6",
+    "0",
+    "0",
+    "move " + get_sha1(blocks[0]) + " 2,4,5 1 2,0,1",
+    "move " + get_sha1(blocks[1]) + " 2,5,6 1 2,1,2",
+    "move " + get_sha1(blocks[2]) + " 2,0,1 1 2,2,3",
+    "new 2,6,8",
+    "new 2,1,2",
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", new_data },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  // Set up the handler, command_pipe, patch offset & length.
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(android::base::Join(blocks, ""), update_file.path));
+  std::string script = "block_image_update(\"" + std::string(update_file.path) +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+
+  std::string updated_content;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated_content));
+  std::string expected = blocks[2] + new_data.substr(8192) + blocks[2] + blocks[3] + blocks[0] +
+                         blocks[1] + new_data.substr(0, 8192);
+  ASSERT_EQ(expected, updated_content);
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, brotli_new_data_segments) {
+  auto generator = []() { return rand() % 128; };
+  // Generate 30 blocks of random data, and compress them as three independent segments.
+  std::string new_data;
+  generate_n(back_inserter(new_data), 4096 * 30, generator);
+
+  std::string encoded_data;
+  std::string new_data_index = "new_data_index 3";
+  // Segments of 10, 15 and 5 blocks.
+  std::vector<std::pair<size_t, size_t>> segments = { { 0, 10 }, { 10, 15 }, { 25, 5 } };
+  for (const auto& range : segments) {
+    std::string segment = new_data.substr(range.first * 4096, range.second * 4096);
+    size_t encoded_size = BrotliEncoderMaxCompressedSize(segment.size());
+    std::string encoded(encoded_size, 0);
+    ASSERT_TRUE(BrotliEncoderCompress(
+        BROTLI_DEFAULT_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_DEFAULT_MODE, segment.size(),
+        reinterpret_cast<const uint8_t*>(segment.data()), &encoded_size,
+        reinterpret_cast<uint8_t*>(const_cast<char*>(encoded.data()))));
+    encoded.resize(encoded_size);
+    new_data_index += " " + std::to_string(encoded_size) + ":" + std::to_string(segment.size());
+    encoded_data += encoded;
+  }
+
+  // The 'new' commands don't line up with the segment boundaries.
+  std::vector<std::string> transfer_list = {
+    "4", "30", "0", "0", new_data_index, "new 2,0,3", "new 4,3,12,20,28", "new 2,12,20",
+    "new 2,28,30",
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new.dat.br", std::move(encoded_data) },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  // Set up the handler, command_pipe, patch offset & length.
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wb");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file;
+  std::string script_new_data =
+      "block_image_update(\"" + std::string(update_file.path) +
+      R"(", package_extract_file("transfer_list"), "new.dat.br", "patch_data"))";
+  expect("t", script_new_data.c_str(), kNoCause, &updater_info);
+
+  std::string updated_content;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated_content));
+  std::string expected = new_data.substr(0, 4096 * 12) + new_data.substr(4096 * 20, 4096 * 8) +
+                         new_data.substr(4096 * 12, 4096 * 8) + new_data.substr(4096 * 28);
+  ASSERT_EQ(expected, updated_content);
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, stash_in_memory_checkpoint) {
+  std::string last_command_file = CacheLocation::location().last_command_file();
+
+  std::string block1 = std::string(4096, '1');
+  std::string block2 = std::string(4096, '2');
+  std::string block3 = std::string(4096, '3');
+  std::string block1_hash = get_sha1(block1);
+  std::string block2_hash = get_sha1(block2);
+
+  // The stash stays in memory until the second 'move' overwrites its source block, which writes it
+  // to disk and marks the first 'move' as the last executed command.
+  std::vector<std::string> transfer_list_fail = {
+    "4",
+    "3",
+    "0",
+    "1",
+    "stash " + block1_hash + " 2,0,1",
+    "move " + block1_hash + " 2,2,3 1 - " + block1_hash + ":2,0,1",
+    "move " + block2_hash + " 2,0,1 1 2,1,2",
+    "fail",
+    "move " + block1_hash + " 2,1,2 1 - " + block1_hash + ":2,0,1",
+    "free " + block1_hash,
+  };
+
+  // The resumed update has to load the stash from disk, as its source block has been overwritten.
+  std::vector<std::string> transfer_list_continue = {
+    "4",
+    "3",
+    "0",
+    "1",
+    "stash " + block1_hash + " 2,0,1",
+    "move " + block1_hash + " 2,2,3 1 - " + block1_hash + ":2,0,1",
+    "move " + block2_hash + " 2,0,1 1 2,1,2",
+    "move " + block1_hash + " 2,1,2 1 - " + block1_hash + ":2,0,1",
+    "free " + block1_hash,
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list_fail", android::base::Join(transfer_list_fail, '\n') },
+    { "transfer_list_continue", android::base::Join(transfer_list_continue, '\n') },
+  };
+
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  // Set up the handler, command_pipe, patch offset & length.
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(block1 + block2 + block3, update_file.path));
+  std::string script =
+      "block_image_update(\"" + std::string(update_file.path) +
+      R"(", package_extract_file("transfer_list_fail"), "new_data", "patch_data"))";
+  expect("", script.c_str(), kNoCause, &updater_info);
+
+  std::string last_command_content;
+  ASSERT_TRUE(android::base::ReadFileToString(last_command_file.c_str(), &last_command_content));
+  EXPECT_EQ("1\n" + transfer_list_fail[5], last_command_content);
+  std::string updated_contents;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated_contents));
+  ASSERT_EQ(block2 + block2 + block1, updated_contents);
+
+  std::string script_second_update =
+      "block_image_update(\"" + std::string(update_file.path) +
+      R"(", package_extract_file("transfer_list_continue"), "new_data", "patch_data"))";
+  expect("t", script_second_update.c_str(), kNoCause, &updater_info);
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated_contents));
+  ASSERT_EQ(block2 + block1 + block1, updated_contents);
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, stash_reference_counting) {
+  std::string block1 = std::string(4096, '1');
+  std::string block2 = std::string(4096, '2');
+  std::string block3 = std::string(4096, '3');
+  std::string block1_hash = get_sha1(block1);
+
+  // The stash is freed and stashed again before its last use, which reuses the retained contents.
+  std::vector<std::string> transfer_list = {
+    "4",
+    "2",
+    "0",
+    "1",
+    "stash " + block1_hash + " 2,0,1",
+    "move " + block1_hash + " 2,1,2 1 - " + block1_hash + ":2,0,1",
+    "free " + block1_hash,
+    "stash " + block1_hash + " 2,1,2",
+    "move " + block1_hash + " 2,2,3 1 - " + block1_hash + ":2,0,1",
+    "free " + block1_hash,
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  // Set up the handler, command_pipe, patch offset & length.
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(block1 + block2 + block3, update_file.path));
+  std::string script = "block_image_update(\"" + std::string(update_file.path) +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+
+  std::string updated_contents;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated_contents));
+  ASSERT_EQ(block1 + block1 + block1, updated_contents);
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, range_sha1) {
+  // Cover ranges longer than the chunks that are read while hashing.
+  std::string content;
+  for (size_t i = 0; i < 600; i++) {
+    content += std::string(4096, static_cast<char>('a' + i % 26));
+  }
+  TemporaryFile block_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, block_file.path));
+
+  std::string expected = get_sha1(content.substr(0, 10 * 4096) + content.substr(20 * 4096));
+  std::string script = "range_sha1(\"" + std::string(block_file.path) + "\", \"4,0,10,20,600\")";
+  expect(expected.c_str(), script.c_str(), kNoCause);
+
+  // Reading past the end of the file fails.
+  script = "range_sha1(\"" + std::string(block_file.path) + "\", \"2,590,610\")";
+  expect("", script.c_str(), kFreadFailure);
+}
+
+TEST_F(UpdaterTest, range_sha1_multi) {
+  std::string content;
+  for (size_t i = 0; i < 600; i++) {
+    content += std::string(4096, static_cast<char>('a' + i % 26));
+  }
+  TemporaryFile block_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, block_file.path));
+
+  std::string path(block_file.path);
+  std::string expected = get_sha1(content.substr(0, 10 * 4096)) + "," +
+                         get_sha1(content.substr(20 * 4096)) + "," +
+                         get_sha1(content.substr(5 * 4096, 4096));
+  std::string script = "range_sha1_multi(\"" + path + "\", \"2,0,10\", \"" + path +
+                       "\", \"2,20,600\", \"" + path + "\", \"2,5,6\")";
+  expect(expected.c_str(), script.c_str(), kNoCause);
+
+  // Any of them failing fails the whole call.
+  script = "range_sha1_multi(\"" + path + "\", \"2,0,10\", \"" + path + "\", \"2,590,610\")";
+  expect("", script.c_str(), kFreadFailure);
+
+  script = "range_sha1_multi(\"" + path + "\")";
+  expect("", script.c_str(), kArgsParsingFailure);
+}
+
+TEST_F(UpdaterTest, transfer_trace) {
+  std::string block1 = std::string(4096, '1');
+  std::string block2 = std::string(4096, '2');
+
+  std::vector<std::string> transfer_list = {
+    "4",
+    "2",
+    "0",
+    "0",
+    "move " + get_sha1(block1) + " 2,1,2 1 2,0,1",
+    "zero 2,0,1",
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  // Set up the handler, command_pipe, patch offset & length.
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(block1 + block2, update_file.path));
+  std::string script = "block_image_update(\"" + std::string(update_file.path) +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+
+  // Expect a header and one line per command, in the order of the transfer list.
+  std::string trace_file = CacheLocation::location().transfer_trace_base() + "_" +
+                           android::base::Basename(update_file.path);
+  std::string trace;
+  ASSERT_TRUE(android::base::ReadFileToString(trace_file, &trace));
+  std::vector<std::string> lines = android::base::Split(android::base::Trim(trace), "\n");
+  ASSERT_EQ(3u, lines.size());
+  ASSERT_TRUE(android::base::StartsWith(lines[0], "index,command,parse_ns,parse_bytes,"));
+  ASSERT_TRUE(android::base::StartsWith(lines[1], "0,move,"));
+  ASSERT_TRUE(android::base::StartsWith(lines[2], "1,zero,"));
+  ASSERT_EQ(0, unlink(trace_file.c_str()));
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, block_image_update_streaming_move) {
+  // Give each block distinct contents, so that any misplaced block shows up.
+  std::vector<std::string> blocks;
+  for (size_t i = 0; i < 320; i++) {
+    std::string block;
+    for (size_t j = 0; j < 4096 / 8; j++) {
+      block += android::base::StringPrintf("%08zu", i);
+    }
+    blocks.push_back(block);
+  }
+  auto join_blocks = [&blocks](size_t first, size_t last) {
+    std::string data;
+    for (size_t i = first; i < last; i++) {
+      data += blocks[i];
+    }
+    return data;
+  };
+
+  // The move is larger than the streaming window. Its source overlaps the target, with the first
+  // half moving towards the end and the second half towards the start.
+  std::string src = join_blocks(0, 150) + join_blocks(170, 320);
+  std::vector<std::string> transfer_list = {
+    "4",
+    "300",
+    "0",
+    "0",
+    "move " + get_sha1(src) + " 4,10,160,160,310 300 4,0,150,170,320",
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  // Set up the handler, command_pipe, patch offset & length.
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(join_blocks(0, 320), update_file.path));
+  std::string script = "block_image_update(\"" + std::string(update_file.path) +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+
+  std::string updated;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated));
+  ASSERT_EQ(join_blocks(0, 10) + src + join_blocks(310, 320), updated);
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, block_image_update_verified_targets) {
+  std::string block1 = std::string(4096, '1');
+  std::string block2 = std::string(4096, '2');
+
+  std::vector<std::string> transfer_list = {
+    "4",
+    "2",
+    "0",
+    "0",
+    "move " + get_sha1(block2) + " 2,0,1 1 2,1,2",
+    "zero 2,1,2",
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  // Set up the handler, command_pipe, patch offset & length.
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(block1 + block2, update_file.path));
+  std::string script = "block_image_update(\"" + std::string(update_file.path) +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+
+  // The target of the 'move' is checked during the update.
+  std::string zero_block(4096, '\0');
+  expect(get_sha1(block2).c_str(),
+         ("range_sha1(\"" + std::string(update_file.path) + "\", \"2,0,1\")").c_str(), kNoCause);
+  expect(get_sha1(block2 + zero_block).c_str(),
+         ("range_sha1(\"" + std::string(update_file.path) + "\", \"2,0,2\")").c_str(), kNoCause);
+
+  // range_sha1() reads the blocks again, so it sees what was written after the update as well.
+  ASSERT_TRUE(android::base::WriteStringToFile(block1 + zero_block, update_file.path));
+  expect(get_sha1(block1).c_str(),
+         ("range_sha1(\"" + std::string(update_file.path) + "\", \"2,0,1\")").c_str(), kNoCause);
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, block_image_update_zero_fragmented) {
+  std::string block1 = std::string(4096, '1');
+  std::string block2 = std::string(4096, '2');
+  std::string zero_block(4096, '\0');
+
+  // The adjacent ranges are zeroed together, in any order.
+  std::vector<std::string> transfer_list = {
+    "4", "3", "0", "0", "zero 6,3,4,0,1,1,2",
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  // Set up the handler, command_pipe, patch offset & length.
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file;
+  ASSERT_TRUE(
+      android::base::WriteStringToFile(block1 + block2 + block1 + block2, update_file.path));
+  std::string script = "block_image_update(\"" + std::string(update_file.path) +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+
+  std::string updated;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated));
+  ASSERT_EQ(zero_block + zero_block + block1 + zero_block, updated);
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, block_image_update_multi) {
+  std::string block1 = std::string(4096, '1');
+  std::string block2 = std::string(4096, '2');
+  std::string block3 = std::string(4096, '3');
+
+  // Each partition swaps its two blocks through a stash.
+  auto swap_list = [](const std::string& first, const std::string& second) {
+    std::vector<std::string> transfer_list = {
+      "4",
+      "2",
+      "1",
+      "1",
+      "stash " + get_sha1(first) + " 2,0,1",
+      "move " + get_sha1(second) + " 2,0,1 1 2,1,2",
+      "move " + get_sha1(first) + " 2,1,2 1 - " + get_sha1(first) + ":2,0,1",
+      "free " + get_sha1(first),
+    };
+    return android::base::Join(transfer_list, '\n');
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list_a", swap_list(block1, block2) },
+    { "transfer_list_b", swap_list(block2, block3) },
+  };
+
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  // Set up the handler, command_pipe, patch offset & length.
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file_a;
+  TemporaryFile update_file_b;
+  ASSERT_TRUE(android::base::WriteStringToFile(block1 + block2, update_file_a.path));
+  ASSERT_TRUE(android::base::WriteStringToFile(block2 + block3, update_file_b.path));
+  std::string script = "block_image_update_multi(\"" + std::string(update_file_a.path) +
+                       R"(", package_extract_file("transfer_list_a"), "new_data", "patch_data", ")" +
+                       std::string(update_file_b.path) +
+                       R"(", package_extract_file("transfer_list_b"), "new_data", "patch_data"))";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+
+  std::string updated;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file_a.path, &updated));
+  ASSERT_EQ(block2 + block1, updated);
+  ASSERT_TRUE(android::base::ReadFileToString(update_file_b.path, &updated));
+  ASSERT_EQ(block3 + block2, updated);
+
+  // The combined progress reaches the end.
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  std::string cmd;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_pipe.path, &cmd));
+  ASSERT_NE(std::string::npos, cmd.find("set_progress 1.0000"));
+
+  // A malformed tuple fails the whole call.
+  expect("", "block_image_update_multi(\"a\", \"b\", \"c\")", kArgsParsingFailure);
+  CloseArchive(handle);
+}
@@ -28,9 +28,13 @@
 #include <android-base/file.h>
 #include <android-base/stringprintf.h>
 #include <android-base/test_utils.h>
+#include <openssl/bytestring.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
 
 #include "common/test_constants.h"
 #include "otautil/SysUtil.h"
+#include "otautil/print_sha1.h"
 #include "verifier.h"
 
 using namespace std::string_literals;
@@ -220,3 +224,96 @@ INSTANTIATE_TEST_CASE_P(BadPackage, VerifierFailureTest,
     ::testing::Values(
       std::vector<std::string>({"random.zip", "v1"}),
       std::vector<std::string>({"fake-eocd.zip", "v1"})));
+
+// Builds a package of |size| bytes ending in a 2-byte comment length and a |comment_size|-byte
+// comment (no EOCD needed), with chunk digests at |manifest_offset| signed by |key|, and returns
+// the manifest.
+static std::string make_chunked_package(std::string* package, size_t size, size_t comment_size,
+                                        size_t manifest_offset, uint32_t chunk_size,
+                                        size_t manifest_size, const std::string& key) {
+  package->resize(size);
+  for (size_t i = 0; i < size; i++) {
+    (*package)[i] = static_cast<char>(i * 7 + 3);
+  }
+  size_t covered = size - comment_size - 2;
+  (*package)[covered] = comment_size & 0xff;
+  (*package)[covered + 1] = comment_size >> 8;
+
+  std::string zeroed = *package;
+  std::fill(zeroed.begin() + manifest_offset, zeroed.begin() + manifest_offset + manifest_size, 0);
+  std::string manifest = android::base::StringPrintf("chunk_digests 1\n%u %zu\n", chunk_size,
+                                                     covered);
+  for (size_t start = 0; start < covered; start += chunk_size) {
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const uint8_t*>(zeroed.data()) + start,
+           std::min<size_t>(chunk_size, covered - start), digest);
+    manifest += print_sha1(digest, SHA256_DIGEST_LENGTH) + "\n";
+  }
+
+  std::string pk8;
+  EXPECT_TRUE(android::base::ReadFileToString(from_testdata_base("testkey_" + key + ".pk8"), &pk8));
+  CBS cbs;
+  CBS_init(&cbs, reinterpret_cast<const uint8_t*>(pk8.data()), pk8.size());
+  bssl::UniquePtr<EVP_PKEY> pkey(EVP_parse_private_key(&cbs));
+  EXPECT_NE(nullptr, pkey);
+  uint8_t hash[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const uint8_t*>(manifest.data()), manifest.size(), hash);
+  std::vector<uint8_t> sig(RSA_size(EVP_PKEY_get0_RSA(pkey.get())));
+  unsigned int sig_len;
+  EXPECT_EQ(1, RSA_sign(NID_sha256, hash, sizeof(hash), sig.data(), &sig_len,
+                        EVP_PKEY_get0_RSA(pkey.get())));
+  manifest += print_hex(sig.data(), sig_len) + "\n";
+  // The test manifest has to fit where it was assumed to be.
+  EXPECT_EQ(manifest_size, manifest.size());
+  package->replace(manifest_offset, manifest.size(), manifest);
+  return manifest;
+}
+
+TEST(VerifierTest, chunk_digests) {
+  std::vector<Certificate> certs;
+  ASSERT_TRUE(load_keys(from_testdata_base("testkey_v3.txt").c_str(), certs));
+
+  // 8 chunks of 4096 bytes, the last one short: a header of 27 bytes, 8 digest lines of 65 and a
+  // 2048-bit signature of 513.
+  constexpr size_t kManifestSize = 27 + 8 * 65 + 513;
+  std::string package;
+  std::string manifest =
+      make_chunked_package(&package, 31000, 100, 5000, 4096, kManifestSize, "v3");
+  auto chunks = ChunkDigests::Parse(manifest, 5000, package.size(), certs);
+  ASSERT_NE(nullptr, chunks);
+  ASSERT_EQ(4096U, chunks->chunk_size());
+  ASSERT_EQ(31000U - 102, chunks->covered_length());
+  ASSERT_TRUE(chunks->SetTail(package.substr(chunks->covered_length())));
+
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(package.data());
+  for (size_t offset = 0; offset < package.size(); offset += 8192) {
+    ASSERT_TRUE(chunks->Verify(offset, data + offset, std::min<size_t>(8192, package.size() - offset)));
+  }
+  // Not on a chunk boundary.
+  ASSERT_FALSE(chunks->Verify(100, data + 100, 4096));
+
+  // A changed byte, in a chunk, in the manifest or in the tail.
+  for (size_t pos : { 10U, 5100U, 30990U }) {
+    std::string tampered = package;
+    tampered[pos] ^= 1;
+    size_t offset = pos / 8192 * 8192;
+    ASSERT_FALSE(chunks->Verify(offset, reinterpret_cast<const uint8_t*>(tampered.data()) + offset,
+                                std::min<size_t>(8192, package.size() - offset)));
+  }
+
+  // Signed by another key.
+  std::vector<Certificate> other_certs;
+  ASSERT_TRUE(load_keys(from_testdata_base("testkey_v4.txt").c_str(), other_certs));
+  ASSERT_EQ(nullptr, ChunkDigests::Parse(manifest, 5000, package.size(), other_certs));
+
+  // Tampered digest.
+  std::string bad_manifest = manifest;
+  bad_manifest[40] = bad_manifest[40] == '0' ? '1' : '0';
+  ASSERT_EQ(nullptr, ChunkDigests::Parse(bad_manifest, 5000, package.size(), certs));
+
+  // A tail that doesn't hold the comment, or has an EOCD marker.
+  ASSERT_FALSE(chunks->SetTail(package.substr(chunks->covered_length() + 1)));
+  std::string tail = package.substr(chunks->covered_length());
+  tail.replace(10, 4, "PK\x05\x06");
+  ASSERT_FALSE(chunks->SetTail(tail));
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/test_utils.h>
+#include <android-base/unique_fd.h>
+#include <gtest/gtest.h>
+
+#include "otautil/block_io_trace.h"
+
+TEST(BlockIoTraceTest, not_tracing_by_default) {
+  ASSERT_EQ(nullptr, BlockIoTrace::Get());
+  ASSERT_TRUE(BlockIoTrace::Finish(""));
+}
+
+TEST(BlockIoTraceTest, records_the_traced_file_only) {
+  TemporaryFile device;
+  TemporaryFile other;
+  ASSERT_TRUE(BlockIoTrace::Start(device.path));
+  BlockIoTrace* trace = BlockIoTrace::Get();
+  ASSERT_NE(nullptr, trace);
+
+  // Another descriptor of the traced file counts as well.
+  android::base::unique_fd fd(open(device.path, O_RDWR));
+  ASSERT_NE(-1, fd);
+  ASSERT_TRUE(trace->Traces(device.fd));
+  ASSERT_TRUE(trace->Traces(fd));
+  ASSERT_FALSE(trace->Traces(other.fd));
+
+  BlockIoTrace::SetCommand(3);
+  uint64_t start_ns = trace->Now();
+  trace->Record(fd, BlockIoRecord::kWrite, 4096, 8192, start_ns);
+  trace->Record(other.fd, BlockIoRecord::kWrite, 0, 4096, start_ns);
+  BlockIoTrace::SetCommand(-1);
+  trace->Record(device.fd, BlockIoRecord::kFsync, 0, 0, trace->Now(), BlockIoRecord::kQueued);
+
+  ASSERT_EQ(2u, trace->records().size());
+  const BlockIoRecord& write = trace->records()[0];
+  ASSERT_EQ(BlockIoRecord::kWrite, write.op);
+  ASSERT_EQ(4096u, write.offset);
+  ASSERT_EQ(8192u, write.length);
+  ASSERT_EQ(start_ns, write.start_ns);
+  ASSERT_EQ(3, write.command);
+  ASSERT_EQ(0, write.flags);
+  const BlockIoRecord& fsync = trace->records()[1];
+  ASSERT_EQ(BlockIoRecord::kFsync, fsync.op);
+  ASSERT_EQ(-1, fsync.command);
+  ASSERT_EQ(BlockIoRecord::kQueued, fsync.flags);
+  ASSERT_GE(fsync.start_ns, write.start_ns);
+
+  TemporaryFile saved;
+  ASSERT_TRUE(BlockIoTrace::Finish(saved.path));
+  ASSERT_EQ(nullptr, BlockIoTrace::Get());
+
+  std::vector<BlockIoRecord> records;
+  ASSERT_TRUE(BlockIoTrace::Load(saved.path, &records));
+  ASSERT_EQ(2u, records.size());
+  ASSERT_EQ(8192u, records[0].length);
+  ASSERT_EQ(3, records[0].command);
+  ASSERT_EQ(BlockIoRecord::kFsync, records[1].op);
+}
+
+TEST(BlockIoTraceTest, command_is_per_thread) {
+  TemporaryFile device;
+  ASSERT_TRUE(BlockIoTrace::Start(device.path));
+  BlockIoTrace* trace = BlockIoTrace::Get();
+  BlockIoTrace::SetCommand(1);
+  std::thread worker([trace, &device]() {
+    BlockIoTrace::SetCommand(2);
+    trace->Record(device.fd, BlockIoRecord::kRead, 0, 4096, trace->Now());
+  });
+  worker.join();
+  trace->Record(device.fd, BlockIoRecord::kRead, 4096, 4096, trace->Now());
+  BlockIoTrace::SetCommand(-1);
+
+  ASSERT_EQ(2u, trace->records().size());
+  ASSERT_EQ(2, trace->records()[0].command);
+  ASSERT_EQ(1, trace->records()[1].command);
+  ASSERT_TRUE(BlockIoTrace::Finish(""));
+}
+
+TEST(BlockIoTraceTest, load_rejects_bad_files) {
+  std::vector<BlockIoRecord> records;
+  TemporaryFile garbage;
+  ASSERT_TRUE(android::base::WriteStringToFile("not a trace at all", garbage.path));
+  ASSERT_FALSE(BlockIoTrace::Load(garbage.path, &records));
+
+  // A header claiming more records than there are.
+  std::vector<BlockIoRecord> saved(2);
+  TemporaryFile truncated;
+  ASSERT_TRUE(BlockIoTrace::Save(truncated.path, saved));
+  ASSERT_EQ(0, truncate(truncated.path, 16 + sizeof(BlockIoRecord)));
+  ASSERT_FALSE(BlockIoTrace::Load(truncated.path, &records));
+
+  TemporaryFile empty;
+  ASSERT_TRUE(BlockIoTrace::Save(empty.path, {}));
+  ASSERT_TRUE(BlockIoTrace::Load(empty.path, &records));
+  ASSERT_TRUE(records.empty());
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/test_utils.h>
+#include <gtest/gtest.h>
+
+#include "otautil/boot_trace.h"
+
+static const TraceEvent* FindEvent(const std::vector<TraceEvent>& events, const std::string& name) {
+  for (const auto& event : events) {
+    if (event.name == name) {
+      return &event;
+    }
+  }
+  return nullptr;
+}
+
+TEST(BootTraceTest, phases) {
+  {
+    TracePhase outer("test_outer");
+    {
+      TracePhase inner("test_inner");
+    }
+    TracePhase ended("test_ended");
+    ended.End();
+    ended.End();
+  }
+  auto start = std::chrono::steady_clock::now();
+  TraceRecord("test_recorded", start, start + std::chrono::milliseconds(5));
+
+  std::vector<TraceEvent> events = TraceEvents();
+  const TraceEvent* outer = FindEvent(events, "test_outer");
+  const TraceEvent* inner = FindEvent(events, "test_inner");
+  ASSERT_NE(nullptr, outer);
+  ASSERT_NE(nullptr, inner);
+  ASSERT_LE(outer->start_ns, inner->start_ns);
+  ASSERT_GE(outer->end_ns, inner->end_ns);
+
+  size_t ended_count = 0;
+  for (const auto& event : events) {
+    if (event.name == "test_ended") {
+      ended_count++;
+    }
+  }
+  ASSERT_EQ(1U, ended_count);
+
+  const TraceEvent* recorded = FindEvent(events, "test_recorded");
+  ASSERT_NE(nullptr, recorded);
+  ASSERT_NEAR(5000000, recorded->end_ns - recorded->start_ns, 1000);
+
+  std::string summary = TraceSummary(events);
+  ASSERT_NE(std::string::npos, summary.find("test_inner"));
+  // Sorted by start time.
+  ASSERT_LT(summary.find("test_outer"), summary.find("test_inner"));
+
+  TemporaryFile temp_file;
+  ASSERT_TRUE(WriteChromeTrace(temp_file.path));
+  std::string json;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file.path, &json));
+  ASSERT_NE(std::string::npos, json.find("\"name\":\"test_recorded\",\"ph\":\"X\""));
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
+#include <gtest/gtest.h>
+
+#include "otautil/command_pipe.h"
+
+// Reads the whole pipe, with the set_progress fractions put in the commands as "<progress %f>".
+static std::vector<std::string> ReadAll(int fd, bool* framed = nullptr) {
+  std::vector<std::string> commands;
+  CommandPipeReader reader(fd);
+  auto on_command = [&commands](const std::string& line) { commands.push_back(line); };
+  auto on_set_progress = [&commands](double fraction) {
+    commands.push_back(android::base::StringPrintf("<progress %f>", fraction));
+  };
+  while (reader.Read(on_command, on_set_progress)) {
+  }
+  if (framed != nullptr) {
+    *framed = reader.framed();
+  }
+  return commands;
+}
+
+TEST(CommandPipeTest, text) {
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  android::base::unique_fd read_fd(fds[0]);
+  {
+    android::base::unique_fd write_fd(fds[1]);
+    std::string text =
+        "ui_print a\nset_progress 0.1\nset_progress 0.2\nlog b\nset_progress 0.3\nwipe_cache";
+    ASSERT_TRUE(android::base::WriteFully(write_fd, text.data(), text.size()));
+  }
+
+  bool framed;
+  std::vector<std::string> commands = ReadAll(read_fd, &framed);
+  ASSERT_FALSE(framed);
+  // The set_progress lines of one read are coalesced, and the unfinished last line counts.
+  std::vector<std::string> expected = { "ui_print a", "set_progress 0.2", "log b",
+                                        "set_progress 0.3", "wipe_cache" };
+  ASSERT_EQ(expected, commands);
+}
+
+TEST(CommandPipeTest, framed) {
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  android::base::unique_fd read_fd(fds[0]);
+  FILE* stream = OpenFramedCommandPipe(fds[1]);
+  ASSERT_NE(nullptr, stream);
+  setlinebuf(stream);
+  // Written in pieces, with the newlines anywhere.
+  fprintf(stream, "ui_print ");
+  fprintf(stream, "a b\nset_progress 0.25\n");
+  for (int i = 0; i < 1000; i++) {
+    fprintf(stream, "set_progress %f\n", 0.25 + i / 2000.0);
+  }
+  fprintf(stream, "log c\nset_progress 1.0\nclear_display");
+  ASSERT_EQ(0, fclose(stream));
+
+  bool framed;
+  std::vector<std::string> commands = ReadAll(read_fd, &framed);
+  ASSERT_TRUE(framed);
+  // The progress goes before the command that followed it, and all of it came in one read.
+  std::vector<std::string> expected = { "ui_print a b", "<progress 0.749500>", "log c",
+                                        "<progress 1.000000>", "clear_display" };
+  ASSERT_EQ(expected, commands);
+}
+
+TEST(CommandPipeTest, framed_progress_is_throttled) {
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  android::base::unique_fd read_fd(fds[0]);
+  FILE* stream = OpenFramedCommandPipe(fds[1]);
+  ASSERT_NE(nullptr, stream);
+  setlinebuf(stream);
+  for (int i = 0; i < 1000; i++) {
+    fprintf(stream, "set_progress %f\n", i / 1000.0);
+  }
+  ASSERT_EQ(0, fclose(stream));
+
+  // Count the frames as they are in the pipe.
+  std::string data;
+  char buffer[4096];
+  ssize_t n;
+  while ((n = read(read_fd, buffer, sizeof(buffer))) > 0) {
+    data.append(buffer, n);
+  }
+  size_t progress_frames = 0;
+  for (size_t offset = 0; offset + sizeof(CommandFrame) <= data.size();) {
+    CommandFrame header;
+    memcpy(&header, data.data() + offset, sizeof(header));
+    if (header.type == CommandFrame::kSetProgress) {
+      progress_frames++;
+    }
+    offset += sizeof(header) + header.length;
+  }
+  // The first one right away, and the last one when the stream is closed.
+  ASSERT_GE(progress_frames, 2u);
+  ASSERT_LT(progress_frames, 100u);
+}
+
+TEST(CommandPipeTest, framed_progress_after_interval) {
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  android::base::unique_fd read_fd(fds[0]);
+  std::vector<std::string> commands;
+  std::thread reader([&read_fd, &commands]() { commands = ReadAll(read_fd); });
+
+  FILE* stream = OpenFramedCommandPipe(fds[1]);
+  ASSERT_NE(nullptr, stream);
+  setlinebuf(stream);
+  fprintf(stream, "set_progress 0.1\n");
+  std::this_thread::sleep_for(kCommandProgressInterval * 2);
+  fprintf(stream, "set_progress 0.2\n");
+  ASSERT_EQ(0, fclose(stream));
+  reader.join();
+
+  std::vector<std::string> expected = { "<progress 0.100000>", "<progress 0.200000>" };
+  ASSERT_EQ(expected, commands);
+}
+
+TEST(CommandPipeTest, rejects_bad_frames) {
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  android::base::unique_fd read_fd(fds[0]);
+  {
+    android::base::unique_fd write_fd(fds[1]);
+    CommandFrame hello = {};
+    CommandFrame bad = {};
+    bad.type = CommandFrame::kSetProgress;
+    bad.length = 3;
+    ASSERT_TRUE(android::base::WriteFully(write_fd, &hello, sizeof(hello)));
+    ASSERT_TRUE(android::base::WriteFully(write_fd, &bad, sizeof(bad)));
+    ASSERT_TRUE(android::base::WriteFully(write_fd, "abc", 3));
+  }
+  CommandPipeReader reader(read_fd);
+  auto on_command = [](const std::string&) { FAIL(); };
+  auto on_set_progress = [](double) { FAIL(); };
+  ASSERT_FALSE(reader.Read(on_command, on_set_progress));
+  ASSERT_TRUE(reader.framed());
+}
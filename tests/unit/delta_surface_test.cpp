@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <memory>
+
+#include <gtest/gtest.h>
+
+#include "minui/minui.h"
+
+using SurfacePtr = std::unique_ptr<GRSurface, decltype(&res_free_surface)>;
+
+// A display surface whose pixel (x, y) is y * width + x.
+static SurfacePtr CreateFrame(int width, int height) {
+  GRSurface* surface = static_cast<GRSurface*>(malloc(sizeof(GRSurface) + width * height * 4));
+  surface->width = width;
+  surface->height = height;
+  surface->row_bytes = width * 4;
+  surface->pixel_bytes = 4;
+  surface->data = reinterpret_cast<unsigned char*>(surface + 1);
+  uint32_t* pixels = reinterpret_cast<uint32_t*>(surface->data);
+  for (int i = 0; i < width * height; ++i) {
+    pixels[i] = i;
+  }
+  return SurfacePtr(surface, res_free_surface);
+}
+
+static void SetPixel(GRSurface* surface, int x, int y, uint32_t value) {
+  memcpy(surface->data + y * surface->row_bytes + x * 4, &value, sizeof(value));
+}
+
+TEST(DeltaSurfaceTest, bounding_box) {
+  SurfacePtr previous = CreateFrame(16, 8);
+  SurfacePtr frame = CreateFrame(16, 8);
+  SetPixel(frame.get(), 3, 2, 0xffffffff);
+  SetPixel(frame.get(), 9, 5, 0xffffffff);
+
+  GRSurface* result;
+  int x, y;
+  ASSERT_EQ(0, res_create_delta_surface(&result, &x, &y, previous.get(), frame.get()));
+  SurfacePtr delta(result, res_free_surface);
+  ASSERT_NE(nullptr, delta);
+  ASSERT_EQ(3, x);
+  ASSERT_EQ(2, y);
+  ASSERT_EQ(7, delta->width);
+  ASSERT_EQ(4, delta->height);
+
+  // Applying it to the previous frame gives the new one.
+  res_apply_delta_surface(previous.get(), delta.get(), x, y);
+  ASSERT_EQ(0, memcmp(previous->data, frame->data, frame->height * frame->row_bytes));
+}
+
+TEST(DeltaSurfaceTest, identical_frames) {
+  SurfacePtr previous = CreateFrame(16, 8);
+  SurfacePtr frame = CreateFrame(16, 8);
+  GRSurface* result;
+  int x, y;
+  ASSERT_EQ(0, res_create_delta_surface(&result, &x, &y, previous.get(), frame.get()));
+  ASSERT_EQ(nullptr, result);
+}
+
+TEST(DeltaSurfaceTest, whole_frame) {
+  SurfacePtr frame = CreateFrame(16, 8);
+  GRSurface* result;
+  int x, y;
+  ASSERT_EQ(0, res_create_delta_surface(&result, &x, &y, nullptr, frame.get()));
+  SurfacePtr copy(result, res_free_surface);
+  ASSERT_EQ(0, x);
+  ASSERT_EQ(0, y);
+  ASSERT_EQ(16, copy->width);
+  ASSERT_EQ(8, copy->height);
+  ASSERT_EQ(0, memcmp(copy->data, frame->data, frame->height * frame->row_bytes));
+
+  // Frames of different sizes can't be compared.
+  SurfacePtr other = CreateFrame(8, 8);
+  ASSERT_GT(0, res_create_delta_surface(&result, &x, &y, other.get(), frame.get()));
+}
@@ -20,6 +20,7 @@
 
 #include <string>
 
+#include <android-base/file.h>
 #include <android-base/test_utils.h>
 #include <gtest/gtest.h>
 #include <otautil/DirUtil.h>
@@ -138,3 +139,54 @@ TEST(DirUtilTest, unlink_smoke) {
   // Verify it's gone.
   ASSERT_EQ(-1, access((path + "/a").c_str(), F_OK));
 }
+
+TEST(DirUtilTest, create_with_cache) {
+  TemporaryDir td;
+  std::string prefix(td.path);
+  DirCache cache;
+  ASSERT_EQ(0, mkdir_recursively(prefix + "/a/b/c/file", 0755, true, nullptr, nullptr, &cache));
+  struct stat sb;
+  ASSERT_EQ(0, stat((prefix + "/a/b/c").c_str(), &sb));
+  ASSERT_TRUE(S_ISDIR(sb.st_mode));
+  ASSERT_TRUE(cache.Contains(prefix + "/a/b/c"));
+  ASSERT_TRUE(cache.Contains(prefix + "/a/b"));
+
+  // The cached directories aren't looked at again, so a sibling only needs its own directory.
+  ASSERT_EQ(0, rmdir((prefix + "/a/b/c").c_str()));
+  ASSERT_EQ(0, mkdir_recursively(prefix + "/a/b/c/other", 0755, true, nullptr, nullptr, &cache));
+  ASSERT_EQ(-1, access((prefix + "/a/b/c").c_str(), F_OK));
+  ASSERT_EQ(0, mkdir_recursively(prefix + "/a/b/d/file", 0755, true, nullptr, nullptr, &cache));
+  ASSERT_EQ(0, access((prefix + "/a/b/d").c_str(), F_OK));
+
+  // A file in the way still fails.
+  TemporaryFile tf;
+  ASSERT_EQ(-1, mkdir_recursively(std::string(tf.path) + "/x/", 0755, false, nullptr, nullptr,
+                                  &cache));
+  ASSERT_EQ(ENOTDIR, errno);
+
+  ASSERT_EQ(0, dirUnlinkHierarchy((prefix + "/a").c_str()));
+}
+
+TEST(DirUtilTest, unlink_parallel) {
+  TemporaryDir td;
+  std::string path = std::string(td.path) + "/a";
+  for (const char* dir : { "b/c/d/e", "b/f", "g/h/i", "j" }) {
+    ASSERT_EQ(0, mkdir_recursively(path + "/" + dir, 0700, false, nullptr));
+    ASSERT_TRUE(android::base::WriteStringToFile("x", path + "/" + dir + "/file"));
+  }
+  ASSERT_TRUE(android::base::WriteStringToFile("x", path + "/file"));
+  ASSERT_TRUE(android::base::WriteStringToFile("x", path + "/b/file"));
+
+  for (size_t depth : { 1, 2, 5 }) {
+    ASSERT_EQ(0, mkdir_recursively(path + "/b/c/d/e", 0700, false, nullptr));
+    ASSERT_EQ(0, dirUnlinkHierarchy(path.c_str(), 4, depth));
+    ASSERT_EQ(-1, access(path.c_str(), F_OK));
+  }
+
+  // A file, or nothing at all.
+  TemporaryFile tf;
+  ASSERT_EQ(0, dirUnlinkHierarchy(tf.path, 4));
+  ASSERT_EQ(-1, access(tf.path, F_OK));
+  ASSERT_EQ(-1, dirUnlinkHierarchy(path.c_str(), 4));
+  ASSERT_EQ(ENOENT, errno);
+}
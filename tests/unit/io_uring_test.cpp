@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/test_utils.h>
+#include <gtest/gtest.h>
+
+#include "otautil/io_uring.h"
+
+TEST(IoUringQueueTest, ReadWrite) {
+  std::unique_ptr<IoUringQueue> queue = IoUringQueue::Create(4);
+  if (!queue) {
+    GTEST_LOG_(INFO) << "Test skipped: io_uring is unavailable";
+    return;
+  }
+  ASSERT_LE(queue->depth(), 4U);
+
+  TemporaryFile tf;
+  std::string content(4096 * 10, '\0');
+  for (size_t i = 0; i < content.size(); i++) {
+    content[i] = static_cast<char>(i * 13 + i / 4096);
+  }
+
+  // Write the content out of order, with more requests than the queue depth.
+  std::vector<IoRequest> writes;
+  for (size_t i : { 3, 0, 9, 1, 5, 2, 8, 4, 7, 6 }) {
+    writes.push_back({ tf.fd, reinterpret_cast<uint8_t*>(&content[i * 4096]), 4096,
+                       static_cast<off64_t>(i * 4096) });
+  }
+  ASSERT_TRUE(queue->Write(writes));
+
+  std::string written;
+  ASSERT_TRUE(android::base::ReadFileToString(tf.path, &written));
+  ASSERT_EQ(content, written);
+
+  std::string buffer(content.size(), '\0');
+  std::vector<IoRequest> reads = {
+    { tf.fd, reinterpret_cast<uint8_t*>(&buffer[0]), 4096 * 3, 0 },
+    { tf.fd, reinterpret_cast<uint8_t*>(&buffer[4096 * 3]), 4096 * 7, 4096 * 3 },
+  };
+  ASSERT_TRUE(queue->Read(reads));
+  ASSERT_EQ(content, buffer);
+}
+
+TEST(IoUringQueueTest, ReadPastEnd) {
+  std::unique_ptr<IoUringQueue> queue = IoUringQueue::Create(4);
+  if (!queue) {
+    GTEST_LOG_(INFO) << "Test skipped: io_uring is unavailable";
+    return;
+  }
+
+  TemporaryFile tf;
+  ASSERT_TRUE(android::base::WriteStringToFile("abcd", tf.path));
+
+  std::vector<uint8_t> buffer(4096);
+  std::vector<IoRequest> reads = { { tf.fd, buffer.data(), buffer.size(), 0 } };
+  ASSERT_FALSE(queue->Read(reads));
+  ASSERT_EQ(EIO, errno);
+  ASSERT_EQ("abcd", std::string(buffer.begin(), buffer.begin() + 4));
+}
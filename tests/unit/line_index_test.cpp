@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/test_utils.h>
+#include <android-base/unique_fd.h>
+#include <gtest/gtest.h>
+
+#include "otautil/line_index.h"
+
+static std::string GetLine(LineIndex& index, size_t line) {
+  size_t offset;
+  size_t length;
+  index.GetLine(line, &offset, &length);
+  return std::string(index.data() + offset, length);
+}
+
+TEST(LineIndexTest, Lines) {
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile("first\n\nthird\nlast", temp_file.path));
+  LineIndex index;
+  ASSERT_TRUE(index.Open(temp_file.fd));
+  ASSERT_EQ(4u, index.WaitForAll());
+  bool done;
+  ASSERT_EQ(4u, index.IndexedLines(&done));
+  ASSERT_TRUE(done);
+  ASSERT_EQ("first", GetLine(index, 0));
+  ASSERT_EQ("", GetLine(index, 1));
+  ASSERT_EQ("third", GetLine(index, 2));
+  ASSERT_EQ("last", GetLine(index, 3));
+  ASSERT_TRUE(index.WaitForLine(3));
+  ASSERT_FALSE(index.WaitForLine(4));
+}
+
+TEST(LineIndexTest, TrailingNewline) {
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile("a\nb\n", temp_file.path));
+  LineIndex index;
+  ASSERT_TRUE(index.Open(temp_file.fd));
+  ASSERT_EQ(2u, index.WaitForAll());
+  ASSERT_EQ("b", GetLine(index, 1));
+}
+
+TEST(LineIndexTest, EmptyFile) {
+  TemporaryFile temp_file;
+  LineIndex index;
+  ASSERT_TRUE(index.Open(temp_file.fd));
+  ASSERT_EQ(0u, index.WaitForAll());
+  ASSERT_FALSE(index.WaitForLine(0));
+  ASSERT_EQ(SIZE_MAX, index.Find("x", 0));
+}
+
+TEST(LineIndexTest, LargeFile) {
+  // Spans several chunks of the scan, with lines across their boundaries.
+  std::string content;
+  for (size_t i = 0; content.size() < 5 * 1024 * 1024; i++) {
+    content += "line " + std::to_string(i) + std::string(i % 97, '.') + "\n";
+  }
+  content += "E:the end";
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+  LineIndex index;
+  ASSERT_TRUE(index.Open(temp_file.fd));
+  ASSERT_TRUE(index.WaitForLine(1));
+  ASSERT_EQ("line 1.", GetLine(index, 1));
+
+  size_t lines = index.WaitForAll();
+  size_t offset = 0;
+  for (size_t i = 0; i + 1 < lines; i++) {
+    std::string expected = "line " + std::to_string(i) + std::string(i % 97, '.');
+    ASSERT_EQ(expected, GetLine(index, i));
+    size_t line_offset;
+    size_t length;
+    index.GetLine(i, &line_offset, &length);
+    ASSERT_EQ(offset, line_offset);
+    offset += length + 1;
+  }
+  ASSERT_EQ("E:the end", GetLine(index, lines - 1));
+  ASSERT_EQ(lines - 1, index.Find("E:", 0, true));
+}
+
+TEST(LineIndexTest, Find) {
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile("I:start\nFILE:x\nE:one\nfoo\nE:two\n",
+                                               temp_file.path));
+  LineIndex index;
+  ASSERT_TRUE(index.Open(temp_file.fd));
+  ASSERT_EQ(1u, index.Find("E:", 0));
+  ASSERT_EQ(2u, index.Find("E:", 0, true));
+  ASSERT_EQ(4u, index.Find("E:", 3, true));
+  ASSERT_EQ(SIZE_MAX, index.Find("E:", 5, true));
+  // Matches don't span lines.
+  ASSERT_EQ(SIZE_MAX, index.Find("one\nfoo", 0));
+  ASSERT_EQ(3u, index.Find("foo", 0));
+}
+
+TEST(LineIndexTest, Unmappable) {
+  // Files in procfs have no size, so they get read instead.
+  android::base::unique_fd fd(open("/proc/self/cmdline", O_RDONLY));
+  ASSERT_NE(-1, fd.get());
+  LineIndex index;
+  ASSERT_TRUE(index.Open(fd.get()));
+  ASSERT_GT(index.size(), 0u);
+  ASSERT_EQ(1u, index.WaitForAll());
+}
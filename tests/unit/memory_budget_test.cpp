@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "otautil/memory_budget.h"
+
+// A budget over a made up amount of memory, which the fake caches give back to.
+class FakeMemoryBudget : public MemoryBudget {
+ public:
+  explicit FakeMemoryBudget(uint64_t reserve) : MemoryBudget(reserve) {}
+
+  // Registers a cache holding |size| bytes, which frees what it's asked for.
+  void AddCache(size_t size) {
+    caches_.push_back(size);
+    size_t index = caches_.size() - 1;
+    Register([this, index](size_t bytes) {
+      size_t freed = std::min(bytes, caches_[index]);
+      caches_[index] -= freed;
+      available_ += freed;
+      return freed;
+    });
+  }
+
+  uint64_t available_ = 0;
+  double pressure_ = 0;
+  std::vector<size_t> caches_;
+
+ protected:
+  uint64_t Available() override {
+    return available_;
+  }
+  double Pressure() override {
+    return pressure_;
+  }
+};
+
+TEST(MemoryBudgetTest, has_room_without_reclaiming) {
+  FakeMemoryBudget budget(100);
+  budget.available_ = 1000;
+  budget.AddCache(500);
+  ASSERT_TRUE(budget.HasRoom(900));
+  ASSERT_EQ(500u, budget.caches_[0]);
+}
+
+TEST(MemoryBudgetTest, reclaims_what_is_missing) {
+  FakeMemoryBudget budget(100);
+  budget.available_ = 300;
+  budget.AddCache(150);
+  budget.AddCache(500);
+  // 200 + 100 is there already, the other 500 come from the caches in order.
+  ASSERT_TRUE(budget.HasRoom(700));
+  ASSERT_EQ(0u, budget.caches_[0]);
+  ASSERT_EQ(150u, budget.caches_[1]);
+
+  // Not enough even with all the caches gone.
+  ASSERT_FALSE(budget.HasRoom(2000));
+  ASSERT_EQ(0u, budget.caches_[1]);
+}
+
+TEST(MemoryBudgetTest, reclaims_under_pressure) {
+  FakeMemoryBudget budget(100);
+  budget.available_ = 10000;
+  budget.pressure_ = MemoryBudget::kPressureThreshold;
+  budget.AddCache(500);
+  ASSERT_TRUE(budget.HasRoom(200));
+  ASSERT_EQ(300u, budget.caches_[0]);
+}
+
+TEST(MemoryBudgetTest, acquire_accounts) {
+  FakeMemoryBudget budget(0);
+  budget.available_ = 100;
+  ASSERT_TRUE(budget.Acquire(60));
+  // The allocation may go ahead anyway; it's still accounted for.
+  ASSERT_FALSE(budget.Acquire(200));
+  ASSERT_EQ(260u, budget.acquired());
+  budget.Release(200);
+  ASSERT_EQ(60u, budget.acquired());
+  ASSERT_EQ(260u, budget.peak());
+  budget.Release(100);
+  ASSERT_EQ(0u, budget.acquired());
+}
+
+TEST(MemoryBudgetTest, unregistered_cache_is_left_alone) {
+  FakeMemoryBudget budget(0);
+  int id = budget.Register([](size_t) -> size_t {
+    ADD_FAILURE() << "reclaimed from an unregistered cache";
+    return 0;
+  });
+  budget.Unregister(id);
+  ASSERT_FALSE(budget.HasRoom(100));
+}
+
+TEST(MemoryBudgetTest, cache_limit) {
+  FakeMemoryBudget budget(100);
+  budget.available_ = 1000;
+  ASSERT_EQ(1100u, budget.CacheLimit(200));
+  ASSERT_EQ(1050u, budget.CacheLimit(200, 50));
+  budget.available_ = 10;
+  ASSERT_EQ(0u, budget.CacheLimit(50));
+
+  budget.available_ = 1000;
+  budget.pressure_ = MemoryBudget::kPressureThreshold;
+  ASSERT_EQ(100u, budget.CacheLimit(200));
+}
+
+TEST(MemoryBudgetTest, system_memory) {
+  ASSERT_GT(MemoryBudget::AvailableMemory(), 0u);
+  ASSERT_GE(MemoryBudget::MemoryPressure(), 0);
+}
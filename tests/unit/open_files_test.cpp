@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <limits.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/test_utils.h>
+#include <gtest/gtest.h>
+
+#include "otautil/open_files.h"
+
+using namespace std::chrono_literals;
+
+static bool HasEntry(const OpenFiles& files, OpenFiles::Kind kind, const std::string& path) {
+  for (const auto& entry : files.entries()) {
+    if (entry.pid == getpid() && entry.kind == kind && entry.path == path) {
+      return true;
+    }
+  }
+  return false;
+}
+
+TEST(OpenFilesTest, finds_own_files) {
+  TemporaryFile temp_file;
+  char real_path[PATH_MAX];
+  ASSERT_NE(nullptr, realpath(temp_file.path, real_path));
+
+  OpenFiles files;
+  ASSERT_TRUE(files.Scan(false));
+  ASSERT_FALSE(files.with_maps());
+  ASSERT_TRUE(HasEntry(files, OpenFiles::Kind::kFd, real_path));
+
+  char cwd[PATH_MAX];
+  ASSERT_NE(nullptr, getcwd(cwd, sizeof(cwd)));
+  ASSERT_TRUE(HasEntry(files, OpenFiles::Kind::kCwd, cwd));
+
+  std::string exe;
+  ASSERT_TRUE(android::base::Readlink("/proc/self/exe", &exe));
+  ASSERT_TRUE(HasEntry(files, OpenFiles::Kind::kExe, exe));
+  ASSERT_FALSE(HasEntry(files, OpenFiles::Kind::kMap, exe));
+
+  // The test binary is mapped in, but only listed once.
+  ASSERT_TRUE(files.Scan(true));
+  size_t maps = 0;
+  for (const auto& entry : files.entries()) {
+    if (entry.pid == getpid() && entry.kind == OpenFiles::Kind::kMap && entry.path == exe) {
+      maps++;
+    }
+  }
+  ASSERT_EQ(1u, maps);
+}
+
+TEST(OpenFilesTest, get_reuses_recent_snapshot) {
+  OpenFiles::Invalidate();
+  std::shared_ptr<const OpenFiles> first = OpenFiles::Get(1h, false);
+  ASSERT_NE(nullptr, first);
+  ASSERT_EQ(first, OpenFiles::Get(1h, false));
+
+  // A snapshot without the maps doesn't do for a caller that wants them.
+  std::shared_ptr<const OpenFiles> with_maps = OpenFiles::Get(1h, true);
+  ASSERT_NE(first, with_maps);
+  ASSERT_TRUE(with_maps->with_maps());
+  ASSERT_EQ(with_maps, OpenFiles::Get(1h, false));
+
+  ASSERT_NE(with_maps, OpenFiles::Get(0ms, true));
+
+  std::shared_ptr<const OpenFiles> last = OpenFiles::Get(1h, true);
+  OpenFiles::Invalidate();
+  ASSERT_NE(last, OpenFiles::Get(1h, true));
+}
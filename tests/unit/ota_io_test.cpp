@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/test_utils.h>
+#include <gtest/gtest.h>
+
+#include "otafault/ota_io.h"
+
+static const OtaIoFileStats* FindStats(const std::vector<OtaIoFileStats>& stats,
+                                       const std::string& path) {
+  for (const auto& file : stats) {
+    if (file.path == path) {
+      return &file;
+    }
+  }
+  return nullptr;
+}
+
+TEST(OtaIoTest, stats) {
+  ota_io_enable_stats();
+
+  TemporaryFile temp_file;
+  std::string data(4096, 'a');
+  {
+    // The counters outlive both the fd and the caller's copy of the path.
+    std::string path = temp_file.path;
+    unique_fd fd(ota_open(path.c_str(), O_RDWR));
+    ASSERT_NE(-1, fd);
+    path.clear();
+    for (size_t i = 0; i < 4; ++i) {
+      ASSERT_EQ(static_cast<ssize_t>(data.size()), ota_write(fd, data.data(), data.size()));
+    }
+    ASSERT_EQ(0, ota_fsync(fd));
+    ASSERT_EQ(10, ota_pread(fd, &data[0], 10, 0));
+  }
+
+  std::vector<OtaIoFileStats> stats = ota_io_stats();
+  const OtaIoFileStats* file = FindStats(stats, temp_file.path);
+  ASSERT_NE(nullptr, file);
+  const OtaIoOpStats& writes = file->ops[OTAIO_OP_WRITE];
+  ASSERT_EQ(4U, writes.calls);
+  ASSERT_EQ(4U * data.size(), writes.bytes);
+  uint64_t latencies = 0;
+  for (uint64_t count : writes.latency_us) {
+    latencies += count;
+  }
+  ASSERT_EQ(4U, latencies);
+  ASSERT_LE(writes.LatencyPercentileUs(50), writes.LatencyPercentileUs(99));
+
+  ASSERT_EQ(1U, file->ops[OTAIO_OP_FSYNC].calls);
+  ASSERT_EQ(1U, file->ops[OTAIO_OP_READ].calls);
+  ASSERT_EQ(10U, file->ops[OTAIO_OP_READ].bytes);
+
+  // An fd that wasn't opened through ota_open() shows up as untracked.
+  android::base::unique_fd other(open(temp_file.path, O_RDONLY));
+  ASSERT_NE(-1, other);
+  ASSERT_EQ(10, ota_read(other, &data[0], 10));
+  stats = ota_io_stats();
+  const OtaIoFileStats* untracked = FindStats(stats, "(untracked)");
+  ASSERT_NE(nullptr, untracked);
+  ASSERT_LE(1U, untracked->ops[OTAIO_OP_READ].calls);
+}
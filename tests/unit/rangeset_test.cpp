@@ -15,9 +15,11 @@
  */
 
 #include <signal.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 #include <limits>
+#include <string>
 #include <vector>
 
 #include <gtest/gtest.h>
@@ -47,7 +49,7 @@ TEST(RangeSetTest, Parse_smoke) {
   ASSERT_EQ((Range{ 1, 10 }), rs2[1]);
   ASSERT_EQ(static_cast<size_t>(14), rs2.blocks());
 
-  // Leading zeros are fine. But android::base::ParseUint() doesn't like trailing zeros like "10 ".
+  // Leading spaces are fine, but not trailing ones like "10 ".
   ASSERT_EQ(rs, RangeSet::Parse(" 2, 1,   10"));
   ASSERT_FALSE(RangeSet::Parse("2,1,10 "));
 }
@@ -72,6 +74,19 @@ TEST(RangeSetTest, Parse_InvalidCases) {
   ASSERT_FALSE(RangeSet::Parse("2,2,1"));
 }
 
+TEST(RangeSetTest, Parse_buffer) {
+  // Parses only the given length, e.g. a token within a transfer list line.
+  const std::string line = "move 2,1,10 4,15,20,1,10";
+  ASSERT_EQ(RangeSet::Parse("2,1,10"), RangeSet::Parse(line.data() + 5, 6));
+  ASSERT_EQ(RangeSet::Parse("4,15,20,1,10"), RangeSet::Parse(line.data() + 12, 12));
+  ASSERT_FALSE(RangeSet::Parse(line.data() + 5, 5));
+  ASSERT_FALSE(RangeSet::Parse(line.data(), 0));
+
+  // Each value is limited to INT_MAX.
+  ASSERT_TRUE(RangeSet::Parse("2,0,2147483647"));
+  ASSERT_FALSE(RangeSet::Parse("2,0,2147483648"));
+}
+
 TEST(RangeSetTest, Clear) {
   RangeSet rs = RangeSet::Parse("2,1,6");
   ASSERT_TRUE(rs);
@@ -123,6 +138,24 @@ TEST(RangeSetTest, Overlaps) {
   ASSERT_FALSE(RangeSet::Parse("2,5,7").Overlaps(RangeSet::Parse("2,3,5")));
 }
 
+TEST(RangeSetTest, Overlaps_LargeSets) {
+  // Unsorted sets that are large enough to be swept instead of compared pairwise.
+  std::vector<Range> even;
+  std::vector<Range> odd;
+  for (size_t i = 20; i-- > 0;) {
+    even.emplace_back(i * 20, i * 20 + 10);
+    odd.emplace_back(i * 20 + 10, i * 20 + 20);
+  }
+  RangeSet r1(std::move(even));
+  RangeSet r2(std::move(odd));
+  ASSERT_FALSE(r1.Overlaps(r2));
+  ASSERT_FALSE(r2.Overlaps(r1));
+
+  r2.PushBack({ 385, 386 });
+  ASSERT_TRUE(r1.Overlaps(r2));
+  ASSERT_TRUE(r2.Overlaps(r1));
+}
+
 TEST(RangeSetTest, Split) {
   RangeSet rs1 = RangeSet::Parse("2,1,2");
   ASSERT_TRUE(rs1);
@@ -240,6 +273,29 @@ TEST(RangeSetTest, iterators) {
   ASSERT_EQ((std::vector<Range>{ Range{ 8, 10 }, Range{ 1, 5 } }), ranges);
 }
 
+TEST(RangeSetTest, wide_block_numbers) {
+  if (sizeof(size_t) < sizeof(uint64_t)) {
+    GTEST_LOG_(INFO) << "Test skipped on 32-bit size_t.";
+    return;
+  }
+  // The block numbers that don't fit in 32 bits switch the whole RangeSet to 64-bit ones.
+  const size_t big = static_cast<size_t>(UINT32_MAX) + 10;
+  RangeSet rs = RangeSet::Parse("4,1,5,8,10");
+  ASSERT_TRUE(rs.PushBack({ big, big + 2 }));
+  ASSERT_EQ(static_cast<size_t>(3), rs.size());
+  ASSERT_EQ(static_cast<size_t>(8), rs.blocks());
+  ASSERT_EQ((std::vector<Range>{ Range{ 1, 5 }, Range{ 8, 10 }, Range{ big, big + 2 } }),
+            std::vector<Range>(rs.cbegin(), rs.cend()));
+  ASSERT_EQ(big + 1, rs.GetBlockNumber(7));
+  ASSERT_EQ(RangeSet(std::vector<Range>{ Range{ 1, 5 }, Range{ 8, 10 }, Range{ big, big + 2 } }),
+            rs);
+  ASSERT_TRUE(rs.Overlaps(RangeSet(std::vector<Range>{ Range{ big + 1, big + 5 } })));
+
+  rs.Clear();
+  ASSERT_TRUE(rs.PushBack({ 1, 5 }));
+  ASSERT_EQ(RangeSet::Parse("2,1,5"), rs);
+}
+
 TEST(RangeSetTest, ToString) {
   ASSERT_EQ("", RangeSet::Parse("").ToString());
   ASSERT_EQ("2,1,6", RangeSet::Parse("2,1,6").ToString());
@@ -287,3 +343,40 @@ TEST(SortedRangeSetTest, file_range) {
   // block#10 not in range.
   ASSERT_EXIT(rs.GetOffsetInRangeSet(40970), ::testing::KilledBySignal(SIGABRT), "");
 }
+
+TEST(RangeIndexTest, InsertRemove) {
+  RangeIndex index;
+  ASSERT_TRUE(index.empty());
+  ASSERT_FALSE(index.Overlaps(RangeSet::Parse("2,0,100")));
+
+  index.Insert(RangeSet::Parse("4,10,20,30,40"));
+  index.Insert(RangeSet::Parse("2,15,35"));
+  ASSERT_EQ(30U, index.blocks());
+  ASSERT_TRUE(index.Overlaps(RangeSet::Parse("2,39,50")));
+  ASSERT_FALSE(index.Overlaps(RangeSet::Parse("4,0,10,40,50")));
+  ASSERT_TRUE(index.Contains(RangeSet::Parse("2,10,40")));
+  ASSERT_FALSE(index.Contains(RangeSet::Parse("2,9,40")));
+
+  // The blocks shared with the other set stay indexed.
+  index.Remove(RangeSet::Parse("2,15,35"));
+  ASSERT_EQ(20U, index.blocks());
+  ASSERT_FALSE(index.Overlaps(RangeSet::Parse("2,20,30")));
+  ASSERT_TRUE(index.Contains(RangeSet::Parse("4,30,40,10,20")));
+  ASSERT_FALSE(index.Contains(RangeSet::Parse("2,10,40")));
+
+  index.Remove(RangeSet::Parse("4,10,20,30,40"));
+  ASSERT_TRUE(index.empty());
+  ASSERT_EQ(0U, index.blocks());
+}
+
+TEST(RangeIndexTest, Intersect) {
+  RangeIndex index;
+  index.Insert(RangeSet::Parse("4,10,20,30,40"));
+  index.Insert(RangeSet::Parse("2,20,25"));
+  ASSERT_EQ(RangeSet::Parse("4,15,25,30,32"), index.Intersect(RangeSet::Parse("4,30,32,15,27")));
+  ASSERT_FALSE(index.Intersect(RangeSet::Parse("2,0,10")));
+
+  index.Clear();
+  ASSERT_TRUE(index.empty());
+  ASSERT_FALSE(index.Intersect(RangeSet::Parse("2,0,100")));
+}
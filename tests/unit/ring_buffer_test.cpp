@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "otautil/ring_buffer.h"
+
+TEST(RingBufferTest, ReadWrite) {
+  RingBuffer ring(16);
+  std::string data = "0123456789";
+  ASSERT_TRUE(ring.Write(reinterpret_cast<const uint8_t*>(data.data()), data.size()));
+
+  // Partial reads.
+  std::vector<uint8_t> buffer(16);
+  ASSERT_EQ(4U, ring.Read(buffer.data(), 4));
+  ASSERT_EQ("0123", std::string(buffer.begin(), buffer.begin() + 4));
+  ASSERT_EQ(6U, ring.Read(buffer.data(), buffer.size()));
+  ASSERT_EQ("456789", std::string(buffer.begin(), buffer.begin() + 6));
+
+  // Wrap around the end of the buffer.
+  ASSERT_TRUE(ring.Write(reinterpret_cast<const uint8_t*>(data.data()), data.size()));
+  ASSERT_EQ(10U, ring.Read(buffer.data(), buffer.size()));
+  ASSERT_EQ(data, std::string(buffer.begin(), buffer.begin() + 10));
+}
+
+TEST(RingBufferTest, CloseWrite) {
+  RingBuffer ring(16);
+  std::string data = "abc";
+  ASSERT_TRUE(ring.Write(reinterpret_cast<const uint8_t*>(data.data()), data.size()));
+  ring.CloseWrite();
+
+  // Pending data can still be consumed after the writer is closed.
+  std::vector<uint8_t> buffer(16);
+  ASSERT_EQ(3U, ring.Read(buffer.data(), buffer.size()));
+  ASSERT_EQ(0U, ring.Read(buffer.data(), buffer.size()));
+}
+
+TEST(RingBufferTest, CloseReadUnblocksWriter) {
+  RingBuffer ring(4);
+  std::thread reader([&ring]() {
+    uint8_t byte;
+    ASSERT_EQ(1U, ring.Read(&byte, 1));
+    ring.CloseRead();
+  });
+
+  // The writer blocks on the full buffer, until the reader goes away.
+  std::vector<uint8_t> data(64, 'a');
+  ASSERT_FALSE(ring.Write(data.data(), data.size()));
+  reader.join();
+}
+
+TEST(RingBufferTest, ConcurrentTransfer) {
+  RingBuffer ring(37);
+  std::vector<uint8_t> data(1024 * 1024);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<uint8_t>(i * 7 + i / 251);
+  }
+
+  std::thread writer([&ring, &data]() {
+    // Write with a chunk size that's not aligned to the buffer capacity.
+    for (size_t pos = 0; pos < data.size(); pos += 100) {
+      ASSERT_TRUE(ring.Write(data.data() + pos, std::min<size_t>(100, data.size() - pos)));
+    }
+    ring.CloseWrite();
+  });
+
+  std::vector<uint8_t> received;
+  uint8_t buffer[29];
+  size_t count;
+  while ((count = ring.Read(buffer, sizeof(buffer))) > 0) {
+    received.insert(received.end(), buffer, buffer + count);
+  }
+  writer.join();
+  ASSERT_EQ(data, received);
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "minui/minui.h"
+
+using SurfacePtr = std::unique_ptr<GRSurface, decltype(&res_free_surface)>;
+
+// A display surface whose channel c of pixel (x, y) is x * 16 + c.
+static SurfacePtr CreateGradient(int width, int height) {
+  GRSurface* surface = static_cast<GRSurface*>(malloc(sizeof(GRSurface) + width * height * 4));
+  surface->width = width;
+  surface->height = height;
+  surface->row_bytes = width * 4;
+  surface->pixel_bytes = 4;
+  surface->data = reinterpret_cast<unsigned char*>(surface + 1);
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      for (int c = 0; c < 4; ++c) {
+        surface->data[y * surface->row_bytes + x * 4 + c] = x * 16 + c;
+      }
+    }
+  }
+  return SurfacePtr(surface, res_free_surface);
+}
+
+TEST(ScaledSurfaceTest, bilinear) {
+  SurfacePtr src = CreateGradient(9, 5);
+  GRSurface* dst;
+  ASSERT_EQ(0, res_create_scaled_surface(&dst, src.get(), 2.0f, 3.0f));
+  SurfacePtr scaled(dst, res_free_surface);
+  ASSERT_EQ(18, scaled->width);
+  ASSERT_EQ(15, scaled->height);
+
+  // Pixel x samples the source at x / 18 * 8, and the rows are all alike.
+  for (int y = 0; y < scaled->height; ++y) {
+    for (int x = 0; x < scaled->width; ++x) {
+      for (int c = 0; c < 4; ++c) {
+        int expected = x * 8 * 16 / 18 + c;
+        int actual = scaled->data[y * scaled->row_bytes + x * 4 + c];
+        ASSERT_NEAR(expected, actual, 1) << "at (" << x << ", " << y << "), channel " << c;
+      }
+    }
+  }
+}
+
+TEST(ScaledSurfaceTest, repeated) {
+  SurfacePtr src = CreateGradient(33, 17);
+  GRSurface* first;
+  ASSERT_EQ(0, res_create_scaled_surface(&first, src.get(), 0.5f, 0.5f));
+  SurfacePtr first_ptr(first, res_free_surface);
+
+  // Scaling the same pixels again gives a surface of its own, with the same content.
+  SurfacePtr copy = CreateGradient(33, 17);
+  GRSurface* second;
+  ASSERT_EQ(0, res_create_scaled_surface(&second, copy.get(), 0.5f, 0.5f));
+  SurfacePtr second_ptr(second, res_free_surface);
+  ASSERT_NE(first, second);
+  ASSERT_EQ(first->width, second->width);
+  ASSERT_EQ(first->height, second->height);
+  ASSERT_EQ(std::vector<uint8_t>(first->data, first->data + first->row_bytes * first->height),
+            std::vector<uint8_t>(second->data, second->data + second->row_bytes * second->height));
+
+  // But not for other pixels.
+  copy->data[0] ^= 0xff;
+  GRSurface* third;
+  ASSERT_EQ(0, res_create_scaled_surface(&third, copy.get(), 0.5f, 0.5f));
+  SurfacePtr third_ptr(third, res_free_surface);
+  ASSERT_NE(first->data[0], third->data[0]);
+}
+
+TEST(ScaledSurfaceTest, empty) {
+  SurfacePtr src = CreateGradient(4, 4);
+  GRSurface* dst;
+  ASSERT_EQ(-8, res_create_scaled_surface(&dst, src.get(), 0.1f, 1.0f));
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "otautil/sensor_service.h"
+
+using namespace std::chrono_literals;
+
+TEST(SensorServiceTest, defaults_before_start) {
+  SensorService service;
+  ASSERT_FALSE(service.running());
+  BatteryReading battery = service.battery();
+  ASSERT_TRUE(battery.charged);
+  ASSERT_EQ(100, battery.capacity);
+  ASSERT_FALSE(battery.capacity_valid);
+  ASSERT_EQ(-1, service.peak_temperature());
+}
+
+TEST(SensorServiceTest, publishes_readings) {
+  std::atomic<int> capacity(42);
+  std::atomic<int> temperature(30000);
+  SensorService service;
+  service.Start(
+      [&capacity]() {
+        BatteryReading reading;
+        reading.charged = false;
+        reading.capacity = capacity.load();
+        reading.capacity_valid = true;
+        return reading;
+      },
+      5ms, 5ms, [&temperature]() { return temperature.load(); });
+  ASSERT_TRUE(service.running());
+
+  uint64_t seq = service.WaitForBatteryReading(0, 10s);
+  ASSERT_GT(seq, 0u);
+  BatteryReading battery = service.battery();
+  ASSERT_FALSE(battery.charged);
+  ASSERT_EQ(42, battery.capacity);
+  ASSERT_TRUE(battery.capacity_valid);
+
+  // A later reading shows up with a newer sequence number.
+  capacity.store(43);
+  uint64_t next = service.WaitForBatteryReading(seq, 10s);
+  ASSERT_GT(next, seq);
+  next = service.WaitForBatteryReading(next, 10s);
+  ASSERT_EQ(43, service.battery().capacity);
+
+  // The peak survives the temperature going down.
+  temperature.store(45000);
+  while (service.temperature() != 45000) {
+    std::this_thread::sleep_for(1ms);
+  }
+  temperature.store(35000);
+  while (service.temperature() != 35000) {
+    std::this_thread::sleep_for(1ms);
+  }
+  ASSERT_EQ(45000, service.peak_temperature());
+  service.ResetPeakTemperature();
+  ASSERT_EQ(35000, service.peak_temperature());
+
+  service.Stop();
+  ASSERT_FALSE(service.running());
+}
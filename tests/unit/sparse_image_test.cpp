@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/test_utils.h>
+#include <gtest/gtest.h>
+
+#include "otautil/sparse_image.h"
+
+static constexpr uint32_t kBlockSize = 4096;
+
+// Builds a sparse image of |total_blks| blocks out of the chunks added to it.
+class SparseImageBuilder {
+ public:
+  explicit SparseImageBuilder(uint32_t total_blks) {
+    header_.magic = kSparseHeaderMagic;
+    header_.major_version = 1;
+    header_.file_hdr_sz = sizeof(SparseHeader);
+    header_.chunk_hdr_sz = sizeof(SparseChunkHeader);
+    header_.blk_sz = kBlockSize;
+    header_.total_blks = total_blks;
+  }
+
+  void AddChunk(uint16_t type, uint32_t blocks, const std::string& payload) {
+    SparseChunkHeader chunk = {};
+    chunk.chunk_type = type;
+    chunk.chunk_sz = blocks;
+    chunk.total_sz = sizeof(chunk) + payload.size();
+    chunks_.append(reinterpret_cast<const char*>(&chunk), sizeof(chunk));
+    chunks_.append(payload);
+    header_.total_chunks++;
+  }
+
+  void AddFill(uint32_t blocks, uint32_t pattern) {
+    AddChunk(kSparseChunkFill, blocks, std::string(reinterpret_cast<const char*>(&pattern), 4));
+  }
+
+  std::string Build() const {
+    return std::string(reinterpret_cast<const char*>(&header_), sizeof(header_)) + chunks_;
+  }
+
+ private:
+  SparseHeader header_ = {};
+  std::string chunks_;
+};
+
+static const uint8_t* Bytes(const std::string& s) {
+  return reinterpret_cast<const uint8_t*>(s.data());
+}
+
+static std::string Repeat(const std::string& pattern, size_t len) {
+  std::string result;
+  while (result.size() < len) {
+    result += pattern;
+  }
+  return result;
+}
+
+TEST(SparseImageTest, IsSparseImage) {
+  SparseImageBuilder builder(1);
+  std::string image = builder.Build();
+  ASSERT_TRUE(IsSparseImage(Bytes(image), image.size()));
+  ASSERT_FALSE(IsSparseImage(Bytes(image), image.size() - 1));
+
+  std::string raw(kBlockSize, 'a');
+  ASSERT_FALSE(IsSparseImage(Bytes(raw), raw.size()));
+
+  // A major version we don't know.
+  image[4] = 2;
+  ASSERT_FALSE(IsSparseImage(Bytes(image), image.size()));
+}
+
+TEST(SparseImageTest, expands_all_the_chunk_types) {
+  std::string raw1(kBlockSize * 2, 'r');
+  std::string raw2(kBlockSize, 's');
+  SparseImageBuilder builder(9);
+  builder.AddChunk(kSparseChunkRaw, 2, raw1);
+  builder.AddFill(3, 0x64636261);
+  builder.AddChunk(kSparseChunkDontCare, 1, "");
+  builder.AddChunk(kSparseChunkCrc32, 0, "crc!");
+  builder.AddChunk(kSparseChunkRaw, 1, raw2);
+  builder.AddChunk(kSparseChunkDontCare, 2, "");
+  std::string image = builder.Build();
+
+  TemporaryFile temp_file;
+  std::string previous(kBlockSize * 6, 'x');
+  ASSERT_TRUE(android::base::WriteStringToFile(previous, temp_file.path));
+
+  // In pieces that don't line up with the chunks.
+  SparseImageStream stream(temp_file.fd, SparseImageStream::Mode::kWrite);
+  for (size_t p = 0; p < image.size(); p += 1000) {
+    ASSERT_TRUE(stream.Write(Bytes(image) + p, std::min<size_t>(1000, image.size() - p)));
+  }
+  ASSERT_TRUE(stream.Finish());
+  ASSERT_EQ(9u * kBlockSize, stream.size());
+  ASSERT_EQ(6u * kBlockSize, stream.bytes_written());
+  ASSERT_EQ(0u, stream.bytes_zeroed());
+
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file.path, &content));
+  std::string expected = raw1 + Repeat("abcd", kBlockSize * 3) + std::string(kBlockSize, 'x') +
+                         raw2 + std::string(kBlockSize * 2, '\0');
+  ASSERT_EQ(expected, content);
+
+  SparseImageStream verify(temp_file.fd, SparseImageStream::Mode::kVerify);
+  ASSERT_TRUE(verify.Write(Bytes(image), image.size()));
+  ASSERT_TRUE(verify.Finish());
+}
+
+TEST(SparseImageTest, verify_detects_mismatches) {
+  SparseImageBuilder builder(2);
+  builder.AddChunk(kSparseChunkRaw, 1, std::string(kBlockSize, 'r'));
+  builder.AddFill(1, 0);
+  std::string image = builder.Build();
+
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      std::string(kBlockSize, 'r') + std::string(kBlockSize - 1, '\0') + "z", temp_file.path));
+  SparseImageStream verify(temp_file.fd, SparseImageStream::Mode::kVerify);
+  ASSERT_FALSE(verify.Write(Bytes(image), image.size()));
+
+  // Nothing gets past the first error.
+  ASSERT_FALSE(verify.Write(Bytes(image), 1));
+  ASSERT_FALSE(verify.Finish());
+}
+
+TEST(SparseImageTest, rejects_malformed_images) {
+  TemporaryFile temp_file;
+
+  // A RAW chunk with less data than the blocks it covers.
+  SparseImageBuilder short_raw(1);
+  short_raw.AddChunk(kSparseChunkRaw, 1, std::string(kBlockSize - 1, 'r'));
+  std::string image = short_raw.Build();
+  SparseImageStream stream1(temp_file.fd, SparseImageStream::Mode::kWrite);
+  ASSERT_FALSE(stream1.Write(Bytes(image), image.size()));
+
+  // More blocks than the header says.
+  SparseImageBuilder too_long(1);
+  too_long.AddChunk(kSparseChunkDontCare, 2, "");
+  image = too_long.Build();
+  SparseImageStream stream2(temp_file.fd, SparseImageStream::Mode::kWrite);
+  ASSERT_FALSE(stream2.Write(Bytes(image), image.size()));
+
+  // An unknown chunk type.
+  SparseImageBuilder unknown(1);
+  unknown.AddChunk(0xcac5, 1, "");
+  image = unknown.Build();
+  SparseImageStream stream3(temp_file.fd, SparseImageStream::Mode::kWrite);
+  ASSERT_FALSE(stream3.Write(Bytes(image), image.size()));
+
+  // Cut short, or followed by trailing data.
+  SparseImageBuilder fill(2);
+  fill.AddFill(2, 0x01010101);
+  image = fill.Build();
+  SparseImageStream stream4(temp_file.fd, SparseImageStream::Mode::kWrite);
+  ASSERT_TRUE(stream4.Write(Bytes(image), image.size() - 1));
+  ASSERT_FALSE(stream4.Finish());
+  SparseImageStream stream5(temp_file.fd, SparseImageStream::Mode::kWrite);
+  ASSERT_FALSE(stream5.Write(Bytes(image + "x"), image.size() + 1));
+
+  // Fewer blocks than the header says.
+  SparseImageBuilder too_short(3);
+  too_short.AddFill(2, 0);
+  image = too_short.Build();
+  SparseImageStream stream6(temp_file.fd, SparseImageStream::Mode::kWrite);
+  ASSERT_TRUE(stream6.Write(Bytes(image), image.size()));
+  ASSERT_FALSE(stream6.Finish());
+}
@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <stddef.h>
+
 #include <gtest/gtest.h>
 
 #include <string>
@@ -43,6 +45,23 @@ TEST(SysUtilTest, MapFileRegularFile) {
   ASSERT_EQ(1U, mapping.ranges());
 }
 
+TEST(SysUtilTest, MapFilePopulateAndAdvise) {
+  TemporaryFile temp_file;
+  std::string content(4096 * 3 + 100, 'x');
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+
+  MemMapping mapping;
+  ASSERT_TRUE(mapping.MapFile(temp_file.path, true));
+  ASSERT_EQ(content.size(), mapping.length);
+  ASSERT_EQ(content, std::string(reinterpret_cast<const char*>(mapping.addr), mapping.length));
+
+  ASSERT_TRUE(mapping.Advise(MemAccess::SEQUENTIAL));
+  ASSERT_TRUE(mapping.Advise(MemAccess::WILLNEED, 5000, 100));
+  ASSERT_TRUE(mapping.Advise(MemAccess::RANDOM, 4096 * 3, SIZE_MAX));
+  // Past the end of the mapped data.
+  ASSERT_TRUE(mapping.Advise(MemAccess::NORMAL, content.size(), 1));
+}
+
 TEST(SysUtilTest, MapFileBlockMap) {
   // Create a file that has 10 blocks.
   TemporaryFile package;
@@ -88,6 +107,71 @@ TEST(SysUtilTest, MapFileBlockMap) {
   ASSERT_EQ(3U, mapping.ranges());
 }
 
+TEST(SysUtilTest, MapFileBinaryBlockMap) {
+  TemporaryFile package;
+  constexpr size_t file_size = 4096 * 10;
+  std::string content(file_size, 'x');
+  ASSERT_TRUE(android::base::WriteStringToFile(content, package.path));
+
+  TemporaryFile block_map_file;
+  std::string filename = std::string("@") + block_map_file.path;
+  MemMapping mapping;
+
+  std::string block_map_content =
+      BinaryBlockMap(package.path, file_size - 100, 4096, { 0, 3, 3, 5, 5, 10 });
+  ASSERT_EQ(0U, block_map_content.size() % 8);
+  ASSERT_TRUE(android::base::WriteStringToFile(block_map_content, block_map_file.path));
+  ASSERT_TRUE(mapping.MapFile(filename));
+  ASSERT_EQ(file_size - 100, mapping.length);
+  ASSERT_EQ(3U, mapping.ranges());
+  ASSERT_EQ(content.substr(0, file_size - 100),
+            std::string(reinterpret_cast<const char*>(mapping.addr), mapping.length));
+
+  // Truncated ranges.
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      block_map_content.substr(0, block_map_content.size() - 8), block_map_file.path));
+  ASSERT_FALSE(mapping.MapFile(filename));
+
+  // The ranges don't add up to the file size.
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      BinaryBlockMap(package.path, file_size, 4096, { 0, 3, 5, 10 }), block_map_file.path));
+  ASSERT_FALSE(mapping.MapFile(filename));
+
+  // Unknown version.
+  block_map_content[offsetof(BlockMapHeader, version)] = 2;
+  ASSERT_TRUE(android::base::WriteStringToFile(block_map_content, block_map_file.path));
+  ASSERT_FALSE(mapping.MapFile(filename));
+}
+
+TEST(SysUtilTest, MapFileLazyBlockMap) {
+  // 40 blocks, with distinct content in every block.
+  TemporaryFile package;
+  constexpr size_t file_size = 4096 * 40;
+  std::string content(file_size, '\0');
+  for (size_t i = 0; i < file_size; i++) {
+    content[i] = static_cast<char>(i / 4096 * 7 + i % 251);
+  }
+  ASSERT_TRUE(android::base::WriteStringToFile(content, package.path));
+
+  // Map the blocks out of order: [20, 40) first, then [0, 20).
+  TemporaryFile block_map_file;
+  std::string block_map_content = std::string(package.path) + "\n163000 4096\n2\n20 40\n0 20\n";
+  ASSERT_TRUE(android::base::WriteStringToFile(block_map_content, block_map_file.path));
+
+  SetLazyBlockMapThreshold(1);
+  {
+    MemMapping mapping;
+    ASSERT_TRUE(mapping.MapFile(std::string("@") + block_map_file.path));
+    ASSERT_EQ(163000U, mapping.length);
+    std::string expected =
+        (content.substr(4096 * 20) + content.substr(0, 4096 * 20)).substr(0, 163000);
+    // Touch a page in the middle first.
+    ASSERT_EQ(expected[4096 * 25 + 3], static_cast<char>(mapping.addr[4096 * 25 + 3]));
+    ASSERT_EQ(expected, std::string(reinterpret_cast<const char*>(mapping.addr), mapping.length));
+  }
+  SetLazyBlockMapThreshold(SIZE_MAX);
+}
+
 TEST(SysUtilTest, MapFileBlockMapInvalidBlockMap) {
   MemMapping mapping;
   TemporaryFile temp_file;
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <chrono>
+
+#include <gtest/gtest.h>
+
+#include "otautil/ThermalUtil.h"
+
+TEST(ThermalGovernorTest, Update) {
+  ThermalGovernor governor(50000, 5000, std::chrono::hours(1));
+  ASSERT_EQ(1.0, governor.level());
+
+  // Backs off by half on each hot reading, down to a floor.
+  governor.Update(50000);
+  ASSERT_EQ(0.5, governor.level());
+  governor.Update(60000);
+  ASSERT_EQ(0.25, governor.level());
+  for (int i = 0; i < 10; i++) {
+    governor.Update(70000);
+  }
+  ASSERT_LT(0.0, governor.level());
+  ASSERT_GT(0.25, governor.level());
+
+  // Holds within the hysteresis band, and without sensors.
+  double level = governor.level();
+  governor.Update(46000);
+  ASSERT_EQ(level, governor.level());
+  governor.Update(-1);
+  ASSERT_EQ(level, governor.level());
+
+  // Recovers a quarter at a time once it's cool enough.
+  governor.Update(44000);
+  ASSERT_EQ(level + 0.25, governor.level());
+  for (int i = 0; i < 4; i++) {
+    governor.Update(30000);
+  }
+  ASSERT_EQ(1.0, governor.level());
+}
+
+TEST(ThermalGovernorTest, Limit) {
+  ThermalGovernor governor(50000, 5000, std::chrono::hours(1));
+  // The first call samples the sensors, which may or may not exist on the host.
+  size_t limit = governor.Limit(8);
+  ASSERT_LE(1U, limit);
+  ASSERT_GE(8U, limit);
+
+  // No new sample within the interval.
+  governor.Update(50000);
+  governor.Update(50000);
+  governor.Update(50000);
+  ASSERT_EQ(std::max<size_t>(1, static_cast<size_t>(8 * governor.level() + 0.5)),
+            governor.Limit(8));
+  ASSERT_EQ(1U, governor.Limit(1));
+}
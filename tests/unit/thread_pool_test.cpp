@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "otautil/thread_pool.h"
+
+using namespace std::chrono_literals;
+
+TEST(ThreadPoolTest, runs_all_tasks) {
+  ThreadPool pool(4);
+  ASSERT_EQ(4u, pool.size());
+  std::atomic<int> sum(0);
+  for (int i = 1; i <= 1000; i++) {
+    ASSERT_TRUE(pool.Submit([&sum, i]() { sum += i; }));
+  }
+  pool.Wait();
+  ASSERT_EQ(500500, sum.load());
+}
+
+TEST(ThreadPoolTest, async_returns_results) {
+  ThreadPool pool(2);
+  std::vector<std::future<int>> futures;
+  for (int i = 0; i < 100; i++) {
+    futures.push_back(pool.Async([i]() { return i * i; }));
+  }
+  for (int i = 0; i < 100; i++) {
+    ASSERT_EQ(i * i, futures[i].get());
+  }
+}
+
+TEST(ThreadPoolTest, await_on_worker) {
+  // The only worker waits for a task it submitted, which it has to run itself.
+  ThreadPool pool(1);
+  std::future<int> outer = pool.Async([&pool]() {
+    std::future<int> inner = pool.Async([]() { return 42; });
+    return pool.Await(inner) + 1;
+  });
+  ASSERT_EQ(43, pool.Await(outer));
+}
+
+TEST(ThreadPoolTest, higher_priority_runs_first) {
+  ThreadPool pool(1);
+  // Keep the only worker busy while the tasks are queued.
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  pool.Submit([released]() { released.wait(); });
+
+  std::mutex mutex;
+  std::vector<int> order;
+  auto record = [&mutex, &order](int value) {
+    return [&mutex, &order, value]() {
+      std::lock_guard<std::mutex> lock(mutex);
+      order.push_back(value);
+    };
+  };
+  pool.Submit(record(2), ThreadPool::Priority::kLow);
+  pool.Submit(record(1), ThreadPool::Priority::kNormal);
+  pool.Submit(record(0), ThreadPool::Priority::kHigh);
+  release.set_value();
+  pool.Wait();
+  ASSERT_EQ((std::vector<int>{ 0, 1, 2 }), order);
+}
+
+TEST(ThreadPoolTest, bounded_queue) {
+  ThreadPool::Options options;
+  options.threads = 1;
+  options.max_queued = 2;
+  ThreadPool pool(options);
+
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  std::promise<void> started;
+  std::atomic<int> done(0);
+  pool.Submit([&started, released, &done]() {
+    started.set_value();
+    released.wait();
+    done++;
+  });
+  // The worker has taken the first task, so the two next ones fill the queue.
+  started.get_future().wait();
+  pool.Submit([&done]() { done++; });
+  pool.Submit([&done]() { done++; });
+
+  // This one has to wait for room in the queue.
+  std::atomic<bool> submitted(false);
+  std::thread submitter([&]() {
+    pool.Submit([&done]() { done++; });
+    submitted = true;
+  });
+  std::this_thread::sleep_for(50ms);
+  ASSERT_FALSE(submitted);
+  release.set_value();
+  submitter.join();
+  pool.Wait();
+  ASSERT_TRUE(submitted);
+  ASSERT_EQ(4, done.load());
+}
+
+TEST(ThreadPoolTest, nested_tasks_on_full_queue) {
+  ThreadPool::Options options;
+  options.threads = 2;
+  options.max_queued = 1;
+  ThreadPool pool(options);
+  std::atomic<int> count(0);
+  for (int i = 0; i < 8; i++) {
+    pool.Submit([&pool, &count]() {
+      for (int j = 0; j < 8; j++) {
+        pool.Submit([&count]() { count++; });
+      }
+    });
+  }
+  pool.Wait();
+  ASSERT_EQ(64, count.load());
+}
+
+TEST(ThreadPoolTest, cancel_drops_queued_tasks) {
+  ThreadPool pool(1);
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  std::promise<void> started;
+  std::atomic<bool> saw_cancel(false);
+  pool.Submit([&pool, &started, released, &saw_cancel]() {
+    started.set_value();
+    released.wait();
+    saw_cancel = pool.cancelled();
+  });
+  started.get_future().wait();
+
+  std::atomic<int> ran(0);
+  for (int i = 0; i < 10; i++) {
+    pool.Submit([&ran]() { ran++; });
+  }
+  ASSERT_EQ(10u, pool.Cancel());
+  ASSERT_FALSE(pool.Submit([&ran]() { ran++; }));
+  release.set_value();
+  pool.Wait();
+  ASSERT_TRUE(saw_cancel);
+  ASSERT_EQ(0, ran.load());
+}
+
+TEST(ThreadPoolTest, parallel_for) {
+  ThreadPool pool(3);
+  std::vector<std::atomic<int>> hits(1000);
+  ASSERT_TRUE(pool.ParallelFor(hits.size(), [&hits](size_t i) {
+    hits[i]++;
+    return true;
+  }));
+  for (const auto& hit : hits) {
+    ASSERT_EQ(1, hit.load());
+  }
+
+  // Stops handing out indices after a failure.
+  std::atomic<size_t> calls(0);
+  ASSERT_FALSE(pool.ParallelFor(100000, [&calls](size_t i) {
+    calls++;
+    return i != 10;
+  }));
+  ASSERT_LT(calls.load(), 100000u);
+
+  // Runs on at most 2 threads when asked to.
+  std::atomic<int> running(0);
+  std::atomic<int> max_running(0);
+  ASSERT_TRUE(pool.ParallelFor(100, [&running, &max_running](size_t) {
+    int now = ++running;
+    int seen = max_running.load();
+    while (now > seen && !max_running.compare_exchange_weak(seen, now)) {
+    }
+    std::this_thread::sleep_for(1ms);
+    running--;
+    return true;
+  }, 2));
+  ASSERT_LE(max_running.load(), 2);
+
+  // Works from within a task as well.
+  std::future<bool> nested = pool.Async([&pool]() {
+    return pool.ParallelFor(100, [](size_t) { return true; });
+  });
+  ASSERT_TRUE(nested.get());
+}
+
+TEST(ThreadPoolTest, cpu_affinity) {
+  ThreadPool::Options options;
+  options.threads = 2;
+  options.cpus = { 0 };
+  ThreadPool pool(options);
+  std::atomic<int> count(0);
+  ASSERT_TRUE(pool.ParallelFor(10, [&count](size_t) {
+    count++;
+    return true;
+  }));
+  ASSERT_EQ(10, count.load());
+}
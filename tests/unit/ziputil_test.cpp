@@ -18,11 +18,14 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <android-base/file.h>
 #include <android-base/test_utils.h>
 #include <gtest/gtest.h>
+#include <otautil/SysUtil.h>
 #include <otautil/ZipUtil.h>
 #include <ziparchive/zip_archive.h>
 
@@ -189,3 +192,99 @@ TEST(ZipUtilTest, set_timestamp) {
 
   CloseArchive(handle);
 }
+
+TEST(ZipUtilTest, extract_parallel) {
+  std::string zip_path = from_testdata_base("ziptest_valid.zip");
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchive(zip_path.c_str(), &handle));
+
+  constexpr struct utimbuf timestamp = { 1217592000, 1217592000 };
+
+  // Extract all the entries with more jobs than there are files.
+  TemporaryDir td;
+  ASSERT_TRUE(ExtractPackageRecursive(handle, "", td.path, &timestamp, nullptr, 4));
+
+  std::string path(td.path);
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(path + "/a.txt", &content));
+  ASSERT_EQ(kATxtContents, content);
+  ASSERT_TRUE(android::base::ReadFileToString(path + "/b.txt", &content));
+  ASSERT_EQ(kBTxtContents, content);
+  ASSERT_TRUE(android::base::ReadFileToString(path + "/b/c.txt", &content));
+  ASSERT_EQ(kCTxtContents, content);
+  ASSERT_TRUE(android::base::ReadFileToString(path + "/b/d.txt", &content));
+  ASSERT_EQ(kDTxtContents, content);
+
+  // The timestamps are still set, after all the files are written.
+  struct stat sb;
+  ASSERT_EQ(0, stat((path + "/b/d.txt").c_str(), &sb)) << strerror(errno);
+  ASSERT_EQ(1217592000, static_cast<long>(sb.st_mtime));
+
+  // Clean up the temp files under td.
+  ASSERT_EQ(0, unlink((path + "/a.txt").c_str()));
+  ASSERT_EQ(0, unlink((path + "/b.txt").c_str()));
+  ASSERT_EQ(0, unlink((path + "/b/c.txt").c_str()));
+  ASSERT_EQ(0, unlink((path + "/b/d.txt").c_str()));
+  ASSERT_EQ(0, rmdir((path + "/b").c_str()));
+
+  CloseArchive(handle);
+}
+
+TEST(ZipUtilTest, zip_index) {
+  std::string zip_path = from_testdata_base("ziptest_valid.zip");
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchive(zip_path.c_str(), &handle));
+
+  std::unique_ptr<ZipIndex> index = ZipIndex::Build(handle);
+  ASSERT_NE(nullptr, index);
+
+  ZipEntry entry;
+  ASSERT_TRUE(index->Find("b/d.txt", &entry));
+  ASSERT_EQ(kDTxtContents.size(), entry.uncompressed_length);
+  ASSERT_FALSE(index->Find("b/e.txt", &entry));
+  ASSERT_FALSE(index->Find("b/d", &entry));
+
+  // The files under "b/" come back in name order.
+  std::vector<std::string> names;
+  auto range = index->EntriesWithPrefix("b/");
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->first.back() != '/') {
+      names.push_back(it->first);
+    }
+  }
+  ASSERT_EQ((std::vector<std::string>{ "b/c.txt", "b/d.txt" }), names);
+
+  // Extracting through the index gives the same result as walking the archive.
+  TemporaryDir td;
+  ASSERT_TRUE(ExtractPackageRecursive(handle, "b", td.path, nullptr, nullptr, 1, index.get()));
+  std::string path(td.path);
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(path + "/c.txt", &content));
+  ASSERT_EQ(kCTxtContents, content);
+  ASSERT_TRUE(android::base::ReadFileToString(path + "/d.txt", &content));
+  ASSERT_EQ(kDTxtContents, content);
+
+  // Clean up the temp files under td.
+  ASSERT_EQ(0, unlink((path + "/c.txt").c_str()));
+  ASSERT_EQ(0, unlink((path + "/d.txt").c_str()));
+
+  CloseArchive(handle);
+}
+
+TEST(ZipUtilTest, prefetch) {
+  std::string zip_path = from_testdata_base("ziptest_valid.zip");
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_path));
+  ASSERT_TRUE(PrefetchZipDirectory(map.addr, map.length));
+
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_path.c_str(), &handle));
+  // The missing names are skipped.
+  PrefetchZipEntries(handle, map.addr, map.length, { "b/d.txt", "a.txt", "no_such_entry" });
+  CloseArchive(handle);
+
+  // Not an archive.
+  std::vector<uint8_t> garbage(4096, 'x');
+  ASSERT_FALSE(PrefetchZipDirectory(garbage.data(), garbage.size()));
+  ASSERT_FALSE(PrefetchZipDirectory(garbage.data(), 10));
+}
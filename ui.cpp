@@ -303,11 +303,21 @@ void RecoveryUI::OnTouchRelease() {
 }
 
 int RecoveryUI::OnInputEvent(int fd, uint32_t epevents) {
-  struct input_event ev;
-  if (ev_get_input(fd, epevents, &ev) == -1) {
+  // A moving finger reports a few events per SYN_REPORT, many times a second. Take all that's
+  // pending in one read.
+  static constexpr size_t kInputBatchSize = 64;
+  input_event events[kInputBatchSize];
+  int count = ev_get_inputs(fd, epevents, events, kInputBatchSize);
+  if (count == -1) {
     return -1;
   }
+  for (int i = 0; i < count; ++i) {
+    ProcessInputEvent(events[i]);
+  }
+  return 0;
+}
 
+void RecoveryUI::ProcessInputEvent(const input_event& ev) {
   // Touch inputs handling.
   //
   // Per the doc Multi-touch Protocol at below, there are two protocols.
@@ -323,6 +333,9 @@ int RecoveryUI::OnInputEvent(int fd, uint32_t epevents) {
   // ABS_MT_TRACKING_ID being -1.
   //
   // Touch input events will only be available if touch_screen_allowed_ is set.
+  //
+  // The motion is tracked once per SYN_REPORT, with the latest position, however many position
+  // events came before it.
 
   if (ev.type == EV_SYN) {
     if (touch_screen_allowed_ && ev.code == SYN_REPORT) {
@@ -337,9 +350,12 @@ int RecoveryUI::OnInputEvent(int fd, uint32_t epevents) {
         OnTouchRelease();
         touch_reported_ = false;
         touch_saw_x_ = touch_saw_y_ = false;
+      } else if (touch_reported_ && touch_saw_x_ && touch_saw_y_) {
+        OnTouchTrack();
+        touch_saw_x_ = touch_saw_y_ = false;
       }
     }
-    return 0;
+    return;
   }
 
   if (ev.type == EV_REL) {
@@ -368,27 +384,19 @@ int RecoveryUI::OnInputEvent(int fd, uint32_t epevents) {
       touch_slot_ = ev.value;
     }
     // Ignore other fingers.
-    if (touch_slot_ > 0) return 0;
+    if (touch_slot_ > 0) return;
 
     switch (ev.code) {
       case ABS_MT_POSITION_X:
         touch_finger_down_ = true;
         touch_saw_x_ = true;
         touch_pos_.x(ev.value);
-        if (touch_reported_ && touch_saw_y_) {
-          OnTouchTrack();
-          touch_saw_x_ = touch_saw_y_ = false;
-        }
         break;
 
       case ABS_MT_POSITION_Y:
         touch_finger_down_ = true;
         touch_saw_y_ = true;
         touch_pos_.y(ev.value);
-        if (touch_reported_ && touch_saw_x_) {
-          OnTouchTrack();
-          touch_saw_x_ = touch_saw_y_ = false;
-        }
         break;
 
       case ABS_MT_TRACKING_ID:
@@ -396,7 +404,7 @@ int RecoveryUI::OnInputEvent(int fd, uint32_t epevents) {
         if (ev.value < 0) touch_finger_down_ = false;
         break;
     }
-    return 0;
+    return;
   }
 
   if (ev.type == EV_KEY && ev.code <= KEY_MAX) {
@@ -411,14 +419,12 @@ int RecoveryUI::OnInputEvent(int fd, uint32_t epevents) {
       // additional scrolling (because in ScreenRecoveryUI::ShowFile(), we consider keys other than
       // KEY_POWER and KEY_UP as KEY_DOWN).
       if (ev.code == BTN_TOUCH || ev.code == BTN_TOOL_FINGER) {
-        return 0;
+        return;
       }
     }
 
     ProcessKey(ev.code, ev.value);
   }
-
-  return 0;
 }
 
 // Process a key-up or -down event.  A key is "registered" when it is
@@ -707,6 +713,17 @@ RecoveryUI::KeyAction RecoveryUI::CheckKey(int key, bool is_long_press) {
 void RecoveryUI::KeyLongPress(int) {
 }
 
+void RecoveryUI::StartLazyMenu(bool is_main, menu_type_t type, const char* const* headers,
+                               size_t count, const MenuItemProvider& provider,
+                               int initial_selection) {
+  MenuItemVector items;
+  items.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    items.push_back(provider(i));
+  }
+  StartMenu(is_main, type, headers, items, initial_selection);
+}
+
 void RecoveryUI::SetEnableReboot(bool enabled) {
   pthread_mutex_lock(&event_queue_mutex);
   enable_reboot = enabled;
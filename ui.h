@@ -22,6 +22,7 @@
 #include <pthread.h>
 #include <time.h>
 
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -50,6 +51,8 @@ class MenuItem {
   std::string icon_name_sel_;
 };
 typedef std::vector<MenuItem> MenuItemVector;
+// Returns the item at the given index of a menu, for menus too long to be built in full.
+using MenuItemProvider = std::function<MenuItem(size_t)>;
 
 /*
  * Simple representation of a (x,y) coordinate with convenience operators
@@ -242,6 +245,12 @@ class RecoveryUI {
   virtual void StartMenu(bool is_main, menu_type_t type, const char* const* headers,
                          const MenuItemVector& items, int initial_selection) = 0;
 
+  // Like StartMenu(), for a menu of |count| items that |provider| produces only as they get shown.
+  // The provider must stay valid until EndMenu(). By default, this builds the whole menu.
+  virtual void StartLazyMenu(bool is_main, menu_type_t type, const char* const* headers,
+                             size_t count, const MenuItemProvider& provider,
+                             int initial_selection);
+
   // Sets the menu highlight to the given index, wrapping if necessary. Returns the actual item
   // selected.
   virtual int SelectMenu(int sel) = 0;
@@ -309,6 +318,7 @@ class RecoveryUI {
   void OnTouchTrack();
   void OnTouchRelease();
   int OnInputEvent(int fd, uint32_t epevents);
+  void ProcessInputEvent(const input_event& ev);
   void ProcessKey(int key_code, int updown);
 
   bool IsUsbConnected();
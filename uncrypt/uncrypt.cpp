@@ -55,6 +55,7 @@
  *  a1. ctl.start:
  *    setup-bcb /
  *    clear-bcb /
+ *    uncrypt-extend /
  *    uncrypt
  *
  *                         b2. create socket at
@@ -90,6 +91,7 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <libgen.h>
+#include <linux/fiemap.h>
 #include <linux/fs.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -102,11 +104,16 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/parseint.h>
 #include <android-base/properties.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
@@ -116,10 +123,16 @@
 #include <cutils/sockets.h>
 #include <fs_mgr.h>
 
+#include "otautil/SysUtil.h"
 #include "otautil/error_code.h"
 
-static constexpr int WINDOW_SIZE = 5;
+// Blocks read and written back at a time when copying an encrypted package to its raw device.
+static constexpr int COPY_CHUNK_BLOCKS = 256;
+// Chunks that may be read ahead of the one being written.
+static constexpr size_t COPY_CHUNKS_IN_FLIGHT = 4;
 static constexpr int FIBMAP_RETRY_LIMIT = 3;
+// Number of extents fetched by each FS_IOC_FIEMAP call.
+static constexpr size_t FIEMAP_EXTENT_BATCH = 256;
 
 // uncrypt provides three services: SETUP_BCB, CLEAR_BCB and UNCRYPT.
 //
@@ -132,24 +145,41 @@ static constexpr int FIBMAP_RETRY_LIMIT = 3;
 // and CACHE_BLOCK_MAP). It will be working (and needed) only for non-A/B
 // devices, on which /cache partitions always exist.
 static const std::string CACHE_BLOCK_MAP = "/cache/recovery/block.map";
+static const std::string CACHE_BLOCK_MAP_PARTIAL = "/cache/recovery/block.map.partial";
 static const std::string UNCRYPT_PATH_FILE = "/cache/recovery/uncrypt_file";
 static const std::string UNCRYPT_STATUS = "/cache/recovery/uncrypt_status";
 static const std::string UNCRYPT_SOCKET = "uncrypt";
 
 static struct fstab* fstab = nullptr;
 
-static int write_at_offset(unsigned char* buffer, size_t size, int wfd, off64_t offset) {
-    if (TEMP_FAILURE_RETRY(lseek64(wfd, offset, SEEK_SET)) == -1) {
-        PLOG(ERROR) << "error seeking to offset " << offset;
-        return -1;
-    }
-    if (!android::base::WriteFully(wfd, buffer, size)) {
-        PLOG(ERROR) << "error writing offset " << offset;
-        return -1;
+static int write_at_offset(const unsigned char* buffer, size_t size, int wfd, off64_t offset) {
+    while (size > 0) {
+        ssize_t written = TEMP_FAILURE_RETRY(pwrite64(wfd, buffer, size, offset));
+        if (written <= 0) {
+            PLOG(ERROR) << "error writing offset " << offset;
+            return -1;
+        }
+        buffer += written;
+        size -= written;
+        offset += written;
     }
     return 0;
 }
 
+static bool read_at_offset(unsigned char* buffer, size_t size, int fd, off64_t offset) {
+    while (size > 0) {
+        ssize_t nread = TEMP_FAILURE_RETRY(pread64(fd, buffer, size, offset));
+        if (nread <= 0) {
+            if (nread == 0) errno = EIO;
+            return false;
+        }
+        buffer += nread;
+        size -= nread;
+        offset += nread;
+    }
+    return true;
+}
+
 static void add_block_to_ranges(std::vector<int>& ranges, int new_block) {
     if (!ranges.empty() && new_block == ranges.back()) {
         // If the new block comes immediately after the current range,
@@ -251,69 +281,229 @@ static int retry_fibmap(const int fd, const char* name, int* block, const int he
     return kUncryptIoctlError;
 }
 
-static int produce_block_map(const char* path, const char* map_file, const char* blk_dev,
-                             bool encrypted, bool f2fs_fs, int socket) {
-    std::string err;
-    if (!android::base::RemoveFileIfExists(map_file, &err)) {
-        LOG(ERROR) << "failed to remove the existing map file " << map_file << ": " << err;
-        return kUncryptFileRemoveError;
-    }
-    std::string tmp_map_file = std::string(map_file) + ".tmp";
-    android::base::unique_fd mapfd(open(tmp_map_file.c_str(),
-                                        O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR));
-    if (mapfd == -1) {
-        PLOG(ERROR) << "failed to open " << tmp_map_file;
-        return kUncryptFileOpenError;
+// Maps the blocks of a file to the blocks of its device. Whole extents are fetched with
+// FS_IOC_FIEMAP, a batch at a time, instead of issuing a FIBMAP for each block; FIBMAP is still
+// used for the blocks that aren't covered by a plain extent, and for all of them if the filesystem
+// doesn't support FIEMAP.
+class BlockMapper {
+  public:
+    BlockMapper(int fd, const char* path, off64_t file_size, int block_size)
+        : fd_(fd), path_(path), block_size_(block_size),
+          file_blocks_(static_cast<int>((file_size + block_size - 1) / block_size)) {}
+
+    // Stores the device block of |logical_block| in |*block|. Returns kUncryptNoError, or the
+    // error code on failure.
+    int Map(int logical_block, int* block) {
+        if (fiemap_supported_ && FindExtent(logical_block, block)) {
+            return kUncryptNoError;
+        }
+
+        *block = logical_block;
+        if (ioctl(fd_, FIBMAP, block) != 0) {
+            PLOG(ERROR) << "failed to find block " << logical_block;
+            return kUncryptIoctlError;
+        }
+        if (*block == 0) {
+            LOG(ERROR) << "failed to find block " << logical_block << ", retrying";
+            return retry_fibmap(fd_, path_, block, logical_block);
+        }
+        return kUncryptNoError;
     }
 
-    // Make sure we can write to the socket.
-    if (!write_status_to_socket(0, socket)) {
-        LOG(ERROR) << "failed to write to socket " << socket;
-        return kUncryptSocketWriteError;
+  private:
+    struct Extent {
+        int logical;
+        int physical;
+        int count;
+    };
+
+    bool FindExtent(int logical_block, int* block) {
+        // The blocks are looked up in order, so the extent for the next block is almost always the
+        // current one or the one after it.
+        for (int pass = 0; pass < 2; pass++) {
+            while (cursor_ < extents_.size() &&
+                   extents_[cursor_].logical + extents_[cursor_].count <= logical_block) {
+                cursor_++;
+            }
+            if (cursor_ < extents_.size() && extents_[cursor_].logical <= logical_block) {
+                *block = extents_[cursor_].physical + (logical_block - extents_[cursor_].logical);
+                return true;
+            }
+            if (logical_block < fetched_end_ || pass == 1 || !FetchExtents(logical_block)) {
+                // A hole or an extent we can't use: leave it to FIBMAP.
+                return false;
+            }
+        }
+        return false;
     }
 
-    struct stat sb;
-    if (stat(path, &sb) != 0) {
-        LOG(ERROR) << "failed to stat " << path;
-        return kUncryptFileStatError;
+    // Replaces the cached extents with the ones from |logical_block| on.
+    bool FetchExtents(int logical_block) {
+        std::vector<uint8_t> buffer(sizeof(fiemap) + FIEMAP_EXTENT_BATCH * sizeof(fiemap_extent));
+        fiemap* fm = reinterpret_cast<fiemap*>(buffer.data());
+        fm->fm_start = static_cast<uint64_t>(logical_block) * block_size_;
+        fm->fm_length = static_cast<uint64_t>(file_blocks_ - logical_block) * block_size_;
+        // Like retry_fibmap(), flush the file first so that none of its blocks is left unallocated.
+        fm->fm_flags = FIEMAP_FLAG_SYNC;
+        fm->fm_extent_count = FIEMAP_EXTENT_BATCH;
+        if (ioctl(fd_, FS_IOC_FIEMAP, fm) != 0) {
+            PLOG(WARNING) << "FIEMAP isn't usable on " << path_ << "; falling back to FIBMAP";
+            fiemap_supported_ = false;
+            return false;
+        }
+
+        extents_.clear();
+        cursor_ = 0;
+        fetched_end_ = file_blocks_;
+        static constexpr uint32_t kUnmappable = FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC |
+                                                FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_NOT_ALIGNED |
+                                                FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL;
+        for (uint32_t i = 0; i < fm->fm_mapped_extents; i++) {
+            const fiemap_extent& fe = fm->fm_extents[i];
+            if (i == fm->fm_extent_count - 1 && !(fe.fe_flags & FIEMAP_EXTENT_LAST)) {
+                // The batch is full; the blocks past its last extent are still to be fetched.
+                fetched_end_ = static_cast<int>((fe.fe_logical + fe.fe_length) / block_size_);
+            }
+            if ((fe.fe_flags & kUnmappable) || fe.fe_logical % block_size_ != 0 ||
+                fe.fe_physical % block_size_ != 0 || fe.fe_length % block_size_ != 0) {
+                continue;
+            }
+            extents_.push_back({ static_cast<int>(fe.fe_logical / block_size_),
+                                 static_cast<int>(fe.fe_physical / block_size_),
+                                 static_cast<int>(fe.fe_length / block_size_) });
+        }
+        return true;
     }
 
-    LOG(INFO) << " block size: " << sb.st_blksize << " bytes";
+    const int fd_;
+    const char* path_;
+    const int block_size_;
+    const int file_blocks_;
+
+    bool fiemap_supported_ = true;
+    std::vector<Extent> extents_;
+    size_t cursor_ = 0;
+    // The extents of the blocks before this one have all been fetched.
+    int fetched_end_ = 0;
+};
+
+struct CopyChunk {
+    int first_block;
+    int count;
+    std::vector<unsigned char> data;
+};
+
+// Copies the blocks [|first_block|, |end_block|) of |fd|, read through the filesystem (i.e.
+// decrypted), to the same blocks of the raw device |wfd|, and records them in |ranges|. A reader thread keeps up to
+// COPY_CHUNKS_IN_FLIGHT chunks read ahead, so that the decryption overlaps with the writes; this
+// thread maps each chunk and writes every run of physically contiguous blocks with one pwrite.
+static int copy_blocks_to_device(int fd, int wfd, const char* path, off64_t file_size,
+                                 int block_size, int first_block, int end_block,
+                                 BlockMapper* mapper, std::vector<int>* ranges, int socket) {
+    std::mutex mu;
+    std::condition_variable cv;
+    std::deque<std::unique_ptr<CopyChunk>> free_chunks;
+    std::deque<std::unique_ptr<CopyChunk>> read_chunks;
+    bool read_failed = false;
+    bool finished = false;
+    for (size_t i = 0; i < COPY_CHUNKS_IN_FLIGHT; i++) {
+        free_chunks.emplace_back(new CopyChunk);
+        free_chunks.back()->data.resize(static_cast<size_t>(COPY_CHUNK_BLOCKS) * block_size);
+    }
 
-    int blocks = ((sb.st_size-1) / sb.st_blksize) + 1;
-    LOG(INFO) << "  file size: " << sb.st_size << " bytes, " << blocks << " blocks";
+    std::thread reader([&]() {
+        for (int block = first_block; block < end_block; block += COPY_CHUNK_BLOCKS) {
+            std::unique_ptr<CopyChunk> chunk;
+            {
+                std::unique_lock<std::mutex> lock(mu);
+                cv.wait(lock, [&] { return finished || !free_chunks.empty(); });
+                if (finished) return;
+                chunk = std::move(free_chunks.front());
+                free_chunks.pop_front();
+            }
+            chunk->first_block = block;
+            chunk->count = std::min(COPY_CHUNK_BLOCKS, end_block - block);
+            off64_t offset = static_cast<off64_t>(block) * block_size;
+            size_t size = std::min(static_cast<off64_t>(chunk->count) * block_size,
+                                   file_size - offset);
+            bool success = read_at_offset(chunk->data.data(), size, fd, offset);
+            if (!success) {
+                PLOG(ERROR) << "failed to read " << path;
+            }
+            // Zero the end of the last block.
+            std::fill(chunk->data.begin() + size,
+                      chunk->data.begin() + static_cast<size_t>(chunk->count) * block_size, 0);
+
+            std::lock_guard<std::mutex> lock(mu);
+            if (success) {
+                read_chunks.push_back(std::move(chunk));
+            } else {
+                read_failed = true;
+            }
+            cv.notify_all();
+            if (!success) return;
+        }
+    });
 
-    std::vector<int> ranges;
+    int result = kUncryptNoError;
+    int last_progress = 0;
+    std::vector<int> physical(COPY_CHUNK_BLOCKS);
+    int blocks = end_block - first_block;
+    for (int done = 0; done < blocks && result == kUncryptNoError;) {
+        std::unique_ptr<CopyChunk> chunk;
+        {
+            std::unique_lock<std::mutex> lock(mu);
+            cv.wait(lock, [&] { return read_failed || !read_chunks.empty(); });
+            if (read_chunks.empty()) {
+                result = kUncryptReadError;
+                break;
+            }
+            chunk = std::move(read_chunks.front());
+            read_chunks.pop_front();
+        }
 
-    std::string s = android::base::StringPrintf("%s\n%" PRId64 " %" PRId64 "\n",
-                       blk_dev, static_cast<int64_t>(sb.st_size),
-                       static_cast<int64_t>(sb.st_blksize));
-    if (!android::base::WriteStringToFd(s, mapfd)) {
-        PLOG(ERROR) << "failed to write " << tmp_map_file;
-        return kUncryptWriteError;
-    }
+        // Mapped only after the blocks are read, like the reads that used to stay a few blocks
+        // ahead of FIBMAP.
+        for (int i = 0; i < chunk->count && result == kUncryptNoError; i++) {
+            result = mapper->Map(chunk->first_block + i, &physical[i]);
+            if (result == kUncryptNoError) {
+                add_block_to_ranges(*ranges, physical[i]);
+            }
+        }
+        for (int i = 0; i < chunk->count && result == kUncryptNoError;) {
+            int run = 1;
+            while (i + run < chunk->count && physical[i + run] == physical[i] + run) {
+                run++;
+            }
+            if (write_at_offset(chunk->data.data() + static_cast<size_t>(i) * block_size,
+                                static_cast<size_t>(run) * block_size, wfd,
+                                static_cast<off64_t>(block_size) * physical[i]) != 0) {
+                result = kUncryptWriteError;
+            }
+            i += run;
+        }
+        done += chunk->count;
 
-    std::vector<std::vector<unsigned char>> buffers;
-    if (encrypted) {
-        buffers.resize(WINDOW_SIZE, std::vector<unsigned char>(sb.st_blksize));
-    }
-    int head_block = 0;
-    int head = 0, tail = 0;
+        // Update the status file, progress must be between [0, 99].
+        int progress = static_cast<int>(100 * (double(done) / double(blocks)));
+        if (progress > last_progress && progress < 100) {
+            last_progress = progress;
+            write_status_to_socket(progress, socket);
+        }
 
-    android::base::unique_fd fd(open(path, O_RDWR));
-    if (fd == -1) {
-        PLOG(ERROR) << "failed to open " << path << " for reading";
-        return kUncryptFileOpenError;
+        std::lock_guard<std::mutex> lock(mu);
+        free_chunks.push_back(std::move(chunk));
+        cv.notify_all();
     }
 
-    android::base::unique_fd wfd;
-    if (encrypted) {
-        wfd.reset(open(blk_dev, O_WRONLY));
-        if (wfd == -1) {
-            PLOG(ERROR) << "failed to open " << blk_dev << " for writing";
-            return kUncryptBlockOpenError;
-        }
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        finished = true;
+        cv.notify_all();
     }
+    reader.join();
+    return result;
+}
 
 // F2FS-specific ioctl
 // It requires the below kernel commit merged in v4.16-rc1.
@@ -331,6 +521,7 @@ static int produce_block_map(const char* path, const char* map_file, const char*
 #define F2FS_IOC_SET_PIN_FILE	_IOW(F2FS_IOCTL_MAGIC, 13, __u32)
 #define F2FS_IOC_GET_PIN_FILE	_IOW(F2FS_IOCTL_MAGIC, 14, __u32)
 #endif
+static int pin_file(int fd, const char* path, const char* blk_dev, bool f2fs_fs) {
     if (f2fs_fs) {
         __u32 set = 1;
         int error = ioctl(fd, F2FS_IOC_SET_PIN_FILE, &set);
@@ -340,100 +531,258 @@ static int produce_block_map(const char* path, const char* map_file, const char*
             return kUncryptIoctlError;
         }
     }
+    return kUncryptNoError;
+}
 
-    off64_t pos = 0;
+// Maps the blocks [|first_block|, |end_block|) of |fd| into |ranges|, and copies them to the raw
+// device |wfd| if the filesystem is |encrypted|.
+static int map_blocks(int fd, int wfd, const char* path, const struct stat& sb, bool encrypted,
+                      int first_block, int end_block, BlockMapper* mapper,
+                      std::vector<int>* ranges, int socket) {
+    if (encrypted) {
+        return copy_blocks_to_device(fd, wfd, path, sb.st_size, sb.st_blksize, first_block,
+                                     end_block, mapper, ranges, socket);
+    }
+
+    // If we're not encrypting, we don't need to read anything; just map the blocks.
     int last_progress = 0;
-    while (pos < sb.st_size) {
+    for (int i = first_block; i < end_block; i++) {
         // Update the status file, progress must be between [0, 99].
-        int progress = static_cast<int>(100 * (double(pos) / double(sb.st_size)));
+        int progress =
+                static_cast<int>(100 * (double(i - first_block) / double(end_block - first_block)));
         if (progress > last_progress) {
             last_progress = progress;
             write_status_to_socket(progress, socket);
         }
 
-        if ((tail+1) % WINDOW_SIZE == head) {
-            // write out head buffer
-            int block = head_block;
-            if (ioctl(fd, FIBMAP, &block) != 0) {
-                PLOG(ERROR) << "failed to find block " << head_block;
-                return kUncryptIoctlError;
-            }
+        int block;
+        int error = mapper->Map(i, &block);
+        if (error != kUncryptNoError) {
+            return error;
+        }
+        add_block_to_ranges(*ranges, block);
+    }
+    return kUncryptNoError;
+}
 
-            if (block == 0) {
-                LOG(ERROR) << "failed to find block " << head_block << ", retrying";
-                int error = retry_fibmap(fd, path, &block, head_block);
-                if (error != kUncryptNoError) {
-                    return error;
-                }
-            }
+// The blocks of a package mapped (and copied, on encrypted devices) while it was being downloaded.
+// Recorded in CACHE_BLOCK_MAP_PARTIAL as
+//
+//     /data/ota_package/update.zip      # package
+//     /dev/block/.../userdata           # block device
+//     1234 4096 2 1                     # inode, block size, count of blocks mapped, encrypted
+//     1                                 # count of block ranges
+//     1000 1002                         # block range 0
+struct PartialBlockMap {
+    std::string path;
+    std::string blk_dev;
+    uint64_t ino = 0;
+    int block_size = 0;
+    int blocks = 0;
+    bool encrypted = false;
+    std::vector<int> ranges;
+};
 
-            add_block_to_ranges(ranges, block);
-            if (encrypted) {
-                if (write_at_offset(buffers[head].data(), sb.st_blksize, wfd,
-                                    static_cast<off64_t>(sb.st_blksize) * block) != 0) {
-                    return kUncryptWriteError;
-                }
-            }
-            head = (head + 1) % WINDOW_SIZE;
-            ++head_block;
+static bool load_partial_block_map(PartialBlockMap* partial) {
+    std::string content;
+    if (!android::base::ReadFileToString(CACHE_BLOCK_MAP_PARTIAL, &content)) {
+        return false;
+    }
+    std::vector<std::string> lines = android::base::Split(android::base::Trim(content), "\n");
+    if (lines.size() < 4) {
+        LOG(WARNING) << "ignoring truncated " << CACHE_BLOCK_MAP_PARTIAL;
+        return false;
+    }
+    partial->path = lines[0];
+    partial->blk_dev = lines[1];
+    std::vector<std::string> header = android::base::Split(lines[2], " ");
+    int encrypted;
+    size_t range_count;
+    if (header.size() != 4 || !android::base::ParseUint(header[0], &partial->ino) ||
+        !android::base::ParseInt(header[1], &partial->block_size, 1) ||
+        !android::base::ParseInt(header[2], &partial->blocks, 0) ||
+        !android::base::ParseInt(header[3], &encrypted, 0, 1) ||
+        !android::base::ParseUint(lines[3], &range_count) || lines.size() != 4 + range_count) {
+        LOG(WARNING) << "ignoring malformed " << CACHE_BLOCK_MAP_PARTIAL;
+        return false;
+    }
+    partial->encrypted = encrypted == 1;
+    partial->ranges.clear();
+    for (size_t i = 0; i < range_count; i++) {
+        std::vector<std::string> pair = android::base::Split(lines[4 + i], " ");
+        int start;
+        int end;
+        if (pair.size() != 2 || !android::base::ParseInt(pair[0], &start, 0) ||
+            !android::base::ParseInt(pair[1], &end, start + 1)) {
+            LOG(WARNING) << "ignoring malformed " << CACHE_BLOCK_MAP_PARTIAL;
+            return false;
         }
+        partial->ranges.push_back(start);
+        partial->ranges.push_back(end);
+    }
+    return true;
+}
 
-        // read next block to tail
-        if (encrypted) {
-            size_t to_read = static_cast<size_t>(
-                    std::min(static_cast<off64_t>(sb.st_blksize), sb.st_size - pos));
-            if (!android::base::ReadFully(fd, buffers[tail].data(), to_read)) {
-                PLOG(ERROR) << "failed to read " << path;
-                return kUncryptReadError;
-            }
-            pos += to_read;
-        } else {
-            // If we're not encrypting; we don't need to actually read
-            // anything, just skip pos forward as if we'd read a
-            // block.
-            pos += sb.st_blksize;
-        }
-        tail = (tail+1) % WINDOW_SIZE;
+static int save_partial_block_map(const PartialBlockMap& partial) {
+    std::string content = android::base::StringPrintf(
+            "%s\n%s\n%" PRIu64 " %d %d %d\n%zu\n", partial.path.c_str(), partial.blk_dev.c_str(),
+            partial.ino, partial.block_size, partial.blocks, partial.encrypted ? 1 : 0,
+            partial.ranges.size() / 2);
+    for (size_t i = 0; i < partial.ranges.size(); i += 2) {
+        content += android::base::StringPrintf("%d %d\n", partial.ranges[i], partial.ranges[i + 1]);
     }
 
-    while (head != tail) {
-        // write out head buffer
-        int block = head_block;
-        if (ioctl(fd, FIBMAP, &block) != 0) {
-            PLOG(ERROR) << "failed to find block " << head_block;
-            return kUncryptIoctlError;
+    std::string tmp_file = CACHE_BLOCK_MAP_PARTIAL + ".tmp";
+    android::base::unique_fd fd(open(tmp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                                     S_IRUSR | S_IWUSR));
+    if (fd == -1) {
+        PLOG(ERROR) << "failed to open " << tmp_file;
+        return kUncryptFileOpenError;
+    }
+    if (!android::base::WriteStringToFd(content, fd)) {
+        PLOG(ERROR) << "failed to write " << tmp_file;
+        return kUncryptWriteError;
+    }
+    if (fsync(fd) == -1) {
+        PLOG(ERROR) << "failed to fsync \"" << tmp_file << "\"";
+        return kUncryptFileSyncError;
+    }
+    if (rename(tmp_file.c_str(), CACHE_BLOCK_MAP_PARTIAL.c_str()) == -1) {
+        PLOG(ERROR) << "failed to rename " << tmp_file << " to " << CACHE_BLOCK_MAP_PARTIAL;
+        return kUncryptFileRenameError;
+    }
+    return kUncryptNoError;
+}
+
+static bool partial_block_map_matches(const PartialBlockMap& partial, const char* path,
+                                      const char* blk_dev, const struct stat& sb, bool encrypted) {
+    return partial.path == path && partial.blk_dev == blk_dev && partial.ino == sb.st_ino &&
+           partial.block_size == sb.st_blksize && partial.encrypted == encrypted;
+}
+
+// Checks that the blocks recorded in |partial| haven't moved since they were mapped.
+static bool verify_partial_block_map(const PartialBlockMap& partial, BlockMapper* mapper) {
+    std::vector<int> ranges;
+    for (int i = 0; i < partial.blocks; i++) {
+        int block;
+        if (mapper->Map(i, &block) != kUncryptNoError) {
+            return false;
         }
+        add_block_to_ranges(ranges, block);
+    }
+    if (ranges != partial.ranges) {
+        LOG(WARNING) << "the blocks mapped during the download have moved; starting over";
+        return false;
+    }
+    return true;
+}
 
-        if (block == 0) {
-            LOG(ERROR) << "failed to find block " << head_block << ", retrying";
-            int error = retry_fibmap(fd, path, &block, head_block);
-            if (error != kUncryptNoError) {
-                return error;
-            }
+static int produce_block_map(const char* path, const char* map_file, const char* blk_dev,
+                             bool encrypted, bool f2fs_fs, int socket) {
+    std::string err;
+    if (!android::base::RemoveFileIfExists(map_file, &err)) {
+        LOG(ERROR) << "failed to remove the existing map file " << map_file << ": " << err;
+        return kUncryptFileRemoveError;
+    }
+    std::string tmp_map_file = std::string(map_file) + ".tmp";
+    android::base::unique_fd mapfd(open(tmp_map_file.c_str(),
+                                        O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR));
+    if (mapfd == -1) {
+        PLOG(ERROR) << "failed to open " << tmp_map_file;
+        return kUncryptFileOpenError;
+    }
+
+    // Make sure we can write to the socket.
+    if (!write_status_to_socket(0, socket)) {
+        LOG(ERROR) << "failed to write to socket " << socket;
+        return kUncryptSocketWriteError;
+    }
+
+    struct stat sb;
+    if (stat(path, &sb) != 0) {
+        LOG(ERROR) << "failed to stat " << path;
+        return kUncryptFileStatError;
+    }
+
+    LOG(INFO) << " block size: " << sb.st_blksize << " bytes";
+
+    int blocks = ((sb.st_size-1) / sb.st_blksize) + 1;
+    LOG(INFO) << "  file size: " << sb.st_size << " bytes, " << blocks << " blocks";
+
+    std::vector<int> ranges;
+
+    // With ro.uncrypt.binary_block_map set, the map is written in the binary form that recovery
+    // reads in place (see BlockMapHeader); only recoveries that know it may be installed along.
+    bool binary_map = android::base::GetBoolProperty("ro.uncrypt.binary_block_map", false);
+    if (!binary_map) {
+        std::string s = android::base::StringPrintf("%s\n%" PRId64 " %" PRId64 "\n",
+                           blk_dev, static_cast<int64_t>(sb.st_size),
+                           static_cast<int64_t>(sb.st_blksize));
+        if (!android::base::WriteStringToFd(s, mapfd)) {
+            PLOG(ERROR) << "failed to write " << tmp_map_file;
+            return kUncryptWriteError;
         }
+    }
 
-        add_block_to_ranges(ranges, block);
-        if (encrypted) {
-            if (write_at_offset(buffers[head].data(), sb.st_blksize, wfd,
-                                static_cast<off64_t>(sb.st_blksize) * block) != 0) {
-                return kUncryptWriteError;
-            }
+    android::base::unique_fd fd(open(path, O_RDWR));
+    if (fd == -1) {
+        PLOG(ERROR) << "failed to open " << path << " for reading";
+        return kUncryptFileOpenError;
+    }
+
+    android::base::unique_fd wfd;
+    if (encrypted) {
+        wfd.reset(open(blk_dev, O_WRONLY));
+        if (wfd == -1) {
+            PLOG(ERROR) << "failed to open " << blk_dev << " for writing";
+            return kUncryptBlockOpenError;
         }
-        head = (head + 1) % WINDOW_SIZE;
-        ++head_block;
     }
 
-    if (!android::base::WriteStringToFd(
-            android::base::StringPrintf("%zu\n", ranges.size() / 2), mapfd)) {
-        PLOG(ERROR) << "failed to write " << tmp_map_file;
-        return kUncryptWriteError;
+    int error = pin_file(fd, path, blk_dev, f2fs_fs);
+    if (error != kUncryptNoError) {
+        return error;
     }
-    for (size_t i = 0; i < ranges.size(); i += 2) {
+
+    // Pick up from the blocks that were mapped while the package was being downloaded, provided
+    // they have stayed where they were.
+    BlockMapper mapper(fd, path, sb.st_size, sb.st_blksize);
+    int first_block = 0;
+    PartialBlockMap partial;
+    if (load_partial_block_map(&partial) &&
+        partial_block_map_matches(partial, path, blk_dev, sb, encrypted) &&
+        partial.blocks <= blocks && verify_partial_block_map(partial, &mapper)) {
+        LOG(INFO) << "resuming from the " << partial.blocks << " blocks mapped during the download";
+        first_block = partial.blocks;
+        ranges = std::move(partial.ranges);
+    }
+
+    error = map_blocks(fd, wfd, path, sb, encrypted, first_block, blocks, &mapper, &ranges,
+                       socket);
+    if (error != kUncryptNoError) {
+        return error;
+    }
+
+    if (binary_map) {
+        std::string content = BinaryBlockMap(blk_dev, sb.st_size, sb.st_blksize,
+                                             std::vector<uint64_t>(ranges.begin(), ranges.end()));
+        if (!android::base::WriteStringToFd(content, mapfd)) {
+            PLOG(ERROR) << "failed to write " << tmp_map_file;
+            return kUncryptWriteError;
+        }
+    } else {
         if (!android::base::WriteStringToFd(
-                android::base::StringPrintf("%d %d\n", ranges[i], ranges[i+1]), mapfd)) {
+                android::base::StringPrintf("%zu\n", ranges.size() / 2), mapfd)) {
             PLOG(ERROR) << "failed to write " << tmp_map_file;
             return kUncryptWriteError;
         }
+        for (size_t i = 0; i < ranges.size(); i += 2) {
+            if (!android::base::WriteStringToFd(
+                    android::base::StringPrintf("%d %d\n", ranges[i], ranges[i+1]), mapfd)) {
+                PLOG(ERROR) << "failed to write " << tmp_map_file;
+                return kUncryptWriteError;
+            }
+        }
     }
 
     if (fsync(mapfd) == -1) {
@@ -460,6 +809,10 @@ static int produce_block_map(const char* path, const char* map_file, const char*
         PLOG(ERROR) << "failed to rename " << tmp_map_file << " to " << map_file;
         return kUncryptFileRenameError;
     }
+    // The blocks mapped during the download are part of the map now.
+    if (!android::base::RemoveFileIfExists(CACHE_BLOCK_MAP_PARTIAL, &err)) {
+        LOG(WARNING) << "failed to remove " << CACHE_BLOCK_MAP_PARTIAL << ": " << err;
+    }
     // Sync dir to make rename() result written to disk.
     std::string file_name = map_file;
     std::string dir_name = dirname(&file_name[0]);
@@ -520,6 +873,86 @@ static int uncrypt(const char* input_path, const char* map_file, const int socke
     return 0;
 }
 
+// Extends the partial block map of |input_path| over its first |synced_size| bytes, which the
+// caller guarantees to be final and fsync'ed. On encrypted devices those blocks are copied to the
+// raw device as well, so the caller must not read them back through the filesystem.
+static int extend_block_map(const char* input_path, off64_t synced_size, int socket) {
+    char path[PATH_MAX+1];
+    if (realpath(input_path, path) == nullptr) {
+        PLOG(ERROR) << "failed to convert \"" << input_path << "\" to absolute path";
+        return kUncryptRealpathFindError;
+    }
+    if (strncmp(path, "/data/", 6) != 0) {
+        LOG(INFO) << path << " won't need a block map";
+        return 0;
+    }
+
+    bool encryptable;
+    bool encrypted;
+    bool f2fs_fs;
+    const char* blk_dev = find_block_device(path, &encryptable, &encrypted, &f2fs_fs);
+    if (blk_dev == nullptr) {
+        LOG(ERROR) << "failed to find block device for " << path;
+        return kUncryptBlockDeviceFindError;
+    }
+
+    android::base::unique_fd fd(open(path, O_RDWR));
+    if (fd == -1) {
+        PLOG(ERROR) << "failed to open " << path << " for reading";
+        return kUncryptFileOpenError;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) != 0) {
+        PLOG(ERROR) << "failed to stat " << path;
+        return kUncryptFileStatError;
+    }
+    int error = pin_file(fd, path, blk_dev, f2fs_fs);
+    if (error != kUncryptNoError) {
+        return error;
+    }
+
+    PartialBlockMap partial;
+    if (!load_partial_block_map(&partial) ||
+        !partial_block_map_matches(partial, path, blk_dev, sb, encrypted)) {
+        partial = PartialBlockMap();
+        partial.path = path;
+        partial.blk_dev = blk_dev;
+        partial.ino = sb.st_ino;
+        partial.block_size = sb.st_blksize;
+        partial.encrypted = encrypted;
+    }
+
+    // Only whole blocks are mapped; the last one is left to the final uncrypt.
+    int end_block = static_cast<int>(std::min(synced_size, sb.st_size) / sb.st_blksize);
+    if (end_block <= partial.blocks) {
+        return 0;
+    }
+
+    android::base::unique_fd wfd;
+    if (encrypted) {
+        wfd.reset(open(blk_dev, O_WRONLY));
+        if (wfd == -1) {
+            PLOG(ERROR) << "failed to open " << blk_dev << " for writing";
+            return kUncryptBlockOpenError;
+        }
+    }
+
+    LOG(INFO) << "mapping blocks " << partial.blocks << " to " << end_block << " of " << path;
+    BlockMapper mapper(fd, path, sb.st_size, sb.st_blksize);
+    error = map_blocks(fd, wfd, path, sb, encrypted, partial.blocks, end_block, &mapper,
+                       &partial.ranges, socket);
+    if (error != kUncryptNoError) {
+        return error;
+    }
+    if (encrypted && fsync(wfd) == -1) {
+        PLOG(ERROR) << "failed to fsync \"" << blk_dev << "\"";
+        return kUncryptFileSyncError;
+    }
+    partial.blocks = end_block;
+    error = save_partial_block_map(partial);
+    return error == kUncryptNoError ? 0 : error;
+}
+
 static void log_uncrypt_error_code(UncryptErrorCode error_code) {
     if (!android::base::WriteStringToFile(android::base::StringPrintf(
             "uncrypt_error: %d\n", error_code), UNCRYPT_STATUS)) {
@@ -580,7 +1013,7 @@ static bool clear_bcb(const int socket) {
     return true;
 }
 
-static bool setup_bcb(const int socket) {
+static bool read_message(const int socket, std::string* content) {
     // c5. receive message length
     int length;
     if (!android::base::ReadFully(socket, &length, 4)) {
@@ -590,13 +1023,44 @@ static bool setup_bcb(const int socket) {
     length = ntohl(length);
 
     // c7. receive message
-    std::string content;
-    content.resize(length);
-    if (!android::base::ReadFully(socket, &content[0], length)) {
+    content->resize(length);
+    if (!android::base::ReadFully(socket, &(*content)[0], length)) {
         PLOG(ERROR) << "failed to read the message";
         return false;
     }
-    LOG(INFO) << "  received command: [" << content << "] (" << content.size() << ")";
+    LOG(INFO) << "  received command: [" << *content << "] (" << content->size() << ")";
+    return true;
+}
+
+// The message is the path of the package being downloaded and the number of bytes of it that
+// have been fsync'ed, on two lines.
+static bool extend_map(const int socket) {
+    std::string content;
+    if (!read_message(socket, &content)) {
+        return false;
+    }
+    std::vector<std::string> lines = android::base::Split(android::base::Trim(content), "\n");
+    int64_t synced_size;
+    if (lines.size() != 2 || !android::base::ParseInt(lines[1], &synced_size, int64_t(0))) {
+        LOG(ERROR) << "invalid message to extend the block map";
+        write_status_to_socket(-1, socket);
+        return false;
+    }
+    int status = extend_block_map(lines[0].c_str(), synced_size, socket);
+    if (status != 0) {
+        LOG(ERROR) << "failed to extend the block map: " << status;
+        write_status_to_socket(-1, socket);
+        return false;
+    }
+    write_status_to_socket(100, socket);
+    return true;
+}
+
+static bool setup_bcb(const int socket) {
+    std::string content;
+    if (!read_message(socket, &content)) {
+        return false;
+    }
     std::vector<std::string> options = android::base::Split(content, "\n");
     std::string wipe_package;
     for (auto& option : options) {
@@ -610,15 +1074,21 @@ static bool setup_bcb(const int socket) {
         }
     }
 
-    // c8. setup the bcb command
+    // c8. setup the bcb command, and the wipe package along with it in a single commit
     std::string err;
-    if (!write_bootloader_message(options, &err)) {
+    MiscSession misc;
+    if (!misc.Open(&err)) {
         LOG(ERROR) << "failed to set bootloader message: " << err;
         write_status_to_socket(-1, socket);
         return false;
     }
-    if (!wipe_package.empty() && !write_wipe_package(wipe_package, &err)) {
-        PLOG(ERROR) << "failed to set wipe package: " << err;
+    *misc.boot() = {};
+    update_bootloader_message_in_struct(misc.boot(), options);
+    if (!wipe_package.empty()) {
+        misc.SetWipePackage(wipe_package);
+    }
+    if (!misc.Commit(&err)) {
+        LOG(ERROR) << "failed to set bootloader message: " << err;
         write_status_to_socket(-1, socket);
         return false;
     }
@@ -632,10 +1102,12 @@ static void usage(const char* exename) {
     fprintf(stderr, "%s [<package_path> <map_file>]  Uncrypt ota package.\n", exename);
     fprintf(stderr, "%s --clear-bcb  Clear BCB data in misc partition.\n", exename);
     fprintf(stderr, "%s --setup-bcb  Setup BCB data by command file.\n", exename);
+    fprintf(stderr, "%s --extend-map  Extend the block map of a package being downloaded.\n",
+            exename);
 }
 
 int main(int argc, char** argv) {
-    enum { UNCRYPT, SETUP_BCB, CLEAR_BCB, UNCRYPT_DEBUG } action;
+    enum { UNCRYPT, SETUP_BCB, CLEAR_BCB, EXTEND_MAP, UNCRYPT_DEBUG } action;
     const char* input_path = nullptr;
     const char* map_file = CACHE_BLOCK_MAP.c_str();
 
@@ -643,6 +1115,8 @@ int main(int argc, char** argv) {
         action = CLEAR_BCB;
     } else if (argc == 2 && strcmp(argv[1], "--setup-bcb") == 0) {
         action = SETUP_BCB;
+    } else if (argc == 2 && strcmp(argv[1], "--extend-map") == 0) {
+        action = EXTEND_MAP;
     } else if (argc == 1) {
         action = UNCRYPT;
     } else if (argc == 3) {
@@ -704,6 +1178,9 @@ int main(int argc, char** argv) {
         case CLEAR_BCB:
             success = clear_bcb(socket_fd);
             break;
+        case EXTEND_MAP:
+            success = extend_map(socket_fd);
+            break;
         default:  // Should never happen.
             LOG(ERROR) << "Invalid uncrypt action code: " << action;
             return 1;
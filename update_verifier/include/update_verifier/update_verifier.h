@@ -17,8 +17,21 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 int update_verifier(int argc, char** argv);
 
-// Exposed for testing purpose.
-bool verify_image(const std::string& care_map_name);
+struct CareMapRanges {
+  std::string partition;
+  std::string ranges;
+};
+
+// Exposed for testing purpose. If progress_name is non-empty, the blocks that have been read are
+// recorded there, and the ones recorded by an earlier attempt with the same care map are skipped.
+// With a v2 care map and a non-null deferred, only the blocks that the boot reads get verified,
+// and the rest are returned in deferred for verify_deferred().
+bool verify_image(const std::string& care_map_name, const std::string& progress_name = "",
+                  std::vector<CareMapRanges>* deferred = nullptr);
+
+// Reads the blocks left over by verify_image().
+bool verify_deferred(const std::vector<CareMapRanges>& deferred);
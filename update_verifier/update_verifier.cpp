@@ -40,13 +40,25 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <future>
+#include <iterator>
+#include <map>
+#include <memory>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <android-base/file.h>
@@ -59,12 +71,21 @@
 #include <cutils/android_reboot.h>
 
 #include "otautil/rangeset.h"
+#include "otautil/thread_pool.h"
 
 using android::sp;
 using android::hardware::boot::V1_0::IBootControl;
 using android::hardware::boot::V1_0::BoolResult;
 using android::hardware::boot::V1_0::CommandResult;
 
+// From the kernel's include/linux/ioprio.h, which isn't exported to userspace.
+static constexpr int IOPRIO_CLASS_SHIFT = 13;
+static constexpr int IOPRIO_CLASS_IDLE = 3;
+static constexpr int IOPRIO_WHO_PROCESS = 1;
+static constexpr int IOPRIO_PRIO_VALUE(int ioprio_class, int data) {
+  return (ioprio_class << IOPRIO_CLASS_SHIFT) | data;
+}
+
 // Find directories in format of "/sys/block/dm-X".
 static int dm_name_filter(const dirent* de) {
   if (android::base::StartsWith(de->d_name, "dm-")) {
@@ -73,11 +94,209 @@ static int dm_name_filter(const dirent* de) {
   return 0;
 }
 
-static bool read_blocks(const std::string& partition, const std::string& range_str) {
-  if (partition != "system" && partition != "vendor" && partition != "product") {
-    LOG(ERROR) << "Invalid partition name \"" << partition << "\"";
-    return false;
+static constexpr size_t kBlockSize = 4096;
+// The blocks read by one pread(), and the unit of work handed to the reader threads.
+static constexpr size_t kReadBlocks = 1024;
+
+enum class StorageType {
+  UNKNOWN,
+  EMMC,
+  UFS,
+  NVME,
+};
+
+struct StorageInfo {
+  StorageType type = StorageType::UNKNOWN;
+  std::string disk;
+  size_t queue_depth = 0;
+};
+
+// Returns the name of the whole disk that "/sys/class/block/|name|" lives on, following the device
+// mapper slaves (verity on top of linear, for example) and going from a partition to its disk.
+static std::string find_backing_disk(std::string name) {
+  for (int depth = 0; depth < 8 && android::base::StartsWith(name, "dm-"); depth++) {
+    std::string slaves_dir = "/sys/block/" + name + "/slaves";
+    std::unique_ptr<DIR, decltype(&closedir)> dir(opendir(slaves_dir.c_str()), closedir);
+    if (!dir) {
+      return "";
+    }
+    std::string slave;
+    dirent* de;
+    while ((de = readdir(dir.get())) != nullptr) {
+      if (de->d_name[0] != '.') {
+        slave = de->d_name;
+        break;
+      }
+    }
+    if (slave.empty()) {
+      return "";
+    }
+    name = slave;
   }
+
+  std::string sys_path = "/sys/class/block/" + name;
+  if (access((sys_path + "/partition").c_str(), F_OK) == 0) {
+    // "/sys/devices/.../block/sda/sda15": the parent directory is the disk.
+    std::unique_ptr<char, decltype(&free)> real_path(realpath(sys_path.c_str(), nullptr), free);
+    if (!real_path) {
+      return "";
+    }
+    std::string path(real_path.get());
+    size_t slash = path.rfind('/');
+    if (slash == std::string::npos || slash == 0) {
+      return "";
+    }
+    path.resize(slash);
+    return path.substr(path.rfind('/') + 1);
+  }
+  return name;
+}
+
+static StorageInfo get_storage_info(const std::string& dm_name) {
+  StorageInfo info;
+  info.disk = find_backing_disk(dm_name);
+  if (android::base::StartsWith(info.disk, "mmcblk")) {
+    info.type = StorageType::EMMC;
+  } else if (android::base::StartsWith(info.disk, "sd")) {
+    info.type = StorageType::UFS;
+  } else if (android::base::StartsWith(info.disk, "nvme")) {
+    info.type = StorageType::NVME;
+  }
+
+  // The SCSI (UFS) queue depth, or else the number of requests the block layer queues up.
+  for (const char* node : { "/device/queue_depth", "/queue/nr_requests" }) {
+    std::string content;
+    if (!info.disk.empty() &&
+        android::base::ReadFileToString("/sys/block/" + info.disk + node, &content) &&
+        android::base::ParseUint(android::base::Trim(content), &info.queue_depth) &&
+        info.queue_depth > 0) {
+      break;
+    }
+    info.queue_depth = 0;
+  }
+  return info;
+}
+
+// Picks the number of reader threads for the storage. eMMC serves one command at a time, so more
+// than a couple of readers only makes it seek between them, while UFS and NVMe need several
+// requests in flight to reach their bandwidth.
+static size_t get_reader_count(const StorageInfo& info) {
+  size_t override_count = android::base::GetUintProperty<size_t>("ro.update_verifier.readers", 0);
+  if (override_count > 0) {
+    return override_count;
+  }
+
+  size_t cpus = std::thread::hardware_concurrency() ?: 4;
+  switch (info.type) {
+    case StorageType::EMMC:
+      return 2;
+    case StorageType::UFS:
+    case StorageType::NVME:
+      if (info.queue_depth > 0) {
+        return std::max<size_t>(2, std::min<size_t>({ info.queue_depth / 4, cpus, 8 }));
+      }
+      return std::min<size_t>(cpus, 8);
+    default:
+      return std::min<size_t>(cpus, 4);
+  }
+}
+
+// The blocks that have been read successfully through dm-verity since the current slot got
+// updated, saved as they're read. If the verification gets interrupted (the device reboots or
+// update_verifier gets killed before it marks the slot), the next attempt reads only the rest.
+// The record is only reused for the same slot and the same care map, so a new update starts over.
+struct VerifyProgress {
+  std::string path;
+  std::string key;
+  std::map<std::string, std::vector<Range>> verified;
+
+  void Load();
+  void Save() const;
+};
+
+static constexpr auto kProgressInterval = std::chrono::seconds(2);
+
+// Sorts the ranges and merges the overlapping or adjacent ones.
+static std::vector<Range> merge_ranges(std::vector<Range> ranges) {
+  std::sort(ranges.begin(), ranges.end());
+  std::vector<Range> merged;
+  for (const auto& range : ranges) {
+    if (!merged.empty() && range.first <= merged.back().second) {
+      merged.back().second = std::max(merged.back().second, range.second);
+    } else {
+      merged.push_back(range);
+    }
+  }
+  return merged;
+}
+
+// Returns the parts of |ranges| that aren't in |verified|, which must be sorted and merged.
+static std::vector<Range> subtract_ranges(const RangeSet& ranges,
+                                          const std::vector<Range>& verified) {
+  std::vector<Range> result;
+  for (const auto& range : ranges) {
+    size_t start = range.first;
+    auto it = std::upper_bound(verified.begin(), verified.end(), Range(start, SIZE_MAX));
+    if (it != verified.begin() && std::prev(it)->second > start) {
+      --it;
+    }
+    for (; it != verified.end() && it->first < range.second && start < range.second; ++it) {
+      if (it->first > start) {
+        result.emplace_back(start, it->first);
+      }
+      start = std::max(start, it->second);
+    }
+    if (start < range.second) {
+      result.emplace_back(start, range.second);
+    }
+  }
+  return result;
+}
+
+void VerifyProgress::Load() {
+  std::string content;
+  if (path.empty() || !android::base::ReadFileToString(path, &content)) {
+    return;
+  }
+  std::vector<std::string> lines = android::base::Split(android::base::Trim(content), "\n");
+  if (lines.empty() || lines[0] != key || lines.size() % 2 != 1) {
+    LOG(INFO) << "Ignoring the verification progress in " << path << " from an earlier update";
+    return;
+  }
+  for (size_t i = 1; i < lines.size(); i += 2) {
+    RangeSet ranges = RangeSet::Parse(lines[i + 1]);
+    if (!ranges) {
+      LOG(WARNING) << "Ignoring malformed verification progress in " << path;
+      verified.clear();
+      return;
+    }
+    verified[lines[i]] = merge_ranges(std::vector<Range>(ranges.begin(), ranges.end()));
+  }
+}
+
+void VerifyProgress::Save() const {
+  if (path.empty()) {
+    return;
+  }
+  std::string content = key + "\n";
+  for (const auto& entry : verified) {
+    if (!entry.second.empty()) {
+      content += entry.first + "\n" + RangeSet(std::vector<Range>(entry.second)).ToString() + "\n";
+    }
+  }
+  // Write the new record aside and rename it over, so that an interruption keeps the old one.
+  std::string tmp_path = path + ".tmp";
+  android::base::unique_fd fd(
+      TEMP_FAILURE_RETRY(open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)));
+  if (fd.get() == -1 || !android::base::WriteStringToFd(content, fd.get()) ||
+      fsync(fd.get()) != 0 || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    PLOG(WARNING) << "Failed to save the verification progress to " << path;
+    unlink(tmp_path.c_str());
+  }
+}
+
+// Returns the dm-X name of the device mapper node of |partition|, or an empty string.
+static std::string find_dm_device(const std::string& partition) {
   // Iterate the content of "/sys/block/dm-X/dm/name". If it matches one of "system", "vendor" or
   // "product", then dm-X is a dm-wrapped device for that target. We will later read all the
   // ("cared") blocks from "/dev/block/dm-X" to ensure the target partition's integrity.
@@ -86,16 +305,15 @@ static bool read_blocks(const std::string& partition, const std::string& range_s
   int n = scandir(DM_PATH_PREFIX, &namelist, dm_name_filter, alphasort);
   if (n == -1) {
     PLOG(ERROR) << "Failed to scan dir " << DM_PATH_PREFIX;
-    return false;
+    return "";
   }
   if (n == 0) {
     LOG(ERROR) << "dm block device not found for " << partition;
-    return false;
+    return "";
   }
 
   static constexpr auto DM_PATH_SUFFIX = "/dm/name";
-  static constexpr auto DEV_PATH = "/dev/block/";
-  std::string dm_block_device;
+  std::string dm_name;
   while (n--) {
     std::string path = DM_PATH_PREFIX + std::string(namelist[n]->d_name) + DM_PATH_SUFFIX;
     std::string content;
@@ -110,7 +328,7 @@ static bool read_blocks(const std::string& partition, const std::string& range_s
       }
 #endif
       if (dm_block_name == partition) {
-        dm_block_device = DEV_PATH + std::string(namelist[n]->d_name);
+        dm_name = namelist[n]->d_name;
         while (n--) {
           free(namelist[n]);
         }
@@ -121,71 +339,300 @@ static bool read_blocks(const std::string& partition, const std::string& range_s
   }
   free(namelist);
 
-  if (dm_block_device.empty()) {
+  if (dm_name.empty()) {
     LOG(ERROR) << "Failed to find dm block device for " << partition;
-    return false;
   }
+  return dm_name;
+}
 
-  // For block range string, first integer 'count' equals 2 * total number of valid ranges,
-  // followed by 'count' number comma separated integers. Every two integers reprensent a
-  // block range with the first number included in range but second number not included.
-  // For example '4,64536,65343,74149,74150' represents: [64536,65343) and [74149,74150).
-  RangeSet ranges = RangeSet::Parse(range_str);
-  if (!ranges) {
-    LOG(ERROR) << "Error parsing RangeSet string " << range_str;
-    return false;
+// The blocks of one care map entry that are left to read.
+struct ReadJob {
+  std::string partition;
+  std::string dm_block_device;
+  // The index of the disk that the partition lives on, in ReadPlan::disks.
+  size_t disk;
+  // The kReadBlocks-sized chunks of the ranges, and the index of the first one in ReadPlan::chunks.
+  std::vector<Range> chunks;
+  size_t first_chunk;
+  size_t blocks;
+};
+
+// The jobs that read from one disk, and the chunks of them in the order they get read.
+struct DiskQueue {
+  StorageInfo storage;
+  size_t readers;
+  std::vector<size_t> chunks;
+  std::atomic<size_t> next{ 0 };
+};
+
+// A single schedule for all the partitions, so that the readers go from one partition to the next
+// without waiting for the slowest reader, and the small partitions don't leave the readers idle.
+struct ReadPlan {
+  std::vector<ReadJob> jobs;
+  std::vector<std::unique_ptr<DiskQueue>> disks;
+  // The job of each chunk, and whether it's been read.
+  std::vector<size_t> chunk_jobs;
+  std::unique_ptr<std::atomic<bool>[]> chunk_done;
+};
+
+// A reader's descriptor of a device mapper node.
+struct ReaderDevice {
+  android::base::unique_fd fd;
+  bool direct;
+};
+
+// Reads the blocks of |range| from |job|'s device into |buf|.
+static bool read_chunk(const ReadJob& job, const Range& range, ReaderDevice* device,
+                       uint8_t* buf) {
+  size_t range_start = range.first;
+  size_t range_end = range.second;
+  if (!device->direct) {
+    posix_fadvise(device->fd.get(), static_cast<off64_t>(range_start) * kBlockSize,
+                  (range_end - range_start) * kBlockSize, POSIX_FADV_SEQUENTIAL);
   }
 
-  // RangeSet::Split() splits the ranges into multiple groups with same number of blocks (except for
-  // the last group).
-  size_t thread_num = std::thread::hardware_concurrency() ?: 4;
-  std::vector<RangeSet> groups = ranges.Split(thread_num);
+  size_t done = 0;
+  size_t to_read = (range_end - range_start) * kBlockSize;
+  while (done < to_read) {
+    off64_t offset = static_cast<off64_t>(range_start) * kBlockSize + done;
+    ssize_t r = TEMP_FAILURE_RETRY(pread64(device->fd.get(), buf, to_read - done, offset));
+    if (r == -1 && errno == EINVAL && device->direct) {
+      // The device doesn't take direct I/O after all; read through the page cache instead.
+      PLOG(WARNING) << "O_DIRECT read of " << job.dm_block_device << " failed; retrying";
+      device->direct = false;
+      device->fd.reset(TEMP_FAILURE_RETRY(open(job.dm_block_device.c_str(), O_RDONLY)));
+      if (device->fd.get() == -1) {
+        PLOG(ERROR) << "Error reading " << job.dm_block_device << " for partition "
+                    << job.partition;
+        return false;
+      }
+      continue;
+    }
+    if (r <= 0) {
+      PLOG(ERROR) << "Failed to read blocks " << range_start << " to " << range_end << " of "
+                  << job.partition;
+      return false;
+    }
+    done += r;
+  }
+  return true;
+}
 
-  std::vector<std::future<bool>> threads;
-  for (const auto& group : groups) {
-    auto thread_func = [&group, &dm_block_device, &partition]() {
-      android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(dm_block_device.c_str(), O_RDONLY)));
-      if (fd.get() == -1) {
-        PLOG(ERROR) << "Error reading " << dm_block_device << " for partition " << partition;
+// Reads the blocks of the care map entries in |first|, and then the ones in |then|, that haven't
+// been verified yet. All the partitions share one pool of readers: each disk gets as many of them
+// as its queue depth calls for (see get_reader_count()), and they take the chunks of the disk in
+// the order of the two lists, the partitions with the most blocks to read first within each.
+static bool read_blocks(const std::vector<CareMapRanges>& first,
+                        const std::vector<CareMapRanges>& then, VerifyProgress* progress) {
+  ReadPlan plan;
+  // The verified blocks of each partition as of the start.
+  std::map<std::string, std::vector<Range>> previously_verified;
+  std::map<std::string, size_t> disk_indices;
+  size_t first_jobs = 0;
+  for (const auto* entries : { &first, &then }) {
+    for (const auto& entry : *entries) {
+      const std::string& partition = entry.partition;
+      if (partition != "system" && partition != "vendor" && partition != "product") {
+        LOG(ERROR) << "Invalid partition name \"" << partition << "\"";
+        return false;
+      }
+      std::string dm_name = find_dm_device(partition);
+      if (dm_name.empty()) {
         return false;
       }
 
-      static constexpr size_t kBlockSize = 4096;
-      std::vector<uint8_t> buf(1024 * kBlockSize);
+      // For block range string, first integer 'count' equals 2 * total number of valid ranges,
+      // followed by 'count' number comma separated integers. Every two integers reprensent a
+      // block range with the first number included in range but second number not included.
+      // For example '4,64536,65343,74149,74150' represents: [64536,65343) and [74149,74150).
+      RangeSet ranges = RangeSet::Parse(entry.ranges);
+      if (!ranges) {
+        LOG(ERROR) << "Error parsing RangeSet string " << entry.ranges;
+        return false;
+      }
+
+      if (previously_verified.find(partition) == previously_verified.end()) {
+        previously_verified[partition] = progress->verified[partition];
+      }
+      ReadJob job;
+      job.partition = partition;
+      job.dm_block_device = "/dev/block/" + dm_name;
+      job.blocks = 0;
+      for (const auto& range : subtract_ranges(ranges, previously_verified[partition])) {
+        for (size_t start = range.first; start < range.second; start += kReadBlocks) {
+          job.chunks.emplace_back(start, std::min(start + kReadBlocks, range.second));
+        }
+        job.blocks += range.second - range.first;
+      }
+      if (job.blocks < ranges.blocks()) {
+        LOG(INFO) << "Skipping " << ranges.blocks() - job.blocks << " blocks of " << partition
+                  << " verified by an earlier attempt";
+      }
+      if (job.chunks.empty()) {
+        continue;
+      }
+
+      StorageInfo storage = get_storage_info(dm_name);
+      std::string disk_key = storage.disk.empty() ? dm_name : storage.disk;
+      auto disk = disk_indices.find(disk_key);
+      if (disk == disk_indices.end()) {
+        disk = disk_indices.emplace(disk_key, plan.disks.size()).first;
+        plan.disks.emplace_back(new DiskQueue);
+        plan.disks.back()->storage = storage;
+      }
+      job.disk = disk->second;
+      plan.jobs.push_back(std::move(job));
+    }
+    if (entries == &first) {
+      first_jobs = plan.jobs.size();
+    }
+  }
+  if (plan.jobs.empty()) {
+    return true;
+  }
+
+  // Largest first, without moving a job ahead of a higher priority one.
+  std::vector<size_t> order(plan.jobs.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  auto larger = [&plan](size_t a, size_t b) { return plan.jobs[a].blocks > plan.jobs[b].blocks; };
+  std::stable_sort(order.begin(), order.begin() + first_jobs, larger);
+  std::stable_sort(order.begin() + first_jobs, order.end(), larger);
+
+  size_t total_blocks = 0;
+  for (size_t i = 0; i < plan.jobs.size(); i++) {
+    ReadJob& job = plan.jobs[i];
+    job.first_chunk = plan.chunk_jobs.size();
+    plan.chunk_jobs.insert(plan.chunk_jobs.end(), job.chunks.size(), i);
+    total_blocks += job.blocks;
+  }
+  for (size_t i : order) {
+    const ReadJob& job = plan.jobs[i];
+    std::vector<size_t>& chunks = plan.disks[job.disk]->chunks;
+    for (size_t c = 0; c < job.chunks.size(); c++) {
+      chunks.push_back(job.first_chunk + c);
+    }
+  }
+  plan.chunk_done.reset(new std::atomic<bool>[plan.chunk_jobs.size()]);
+  for (size_t i = 0; i < plan.chunk_jobs.size(); i++) {
+    plan.chunk_done[i] = false;
+  }
+
+  // The blocks are read exactly once, so skip the page cache when the device allows it.
+  bool direct_io = android::base::GetBoolProperty("ro.update_verifier.direct_io", true);
+  size_t thread_num = 0;
+  for (auto& disk : plan.disks) {
+    disk->readers = std::min(get_reader_count(disk->storage), disk->chunks.size());
+    thread_num += disk->readers;
+  }
+  for (const auto& job : plan.jobs) {
+    const StorageInfo& storage = plan.disks[job.disk]->storage;
+    LOG(INFO) << "Reading " << job.blocks << " blocks of " << job.partition << " from "
+              << job.dm_block_device << " (disk "
+              << (storage.disk.empty() ? "unknown" : storage.disk) << ", queue depth "
+              << storage.queue_depth << ", " << plan.disks[job.disk]->readers << " readers)"
+              << (direct_io ? " with O_DIRECT" : "");
+  }
 
-      size_t block_count = 0;
-      for (const auto& range : group) {
-        size_t range_start = range.first;
-        size_t range_end = range.second;
-        if (lseek64(fd.get(), static_cast<off64_t>(range_start) * kBlockSize, SEEK_SET) == -1) {
-          PLOG(ERROR) << "lseek to " << range_start << " failed";
+  // Adds the chunks read so far to the record, and saves it.
+  size_t chunks_saved = 0;
+  auto save_progress = [&]() {
+    std::map<std::string, std::vector<Range>> done;
+    size_t done_count = 0;
+    for (size_t i = 0; i < plan.chunk_jobs.size(); i++) {
+      if (plan.chunk_done[i]) {
+        const ReadJob& job = plan.jobs[plan.chunk_jobs[i]];
+        done[job.partition].push_back(job.chunks[i - job.first_chunk]);
+        done_count++;
+      }
+    }
+    if (done_count == chunks_saved) {
+      return;
+    }
+    chunks_saved = done_count;
+    for (auto& entry : done) {
+      const std::vector<Range>& previous = previously_verified[entry.first];
+      entry.second.insert(entry.second.end(), previous.begin(), previous.end());
+      progress->verified[entry.first] = merge_ranges(std::move(entry.second));
+    }
+    progress->Save();
+  };
+
+  auto start_time = std::chrono::steady_clock::now();
+  // The readers mostly wait for the devices, so they get a pool of their own rather than sharing
+  // the one sized for the CPUs.
+  ThreadPool readers(thread_num);
+  std::atomic<bool> failed(false);
+  std::vector<std::future<bool>> threads;
+  for (auto& disk_ptr : plan.disks) {
+    DiskQueue* disk = disk_ptr.get();
+    for (size_t i = 0; i < disk->readers; i++) {
+      auto thread_func = [&plan, &failed, direct_io, disk]() {
+        // O_DIRECT needs a block-aligned buffer.
+        void* buf_ptr;
+        if (posix_memalign(&buf_ptr, kBlockSize, kReadBlocks * kBlockSize) != 0) {
+          LOG(ERROR) << "Failed to allocate the read buffer";
+          failed = true;
           return false;
         }
+        std::unique_ptr<uint8_t, decltype(&free)> buf(static_cast<uint8_t*>(buf_ptr), free);
+
+        std::map<std::string, ReaderDevice> devices;
+        size_t block_count = 0;
+        size_t index;
+        while (!failed && (index = disk->next.fetch_add(1)) < disk->chunks.size()) {
+          size_t chunk = disk->chunks[index];
+          const ReadJob& job = plan.jobs[plan.chunk_jobs[chunk]];
+          auto device = devices.find(job.dm_block_device);
+          if (device == devices.end()) {
+            ReaderDevice opened;
+            opened.direct = direct_io;
+            opened.fd.reset(TEMP_FAILURE_RETRY(
+                open(job.dm_block_device.c_str(), O_RDONLY | (direct_io ? O_DIRECT : 0))));
+            if (opened.fd.get() == -1 && direct_io) {
+              opened.direct = false;
+              opened.fd.reset(TEMP_FAILURE_RETRY(open(job.dm_block_device.c_str(), O_RDONLY)));
+            }
+            if (opened.fd.get() == -1) {
+              PLOG(ERROR) << "Error reading " << job.dm_block_device << " for partition "
+                          << job.partition;
+              failed = true;
+              return false;
+            }
+            device = devices.emplace(job.dm_block_device, std::move(opened)).first;
+          }
 
-        size_t remain = (range_end - range_start) * kBlockSize;
-        while (remain > 0) {
-          size_t to_read = std::min(remain, 1024 * kBlockSize);
-          if (!android::base::ReadFully(fd.get(), buf.data(), to_read)) {
-            PLOG(ERROR) << "Failed to read blocks " << range_start << " to " << range_end;
+          const Range& range = job.chunks[chunk - job.first_chunk];
+          if (!read_chunk(job, range, &device->second, buf.get())) {
+            failed = true;
             return false;
           }
-          remain -= to_read;
+          plan.chunk_done[chunk] = true;
+          block_count += range.second - range.first;
         }
-        block_count += (range_end - range_start);
-      }
-      LOG(INFO) << "Finished reading " << block_count << " blocks on " << dm_block_device;
-      return true;
-    };
+        LOG(INFO) << "Finished reading " << block_count << " blocks on disk "
+                  << (disk->storage.disk.empty() ? "unknown" : disk->storage.disk);
+        return !failed;
+      };
 
-    threads.emplace_back(std::async(std::launch::async, thread_func));
+      threads.push_back(readers.Async(thread_func));
+    }
   }
 
   bool ret = true;
   for (auto& t : threads) {
+    while (t.wait_for(kProgressInterval) != std::future_status::ready) {
+      save_progress();
+    }
     ret = t.get() && ret;
   }
-  LOG(INFO) << "Finished reading blocks on " << dm_block_device << " with " << thread_num
-            << " threads.";
+  save_progress();
+  std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start_time;
+  double mib = static_cast<double>(total_blocks) * kBlockSize / (1024 * 1024);
+  LOG(INFO) << "Finished reading blocks of " << plan.jobs.size() << " care map entries with "
+            << thread_num << " threads: " << mib << " MiB in " << duration.count() << " s ("
+            << (duration.count() > 0 ? mib / duration.count() : 0) << " MiB/s).";
   return ret;
 }
 
@@ -196,7 +643,8 @@ static bool read_blocks(const std::string& partition, const std::string& range_s
 // the care_map format between N and O. An O update_verifier would fail to work with N
 // care_map.txt. This could be a result of sideloading an O OTA while the device having a pending N
 // update.
-bool verify_image(const std::string& care_map_name) {
+bool verify_image(const std::string& care_map_name, const std::string& progress_name,
+                  std::vector<CareMapRanges>* deferred) {
   android::base::unique_fd care_map_fd(TEMP_FAILURE_RETRY(open(care_map_name.c_str(), O_RDONLY)));
   // If the device is flashed before the current boot, it may not have care_map.txt
   // in /data/ota_package. To allow the device to continue booting in this situation,
@@ -216,25 +664,105 @@ bool verify_image(const std::string& care_map_name) {
 
   std::vector<std::string> lines;
   lines = android::base::Split(android::base::Trim(file_content), "\n");
-  if (lines.size() != 2 && lines.size() != 4 && lines.size() != 6) {
-    LOG(ERROR) << "Invalid lines in care_map: found " << lines.size()
-               << " lines, expecting 2 or 4 or 6 lines.";
-    return false;
-  }
 
-  for (size_t i = 0; i < lines.size(); i += 2) {
-    // We're seeing an N care_map.txt. Skip the verification since it's not compatible with O
-    // update_verifier (the last few metadata blocks can't be read via device mapper).
-    if (android::base::StartsWith(lines[i], "/dev/block/")) {
-      LOG(WARNING) << "Found legacy care_map.txt; skipped.";
-      return true;
+  // The ranges to read before returning, and the ones that may be left for after the boot.
+  std::vector<CareMapRanges> critical;
+  std::vector<CareMapRanges> rest;
+  if (!lines.empty() && lines[0] == "2") {
+    // A v2 care map has a version line, followed by up to three triplets: the partition name, the
+    // ranges of all the blocks to verify, and the subset of them that the boot reads ("-" for
+    // none). The latter are read first.
+    if (lines.size() != 4 && lines.size() != 7 && lines.size() != 10) {
+      LOG(ERROR) << "Invalid lines in v2 care_map: found " << lines.size()
+                 << " lines, expecting 4 or 7 or 10 lines.";
+      return false;
     }
-    if (!read_blocks(lines[i], lines[i+1])) {
+    for (size_t i = 1; i < lines.size(); i += 3) {
+      if (lines[i + 2] == "-") {
+        rest.push_back({ lines[i], lines[i + 1] });
+        continue;
+      }
+      RangeSet all = RangeSet::Parse(lines[i + 1]);
+      RangeSet boot = RangeSet::Parse(lines[i + 2]);
+      if (!all || !boot) {
+        LOG(ERROR) << "Error parsing the ranges of " << lines[i] << " in care_map";
+        return false;
+      }
+      critical.push_back({ lines[i], lines[i + 2] });
+      std::vector<Range> remaining = subtract_ranges(
+          all, merge_ranges(std::vector<Range>(boot.begin(), boot.end())));
+      if (!remaining.empty()) {
+        rest.push_back({ lines[i], RangeSet(std::move(remaining)).ToString() });
+      }
+    }
+  } else {
+    if (lines.size() != 2 && lines.size() != 4 && lines.size() != 6) {
+      LOG(ERROR) << "Invalid lines in care_map: found " << lines.size()
+                 << " lines, expecting 2 or 4 or 6 lines.";
       return false;
     }
+    for (size_t i = 0; i < lines.size(); i += 2) {
+      // We're seeing an N care_map.txt. Skip the verification since it's not compatible with O
+      // update_verifier (the last few metadata blocks can't be read via device mapper).
+      if (android::base::StartsWith(lines[i], "/dev/block/")) {
+        LOG(WARNING) << "Found legacy care_map.txt; skipped.";
+        return true;
+      }
+      critical.push_back({ lines[i], lines[i + 1] });
+    }
   }
 
-  return true;
+  VerifyProgress progress;
+  progress.path = progress_name;
+  progress.key = "v1 " + android::base::GetProperty("ro.boot.slot_suffix", "") + " " +
+                 std::to_string(file_content.size()) + " " +
+                 std::to_string(std::hash<std::string>()(file_content));
+  progress.Load();
+
+  if (deferred != nullptr) {
+    *deferred = std::move(rest);
+    rest.clear();
+  }
+  // Without deferred, the rest goes in the same pass, after the blocks that the boot reads.
+  return read_blocks(critical, rest, &progress);
+}
+
+bool verify_deferred(const std::vector<CareMapRanges>& deferred) {
+  // The slot has been marked by now, so there's no point in keeping a record of the progress.
+  VerifyProgress progress;
+  return read_blocks(deferred, {}, &progress);
+}
+
+static constexpr auto VERIFY_PROGRESS_FILE = "/data/ota_package/care_map.progress";
+
+// Verifies the blocks of a v2 care map that the boot doesn't depend on, in a child process at
+// idle I/O priority, so that init can carry on with the boot. Those blocks are still read through
+// dm-verity, which acts on any corruption according to its mode.
+static void verify_in_background(const std::vector<CareMapRanges>& deferred) {
+  pid_t pid = fork();
+  if (pid == -1) {
+    PLOG(WARNING) << "Failed to fork; skipping the verification of the remaining blocks";
+    return;
+  }
+  if (pid > 0) {
+    LOG(INFO) << "Verifying the remaining blocks in process " << pid;
+    return;
+  }
+
+  setsid();
+  if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)) ==
+      -1) {
+    PLOG(WARNING) << "Failed to lower the I/O priority";
+  }
+  if (setpriority(PRIO_PROCESS, 0, 19) == -1) {
+    PLOG(WARNING) << "Failed to lower the priority";
+  }
+  if (!verify_deferred(deferred)) {
+    LOG(ERROR) << "Failed to verify the remaining blocks in care map file.";
+    _exit(1);
+  }
+  LOG(INFO) << "Finished verifying the remaining blocks.";
+  _exit(0);
 }
 
 static int reboot_device() {
@@ -263,6 +791,7 @@ int update_verifier(int argc, char** argv) {
 
   if (is_successful == BoolResult::FALSE) {
     // The current slot has not booted successfully.
+    std::vector<CareMapRanges> deferred;
 
 #if defined(PRODUCT_SUPPORTS_VERITY) || defined(BOARD_AVB_ENABLE)
     bool skip_verification = false;
@@ -291,7 +820,7 @@ int update_verifier(int argc, char** argv) {
 
     if (!skip_verification) {
       static constexpr auto CARE_MAP_FILE = "/data/ota_package/care_map.txt";
-      if (!verify_image(CARE_MAP_FILE)) {
+      if (!verify_image(CARE_MAP_FILE, VERIFY_PROGRESS_FILE, &deferred)) {
         LOG(ERROR) << "Failed to verify all blocks in care map file.";
         return reboot_device();
       }
@@ -307,6 +836,13 @@ int update_verifier(int argc, char** argv) {
       return reboot_device();
     }
     LOG(INFO) << "Marked slot " << current_slot << " as booted successfully.";
+    if (unlink(VERIFY_PROGRESS_FILE) == -1 && errno != ENOENT) {
+      PLOG(WARNING) << "Failed to remove " << VERIFY_PROGRESS_FILE;
+    }
+
+    if (!deferred.empty()) {
+      verify_in_background(deferred);
+    }
   }
 
   LOG(INFO) << "Leaving update_verifier.";
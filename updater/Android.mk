@@ -48,6 +48,7 @@ updater_common_static_libraries := \
     libcutils \
     libtune2fs \
     libbrotli \
+    liblz4 \
     libziparchive \
     $(tune2fs_static_libraries)
 
@@ -139,3 +140,25 @@ inc :=
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 
 include $(BUILD_EXECUTABLE)
+
+# blockio_replay (static executable)
+# ===============================
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := blockio_replay
+
+LOCAL_SRC_FILES := \
+    blockio_replay.cpp
+
+LOCAL_CFLAGS := \
+    -Wall \
+    -Werror
+
+LOCAL_STATIC_LIBRARIES := \
+    libotautil \
+    libbase \
+    liblog
+
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+
+include $(BUILD_EXECUTABLE)
@@ -26,6 +26,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/sysinfo.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
@@ -33,30 +35,53 @@
 #include <unistd.h>
 #include <fec/io.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <functional>
+#include <future>
+#include <iterator>
 #include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/macros.h>
 #include <android-base/parseint.h>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <applypatch/applypatch.h>
 #include <brotli/decode.h>
+#include <lz4.h>
 #include <openssl/sha.h>
 #include <private/android_filesystem_config.h>
 #include <ziparchive/zip_archive.h>
 
 #include "edify/expr.h"
+#include "otafault/config.h"
 #include "otafault/ota_io.h"
+#include "otautil/SysUtil.h"
+#include "otautil/ThermalUtil.h"
+#include "otautil/block_io_trace.h"
 #include "otautil/cache_location.h"
 #include "otautil/error_code.h"
+#include "otautil/io_uring.h"
+#include "otautil/memory_budget.h"
 #include "otautil/print_sha1.h"
 #include "otautil/rangeset.h"
+#include "otautil/ring_buffer.h"
+#include "otautil/thread_pool.h"
+#include "updater/blockimg.h"
 #include "updater/install.h"
 #include "updater/updater.h"
 
@@ -69,21 +94,63 @@ static constexpr size_t BLOCKSIZE = 4096;
 static constexpr mode_t STASH_DIRECTORY_MODE = 0700;
 static constexpr mode_t STASH_FILE_MODE = 0600;
 
-static CauseCode failure_type = kNoCause;
-static bool is_retry = false;
-static std::unordered_map<std::string, RangeSet> stash_map;
+// The outcome of a block image update that's shared by all the threads working for it. Each update
+// has its own, as several of them may run at once (block_image_update_multi(), parallel()).
+struct UpdateStatus {
+  // The cause of the last failure, set by the worker threads as well.
+  std::atomic<CauseCode> failure_type{ kNoCause };
+  bool is_retry = false;
+};
+
+// The update the calling thread works for, or null outside of one.
+static thread_local UpdateStatus* update_status = nullptr;
+
+// Makes the calling thread work for |status| within a scope, which the threads that execute
+// commands for an update take on from the thread that hands them out.
+class ScopedUpdateStatus {
+ public:
+  explicit ScopedUpdateStatus(UpdateStatus* status) : previous_(update_status) {
+    update_status = status;
+  }
+
+  ~ScopedUpdateStatus() {
+    update_status = previous_;
+  }
+
+ private:
+  UpdateStatus* previous_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedUpdateStatus);
+};
+
+static void SetFailureType(CauseCode cause) {
+  if (update_status != nullptr) {
+    update_status->failure_type = cause;
+  }
+}
+
+// Only accessed by the thread that executes the serial commands of an update. Each partition has
+// its own when several of them are updated concurrently.
+static thread_local std::unordered_map<std::string, RangeSet> stash_map;
+
+// The file next to the last command file with the commands completed after the last command index.
+static std::string CompletedCommandsFile(const std::string& last_command_file) {
+  return last_command_file + ".completed";
+}
 
-static void DeleteLastCommandFile() {
-  std::string last_command_file = CacheLocation::location().last_command_file();
+static void DeleteLastCommandFile(const std::string& last_command_file) {
   if (unlink(last_command_file.c_str()) == -1 && errno != ENOENT) {
     PLOG(ERROR) << "Failed to unlink: " << last_command_file;
   }
+  std::string completed_file = CompletedCommandsFile(last_command_file);
+  if (unlink(completed_file.c_str()) == -1 && errno != ENOENT) {
+    PLOG(ERROR) << "Failed to unlink: " << completed_file;
+  }
 }
 
 // Parse the last command index of the last update and save the result to |last_command_index|.
 // Return true if we successfully read the index.
-static bool ParseLastCommandFile(int* last_command_index) {
-  std::string last_command_file = CacheLocation::location().last_command_file();
+static bool ParseLastCommandFile(const std::string& last_command_file, int* last_command_index) {
   android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(last_command_file.c_str(), O_RDONLY)));
   if (fd == -1) {
     if (errno != ENOENT) {
@@ -116,12 +183,10 @@ static bool ParseLastCommandFile(int* last_command_index) {
   return true;
 }
 
-// Update the last command index in the last_command_file if the current command writes to the
-// stash either explicitly or implicitly.
-static bool UpdateLastCommandIndex(int command_index, const std::string& command_string) {
-  std::string last_command_file = CacheLocation::location().last_command_file();
+// Replaces |last_command_file| (or the file next to it) with |content|, which is synced to disk
+// along with the directory.
+static bool WriteLastCommandFile(const std::string& last_command_file, const std::string& content) {
   std::string last_command_tmp = last_command_file + ".tmp";
-  std::string content = std::to_string(command_index) + "\n" + command_string;
   android::base::unique_fd wfd(
       TEMP_FAILURE_RETRY(open(last_command_tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0660)));
   if (wfd == -1 || !android::base::WriteStringToFd(content, wfd)) {
@@ -160,16 +225,142 @@ static bool UpdateLastCommandIndex(int command_index, const std::string& command
   return true;
 }
 
+// Update the last command index in the last_command_file if the current command writes to the
+// stash either explicitly or implicitly.
+static bool UpdateLastCommandIndex(const std::string& last_command_file, int command_index,
+                                   const std::string& command_string) {
+  return WriteLastCommandFile(last_command_file,
+                              std::to_string(command_index) + "\n" + command_string);
+}
+
+// The completed commands file holds the SHA-1 of the transfer list and the number of commands on
+// its first line, followed by a bitmap with a bit for each command index.
+static bool WriteCompletedCommands(const std::string& last_command_file,
+                                   const std::string& transfer_list_digest,
+                                   const std::vector<bool>& completed) {
+  std::string content = transfer_list_digest + " " + std::to_string(completed.size()) + "\n";
+  std::string bitmap((completed.size() + 7) / 8, '\0');
+  for (size_t i = 0; i < completed.size(); i++) {
+    if (completed[i]) {
+      bitmap[i / 8] |= 1 << (i % 8);
+    }
+  }
+  return WriteLastCommandFile(CompletedCommandsFile(last_command_file), content + bitmap);
+}
+
+// Reads the commands completed by the last update into |completed|, which is left empty if there
+// are none, or if they were recorded for a different transfer list.
+static void ParseCompletedCommands(const std::string& last_command_file,
+                                   const std::string& transfer_list_digest, size_t commands,
+                                   std::vector<bool>* completed) {
+  completed->clear();
+  std::string content;
+  if (!android::base::ReadFileToString(CompletedCommandsFile(last_command_file), &content)) {
+    return;
+  }
+  std::string header = transfer_list_digest + " " + std::to_string(commands) + "\n";
+  if (!android::base::StartsWith(content, header) ||
+      content.size() != header.size() + (commands + 7) / 8) {
+    LOG(WARNING) << "Ignoring the completed commands of a different transfer list";
+    return;
+  }
+  completed->resize(commands);
+  for (size_t i = 0; i < commands; i++) {
+    (*completed)[i] = (content[header.size() + i / 8] >> (i % 8)) & 1;
+  }
+}
+
+// Allocates the block buffers aligned to BLOCKSIZE, so that they can be used for O_DIRECT I/O.
+template <typename T>
+struct BlockAlignedAllocator {
+  using value_type = T;
+
+  BlockAlignedAllocator() = default;
+  template <typename U>
+  BlockAlignedAllocator(const BlockAlignedAllocator<U>&) {}
+
+  // Goes through the memory budget, which gets the caches to give memory back first if it's short.
+  // The allocation goes ahead regardless, as the command can't do without the buffer.
+  T* allocate(size_t n) {
+    if (!MemoryBudget::Instance().Acquire(n * sizeof(T))) {
+      LOG(WARNING) << "Allocating " << n * sizeof(T) << " bytes with the memory short";
+    }
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, BLOCKSIZE, std::max<size_t>(n * sizeof(T), 1)) != 0) {
+      LOG(FATAL) << "Failed to allocate " << n * sizeof(T) << " bytes";
+    }
+    return static_cast<T*>(ptr);
+  }
+
+  void deallocate(T* ptr, size_t n) {
+    free(ptr);
+    MemoryBudget::Instance().Release(n * sizeof(T));
+  }
+
+  // Leaves the bytes uninitialized when a buffer grows, as they're always filled by the reads or
+  // copies that follow.
+  template <typename U>
+  void construct(U* ptr) {
+    ::new (static_cast<void*>(ptr)) U;
+  }
+  template <typename U, typename... Args>
+  void construct(U* ptr, Args&&... args) {
+    ::new (static_cast<void*>(ptr)) U(std::forward<Args>(args)...);
+  }
+
+  template <typename U>
+  bool operator==(const BlockAlignedAllocator<U>&) const {
+    return true;
+  }
+  template <typename U>
+  bool operator!=(const BlockAlignedAllocator<U>&) const {
+    return false;
+  }
+};
+
+using BlockBuffer = std::vector<uint8_t, BlockAlignedAllocator<uint8_t>>;
+
+// Records the block I/O operation spanning its lifetime, if a trace is being taken and |fd| is the
+// traced device. An |offset| of -1 stands for the current offset of |fd|.
+class TracedIo {
+ public:
+  TracedIo(int fd, uint8_t op, off64_t offset, uint64_t length)
+      : trace_(BlockIoTrace::Get()), fd_(fd), op_(op), offset_(offset), length_(length) {
+    if (trace_ != nullptr) {
+      if (offset_ == -1) {
+        offset_ = lseek64(fd_, 0, SEEK_CUR);
+      }
+      start_ns_ = trace_->Now();
+    }
+  }
+  ~TracedIo() {
+    if (trace_ != nullptr && offset_ >= 0) {
+      trace_->Record(fd_, op_, offset_, length_, start_ns_);
+    }
+  }
+
+ private:
+  BlockIoTrace* trace_;
+  int fd_;
+  uint8_t op_;
+  off64_t offset_;
+  uint64_t length_;
+  uint64_t start_ns_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(TracedIo);
+};
+
 static int read_all(int fd, uint8_t* data, size_t size) {
+    TracedIo traced(fd, BlockIoRecord::kRead, -1, size);
     size_t so_far = 0;
     while (so_far < size) {
         ssize_t r = TEMP_FAILURE_RETRY(ota_read(fd, data+so_far, size-so_far));
         if (r == -1) {
-            failure_type = kFreadFailure;
+            SetFailureType(kFreadFailure);
             PLOG(ERROR) << "read failed";
             return -1;
         } else if (r == 0) {
-            failure_type = kFreadFailure;
+            SetFailureType(kFreadFailure);
             LOG(ERROR) << "read reached unexpected EOF.";
             return -1;
         }
@@ -178,16 +369,17 @@ static int read_all(int fd, uint8_t* data, size_t size) {
     return 0;
 }
 
-static int read_all(int fd, std::vector<uint8_t>& buffer, size_t size) {
+static int read_all(int fd, BlockBuffer& buffer, size_t size) {
     return read_all(fd, buffer.data(), size);
 }
 
 static int write_all(int fd, const uint8_t* data, size_t size) {
+    TracedIo traced(fd, BlockIoRecord::kWrite, -1, size);
     size_t written = 0;
     while (written < size) {
         ssize_t w = TEMP_FAILURE_RETRY(ota_write(fd, data+written, size-written));
         if (w == -1) {
-            failure_type = kFwriteFailure;
+            SetFailureType(kFwriteFailure);
             PLOG(ERROR) << "write failed";
             return -1;
         }
@@ -197,16 +389,55 @@ static int write_all(int fd, const uint8_t* data, size_t size) {
     return 0;
 }
 
-static int write_all(int fd, const std::vector<uint8_t>& buffer, size_t size) {
+static int write_all(int fd, const BlockBuffer& buffer, size_t size) {
     return write_all(fd, buffer.data(), size);
 }
 
+// Reads |size| bytes at |offset| with positional reads, which don't alter the file offset of |fd|.
+// On failure, errno is that of the failed read, or EIO if the file ends short of |size|.
+static int read_all_at(int fd, uint8_t* data, size_t size, off64_t offset) {
+  TracedIo traced(fd, BlockIoRecord::kRead, offset, size);
+  size_t so_far = 0;
+  while (so_far < size) {
+    ssize_t r = TEMP_FAILURE_RETRY(ota_pread(fd, data + so_far, size - so_far, offset + so_far));
+    if (r == -1) {
+      SetFailureType(kFreadFailure);
+      PLOG(ERROR) << "pread failed";
+      return -1;
+    } else if (r == 0) {
+      SetFailureType(kFreadFailure);
+      LOG(ERROR) << "pread reached unexpected EOF.";
+      errno = EIO;
+      return -1;
+    }
+    so_far += r;
+  }
+  return 0;
+}
+
+static int write_all_at(int fd, const uint8_t* data, size_t size, off64_t offset) {
+  TracedIo traced(fd, BlockIoRecord::kWrite, offset, size);
+  size_t written = 0;
+  while (written < size) {
+    ssize_t w =
+        TEMP_FAILURE_RETRY(ota_pwrite(fd, data + written, size - written, offset + written));
+    if (w == -1) {
+      SetFailureType(kFwriteFailure);
+      PLOG(ERROR) << "pwrite failed";
+      return -1;
+    }
+    written += w;
+  }
+  return 0;
+}
+
 static bool discard_blocks(int fd, off64_t offset, uint64_t size) {
   // Don't discard blocks unless the update is a retry run.
-  if (!is_retry) {
+  if (update_status == nullptr || !update_status->is_retry) {
     return true;
   }
 
+  TracedIo traced(fd, BlockIoRecord::kDiscard, offset, size);
   uint64_t args[2] = { static_cast<uint64_t>(offset), size };
   if (ioctl(fd, BLKDISCARD, &args) == -1 && errno != ENOTSUP) {
     PLOG(ERROR) << "BLKDISCARD ioctl failed";
@@ -215,35 +446,315 @@ static bool discard_blocks(int fd, off64_t offset, uint64_t size) {
   return true;
 }
 
+// Returns the discard granularity of the block device behind |fd| in bytes, or 0 if it's not a
+// block device or the granularity is unknown. Partitions share the queue of the whole disk.
+static uint64_t DiscardGranularity(int fd) {
+  struct stat sb;
+  if (fstat(fd, &sb) == -1 || !S_ISBLK(sb.st_mode)) {
+    return 0;
+  }
+  std::string sysfs_dir =
+      android::base::StringPrintf("/sys/dev/block/%u:%u", major(sb.st_rdev), minor(sb.st_rdev));
+  for (const char* queue : { "/queue", "/../queue" }) {
+    std::string content;
+    uint64_t granularity;
+    if (android::base::ReadFileToString(sysfs_dir + queue + "/discard_granularity", &content) &&
+        android::base::ParseUint(android::base::Trim(content), &granularity)) {
+      return granularity;
+    }
+  }
+  return 0;
+}
+
+// Converts |ranges| into the byte extents to discard, with adjacent and overlapping ranges merged
+// so that each contiguous extent takes a single ioctl. With a |granularity| larger than a block,
+// the extents are shrunk to whole units of it, since the device ignores the partial units anyway;
+// the ones that don't cover a full unit are dropped.
+static std::vector<std::pair<uint64_t, uint64_t>> DiscardExtents(const RangeSet& ranges,
+                                                                 uint64_t granularity) {
+  std::vector<std::pair<size_t, size_t>> sorted(ranges.cbegin(), ranges.cend());
+  std::sort(sorted.begin(), sorted.end());
+
+  std::vector<std::pair<uint64_t, uint64_t>> extents;
+  auto add_extent = [&extents, granularity](uint64_t begin, uint64_t end) {
+    if (granularity > BLOCKSIZE) {
+      begin = (begin + granularity - 1) / granularity * granularity;
+      end = end / granularity * granularity;
+    }
+    if (begin < end) {
+      extents.emplace_back(begin, end - begin);
+    }
+  };
+
+  uint64_t begin = 0;
+  uint64_t end = 0;
+  for (const auto& range : sorted) {
+    uint64_t first = range.first * static_cast<uint64_t>(BLOCKSIZE);
+    uint64_t last = range.second * static_cast<uint64_t>(BLOCKSIZE);
+    if (begin < end && first <= end) {
+      end = std::max(end, last);
+      continue;
+    }
+    add_extent(begin, end);
+    begin = first;
+    end = last;
+  }
+  add_extent(begin, end);
+  return extents;
+}
+
+// Issues a BLKDISCARD for each of the byte |extents|. Devices that don't support discard are fine.
+static bool DiscardExtentList(int fd, const std::vector<std::pair<uint64_t, uint64_t>>& extents) {
+  for (const auto& extent : extents) {
+    TracedIo traced(fd, BlockIoRecord::kDiscard, extent.first, extent.second);
+    uint64_t args[2] = { extent.first, extent.second };
+    if (ioctl(fd, BLKDISCARD, &args) == -1) {
+      if (errno == ENOTSUP) {
+        return true;
+      }
+      PLOG(ERROR) << "BLKDISCARD ioctl failed";
+      return false;
+    }
+  }
+  return true;
+}
+
 static bool check_lseek(int fd, off64_t offset, int whence) {
     off64_t rc = TEMP_FAILURE_RETRY(lseek64(fd, offset, whence));
     if (rc == -1) {
-        failure_type = kLseekFailure;
+        SetFailureType(kLseekFailure);
         PLOG(ERROR) << "lseek64 failed";
         return false;
     }
     return true;
 }
 
-static void allocate(size_t size, std::vector<uint8_t>& buffer) {
+// Hands out the block buffers for the transfer commands, and takes them back once they're done
+// with, so that the large buffers are reused across the commands rather than being allocated (and
+// copied on growth) over and over. It's shared by the parallel workers.
+class BlockBufferPool {
+ public:
+  BlockBufferPool()
+      : reclaimer_id_(MemoryBudget::Instance().Register(
+            [this](size_t bytes) { return Reclaim(bytes); })) {}
+  ~BlockBufferPool() {
+    MemoryBudget::Instance().Unregister(reclaimer_id_);
+  }
+
+  // Returns a buffer of |size| bytes, which is the smallest free one that's large enough if any.
+  BlockBuffer Take(size_t size) {
+    BlockBuffer buffer;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto best = free_.end();
+      for (auto it = free_.begin(); it != free_.end(); ++it) {
+        if (it->capacity() >= size && (best == free_.end() || it->capacity() < best->capacity())) {
+          best = it;
+        }
+      }
+      if (best != free_.end()) {
+        free_size_ -= best->capacity();
+        buffer = std::move(*best);
+        free_.erase(best);
+        reused_++;
+      } else {
+        allocated_++;
+      }
+    }
+    // Allocating may reclaim the free buffers of the pool, so it's done without the lock.
+    buffer.resize(size);
+    std::lock_guard<std::mutex> lock(mutex_);
+    in_use_ += buffer.capacity();
+    peak_ = std::max(peak_, in_use_);
+    return buffer;
+  }
+
+  // Puts |buffer| back into the pool. The smallest free buffers are dropped when there are too many
+  // of them, but the largest one is always kept.
+  void Return(BlockBuffer&& buffer) {
+    if (buffer.capacity() == 0) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    in_use_ -= std::min(in_use_, buffer.capacity());
+    free_size_ += buffer.capacity();
+    free_.push_back(std::move(buffer));
+    while (free_.size() > 1 && (free_.size() > kMaxFreeBuffers || free_size_ > kMaxFreeSize)) {
+      auto smallest = std::min_element(
+          free_.begin(), free_.end(),
+          [](const BlockBuffer& a, const BlockBuffer& b) { return a.capacity() < b.capacity(); });
+      free_size_ -= smallest->capacity();
+      free_.erase(smallest);
+    }
+  }
+
+  // Frees the free buffers, the largest first, until |bytes| have been freed. Returns how much was
+  // freed.
+  size_t Reclaim(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t freed = 0;
+    while (freed < bytes && !free_.empty()) {
+      auto largest = std::max_element(
+          free_.begin(), free_.end(),
+          [](const BlockBuffer& a, const BlockBuffer& b) { return a.capacity() < b.capacity(); });
+      freed += largest->capacity();
+      free_size_ -= largest->capacity();
+      free_.erase(largest);
+    }
+    return freed;
+  }
+
+  // Frees the pooled buffers, and logs the high-water mark of the buffers in use.
+  void Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    LOG(INFO) << "block buffers: peak " << peak_ << " bytes in use, " << allocated_
+              << " allocated, " << reused_ << " reused";
+    free_.clear();
+    free_size_ = 0;
+    in_use_ = 0;
+    peak_ = 0;
+    allocated_ = 0;
+    reused_ = 0;
+  }
+
+ private:
+  static constexpr size_t kMaxFreeBuffers = 16;
+  static constexpr size_t kMaxFreeSize = 64 * 1024 * 1024;
+
+  const int reclaimer_id_;
+  std::mutex mutex_;
+  std::vector<BlockBuffer> free_;
+  size_t free_size_ = 0;
+  size_t in_use_ = 0;
+  size_t peak_ = 0;
+  size_t allocated_ = 0;
+  size_t reused_ = 0;
+};
+
+static BlockBufferPool buffer_pool;
+
+// A buffer from the pool for temporary use, which goes back to the pool when it goes out of scope.
+class PooledBlockBuffer {
+ public:
+  explicit PooledBlockBuffer(size_t size) : buffer_(buffer_pool.Take(size)) {}
+  ~PooledBlockBuffer() {
+    buffer_pool.Return(std::move(buffer_));
+  }
+
+  BlockBuffer& operator*() {
+    return buffer_;
+  }
+
+ private:
+  BlockBuffer buffer_;
+
+  DISALLOW_COPY_AND_ASSIGN(PooledBlockBuffer);
+};
+
+static void allocate(size_t size, BlockBuffer& buffer) {
     // if the buffer's big enough, reuse it.
     if (size <= buffer.size()) return;
 
-    buffer.resize(size);
+    // Swap in a larger buffer from the pool instead of growing this one, which would copy the
+    // contents that are about to be overwritten.
+    buffer_pool.Return(std::move(buffer));
+    buffer = buffer_pool.Take(size);
+}
+
+// The phases of a transfer command that are timed in the transfer trace.
+enum TracePhase {
+  kTraceParse,
+  kTraceSourceLoad,
+  kTraceStashLoad,
+  kTraceStashWrite,
+  kTracePatch,
+  kTraceWrite,
+  kTraceFsync,
+  kTracePhaseCount,
+};
+
+static constexpr const char* kTracePhaseNames[kTracePhaseCount] = {
+  "parse", "source_load", "stash_load", "stash_write", "patch", "write", "fsync",
+};
+
+// The time spent and the bytes processed in each phase of a transfer command.
+struct CommandTrace {
+  int cmdindex = -1;
+  std::string cmdname;
+  uint64_t ns[kTracePhaseCount] = {};
+  uint64_t bytes[kTracePhaseCount] = {};
+};
+
+// Adds the time from its construction to its destruction to |phase| of |trace|, unless |trace| is
+// null.
+class TraceTimer {
+ public:
+  TraceTimer(CommandTrace* trace, TracePhase phase, uint64_t bytes = 0)
+      : trace_(trace), phase_(phase), bytes_(bytes), start_(std::chrono::steady_clock::now()) {}
+
+  ~TraceTimer() {
+    if (trace_ != nullptr) {
+      trace_->ns[phase_] += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                std::chrono::steady_clock::now() - start_)
+                                .count();
+      trace_->bytes[phase_] += bytes_;
+    }
+  }
+
+  void set_bytes(uint64_t bytes) {
+    bytes_ = bytes;
+  }
+
+ private:
+  CommandTrace* trace_;
+  TracePhase phase_;
+  uint64_t bytes_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Runs of zero blocks shorter than this are written as they are, since an ioctl for each of them
+// would cost more than the write.
+static constexpr size_t kMinZeroRunBlocks = 16;
+
+// Returns whether the BLOCKSIZE bytes at |data| are all zero. Each cache line is OR-ed together
+// without branches in between, which the compiler vectorizes. |data| needn't be aligned.
+static bool IsZeroBlock(const uint8_t* data) {
+  constexpr size_t kLineSize = 64;
+  for (size_t offset = 0; offset < BLOCKSIZE; offset += kLineSize) {
+    uint64_t bits = 0;
+    for (size_t i = 0; i < kLineSize; i += sizeof(uint64_t)) {
+      uint64_t word;
+      memcpy(&word, data + offset + i, sizeof(word));
+      bits |= word;
+    }
+    if (bits != 0) {
+      return false;
+    }
+  }
+  return true;
 }
 
 /**
  * RangeSinkWriter reads data from the given FD, and writes them to the destination specified by the
- * given RangeSet.
+ * given RangeSet. The time spent writing is added to |trace|, if given.
+ *
+ * With a non-zero |zero_request| (BLKZEROOUT, or BLKDISCARD for a device that reads discarded
+ * blocks back as zeroes), the block-aligned runs of at least kMinZeroRunBlocks zero blocks are
+ * zeroed with that ioctl instead of being written.
  */
 class RangeSinkWriter {
  public:
-  RangeSinkWriter(int fd, const RangeSet& tgt)
+  RangeSinkWriter(int fd, const RangeSet& tgt, CommandTrace* trace = nullptr,
+                  unsigned long zero_request = 0)
       : fd_(fd),
         tgt_(tgt),
+        trace_(trace),
+        zero_request_(zero_request),
         next_range_(0),
         current_range_left_(0),
-        bytes_written_(0) {
+        current_offset_(0),
+        bytes_written_(0),
+        bytes_zeroed_(0) {
     CHECK_NE(tgt.size(), static_cast<size_t>(0));
   };
 
@@ -274,6 +785,27 @@ class RangeSinkWriter {
         write_now = current_range_left_;
       }
 
+      if (zero_request_ != 0 && (bytes_written_ + written) % BLOCKSIZE == 0) {
+        size_t zero_run;
+        write_now = SplitZeroRun(data, write_now, &zero_run);
+        if (zero_run > 0) {
+          int result = ZeroOut(zero_run);
+          if (result == -1) {
+            break;
+          }
+          if (result == 1) {
+            data += zero_run;
+            size -= zero_run;
+            current_range_left_ -= zero_run;
+            written += zero_run;
+            continue;
+          }
+          // The device can't zero the blocks, so they're written after all.
+          write_now = zero_run;
+        }
+      }
+
+      TraceTimer timer(trace_, kTraceWrite, write_now);
       if (write_all(fd_, data, write_now) == -1) {
         break;
       }
@@ -282,6 +814,7 @@ class RangeSinkWriter {
       size -= write_now;
 
       current_range_left_ -= write_now;
+      current_offset_ += write_now;
       written += write_now;
     }
 
@@ -293,7 +826,66 @@ class RangeSinkWriter {
     return bytes_written_;
   }
 
+  // The bytes that have been zeroed in place instead of written.
+  size_t BytesZeroed() const {
+    return bytes_zeroed_;
+  }
+
  private:
+  // Returns the length of the data at the start of the block-aligned |data| to write, which is
+  // followed by a run of zero blocks to zero out, or the end of |size|. If the data starts with
+  // such a run, sets |zero_run| to its length and returns 0.
+  size_t SplitZeroRun(const uint8_t* data, size_t size, size_t* zero_run) {
+    *zero_run = 0;
+    size_t blocks = size / BLOCKSIZE;
+    size_t run = 0;
+    for (size_t i = 0; i < blocks; i++) {
+      if (!IsZeroBlock(data + i * BLOCKSIZE)) {
+        if (run >= kMinZeroRunBlocks) {
+          break;
+        }
+        run = 0;
+        continue;
+      }
+      run++;
+      if (run == kMinZeroRunBlocks && i + 1 > run) {
+        // Writes the data up to the run first.
+        return (i + 1 - run) * BLOCKSIZE;
+      }
+    }
+    if (run >= kMinZeroRunBlocks) {
+      // The data starts with the run, as any earlier one would have ended the scan above.
+      *zero_run = run * BLOCKSIZE;
+      return 0;
+    }
+    return size;
+  }
+
+  // Zeroes the next |size| bytes of the target with |zero_request_|, and moves the file offset past
+  // them. Returns 1 on success, 0 if the device doesn't support it and the bytes have to be
+  // written, or -1 on errors.
+  int ZeroOut(size_t size) {
+    TraceTimer timer(trace_, kTraceWrite, size);
+    TracedIo traced(fd_, zero_request_ == BLKDISCARD ? BlockIoRecord::kDiscard
+                                                     : BlockIoRecord::kZeroOut,
+                    current_offset_, size);
+    uint64_t args[2] = { static_cast<uint64_t>(current_offset_), size };
+    if (ioctl(fd_, zero_request_, &args) == -1) {
+      if (bytes_zeroed_ == 0) {
+        PLOG(INFO) << "Failed to zero out the blocks in place; writing them instead";
+        zero_request_ = 0;
+        return 0;
+      }
+      SetFailureType(kFwriteFailure);
+      PLOG(ERROR) << (zero_request_ == BLKDISCARD ? "BLKDISCARD" : "BLKZEROOUT")
+                  << " ioctl failed";
+      return -1;
+    }
+    current_offset_ += size;
+    bytes_zeroed_ += size;
+    return check_lseek(fd_, current_offset_, SEEK_SET) ? 1 : -1;
+  }
+
   // Set up the output cursor, move to next range if needed.
   bool SeekToOutputRange() {
     // We haven't finished the current range yet.
@@ -309,6 +901,7 @@ class RangeSinkWriter {
     const Range& range = tgt_[next_range_];
     off64_t offset = static_cast<off64_t>(range.first) * BLOCKSIZE;
     current_range_left_ = (range.second - range.first) * BLOCKSIZE;
+    current_offset_ = offset;
     next_range_++;
 
     if (!discard_blocks(fd_, offset, current_range_left_)) {
@@ -324,12 +917,18 @@ class RangeSinkWriter {
   int fd_;
   // The destination ranges for the data.
   const RangeSet& tgt_;
+  CommandTrace* trace_;
+  // The ioctl that zeroes the runs of zero blocks, or 0 to write them.
+  unsigned long zero_request_;
   // The next range that we should write to.
   size_t next_range_;
   // The number of bytes to write before moving to the next range.
   size_t current_range_left_;
-  // Total bytes written by the writer.
+  // The offset of the next byte to write to.
+  off64_t current_offset_;
+  // Total bytes written by the writer, including the zeroed ones.
   size_t bytes_written_;
+  size_t bytes_zeroed_;
 };
 
 /**
@@ -338,98 +937,55 @@ class RangeSinkWriter {
  * of the archive (it's compressed) without writing it to a temp file, but we can't write each
  * section until it's that transfer's turn to go.
  *
- * To achieve this, we expand the new data from the archive in a background thread, and block that
- * threads 'receive uncompressed data' function until the main thread has reached a point where we
- * want some new data to be written. We signal the background thread with the destination for the
- * data and block the main thread, waiting for the background thread to complete writing that
- * section. Then it signals the main thread to wake up and goes back to blocking waiting for a
- * transfer.
+ * To achieve this, we expand the new data from the archive in a background thread into a bounded
+ * ring buffer, which lets the decompressor run ahead of the transfer list while the main thread is
+ * busy with other commands. When a 'new' command is reached, it drains the bytes it needs from the
+ * ring buffer and writes them to the target blocks. The background thread blocks once the ring
+ * buffer is full, until the main thread consumes some data or stops the transfer.
  *
- * NewThreadInfo is the struct used to pass information back and forth between the two threads. When
- * the main thread wants some data written, it sets writer to the destination location and signals
- * the condition. When the background thread is done writing, it clears writer and signals the
- * condition again.
+ * NewThreadInfo is the struct used to pass information back and forth between the two threads.
  */
+struct NewDataSegment {
+  size_t compressed_size;
+  size_t uncompressed_size;
+};
+
 struct NewThreadInfo {
   ZipArchiveHandle za;
   ZipEntry entry;
   bool brotli_compressed;
+  // The independently compressed streams that the new data consists of, if the transfer list has a
+  // new_data_index line; empty for a single stream.
+  std::vector<NewDataSegment> segments;
+  // Points to the compressed new data if it's directly accessible in the mapped package.
+  const uint8_t* mapped_data;
 
-  std::unique_ptr<RangeSinkWriter> writer;
+  std::unique_ptr<RingBuffer> ring;
   BrotliDecoderState* brotli_decoder_state;
-  bool receiver_available;
-
-  pthread_mutex_t mu;
-  pthread_cond_t cv;
+  // Cleared by the background thread once it has finished expanding the new data.
+  std::atomic<bool> receiver_available;
 };
 
+// The size of the ring buffer holding the expanded new data, which can be lowered on devices with
+// little RAM through the ro.updater.new_data_buffer_size property.
+static constexpr size_t kDefaultNewDataBufferSize = 4 * 1024 * 1024;
+static constexpr size_t kMinNewDataBufferSize = 16 * BLOCKSIZE;
+
 static bool receive_new_data(const uint8_t* data, size_t size, void* cookie) {
   NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
 
-  while (size > 0) {
-    // Wait for nti->writer to be non-null, indicating some of this data is wanted.
-    pthread_mutex_lock(&nti->mu);
-    while (nti->writer == nullptr) {
-      // End the new data receiver if we encounter an error when performing block image update.
-      if (!nti->receiver_available) {
-        pthread_mutex_unlock(&nti->mu);
-        return false;
-      }
-      pthread_cond_wait(&nti->cv, &nti->mu);
-    }
-    pthread_mutex_unlock(&nti->mu);
-
-    // At this point nti->writer is set, and we own it. The main thread is waiting for it to
-    // disappear from nti.
-    size_t write_now = std::min(size, nti->writer->AvailableSpace());
-    if (nti->writer->Write(data, write_now) != write_now) {
-      LOG(ERROR) << "Failed to write " << write_now << " bytes.";
-      return false;
-    }
-
-    data += write_now;
-    size -= write_now;
-
-    if (nti->writer->Finished()) {
-      // We have written all the bytes desired by this writer.
-
-      pthread_mutex_lock(&nti->mu);
-      nti->writer = nullptr;
-      pthread_cond_broadcast(&nti->cv);
-      pthread_mutex_unlock(&nti->mu);
-    }
-  }
-
-  return true;
+  // Blocks while the ring buffer is full. It fails once the block image update stops consuming
+  // new data, e.g. on errors.
+  return nti->ring->Write(data, size);
 }
 
 static bool receive_brotli_new_data(const uint8_t* data, size_t size, void* cookie) {
   NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
 
+  uint8_t buffer[32768];
   while (size > 0 || BrotliDecoderHasMoreOutput(nti->brotli_decoder_state)) {
-    // Wait for nti->writer to be non-null, indicating some of this data is wanted.
-    pthread_mutex_lock(&nti->mu);
-    while (nti->writer == nullptr) {
-      // End the receiver if we encounter an error when performing block image update.
-      if (!nti->receiver_available) {
-        pthread_mutex_unlock(&nti->mu);
-        return false;
-      }
-      pthread_cond_wait(&nti->cv, &nti->mu);
-    }
-    pthread_mutex_unlock(&nti->mu);
-
-    // At this point nti->writer is set, and we own it. The main thread is waiting for it to
-    // disappear from nti.
-
-    size_t buffer_size = std::min<size_t>(32768, nti->writer->AvailableSpace());
-    if (buffer_size == 0) {
-      LOG(ERROR) << "No space left in output range";
-      return false;
-    }
-    uint8_t buffer[buffer_size];
     size_t available_in = size;
-    size_t available_out = buffer_size;
+    size_t available_out = sizeof(buffer);
     uint8_t* next_out = buffer;
 
     // The brotli decoder will update |data|, |available_in|, |next_out| and |available_out|.
@@ -442,87 +998,310 @@ static bool receive_brotli_new_data(const uint8_t* data, size_t size, void* cook
       return false;
     }
 
-    LOG(DEBUG) << "bytes to write: " << buffer_size - available_out << ", bytes consumed "
+    LOG(DEBUG) << "bytes to write: " << sizeof(buffer) - available_out << ", bytes consumed "
                << size - available_in << ", decoder status " << result;
 
-    size_t write_now = buffer_size - available_out;
-    if (nti->writer->Write(buffer, write_now) != write_now) {
-      LOG(ERROR) << "Failed to write " << write_now << " bytes.";
+    size_t write_now = sizeof(buffer) - available_out;
+    if (write_now > 0 && !nti->ring->Write(buffer, write_now)) {
       return false;
     }
 
     // Update the remaining size. The input data ptr is already updated by brotli decoder function.
     size = available_in;
 
-    if (nti->writer->Finished()) {
-      // We have written all the bytes desired by this writer.
-
-      pthread_mutex_lock(&nti->mu);
-      nti->writer = nullptr;
-      pthread_cond_broadcast(&nti->cv);
-      pthread_mutex_unlock(&nti->mu);
+    if (result == BROTLI_DECODER_RESULT_SUCCESS) {
+      if (nti->segments.empty()) {
+        // Ignore any trailing bytes after the end of the brotli stream.
+        break;
+      }
+      // Segmented new data is a concatenation of brotli streams, so start over with the next one.
+      BrotliDecoderDestroyInstance(nti->brotli_decoder_state);
+      nti->brotli_decoder_state = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
     }
   }
 
   return true;
 }
 
+// Maximum number of new data segments that are decoded concurrently, and the limit of the total
+// uncompressed size of the segments being decoded at a time.
+static constexpr size_t kMaxNewDataDecoders = 4;
+static constexpr size_t kMaxNewDataDecodeBytes = 64 * 1024 * 1024;
+
+// Decodes the segments of the mapped new data with several threads, and feeds the decoded data to
+// the ring buffer in order.
+static bool decode_new_data_segments(NewThreadInfo* nti) {
+  size_t num_decoders =
+      std::min<size_t>(std::thread::hardware_concurrency() ?: 2, kMaxNewDataDecoders);
+
+  auto decode_segment = [](const uint8_t* data, const NewDataSegment& segment) {
+    std::vector<uint8_t> decoded(segment.uncompressed_size);
+    size_t decoded_size = decoded.size();
+    if (BrotliDecoderDecompress(segment.compressed_size, data, &decoded_size, decoded.data()) !=
+            BROTLI_DECODER_RESULT_SUCCESS ||
+        decoded_size != segment.uncompressed_size) {
+      LOG(ERROR) << "Failed to decompress new data segment of " << segment.compressed_size
+                 << " bytes";
+      decoded.clear();
+    }
+    return decoded;
+  };
+
+  std::deque<std::future<std::vector<uint8_t>>> decoding;
+  size_t decoding_bytes = 0;
+  size_t next = 0;
+  const uint8_t* next_data = nti->mapped_data;
+  for (size_t i = 0; i < nti->segments.size(); i++) {
+    // Keep the decoders busy, within the memory budget.
+    while (next < nti->segments.size() && decoding.size() < num_decoders &&
+           (decoding.empty() ||
+            decoding_bytes + nti->segments[next].uncompressed_size <= kMaxNewDataDecodeBytes)) {
+      const NewDataSegment& segment = nti->segments[next];
+      decoding.push_back(std::async(std::launch::async, decode_segment, next_data, segment));
+      decoding_bytes += segment.uncompressed_size;
+      next_data += segment.compressed_size;
+      next++;
+    }
+
+    std::vector<uint8_t> decoded = decoding.front().get();
+    decoding.pop_front();
+    decoding_bytes -= nti->segments[i].uncompressed_size;
+    if (decoded.empty() || !nti->ring->Write(decoded.data(), decoded.size())) {
+      // Wait for the pending decoders before bailing out, as they access the mapped package.
+      for (auto& future : decoding) {
+        future.wait();
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
 static void* unzip_new_data(void* cookie) {
   NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
-  if (nti->brotli_compressed) {
+  if (nti->mapped_data != nullptr) {
+    decode_new_data_segments(nti);
+  } else if (nti->brotli_compressed) {
     ProcessZipEntryContents(nti->za, &nti->entry, receive_brotli_new_data, nti);
   } else {
     ProcessZipEntryContents(nti->za, &nti->entry, receive_new_data, nti);
   }
-  pthread_mutex_lock(&nti->mu);
   nti->receiver_available = false;
-  if (nti->writer != nullptr) {
-    pthread_cond_broadcast(&nti->cv);
-  }
-  pthread_mutex_unlock(&nti->mu);
+  nti->ring->CloseWrite();
   return nullptr;
 }
 
-static int ReadBlocks(const RangeSet& src, std::vector<uint8_t>& buffer, int fd) {
-  size_t p = 0;
-  for (const auto& range : src) {
-    if (!check_lseek(fd, static_cast<off64_t>(range.first) * BLOCKSIZE, SEEK_SET)) {
-      return -1;
+// Calls |func| for each run of blocks in |rs| that's contiguous on the device, with the offset of
+// the run into the data and its length in bytes. Adjacent ranges are coalesced, so that each run
+// takes a single syscall. Returns -1 as soon as |func| fails.
+static int ForEachContiguousRun(const RangeSet& rs,
+                                const std::function<int(size_t, off64_t, size_t)>& func) {
+  size_t pos = 0;
+  auto it = rs.cbegin();
+  while (it != rs.cend()) {
+    size_t first = it->first;
+    size_t last = it->second;
+    for (++it; it != rs.cend() && it->first == last; ++it) {
+      last = it->second;
     }
 
-    size_t size = (range.second - range.first) * BLOCKSIZE;
-    if (read_all(fd, buffer.data() + p, size) == -1) {
+    size_t size = (last - first) * BLOCKSIZE;
+    if (func(pos, static_cast<off64_t>(first) * BLOCKSIZE, size) == -1) {
       return -1;
     }
+    pos += size;
+  }
+  return 0;
+}
+
+// The largest request submitted to the io_uring, so that long runs are split up and spread across
+// the queue.
+static constexpr size_t kMaxIoRequestSize = 1024 * 1024;
+static constexpr unsigned kIoQueueDepth = 32;
+
+// Splits the blocks in |rs| into requests for the io_uring, with the data laid out contiguously
+// starting from |data|.
+static std::vector<IoRequest> BlockIoRequests(const RangeSet& rs, uint8_t* data, int fd) {
+  std::vector<IoRequest> requests;
+  ForEachContiguousRun(rs, [&requests, data, fd](size_t pos, off64_t offset, size_t size) {
+    for (size_t done = 0; done < size; done += kMaxIoRequestSize) {
+      requests.push_back({ fd, data + pos + done, std::min(size - done, kMaxIoRequestSize),
+                           offset + static_cast<off64_t>(done) });
+    }
+    return 0;
+  });
+  return requests;
+}
+
+static uint64_t TraceStart() {
+  BlockIoTrace* trace = BlockIoTrace::Get();
+  return trace != nullptr ? trace->Now() : 0;
+}
+
+// Records the |requests| done through the io_uring since |start_ns|, as a batch.
+static void TraceIoRequests(uint8_t op, const std::vector<IoRequest>& requests,
+                            uint64_t start_ns) {
+  BlockIoTrace* trace = BlockIoTrace::Get();
+  if (trace == nullptr) {
+    return;
+  }
+  for (const auto& request : requests) {
+    trace->Record(request.fd, op, request.offset, request.size, start_ns, BlockIoRecord::kQueued);
+  }
+}
 
-    p += size;
+// Reads the blocks in |src| into |buffer|. If |queue| is given, the runs are read concurrently
+// through the io_uring; on failure they're read once more synchronously, which reports the error
+// (and EIO for a retry) the same way as before.
+static int ReadBlocks(const RangeSet& src, BlockBuffer& buffer, int fd,
+                      IoUringQueue* queue = nullptr) {
+  if (queue != nullptr) {
+    std::vector<IoRequest> requests = BlockIoRequests(src, buffer.data(), fd);
+    if (requests.size() > 1) {
+      uint64_t start_ns = TraceStart();
+      if (queue->Read(requests)) {
+        TraceIoRequests(BlockIoRecord::kRead, requests, start_ns);
+        return 0;
+      }
+      PLOG(WARNING) << "io_uring read failed; retrying with synchronous I/O";
+    }
   }
 
-  return 0;
+  return ForEachContiguousRun(src, [&buffer, fd](size_t pos, off64_t offset, size_t size) {
+    return read_all_at(fd, buffer.data() + pos, size, offset);
+  });
 }
 
-static int WriteBlocks(const RangeSet& tgt, const std::vector<uint8_t>& buffer, int fd) {
-  size_t written = 0;
-  for (const auto& range : tgt) {
-    off64_t offset = static_cast<off64_t>(range.first) * BLOCKSIZE;
-    size_t size = (range.second - range.first) * BLOCKSIZE;
-    if (!discard_blocks(fd, offset, size)) {
-      return -1;
+static int WriteBlocks(const RangeSet& tgt, const BlockBuffer& buffer, int fd,
+                       IoUringQueue* queue = nullptr) {
+  if (queue != nullptr) {
+    // The buffer isn't modified; the requests are shared between reads and writes.
+    std::vector<IoRequest> requests =
+        BlockIoRequests(tgt, const_cast<uint8_t*>(buffer.data()), fd);
+    if (requests.size() > 1) {
+      if (ForEachContiguousRun(tgt, [fd](size_t, off64_t offset, size_t size) {
+            return discard_blocks(fd, offset, size) ? 0 : -1;
+          }) == -1) {
+        return -1;
+      }
+      uint64_t start_ns = TraceStart();
+      if (queue->Write(requests)) {
+        TraceIoRequests(BlockIoRecord::kWrite, requests, start_ns);
+        return 0;
+      }
+      PLOG(WARNING) << "io_uring write failed; retrying with synchronous I/O";
     }
+  }
 
-    if (!check_lseek(fd, offset, SEEK_SET)) {
+  return ForEachContiguousRun(tgt, [&buffer, fd](size_t pos, off64_t offset, size_t size) {
+    if (!discard_blocks(fd, offset, size)) {
       return -1;
     }
+    return write_all_at(fd, buffer.data() + pos, size, offset);
+  });
+}
 
-    if (write_all(fd, buffer.data() + written, size) == -1) {
-      return -1;
+// A stash that's only kept in memory. |src| is where the blocks were loaded from, which must not be
+// overwritten until the stash has been written to disk.
+struct MemoryStash {
+  BlockBuffer data;
+  RangeSet src;
+};
+
+// Issues the discards of the 'erase' commands on a background thread, so that the following
+// commands don't wait for the device to trim the blocks. A command that writes to the blocks being
+// erased waits for them first, as a late discard would destroy its data.
+class BackgroundDiscarder {
+ public:
+  explicit BackgroundDiscarder(const std::string& blockdev)
+      : fd_(TEMP_FAILURE_RETRY(ota_open(blockdev.c_str(), O_RDWR))), done_(false), failed_(false) {
+    if (fd_ == -1) {
+      PLOG(WARNING) << "Failed to open " << blockdev << "; discarding the blocks synchronously";
+      return;
     }
+    thread_ = std::thread(&BackgroundDiscarder::Run, this);
+  }
 
-    written += size;
+  ~BackgroundDiscarder() {
+    Finish();
   }
 
-  return 0;
-}
+  bool running() const {
+    return thread_.joinable();
+  }
+
+  void Add(RangeSet blocks, std::vector<std::pair<uint64_t, uint64_t>> extents) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    jobs_.push_back({ std::move(blocks), std::move(extents) });
+    cv_.notify_all();
+  }
+
+  // Waits until none of the queued discards overlaps |tgt|, which is about to be written.
+  void WaitFor(const RangeSet& tgt) {
+    if (!tgt) {
+      return;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this, &tgt]() {
+      return std::none_of(jobs_.begin(), jobs_.end(),
+                          [&tgt](const Job& job) { return job.blocks.Overlaps(tgt); });
+    });
+  }
+
+  // Waits for all the queued discards. Returns false if any of them has failed.
+  bool Finish() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_ = true;
+      cv_.notify_all();
+    }
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+    return !failed_;
+  }
+
+ private:
+  struct Job {
+    RangeSet blocks;
+    std::vector<std::pair<uint64_t, uint64_t>> extents;
+  };
+
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this]() { return done_ || !jobs_.empty(); });
+      if (jobs_.empty()) {
+        return;
+      }
+      // The job stays in the queue until the blocks are discarded, so that WaitFor() can see it.
+      const Job& job = jobs_.front();
+      lock.unlock();
+      bool success = DiscardExtentList(fd_, job.extents);
+      lock.lock();
+      failed_ = failed_ || !success;
+      jobs_.pop_front();
+      cv_.notify_all();
+    }
+  }
+
+  android::base::unique_fd fd_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Job> jobs_;
+  bool done_;
+  bool failed_;
+};
+
+// The progress of the partitions that are being updated concurrently, which is reported as a
+// whole, weighted by their blocks.
+struct SharedProgress {
+  std::mutex mutex;
+  // The written and the total blocks of each update, once it has started.
+  std::vector<std::pair<size_t, size_t>> blocks;
+  double reported = 0;
+};
 
 // Parameters for transfer list command functions
 struct CommandParameters {
@@ -536,22 +1315,216 @@ struct CommandParameters {
     bool canwrite;
     int createdstash;
     android::base::unique_fd fd;
+    // Opened with O_DIRECT for the bulk block reads and writes, if enabled.
+    android::base::unique_fd direct_fd;
+    // Batches the block I/O through io_uring, if it's available.
+    std::unique_ptr<IoUringQueue> io_queue;
     bool foundwrites;
     bool isunresumable;
+    std::string last_command_file;
+    // The commands completed after the last command index by their indices, which are saved along
+    // with the last command file, and the ones completed by a previous attempt that can be skipped
+    // when resuming. |transfer_list_digest| identifies the transfer list they belong to.
+    std::vector<bool> completed;
+    size_t unsaved_completed;
+    std::vector<bool> skip_completed;
+    std::string transfer_list_digest;
+    // The combined progress and the slot of this update in it, if it runs concurrently with the
+    // updates of other partitions.
+    SharedProgress* shared_progress;
+    size_t progress_slot;
     int version;
     size_t written;
     size_t stashed;
+    // Stashes that haven't been written to /cache yet, and the memory they take (including the
+    // retained stashes), counted by the capacity of their buffers.
+    std::unordered_map<std::string, MemoryStash> memory_stashes;
+    size_t memory_stash_size;
+    size_t memory_stash_limit;
+    // Stashes that have been written to /cache but not synced yet, and their source blocks. With
+    // group commit, the stash files are synced together at the next checkpoint, instead of one by
+    // one along with the last command index.
+    bool group_commit;
+    std::unordered_map<std::string, RangeSet> unsynced_stashes;
+    // Whether the stashes written to /cache are LZ4 compressed.
+    bool compress_stash;
+    // The source blocks of the memory and the unsynced stashes, which mustn't be overwritten until
+    // the stashes are on disk.
+    RangeIndex pending_stash_blocks;
+    // The number of pending commands that load each stash, counted in advance.
+    std::unordered_map<std::string, size_t> stash_refs;
+    // Freed stashes that will be stashed again later. Their contents are kept, if the memory
+    // allows, to save reading and writing the blocks once more.
+    std::unordered_map<std::string, BlockBuffer> retained_stashes;
     NewThreadInfo nti;
     pthread_t thread;
-    std::vector<uint8_t> buffer;
+    BlockBuffer buffer;
     uint8_t* patch_start;
     bool target_verified;  // The target blocks have expected contents already.
+    // The phases of the current command, and the ones of the completed commands.
+    CommandTrace trace;
+    std::vector<CommandTrace> traces;
+    // The discard granularity of the target device in bytes, and whether discarded blocks read
+    // back as zeroes, which are queried once per update.
+    uint64_t discard_granularity;
+    bool discard_zeroes;
+    // The ioctl that zeroes the runs of zero blocks in the new data, or 0 to write them.
+    unsigned long new_zero_request;
+    // Discards the erased blocks in the background, if enabled.
+    std::unique_ptr<BackgroundDiscarder> discarder;
 };
 
+// Returns the fd for reading and writing whole blocks of the target, which bypasses the page cache
+// if O_DIRECT I/O has been enabled.
+static int BlockFd(const CommandParameters& params) {
+  return params.direct_fd != -1 ? params.direct_fd.get() : params.fd.get();
+}
+
+// Saves the trace of the current command, if it has been executed.
+static void FinishTrace(CommandParameters& params) {
+  if (!params.trace.cmdname.empty()) {
+    params.traces.push_back(std::move(params.trace));
+  }
+  params.trace = CommandTrace();
+}
+
+// Writes the traces of the commands as CSV to |path|, with the time in nanoseconds and the bytes
+// processed in each phase. The totals for each command type are logged as well.
+static void WriteTransferTrace(const std::string& path, std::vector<CommandTrace>& traces) {
+  std::sort(traces.begin(), traces.end(), [](const CommandTrace& a, const CommandTrace& b) {
+    return a.cmdindex < b.cmdindex;
+  });
+
+  std::string content = "index,command";
+  for (const char* phase : kTracePhaseNames) {
+    content += android::base::StringPrintf(",%s_ns,%s_bytes", phase, phase);
+  }
+  content += "\n";
+
+  std::map<std::string, CommandTrace> totals;
+  std::map<std::string, size_t> counts;
+  for (const auto& trace : traces) {
+    content += android::base::StringPrintf("%d,%s", trace.cmdindex, trace.cmdname.c_str());
+    CommandTrace& total = totals[trace.cmdname];
+    counts[trace.cmdname]++;
+    for (size_t i = 0; i < kTracePhaseCount; i++) {
+      content += android::base::StringPrintf(",%" PRIu64 ",%" PRIu64, trace.ns[i], trace.bytes[i]);
+      total.ns[i] += trace.ns[i];
+      total.bytes[i] += trace.bytes[i];
+    }
+    content += "\n";
+  }
+
+  for (const auto& total : totals) {
+    std::string summary;
+    for (size_t i = 0; i < kTracePhaseCount; i++) {
+      if (total.second.ns[i] == 0) continue;
+      summary += android::base::StringPrintf(" %s %.1f ms", kTracePhaseNames[i],
+                                             total.second.ns[i] / 1e6);
+      if (total.second.bytes[i] != 0) {
+        summary += android::base::StringPrintf(
+            " (%.1f MiB/s)", total.second.bytes[i] / 1048576.0 / (total.second.ns[i] / 1e9));
+      }
+      summary += ";";
+    }
+    LOG(INFO) << total.first << ": " << counts[total.first] << " commands;" << summary;
+  }
+
+  if (!android::base::WriteStringToFile(content, path)) {
+    PLOG(WARNING) << "Failed to write the transfer trace to " << path;
+  }
+}
+
+// All the block hashing goes through the helpers below. BoringSSL picks the SHA-1 implementation at
+// runtime, using the ARMv8 crypto extensions or the x86 SHA instructions where they're available.
+static std::string HashData(const uint8_t* data, size_t size) {
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1(data, size, digest);
+  return print_sha1(digest);
+}
+
+// The minimum number of blocks worth spreading across threads when hashing each block separately,
+// which is also the number of blocks hashed by each task.
+static constexpr size_t kMinParallelHashBlocks = 256;
+
+// Returns the SHA-1 of each block in |data|. The digests are independent, so they're computed on
+// the shared thread pool for large buffers.
+static std::vector<std::string> HashEachBlock(const uint8_t* data, size_t blocks) {
+  std::vector<std::string> hashes(blocks);
+  if (blocks < kMinParallelHashBlocks) {
+    for (size_t i = 0; i < blocks; i++) {
+      hashes[i] = HashData(data + i * BLOCKSIZE, BLOCKSIZE);
+    }
+    return hashes;
+  }
+
+  size_t num_chunks = (blocks + kMinParallelHashBlocks - 1) / kMinParallelHashBlocks;
+  ThreadPool::Shared().ParallelFor(num_chunks, [&hashes, data, blocks](size_t chunk) {
+    size_t begin = chunk * kMinParallelHashBlocks;
+    size_t end = std::min(begin + kMinParallelHashBlocks, blocks);
+    for (size_t i = begin; i < end; i++) {
+      hashes[i] = HashData(data + i * BLOCKSIZE, BLOCKSIZE);
+    }
+    return true;
+  });
+  return hashes;
+}
+
+// The size of the chunks read from the block device while hashing.
+static constexpr size_t kHashChunkSize = 1024 * 1024;
+
+// Computes the SHA-1 of the blocks in |rs| on |fd|. The next chunk is read on another thread while
+// the current one is being hashed, so the device and the CPU are kept busy at the same time.
+// Returns false on read errors, with errno set.
+static bool HashBlocks(int fd, const RangeSet& rs, std::string* hexdigest) {
+  std::vector<std::pair<off64_t, size_t>> chunks;
+  ForEachContiguousRun(rs, [&chunks](size_t, off64_t offset, size_t size) {
+    for (size_t done = 0; done < size; done += kHashChunkSize) {
+      chunks.emplace_back(offset + done, std::min(size - done, kHashChunkSize));
+    }
+    return 0;
+  });
+
+  // Returns the errno of the failed read, as it doesn't carry over from other threads.
+  PooledBlockBuffer first(kHashChunkSize);
+  PooledBlockBuffer second(kHashChunkSize);
+  BlockBuffer* buffers[2] = { &*first, &*second };
+  UpdateStatus* status = update_status;
+  auto read_chunk = [fd, &chunks, &buffers, status](size_t index) {
+    ScopedUpdateStatus scoped_status(status);
+    BlockBuffer& buffer = *buffers[index % 2];
+    buffer.resize(chunks[index].second);
+    return read_all_at(fd, buffer.data(), buffer.size(), chunks[index].first) == -1 ? errno : 0;
+  };
+
+  SHA_CTX ctx;
+  SHA1_Init(&ctx);
+  int error = chunks.empty() ? 0 : read_chunk(0);
+  for (size_t i = 0; error == 0 && i < chunks.size(); i++) {
+    std::future<int> next;
+    if (i + 1 < chunks.size()) {
+      next = std::async(std::launch::async, read_chunk, i + 1);
+    }
+    SHA1_Update(&ctx, buffers[i % 2]->data(), buffers[i % 2]->size());
+    if (next.valid()) {
+      error = next.get();
+    }
+  }
+  if (error != 0) {
+    errno = error;
+    return false;
+  }
+
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1_Final(digest, &ctx);
+  *hexdigest = print_sha1(digest);
+  return true;
+}
+
 // Print the hash in hex for corrupted source blocks (excluding the stashed blocks which is
 // handled separately).
 static void PrintHashForCorruptedSourceBlocks(const CommandParameters& params,
-                                              const std::vector<uint8_t>& buffer) {
+                                              const BlockBuffer& buffer) {
   LOG(INFO) << "unexpected contents of source blocks in cmd:\n" << params.cmdline;
   CHECK(params.tokens[0] == "move" || params.tokens[0] == "bsdiff" ||
         params.tokens[0] == "imgdiff");
@@ -603,33 +1576,27 @@ static void PrintHashForCorruptedSourceBlocks(const CommandParameters& params,
   }
 
   LOG(INFO) << "printing hash in hex for " << src.blocks() << " source blocks";
+  std::vector<std::string> hashes = HashEachBlock(buffer.data(), buffer.size() / BLOCKSIZE);
   for (size_t i = 0; i < src.blocks(); i++) {
     size_t block_num = src.GetBlockNumber(i);
     size_t buffer_index = locs.GetBlockNumber(i);
-    CHECK_LE((buffer_index + 1) * BLOCKSIZE, buffer.size());
-
-    uint8_t digest[SHA_DIGEST_LENGTH];
-    SHA1(buffer.data() + buffer_index * BLOCKSIZE, BLOCKSIZE, digest);
-    std::string hexdigest = print_sha1(digest);
-    LOG(INFO) << "  block number: " << block_num << ", SHA-1: " << hexdigest;
+    CHECK_LT(buffer_index, hashes.size());
+    LOG(INFO) << "  block number: " << block_num << ", SHA-1: " << hashes[buffer_index];
   }
 }
 
 // If the calculated hash for the whole stash doesn't match the stash id, print the SHA-1
 // in hex for each block.
 static void PrintHashForCorruptedStashedBlocks(const std::string& id,
-                                               const std::vector<uint8_t>& buffer,
+                                               const BlockBuffer& buffer,
                                                const RangeSet& src) {
   LOG(INFO) << "printing hash in hex for stash_id: " << id;
   CHECK_EQ(src.blocks() * BLOCKSIZE, buffer.size());
 
+  std::vector<std::string> hashes = HashEachBlock(buffer.data(), src.blocks());
   for (size_t i = 0; i < src.blocks(); i++) {
     size_t block_num = src.GetBlockNumber(i);
-
-    uint8_t digest[SHA_DIGEST_LENGTH];
-    SHA1(buffer.data() + i * BLOCKSIZE, BLOCKSIZE, digest);
-    std::string hexdigest = print_sha1(digest);
-    LOG(INFO) << "  block number: " << block_num << ", SHA-1: " << hexdigest;
+    LOG(INFO) << "  block number: " << block_num << ", SHA-1: " << hashes[i];
   }
 }
 
@@ -643,7 +1610,7 @@ static void PrintHashForMissingStashedBlocks(const std::string& id, int fd) {
 
   LOG(INFO) << "print hash in hex for source blocks in missing stash: " << id;
   const RangeSet& src = stash_map[id];
-  std::vector<uint8_t> buffer(src.blocks() * BLOCKSIZE);
+  BlockBuffer buffer(src.blocks() * BLOCKSIZE);
   if (ReadBlocks(src, buffer, fd) == -1) {
       LOG(ERROR) << "failed to read source blocks for stash: " << id;
       return;
@@ -651,14 +1618,9 @@ static void PrintHashForMissingStashedBlocks(const std::string& id, int fd) {
   PrintHashForCorruptedStashedBlocks(id, buffer, src);
 }
 
-static int VerifyBlocks(const std::string& expected, const std::vector<uint8_t>& buffer,
+static int VerifyBlocks(const std::string& expected, const BlockBuffer& buffer,
         const size_t blocks, bool printerror) {
-    uint8_t digest[SHA_DIGEST_LENGTH];
-    const uint8_t* data = buffer.data();
-
-    SHA1(data, blocks * BLOCKSIZE, digest);
-
-    std::string hexdigest = print_sha1(digest);
+    std::string hexdigest = HashData(buffer.data(), blocks * BLOCKSIZE);
 
     if (hexdigest != expected) {
         if (printerror) {
@@ -733,8 +1695,221 @@ static void DeleteStash(const std::string& base) {
   }
 }
 
+// Adds the in-memory stash |id| loaded from the |src| blocks, replacing any previous one.
+static MemoryStash& AddMemoryStash(CommandParameters& params, const std::string& id,
+                                   const RangeSet& src) {
+  MemoryStash& memory_stash = params.memory_stashes[id];
+  if (memory_stash.src) {
+    params.memory_stash_size -= memory_stash.data.capacity();
+    buffer_pool.Return(std::move(memory_stash.data));
+    params.pending_stash_blocks.Remove(memory_stash.src);
+  }
+  memory_stash.src = src;
+  params.pending_stash_blocks.Insert(src);
+  return memory_stash;
+}
+
+// Forgets the unsynced stash |id|, without touching its file. Returns whether it was unsynced.
+static bool EraseUnsyncedStash(CommandParameters& params, const std::string& id) {
+  auto unsynced = params.unsynced_stashes.find(id);
+  if (unsynced == params.unsynced_stashes.end()) {
+    return false;
+  }
+  params.pending_stash_blocks.Remove(unsynced->second);
+  params.unsynced_stashes.erase(unsynced);
+  return true;
+}
+
+// A compressed stash file starts with kStashLz4Magic, followed by chunks of up to
+// kStashChunkBlocks blocks. Each chunk is prefixed by its raw and stored sizes, the two being equal
+// for a chunk that doesn't compress. A chunk with a raw size of 0 ends the file. The file is padded
+// to a size that isn't a multiple of BLOCKSIZE, which tells it apart from a raw stash.
+static constexpr char kStashLz4Magic[8] = { 'S', 'T', 'A', 'S', 'H', 'L', 'Z', '4' };
+static constexpr size_t kStashChunkBlocks = 32;
+static constexpr size_t kStashChunkSize = kStashChunkBlocks * BLOCKSIZE;
+
+struct StashChunkHeader {
+  uint32_t raw_size;
+  uint32_t stored_size;
+};
+
+// Returns the most space the file of a stash of |blocks| blocks can take. Chunks that don't shrink
+// are kept as they are, so a compressed stash may take its raw size plus the framing.
+static size_t StashFileSize(size_t blocks, bool compress) {
+  size_t size = blocks * BLOCKSIZE;
+  if (compress) {
+    size_t chunks = (blocks + kStashChunkBlocks - 1) / kStashChunkBlocks;
+    size += sizeof(kStashLz4Magic) + (chunks + 1) * sizeof(StashChunkHeader) + 1;
+  }
+  return size;
+}
+
+// Writes the blocks of a stash to its file, LZ4 compressed if |compress| is true.
+class StashWriter {
+ public:
+  StashWriter(int fd, bool compress) : fd_(fd), compress_(compress) {}
+
+  int Write(const uint8_t* data, size_t size) {
+    if (!compress_) {
+      return write_all(fd_, data, size);
+    }
+    if (written_ == 0 && WriteRaw(reinterpret_cast<const uint8_t*>(kStashLz4Magic),
+                                  sizeof(kStashLz4Magic)) == -1) {
+      return -1;
+    }
+    while (size > 0) {
+      // Whole chunks are compressed in place, the rest is gathered until it fills one.
+      if (pending_.empty() && size >= kStashChunkSize) {
+        if (WriteChunk(data, kStashChunkSize) == -1) {
+          return -1;
+        }
+        data += kStashChunkSize;
+        size -= kStashChunkSize;
+        continue;
+      }
+      size_t n = std::min(size, kStashChunkSize - pending_.size());
+      pending_.insert(pending_.end(), data, data + n);
+      data += n;
+      size -= n;
+      if (pending_.size() == kStashChunkSize && FlushPending() == -1) {
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  int Write(const BlockBuffer& buffer, size_t size) {
+    return Write(buffer.data(), size);
+  }
+
+  // Writes the remaining data and the end of a compressed stash.
+  int Finish() {
+    if (!compress_) {
+      return 0;
+    }
+    if (written_ == 0 && WriteRaw(reinterpret_cast<const uint8_t*>(kStashLz4Magic),
+                                  sizeof(kStashLz4Magic)) == -1) {
+      return -1;
+    }
+    if (FlushPending() == -1) {
+      return -1;
+    }
+    StashChunkHeader end = { 0, 0 };
+    if (WriteRaw(reinterpret_cast<const uint8_t*>(&end), sizeof(end)) == -1) {
+      return -1;
+    }
+    if (written_ % BLOCKSIZE == 0) {
+      uint8_t padding = 0;
+      return WriteRaw(&padding, 1);
+    }
+    return 0;
+  }
+
+ private:
+  int WriteRaw(const uint8_t* data, size_t size) {
+    if (write_all(fd_, data, size) == -1) {
+      return -1;
+    }
+    written_ += size;
+    return 0;
+  }
+
+  int FlushPending() {
+    if (pending_.empty()) {
+      return 0;
+    }
+    int result = WriteChunk(pending_.data(), pending_.size());
+    pending_.clear();
+    return result;
+  }
+
+  int WriteChunk(const uint8_t* data, size_t size) {
+    compressed_.resize(sizeof(StashChunkHeader) + LZ4_compressBound(kStashChunkSize));
+    int stored = LZ4_compress_default(reinterpret_cast<const char*>(data),
+                                      reinterpret_cast<char*>(compressed_.data()) +
+                                          sizeof(StashChunkHeader),
+                                      size, compressed_.size() - sizeof(StashChunkHeader));
+    // Keeps the chunk as it is if it doesn't shrink.
+    if (stored <= 0 || static_cast<size_t>(stored) >= size) {
+      StashChunkHeader header = { static_cast<uint32_t>(size), static_cast<uint32_t>(size) };
+      if (WriteRaw(reinterpret_cast<const uint8_t*>(&header), sizeof(header)) == -1) {
+        return -1;
+      }
+      return WriteRaw(data, size);
+    }
+    StashChunkHeader header = { static_cast<uint32_t>(size), static_cast<uint32_t>(stored) };
+    memcpy(compressed_.data(), &header, sizeof(header));
+    return WriteRaw(compressed_.data(), sizeof(header) + stored);
+  }
+
+  int fd_;
+  bool compress_;
+  // The bytes written to the file so far.
+  size_t written_ = 0;
+  std::vector<uint8_t> pending_;
+  std::vector<uint8_t> compressed_;
+};
+
+// Decompresses the stash file contents |data| into |buffer|, and sets |size| to the stashed bytes.
+static int DecompressStash(const std::string& fn, const std::vector<uint8_t>& data,
+                           BlockBuffer& buffer, size_t* size) {
+  if (data.size() < sizeof(kStashLz4Magic) ||
+      memcmp(data.data(), kStashLz4Magic, sizeof(kStashLz4Magic)) != 0) {
+    LOG(ERROR) << fn << " size " << data.size() << " not multiple of block size " << BLOCKSIZE;
+    return -1;
+  }
+
+  // Sums up the chunk sizes first, to allocate the buffer once.
+  size_t raw_total = 0;
+  size_t pos = sizeof(kStashLz4Magic);
+  while (true) {
+    StashChunkHeader header;
+    if (data.size() - pos < sizeof(header)) {
+      LOG(ERROR) << fn << " is truncated at " << pos;
+      return -1;
+    }
+    memcpy(&header, data.data() + pos, sizeof(header));
+    pos += sizeof(header);
+    if (header.raw_size == 0) {
+      break;
+    }
+    if (header.raw_size > kStashChunkSize || header.raw_size % BLOCKSIZE != 0 ||
+        header.stored_size > header.raw_size || data.size() - pos < header.stored_size) {
+      LOG(ERROR) << fn << " has an invalid chunk at " << pos - sizeof(header);
+      return -1;
+    }
+    raw_total += header.raw_size;
+    pos += header.stored_size;
+  }
+
+  allocate(raw_total, buffer);
+  size_t out = 0;
+  pos = sizeof(kStashLz4Magic);
+  while (out < raw_total) {
+    StashChunkHeader header;
+    memcpy(&header, data.data() + pos, sizeof(header));
+    pos += sizeof(header);
+    const uint8_t* chunk = data.data() + pos;
+    if (header.stored_size == header.raw_size) {
+      memcpy(buffer.data() + out, chunk, header.raw_size);
+    } else if (LZ4_decompress_safe(reinterpret_cast<const char*>(chunk),
+                                   reinterpret_cast<char*>(buffer.data()) + out,
+                                   header.stored_size, header.raw_size) !=
+               static_cast<int>(header.raw_size)) {
+      LOG(ERROR) << fn << " has a corrupted chunk at " << pos - sizeof(header);
+      return -1;
+    }
+    out += header.raw_size;
+    pos += header.stored_size;
+  }
+
+  *size = raw_total;
+  return 0;
+}
+
 static int LoadStash(CommandParameters& params, const std::string& id, bool verify, size_t* blocks,
-                     std::vector<uint8_t>& buffer, bool printnoent) {
+                     BlockBuffer& buffer, bool printnoent) {
+  TraceTimer timer(&params.trace, kTraceStashLoad);
   // In verify mode, if source range_set was saved for the given hash, check contents in the source
   // blocks first. If the check fails, search for the stashed files on /cache as usual.
   if (!params.canwrite) {
@@ -742,7 +1917,7 @@ static int LoadStash(CommandParameters& params, const std::string& id, bool veri
       const RangeSet& src = stash_map[id];
       allocate(src.blocks() * BLOCKSIZE, buffer);
 
-      if (ReadBlocks(src, buffer, params.fd) == -1) {
+      if (ReadBlocks(src, buffer, BlockFd(params), params.io_queue.get()) == -1) {
         LOG(ERROR) << "failed to read source blocks in stash map.";
         return -1;
       }
@@ -760,7 +1935,21 @@ static int LoadStash(CommandParameters& params, const std::string& id, bool veri
     blocks = &blockcount;
   }
 
-  std::string fn = GetStashFileName(params.stashbase, id, "");
+  // The blocks in memory have been verified when they were stashed.
+  auto memory_stash = params.memory_stashes.find(id);
+  if (memory_stash != params.memory_stashes.end()) {
+    const BlockBuffer& data = memory_stash->second.data;
+    LOG(INFO) << " loading " << id << " from memory";
+    allocate(data.size(), buffer);
+    memcpy(buffer.data(), data.data(), data.size());
+    *blocks = data.size() / BLOCKSIZE;
+    timer.set_bytes(data.size());
+    return 0;
+  }
+
+  // An unsynced stash is still in its .partial file.
+  bool unsynced = params.unsynced_stashes.find(id) != params.unsynced_stashes.end();
+  std::string fn = GetStashFileName(params.stashbase, id, unsynced ? ".partial" : "");
 
   struct stat sb;
   if (stat(fn.c_str(), &sb) == -1) {
@@ -773,24 +1962,30 @@ static int LoadStash(CommandParameters& params, const std::string& id, bool veri
 
   LOG(INFO) << " loading " << fn;
 
-  if ((sb.st_size % BLOCKSIZE) != 0) {
-    LOG(ERROR) << fn << " size " << sb.st_size << " not multiple of block size " << BLOCKSIZE;
-    return -1;
-  }
-
   android::base::unique_fd fd(TEMP_FAILURE_RETRY(ota_open(fn.c_str(), O_RDONLY)));
   if (fd == -1) {
     PLOG(ERROR) << "open \"" << fn << "\" failed";
     return -1;
   }
 
-  allocate(sb.st_size, buffer);
+  // A raw stash holds whole blocks, anything else must be a compressed one.
+  size_t size = sb.st_size;
+  if ((sb.st_size % BLOCKSIZE) != 0) {
+    std::vector<uint8_t> data(sb.st_size);
+    if (read_all(fd, data.data(), data.size()) == -1 ||
+        DecompressStash(fn, data, buffer, &size) == -1) {
+      return -1;
+    }
+  } else {
+    allocate(sb.st_size, buffer);
 
-  if (read_all(fd, buffer, sb.st_size) == -1) {
-    return -1;
+    if (read_all(fd, buffer, sb.st_size) == -1) {
+      return -1;
+    }
   }
 
-  *blocks = sb.st_size / BLOCKSIZE;
+  *blocks = size / BLOCKSIZE;
+  timer.set_bytes(size);
 
   if (verify && VerifyBlocks(id, buffer, *blocks, true) != 0) {
     LOG(ERROR) << "unexpected contents in " << fn;
@@ -802,6 +1997,39 @@ static int LoadStash(CommandParameters& params, const std::string& id, bool veri
       PrintHashForCorruptedStashedBlocks(id, buffer, src);
     }
     DeleteFile(fn);
+    EraseUnsyncedStash(params, id);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Creates the stash file |fn| and fills it with |write_contents|, which writes the stashed blocks
+// to the given writer. The blocks are LZ4 compressed if |compress| is true, and the file is synced
+// if |sync| is true.
+static int WriteStashFile(const std::string& fn,
+                          const std::function<int(StashWriter&)>& write_contents, bool compress,
+                          bool sync) {
+  android::base::unique_fd fd(
+      TEMP_FAILURE_RETRY(ota_open(fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC, STASH_FILE_MODE)));
+  if (fd == -1) {
+    PLOG(ERROR) << "failed to create \"" << fn << "\"";
+    return -1;
+  }
+
+  if (fchown(fd, AID_SYSTEM, AID_SYSTEM) != 0) {  // system user
+    PLOG(ERROR) << "failed to chown \"" << fn << "\"";
+    return -1;
+  }
+
+  StashWriter writer(fd, compress);
+  if (write_contents(writer) == -1 || writer.Finish() == -1) {
+    return -1;
+  }
+
+  if (sync && ota_fsync(fd) == -1) {
+    SetFailureType(kFsyncFailure);
+    PLOG(ERROR) << "fsync \"" << fn << "\" failed";
     return -1;
   }
 
@@ -809,12 +2037,13 @@ static int LoadStash(CommandParameters& params, const std::string& id, bool veri
 }
 
 static int WriteStash(const std::string& base, const std::string& id, int blocks,
-                      std::vector<uint8_t>& buffer, bool checkspace, bool* exists) {
+                      const std::function<int(StashWriter&)>& write_contents, bool checkspace,
+                      bool* exists, bool compress) {
     if (base.empty()) {
         return -1;
     }
 
-    if (checkspace && CacheSizeCheck(blocks * BLOCKSIZE) != 0) {
+    if (checkspace && CacheSizeCheck(StashFileSize(blocks, compress)) != 0) {
         LOG(ERROR) << "not enough space to write stash";
         return -1;
     }
@@ -840,25 +2069,7 @@ static int WriteStash(const std::string& base, const std::string& id, int blocks
 
     LOG(INFO) << " writing " << blocks << " blocks to " << cn;
 
-    android::base::unique_fd fd(
-        TEMP_FAILURE_RETRY(ota_open(fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC, STASH_FILE_MODE)));
-    if (fd == -1) {
-        PLOG(ERROR) << "failed to create \"" << fn << "\"";
-        return -1;
-    }
-
-    if (fchown(fd, AID_SYSTEM, AID_SYSTEM) != 0) {  // system user
-        PLOG(ERROR) << "failed to chown \"" << fn << "\"";
-        return -1;
-    }
-
-    if (write_all(fd, buffer, blocks * BLOCKSIZE) == -1) {
-        return -1;
-    }
-
-    if (ota_fsync(fd) == -1) {
-        failure_type = kFsyncFailure;
-        PLOG(ERROR) << "fsync \"" << fn << "\" failed";
+    if (WriteStashFile(fn, write_contents, compress, true) != 0) {
         return -1;
     }
 
@@ -871,13 +2082,13 @@ static int WriteStash(const std::string& base, const std::string& id, int blocks
     android::base::unique_fd dfd(TEMP_FAILURE_RETRY(ota_open(dname.c_str(),
                                                              O_RDONLY | O_DIRECTORY)));
     if (dfd == -1) {
-        failure_type = kFileOpenFailure;
+        SetFailureType(kFileOpenFailure);
         PLOG(ERROR) << "failed to open \"" << dname << "\" failed";
         return -1;
     }
 
     if (ota_fsync(dfd) == -1) {
-        failure_type = kFsyncFailure;
+        SetFailureType(kFsyncFailure);
         PLOG(ERROR) << "fsync \"" << dname << "\" failed";
         return -1;
     }
@@ -885,11 +2096,104 @@ static int WriteStash(const std::string& base, const std::string& id, int blocks
     return 0;
 }
 
+static int WriteStash(const std::string& base, const std::string& id, int blocks,
+                      const BlockBuffer& buffer, bool checkspace, bool* exists, bool compress) {
+  return WriteStash(base, id, blocks,
+                    [&buffer, blocks](StashWriter& writer) {
+                      return writer.Write(buffer, blocks * BLOCKSIZE);
+                    },
+                    checkspace, exists, compress);
+}
+
+// Writes the stash to its .partial file without syncing it. It's renamed by SyncStashes(), and the
+// source blocks must stay intact until then, as the command that stashed them runs again if the
+// update gets interrupted before.
+static int WriteUnsyncedStash(CommandParameters& params, const std::string& id, int blocks,
+                              const BlockBuffer& buffer, const RangeSet& src) {
+  std::string cn = GetStashFileName(params.stashbase, id, "");
+  struct stat sb;
+  if (stat(cn.c_str(), &sb) == 0) {
+    // Same as in WriteStash(), the existing file has the same contents.
+    LOG(INFO) << " skipping " << blocks << " existing blocks in " << cn;
+    return 0;
+  }
+
+  std::string fn = GetStashFileName(params.stashbase, id, ".partial");
+  LOG(INFO) << " writing " << blocks << " blocks to " << fn;
+  if (WriteStashFile(fn,
+                     [&buffer, blocks](StashWriter& writer) {
+                       return writer.Write(buffer, blocks * BLOCKSIZE);
+                     },
+                     params.compress_stash, false) != 0) {
+    return -1;
+  }
+  EraseUnsyncedStash(params, id);
+  params.unsynced_stashes[id] = src;
+  params.pending_stash_blocks.Insert(src);
+  return 0;
+}
+
+// Syncs all the unsynced stashes with a single syncfs() of the stash filesystem, and then renames
+// them to their final names. This takes two barriers no matter how many stashes there are, instead
+// of two for each of them.
+static int SyncStashes(CommandParameters& params) {
+  if (params.unsynced_stashes.empty()) {
+    return 0;
+  }
+
+  TraceTimer timer(&params.trace, kTraceFsync);
+  std::string dname = GetStashFileName(params.stashbase, "", "");
+  android::base::unique_fd dfd(
+      TEMP_FAILURE_RETRY(ota_open(dname.c_str(), O_RDONLY | O_DIRECTORY)));
+  if (dfd == -1) {
+    SetFailureType(kFileOpenFailure);
+    PLOG(ERROR) << "failed to open \"" << dname << "\" failed";
+    return -1;
+  }
+
+  if (syncfs(dfd) == -1) {
+    SetFailureType(kFsyncFailure);
+    PLOG(ERROR) << "syncfs \"" << dname << "\" failed";
+    return -1;
+  }
+
+  for (const auto& unsynced : params.unsynced_stashes) {
+    std::string fn = GetStashFileName(params.stashbase, unsynced.first, ".partial");
+    std::string cn = GetStashFileName(params.stashbase, unsynced.first, "");
+    if (rename(fn.c_str(), cn.c_str()) == -1) {
+      PLOG(ERROR) << "rename(\"" << fn << "\", \"" << cn << "\") failed";
+      return -1;
+    }
+  }
+
+  if (ota_fsync(dfd) == -1) {
+    SetFailureType(kFsyncFailure);
+    PLOG(ERROR) << "fsync \"" << dname << "\" failed";
+    return -1;
+  }
+
+  LOG(INFO) << "synced " << params.unsynced_stashes.size() << " stashes";
+  for (const auto& unsynced : params.unsynced_stashes) {
+    params.pending_stash_blocks.Remove(unsynced.second);
+  }
+  params.unsynced_stashes.clear();
+  return 0;
+}
+
+// Deletes the stash |id| if it hasn't been synced yet. Returns whether it was unsynced.
+static bool DeleteUnsyncedStash(CommandParameters& params, const std::string& id) {
+  if (!EraseUnsyncedStash(params, id)) {
+    return false;
+  }
+  DeleteFile(GetStashFileName(params.stashbase, id, ".partial"));
+  return true;
+}
+
 // Creates a directory for storing stash files and checks if the /cache partition
 // hash enough space for the expected amount of blocks we need to store. Returns
 // >0 if we created the directory, zero if it existed already, and <0 of failure.
 
-static int CreateStash(State* state, size_t maxblocks, const std::string& blockdev,
+static int CreateStash(State* state, size_t maxblocks, bool compress, const std::string& blockdev,
                        std::string& base) {
   if (blockdev.empty()) {
     return -1;
@@ -905,7 +2209,9 @@ static int CreateStash(State* state, size_t maxblocks, const std::string& blockd
   std::string dirname = GetStashFileName(base, "", "");
   struct stat sb;
   int res = stat(dirname.c_str(), &sb);
-  size_t max_stash_size = maxblocks * BLOCKSIZE;
+  // Compressed stashes may not shrink at all, so they're checked for their worst case, which is
+  // reached when each block goes in a stash of its own.
+  size_t max_stash_size = maxblocks * StashFileSize(1, compress);
 
   if (res == -1 && errno != ENOENT) {
     ErrorAbort(state, kStashCreationFailure, "stat \"%s\" failed: %s", dirname.c_str(),
@@ -979,41 +2285,476 @@ static int FreeStash(const std::string& base, const std::string& id) {
   return 0;
 }
 
-// Source contains packed data, which we want to move to the locations given in locs in the dest
-// buffer. source and dest may be the same buffer.
-static void MoveRange(std::vector<uint8_t>& dest, const RangeSet& locs,
-                      const std::vector<uint8_t>& source) {
-  const uint8_t* from = source.data();
-  uint8_t* to = dest.data();
-  size_t start = locs.blocks();
-  // Must do the movement backward.
-  for (auto it = locs.crbegin(); it != locs.crend(); it++) {
-    size_t blocks = it->second - it->first;
-    start -= blocks;
-    memmove(to + (it->first * BLOCKSIZE), from + (start * BLOCKSIZE), blocks * BLOCKSIZE);
+// Writes all the in-memory stashes to /cache, and syncs them along with the unsynced ones. This
+// must happen before the last command index advances, as the commands that created them won't run
+// again when resuming the update.
+static int FlushMemoryStashes(CommandParameters& params) {
+  if (!params.memory_stashes.empty()) {
+    LOG(INFO) << "writing " << params.memory_stashes.size() << " in-memory stashes to disk";
+  }
+  for (auto& memory_stash : params.memory_stashes) {
+    BlockBuffer& data = memory_stash.second.data;
+    int blocks = data.size() / BLOCKSIZE;
+    bool exists = false;
+    TraceTimer timer(&params.trace, kTraceStashWrite, data.size());
+    int result = params.group_commit ? WriteUnsyncedStash(params, memory_stash.first, blocks, data,
+                                                          memory_stash.second.src)
+                                     : WriteStash(params.stashbase, memory_stash.first, blocks,
+                                                  data, false, &exists, params.compress_stash);
+    if (result != 0) {
+      LOG(ERROR) << "failed to write stash " << memory_stash.first;
+      return -1;
+    }
+  }
+  for (auto& memory_stash : params.memory_stashes) {
+    params.memory_stash_size -= memory_stash.second.data.capacity();
+    buffer_pool.Return(std::move(memory_stash.second.data));
+    params.pending_stash_blocks.Remove(memory_stash.second.src);
   }
+  params.memory_stashes.clear();
+  return SyncStashes(params);
 }
 
-/**
- * We expect to parse the remainder of the parameter tokens as one of:
- *
- *    <src_block_count> <src_range>
- *        (loads data from source image only)
- *
- *    <src_block_count> - <[stash_id:stash_range] ...>
- *        (loads data from stashes only)
- *
- *    <src_block_count> <src_range> <src_loc> <[stash_id:stash_range] ...>
- *        (loads data from both source image and stashes)
- *
- * On return, params.buffer is filled with the loaded source data (rearranged and combined with
- * stashed data as necessary). buffer may be reallocated if needed to accommodate the source data.
- * tgt is the target RangeSet for detecting overlaps. Any stashes required are loaded using
- * LoadStash.
- */
-static int LoadSourceBlocks(CommandParameters& params, const RangeSet& tgt, size_t* src_blocks,
-                            bool* overlap) {
-  CHECK(src_blocks != nullptr);
+// The number of completed commands that are saved to the completed commands file at a time, on top
+// of the checkpoints.
+static constexpr size_t kCompletedCommandsBatch = 64;
+
+// Marks the command at |cmdindex| as completed, after its blocks have been synced.
+static void MarkCompleted(CommandParameters& params, int cmdindex) {
+  if (cmdindex < 0 || static_cast<size_t>(cmdindex) >= params.completed.size()) {
+    return;
+  }
+  params.completed[cmdindex] = true;
+  params.unsaved_completed++;
+}
+
+static void SaveCompletedCommands(CommandParameters& params) {
+  if (params.unsaved_completed == 0) {
+    return;
+  }
+  if (!WriteCompletedCommands(params.last_command_file, params.transfer_list_digest,
+                              params.completed)) {
+    LOG(WARNING) << "Failed to update the completed commands file.";
+  }
+  params.unsaved_completed = 0;
+}
+
+// Whether the command at |cmdindex| has completed in a previous attempt, and doesn't need to run
+// again when resuming.
+static bool SkipCompleted(const std::vector<bool>& skip_completed, int cmdindex) {
+  return cmdindex >= 0 && static_cast<size_t>(cmdindex) < skip_completed.size() &&
+         skip_completed[cmdindex];
+}
+
+// Returns the commands recorded in |completed| that a resumed update can skip. A completed 'stash'
+// runs again unless the stash has been freed by a completed command too, as the in-memory stashes
+// are gone; its source blocks are intact, since they can't be overwritten before the stash is
+// written to disk, which advances the last command index past it.
+static std::vector<bool> SkippableCommands(const std::vector<std::string>& lines, size_t start,
+                                           const std::vector<bool>& completed) {
+  std::vector<bool> skip(completed);
+  // Whether the next 'free' of each stash id has completed.
+  std::unordered_map<std::string, bool> freed;
+  for (size_t i = completed.size(); i-- > 0;) {
+    const std::string& line = lines[start + i];
+    if (android::base::StartsWith(line, "free ")) {
+      freed[android::base::Split(line, " ")[1]] = completed[i];
+    } else if (completed[i] && android::base::StartsWith(line, "stash ")) {
+      auto it = freed.find(android::base::Split(line, " ")[1]);
+      skip[i] = it != freed.end() && it->second;
+    }
+  }
+  return skip;
+}
+
+// Reads and drops the new data of a skipped 'new' command writing to |tgt|, so that the following
+// ones get theirs.
+static bool DiscardNewData(CommandParameters& params, const RangeSet& tgt) {
+  size_t size = tgt.blocks() * BLOCKSIZE;
+  allocate(std::min(size, params.nti.ring->capacity()), params.buffer);
+  while (size > 0) {
+    size_t count =
+        params.nti.ring->Read(params.buffer.data(), std::min(size, params.buffer.size()));
+    if (count == 0) {
+      LOG(ERROR) << "missing " << size << " bytes of new data";
+      return false;
+    }
+    size -= count;
+  }
+  return true;
+}
+
+// Writes the pending stashes to disk ahead of the command at |cmdindex|, and marks the previous
+// command as the last executed one, so that a resumed update doesn't need their source blocks.
+static int CheckpointStashes(CommandParameters& params, int cmdindex,
+                             const std::string& prev_cmdline) {
+  if (params.memory_stashes.empty() && params.unsynced_stashes.empty()) {
+    return 0;
+  }
+  if (FlushMemoryStashes(params) != 0) {
+    return -1;
+  }
+  if (cmdindex > 0 &&
+      !UpdateLastCommandIndex(params.last_command_file, cmdindex - 1, prev_cmdline)) {
+    LOG(WARNING) << "Failed to update the last command file.";
+  }
+  SaveCompletedCommands(params);
+  return 0;
+}
+
+// Returns the ids of the stashes that the command given by |tokens| loads, i.e. the
+// <stash_id>:<stash_range> parameters of 'move', 'bsdiff' and 'imgdiff'.
+static std::vector<std::string> StashReferences(const std::vector<std::string>& tokens) {
+  std::vector<std::string> ids;
+  if (tokens[0] != "move" && tokens[0] != "bsdiff" && tokens[0] != "imgdiff") {
+    return ids;
+  }
+  for (const auto& token : tokens) {
+    size_t colon = token.find(':');
+    if (colon != std::string::npos) {
+      ids.push_back(token.substr(0, colon));
+    }
+  }
+  return ids;
+}
+
+// Drops the stashes that aren't needed anymore after the current command has completed, without
+// waiting for the 'free' commands.
+static void ReleaseStashReferences(CommandParameters& params) {
+  for (const auto& id : StashReferences(params.tokens)) {
+    auto refs = params.stash_refs.find(id);
+    if (refs == params.stash_refs.end() || --refs->second > 0) {
+      continue;
+    }
+    params.stash_refs.erase(refs);
+
+    LOG(INFO) << "releasing stash " << id << " after its last use";
+    auto memory_stash = params.memory_stashes.find(id);
+    if (memory_stash != params.memory_stashes.end()) {
+      params.memory_stash_size -= memory_stash->second.data.capacity();
+      buffer_pool.Return(std::move(memory_stash->second.data));
+      params.pending_stash_blocks.Remove(memory_stash->second.src);
+      params.memory_stashes.erase(memory_stash);
+    }
+    if (!DeleteUnsyncedStash(params, id)) {
+      FreeStash(params.stashbase, id);
+    }
+  }
+}
+
+static void DropRetainedStashes(CommandParameters& params) {
+  for (auto& retained : params.retained_stashes) {
+    params.memory_stash_size -= retained.second.capacity();
+    buffer_pool.Return(std::move(retained.second));
+  }
+  params.retained_stashes.clear();
+}
+
+// Returns whether writing to |tgt| would overwrite the source blocks of an in-memory or unsynced
+// stash.
+static bool OverlapsPendingStashes(const CommandParameters& params, const RangeSet& tgt) {
+  return params.pending_stash_blocks.Overlaps(tgt);
+}
+
+// Returns the blocks that the command given by |tokens| writes to, or an empty RangeSet if it
+// doesn't write to the target.
+static RangeSet CommandTargetRange(const std::vector<std::string>& tokens) {
+  static const std::unordered_map<std::string, size_t> kTargetPositions = {
+    { "move", 2 }, { "bsdiff", 5 }, { "imgdiff", 5 }, { "new", 1 }, { "zero", 1 }, { "erase", 1 },
+  };
+  auto it = kTargetPositions.find(tokens[0]);
+  if (it == kTargetPositions.end() || it->second >= tokens.size()) {
+    return RangeSet();
+  }
+  return RangeSet::Parse(tokens[it->second]);
+}
+
+// Returns the blocks of the partition that the command given by |tokens| reads as its source.
+static RangeSet CommandSourceRange(const std::vector<std::string>& tokens) {
+  static const std::unordered_map<std::string, size_t> kSourcePositions = {
+    { "move", 4 }, { "bsdiff", 7 }, { "imgdiff", 7 }, { "stash", 2 },
+  };
+  auto it = kSourcePositions.find(tokens[0]);
+  if (it == kSourcePositions.end() || it->second >= tokens.size() || tokens[it->second] == "-") {
+    return RangeSet();
+  }
+  return RangeSet::Parse(tokens[it->second]);
+}
+
+// A command of the transfer list, as seen by the planning pass before the execution starts.
+struct PlannedCommand {
+  size_t line;
+  // The blocks read from the partition. For 'move', 'bsdiff' and 'imgdiff', the target blocks are
+  // read as well, to check if the command has been executed already.
+  std::vector<RangeSet> reads;
+  // The number of blocks that the command counts as written.
+  size_t written;
+  // The patch data of a 'bsdiff' or 'imgdiff', or 0 bytes for the other commands.
+  size_t patch_offset;
+  size_t patch_len;
+};
+
+// The pre-scanned transfer list. It's used to prefetch the blocks that the upcoming commands read,
+// and to drop them from the page cache once no other command reads them.
+struct TransferPlan {
+  std::vector<PlannedCommand> commands;
+  // The number of pending commands reading each block. Blocks read by more than UINT8_MAX commands
+  // are never dropped.
+  std::vector<uint8_t> readers;
+  // The blocks of the commands that have been skipped when resuming the update.
+  size_t skipped_written;
+  size_t total_written;
+  // The next command to execute, and the first one that hasn't been prefetched.
+  size_t next;
+  size_t next_prefetch;
+  size_t prefetched_blocks;
+  // The first command whose patch data hasn't been prefetched, and the prefetched ones that haven't
+  // been executed yet.
+  size_t next_patch;
+  std::deque<size_t> prefetched_patches;
+};
+
+// Don't keep more than this many blocks prefetched ahead of the commands being executed.
+static constexpr size_t kMaxPrefetchBlocks = 8192;
+
+// Parses the commands after |start| that are yet to run, i.e. the ones after
+// |last_command_index| when resuming an update, other than the completed ones to skip.
+static void PlanTransferList(const std::vector<std::string>& lines, size_t start,
+                             int last_command_index, CommandParameters& params,
+                             TransferPlan* plan) {
+  static const std::unordered_map<std::string, bool> kWriteCommands = {
+    { "move", true }, { "bsdiff", true }, { "imgdiff", true }, { "new", false }, { "zero", false },
+  };
+
+  *plan = {};
+  size_t shared_blocks = 0;
+  for (size_t i = start; i < lines.size(); i++) {
+    if (lines[i].empty()) continue;
+    std::vector<std::string> tokens = android::base::Split(lines[i], " ");
+    auto write_command = kWriteCommands.find(tokens[0]);
+
+    PlannedCommand cmd{ i, {}, 0, 0, 0 };
+    if ((tokens[0] == "bsdiff" || tokens[0] == "imgdiff") && tokens.size() > 2 &&
+        (!android::base::ParseUint(tokens[1], &cmd.patch_offset) ||
+         !android::base::ParseUint(tokens[2], &cmd.patch_len))) {
+      // The command reports the malformed patch when it runs.
+      cmd.patch_len = 0;
+    }
+    if (write_command != kWriteCommands.end()) {
+      RangeSet tgt = CommandTargetRange(tokens);
+      cmd.written = tgt.blocks();
+      if (write_command->second && tgt) {
+        cmd.reads.push_back(std::move(tgt));
+      }
+    }
+    if ((last_command_index >= 0 && i - start <= static_cast<size_t>(last_command_index)) ||
+        SkipCompleted(params.skip_completed, i - start)) {
+      plan->skipped_written += cmd.written;
+      plan->total_written += cmd.written;
+      continue;
+    }
+    plan->total_written += cmd.written;
+
+    RangeSet src = CommandSourceRange(tokens);
+    if (src) {
+      cmd.reads.push_back(std::move(src));
+    }
+    for (const auto& id : StashReferences(tokens)) {
+      params.stash_refs[id]++;
+    }
+
+    for (const auto& rs : cmd.reads) {
+      for (const auto& range : rs) {
+        if (plan->readers.size() < range.second) {
+          plan->readers.resize(range.second);
+        }
+        for (size_t block = range.first; block < range.second; block++) {
+          uint8_t& count = plan->readers[block];
+          if (count == 1) shared_blocks++;
+          if (count < UINT8_MAX) count++;
+        }
+      }
+    }
+    plan->commands.push_back(std::move(cmd));
+  }
+
+  LOG(INFO) << "planned " << plan->commands.size() << " commands to write "
+            << plan->total_written - plan->skipped_written << " blocks; " << shared_blocks
+            << " blocks are read by multiple commands";
+}
+
+// Marks the commands before |line| as executed, and drops the blocks that no pending command reads
+// from the page cache.
+static void ReleaseBlocks(int fd, TransferPlan* plan, size_t line) {
+  for (; plan->next < plan->commands.size() && plan->commands[plan->next].line < line;
+       plan->next++) {
+    const PlannedCommand& cmd = plan->commands[plan->next];
+    for (const auto& rs : cmd.reads) {
+      if (plan->next < plan->next_prefetch) {
+        plan->prefetched_blocks -= std::min(plan->prefetched_blocks, rs.blocks());
+      }
+      for (const auto& range : rs) {
+        size_t run_start = range.first;
+        for (size_t block = range.first; block <= range.second; block++) {
+          bool unused = false;
+          if (block < range.second) {
+            uint8_t& count = plan->readers[block];
+            if (count > 0 && count < UINT8_MAX) count--;
+            unused = count == 0;
+          }
+          if (!unused) {
+            if (block > run_start) {
+              posix_fadvise(fd, static_cast<off64_t>(run_start) * BLOCKSIZE,
+                            static_cast<off64_t>(block - run_start) * BLOCKSIZE,
+                            POSIX_FADV_DONTNEED);
+            }
+            run_start = block + 1;
+          }
+        }
+      }
+    }
+  }
+}
+
+// Asks the kernel to read ahead the blocks for the commands from |line| on, up to
+// kMaxPrefetchBlocks.
+static void PrefetchBlocks(int fd, TransferPlan* plan, size_t line) {
+  // The commands before |line| that didn't get to ReleaseBlocks() (e.g. the ones that returned
+  // early) are done with their blocks as well.
+  ReleaseBlocks(fd, plan, line);
+  if (plan->next_prefetch < plan->next) {
+    plan->next_prefetch = plan->next;
+    plan->prefetched_blocks = 0;
+  }
+
+  while (plan->next_prefetch < plan->commands.size() &&
+         plan->prefetched_blocks < kMaxPrefetchBlocks) {
+    const PlannedCommand& cmd = plan->commands[plan->next_prefetch++];
+    for (const auto& rs : cmd.reads) {
+      ForEachContiguousRun(rs, [fd](size_t, off64_t offset, size_t size) {
+        posix_fadvise(fd, offset, size, POSIX_FADV_WILLNEED);
+        return 0;
+      });
+      plan->prefetched_blocks += rs.blocks();
+    }
+  }
+}
+
+// Faults in the patch data of the next |lookahead| 'bsdiff' and 'imgdiff' commands from |line| on,
+// so that patching one of them doesn't wait for the package to be read. The pages are advised to
+// the kernel and touched on the shared thread pool, which also fills in a lazily mapped block map.
+// |map| is kept alive by the task that touches them.
+static void PrefetchPatches(const uint8_t* patch_start, size_t patch_size,
+                            const std::shared_ptr<MemMapping>& map, size_t lookahead,
+                            TransferPlan* plan, size_t line) {
+  while (!plan->prefetched_patches.empty() &&
+         plan->commands[plan->prefetched_patches.front()].line < line) {
+    plan->prefetched_patches.pop_front();
+  }
+  while (plan->next_patch < plan->commands.size() && plan->commands[plan->next_patch].line < line) {
+    plan->next_patch++;
+  }
+
+  while (plan->prefetched_patches.size() < lookahead && plan->next_patch < plan->commands.size()) {
+    size_t index = plan->next_patch++;
+    const PlannedCommand& cmd = plan->commands[index];
+    if (cmd.patch_len == 0 || cmd.patch_offset >= patch_size ||
+        cmd.patch_len > patch_size - cmd.patch_offset) {
+      continue;
+    }
+    plan->prefetched_patches.push_back(index);
+
+    const uint8_t* data = patch_start + cmd.patch_offset;
+    size_t len = cmd.patch_len;
+    AdviseMappedRange(data, len, MemAccess::WILLNEED);
+    if (map) {
+      ThreadPool::Shared().Submit([map, data, len]() {
+        static const size_t page_size = sysconf(_SC_PAGESIZE);
+        for (size_t offset = 0; offset < len; offset += page_size) {
+          (void)*static_cast<const volatile uint8_t*>(data + offset);
+        }
+        (void)*static_cast<const volatile uint8_t*>(data + len - 1);
+      }, ThreadPool::Priority::kLow);
+    }
+  }
+}
+
+// Reports the fraction of the blocks that have been written, counting the ones written before the
+// update was resumed. The expected time to completion is logged every 10%, based on the rate since
+// |start|.
+static void ReportProgress(State* state, FILE* cmd_pipe, const CommandParameters& params,
+                           const TransferPlan& plan,
+                           std::chrono::steady_clock::time_point start, size_t* step) {
+  if (plan.total_written == 0) {
+    return;
+  }
+  size_t done = std::min(plan.skipped_written + params.written, plan.total_written);
+  if (params.shared_progress != nullptr) {
+    SharedProgress& progress = *params.shared_progress;
+    std::lock_guard<std::mutex> lock(progress.mutex);
+    progress.blocks[params.progress_slot] = { done, plan.total_written };
+    size_t all_done = 0;
+    size_t all_total = 0;
+    for (const auto& blocks : progress.blocks) {
+      all_done += blocks.first;
+      all_total += blocks.second;
+    }
+    // The total grows as the other updates start; never report going backwards.
+    progress.reported =
+        std::max(progress.reported, static_cast<double>(all_done) / all_total);
+    fprintf(cmd_pipe, "set_progress %.4f\n", BranchProgress(state, progress.reported));
+    fflush(cmd_pipe);
+  } else {
+    double fraction = static_cast<double>(done) / plan.total_written;
+    fprintf(cmd_pipe, "set_progress %.4f\n", BranchProgress(state, fraction));
+    fflush(cmd_pipe);
+  }
+
+  size_t current_step = done * 10 / plan.total_written;
+  if (current_step > *step && params.written > 0) {
+    *step = current_step;
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    double remaining = elapsed.count() * (plan.total_written - done) / params.written;
+    LOG(INFO) << "wrote " << current_step * 10 << "% of the blocks in " << elapsed.count()
+              << " s; about " << static_cast<int>(remaining) << " s remaining";
+  }
+}
+
+// Source contains packed data, which we want to move to the locations given in locs in the dest
+// buffer. source and dest may be the same buffer.
+static void MoveRange(BlockBuffer& dest, const RangeSet& locs,
+                      const BlockBuffer& source) {
+  const uint8_t* from = source.data();
+  uint8_t* to = dest.data();
+  size_t start = locs.blocks();
+  // Must do the movement backward.
+  for (auto it = locs.crbegin(); it != locs.crend(); it++) {
+    size_t blocks = it->second - it->first;
+    start -= blocks;
+    memmove(to + (it->first * BLOCKSIZE), from + (start * BLOCKSIZE), blocks * BLOCKSIZE);
+  }
+}
+
+/**
+ * We expect to parse the remainder of the parameter tokens as one of:
+ *
+ *    <src_block_count> <src_range>
+ *        (loads data from source image only)
+ *
+ *    <src_block_count> - <[stash_id:stash_range] ...>
+ *        (loads data from stashes only)
+ *
+ *    <src_block_count> <src_range> <src_loc> <[stash_id:stash_range] ...>
+ *        (loads data from both source image and stashes)
+ *
+ * On return, params.buffer is filled with the loaded source data (rearranged and combined with
+ * stashed data as necessary). buffer may be reallocated if needed to accommodate the source data.
+ * tgt is the target RangeSet for detecting overlaps. Any stashes required are loaded using
+ * LoadStash.
+ */
+static int LoadSourceBlocks(CommandParameters& params, const RangeSet& tgt, size_t* src_blocks,
+                            bool* overlap) {
+  CHECK(src_blocks != nullptr);
   CHECK(overlap != nullptr);
 
   // <src_block_count>
@@ -1034,7 +2775,8 @@ static int LoadSourceBlocks(CommandParameters& params, const RangeSet& tgt, size
     CHECK(static_cast<bool>(src));
     *overlap = src.Overlaps(tgt);
 
-    if (ReadBlocks(src, params.buffer, params.fd) == -1) {
+    TraceTimer timer(&params.trace, kTraceSourceLoad, src.blocks() * BLOCKSIZE);
+    if (ReadBlocks(src, params.buffer, BlockFd(params), params.io_queue.get()) == -1) {
       return -1;
     }
 
@@ -1058,8 +2800,8 @@ static int LoadSourceBlocks(CommandParameters& params, const RangeSet& tgt, size
       return -1;
     }
 
-    std::vector<uint8_t> stash;
-    if (LoadStash(params, tokens[0], false, nullptr, stash, true) == -1) {
+    PooledBlockBuffer stash(0);
+    if (LoadStash(params, tokens[0], false, nullptr, *stash, true) == -1) {
       // These source blocks will fail verification if used later, but we
       // will let the caller decide if this is a fatal failure
       LOG(ERROR) << "failed to load stash " << tokens[0];
@@ -1068,12 +2810,45 @@ static int LoadSourceBlocks(CommandParameters& params, const RangeSet& tgt, size
 
     RangeSet locs = RangeSet::Parse(tokens[1]);
     CHECK(static_cast<bool>(locs));
-    MoveRange(params.buffer, locs, stash);
+    MoveRange(params.buffer, locs, *stash);
   }
 
   return 0;
 }
 
+// Stashes the source blocks of a command that overwrites them, so that it can be resumed from
+// possible write errors. |write_contents| writes the |blocks| source blocks to the stash file.
+static int StashOverlappingSource(CommandParameters& params, const std::string& srchash,
+                                  size_t blocks,
+                                  const std::function<int(StashWriter&)>& write_contents) {
+  LOG(INFO) << "stashing " << blocks << " overlapping blocks to " << srchash;
+
+  // The stash has to be on disk, since this command overwrites its source. The last command index
+  // advances past the earlier stashes, which go to disk as well.
+  if (FlushMemoryStashes(params) != 0) {
+    return -1;
+  }
+
+  bool stash_exists = false;
+  TraceTimer timer(&params.trace, kTraceStashWrite, blocks * BLOCKSIZE);
+  if (WriteStash(params.stashbase, srchash, blocks, write_contents, true, &stash_exists,
+                 params.compress_stash) != 0) {
+    LOG(ERROR) << "failed to stash overlapping source blocks";
+    return -1;
+  }
+
+  if (!UpdateLastCommandIndex(params.last_command_file, params.cmdindex, params.cmdline)) {
+    LOG(WARNING) << "Failed to update the last command file.";
+  }
+
+  params.stashed += blocks;
+  // Can be deleted when the write has completed.
+  if (!stash_exists) {
+    params.freestash = srchash;
+  }
+  return 0;
+}
+
 /**
  * Do a source/target load for move/bsdiff/imgdiff in version 3.
  *
@@ -1134,13 +2909,16 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet& tgt, size_t*
   tgt = RangeSet::Parse(params.tokens[params.cpos++]);
   CHECK(static_cast<bool>(tgt));
 
-  std::vector<uint8_t> tgtbuffer(tgt.blocks() * BLOCKSIZE);
-  if (ReadBlocks(tgt, tgtbuffer, params.fd) == -1) {
-    return -1;
+  PooledBlockBuffer tgtbuffer(tgt.blocks() * BLOCKSIZE);
+  {
+    TraceTimer timer(&params.trace, kTraceSourceLoad, tgt.blocks() * BLOCKSIZE);
+    if (ReadBlocks(tgt, *tgtbuffer, BlockFd(params), params.io_queue.get()) == -1) {
+      return -1;
+    }
   }
 
   // Return now if target blocks already have expected content.
-  if (VerifyBlocks(tgthash, tgtbuffer, tgt.blocks(), false) == 0) {
+  if (VerifyBlocks(tgthash, *tgtbuffer, tgt.blocks(), false) == 0) {
     return 1;
   }
 
@@ -1154,24 +2932,13 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet& tgt, size_t*
     // resume from possible write errors. In verify mode, we can skip stashing
     // because the source blocks won't be overwritten.
     if (*overlap && params.canwrite) {
-      LOG(INFO) << "stashing " << *src_blocks << " overlapping blocks to " << srchash;
-
-      bool stash_exists = false;
-      if (WriteStash(params.stashbase, srchash, *src_blocks, params.buffer, true,
-                     &stash_exists) != 0) {
-        LOG(ERROR) << "failed to stash overlapping source blocks";
+      size_t blocks = *src_blocks;
+      const BlockBuffer& buffer = params.buffer;
+      if (StashOverlappingSource(params, srchash, blocks, [&buffer, blocks](StashWriter& writer) {
+            return writer.Write(buffer, blocks * BLOCKSIZE);
+          }) != 0) {
         return -1;
       }
-
-      if (!UpdateLastCommandIndex(params.cmdindex, params.cmdline)) {
-        LOG(WARNING) << "Failed to update the last command file.";
-      }
-
-      params.stashed += *src_blocks;
-      // Can be deleted when the write has completed.
-      if (!stash_exists) {
-        params.freestash = srchash;
-      }
     }
 
     // Source blocks have expected content, command can proceed.
@@ -1194,11 +2961,231 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet& tgt, size_t*
   return -1;
 }
 
+// Moves larger than this many blocks that only read from the source image are streamed through a
+// window of this size, rather than loading the whole source into params.buffer.
+static constexpr size_t kMoveWindowBlocks = 256;
+
+// Same for bsdiff patches larger than this, whose source is read on demand while patching.
+static constexpr size_t kMinStreamingPatchBlocks = 4096;
+
+// Returns whether the ranges in |rs| are in ascending block order.
+static bool IsAscending(const RangeSet& rs) {
+  for (size_t i = 1; i < rs.size(); i++) {
+    if (rs[i].first < rs[i - 1].second) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Parses the parameters of a command that reads from the source image only, i.e.
+// "<src_hash> [<tgt_hash>] <tgt_range> <src_block_count> <src_range>", if the source has more than
+// |min_blocks| blocks. |onehash| is the same as for LoadSrcTgtVersion3(). The tokens aren't
+// consumed.
+static bool ParseStreamingSource(const CommandParameters& params, bool onehash, size_t min_blocks,
+                                 std::string* srchash, std::string* tgthash, RangeSet* tgt,
+                                 RangeSet* src) {
+  size_t pos = params.cpos + (onehash ? 1 : 2);
+  if (pos + 3 != params.tokens.size() || params.tokens[pos + 2] == "-") {
+    return false;
+  }
+  size_t src_blocks;
+  if (!android::base::ParseUint(params.tokens[pos + 1], &src_blocks) || src_blocks <= min_blocks) {
+    return false;
+  }
+  *tgt = RangeSet::Parse(params.tokens[pos]);
+  *src = RangeSet::Parse(params.tokens[pos + 2]);
+  if (!*tgt || !*src || src->blocks() != src_blocks) {
+    return false;
+  }
+  *srchash = params.tokens[params.cpos];
+  *tgthash = params.tokens[pos - 1];
+  return true;
+}
+
+// A run of blocks that are moved from |src| to |tgt|, both contiguous.
+struct MoveSegment {
+  size_t src;
+  size_t tgt;
+  size_t blocks;
+};
+
+// Pairs up the blocks of |src| and |tgt| (with the same number of blocks) into contiguous runs.
+static std::vector<MoveSegment> MoveSegments(const RangeSet& src, const RangeSet& tgt) {
+  std::vector<MoveSegment> segments;
+  auto s = src.cbegin();
+  auto t = tgt.cbegin();
+  size_t s_done = 0;
+  size_t t_done = 0;
+  while (s != src.cend() && t != tgt.cend()) {
+    size_t blocks = std::min(s->second - s->first - s_done, t->second - t->first - t_done);
+    segments.push_back({ s->first + s_done, t->first + t_done, blocks });
+    s_done += blocks;
+    t_done += blocks;
+    if (s_done == s->second - s->first) {
+      ++s;
+      s_done = 0;
+    }
+    if (t_done == t->second - t->first) {
+      ++t;
+      t_done = 0;
+    }
+  }
+  return segments;
+}
+
+// Copies the blocks of |src| to |tgt| on the device through |window|, which holds
+// kMoveWindowBlocks blocks, like memmove() does for overlapping buffers. As both ranges are
+// ascending, a block moving towards the start can only land on the source of an earlier block
+// moving the same way, and a block moving towards the end on the source of a later one. So the
+// former are copied front to back, then the latter back to front, and each window is read in full
+// before it's written. A source block is never overwritten before it has been read.
+static int StreamBlocks(CommandParameters& params, const RangeSet& src, const RangeSet& tgt,
+                        BlockBuffer& window) {
+  std::vector<MoveSegment> segments = MoveSegments(src, tgt);
+
+  RangeSet window_src;
+  RangeSet window_tgt;
+  auto flush = [&]() {
+    if (window_src.blocks() == 0) {
+      return 0;
+    }
+    {
+      TraceTimer timer(&params.trace, kTraceSourceLoad, window_src.blocks() * BLOCKSIZE);
+      if (ReadBlocks(window_src, window, BlockFd(params), params.io_queue.get()) == -1) {
+        return -1;
+      }
+    }
+    TraceTimer timer(&params.trace, kTraceWrite, window_tgt.blocks() * BLOCKSIZE);
+    if (WriteBlocks(window_tgt, window, BlockFd(params), params.io_queue.get()) == -1) {
+      return -1;
+    }
+    window_src.Clear();
+    window_tgt.Clear();
+    return 0;
+  };
+  // Adds |blocks| blocks of |segment| from |offset| to the window, flushing it whenever it's full.
+  auto add = [&](const MoveSegment& segment, size_t offset, size_t blocks) {
+    window_src.PushBack({ segment.src + offset, segment.src + offset + blocks });
+    window_tgt.PushBack({ segment.tgt + offset, segment.tgt + offset + blocks });
+    return window_src.blocks() == kMoveWindowBlocks ? flush() : 0;
+  };
+
+  for (const auto& segment : segments) {
+    if (segment.tgt >= segment.src) continue;
+    for (size_t offset = 0; offset < segment.blocks;) {
+      size_t blocks = std::min(segment.blocks - offset, kMoveWindowBlocks - window_src.blocks());
+      if (add(segment, offset, blocks) == -1) {
+        return -1;
+      }
+      offset += blocks;
+    }
+  }
+  if (flush() == -1) {
+    return -1;
+  }
+
+  for (auto it = segments.crbegin(); it != segments.crend(); ++it) {
+    if (it->tgt <= it->src) continue;
+    for (size_t end = it->blocks; end > 0;) {
+      size_t blocks = std::min(end, kMoveWindowBlocks - window_src.blocks());
+      if (add(*it, end - blocks, blocks) == -1) {
+        return -1;
+      }
+      end -= blocks;
+    }
+  }
+  return flush();
+}
+
+// Checks the target and the source blocks of a streamed command by hashing them straight from the
+// device, and stashes the source blocks if they overlap the target. Returns the same as
+// LoadSrcTgtVersion3() in |status|, or false if the command has to go through
+// LoadSrcTgtVersion3() after all, because the source blocks don't have the expected contents.
+static bool LoadStreamingSource(CommandParameters& params, const std::string& srchash,
+                                const std::string& tgthash, const RangeSet& tgt,
+                                const RangeSet& src, int* status) {
+  std::string hexdigest;
+  {
+    TraceTimer timer(&params.trace, kTraceSourceLoad, tgt.blocks() * BLOCKSIZE);
+    if (!HashBlocks(BlockFd(params), tgt, &hexdigest)) {
+      PLOG(ERROR) << "failed to read target blocks";
+      *status = -1;
+      return true;
+    }
+  }
+  if (hexdigest == tgthash) {
+    *status = 1;
+    return true;
+  }
+
+  {
+    TraceTimer timer(&params.trace, kTraceSourceLoad, src.blocks() * BLOCKSIZE);
+    if (!HashBlocks(BlockFd(params), src, &hexdigest)) {
+      PLOG(ERROR) << "failed to read source blocks";
+      *status = -1;
+      return true;
+    }
+  }
+  if (hexdigest != srchash) {
+    return false;
+  }
+
+  *status = 0;
+  if (src.Overlaps(tgt) && params.canwrite) {
+    if (StashOverlappingSource(params, srchash, src.blocks(), [&](StashWriter& writer) {
+          // Goes through a window, as the stash is laid out in the order of the source blocks.
+          PooledBlockBuffer pooled(kMoveWindowBlocks * BLOCKSIZE);
+          BlockBuffer& window = *pooled;
+          RangeSet chunk;
+          auto write_chunk = [&]() {
+            if (ReadBlocks(chunk, window, BlockFd(params), params.io_queue.get()) == -1 ||
+                writer.Write(window, chunk.blocks() * BLOCKSIZE) == -1) {
+              return -1;
+            }
+            chunk.Clear();
+            return 0;
+          };
+          for (const auto& range : src) {
+            for (size_t block = range.first; block < range.second;) {
+              size_t blocks = std::min(range.second - block, kMoveWindowBlocks - chunk.blocks());
+              chunk.PushBack({ block, block + blocks });
+              block += blocks;
+              if (chunk.blocks() == kMoveWindowBlocks && write_chunk() == -1) {
+                return -1;
+              }
+            }
+          }
+          return chunk.blocks() == 0 ? 0 : write_chunk();
+        }) != 0) {
+      *status = -1;
+    }
+  }
+  return true;
+}
+
 static int PerformCommandMove(CommandParameters& params) {
   size_t blocks = 0;
   bool overlap = false;
   RangeSet tgt;
-  int status = LoadSrcTgtVersion3(params, tgt, &blocks, true, &overlap);
+
+  // Large moves from the source image only are streamed, so they don't need a buffer of their full
+  // size.
+  std::string srchash;
+  std::string tgthash;
+  RangeSet src;
+  bool streaming = false;
+  int status;
+  if (ParseStreamingSource(params, true, kMoveWindowBlocks, &srchash, &tgthash, &tgt, &src) &&
+      tgt.blocks() == src.blocks() && IsAscending(tgt) && IsAscending(src)) {
+    streaming = LoadStreamingSource(params, srchash, tgthash, tgt, src, &status);
+  }
+  if (streaming) {
+    blocks = src.blocks();
+    params.cpos = params.tokens.size();
+  } else {
+    status = LoadSrcTgtVersion3(params, tgt, &blocks, true, &overlap);
+  }
 
   if (status == -1) {
     LOG(ERROR) << "failed to read blocks for move";
@@ -1218,8 +3205,16 @@ static int PerformCommandMove(CommandParameters& params) {
     if (status == 0) {
       LOG(INFO) << "  moving " << blocks << " blocks";
 
-      if (WriteBlocks(tgt, params.buffer, params.fd) == -1) {
-        return -1;
+      if (streaming) {
+        PooledBlockBuffer window(kMoveWindowBlocks * BLOCKSIZE);
+        if (StreamBlocks(params, src, tgt, *window) == -1) {
+          return -1;
+        }
+      } else {
+        TraceTimer timer(&params.trace, kTraceWrite, tgt.blocks() * BLOCKSIZE);
+        if (WriteBlocks(tgt, params.buffer, BlockFd(params), params.io_queue.get()) == -1) {
+          return -1;
+        }
       }
     } else {
       LOG(INFO) << "skipping " << blocks << " already moved blocks";
@@ -1244,6 +3239,21 @@ static int PerformCommandStash(CommandParameters& params) {
   }
 
   const std::string& id = params.tokens[params.cpos++];
+
+  // The same contents were stashed and freed earlier; there's no need to read them again. They're
+  // tied to the new source range from now on.
+  auto retained = params.retained_stashes.find(id);
+  if (retained != params.retained_stashes.end()) {
+    RangeSet src = RangeSet::Parse(params.tokens[params.cpos++]);
+    CHECK(static_cast<bool>(src));
+    LOG(INFO) << "reusing " << src.blocks() << " retained blocks for stash " << id;
+    MemoryStash& memory_stash = AddMemoryStash(params, id, src);
+    memory_stash.data = std::move(retained->second);
+    params.retained_stashes.erase(retained);
+    params.stashed += src.blocks();
+    return 0;
+  }
+
   size_t blocks = 0;
   if (LoadStash(params, id, true, &blocks, params.buffer, false) == 0) {
     // Stash file already exists and has expected contents. Do not read from source again, as the
@@ -1255,8 +3265,11 @@ static int PerformCommandStash(CommandParameters& params) {
   CHECK(static_cast<bool>(src));
 
   allocate(src.blocks() * BLOCKSIZE, params.buffer);
-  if (ReadBlocks(src, params.buffer, params.fd) == -1) {
-    return -1;
+  {
+    TraceTimer timer(&params.trace, kTraceSourceLoad, src.blocks() * BLOCKSIZE);
+    if (ReadBlocks(src, params.buffer, BlockFd(params), params.io_queue.get()) == -1) {
+      return -1;
+    }
   }
   blocks = src.blocks();
   stash_map[id] = src;
@@ -1274,10 +3287,55 @@ static int PerformCommandStash(CommandParameters& params) {
     return 0;
   }
 
+  // Keep the stash in memory if it fits. The command will run again if the update is interrupted
+  // before it's written to disk, which is safe until the source blocks get overwritten.
+  // Also leave the memory to the patches when it runs short, whatever the limit.
+  size_t size = blocks * BLOCKSIZE;
+  MemoryBudget& budget = MemoryBudget::Instance();
+  if (params.memory_stash_size + size > params.memory_stash_limit || !budget.HasRoom(size)) {
+    DropRetainedStashes(params);
+  }
+  if (params.memory_stash_size + size <= params.memory_stash_limit && budget.HasRoom(size)) {
+    // The limit is on the memory the stashes hold, and a buffer from the pool may have more room
+    // than |size|.
+    BlockBuffer data = buffer_pool.Take(size);
+    if (params.memory_stash_size + data.capacity() <= params.memory_stash_limit) {
+      LOG(INFO) << "stashing " << blocks << " blocks to " << id << " in memory";
+      memcpy(data.data(), params.buffer.data(), size);
+      params.memory_stash_size += data.capacity();
+      MemoryStash& memory_stash = AddMemoryStash(params, id, src);
+      memory_stash.data = std::move(data);
+      params.stashed += blocks;
+      return 0;
+    }
+    buffer_pool.Return(std::move(data));
+  }
+
+  // With group commit, the stash is synced at the next checkpoint together with the other ones,
+  // and the last command index doesn't need to be updated until then.
+  if (params.group_commit) {
+    LOG(INFO) << "stashing " << blocks << " blocks to " << id;
+    TraceTimer timer(&params.trace, kTraceStashWrite, size);
+    if (WriteUnsyncedStash(params, id, blocks, params.buffer, src) != 0) {
+      return -1;
+    }
+    params.stashed += blocks;
+    return 0;
+  }
+
+  if (FlushMemoryStashes(params) != 0) {
+    return -1;
+  }
+
   LOG(INFO) << "stashing " << blocks << " blocks to " << id;
-  int result = WriteStash(params.stashbase, id, blocks, params.buffer, false, nullptr);
+  int result;
+  {
+    TraceTimer timer(&params.trace, kTraceStashWrite, size);
+    result = WriteStash(params.stashbase, id, blocks, params.buffer, false, nullptr,
+                        params.compress_stash);
+  }
   if (result == 0) {
-    if (!UpdateLastCommandIndex(params.cmdindex, params.cmdline)) {
+    if (!UpdateLastCommandIndex(params.last_command_file, params.cmdindex, params.cmdline)) {
       LOG(WARNING) << "Failed to update the last command file.";
     }
 
@@ -1296,6 +3354,25 @@ static int PerformCommandFree(CommandParameters& params) {
   const std::string& id = params.tokens[params.cpos++];
   stash_map.erase(id);
 
+  // Keep the contents around if a pending command still loads this stash, which means that it
+  // will be stashed again.
+  auto memory_stash = params.memory_stashes.find(id);
+  if (memory_stash != params.memory_stashes.end()) {
+    auto refs = params.stash_refs.find(id);
+    if (refs != params.stash_refs.end() && refs->second > 0) {
+      params.retained_stashes[id] = std::move(memory_stash->second.data);
+    } else {
+      params.memory_stash_size -= memory_stash->second.data.capacity();
+      buffer_pool.Return(std::move(memory_stash->second.data));
+    }
+    params.pending_stash_blocks.Remove(memory_stash->second.src);
+    params.memory_stashes.erase(memory_stash);
+  }
+
+  if (DeleteUnsyncedStash(params, id)) {
+    return 0;
+  }
+
   if (params.createdstash || params.canwrite) {
     return FreeStash(params.stashbase, id);
   }
@@ -1303,6 +3380,48 @@ static int PerformCommandFree(CommandParameters& params) {
   return 0;
 }
 
+// Returns the ioctl that zeroes blocks of the target device without transferring any data:
+// BLKDISCARD if the device reads discarded blocks back as zeroes, or BLKZEROOUT. Returns 0 if the
+// target isn't a block device, or faults are being injected, as the ioctls bypass libotafault.
+static unsigned long ZeroOutRequest(const CommandParameters& params) {
+  struct stat sb;
+  if (should_fault_inject(OTAIO_WRITE) || fstat(params.fd, &sb) == -1 || !S_ISBLK(sb.st_mode)) {
+    return 0;
+  }
+  return params.discard_zeroes ? BLKDISCARD : BLKZEROOUT;
+}
+
+// Zeroes the byte |extents| on the block device with BLKZEROOUT, or with BLKDISCARD if the device
+// reads discarded blocks back as zeroes. Either lets the device zero the blocks without transferring
+// any data. Sets |zeroed| to false if the device doesn't support it, in which case nothing has been
+// zeroed and the blocks need to be written instead.
+static int ZeroOutExtents(const CommandParameters& params,
+                          const std::vector<std::pair<uint64_t, uint64_t>>& extents, bool* zeroed) {
+  *zeroed = false;
+  unsigned long request = ZeroOutRequest(params);
+  if (request == 0) {
+    return 0;
+  }
+
+  for (size_t i = 0; i < extents.size(); i++) {
+    TracedIo traced(params.fd, request == BLKDISCARD ? BlockIoRecord::kDiscard
+                                                     : BlockIoRecord::kZeroOut,
+                    extents[i].first, extents[i].second);
+    uint64_t args[2] = { extents[i].first, extents[i].second };
+    if (ioctl(params.fd, request, &args) == -1) {
+      if (i == 0) {
+        PLOG(INFO) << "Failed to zero out the blocks in place; writing them instead";
+        return 0;
+      }
+      SetFailureType(kFwriteFailure);
+      PLOG(ERROR) << (params.discard_zeroes ? "BLKDISCARD" : "BLKZEROOUT") << " ioctl failed";
+      return -1;
+    }
+  }
+  *zeroed = true;
+  return 0;
+}
+
 static int PerformCommandZero(CommandParameters& params) {
   if (params.cpos >= params.tokens.size()) {
     LOG(ERROR) << "missing target blocks for zero";
@@ -1314,25 +3433,31 @@ static int PerformCommandZero(CommandParameters& params) {
 
   LOG(INFO) << "  zeroing " << tgt.blocks() << " blocks";
 
-  allocate(BLOCKSIZE, params.buffer);
-  memset(params.buffer.data(), 0, BLOCKSIZE);
-
   if (params.canwrite) {
-    for (const auto& range : tgt) {
-      off64_t offset = static_cast<off64_t>(range.first) * BLOCKSIZE;
-      size_t size = (range.second - range.first) * BLOCKSIZE;
-      if (!discard_blocks(params.fd, offset, size)) {
-        return -1;
-      }
+    TraceTimer timer(&params.trace, kTraceWrite, tgt.blocks() * BLOCKSIZE);
+    std::vector<std::pair<uint64_t, uint64_t>> extents = DiscardExtents(tgt, 0);
+    bool zeroed;
+    if (ZeroOutExtents(params, extents, &zeroed) == -1) {
+      return -1;
+    }
 
-      if (!check_lseek(params.fd, offset, SEEK_SET)) {
-        return -1;
-      }
+    if (!zeroed) {
+      // Write the zeroes in chunks of up to the move window, rather than one block at a time.
+      size_t chunk_blocks = std::min(tgt.blocks(), kMoveWindowBlocks);
+      allocate(chunk_blocks * BLOCKSIZE, params.buffer);
+      memset(params.buffer.data(), 0, chunk_blocks * BLOCKSIZE);
 
-      for (size_t j = range.first; j < range.second; ++j) {
-        if (write_all(params.fd, params.buffer, BLOCKSIZE) == -1) {
+      for (const auto& extent : extents) {
+        if (!discard_blocks(params.fd, extent.first, extent.second)) {
           return -1;
         }
+        for (uint64_t pos = 0; pos < extent.second;) {
+          size_t size = std::min<uint64_t>(extent.second - pos, chunk_blocks * BLOCKSIZE);
+          if (write_all_at(params.fd, params.buffer.data(), size, extent.first + pos) == -1) {
+            return -1;
+          }
+          pos += size;
+        }
       }
     }
   }
@@ -1358,21 +3483,30 @@ static int PerformCommandNew(CommandParameters& params) {
   if (params.canwrite) {
     LOG(INFO) << " writing " << tgt.blocks() << " blocks of new data";
 
-    pthread_mutex_lock(&params.nti.mu);
-    params.nti.writer = std::make_unique<RangeSinkWriter>(params.fd, tgt);
-    pthread_cond_broadcast(&params.nti.cv);
-
-    while (params.nti.writer != nullptr) {
-      if (!params.nti.receiver_available) {
-        LOG(ERROR) << "missing " << (tgt.blocks() * BLOCKSIZE - params.nti.writer->BytesWritten())
-                   << " bytes of new data";
-        pthread_mutex_unlock(&params.nti.mu);
+    // The time waiting for the new data counts as loading the source. The runs of zero blocks,
+    // e.g. the free space of a full image, are zeroed in place where the device supports it.
+    RangeSinkWriter writer(params.fd, tgt, &params.trace, params.new_zero_request);
+    allocate(std::min(tgt.blocks() * BLOCKSIZE, params.nti.ring->capacity()), params.buffer);
+    while (!writer.Finished()) {
+      size_t read_now = std::min(params.buffer.size(), writer.AvailableSpace());
+      size_t count;
+      {
+        TraceTimer timer(&params.trace, kTraceSourceLoad);
+        count = params.nti.ring->Read(params.buffer.data(), read_now);
+        timer.set_bytes(count);
+      }
+      if (count == 0) {
+        LOG(ERROR) << "missing " << writer.AvailableSpace() << " bytes of new data";
+        return -1;
+      }
+      if (writer.Write(params.buffer.data(), count) != count) {
+        LOG(ERROR) << "Failed to write " << count << " bytes.";
         return -1;
       }
-      pthread_cond_wait(&params.nti.cv, &params.nti.mu);
     }
-
-    pthread_mutex_unlock(&params.nti.mu);
+    if (writer.BytesZeroed() > 0) {
+      LOG(INFO) << "  zeroed " << writer.BytesZeroed() / BLOCKSIZE << " blocks in place";
+    }
   }
 
   params.written += tgt.blocks();
@@ -1380,6 +3514,47 @@ static int PerformCommandNew(CommandParameters& params) {
   return 0;
 }
 
+// Reads the packed source blocks of |src| from the device at any offset, for the patches that pull
+// their source data on demand.
+class RangeSetReader {
+ public:
+  RangeSetReader(int fd, const RangeSet& src, CommandTrace* trace)
+      : fd_(fd), src_(src), trace_(trace) {
+    size_t blocks = 0;
+    for (const auto& range : src_) {
+      starts_.push_back(blocks);
+      blocks += range.second - range.first;
+    }
+  }
+
+  bool Read(size_t offset, uint8_t* data, size_t size) {
+    TraceTimer timer(trace_, kTraceSourceLoad, size);
+    while (size > 0) {
+      // The range that holds the block at |offset|.
+      size_t index =
+          std::upper_bound(starts_.begin(), starts_.end(), offset / BLOCKSIZE) - starts_.begin() - 1;
+      const Range& range = src_[index];
+      size_t pos = offset - starts_[index] * BLOCKSIZE;
+      size_t count = std::min(size, (range.second - range.first) * BLOCKSIZE - pos);
+      if (read_all_at(fd_, data, count, static_cast<off64_t>(range.first) * BLOCKSIZE + pos) ==
+          -1) {
+        return false;
+      }
+      offset += count;
+      data += count;
+      size -= count;
+    }
+    return true;
+  }
+
+ private:
+  int fd_;
+  const RangeSet& src_;
+  CommandTrace* trace_;
+  // The index of the first block of each range in the packed source.
+  std::vector<size_t> starts_;
+};
+
 static int PerformCommandDiff(CommandParameters& params) {
   // <offset> <length>
   if (params.cpos + 1 >= params.tokens.size()) {
@@ -1402,7 +3577,26 @@ static int PerformCommandDiff(CommandParameters& params) {
   RangeSet tgt;
   size_t blocks = 0;
   bool overlap = false;
-  int status = LoadSrcTgtVersion3(params, tgt, &blocks, false, &overlap);
+
+  // Large bsdiff patches read their source on demand, rather than loading it into params.buffer.
+  // The source can't overlap the target, which is written while the source is still being read.
+  std::string srchash;
+  std::string tgthash;
+  RangeSet src;
+  bool streaming = false;
+  int status;
+  if (params.cmdname[0] == 'b' &&
+      ParseStreamingSource(params, false, kMinStreamingPatchBlocks, &srchash, &tgthash, &tgt,
+                           &src) &&
+      !src.Overlaps(tgt)) {
+    streaming = LoadStreamingSource(params, srchash, tgthash, tgt, src, &status);
+  }
+  if (streaming) {
+    blocks = src.blocks();
+    params.cpos = params.tokens.size();
+  } else {
+    status = LoadSrcTgtVersion3(params, tgt, &blocks, false, &overlap);
+  }
 
   if (status == -1) {
     LOG(ERROR) << "failed to read blocks for diff";
@@ -1421,29 +3615,46 @@ static int PerformCommandDiff(CommandParameters& params) {
   if (params.canwrite) {
     if (status == 0) {
       LOG(INFO) << "patching " << blocks << " blocks to " << tgt.blocks();
-      Value patch_value(
-          VAL_BLOB, std::string(reinterpret_cast<const char*>(params.patch_start + offset), len));
-
-      RangeSinkWriter writer(params.fd, tgt);
-      if (params.cmdname[0] == 'i') {  // imgdiff
-        if (ApplyImagePatch(params.buffer.data(), blocks * BLOCKSIZE, patch_value,
-                            std::bind(&RangeSinkWriter::Write, &writer, std::placeholders::_1,
-                                      std::placeholders::_2),
-                            nullptr, nullptr) != 0) {
-          LOG(ERROR) << "Failed to apply image patch.";
-          failure_type = kPatchApplicationFailure;
-          return -1;
-        }
-      } else {
-        if (ApplyBSDiffPatch(params.buffer.data(), blocks * BLOCKSIZE, patch_value, 0,
-                             std::bind(&RangeSinkWriter::Write, &writer, std::placeholders::_1,
-                                       std::placeholders::_2),
-                             nullptr) != 0) {
-          LOG(ERROR) << "Failed to apply bsdiff patch.";
-          failure_type = kPatchApplicationFailure;
-          return -1;
+      // The package stays mapped for the whole update, so the patch can be used in place.
+      Value patch_value(params.patch_start + offset, len);
+
+      // The writes from the patcher (and the source reads, if streaming) are traced separately, and
+      // don't count towards patching.
+      RangeSinkWriter writer(params.fd, tgt, &params.trace);
+      uint64_t write_ns = params.trace.ns[kTraceWrite];
+      uint64_t source_ns = params.trace.ns[kTraceSourceLoad];
+      int result;
+      {
+        TraceTimer timer(&params.trace, kTracePatch, len);
+        if (streaming) {
+          RangeSetReader reader(params.fd, src, &params.trace);
+          result = ApplyBSDiffPatchFromSource(
+              std::bind(&RangeSetReader::Read, &reader, std::placeholders::_1,
+                        std::placeholders::_2, std::placeholders::_3),
+              blocks * BLOCKSIZE, patch_value, 0,
+              std::bind(&RangeSinkWriter::Write, &writer, std::placeholders::_1,
+                        std::placeholders::_2),
+              nullptr);
+        } else if (params.cmdname[0] == 'i') {  // imgdiff
+          result = ApplyImagePatch(params.buffer.data(), blocks * BLOCKSIZE, patch_value,
+                                   std::bind(&RangeSinkWriter::Write, &writer,
+                                             std::placeholders::_1, std::placeholders::_2),
+                                   nullptr, nullptr);
+        } else {
+          result = ApplyBSDiffPatch(params.buffer.data(), blocks * BLOCKSIZE, patch_value, 0,
+                                    std::bind(&RangeSinkWriter::Write, &writer,
+                                              std::placeholders::_1, std::placeholders::_2),
+                                    nullptr);
         }
       }
+      params.trace.ns[kTracePatch] -= params.trace.ns[kTraceWrite] - write_ns +
+                                      params.trace.ns[kTraceSourceLoad] - source_ns;
+      if (result != 0) {
+        LOG(ERROR) << "Failed to apply " << (params.cmdname[0] == 'i' ? "image" : "bsdiff")
+                   << " patch.";
+        SetFailureType(kPatchApplicationFailure);
+        return -1;
+      }
 
       // We expect the output of the patcher to fill the tgt ranges exactly.
       if (!writer.Finished()) {
@@ -1490,31 +3701,409 @@ static int PerformCommandErase(CommandParameters& params) {
   CHECK(static_cast<bool>(tgt));
 
   if (params.canwrite) {
-    LOG(INFO) << " erasing " << tgt.blocks() << " blocks";
+    std::vector<std::pair<uint64_t, uint64_t>> extents =
+        DiscardExtents(tgt, params.discard_granularity);
+    LOG(INFO) << " erasing " << tgt.blocks() << " blocks in " << extents.size() << " extents";
 
-    for (const auto& range : tgt) {
-      uint64_t blocks[2];
-      // offset in bytes
-      blocks[0] = range.first * static_cast<uint64_t>(BLOCKSIZE);
-      // length in bytes
-      blocks[1] = (range.second - range.first) * static_cast<uint64_t>(BLOCKSIZE);
+    if (params.discarder) {
+      params.discarder->Add(std::move(tgt), std::move(extents));
+    } else if (!DiscardExtentList(params.fd, extents)) {
+      return -1;
+    }
+  }
 
-      if (ioctl(params.fd, BLKDISCARD, &blocks) == -1 && errno != ENOTSUP) {
-        PLOG(ERROR) << "BLKDISCARD ioctl failed";
-        return -1;
+  return 0;
+}
+
+// Definitions for transfer list command functions
+typedef int (*CommandFunction)(CommandParameters&);
+
+struct Command {
+    const char* name;
+    CommandFunction f;
+};
+
+// Maximum number of threads that execute independent transfer commands concurrently.
+static constexpr size_t kMaxParallelWorkers = 8;
+// Maximum number of consecutive commands that are scheduled together as one dependency graph.
+static constexpr size_t kParallelWindowSize = 64;
+
+// Set by the tools that run the updates outside of an install; see SetBlockImageTuning().
+static BlockImageTuning tuning;
+
+/**
+ * A transfer command that is scheduled together with its neighbours. It may run as soon as all the
+ * earlier commands in the same window that it conflicts with have finished, i.e. the ones that
+ * write to blocks it reads or writes, or read blocks it writes. 'new' commands additionally depend
+ * on the previous 'new' command, since they consume the new data stream in order.
+ */
+struct ParallelCommand {
+  const std::string* line;
+  int cmdindex;
+  CommandFunction f;
+  bool is_new;
+  RangeSet src;
+  RangeSet tgt;
+  size_t pending_deps;
+  std::vector<size_t> dependents;
+};
+
+// Parses the ranges of a command that is eligible for out-of-order execution, i.e. a 'new', or a
+// 'move'/'bsdiff'/'imgdiff' that reads directly from the source image only. Commands that load
+// stashes, or whose source overlaps the target (which implicitly stashes the source and updates
+// the last command file) must be executed serially, in which case it returns false.
+static bool ParseParallelCommand(const std::vector<std::string>& tokens, RangeSet* src,
+                                 RangeSet* tgt) {
+  const std::string& cmdname = tokens[0];
+  if (cmdname == "new") {
+    // new <tgt_range>
+    if (tokens.size() != 2) {
+      return false;
+    }
+    *tgt = RangeSet::Parse(tokens[1]);
+    return static_cast<bool>(*tgt);
+  }
+
+  size_t pos;
+  if (cmdname == "move") {
+    // move <onehash> <tgt_range> <src_blk_count> <src_range>
+    pos = 2;
+  } else if (cmdname == "bsdiff" || cmdname == "imgdiff") {
+    // bsdiff <offset> <len> <src_hash> <tgt_hash> <tgt_range> <src_blk_count> <src_range>
+    pos = 5;
+  } else {
+    return false;
+  }
+
+  if (tokens.size() != pos + 3 || tokens[pos + 2] == "-") {
+    return false;
+  }
+  *tgt = RangeSet::Parse(tokens[pos]);
+  *src = RangeSet::Parse(tokens[pos + 2]);
+  if (!*tgt || !*src) {
+    return false;
+  }
+  return !src->Overlaps(*tgt);
+}
+
+// Collects the window of consecutive eligible commands starting at lines[first], and computes the
+// dependencies among them. |start| is the line of the first transfer command, for computing the
+// command indices. The window ends before any completed command in |skip_completed|. Returns the
+// index of the line that follows the window.
+static size_t CollectParallelCommands(
+    const std::vector<std::string>& lines, size_t first, size_t start,
+    const std::unordered_map<std::string, const Command*>& cmd_map,
+    const std::vector<bool>& skip_completed, std::vector<ParallelCommand>* cmds) {
+  size_t i = first;
+  for (; i < lines.size() && cmds->size() < kParallelWindowSize; i++) {
+    const std::string& line = lines[i];
+    if (line.empty()) continue;
+    if (i - start > static_cast<size_t>(std::numeric_limits<int>::max())) break;
+    if (SkipCompleted(skip_completed, i - start)) break;
+
+    std::vector<std::string> tokens = android::base::Split(line, " ");
+    auto it = cmd_map.find(tokens[0]);
+    if (it == cmd_map.end() || it->second->f == nullptr) break;
+
+    ParallelCommand cmd{ &line, static_cast<int>(i - start), it->second->f, tokens[0] == "new" };
+    if (!ParseParallelCommand(tokens, &cmd.src, &cmd.tgt)) break;
+
+    // Add an edge from every earlier command that must complete before this one.
+    size_t index = cmds->size();
+    bool found_new = false;
+    for (size_t k = index; k-- > 0;) {
+      ParallelCommand& prev = (*cmds)[k];
+      bool depends = cmd.tgt.Overlaps(prev.tgt) || cmd.tgt.Overlaps(prev.src) ||
+                     cmd.src.Overlaps(prev.tgt);
+      if (cmd.is_new && prev.is_new && !found_new) {
+        found_new = true;
+        depends = true;
+      }
+      if (depends) {
+        prev.dependents.push_back(index);
+        cmd.pending_deps++;
+      }
+    }
+    cmds->push_back(std::move(cmd));
+  }
+  return i;
+}
+
+// Executes the given window of commands with up to |max_threads| of |workers|, on the shared thread
+// pool and the calling thread. Each worker owns a copy of the command parameters, with its own fd
+// to the block device and its own buffer. 'new' commands are executed against the shared |params|
+// instead, because they hand off the target to the new data thread; they never run concurrently
+// with each other as they are chained together.
+// Returns false if any of the commands fails.
+static bool PerformParallelCommands(CommandParameters& params,
+                                    std::vector<std::unique_ptr<CommandParameters>>& workers,
+                                    std::vector<ParallelCommand>& cmds, size_t max_threads) {
+  std::mutex mu;
+  std::condition_variable cv;
+  std::deque<size_t> ready;
+  size_t remaining = cmds.size();
+  bool failed = false;
+
+  for (size_t i = 0; i < cmds.size(); i++) {
+    if (cmds[i].pending_deps == 0) {
+      ready.push_back(i);
+    }
+  }
+
+  auto worker_func = [&](CommandParameters* worker_params) {
+    std::unique_lock<std::mutex> lock(mu);
+    while (true) {
+      cv.wait(lock, [&] { return failed || remaining == 0 || !ready.empty(); });
+      if (failed || remaining == 0) {
+        return;
+      }
+      size_t index = ready.front();
+      ready.pop_front();
+      lock.unlock();
+
+      ParallelCommand& cmd = cmds[index];
+      CommandParameters& p = cmd.is_new ? params : *worker_params;
+      p.trace = CommandTrace();
+      {
+        TraceTimer timer(&p.trace, kTraceParse, cmd.line->size());
+        p.tokens = android::base::Split(*cmd.line, " ");
+      }
+      p.cpos = 1;
+      p.cmdindex = cmd.cmdindex;
+      p.cmdname = p.tokens[0].c_str();
+      p.cmdline = cmd.line->c_str();
+      p.target_verified = false;
+      p.trace.cmdindex = p.cmdindex;
+      p.trace.cmdname = p.cmdname;
+      BlockIoTrace::SetCommand(p.cmdindex);
+      bool success = (cmd.f(p) != -1);
+      FinishTrace(p);
+      if (!success) {
+        LOG(ERROR) << "failed to execute command [" << *cmd.line << "]";
+      }
+
+      lock.lock();
+      if (!success) {
+        failed = true;
+        cv.notify_all();
+        return;
+      }
+      remaining--;
+      for (size_t dependent : cmd.dependents) {
+        if (--cmds[dependent].pending_deps == 0) {
+          ready.push_back(dependent);
+        }
+      }
+      cv.notify_all();
+    }
+  };
+
+  size_t num_threads = std::min({ workers.size(), cmds.size(), max_threads });
+  UpdateStatus* status = update_status;
+  ThreadPool::Shared().ParallelFor(num_threads, [&](size_t i) {
+    ScopedUpdateStatus scoped_status(status);
+    worker_func(workers[i].get());
+    return true;
+  }, num_threads);
+
+  for (size_t i = 0; i < num_threads; i++) {
+    CommandParameters& worker_params = *workers[i];
+    params.written += worker_params.written;
+    worker_params.written = 0;
+    params.foundwrites = params.foundwrites || worker_params.foundwrites;
+    params.isunresumable = params.isunresumable || worker_params.isunresumable;
+    std::move(worker_params.traces.begin(), worker_params.traces.end(),
+              std::back_inserter(params.traces));
+    worker_params.traces.clear();
+  }
+
+  return !failed;
+}
+
+// Sets up the parameters for up to |num_workers| threads that execute independent commands.
+// Returns an empty vector if concurrent execution is unavailable.
+static std::vector<std::unique_ptr<CommandParameters>> CreateParallelWorkers(
+    const CommandParameters& params, const std::string& blockdev, size_t num_workers) {
+  std::vector<std::unique_ptr<CommandParameters>> workers;
+  if (num_workers < 2) {
+    return workers;
+  }
+
+  for (size_t i = 0; i < num_workers; i++) {
+    auto worker_params = std::make_unique<CommandParameters>();
+    worker_params->fd.reset(TEMP_FAILURE_RETRY(ota_open(blockdev.c_str(), O_RDWR)));
+    if (worker_params->fd == -1) {
+      PLOG(WARNING) << "Failed to open " << blockdev << "; executing commands serially";
+      return {};
+    }
+    if (params.direct_fd != -1) {
+      worker_params->direct_fd.reset(
+          TEMP_FAILURE_RETRY(ota_open(blockdev.c_str(), O_RDWR | O_DIRECT)));
+    }
+    if (params.io_queue) {
+      worker_params->io_queue = IoUringQueue::Create(kIoQueueDepth);
+    }
+    worker_params->canwrite = params.canwrite;
+    worker_params->createdstash = params.createdstash;
+    worker_params->stashbase = params.stashbase;
+    worker_params->version = params.version;
+    worker_params->patch_start = params.patch_start;
+    workers.push_back(std::move(worker_params));
+  }
+  return workers;
+}
+
+// Parses the new data index of the form
+//    new_data_index <segment_count> <compressed_size>:<uncompressed_size> ...
+// Returns the segments, and the total compressed size in |compressed_size|.
+static bool ParseNewDataIndex(const std::string& line, std::vector<NewDataSegment>* segments,
+                              size_t* compressed_size) {
+  std::vector<std::string> tokens = android::base::Split(line, " ");
+  size_t count;
+  if (tokens.size() < 3 || !android::base::ParseUint(tokens[1], &count) ||
+      count != tokens.size() - 2) {
+    LOG(ERROR) << "invalid number of new data segments";
+    return false;
+  }
+
+  *compressed_size = 0;
+  for (size_t i = 2; i < tokens.size(); i++) {
+    std::vector<std::string> sizes = android::base::Split(tokens[i], ":");
+    NewDataSegment segment;
+    if (sizes.size() != 2 || !android::base::ParseUint(sizes[0], &segment.compressed_size) ||
+        !android::base::ParseUint(sizes[1], &segment.uncompressed_size) ||
+        segment.compressed_size == 0 || segment.uncompressed_size == 0) {
+      LOG(ERROR) << "invalid new data segment \"" << tokens[i] << "\"";
+      return false;
+    }
+    if (segment.compressed_size > std::numeric_limits<size_t>::max() - *compressed_size) {
+      LOG(ERROR) << "new data segments overflow";
+      return false;
+    }
+    *compressed_size += segment.compressed_size;
+    segments->push_back(segment);
+  }
+  return true;
+}
+
+// Hashes the targets of the completed commands on a background thread while the following commands
+// are executing, and checks them against the expected hashes. The blocks are most likely still in
+// the page cache, since they have just been written.
+class TargetVerifier {
+ public:
+  explicit TargetVerifier(const std::string& blockdev)
+      : fd_(TEMP_FAILURE_RETRY(ota_open(blockdev.c_str(), O_RDONLY))),
+        done_(false),
+        verified_(0),
+        mismatches_(0) {
+    if (fd_ == -1) {
+      PLOG(WARNING) << "Failed to open " << blockdev << "; not verifying the targets in advance";
+      return;
+    }
+    thread_ = std::thread(&TargetVerifier::Run, this);
+  }
+
+  ~TargetVerifier() {
+    Finish();
+  }
+
+  bool running() const {
+    return thread_.joinable();
+  }
+
+  // Queues the target of a completed 'move', 'bsdiff' or 'imgdiff' given by |tokens|. Other
+  // commands have no target hash to check.
+  void Add(const std::vector<std::string>& tokens) {
+    size_t pos;
+    if (tokens[0] == "move") {
+      pos = 1;
+    } else if (tokens[0] == "bsdiff" || tokens[0] == "imgdiff") {
+      pos = 4;
+    } else {
+      return;
+    }
+    RangeSet tgt = CommandTargetRange(tokens);
+    if (pos >= tokens.size() || !tgt) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    jobs_.push_back({ std::move(tgt), tokens[pos] });
+    cv_.notify_all();
+  }
+
+  // Waits until none of the queued targets overlaps |tgt|, which is about to be overwritten.
+  void WaitFor(const RangeSet& tgt) {
+    if (!tgt) {
+      return;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this, &tgt]() {
+      return std::none_of(jobs_.begin(), jobs_.end(),
+                          [&tgt](const Job& job) { return job.tgt.Overlaps(tgt); });
+    });
+  }
+
+  // Waits for all the queued targets, and returns the number of those that don't match.
+  size_t Finish() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_ = true;
+      cv_.notify_all();
+    }
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+    return mismatches_;
+  }
+
+  // The number of targets that have the expected contents. Only valid after Finish().
+  size_t verified() const {
+    return verified_;
+  }
+
+ private:
+  struct Job {
+    RangeSet tgt;
+    std::string hash;
+  };
+
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this]() { return done_ || !jobs_.empty(); });
+      if (jobs_.empty()) {
+        return;
+      }
+      // The job stays in the queue while it's being hashed, so that WaitFor() can see it.
+      Job job = jobs_.front();
+      lock.unlock();
+      std::string hexdigest;
+      bool read = HashBlocks(fd_, job.tgt, &hexdigest);
+      if (!read) {
+        PLOG(ERROR) << "Failed to read the target blocks " << job.tgt.ToString();
+      } else if (hexdigest != job.hash) {
+        LOG(ERROR) << "Target blocks " << job.tgt.ToString() << " have unexpected contents "
+                   << hexdigest << " (expected " << job.hash << ")";
+      }
+      lock.lock();
+      if (read && hexdigest == job.hash) {
+        verified_++;
+      } else {
+        mismatches_++;
       }
+      jobs_.pop_front();
+      cv_.notify_all();
     }
   }
 
-  return 0;
-}
-
-// Definitions for transfer list command functions
-typedef int (*CommandFunction)(CommandParameters&);
-
-struct Command {
-    const char* name;
-    CommandFunction f;
+  android::base::unique_fd fd_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Job> jobs_;
+  bool done_;
+  size_t verified_;
+  size_t mismatches_;
 };
 
 // args:
@@ -1523,32 +4112,31 @@ struct Command {
 //    - new data stream (filename within package.zip)
 //    - patch stream (filename within package.zip, must be uncompressed)
 
+// The updates of several partitions that run concurrently, of which the current one is the
+// |index|-th. They share the memory budget, the threads and the progress.
+struct ConcurrentUpdates {
+  size_t count;
+  size_t index;
+  SharedProgress* progress;
+};
+
 static Value* PerformBlockImageUpdate(const char* name, State* state,
-                                      const std::vector<std::unique_ptr<Expr>>& argv,
-                                      const Command* commands, size_t cmdcount, bool dryrun) {
+                                      const Value* blockdev_filename,
+                                      const Value* transfer_list_value, const Value* new_data_fn,
+                                      const Value* patch_data_fn, const Command* commands,
+                                      size_t cmdcount, bool dryrun,
+                                      const ConcurrentUpdates* concurrent) {
   CommandParameters params = {};
   params.canwrite = !dryrun;
 
+  UpdateStatus status;
+  status.is_retry = state->is_retry;
+  ScopedUpdateStatus scoped_status(&status);
+
   LOG(INFO) << "performing " << (dryrun ? "verification" : "update");
-  if (state->is_retry) {
-    is_retry = true;
+  if (status.is_retry) {
     LOG(INFO) << "This update is a retry.";
   }
-  if (argv.size() != 4) {
-    ErrorAbort(state, kArgsParsingFailure, "block_image_update expects 4 arguments, got %zu",
-               argv.size());
-    return StringValue("");
-  }
-
-  std::vector<std::unique_ptr<Value>> args;
-  if (!ReadValueArgs(state, argv, &args)) {
-    return nullptr;
-  }
-
-  const std::unique_ptr<Value>& blockdev_filename = args[0];
-  const std::unique_ptr<Value>& transfer_list_value = args[1];
-  const std::unique_ptr<Value>& new_data_fn = args[2];
-  const std::unique_ptr<Value>& patch_data_fn = args[3];
 
   if (blockdev_filename->type != VAL_STRING) {
     ErrorAbort(state, kArgsParsingFailure, "blockdev_filename argument to %s must be string", name);
@@ -1572,6 +4160,17 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     return StringValue("");
   }
 
+  // Each of the concurrent updates (including those in the branches of parallel()) is resumed from
+  // its own last command.
+  params.last_command_file = CacheLocation::location().last_command_file();
+  if (concurrent != nullptr || state->parent != nullptr) {
+    params.last_command_file += "_" + android::base::Basename(blockdev_filename->data);
+  }
+  if (concurrent != nullptr) {
+    params.shared_progress = concurrent->progress;
+    params.progress_slot = concurrent->index;
+  }
+
   FILE* cmd_pipe = ui->cmd_pipe;
   ZipArchiveHandle za = ui->package_zip;
 
@@ -1579,17 +4178,17 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     return StringValue("");
   }
 
-  ZipString path_data(patch_data_fn->data.c_str());
   ZipEntry patch_entry;
-  if (FindEntry(za, path_data, &patch_entry) != 0) {
+  if (!FindPackageEntry(state, patch_data_fn->data, &patch_entry)) {
     LOG(ERROR) << name << "(): no file \"" << patch_data_fn->data << "\" in package";
     return StringValue("");
   }
 
   params.patch_start = ui->package_zip_addr + patch_entry.offset;
-  ZipString new_data(new_data_fn->data.c_str());
+  // The patches are read in the order of the transfer list, far apart from each other.
+  AdviseMappedRange(params.patch_start, patch_entry.compressed_length, MemAccess::RANDOM);
   ZipEntry new_entry;
-  if (FindEntry(za, new_data, &new_entry) != 0) {
+  if (!FindPackageEntry(state, new_data_fn->data, &new_entry)) {
     LOG(ERROR) << name << "(): no file \"" << new_data_fn->data << "\" in package";
     return StringValue("");
   }
@@ -1600,30 +4199,35 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     return StringValue("");
   }
 
-  if (params.canwrite) {
-    params.nti.za = za;
-    params.nti.entry = new_entry;
-    params.nti.brotli_compressed = android::base::EndsWith(new_data_fn->data, ".br");
-    if (params.nti.brotli_compressed) {
-      // Initialize brotli decoder state.
-      params.nti.brotli_decoder_state = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
-    }
-    params.nti.receiver_available = true;
-
-    pthread_mutex_init(&params.nti.mu, nullptr);
-    pthread_cond_init(&params.nti.cv, nullptr);
-    pthread_attr_t attr;
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+  params.discard_granularity = DiscardGranularity(params.fd);
+  unsigned int discard_zeroes = 0;
+  params.discard_zeroes = ioctl(params.fd, BLKDISCARDZEROES, &discard_zeroes) == 0 &&
+                          discard_zeroes != 0;
+  if (android::base::GetBoolProperty("ro.updater.zero_new_blocks", true)) {
+    params.new_zero_request = ZeroOutRequest(params);
+  }
 
-    int error = pthread_create(&params.thread, &attr, unzip_new_data, &params.nti);
-    if (error != 0) {
-      PLOG(ERROR) << "pthread_create failed";
-      return StringValue("");
+  // Optionally bypass the page cache for the bulk block I/O, since recovery doesn't have enough RAM
+  // to cache large transfers anyway. Partial writes, e.g. from the patch sinks, stay buffered.
+  if (android::base::GetBoolProperty("ro.updater.direct_io", false)) {
+    params.direct_fd.reset(
+        TEMP_FAILURE_RETRY(ota_open(blockdev_filename->data.c_str(), O_RDWR | O_DIRECT)));
+    if (params.direct_fd == -1) {
+      PLOG(WARNING) << "Failed to open " << blockdev_filename->data << " with O_DIRECT";
     }
   }
 
-  std::vector<std::string> lines = android::base::Split(transfer_list_value->data, "\n");
+  // Keep multiple block reads and writes in flight through io_uring where the kernel supports it.
+  // It bypasses libotafault, so stay with the synchronous I/O when faults are being injected.
+  if (android::base::GetBoolProperty("ro.updater.io_uring", true) &&
+      !should_fault_inject(OTAIO_READ) && !should_fault_inject(OTAIO_WRITE)) {
+    params.io_queue = IoUringQueue::Create(kIoQueueDepth);
+  }
+
+  // The transfer list may be a blob referencing the package, and is split into lines anyway, so
+  // it's read as a string here.
+  const std::string transfer_list(transfer_list_value->bytes(), transfer_list_value->size());
+  std::vector<std::string> lines = android::base::Split(transfer_list, "\n");
   if (lines.size() < 2) {
     ErrorAbort(state, kArgsParsingFailure, "too few lines in the transfer list [%zd]",
                lines.size());
@@ -1667,13 +4271,41 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     return StringValue("");
   }
 
-  int res = CreateStash(state, stash_max_blocks, blockdev_filename->data, params.stashbase);
+  // Optionally compress the stashes written to /cache with LZ4, for devices whose /cache is too
+  // small for the largest stashes.
+  params.compress_stash =
+      params.canwrite && android::base::GetBoolProperty("ro.updater.stash_lz4", false);
+
+  int res = CreateStash(state, stash_max_blocks, params.compress_stash, blockdev_filename->data,
+                        params.stashbase);
   if (res == -1) {
     return StringValue("");
   }
 
   params.createdstash = res;
 
+  // Stashes are kept in memory up to a quarter of the free RAM by default, saving the round trip
+  // through /cache for the ones whose source blocks stay intact until they're freed.
+  if (params.canwrite) {
+    struct sysinfo info;
+    size_t default_limit =
+        sysinfo(&info) == 0 ? static_cast<uint64_t>(info.freeram) * info.mem_unit / 4 : 0;
+    params.memory_stash_limit =
+        tuning.stash_memory_limit != 0
+            ? tuning.stash_memory_limit
+            : android::base::GetUintProperty<size_t>("ro.updater.stash_memory_limit",
+                                                     default_limit);
+    if (concurrent != nullptr) {
+      params.memory_stash_limit /= concurrent->count;
+    }
+    LOG(INFO) << "keeping up to " << params.memory_stash_limit << " bytes of stashes in memory";
+
+    // Sync the stashes written to /cache in groups, at the checkpoints where the last command
+    // index advances.
+    params.group_commit = android::base::GetBoolProperty("ro.updater.group_commit", true) &&
+                          !should_fault_inject(OTAIO_FSYNC);
+  }
+
   // When performing an update, save the index and cmdline of the current command into
   // the last_command_file if this command writes to the stash either explicitly of implicitly.
   // Upon resuming an update, read the saved index first; then
@@ -1685,14 +4317,100 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
   //      stashes with duplicate id unintentionally (b/69858743); and also speed up the update.
   // If an update succeeds or is unresumable, delete the last_command_file.
   int saved_last_command_index;
-  if (!ParseLastCommandFile(&saved_last_command_index)) {
-    DeleteLastCommandFile();
+  if (!ParseLastCommandFile(params.last_command_file, &saved_last_command_index)) {
+    // The completed commands file is kept, as it's still valid for the same transfer list.
+    if (unlink(params.last_command_file.c_str()) == -1 && errno != ENOENT) {
+      PLOG(ERROR) << "Failed to unlink: " << params.last_command_file;
+    }
     // We failed to parse the last command, set it explicitly to -1.
     saved_last_command_index = -1;
   }
 
   start += 2;
 
+  // An optional line following the header describes the segments of the new data, if it consists
+  // of independently compressed streams.
+  std::vector<NewDataSegment> new_data_segments;
+  if (start < lines.size() && android::base::StartsWith(lines[start], "new_data_index ")) {
+    size_t compressed_size;
+    if (!ParseNewDataIndex(lines[start], &new_data_segments, &compressed_size)) {
+      ErrorAbort(state, kArgsParsingFailure, "invalid new data index [%s]", lines[start].c_str());
+      return StringValue("");
+    }
+    if (compressed_size != new_entry.uncompressed_length) {
+      ErrorAbort(state, kArgsParsingFailure,
+                 "new data index doesn't match the size of %s (%zu vs %" PRIu32 ")",
+                 new_data_fn->data.c_str(), compressed_size, new_entry.uncompressed_length);
+      return StringValue("");
+    }
+    start++;
+  }
+
+  // Scan the commands before executing them. This counts the references to each stash, so that
+  // the stashes can be released at their last use, and finds the blocks to prefetch. The blocks
+  // aren't prefetched with O_DIRECT I/O, which bypasses the page cache.
+  // The commands completed after the saved index are recorded for the same transfer list only.
+  if (params.canwrite) {
+    params.transfer_list_digest =
+        HashData(reinterpret_cast<const uint8_t*>(transfer_list.data()), transfer_list.size());
+    ParseCompletedCommands(params.last_command_file, params.transfer_list_digest,
+                           lines.size() - start, &params.completed);
+    params.skip_completed = SkippableCommands(lines, start, params.completed);
+    params.completed.resize(lines.size() - start);
+  }
+
+  TransferPlan plan;
+  PlanTransferList(lines, start, params.canwrite ? saved_last_command_index : -1, params, &plan);
+  if (!params.canwrite) {
+    params.stash_refs.clear();
+  }
+  bool prefetch = params.direct_fd == -1;
+  // The patches of this many upcoming commands are read ahead of them, or none with 0.
+  size_t patch_lookahead =
+      params.canwrite ? android::base::GetUintProperty<size_t>("ro.updater.patch_lookahead", 4) : 0;
+  size_t progress_step = 0;
+  auto progress_start = std::chrono::steady_clock::now();
+
+  if (params.canwrite) {
+    params.nti.za = za;
+    params.nti.entry = new_entry;
+    // The new data is consumed once, front to back.
+    AdviseMappedRange(ui->package_zip_addr + new_entry.offset, new_entry.compressed_length,
+                      MemAccess::SEQUENTIAL);
+    params.nti.brotli_compressed = android::base::EndsWith(new_data_fn->data, ".br");
+    params.nti.segments = std::move(new_data_segments);
+    if (!params.nti.segments.empty() && !params.nti.brotli_compressed) {
+      ErrorAbort(state, kArgsParsingFailure, "segmented new data must be brotli compressed");
+      return StringValue("");
+    }
+    // The segments can be decoded in parallel only if we can access the compressed stream
+    // directly, i.e. the entry is stored uncompressed in the package.
+    if (!params.nti.segments.empty() && new_entry.method == kCompressStored) {
+      params.nti.mapped_data = ui->package_zip_addr + new_entry.offset;
+    }
+    if (params.nti.brotli_compressed) {
+      // Initialize brotli decoder state.
+      params.nti.brotli_decoder_state = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
+    }
+    size_t ring_size =
+        tuning.new_data_buffer_size != 0
+            ? tuning.new_data_buffer_size
+            : android::base::GetUintProperty<size_t>("ro.updater.new_data_buffer_size",
+                                                     kDefaultNewDataBufferSize);
+    params.nti.ring = std::make_unique<RingBuffer>(std::max(ring_size, kMinNewDataBufferSize));
+    params.nti.receiver_available = true;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+    int error = pthread_create(&params.thread, &attr, unzip_new_data, &params.nti);
+    if (error != 0) {
+      PLOG(ERROR) << "pthread_create failed";
+      return StringValue("");
+    }
+  }
+
   // Build a map of the available commands
   std::unordered_map<std::string, const Command*> cmd_map;
   for (size_t i = 0; i < cmdcount; ++i) {
@@ -1703,14 +4421,70 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     cmd_map[commands[i].name] = &commands[i];
   }
 
+  // With ro.updater.io_trace set, every operation on the block device is recorded, so that the I/O
+  // pattern of the update can be replayed (with blockio_replay) apart from the CPU work.
+  bool io_trace = params.canwrite && android::base::GetBoolProperty("ro.updater.io_trace", false) &&
+                  BlockIoTrace::Start(blockdev_filename->data);
+
+  // Independent commands are executed concurrently when performing an update. The verification run
+  // stays serial, as it needs to check the target blocks of each command in order.
+  std::vector<std::unique_ptr<CommandParameters>> workers;
+  if (params.canwrite) {
+    size_t num_workers = tuning.max_workers;
+    if (num_workers == 0) {
+      num_workers =
+          std::min<size_t>(std::thread::hardware_concurrency() ?: 4, kMaxParallelWorkers);
+    }
+    if (concurrent != nullptr) {
+      num_workers /= concurrent->count;
+    }
+    workers = CreateParallelWorkers(params, blockdev_filename->data, num_workers);
+  }
+
+  // With ro.updater.thermal_throttle_temp set (in the unit of the thermal zones, usually
+  // millidegrees Celsius), the parallel workers and the I/O queue depth are scaled down while the
+  // device runs hot, instead of running into the kernel's thermal throttling.
+  std::unique_ptr<ThermalGovernor> governor;
+  int throttle_temperature = android::base::GetIntProperty("ro.updater.thermal_throttle_temp", 0);
+  if (params.canwrite && throttle_temperature > 0) {
+    governor = std::make_unique<ThermalGovernor>(
+        throttle_temperature, android::base::GetIntProperty("ro.updater.thermal_hysteresis", 5000),
+        std::chrono::seconds(5));
+  }
+  size_t max_workers = workers.size();
+
+  // The targets are checked on the fly, while they are still likely to be in the page cache.
+  std::unique_ptr<TargetVerifier> verifier;
+  if (params.canwrite && android::base::GetBoolProperty("ro.updater.speculative_verify", true)) {
+    verifier = std::make_unique<TargetVerifier>(blockdev_filename->data);
+    if (!verifier->running()) {
+      verifier.reset();
+    }
+  }
+
+  // Optionally let the device trim the erased blocks while the following commands are running.
+  if (params.canwrite && android::base::GetBoolProperty("ro.updater.async_discard", false)) {
+    params.discarder = std::make_unique<BackgroundDiscarder>(blockdev_filename->data);
+    if (!params.discarder->running()) {
+      params.discarder.reset();
+    }
+  }
+
   int rc = -1;
+  // The line of the command (or the first one of the parallel commands) being executed.
+  size_t current = start;
 
   // Subsequent lines are all individual transfer commands
   for (size_t i = start; i < lines.size(); i++) {
     const std::string& line = lines[i];
     if (line.empty()) continue;
+    current = i;
 
-    params.tokens = android::base::Split(line, " ");
+    FinishTrace(params);
+    {
+      TraceTimer timer(&params.trace, kTraceParse, line.size());
+      params.tokens = android::base::Split(line, " ");
+    }
     params.cpos = 0;
     if (i - start > std::numeric_limits<int>::max()) {
       params.cmdindex = -1;
@@ -1735,13 +4509,122 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
       continue;
     }
 
-    // Skip all commands before the saved last command index when resuming an update.
-    if (params.canwrite && params.cmdindex != -1 && params.cmdindex <= saved_last_command_index) {
+    // Skip all commands before the saved last command index when resuming an update, and the
+    // ones after it that have completed. The new data of a skipped 'new' command is dropped.
+    if (params.canwrite && params.cmdindex != -1 &&
+        (params.cmdindex <= saved_last_command_index ||
+         SkipCompleted(params.skip_completed, params.cmdindex))) {
       LOG(INFO) << "Skipping already executed command: " << params.cmdindex
                 << ", last executed command for previous update: " << saved_last_command_index;
+      if (strcmp(params.cmdname, "new") == 0 &&
+          !DiscardNewData(params, CommandTargetRange(params.tokens))) {
+        goto pbiudone;
+      }
       continue;
     }
 
+    params.trace.cmdindex = params.cmdindex;
+    params.trace.cmdname = params.cmdname;
+    BlockIoTrace::SetCommand(params.cmdindex);
+
+    if (prefetch) {
+      PrefetchBlocks(params.fd, &plan, i);
+    }
+    if (patch_lookahead > 0) {
+      PrefetchPatches(params.patch_start, patch_entry.compressed_length, ui->package_map,
+                      patch_lookahead, &plan, i);
+    }
+
+    if (governor) {
+      max_workers = governor->Limit(workers.size());
+      unsigned max_in_flight = governor->Limit(kIoQueueDepth);
+      if (params.io_queue) {
+        params.io_queue->set_max_in_flight(max_in_flight);
+      }
+      for (auto& worker : workers) {
+        if (worker->io_queue) {
+          worker->io_queue->set_max_in_flight(max_in_flight);
+        }
+      }
+    }
+
+    // Execute this command together with the following independent ones if possible. None of them
+    // writes to the stash, so there's no need to update the last command index; a resumed update
+    // starts over from the same command as it would have done if they were executed serially.
+    if (max_workers > 1) {
+      std::vector<ParallelCommand> window;
+      size_t next =
+          CollectParallelCommands(lines, i, start, cmd_map, params.skip_completed, &window);
+      if (window.size() > 1) {
+        bool overlap = false;
+        for (const auto& command : window) {
+          overlap = overlap || OverlapsPendingStashes(params, command.tgt);
+        }
+        if (overlap && CheckpointStashes(params, params.cmdindex, lines[i - 1]) != 0) {
+          goto pbiudone;
+        }
+        for (const auto& command : window) {
+          if (verifier) {
+            verifier->WaitFor(command.tgt);
+          }
+          if (params.discarder) {
+            params.discarder->WaitFor(command.tgt);
+          }
+        }
+        LOG(INFO) << "executing " << window.size() << " independent commands in parallel";
+        // The commands are traced by the threads that execute them.
+        params.trace = CommandTrace();
+        if (!PerformParallelCommands(params, workers, window, max_workers)) {
+          goto pbiudone;
+        }
+        i = next - 1;
+        {
+          // The fsync is shared by the whole window. It's accounted to the last trace collected from
+          // the workers, which isn't necessarily the command that finished last.
+          TraceTimer timer(&params.traces.back(), kTraceFsync);
+          TracedIo traced(params.fd, BlockIoRecord::kFsync, 0, 0);
+          if (ota_fsync(params.fd) == -1) {
+            SetFailureType(kFsyncFailure);
+            PLOG(ERROR) << "fsync failed";
+            goto pbiudone;
+          }
+        }
+        for (const auto& command : window) {
+          MarkCompleted(params, command.cmdindex);
+        }
+        if (params.unsaved_completed >= kCompletedCommandsBatch) {
+          SaveCompletedCommands(params);
+        }
+        if (verifier) {
+          for (const auto& command : window) {
+            verifier->Add(android::base::Split(*command.line, " "));
+          }
+        }
+        if (prefetch) {
+          ReleaseBlocks(params.fd, &plan, next);
+        }
+        ReportProgress(state, cmd_pipe, params, plan, progress_start, &progress_step);
+        continue;
+      }
+    }
+
+    // Pending stashes need to be on disk before any of their source blocks get overwritten.
+    if ((!params.memory_stashes.empty() || !params.unsynced_stashes.empty()) &&
+        OverlapsPendingStashes(params, CommandTargetRange(params.tokens)) &&
+        CheckpointStashes(params, params.cmdindex, lines[i - 1]) != 0) {
+      goto pbiudone;
+    }
+
+    if (verifier || params.discarder) {
+      RangeSet tgt = CommandTargetRange(params.tokens);
+      if (verifier) {
+        verifier->WaitFor(tgt);
+      }
+      if (params.discarder) {
+        params.discarder->WaitFor(tgt);
+      }
+    }
+
     if (cmd->f(params) == -1) {
       LOG(ERROR) << "failed to execute command [" << line << "]";
       goto pbiudone;
@@ -1759,31 +4642,80 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
         LOG(WARNING) << "Previously executed command " << saved_last_command_index << ": "
                      << params.cmdline << " doesn't produce expected target blocks.";
         saved_last_command_index = -1;
-        DeleteLastCommandFile();
+        DeleteLastCommandFile(params.last_command_file);
       }
     }
     if (params.canwrite) {
-      if (ota_fsync(params.fd) == -1) {
-        failure_type = kFsyncFailure;
-        PLOG(ERROR) << "fsync failed";
-        goto pbiudone;
+      {
+        TraceTimer timer(&params.trace, kTraceFsync);
+        TracedIo traced(params.fd, BlockIoRecord::kFsync, 0, 0);
+        if (ota_fsync(params.fd) == -1) {
+          SetFailureType(kFsyncFailure);
+          PLOG(ERROR) << "fsync failed";
+          goto pbiudone;
+        }
+      }
+      MarkCompleted(params, params.cmdindex);
+      if (params.unsaved_completed >= kCompletedCommandsBatch) {
+        SaveCompletedCommands(params);
       }
-      fprintf(cmd_pipe, "set_progress %.4f\n", static_cast<double>(params.written) / total_blocks);
-      fflush(cmd_pipe);
+      // The stashes can go once the blocks written from them are on the disk.
+      ReleaseStashReferences(params);
+      if (verifier) {
+        verifier->Add(params.tokens);
+      }
+      ReportProgress(state, cmd_pipe, params, plan, progress_start, &progress_step);
+    }
+    if (prefetch) {
+      ReleaseBlocks(params.fd, &plan, i + 1);
+    }
+  }
+
+  if (params.discarder && !params.discarder->Finish()) {
+    LOG(ERROR) << "failed to discard the erased blocks";
+    SetFailureType(kFwriteFailure);
+    goto pbiudone;
+  }
+
+  if (verifier) {
+    size_t mismatches = verifier->Finish();
+    if (mismatches != 0) {
+      LOG(ERROR) << mismatches << " commands didn't produce the expected target blocks";
+      SetFailureType(kFwriteFailure);
+      goto pbiudone;
     }
+    LOG(INFO) << "verified the targets of " << verifier->verified() << " commands";
   }
 
   rc = 0;
 
 pbiudone:
+  FinishTrace(params);
+
+  // Save the pending stashes, so that a resumed update doesn't need to run the commands that have
+  // completed again.
+  if (rc != 0 && params.canwrite && !params.isunresumable &&
+      current - start <= static_cast<size_t>(std::numeric_limits<int>::max()) &&
+      CheckpointStashes(params, current - start, lines[current - 1]) != 0) {
+    LOG(WARNING) << "Failed to save the pending stashes";
+  }
+  if (rc != 0 && params.canwrite && !params.isunresumable) {
+    SaveCompletedCommands(params);
+  }
+
   if (params.canwrite) {
-    pthread_mutex_lock(&params.nti.mu);
+    const char* partition = strrchr(blockdev_filename->data.c_str(), '/');
+    if (partition != nullptr && *(partition + 1) != 0) {
+      WriteTransferTrace(
+          CacheLocation::location().transfer_trace_base() + "_" + std::string(partition + 1),
+          params.traces);
+    }
+
     if (params.nti.receiver_available) {
       LOG(WARNING) << "new data receiver is still available after executing all commands.";
     }
-    params.nti.receiver_available = false;
-    pthread_cond_broadcast(&params.nti.cv);
-    pthread_mutex_unlock(&params.nti.mu);
+    // Unblock the background thread in case it's waiting for the ring buffer to drain.
+    params.nti.ring->CloseRead();
     int ret = pthread_join(params.thread, nullptr);
     if (ret != 0) {
       LOG(WARNING) << "pthread join returned with " << strerror(ret);
@@ -1803,28 +4735,40 @@ pbiudone:
       // Delete stash only after successfully completing the update, as it may contain blocks needed
       // to complete the update later.
       DeleteStash(params.stashbase);
-      DeleteLastCommandFile();
+      DeleteLastCommandFile(params.last_command_file);
     }
-
-    pthread_mutex_destroy(&params.nti.mu);
-    pthread_cond_destroy(&params.nti.cv);
   } else if (rc == 0) {
     LOG(INFO) << "verified partition contents; update may be resumed";
   }
 
-  if (ota_fsync(params.fd) == -1) {
-    failure_type = kFsyncFailure;
-    PLOG(ERROR) << "fsync failed";
+  BlockIoTrace::SetCommand(-1);
+  {
+    TracedIo traced(params.fd, BlockIoRecord::kFsync, 0, 0);
+    if (ota_fsync(params.fd) == -1) {
+      SetFailureType(kFsyncFailure);
+      PLOG(ERROR) << "fsync failed";
+    }
   }
   // params.fd will be automatically closed because it's a unique_fd.
 
+  if (io_trace) {
+    const char* partition = strrchr(blockdev_filename->data.c_str(), '/');
+    BlockIoTrace::Finish(partition != nullptr && *(partition + 1) != 0
+                             ? CacheLocation::location().transfer_trace_base() + "_" +
+                                   std::string(partition + 1) + ".io"
+                             : "");
+  }
+
   if (params.nti.brotli_decoder_state != nullptr) {
     BrotliDecoderDestroyInstance(params.nti.brotli_decoder_state);
   }
 
+  buffer_pool.Return(std::move(params.buffer));
+  buffer_pool.Clear();
+
   // Delete the last command file if the update cannot be resumed.
   if (params.isunresumable) {
-    DeleteLastCommandFile();
+    DeleteLastCommandFile(params.last_command_file);
   }
 
   // Only delete the stash if the update cannot be resumed, or it's a verification run and we
@@ -1833,13 +4777,31 @@ pbiudone:
     DeleteStash(params.stashbase);
   }
 
-  if (failure_type != kNoCause && state->cause_code == kNoCause) {
-    state->cause_code = failure_type;
+  if (status.failure_type != kNoCause && state->cause_code == kNoCause) {
+    state->cause_code = status.failure_type;
   }
 
   return StringValue(rc == 0 ? "t" : "");
 }
 
+static Value* PerformBlockImageUpdate(const char* name, State* state,
+                                      const std::vector<std::unique_ptr<Expr>>& argv,
+                                      const Command* commands, size_t cmdcount, bool dryrun) {
+  if (argv.size() != 4) {
+    ErrorAbort(state, kArgsParsingFailure, "block_image_update expects 4 arguments, got %zu",
+               argv.size());
+    return StringValue("");
+  }
+
+  std::vector<std::unique_ptr<Value>> args;
+  if (!ReadValueArgs(state, argv, &args)) {
+    return nullptr;
+  }
+
+  return PerformBlockImageUpdate(name, state, args[0].get(), args[1].get(), args[2].get(),
+                                 args[3].get(), commands, cmdcount, dryrun, nullptr);
+}
+
 /**
  * The transfer list is a text file containing commands to transfer data from one place to another
  * on the target partition. We parse it and execute the commands in order:
@@ -1883,6 +4845,14 @@ pbiudone:
  * Commands that read data from the partition (i.e. move/bsdiff/imgdiff/stash) have one or more
  * additional hashes before the range parameters, which are used to check if the command has already
  * been completed and verify the integrity of the source data.
+ *
+ * The header may be followed by an optional line that describes the brotli compressed new data as a
+ * concatenation of independently compressed segments:
+ *
+ *    new_data_index <segment_count> <compressed_size>:<uncompressed_size> ...
+ *
+ * The segments are decoded in parallel when the new data is stored uncompressed in the package, and
+ * one after another otherwise. Without the line, the new data is treated as a single stream.
  */
 Value* BlockImageVerifyFn(const char* name, State* state,
                           const std::vector<std::unique_ptr<Expr>>& argv) {
@@ -1903,21 +4873,110 @@ Value* BlockImageVerifyFn(const char* name, State* state,
                 sizeof(commands) / sizeof(commands[0]), true);
 }
 
+static const Command kUpdateCommands[] = {
+    { "bsdiff",     PerformCommandDiff  },
+    { "erase",      PerformCommandErase },
+    { "free",       PerformCommandFree  },
+    { "imgdiff",    PerformCommandDiff  },
+    { "move",       PerformCommandMove  },
+    { "new",        PerformCommandNew   },
+    { "stash",      PerformCommandStash },
+    { "zero",       PerformCommandZero  }
+};
+
 Value* BlockImageUpdateFn(const char* name, State* state,
                           const std::vector<std::unique_ptr<Expr>>& argv) {
-    const Command commands[] = {
-        { "bsdiff",     PerformCommandDiff  },
-        { "erase",      PerformCommandErase },
-        { "free",       PerformCommandFree  },
-        { "imgdiff",    PerformCommandDiff  },
-        { "move",       PerformCommandMove  },
-        { "new",        PerformCommandNew   },
-        { "stash",      PerformCommandStash },
-        { "zero",       PerformCommandZero  }
-    };
+    return PerformBlockImageUpdate(name, state, argv, kUpdateCommands,
+                arraysize(kUpdateCommands), false);
+}
 
-    return PerformBlockImageUpdate(name, state, argv, commands,
-                sizeof(commands) / sizeof(commands[0]), false);
+// block_image_update_multi(blockdev1, transfer_list1, new_data1, patch_data1, blockdev2, ...)
+//
+// Updates the given partitions concurrently, which takes the same arguments as block_image_update()
+// for each of them. The partitions must be independent block devices. They share the memory for
+// the stashes and the threads for the independent commands, and report their progress as a whole.
+// Each update is resumed from its own last command file. Returns "t" if all of them succeed.
+Value* BlockImageUpdateMultiFn(const char* name, State* state,
+                               const std::vector<std::unique_ptr<Expr>>& argv) {
+  if (argv.empty() || argv.size() % 4 != 0) {
+    ErrorAbort(state, kArgsParsingFailure, "%s expects a multiple of 4 arguments, got %zu", name,
+               argv.size());
+    return StringValue("");
+  }
+
+  std::vector<std::unique_ptr<Value>> args;
+  if (!ReadValueArgs(state, argv, &args)) {
+    return nullptr;
+  }
+
+  size_t count = args.size() / 4;
+  SharedProgress progress;
+  progress.blocks.resize(count);
+  std::vector<std::unique_ptr<State>> states;
+  std::vector<std::unique_ptr<Value>> results(count);
+  std::vector<std::thread> threads;
+  LOG(INFO) << "updating " << count << " partitions concurrently";
+  for (size_t i = 0; i < count; i++) {
+    states.push_back(std::make_unique<State>(state->script, state->script_len, state->cookie));
+    states[i]->is_retry = state->is_retry;
+    threads.emplace_back([&, i]() {
+      ConcurrentUpdates concurrent{ count, i, &progress };
+      results[i].reset(PerformBlockImageUpdate(
+          name, states[i].get(), args[i * 4].get(), args[i * 4 + 1].get(), args[i * 4 + 2].get(),
+          args[i * 4 + 3].get(), kUpdateCommands, arraysize(kUpdateCommands), false, &concurrent));
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  // Report the first failure.
+  bool success = true;
+  for (size_t i = 0; i < count; i++) {
+    if (results[i] && results[i]->data == "t") {
+      continue;
+    }
+    LOG(ERROR) << "failed to update " << args[i * 4]->data;
+    if (success) {
+      if (!states[i]->errmsg.empty()) {
+        ErrorAbort(state, states[i]->cause_code, "%s", states[i]->errmsg.c_str());
+      } else if (state->cause_code == kNoCause) {
+        state->cause_code = states[i]->cause_code;
+      }
+    }
+    success = false;
+  }
+  return StringValue(success ? "t" : "");
+}
+
+// Computes the SHA-1 of the blocks in |ranges| on |blockdev| for range_sha1(). The blocks are always
+// read, since they may have been written by anything since an update. On failure, sets |cause|
+// (and errno).
+static bool RangeSha1(const std::string& blockdev, const std::string& ranges,
+                      std::string* hexdigest, CauseCode* cause) {
+  android::base::unique_fd fd(ota_open(blockdev.c_str(), O_RDWR));
+  if (fd == -1) {
+    *cause = kFileOpenFailure;
+    return false;
+  }
+
+  RangeSet rs = RangeSet::Parse(ranges);
+  CHECK(static_cast<bool>(rs));
+
+  if (!HashBlocks(fd, rs, hexdigest)) {
+    *cause = kFreadFailure;
+    return false;
+  }
+  return true;
+}
+
+// Reports the failure of RangeSha1() on |blockdev|.
+static void RangeSha1Failed(State* state, const std::string& blockdev, CauseCode cause) {
+  if (cause == kFileOpenFailure) {
+    ErrorAbort(state, cause, "open \"%s\" failed: %s", blockdev.c_str(), strerror(errno));
+  } else {
+    ErrorAbort(state, cause, "failed to read %s: %s", blockdev.c_str(), strerror(errno));
+  }
 }
 
 Value* RangeSha1Fn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv) {
@@ -1943,41 +5002,62 @@ Value* RangeSha1Fn(const char* name, State* state, const std::vector<std::unique
     return StringValue("");
   }
 
-  android::base::unique_fd fd(ota_open(blockdev_filename->data.c_str(), O_RDWR));
-  if (fd == -1) {
-    ErrorAbort(state, kFileOpenFailure, "open \"%s\" failed: %s", blockdev_filename->data.c_str(),
-               strerror(errno));
+  std::string hexdigest;
+  CauseCode cause = kNoCause;
+  if (!RangeSha1(blockdev_filename->data, ranges->data, &hexdigest, &cause)) {
+    RangeSha1Failed(state, blockdev_filename->data, cause);
     return StringValue("");
   }
 
-  RangeSet rs = RangeSet::Parse(ranges->data);
-  CHECK(static_cast<bool>(rs));
+  return StringValue(hexdigest);
+}
 
-  SHA_CTX ctx;
-  SHA1_Init(&ctx);
+// The number of the ranges of range_sha1_multi() that are hashed at the same time.
+static constexpr size_t kMaxRangeSha1Threads = 4;
+
+// range_sha1_multi(blockdev1, ranges1, blockdev2, ranges2, ...)
+//
+// Returns the SHA-1s of the given ranges, as range_sha1() would for each of them, separated by
+// commas. The ranges are read and hashed concurrently, so the precondition checks of a large
+// incremental don't wait for each read in turn. Returns "" if any of them fails.
+Value* RangeSha1MultiFn(const char* name, State* state,
+                        const std::vector<std::unique_ptr<Expr>>& argv) {
+  if (argv.empty() || argv.size() % 2 != 0) {
+    ErrorAbort(state, kArgsParsingFailure, "%s expects a multiple of 2 arguments, got %zu", name,
+               argv.size());
+    return StringValue("");
+  }
 
-  std::vector<uint8_t> buffer(BLOCKSIZE);
-  for (const auto& range : rs) {
-    if (!check_lseek(fd, static_cast<off64_t>(range.first) * BLOCKSIZE, SEEK_SET)) {
-      ErrorAbort(state, kLseekFailure, "failed to seek %s: %s", blockdev_filename->data.c_str(),
-                 strerror(errno));
+  std::vector<std::unique_ptr<Value>> args;
+  if (!ReadValueArgs(state, argv, &args)) {
+    return nullptr;
+  }
+  for (const auto& arg : args) {
+    if (arg->type != VAL_STRING) {
+      ErrorAbort(state, kArgsParsingFailure, "arguments to %s must be strings", name);
       return StringValue("");
     }
+  }
 
-    for (size_t j = range.first; j < range.second; ++j) {
-      if (read_all(fd, buffer, BLOCKSIZE) == -1) {
-        ErrorAbort(state, kFreadFailure, "failed to read %s: %s", blockdev_filename->data.c_str(),
-                   strerror(errno));
-        return StringValue("");
-      }
+  size_t count = args.size() / 2;
+  std::vector<std::string> digests(count);
+  std::vector<CauseCode> causes(count, kNoCause);
+  std::vector<int> errnos(count, 0);
+  ThreadPool::Shared().ParallelFor(count, [&](size_t i) {
+    if (!RangeSha1(args[i * 2]->data, args[i * 2 + 1]->data, &digests[i], &causes[i])) {
+      errnos[i] = errno;
+    }
+    return true;
+  }, kMaxRangeSha1Threads);
 
-      SHA1_Update(&ctx, buffer.data(), BLOCKSIZE);
+  for (size_t i = 0; i < count; i++) {
+    if (causes[i] != kNoCause) {
+      errno = errnos[i];
+      RangeSha1Failed(state, args[i * 2]->data, causes[i]);
+      return StringValue("");
     }
   }
-  uint8_t digest[SHA_DIGEST_LENGTH];
-  SHA1_Final(digest, &ctx);
-
-  return StringValue(print_sha1(digest));
+  return StringValue(android::base::Join(digests, ","));
 }
 
 // This function checks if a device has been remounted R/W prior to an incremental
@@ -2013,7 +5093,7 @@ Value* CheckFirstBlockFn(const char* name, State* state,
   }
 
   RangeSet blk0(std::vector<Range>{ Range{ 0, 1 } });
-  std::vector<uint8_t> block0_buffer(BLOCKSIZE);
+  BlockBuffer block0_buffer(BLOCKSIZE);
 
   if (ReadBlocks(blk0, block0_buffer, fd) == -1) {
     ErrorAbort(state, kFreadFailure, "failed to read %s: %s", arg_filename->data.c_str(),
@@ -2039,6 +5119,11 @@ Value* CheckFirstBlockFn(const char* name, State* state,
   return StringValue("t");
 }
 
+// The maximum number of threads that recover the blocks at the same time, and the minimum number
+// of blocks worth giving a thread of its own.
+static constexpr size_t kMaxRecoverThreads = 4;
+static constexpr size_t kMinParallelRecoverBlocks = 1024;
+
 Value* BlockImageRecoverFn(const char* name, State* state,
                            const std::vector<std::unique_ptr<Expr>>& argv) {
   if (argv.size() != 2) {
@@ -2092,40 +5177,106 @@ Value* BlockImageRecoverFn(const char* name, State* state,
     return StringValue("");
   }
 
-  uint8_t buffer[BLOCKSIZE];
+  // Stay within the data area, libfec validates and corrects metadata
+  size_t data_blocks = status.data_size / BLOCKSIZE;
+  RangeSet to_read;
   for (const auto& range : rs) {
-    for (size_t j = range.first; j < range.second; ++j) {
-      // Stay within the data area, libfec validates and corrects metadata
-      if (status.data_size <= static_cast<uint64_t>(j) * BLOCKSIZE) {
-        continue;
-      }
+    if (range.first < data_blocks) {
+      to_read.PushBack({ range.first, std::min(range.second, data_blocks) });
+    }
+  }
+
+  // The ranges are split across several fec::io handles, read on the shared thread pool. The
+  // handles cover disjoint blocks, so each corrected block is rewritten by one of them only.
+  size_t num_threads = std::min<size_t>(std::thread::hardware_concurrency() ?: 4,
+                                        kMaxRecoverThreads);
+  if (to_read.blocks() < kMinParallelRecoverBlocks * num_threads) {
+    num_threads = std::max<size_t>(to_read.blocks() / kMinParallelRecoverBlocks, 1);
+  }
+  std::vector<RangeSet> groups =
+      to_read.blocks() == 0 ? std::vector<RangeSet>() : to_read.Split(num_threads);
+
+  std::atomic<bool> failed(false);
+  std::atomic<uint64_t> corrected(0);
+  std::mutex error_mutex;
+  std::string error;
+  auto recover = [&](fec::io* handle, const RangeSet& group) {
+    fec_status before;
+    bool has_status = handle->get_status(before);
+    uint8_t buffer[BLOCKSIZE];
+    for (const auto& range : group) {
+      for (size_t j = range.first; j < range.second && !failed; ++j) {
+        if (handle->pread(buffer, BLOCKSIZE, static_cast<off64_t>(j) * BLOCKSIZE) != BLOCKSIZE) {
+          std::lock_guard<std::mutex> lock(error_mutex);
+          if (!failed.exchange(true)) {
+            error = android::base::StringPrintf("failed to recover %s (block %zu): %s",
+                                                filename->data.c_str(), j, strerror(errno));
+          }
+          return;
+        }
 
-      if (fh.pread(buffer, BLOCKSIZE, static_cast<off64_t>(j) * BLOCKSIZE) != BLOCKSIZE) {
-        ErrorAbort(state, kLibfecFailure, "failed to recover %s (block %zu): %s",
-                   filename->data.c_str(), j, strerror(errno));
-        return StringValue("");
+        // If we want to be able to recover from a situation where rewriting a corrected
+        // block doesn't guarantee the same data will be returned when re-read later, we
+        // can save a copy of corrected blocks to /cache. Note:
+        //
+        //  1. Maximum space required from /cache is the same as the maximum number of
+        //     corrupted blocks we can correct. For RS(255, 253) and a 2 GiB partition,
+        //     this would be ~16 MiB, for example.
+        //
+        //  2. To find out if this block was corrupted, call fec_get_status after each
+        //     read and check if the errors field value has increased.
       }
+    }
+    fec_status after;
+    if (has_status && handle->get_status(after)) {
+      corrected += after.errors - before.errors;
+    }
+  };
 
-      // If we want to be able to recover from a situation where rewriting a corrected
-      // block doesn't guarantee the same data will be returned when re-read later, we
-      // can save a copy of corrected blocks to /cache. Note:
-      //
-      //  1. Maximum space required from /cache is the same as the maximum number of
-      //     corrupted blocks we can correct. For RS(255, 253) and a 2 GiB partition,
-      //     this would be ~16 MiB, for example.
-      //
-      //  2. To find out if this block was corrupted, call fec_get_status after each
-      //     read and check if the errors field value has increased.
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::unique_ptr<fec::io>> extra_handles;
+  std::vector<fec::io*> handles = { &fh };
+  for (size_t i = 1; i < groups.size(); i++) {
+    auto handle = std::make_unique<fec::io>(filename->data, O_RDWR);
+    if (!*handle) {
+      // Splits the blocks across the handles that did open instead.
+      PLOG(WARNING) << "Failed to open another fec handle for " << filename->data;
+      groups = to_read.Split(handles.size());
+      break;
     }
+    handles.push_back(handle.get());
+    extra_handles.push_back(std::move(handle));
+  }
+  ThreadPool::Shared().ParallelFor(groups.size(), [&](size_t i) {
+    recover(handles[i], groups[i]);
+    return !failed;
+  }, kMaxRecoverThreads);
+
+  if (failed) {
+    ErrorAbort(state, kLibfecFailure, "%s", error.c_str());
+    return StringValue("");
   }
+
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  double mib = to_read.blocks() * BLOCKSIZE / (1024.0 * 1024.0);
+  LOG(INFO) << "read " << to_read.blocks() << " blocks with " << groups.size()
+            << " fec handles in " << elapsed.count() << " s ("
+            << (elapsed.count() > 0 ? mib / elapsed.count() : 0) << " MiB/s), corrected "
+            << corrected.load() << " errors";
   LOG(INFO) << "..." << filename->data << " image recovered successfully.";
   return StringValue("t");
 }
 
+void SetBlockImageTuning(const BlockImageTuning& new_tuning) {
+  tuning = new_tuning;
+}
+
 void RegisterBlockImageFunctions() {
   RegisterFunction("block_image_verify", BlockImageVerifyFn);
   RegisterFunction("block_image_update", BlockImageUpdateFn);
+  RegisterFunction("block_image_update_multi", BlockImageUpdateMultiFn);
   RegisterFunction("block_image_recover", BlockImageRecoverFn);
   RegisterFunction("check_first_block", CheckFirstBlockFn);
   RegisterFunction("range_sha1", RangeSha1Fn);
+  RegisterFunction("range_sha1_multi", RangeSha1MultiFn);
 }
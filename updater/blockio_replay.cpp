@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Replays a block I/O trace taken by the updater (with ro.updater.io_trace set) against a block
+// device or an image file, to measure the storage side of an update apart from the decompression,
+// the patching and the hashing around it:
+//
+//   blockio_replay [--read-only] [--timed] [--queue-depth=<n>] <trace> <target>
+//
+// The writes put a fixed pattern rather than the update's data, so the target ends up garbage
+// wherever the update wrote (unless --read-only).
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/unique_fd.h>
+
+#include "otautil/block_io_trace.h"
+#include "otautil/io_uring.h"
+
+static constexpr const char* kOpNames[] = { "read", "write", "discard", "zero", "fsync" };
+static constexpr size_t kNumOps = sizeof(kOpNames) / sizeof(kOpNames[0]);
+
+struct OpStats {
+  uint64_t count = 0;
+  uint64_t bytes = 0;
+  uint64_t recorded_ns = 0;
+  uint64_t replayed_ns = 0;
+};
+
+static uint64_t NanosSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+                                                              start)
+      .count();
+}
+
+static bool ReplayRecord(int fd, bool is_blk, const BlockIoRecord& record, uint8_t* buffer) {
+  switch (record.op) {
+    case BlockIoRecord::kRead:
+      if (!android::base::ReadFullyAtOffset(fd, buffer, record.length, record.offset)) {
+        PLOG(ERROR) << "Failed to read " << record.length << " bytes at " << record.offset;
+        return false;
+      }
+      return true;
+    case BlockIoRecord::kWrite:
+      if (TEMP_FAILURE_RETRY(pwrite64(fd, buffer, record.length, record.offset)) !=
+          static_cast<ssize_t>(record.length)) {
+        PLOG(ERROR) << "Failed to write " << record.length << " bytes at " << record.offset;
+        return false;
+      }
+      return true;
+    case BlockIoRecord::kDiscard:
+    case BlockIoRecord::kZeroOut: {
+      bool discard = record.op == BlockIoRecord::kDiscard;
+      int result;
+      if (is_blk) {
+        uint64_t args[2] = { record.offset, record.length };
+        result = ioctl(fd, discard ? BLKDISCARD : BLKZEROOUT, &args);
+      } else {
+        result = fallocate(fd, discard ? (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)
+                                       : FALLOC_FL_ZERO_RANGE,
+                           record.offset, record.length);
+      }
+      // The updater falls back on writing zeroes when the device can't discard.
+      if (result == -1 && errno != EOPNOTSUPP) {
+        PLOG(ERROR) << "Failed to " << kOpNames[record.op] << " " << record.length << " bytes at "
+                    << record.offset;
+        return false;
+      }
+      return true;
+    }
+    case BlockIoRecord::kFsync:
+      if (fsync(fd) == -1) {
+        PLOG(ERROR) << "Failed to fsync";
+        return false;
+      }
+      return true;
+  }
+  LOG(ERROR) << "Unknown op " << static_cast<int>(record.op);
+  return false;
+}
+
+static void Usage(const char* name) {
+  fprintf(stderr,
+          "usage: %s [--read-only] [--timed] [--queue-depth=<n>] <trace> <target>\n"
+          "  --read-only        skip the writes, discards and zero-outs\n"
+          "  --timed            keep the gaps between the operations as recorded\n"
+          "  --queue-depth=<n>  replay the batches of the trace through an io_uring of depth <n>\n"
+          "                     (default 32, 0 to replay them one request after the other)\n",
+          name);
+}
+
+int main(int argc, char** argv) {
+  static constexpr struct option OPTIONS[] = {
+    { "read-only", no_argument, nullptr, 'r' },
+    { "timed", no_argument, nullptr, 't' },
+    { "queue-depth", required_argument, nullptr, 'q' },
+    { nullptr, 0, nullptr, 0 },
+  };
+  bool read_only = false;
+  bool timed = false;
+  unsigned queue_depth = 32;
+
+  int opt;
+  int option_index;
+  while ((opt = getopt_long(argc, argv, "", OPTIONS, &option_index)) != -1) {
+    switch (opt) {
+      case 'r':
+        read_only = true;
+        break;
+      case 't':
+        timed = true;
+        break;
+      case 'q':
+        if (!android::base::ParseUint(optarg, &queue_depth)) {
+          LOG(ERROR) << "Invalid queue depth: " << optarg;
+          return 1;
+        }
+        break;
+      default:
+        Usage(argv[0]);
+        return 2;
+    }
+  }
+  if (argc - optind != 2) {
+    Usage(argv[0]);
+    return 2;
+  }
+
+  std::vector<BlockIoRecord> records;
+  if (!BlockIoTrace::Load(argv[optind], &records)) {
+    return 1;
+  }
+  const char* target = argv[optind + 1];
+  android::base::unique_fd fd(open(target, (read_only ? O_RDONLY : O_RDWR) | O_CLOEXEC));
+  if (fd == -1) {
+    PLOG(ERROR) << "Failed to open " << target;
+    return 1;
+  }
+  struct stat sb;
+  if (fstat(fd, &sb) == -1) {
+    PLOG(ERROR) << "Failed to stat " << target;
+    return 1;
+  }
+  bool is_blk = S_ISBLK(sb.st_mode);
+
+  std::unique_ptr<IoUringQueue> queue;
+  if (queue_depth > 0) {
+    queue = IoUringQueue::Create(queue_depth);
+    if (!queue) {
+      LOG(WARNING) << "io_uring isn't available; replaying the batches synchronously";
+    }
+  }
+
+  OpStats stats[kNumOps];
+  std::vector<uint8_t> buffer;
+  auto start = std::chrono::steady_clock::now();
+  uint64_t recorded_end_ns = 0;
+  for (size_t i = 0; i < records.size();) {
+    const BlockIoRecord& first = records[i];
+    if (first.op >= kNumOps) {
+      LOG(ERROR) << "Unknown op " << static_cast<int>(first.op) << " in record " << i;
+      return 1;
+    }
+    // The requests that went through the io_uring together, which share the start time.
+    size_t end = i + 1;
+    uint64_t batch_bytes = first.length;
+    if (first.flags & BlockIoRecord::kQueued) {
+      while (end < records.size() && (records[end].flags & BlockIoRecord::kQueued) &&
+             records[end].op == first.op && records[end].start_ns == first.start_ns) {
+        batch_bytes += records[end++].length;
+      }
+    }
+    recorded_end_ns = std::max(recorded_end_ns, first.start_ns + first.duration_ns);
+
+    OpStats& op_stats = stats[first.op];
+    op_stats.count += end - i;
+    op_stats.bytes += batch_bytes;
+    op_stats.recorded_ns += first.duration_ns;
+
+    bool skip = read_only && first.op != BlockIoRecord::kRead && first.op != BlockIoRecord::kFsync;
+    if (skip) {
+      i = end;
+      continue;
+    }
+    if (timed) {
+      uint64_t now_ns = NanosSince(start);
+      if (first.start_ns > now_ns) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(first.start_ns - now_ns));
+      }
+    }
+    if (buffer.size() < batch_bytes) {
+      // A recognizable pattern, so that the blocks written by a replay stand out.
+      buffer.resize(batch_bytes, 0xa5);
+    }
+
+    auto op_start = std::chrono::steady_clock::now();
+    if (end - i > 1 && queue) {
+      std::vector<IoRequest> requests;
+      uint8_t* data = buffer.data();
+      for (size_t j = i; j < end; j++) {
+        requests.push_back({ fd.get(), data, static_cast<size_t>(records[j].length),
+                             static_cast<off64_t>(records[j].offset) });
+        data += records[j].length;
+      }
+      bool success =
+          first.op == BlockIoRecord::kRead ? queue->Read(requests) : queue->Write(requests);
+      if (!success) {
+        PLOG(ERROR) << "Failed to replay the batch of " << requests.size() << " requests at record "
+                    << i;
+        return 1;
+      }
+    } else {
+      for (size_t j = i; j < end; j++) {
+        if (!ReplayRecord(fd, is_blk, records[j], buffer.data())) {
+          LOG(ERROR) << "Failed to replay record " << j;
+          return 1;
+        }
+      }
+    }
+    op_stats.replayed_ns += NanosSince(op_start);
+    i = end;
+  }
+  if (!read_only && fsync(fd) == -1) {
+    PLOG(ERROR) << "Failed to fsync " << target;
+    return 1;
+  }
+  uint64_t replay_ns = NanosSince(start);
+
+  printf("%-8s %10s %12s %12s %12s %10s\n", "op", "count", "MiB", "recorded ms", "replayed ms",
+         "MiB/s");
+  uint64_t recorded_io_ns = 0;
+  for (size_t op = 0; op < kNumOps; op++) {
+    const OpStats& s = stats[op];
+    if (s.count == 0) {
+      continue;
+    }
+    recorded_io_ns += s.recorded_ns;
+    double mib = s.bytes / (1024.0 * 1024.0);
+    double replayed_ms = s.replayed_ns / 1e6;
+    printf("%-8s %10" PRIu64 " %12.1f %12.1f %12.1f %10.1f\n", kOpNames[op], s.count, mib,
+           s.recorded_ns / 1e6, replayed_ms,
+           s.replayed_ns > 0 && op != BlockIoRecord::kFsync ? mib / (s.replayed_ns / 1e9) : 0.0);
+  }
+  printf("the update took %.1f ms, %.1f ms of it in the traced I/O; the replay took %.1f ms\n",
+         recorded_end_ns / 1e6, recorded_io_ns / 1e6, replay_ns / 1e6);
+  return 0;
+}
@@ -17,8 +17,24 @@
 #ifndef _UPDATER_BLOCKIMG_H_
 #define _UPDATER_BLOCKIMG_H_
 
+#include <stddef.h>
+
 #include <string>
 
+// Overrides of the tuning properties of block_image_update(), for the tools that run updates
+// outside of an install (e.g. update_simulator). The zero values keep the properties.
+struct BlockImageTuning {
+  // The parallel workers to execute the commands on, instead of one per CPU (up to 8).
+  size_t max_workers = 0;
+  // Instead of ro.updater.stash_memory_limit.
+  size_t stash_memory_limit = 0;
+  // Instead of ro.updater.new_data_buffer_size.
+  size_t new_data_buffer_size = 0;
+};
+
+// Applies to the block_image_update() calls that start afterwards.
+void SetBlockImageTuning(const BlockImageTuning& tuning);
+
 void RegisterBlockImageFunctions();
 
 #endif
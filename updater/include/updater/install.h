@@ -17,10 +17,22 @@
 #ifndef _UPDATER_INSTALL_H_
 #define _UPDATER_INSTALL_H_
 
+#include <string>
+
+#include <ziparchive/zip_archive.h>
+
 struct State;
 
 void RegisterInstallFunctions();
 
+// Looks up the entry |name| in the update package, through the package index if there's one.
+bool FindPackageEntry(State* _Nonnull state, const std::string& name, ZipEntry* _Nonnull entry);
+
+// Waits for the trees that delete_recursive() is deleting in the background, and returns whether
+// there were any. Everything that needs their space back, or the filesystem to itself, calls this
+// first.
+bool WaitForPendingDeletes();
+
 // uiPrintf function prints msg to screen as well as logs
 void uiPrintf(State* _Nonnull state, const char* _Nonnull format, ...)
     __attribute__((__format__(printf, 2, 3)));
@@ -20,14 +20,32 @@
 #include <stdio.h>
 #include <ziparchive/zip_archive.h>
 
-typedef struct {
+#include <map>
+#include <memory>
+#include <string>
+
+class MemMapping;
+class ZipIndex;
+
+struct UpdaterInfo {
     FILE* cmd_pipe;
     ZipArchiveHandle package_zip;
     int version;
 
-    uint8_t* package_zip_addr;
-    size_t package_zip_len;
-} UpdaterInfo;
+    uint8_t* package_zip_addr = nullptr;
+    size_t package_zip_len = 0;
+    // The mapping behind package_zip_addr, for values that refer into it to hold on to.
+    std::shared_ptr<MemMapping> package_map;
+
+    // The sorted entries of package_zip, built once per session. Lookups fall back to the
+    // archive itself when it's not set.
+    const ZipIndex* package_index = nullptr;
+
+    // The SHA-1s (as 20 bytes) of the package entries listed in its entry SHA-1 manifest, which
+    // sha1_check() loads the first time it's given a package entry.
+    bool entry_sha1s_loaded = false;
+    std::map<std::string, std::string> entry_sha1s;
+};
 
 struct selabel_handle;
 extern struct selabel_handle *sehandle;
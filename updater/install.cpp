@@ -18,9 +18,9 @@
 
 #include <blkid/blkid.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <ftw.h>
 #include <inttypes.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -36,8 +36,14 @@
 #include <unistd.h>
 #include <utime.h>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
@@ -47,6 +53,7 @@
 #include <android-base/properties.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 #include <applypatch/applypatch.h>
 #include <bootloader_message/bootloader_message.h>
 #include <cutils/android_reboot.h>
@@ -63,6 +70,8 @@
 #include "otautil/DirUtil.h"
 #include "otautil/error_code.h"
 #include "otautil/print_sha1.h"
+#include "otautil/sparse_image.h"
+#include "otautil/SysUtil.h"
 #include "otautil/ZipUtil.h"
 #include "tune2fs.h"
 #include "updater/updater.h"
@@ -163,11 +172,261 @@ Value* PackageExtractDirFn(const char* name, State* state,
   // To create a consistent system image, never use the clock for timestamps.
   constexpr struct utimbuf timestamp = { 1217592000, 1217592000 };  // 8/1/2008 default
 
-  bool success = ExtractPackageRecursive(za, zip_path, dest_path, &timestamp, sehandle);
+  // Inflate the entries on a few threads, unless the device opts out.
+  size_t jobs = 1;
+  if (android::base::GetBoolProperty("ro.updater.parallel_extract_dir", true)) {
+    jobs = std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1U), 4);
+  }
+
+  const ZipIndex* index = static_cast<UpdaterInfo*>(state->cookie)->package_index;
+  bool success =
+      ExtractPackageRecursive(za, zip_path, dest_path, &timestamp, sehandle, jobs, index);
+  // The space of the trees still being deleted may be what it ran out of.
+  if (!success && WaitForPendingDeletes()) {
+    LOG(INFO) << name << ": retrying after the pending deletes";
+    success = ExtractPackageRecursive(za, zip_path, dest_path, &timestamp, sehandle, jobs, index);
+  }
 
   return StringValue(success ? "t" : "");
 }
 
+bool FindPackageEntry(State* state, const std::string& name, ZipEntry* entry) {
+  UpdaterInfo* ui = static_cast<UpdaterInfo*>(state->cookie);
+  if (ui->package_index != nullptr) {
+    return ui->package_index->Find(name, entry);
+  }
+  ZipString zip_string_name(name.c_str());
+  return FindEntry(ui->package_zip, zip_string_name, entry) == 0;
+}
+
+// Starts reading the data of |entry| in ahead of its extraction.
+static void PrefetchEntry(State* state, const ZipEntry& entry) {
+  UpdaterInfo* ui = static_cast<UpdaterInfo*>(state->cookie);
+  if (ui->package_zip_addr != nullptr &&
+      entry.offset + entry.compressed_length <= ui->package_zip_len) {
+    AdviseMappedRange(ui->package_zip_addr + entry.offset, entry.compressed_length,
+                      MemAccess::WILLNEED);
+  }
+}
+
+// The chunks that package_extract_file() streams to block devices in, how many of them can be in
+// flight between the inflating and the writing thread, and how often the written data is synced.
+static constexpr size_t kStreamChunkSize = 1024 * 1024;
+static constexpr size_t kStreamChunks = 4;
+static constexpr off64_t kStreamSyncInterval = 16 * 1024 * 1024;
+// The alignment of the offsets, sizes and buffers for O_DIRECT writes.
+static constexpr size_t kStreamAlignment = 4096;
+
+// The chunks passed from the thread that inflates a package entry to the one that writes it.
+struct StreamChunks {
+  static constexpr size_t kNone = static_cast<size_t>(-1);
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<std::unique_ptr<uint8_t, decltype(&free)>> buffers;
+  // The buffers that are ready to be written (with the bytes in them), and the ones to fill next.
+  std::deque<std::pair<size_t, size_t>> filled;
+  std::vector<size_t> empty;
+  // Whether the inflating is over (with |error| set if it failed), or the writing failed.
+  bool done = false;
+  int32_t error = 0;
+  bool failed = false;
+
+  // The buffer being filled by the inflating thread.
+  size_t current = kNone;
+  size_t used = 0;
+
+  // Hands the current buffer over to the writing thread.
+  void Push() {
+    std::lock_guard<std::mutex> lock(mutex);
+    filled.emplace_back(current, used);
+    current = kNone;
+    used = 0;
+    cv.notify_all();
+  }
+};
+
+static bool ReceiveStreamChunk(const uint8_t* data, size_t size, void* cookie) {
+  StreamChunks* chunks = static_cast<StreamChunks*>(cookie);
+  while (size > 0) {
+    if (chunks->current == StreamChunks::kNone) {
+      std::unique_lock<std::mutex> lock(chunks->mutex);
+      chunks->cv.wait(lock, [chunks] { return !chunks->empty.empty() || chunks->failed; });
+      if (chunks->failed) {
+        return false;
+      }
+      chunks->current = chunks->empty.back();
+      chunks->empty.pop_back();
+    }
+    size_t n = std::min(size, kStreamChunkSize - chunks->used);
+    memcpy(chunks->buffers[chunks->current].get() + chunks->used, data, n);
+    chunks->used += n;
+    data += n;
+    size -= n;
+    if (chunks->used == kStreamChunkSize) {
+      chunks->Push();
+    }
+  }
+  return true;
+}
+
+static bool WriteFullyAt(int fd, const uint8_t* data, size_t size, off64_t offset) {
+  while (size > 0) {
+    ssize_t written = TEMP_FAILURE_RETRY(ota_pwrite(fd, data, size, offset));
+    if (written <= 0) {
+      return false;
+    }
+    data += written;
+    size -= written;
+    offset += written;
+  }
+  return true;
+}
+
+// Extracts |entry| to the block device |dest_path|. The entry is inflated on another thread in
+// chunks, which are written as they come, bypassing the page cache if ro.updater.direct_io is set.
+// Otherwise the written ranges are synced as it goes, so that the final fsync doesn't stall on
+// hundreds of MiB of dirty pages. With |expand_sparse|, the entry must be an Android sparse image,
+// which is expanded onto |dest_path| instead (see SparseImageStream), and the size of the expanded
+// image goes to |expanded_size|; its chunks land anywhere in the output, so it always uses the page
+// cache.
+static bool StreamEntryToBlockDevice(const char* name, ZipArchiveHandle za, ZipEntry* entry,
+                                     const std::string& dest_path, bool expand_sparse = false,
+                                     uint64_t* expanded_size = nullptr) {
+  unique_fd fd(TEMP_FAILURE_RETRY(ota_open(dest_path.c_str(), O_WRONLY)));
+  if (fd == -1) {
+    PLOG(ERROR) << name << ": can't open " << dest_path << " for write";
+    return false;
+  }
+  unique_fd direct_fd;
+  if (!expand_sparse && android::base::GetBoolProperty("ro.updater.direct_io", false)) {
+    direct_fd.reset(TEMP_FAILURE_RETRY(ota_open(dest_path.c_str(), O_WRONLY | O_DIRECT)));
+    if (direct_fd == -1) {
+      PLOG(WARNING) << "Failed to open " << dest_path << " with O_DIRECT";
+    }
+  }
+
+  StreamChunks chunks;
+  for (size_t i = 0; i < kStreamChunks; i++) {
+    void* buffer = nullptr;
+    if (posix_memalign(&buffer, kStreamAlignment, kStreamChunkSize) != 0) {
+      LOG(ERROR) << name << ": failed to allocate " << kStreamChunkSize << " bytes";
+      return false;
+    }
+    chunks.buffers.emplace_back(static_cast<uint8_t*>(buffer), free);
+    chunks.empty.push_back(i);
+  }
+
+  std::thread inflater([&chunks, za, entry]() {
+    int32_t ret = ProcessZipEntryContents(za, entry, ReceiveStreamChunk, &chunks);
+    if (ret == 0 && chunks.used > 0) {
+      chunks.Push();
+    }
+    std::lock_guard<std::mutex> lock(chunks.mutex);
+    chunks.done = true;
+    chunks.error = ret;
+    chunks.cv.notify_all();
+  });
+
+  bool success = true;
+  off64_t offset = 0;
+  off64_t synced = 0;
+  off64_t prev_synced = 0;
+  std::unique_ptr<SparseImageStream> sparse;
+  if (expand_sparse) {
+    sparse = std::make_unique<SparseImageStream>(fd, SparseImageStream::Mode::kWrite);
+  }
+  while (true) {
+    std::pair<size_t, size_t> chunk;
+    {
+      std::unique_lock<std::mutex> lock(chunks.mutex);
+      chunks.cv.wait(lock, [&chunks] { return !chunks.filled.empty() || chunks.done; });
+      if (chunks.filled.empty()) {
+        break;
+      }
+      chunk = chunks.filled.front();
+      chunks.filled.pop_front();
+    }
+
+    const uint8_t* data = chunks.buffers[chunk.first].get();
+    if (sparse) {
+      if (offset == 0 && !IsSparseImage(data, chunk.second)) {
+        LOG(ERROR) << name << ": " << entry->uncompressed_length << " bytes to " << dest_path
+                   << " are not a sparse image";
+        success = false;
+      } else if (!sparse->Write(data, chunk.second)) {
+        LOG(ERROR) << name << ": failed to expand the sparse image to " << dest_path;
+        success = false;
+      }
+      offset += chunk.second;
+      // Start the writeback of everything written since the last time.
+      if (static_cast<off64_t>(sparse->bytes_written()) - synced >= kStreamSyncInterval) {
+        sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        synced = sparse->bytes_written();
+      }
+    } else {
+      // Only the tail of a size that's not a multiple of the alignment goes through the page
+      // cache.
+      bool direct = direct_fd != -1 && chunk.second % kStreamAlignment == 0;
+      if (!WriteFullyAt(direct ? direct_fd.get() : fd.get(), data, chunk.second, offset)) {
+        PLOG(ERROR) << name << ": failed to write " << dest_path << " at " << offset;
+        success = false;
+      }
+      offset += chunk.second;
+      // Start the writeback of the latest range, and wait for that of the one before it.
+      if (!direct && offset - synced >= kStreamSyncInterval) {
+        sync_file_range(fd, synced, offset - synced, SYNC_FILE_RANGE_WRITE);
+        if (synced > prev_synced) {
+          sync_file_range(fd, prev_synced, synced - prev_synced,
+                          SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                              SYNC_FILE_RANGE_WAIT_AFTER);
+        }
+        prev_synced = synced;
+        synced = offset;
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(chunks.mutex);
+    chunks.empty.push_back(chunk.first);
+    if (!success) {
+      chunks.failed = true;
+    }
+    chunks.cv.notify_all();
+    if (!success) {
+      break;
+    }
+  }
+  inflater.join();
+
+  if (success && chunks.error != 0) {
+    LOG(ERROR) << name << ": failed to extract entry (" << entry->uncompressed_length
+               << " bytes) to \"" << dest_path << "\": " << ErrorCodeString(chunks.error);
+    success = false;
+  }
+  if (success && sparse) {
+    success = sparse->Finish();
+    LOG(INFO) << name << ": wrote " << sparse->bytes_written() << " of the " << sparse->size()
+              << " bytes of the sparse image (" << sparse->bytes_zeroed() << " zeroed out)";
+    if (expanded_size != nullptr) {
+      *expanded_size = sparse->size();
+    }
+  }
+  // The O_DIRECT writes are done by now, and the fsync below flushes the device for both fds.
+  if (direct_fd != -1 && ota_close(direct_fd) == -1) {
+    PLOG(ERROR) << "close of \"" << dest_path << "\" (O_DIRECT) failed";
+    success = false;
+  }
+  if (ota_fsync(fd) == -1) {
+    PLOG(ERROR) << "fsync of \"" << dest_path << "\" failed";
+    success = false;
+  }
+  if (ota_close(fd) == -1) {
+    PLOG(ERROR) << "close of \"" << dest_path << "\" failed";
+    success = false;
+  }
+  return success;
+}
+
 // package_extract_file(package_file[, dest_file])
 //   Extracts a single package_file from the update package and writes it to dest_file,
 //   overwriting existing files if necessary. Without the dest_file argument, returns the
@@ -191,12 +450,19 @@ Value* PackageExtractFileFn(const char* name, State* state,
     const std::string& dest_path = args[1];
 
     ZipArchiveHandle za = static_cast<UpdaterInfo*>(state->cookie)->package_zip;
-    ZipString zip_string_path(zip_path.c_str());
     ZipEntry entry;
-    if (FindEntry(za, zip_string_path, &entry) != 0) {
+    if (!FindPackageEntry(state, zip_path, &entry)) {
       LOG(ERROR) << name << ": no " << zip_path << " in package";
       return StringValue("");
     }
+    PrefetchEntry(state, entry);
+
+    // Large images for raw partitions are streamed to them.
+    struct stat sb;
+    if (entry.uncompressed_length >= kStreamChunkSize && stat(dest_path.c_str(), &sb) == 0 &&
+        S_ISBLK(sb.st_mode)) {
+      return StringValue(StreamEntryToBlockDevice(name, za, &entry, dest_path) ? "t" : "");
+    }
 
     unique_fd fd(TEMP_FAILURE_RETRY(
         ota_open(dest_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)));
@@ -207,6 +473,12 @@ Value* PackageExtractFileFn(const char* name, State* state,
 
     bool success = true;
     int32_t ret = ExtractEntryToFile(za, &entry, fd);
+    // The space of the trees still being deleted may be what it ran out of.
+    if (ret != 0 && WaitForPendingDeletes() && ftruncate(fd, 0) == 0 &&
+        lseek(fd, 0, SEEK_SET) == 0) {
+      LOG(INFO) << name << ": retrying after the pending deletes";
+      ret = ExtractEntryToFile(za, &entry, fd);
+    }
     if (ret != 0) {
       LOG(ERROR) << name << ": Failed to extract entry \"" << zip_path << "\" ("
                  << entry.uncompressed_length << " bytes) to \"" << dest_path
@@ -234,12 +506,22 @@ Value* PackageExtractFileFn(const char* name, State* state,
     const std::string& zip_path = args[0];
 
     ZipArchiveHandle za = static_cast<UpdaterInfo*>(state->cookie)->package_zip;
-    ZipString zip_string_path(zip_path.c_str());
     ZipEntry entry;
-    if (FindEntry(za, zip_string_path, &entry) != 0) {
+    if (!FindPackageEntry(state, zip_path, &entry)) {
       return ErrorAbort(state, kPackageExtractFileFailure, "%s(): no %s in package", name,
                         zip_path.c_str());
     }
+    PrefetchEntry(state, entry);
+
+    // A stored entry is already there in the mapped package, byte for byte; refer to it rather
+    // than copying what may be hundreds of MB of patch data. The package as a whole has been
+    // verified before the updater runs.
+    UpdaterInfo* ui = static_cast<UpdaterInfo*>(state->cookie);
+    if (entry.method == kCompressStored && ui->package_zip_addr != nullptr &&
+        static_cast<uint64_t>(entry.offset) + entry.uncompressed_length <= ui->package_zip_len) {
+      return new Value(ui->package_zip_addr + entry.offset, entry.uncompressed_length,
+                       ui->package_map);
+    }
 
     std::string buffer;
     buffer.resize(entry.uncompressed_length);
@@ -256,12 +538,103 @@ Value* PackageExtractFileFn(const char* name, State* state,
   }
 }
 
+// Puts the SHA-1 of the first |size| bytes of |path| into |digest|.
+static bool Sha1OfFilePrefix(const std::string& path, uint64_t size, uint8_t* digest) {
+  unique_fd fd(TEMP_FAILURE_RETRY(ota_open(path.c_str(), O_RDONLY)));
+  if (fd == -1) {
+    PLOG(ERROR) << "Failed to open " << path << " for read";
+    return false;
+  }
+  // Read what's on the device, not what's left in the page cache.
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  std::vector<uint8_t> buffer(kStreamChunkSize);
+  SHA_CTX ctx;
+  SHA1_Init(&ctx);
+  while (size > 0) {
+    size_t n = std::min(static_cast<uint64_t>(buffer.size()), size);
+    if (!android::base::ReadFully(fd, buffer.data(), n)) {
+      PLOG(ERROR) << "Failed to read " << path;
+      return false;
+    }
+    SHA1_Update(&ctx, buffer.data(), n);
+    size -= n;
+  }
+  SHA1_Final(digest, &ctx);
+  return true;
+}
+
+// package_extract_sparse_image(package_file, dest_file[, expanded_size, expanded_sha1])
+//   Expands the Android sparse image package_file onto dest_file, which must exist (a block device,
+//   or a file that gets extended to the size of the expanded image). package_extract_file() writes
+//   the bytes of an entry as they are; this is the only function that expands them. If given,
+//   expanded_size and expanded_sha1 are checked against the expanded image, as read back from
+//   dest_file (so the blocks that the image leaves as they are count too). Returns "t" on success,
+//   or "" on failure.
+Value* PackageExtractSparseImageFn(const char* name, State* state,
+                                   const std::vector<std::unique_ptr<Expr>>& argv) {
+  if (argv.size() != 2 && argv.size() != 4) {
+    return ErrorAbort(state, kArgsParsingFailure, "%s() expects 2 or 4 args, got %zu", name,
+                      argv.size());
+  }
+
+  std::vector<std::string> args;
+  if (!ReadArgs(state, argv, &args)) {
+    return ErrorAbort(state, kArgsParsingFailure, "%s() Failed to parse %zu args", name,
+                      argv.size());
+  }
+  const std::string& zip_path = args[0];
+  const std::string& dest_path = args[1];
+
+  uint64_t expected_size = 0;
+  uint8_t expected_digest[SHA_DIGEST_LENGTH];
+  if (argv.size() == 4) {
+    if (!android::base::ParseUint(args[2].c_str(), &expected_size)) {
+      return ErrorAbort(state, kArgsParsingFailure, "%s(): failed to parse \"%s\" as a size",
+                        name, args[2].c_str());
+    }
+    if (ParseSha1(args[3].c_str(), expected_digest) != 0) {
+      return ErrorAbort(state, kArgsParsingFailure, "%s(): failed to parse \"%s\" as sha-1",
+                        name, args[3].c_str());
+    }
+  }
+
+  ZipArchiveHandle za = static_cast<UpdaterInfo*>(state->cookie)->package_zip;
+  ZipEntry entry;
+  if (!FindPackageEntry(state, zip_path, &entry)) {
+    LOG(ERROR) << name << ": no " << zip_path << " in package";
+    return StringValue("");
+  }
+  PrefetchEntry(state, entry);
+
+  uint64_t expanded_size = 0;
+  if (!StreamEntryToBlockDevice(name, za, &entry, dest_path, true, &expanded_size)) {
+    return StringValue("");
+  }
+  if (argv.size() == 4) {
+    if (expanded_size != expected_size) {
+      LOG(ERROR) << name << ": " << zip_path << " expands to " << expanded_size
+                 << " bytes; expected " << expected_size;
+      return StringValue("");
+    }
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    if (!Sha1OfFilePrefix(dest_path, expanded_size, digest)) {
+      return StringValue("");
+    }
+    if (memcmp(digest, expected_digest, SHA_DIGEST_LENGTH) != 0) {
+      LOG(ERROR) << name << ": " << dest_path << " has SHA-1 " << print_sha1(digest)
+                 << " after expanding " << zip_path << "; expected " << args[3];
+      return StringValue("");
+    }
+  }
+  return StringValue("t");
+}
+
 // apply_patch(src_file, tgt_file, tgt_sha1, tgt_size, patch1_sha1, patch1_blob, [...])
 //   Applies a binary patch to the src_file to produce the tgt_file. If the desired target is the
 //   same as the source, pass "-" for tgt_file. tgt_sha1 and tgt_size are the expected final SHA1
 //   hash and size of the target file. The remaining arguments must come in pairs: a SHA1 hash (a
 //   40-character hex string) and a blob. The blob is the patch to be applied when the source
-//   file's current contents have the given SHA1.
+//   file's current contents have the given SHA1. Only the blob that gets applied is evaluated.
 //
 //   The patching is done in a safe manner that guarantees the target file either has the desired
 //   SHA1 hash and size, or it is untouched -- it will not be left in an unrecoverable intermediate
@@ -292,30 +665,46 @@ Value* ApplyPatchFn(const char* name, State* state,
                       target_size_str.c_str());
   }
 
+  // Only the SHA-1s are read up front; the patch blobs are evaluated when applypatch() asks for the
+  // one matching the source, so the others never get extracted from the package.
   int patchcount = (argv.size() - 4) / 2;
-  std::vector<std::unique_ptr<Value>> arg_values;
-  if (!ReadValueArgs(state, argv, &arg_values, 4, argv.size() - 4)) {
-    return nullptr;
-  }
-
+  LazyArgs arg_values(state, argv);
+  std::vector<std::string> patch_sha_str;
   for (int i = 0; i < patchcount; ++i) {
-    if (arg_values[i * 2]->type != VAL_STRING) {
-      return ErrorAbort(state, kArgsParsingFailure, "%s(): sha-1 #%d is not string", name, i * 2);
+    const Value* sha1 = arg_values.Get(4 + i * 2);
+    if (sha1 == nullptr) {
+      return nullptr;
     }
-    if (arg_values[i * 2 + 1]->type != VAL_BLOB) {
-      return ErrorAbort(state, kArgsParsingFailure, "%s(): patch #%d is not blob", name, i * 2 + 1);
+    if (sha1->type != VAL_STRING) {
+      return ErrorAbort(state, kArgsParsingFailure, "%s(): sha-1 #%d is not string", name, i * 2);
     }
+    patch_sha_str.push_back(sha1->data);
   }
 
-  std::vector<std::string> patch_sha_str;
-  std::vector<std::unique_ptr<Value>> patches;
-  for (int i = 0; i < patchcount; ++i) {
-    patch_sha_str.push_back(arg_values[i * 2]->data);
-    patches.push_back(std::move(arg_values[i * 2 + 1]));
-  }
+  bool patch_failed = false;
+  auto load_patch = [&](size_t i) -> const Value* {
+    const Value* patch = arg_values.Get(4 + i * 2 + 1);
+    if (patch == nullptr) {
+      patch_failed = true;
+      return nullptr;
+    }
+    if (patch->type != VAL_BLOB) {
+      ErrorAbort(state, kArgsParsingFailure, "%s(): patch #%zu is not blob", name, i * 2 + 1);
+      patch_failed = true;
+      return nullptr;
+    }
+    return patch;
+  };
 
+  // All the patches in place back up their source to the same file on /cache, so they can't run
+  // concurrently in the branches of parallel().
+  static std::mutex applypatch_mutex;
+  std::lock_guard<std::mutex> lock(applypatch_mutex);
   int result = applypatch(source_filename.c_str(), target_filename.c_str(), target_sha1.c_str(),
-                          target_size, patch_sha_str, patches, nullptr);
+                          target_size, patch_sha_str, load_patch, nullptr);
+  if (patch_failed) {
+    return nullptr;
+  }
 
   return StringValue(result == 0 ? "t" : "");
 }
@@ -348,6 +737,80 @@ Value* ApplyPatchCheckFn(const char* name, State* state,
   return StringValue(result == 0 ? "t" : "");
 }
 
+// The SHA-1s of package entries, as "<sha1> <entry name>" lines, that sha1_check() takes rather
+// than hashing the entries themselves. Like the script, it's covered by the signature of the whole
+// package, which has been verified before the updater runs.
+static constexpr const char* kEntrySha1Manifest = "META-INF/com/android/entry_sha1s";
+
+// Loads kEntrySha1Manifest into |ui|, once. A package doesn't need to have one.
+static void LoadEntrySha1s(State* state, UpdaterInfo* ui) {
+  if (ui->entry_sha1s_loaded) {
+    return;
+  }
+  ui->entry_sha1s_loaded = true;
+  ZipEntry entry;
+  if (!FindPackageEntry(state, kEntrySha1Manifest, &entry)) {
+    return;
+  }
+  std::string manifest(entry.uncompressed_length, '\0');
+  int32_t ret = ExtractToMemory(ui->package_zip, &entry, reinterpret_cast<uint8_t*>(&manifest[0]),
+                                manifest.size());
+  if (ret != 0) {
+    LOG(WARNING) << "Failed to extract " << kEntrySha1Manifest << ": " << ErrorCodeString(ret);
+    return;
+  }
+  for (const auto& line : android::base::Split(manifest, "\n")) {
+    size_t space = line.find(' ');
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    if (space == std::string::npos || space + 1 == line.size() ||
+        ParseSha1(line.substr(0, space).c_str(), digest) != 0) {
+      if (!line.empty()) {
+        LOG(WARNING) << "Invalid line in " << kEntrySha1Manifest << ": \"" << line << "\"";
+      }
+      continue;
+    }
+    ui->entry_sha1s[line.substr(space + 1)] =
+        std::string(reinterpret_cast<const char*>(digest), sizeof(digest));
+  }
+  LOG(INFO) << "Loaded the SHA-1s of " << ui->entry_sha1s.size() << " package entries";
+}
+
+static bool UpdateEntrySha1(const uint8_t* data, size_t size, void* cookie) {
+  SHA1_Update(static_cast<SHA_CTX*>(cookie), data, size);
+  return true;
+}
+
+// Puts the SHA-1 of the package entry |zip_path| into |digest|: from kEntrySha1Manifest if it's
+// listed there, or else by hashing the entry as it's inflated. Aborts the evaluation, as
+// package_extract_file() does, if there's no such entry.
+static bool PackageEntrySha1(State* state, const std::string& zip_path, uint8_t* digest) {
+  UpdaterInfo* ui = static_cast<UpdaterInfo*>(state->cookie);
+  LoadEntrySha1s(state, ui);
+  auto it = ui->entry_sha1s.find(zip_path);
+  if (it != ui->entry_sha1s.end()) {
+    memcpy(digest, it->second.data(), SHA_DIGEST_LENGTH);
+    return true;
+  }
+
+  ZipEntry entry;
+  if (!FindPackageEntry(state, zip_path, &entry)) {
+    ErrorAbort(state, kPackageExtractFileFailure, "package_extract_file(): no %s in package",
+               zip_path.c_str());
+    return false;
+  }
+  PrefetchEntry(state, entry);
+  SHA_CTX ctx;
+  SHA1_Init(&ctx);
+  int32_t ret = ProcessZipEntryContents(ui->package_zip, &entry, UpdateEntrySha1, &ctx);
+  if (ret != 0) {
+    ErrorAbort(state, kPackageExtractFileFailure, "Failed to hash entry \"%s\" (%u bytes): %s",
+               zip_path.c_str(), entry.uncompressed_length, ErrorCodeString(ret));
+    return false;
+  }
+  SHA1_Final(digest, &ctx);
+  return true;
+}
+
 // sha1_check(data)
 //    to return the sha1 of the data (given in the format returned by
 //    read_file).
@@ -356,21 +819,35 @@ Value* ApplyPatchCheckFn(const char* name, State* state,
 //    returns the sha1 of the file if it matches any of the hex
 //    strings passed, or "" if it does not equal any of them.
 //
+// When the data is package_extract_file(package_file), the entry isn't extracted into memory; its
+// SHA-1 comes from the entry SHA-1 manifest of the package, or from hashing it as it's inflated.
 Value* Sha1CheckFn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv) {
   if (argv.size() < 1) {
     return ErrorAbort(state, kArgsParsingFailure, "%s() expects at least 1 arg", name);
   }
 
   std::vector<std::unique_ptr<Value>> args;
-  if (!ReadValueArgs(state, argv, &args)) {
-    return nullptr;
-  }
-
-  if (args[0]->type == VAL_INVALID) {
-    return StringValue("");
-  }
   uint8_t digest[SHA_DIGEST_LENGTH];
-  SHA1(reinterpret_cast<const uint8_t*>(args[0]->data.c_str()), args[0]->data.size(), digest);
+  const Expr& data = *argv[0];
+  if (data.fn == PackageExtractFileFn && data.argv.size() == 1) {
+    std::string zip_path;
+    if (!Evaluate(state, data.argv[0], &zip_path) || !PackageEntrySha1(state, zip_path, digest)) {
+      return nullptr;
+    }
+    if (argv.size() > 1 && !ReadValueArgs(state, argv, &args, 1, argv.size() - 1)) {
+      return nullptr;
+    }
+    // Keeps the indices of the sha1_hex args.
+    args.insert(args.begin(), nullptr);
+  } else {
+    if (!ReadValueArgs(state, argv, &args)) {
+      return nullptr;
+    }
+    if (args[0]->type == VAL_INVALID) {
+      return StringValue("");
+    }
+    SHA1(reinterpret_cast<const uint8_t*>(args[0]->bytes()), args[0]->size(), digest);
+  }
 
   if (argv.size() == 1) {
     return StringValue(print_sha1(digest));
@@ -510,6 +987,8 @@ Value* UnmountFn(const char* name, State* state, const std::vector<std::unique_p
                       "mount_point argument to unmount() can't be empty");
   }
 
+  // A tree deleted in the background would keep the volume busy.
+  WaitForPendingDeletes();
   scan_mounted_volumes();
   MountedVolume* vol = find_mounted_volume_by_mount_point(mount_point.c_str());
   if (vol == nullptr) {
@@ -563,6 +1042,8 @@ Value* FormatFn(const char* name, State* state, const std::vector<std::unique_pt
   const std::string& fs_size = args[3];
   const std::string& mount_point = args[4];
 
+  WaitForPendingDeletes();
+
   if (fs_type.empty()) {
     return ErrorAbort(state, kArgsParsingFailure, "fs_type argument to %s() can't be empty", name);
   }
@@ -670,12 +1151,18 @@ Value* RenameFn(const char* name, State* state, const std::vector<std::unique_pt
   if (dst_name.empty()) {
     return ErrorAbort(state, kArgsParsingFailure, "dst_name argument to %s() can't be empty", name);
   }
+  // Try the rename first; only when that fails, look into why (and create the parents of dst_name).
+  if (rename(src_name.c_str(), dst_name.c_str()) == 0) {
+    return StringValue(dst_name);
+  }
+  if (errno == ENOENT && access(src_name.c_str(), F_OK) != 0 &&
+      access(dst_name.c_str(), F_OK) == 0) {
+    // File was already moved
+    return StringValue(dst_name);
+  }
   if (!make_parents(dst_name)) {
     return ErrorAbort(state, kFileRenameFailure, "Creating parent of %s failed, error %s",
                       dst_name.c_str(), strerror(errno));
-  } else if (access(dst_name.c_str(), F_OK) == 0 && access(src_name.c_str(), F_OK) != 0) {
-    // File was already moved
-    return StringValue(dst_name);
   } else if (rename(src_name.c_str(), dst_name.c_str()) != 0) {
     return ErrorAbort(state, kFileRenameFailure, "Rename of %s to %s failed, error %s",
                       src_name.c_str(), dst_name.c_str(), strerror(errno));
@@ -684,14 +1171,103 @@ Value* RenameFn(const char* name, State* state, const std::vector<std::unique_pt
   return StringValue(dst_name);
 }
 
+// The trees that delete_recursive() is deleting in the background.
+static std::mutex pending_deletes_mutex;
+static std::vector<std::thread> pending_deletes;
+
+// The threads that remove the subtrees of a directory given to delete_recursive() in parallel.
+static constexpr size_t kDeleteJobs = 4;
+
+// Returns the prefix of the hidden names that the directory |path| is moved aside to.
+static std::string DeletingPrefix(const std::string& path) {
+  return android::base::Dirname(path) + "/." + android::base::Basename(path) + ".deleting.";
+}
+
+// Deletes the directory |path| on another thread.
+static void QueueDelete(const std::string& path) {
+  std::lock_guard<std::mutex> lock(pending_deletes_mutex);
+  pending_deletes.emplace_back([path]() {
+    if (dirUnlinkHierarchy(path.c_str(), kDeleteJobs) != 0) {
+      PLOG(ERROR) << "failed to delete " << path;
+    }
+  });
+}
+
+// Moves the directory |path| aside to a hidden name next to it, and deletes it from there on
+// another thread. The path is free for reuse as soon as this returns. Returns false if |path|
+// isn't a directory or can't be moved, for the caller to delete it in place.
+static bool DeleteInBackground(const std::string& path) {
+  static std::atomic<unsigned> counter(0);
+  struct stat sb;
+  if (lstat(path.c_str(), &sb) != 0 || !S_ISDIR(sb.st_mode)) {
+    return false;
+  }
+  std::string moved =
+      DeletingPrefix(path) + std::to_string(getpid()) + "." + std::to_string(counter++);
+  if (rename(path.c_str(), moved.c_str()) != 0) {
+    return false;
+  }
+  QueueDelete(moved);
+  return true;
+}
+
+// Deletes what an updater that was interrupted while deleting |path| in the background left next
+// to it, on another thread if |async| is true.
+static void SweepLeftoverDeletes(const std::string& path, bool async) {
+  std::string prefix = DeletingPrefix(path);
+  std::string dir_name = android::base::Dirname(path);
+  std::string name_prefix = prefix.substr(dir_name.size() + 1);
+  // The moved directories of this updater are already being deleted.
+  std::string own_prefix = name_prefix + std::to_string(getpid()) + ".";
+
+  std::vector<std::string> leftovers;
+  std::unique_ptr<DIR, decltype(&closedir)> dir(opendir(dir_name.c_str()), closedir);
+  if (!dir) {
+    return;
+  }
+  while (dirent* de = readdir(dir.get())) {
+    std::string name = de->d_name;
+    if (android::base::StartsWith(name, name_prefix.c_str()) &&
+        !android::base::StartsWith(name, own_prefix.c_str())) {
+      leftovers.push_back(dir_name + "/" + name);
+    }
+  }
+  dir.reset();
+
+  for (const auto& leftover : leftovers) {
+    LOG(INFO) << "deleting " << leftover << " left behind by an earlier update";
+    if (async) {
+      QueueDelete(leftover);
+    } else if (dirUnlinkHierarchy(leftover.c_str(), kDeleteJobs) != 0) {
+      PLOG(ERROR) << "failed to delete " << leftover;
+    }
+  }
+}
+
+bool WaitForPendingDeletes() {
+  std::vector<std::thread> threads;
+  {
+    std::lock_guard<std::mutex> lock(pending_deletes_mutex);
+    threads.swap(pending_deletes);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return !threads.empty();
+}
+
 // delete([filename, ...])
 //   Deletes all the filenames listed. Returns the number of files successfully deleted.
 //
 // delete_recursive([dirname, ...])
 //   Recursively deletes dirnames and all their contents. Returns the number of directories
 //   successfully deleted.
+//
+//   Devices that opt in with ro.updater.async_delete=true have the directories renamed out of the
+//   way and deleted in the background. See WaitForPendingDeletes(). What an interrupted update
+//   left behind that way is deleted along with them.
 Value* DeleteFn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv) {
-  std::vector<std::string> paths;
+  StringArgs paths;
   if (!ReadArgs(state, argv, &paths)) {
     return nullptr;
   }
@@ -699,8 +1275,35 @@ Value* DeleteFn(const char* name, State* state, const std::vector<std::unique_pt
   bool recursive = (strcmp(name, "delete_recursive") == 0);
 
   int success = 0;
-  for (const auto& path : paths) {
-    if ((recursive ? dirUnlinkHierarchy(path.c_str()) : unlink(path.c_str())) == 0) {
+  if (recursive) {
+    bool async = android::base::GetBoolProperty("ro.updater.async_delete", false);
+    for (size_t i = 0; i < paths.size(); ++i) {
+      SweepLeftoverDeletes(paths[i], async);
+      if ((async && DeleteInBackground(paths[i])) ||
+          dirUnlinkHierarchy(paths[i].c_str(), kDeleteJobs) == 0) {
+        ++success;
+      }
+    }
+    return StringValue(std::to_string(success));
+  }
+
+  // Scripts list the files of a directory together, so unlink them relative to the fd of their
+  // directory rather than resolving each path from the root.
+  std::string dir_path;
+  android::base::unique_fd dir;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    const std::string& path = paths[i];
+    size_t slash = path.rfind('/');
+    if (slash == std::string::npos) {
+      success += unlink(path.c_str()) == 0;
+      continue;
+    }
+    std::string parent = slash == 0 ? "/" : path.substr(0, slash);
+    if (dir == -1 || parent != dir_path) {
+      dir.reset(open(parent.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+      dir_path = parent;
+    }
+    if (dir != -1 ? unlinkat(dir, path.c_str() + slash + 1, 0) == 0 : unlink(path.c_str()) == 0) {
       ++success;
     }
   }
@@ -759,7 +1362,7 @@ Value* SetProgressFn(const char* name, State* state,
   }
 
   UpdaterInfo* ui = static_cast<UpdaterInfo*>(state->cookie);
-  fprintf(ui->cmd_pipe, "set_progress %f\n", frac);
+  fprintf(ui->cmd_pipe, "set_progress %f\n", BranchProgress(state, frac));
 
   return StringValue(frac_str);
 }
@@ -818,10 +1421,11 @@ struct perm_parsed_args {
   const char* selabel;
   bool has_capabilities;
   uint64_t capabilities;
+  // The xattr for |capabilities|, which is the same for all the files.
+  struct vfs_cap_data cap_data;
 };
 
-static struct perm_parsed_args ParsePermArgs(State * state,
-                                             const std::vector<std::string>& args) {
+static struct perm_parsed_args ParsePermArgs(State * state, const StringArgs& args) {
   struct perm_parsed_args parsed;
   int bad = 0;
   static int max_warnings = 20;
@@ -889,6 +1493,9 @@ static struct perm_parsed_args ParsePermArgs(State * state,
       if (sscanf(args[i + 1].c_str(), "%" SCNi64, &capabilities) == 1) {
         parsed.capabilities = capabilities;
         parsed.has_capabilities = true;
+        parsed.cap_data.magic_etc = VFS_CAP_REVISION | VFS_CAP_FLAGS_EFFECTIVE;
+        parsed.cap_data.data[0].permitted = static_cast<uint32_t>(capabilities & 0xffffffff);
+        parsed.cap_data.data[1].permitted = static_cast<uint32_t>(capabilities >> 32);
       } else {
         uiPrintf(state, "ParsePermArgs: invalid capabilities \"%s\"\n", args[i + 1].c_str());
         bad++;
@@ -916,12 +1523,24 @@ static struct perm_parsed_args ParsePermArgs(State * state,
   return parsed;
 }
 
-static int ApplyParsedPerms(State* state, const char* filename, const struct stat* statptr,
-                            struct perm_parsed_args parsed) {
+// Applies |parsed| to |name| in the directory |dirfd| (or AT_FDCWD), which is a file of the given
+// |type|; |path| is its full path, for the messages. Regular files and directories are opened once
+// and changed through the fd, so their path isn't resolved over again for each change. The rest
+// (symlinks and device nodes, which shouldn't be opened) go by their name.
+static int ApplyParsedPerms(State* state, int dirfd, const char* name, const std::string& path,
+                            mode_t type, const struct perm_parsed_args& parsed) {
   int bad = 0;
+  const char* filename = path.c_str();
+
+  android::base::unique_fd fd;
+  if (S_ISREG(type) || S_ISDIR(type)) {
+    int flags = O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC | (S_ISDIR(type) ? O_DIRECTORY : 0);
+    fd.reset(openat(dirfd, name, flags));
+  }
 
   if (parsed.has_selabel) {
-    if (lsetfilecon(filename, parsed.selabel) != 0) {
+    int ret = fd != -1 ? fsetfilecon(fd, parsed.selabel) : lsetfilecon(filename, parsed.selabel);
+    if (ret != 0) {
       uiPrintf(state, "ApplyParsedPerms: lsetfilecon of %s to %s failed: %s\n", filename,
                parsed.selabel, strerror(errno));
       bad++;
@@ -929,67 +1548,55 @@ static int ApplyParsedPerms(State* state, const char* filename, const struct sta
   }
 
   /* ignore symlinks */
-  if (S_ISLNK(statptr->st_mode)) {
+  if (S_ISLNK(type)) {
     return bad;
   }
 
-  if (parsed.has_uid) {
-    if (chown(filename, parsed.uid, -1) < 0) {
-      uiPrintf(state, "ApplyParsedPerms: chown of %s to %d failed: %s\n", filename, parsed.uid,
-               strerror(errno));
-      bad++;
-    }
-  }
-
-  if (parsed.has_gid) {
-    if (chown(filename, -1, parsed.gid) < 0) {
-      uiPrintf(state, "ApplyParsedPerms: chgrp of %s to %d failed: %s\n", filename, parsed.gid,
-               strerror(errno));
-      bad++;
-    }
-  }
-
-  if (parsed.has_mode) {
-    if (chmod(filename, parsed.mode) < 0) {
-      uiPrintf(state, "ApplyParsedPerms: chmod of %s to %d failed: %s\n", filename, parsed.mode,
+  if (parsed.has_uid || parsed.has_gid) {
+    uid_t uid = parsed.has_uid ? parsed.uid : -1;
+    gid_t gid = parsed.has_gid ? parsed.gid : -1;
+    int ret = fd != -1 ? fchown(fd, uid, gid) : fchownat(dirfd, name, uid, gid, 0);
+    if (ret < 0) {
+      uiPrintf(state, "ApplyParsedPerms: chown of %s to %d:%d failed: %s\n", filename, uid, gid,
                strerror(errno));
       bad++;
     }
   }
 
-  if (parsed.has_dmode && S_ISDIR(statptr->st_mode)) {
-    if (chmod(filename, parsed.dmode) < 0) {
-      uiPrintf(state, "ApplyParsedPerms: chmod of %s to %d failed: %s\n", filename, parsed.dmode,
+  // "dmode" and "fmode" take precedence over "mode" for directories and regular files.
+  bool has_mode = parsed.has_mode;
+  mode_t mode = parsed.mode;
+  if (parsed.has_dmode && S_ISDIR(type)) {
+    has_mode = true;
+    mode = parsed.dmode;
+  } else if (parsed.has_fmode && S_ISREG(type)) {
+    has_mode = true;
+    mode = parsed.fmode;
+  }
+  if (has_mode) {
+    int ret = fd != -1 ? fchmod(fd, mode) : fchmodat(dirfd, name, mode, 0);
+    if (ret < 0) {
+      uiPrintf(state, "ApplyParsedPerms: chmod of %s to %d failed: %s\n", filename, mode,
                strerror(errno));
       bad++;
     }
   }
 
-  if (parsed.has_fmode && S_ISREG(statptr->st_mode)) {
-    if (chmod(filename, parsed.fmode) < 0) {
-      uiPrintf(state, "ApplyParsedPerms: chmod of %s to %d failed: %s\n", filename, parsed.fmode,
-               strerror(errno));
-      bad++;
-    }
-  }
-
-  if (parsed.has_capabilities && S_ISREG(statptr->st_mode)) {
+  if (parsed.has_capabilities && S_ISREG(type)) {
     if (parsed.capabilities == 0) {
-      if ((removexattr(filename, XATTR_NAME_CAPS) == -1) && (errno != ENODATA)) {
+      int ret =
+          fd != -1 ? fremovexattr(fd, XATTR_NAME_CAPS) : removexattr(filename, XATTR_NAME_CAPS);
+      if (ret == -1 && errno != ENODATA) {
         // Report failure unless it's ENODATA (attribute not set)
         uiPrintf(state, "ApplyParsedPerms: removexattr of %s to %" PRIx64 " failed: %s\n", filename,
                  parsed.capabilities, strerror(errno));
         bad++;
       }
     } else {
-      struct vfs_cap_data cap_data;
-      memset(&cap_data, 0, sizeof(cap_data));
-      cap_data.magic_etc = VFS_CAP_REVISION | VFS_CAP_FLAGS_EFFECTIVE;
-      cap_data.data[0].permitted = (uint32_t)(parsed.capabilities & 0xffffffff);
-      cap_data.data[0].inheritable = 0;
-      cap_data.data[1].permitted = (uint32_t)(parsed.capabilities >> 32);
-      cap_data.data[1].inheritable = 0;
-      if (setxattr(filename, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0) < 0) {
+      const struct vfs_cap_data& cap_data = parsed.cap_data;
+      int ret = fd != -1 ? fsetxattr(fd, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0)
+                         : setxattr(filename, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0);
+      if (ret < 0) {
         uiPrintf(state, "ApplyParsedPerms: setcap of %s to %" PRIx64 " failed: %s\n", filename,
                  parsed.capabilities, strerror(errno));
         bad++;
@@ -1000,14 +1607,123 @@ static int ApplyParsedPerms(State* state, const char* filename, const struct sta
   return bad;
 }
 
-// nftw doesn't allow us to pass along context, so we need to use
-// global variables.  *sigh*
-static struct perm_parsed_args recursive_parsed_args;
-static State* recursive_state;
+// The number of threads that set_metadata_recursive() spreads the subdirectories of the top one
+// over.
+static constexpr size_t kMetadataThreads = 4;
+
+// Returns the type of |entry| in the directory |dirfd|, or 0 if it can't be found out.
+static mode_t EntryType(int dirfd, const struct dirent* entry) {
+  switch (entry->d_type) {
+    case DT_REG: return S_IFREG;
+    case DT_DIR: return S_IFDIR;
+    case DT_LNK: return S_IFLNK;
+    case DT_CHR: return S_IFCHR;
+    case DT_BLK: return S_IFBLK;
+    case DT_FIFO: return S_IFIFO;
+    case DT_SOCK: return S_IFSOCK;
+  }
+  struct stat sb;
+  if (fstatat(dirfd, entry->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+    return 0;
+  }
+  return sb.st_mode & S_IFMT;
+}
 
-static int do_SetMetadataRecursive(const char* filename, const struct stat* statptr, int /*fileflags*/,
-                                   struct FTW* /*pfwt*/) {
-  return ApplyParsedPerms(recursive_state, filename, statptr, recursive_parsed_args);
+// Lists the entries of the directory |dirfd| (which it takes over), without "." and "..".
+static bool ListDirectory(int dirfd, std::vector<std::pair<std::string, mode_t>>* entries) {
+  std::unique_ptr<DIR, decltype(&closedir)> dir(fdopendir(dirfd), closedir);
+  if (!dir) {
+    close(dirfd);
+    return false;
+  }
+  dirent* entry;
+  while ((entry = readdir(dir.get())) != nullptr) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    entries->emplace_back(entry->d_name, EntryType(dirfd, entry));
+  }
+  return true;
+}
+
+// Applies |parsed| to everything below the directory |dirfd| at |path|, children before their
+// directory (like nftw() with FTW_DEPTH). Doesn't follow symlinks or cross into the directories it
+// can't open. Returns the number of changes that failed.
+static int ApplyParsedPermsBelow(State* state, int dirfd, const std::string& path,
+                                 const struct perm_parsed_args& parsed) {
+  std::vector<std::pair<std::string, mode_t>> entries;
+  if (!ListDirectory(dup(dirfd), &entries)) {
+    uiPrintf(state, "ApplyParsedPerms: failed to read %s: %s\n", path.c_str(), strerror(errno));
+    return 1;
+  }
+
+  int bad = 0;
+  for (const auto& entry : entries) {
+    std::string entry_path = path + "/" + entry.first;
+    if (S_ISDIR(entry.second)) {
+      android::base::unique_fd subdir(openat(dirfd, entry.first.c_str(),
+                                             O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+      if (subdir == -1) {
+        uiPrintf(state, "ApplyParsedPerms: failed to open %s: %s\n", entry_path.c_str(),
+                 strerror(errno));
+        bad++;
+        continue;
+      }
+      bad += ApplyParsedPermsBelow(state, subdir, entry_path, parsed);
+    }
+    bad += ApplyParsedPerms(state, dirfd, entry.first.c_str(), entry_path, entry.second, parsed);
+  }
+  return bad;
+}
+
+// Applies |parsed| to the tree at |path|, with the subtrees of its top directory spread over
+// kMetadataThreads threads.
+static int ApplyParsedPermsRecursive(State* state, const std::string& path, mode_t type,
+                                     const struct perm_parsed_args& parsed) {
+  if (!S_ISDIR(type)) {
+    return ApplyParsedPerms(state, AT_FDCWD, path.c_str(), path, type, parsed);
+  }
+
+  android::base::unique_fd dirfd(open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  std::vector<std::pair<std::string, mode_t>> entries;
+  if (dirfd == -1 || !ListDirectory(dup(dirfd), &entries)) {
+    uiPrintf(state, "ApplyParsedPerms: failed to read %s: %s\n", path.c_str(), strerror(errno));
+    return 1;
+  }
+
+  std::atomic<int> bad(0);
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i; (i = next++) < entries.size();) {
+      const std::string& name = entries[i].first;
+      mode_t entry_type = entries[i].second;
+      std::string entry_path = path + "/" + name;
+      if (S_ISDIR(entry_type)) {
+        android::base::unique_fd subdir(
+            openat(dirfd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+        if (subdir == -1) {
+          uiPrintf(state, "ApplyParsedPerms: failed to open %s: %s\n", entry_path.c_str(),
+                   strerror(errno));
+          bad++;
+          continue;
+        }
+        bad += ApplyParsedPermsBelow(state, subdir, entry_path, parsed);
+      }
+      bad += ApplyParsedPerms(state, dirfd, name.c_str(), entry_path, entry_type, parsed);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < std::min(kMetadataThreads, entries.size()); ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  // The top directory goes last, as the rest of it might depend on its old permissions.
+  bad += ApplyParsedPerms(state, AT_FDCWD, path.c_str(), path, type, parsed);
+  return bad;
 }
 
 static Value* SetMetadataFn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv) {
@@ -1016,7 +1732,8 @@ static Value* SetMetadataFn(const char* name, State* state, const std::vector<st
                       name, argv.size());
   }
 
-  std::vector<std::string> args;
+  // File-based OTAs call this once per file, with nothing but literals.
+  StringArgs args;
   if (!ReadArgs(state, argv, &args)) {
     return ErrorAbort(state, kArgsParsingFailure, "%s() Failed to parse the argument(s)", name);
   }
@@ -1032,13 +1749,9 @@ static Value* SetMetadataFn(const char* name, State* state, const std::vector<st
   bool recursive = (strcmp(name, "set_metadata_recursive") == 0);
 
   if (recursive) {
-    recursive_parsed_args = parsed;
-    recursive_state = state;
-    bad += nftw(args[0].c_str(), do_SetMetadataRecursive, 30, FTW_CHDIR | FTW_DEPTH | FTW_PHYS);
-    memset(&recursive_parsed_args, 0, sizeof(recursive_parsed_args));
-    recursive_state = NULL;
+    bad += ApplyParsedPermsRecursive(state, args[0], sb.st_mode & S_IFMT, parsed);
   } else {
-    bad += ApplyParsedPerms(state, args[0].c_str(), &sb, parsed);
+    bad += ApplyParsedPerms(state, AT_FDCWD, args[0].c_str(), args[0], sb.st_mode & S_IFMT, parsed);
   }
 
   if (bad > 0) {
@@ -1152,6 +1865,7 @@ Value* ApplyPatchSpaceFn(const char* name, State* state,
   }
 
   // Skip the cache size check if the update is a retry.
+  WaitForPendingDeletes();
   if (state->is_retry || CacheSizeCheck(bytes) == 0) {
     return StringValue("t");
   }
@@ -1185,6 +1899,9 @@ Value* RunProgramFn(const char* name, State* state, const std::vector<std::uniqu
 
   LOG(INFO) << "about to run program [" << args2[0] << "] with " << argv.size() << " args";
 
+  // The program gets to see the filesystems as the script left them.
+  WaitForPendingDeletes();
+
   pid_t child = fork();
   if (child == 0) {
     execv(args2[0], args2);
@@ -1441,6 +2158,7 @@ void RegisterInstallFunctions() {
   RegisterFunction("delete_recursive", DeleteFn);
   RegisterFunction("package_extract_dir", PackageExtractDirFn);
   RegisterFunction("package_extract_file", PackageExtractFileFn);
+  RegisterFunction("package_extract_sparse_image", PackageExtractSparseImageFn);
   RegisterFunction("symlink", SymlinkFn);
 
   // Usage:
@@ -16,15 +16,29 @@
 
 #include "updater/updater.h"
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
-
+#include <sys/resource.h>
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
+#include <applypatch/imgpatch.h>
 #include <selinux/android.h>
 #include <selinux/label.h>
 #include <selinux/selinux.h>
@@ -32,10 +46,13 @@
 
 #include "edify/expr.h"
 #include "otafault/config.h"
+#include "otafault/ota_io.h"
 #include "otautil/DirUtil.h"
 #include "otautil/SysUtil.h"
 #include "otautil/cache_location.h"
+#include "otautil/command_pipe.h"
 #include "otautil/error_code.h"
+#include "otautil/ZipUtil.h"
 #include "updater/blockimg.h"
 #include "updater/install.h"
 
@@ -57,6 +74,175 @@ extern bool have_eio_error;
 
 struct selabel_handle *sehandle;
 
+struct TimedFunction {
+  Function fn;
+  std::chrono::steady_clock::duration total;
+};
+
+static std::map<std::string, TimedFunction> timed_functions;
+// Guards the totals, which the branches of parallel() add to concurrently.
+static std::mutex timed_functions_mutex;
+
+static Value* TimedFn(const char* name, State* state,
+                      const std::vector<std::unique_ptr<Expr>>& argv) {
+  TimedFunction& timed = timed_functions.at(name);
+  auto start = std::chrono::steady_clock::now();
+  Value* result = timed.fn(name, state, argv);
+  std::lock_guard<std::mutex> lock(timed_functions_mutex);
+  timed.total += std::chrono::steady_clock::now() - start;
+  return result;
+}
+
+// Re-registers the functions in |names| behind TimedFn, which accumulates the time spent in each
+// of them (including any functions called from their arguments).
+static void TimeFunctions(const std::vector<std::string>& names) {
+  for (const auto& name : names) {
+    Function fn = FindFunction(name);
+    if (fn != nullptr && fn != TimedFn) {
+      timed_functions[name] = { fn, std::chrono::steady_clock::duration::zero() };
+      RegisterFunction(name, TimedFn);
+    }
+  }
+}
+
+// Reports the time spent in each function that was called to the recovery for last_install.
+static void LogFunctionTimes(FILE* cmd_pipe) {
+  for (const auto& entry : timed_functions) {
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(entry.second.total).count();
+    if (ms > 0) {
+      fprintf(cmd_pipe, "log time_fn_%s_ms: %lld\n", entry.first.c_str(),
+              static_cast<long long>(ms));
+    }
+  }
+}
+
+// Reports the I/O that went through libotafault, per file and kind of operation, to the recovery
+// for last_install.
+static void LogIoStats(FILE* cmd_pipe) {
+  static constexpr const char* kOpNames[OTAIO_OP_COUNT] = { "read", "write", "fsync" };
+  for (const auto& file : ota_io_stats()) {
+    for (size_t op = 0; op < OTAIO_OP_COUNT; ++op) {
+      const OtaIoOpStats& stats = file.ops[op];
+      if (stats.calls == 0) {
+        continue;
+      }
+      fprintf(cmd_pipe, "log io_%s: %s calls %" PRIu64 " bytes %" PRIu64 " ms %" PRIu64
+              " p50_us %" PRIu64 " p99_us %" PRIu64 "\n",
+              kOpNames[op], file.path.c_str(), stats.calls, stats.bytes, stats.total_us / 1000,
+              stats.LatencyPercentileUs(50), stats.LatencyPercentileUs(99));
+    }
+  }
+}
+
+// What a call site of the script cost in total, including the calls made from its arguments. The
+// I/O is that of the whole process in the meantime, so it includes concurrent branches.
+struct CallSiteProfile {
+  std::string name;
+  size_t calls = 0;
+  std::chrono::steady_clock::duration wall = std::chrono::steady_clock::duration::zero();
+  int64_t cpu_ns = 0;
+  uint64_t read_bytes = 0;
+  uint64_t write_bytes = 0;
+  // How much the peak RSS of the process grew during the calls.
+  long maxrss_growth_kb = 0;
+};
+
+static std::mutex profile_mutex;
+static std::unordered_map<const Expr*, CallSiteProfile> call_site_profiles;
+
+// The resource usage at some point, to take the differences of around a call.
+struct ResourceSnapshot {
+  std::chrono::steady_clock::time_point wall;
+  int64_t cpu_ns;
+  uint64_t read_bytes = 0;
+  uint64_t write_bytes = 0;
+  long maxrss_kb;
+
+  static ResourceSnapshot Take() {
+    ResourceSnapshot snapshot;
+    snapshot.wall = std::chrono::steady_clock::now();
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    snapshot.cpu_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    // The bytes that went to and from the storage, including those of the I/O that bypasses
+    // libotafault (io_uring, the zip extraction).
+    std::string io;
+    if (android::base::ReadFileToString("/proc/self/io", &io)) {
+      for (const auto& line : android::base::Split(io, "\n")) {
+        if (android::base::StartsWith(line, "read_bytes: ")) {
+          android::base::ParseUint(line.substr(12), &snapshot.read_bytes);
+        } else if (android::base::StartsWith(line, "write_bytes: ")) {
+          android::base::ParseUint(line.substr(13), &snapshot.write_bytes);
+        }
+      }
+    }
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    snapshot.maxrss_kb = usage.ru_maxrss;
+    return snapshot;
+  }
+};
+
+// The evaluate_hook of ro.updater.profile, which records the cost of each call site.
+static Value* ProfiledEvaluate(State* state, const Expr& expr) {
+  ResourceSnapshot before = ResourceSnapshot::Take();
+  Value* result = expr.fn(expr.name.c_str(), state, expr.argv);
+  ResourceSnapshot after = ResourceSnapshot::Take();
+
+  std::lock_guard<std::mutex> lock(profile_mutex);
+  CallSiteProfile& profile = call_site_profiles[&expr];
+  if (profile.calls++ == 0) {
+    profile.name = expr.name;
+  }
+  profile.wall += after.wall - before.wall;
+  profile.cpu_ns += after.cpu_ns - before.cpu_ns;
+  profile.read_bytes += after.read_bytes - before.read_bytes;
+  profile.write_bytes += after.write_bytes - before.write_bytes;
+  profile.maxrss_growth_kb += after.maxrss_kb - before.maxrss_kb;
+  return result;
+}
+
+// The number of the most expensive call sites that go to last_install.
+static constexpr size_t kProfileTopEntries = 5;
+
+// Writes the profile of all the call sites (by the line they're on in the script of |state|) to
+// |path|, most expensive first, and reports the top ones to the recovery for last_install.
+static void WriteProfile(const State& state, FILE* cmd_pipe, const std::string& path) {
+  std::lock_guard<std::mutex> lock(profile_mutex);
+  std::vector<std::pair<const Expr*, const CallSiteProfile*>> sites;
+  for (const auto& entry : call_site_profiles) {
+    sites.emplace_back(entry.first, &entry.second);
+  }
+  std::sort(sites.begin(), sites.end(), [](const auto& a, const auto& b) {
+    return a.second->wall > b.second->wall;
+  });
+
+  std::string report = "line function calls wall_ms cpu_ms read_kb written_kb maxrss_growth_kb\n";
+  for (size_t i = 0; i < sites.size(); i++) {
+    const Expr* expr = sites[i].first;
+    const CallSiteProfile& profile = *sites[i].second;
+    size_t start = std::min<size_t>(std::max(expr->start, 0), state.script_len);
+    long line = 1 + std::count(state.script, state.script + start, '\n');
+    long long wall_ms =
+        std::chrono::duration_cast<std::chrono::milliseconds>(profile.wall).count();
+    report += android::base::StringPrintf(
+        "%ld %s %zu %lld %lld %llu %llu %ld\n", line, profile.name.c_str(), profile.calls, wall_ms,
+        static_cast<long long>(profile.cpu_ns / 1000000),
+        static_cast<unsigned long long>(profile.read_bytes / 1024),
+        static_cast<unsigned long long>(profile.write_bytes / 1024), profile.maxrss_growth_kb);
+    if (i < kProfileTopEntries) {
+      fprintf(cmd_pipe, "log profile_top%zu: line %ld %s %zu calls %lld ms\n", i + 1, line,
+              profile.name.c_str(), profile.calls, wall_ms);
+    }
+  }
+
+  if (!android::base::WriteStringToFile(report, path)) {
+    PLOG(WARNING) << "Failed to write the profile to " << path;
+  } else {
+    LOG(INFO) << "Wrote the profile of " << sites.size() << " call sites to " << path;
+  }
+}
+
 static void UpdaterLogger(android::base::LogId /* id */, android::base::LogSeverity /* severity */,
                           const char* /* tag */, const char* /* file */, unsigned int /* line */,
                           const char* message) {
@@ -75,7 +261,7 @@ int main(int argc, char** argv) {
   // (which is redirected to recovery.log).
   android::base::InitLogging(argv, &UpdaterLogger);
 
-  if (argc != 4 && argc != 5) {
+  if (argc < 4 || argc > 7) {
     LOG(ERROR) << "unexpected number of arguments: " << argc;
     return 1;
   }
@@ -87,22 +273,17 @@ int main(int argc, char** argv) {
     return 2;
   }
 
-  // Set up the pipe for sending commands back to the parent process.
-
-  int fd = atoi(argv[2]);
-  FILE* cmd_pipe = fdopen(fd, "wb");
-  setlinebuf(cmd_pipe);
-
   // Extract the script from the package.
 
   const char* package_filename = argv[3];
-  MemMapping map;
-  if (!map.MapFile(package_filename)) {
+  // Shared, so that blobs referencing the package can keep it mapped.
+  auto map = std::make_shared<MemMapping>();
+  if (!map->MapFile(package_filename)) {
     LOG(ERROR) << "failed to map package " << argv[3];
     return 3;
   }
   ZipArchiveHandle za;
-  int open_err = OpenArchiveFromMemory(map.addr, map.length, argv[3], &za);
+  int open_err = OpenArchiveFromMemory(map->addr, map->length, argv[3], &za);
   if (open_err != 0) {
     LOG(ERROR) << "failed to open package " << argv[3] << ": " << ErrorCodeString(open_err);
     CloseArchive(za);
@@ -119,28 +300,74 @@ int main(int argc, char** argv) {
     return 4;
   }
 
-  std::string script;
-  script.resize(script_entry.uncompressed_length);
-  int extract_err = ExtractToMemory(za, &script_entry, reinterpret_cast<uint8_t*>(&script[0]),
-                                    script_entry.uncompressed_length);
-  if (extract_err != 0) {
-    LOG(ERROR) << "failed to read script from package: " << ErrorCodeString(extract_err);
+  // A stored script (as the large ones of file based OTAs can be) is parsed and referred to where
+  // it lies in the mapped package; only a compressed one is inflated into |script_buffer|.
+  std::string script_buffer;
+  const char* script;
+  size_t script_len = script_entry.uncompressed_length;
+  if (script_entry.method == kCompressStored &&
+      static_cast<uint64_t>(script_entry.offset) + script_len <= map->length) {
+    script = reinterpret_cast<const char*>(map->addr + script_entry.offset);
+  } else {
+    script_buffer.resize(script_len);
+    int extract_err = ExtractToMemory(za, &script_entry,
+                                      reinterpret_cast<uint8_t*>(&script_buffer[0]), script_len);
+    if (extract_err != 0) {
+      LOG(ERROR) << "failed to read script from package: " << ErrorCodeString(extract_err);
+      CloseArchive(za);
+      return 5;
+    }
+    script = script_buffer.data();
+  }
+
+  // Optional arguments: "retry" and "--framed_pipe".
+
+  bool is_retry = false;
+  bool framed_pipe = false;
+  for (int i = 4; i < argc; i++) {
+    if (strcmp(argv[i], "retry") == 0) {
+      is_retry = true;
+    } else if (strcmp(argv[i], kFramedCommandPipeFlag) == 0) {
+      framed_pipe = true;
+    } else {
+      printf("unexpected argument: %s", argv[i]);
+    }
+  }
+
+  // Set up the pipe for sending commands back to the parent process.
+
+  int fd = atoi(argv[2]);
+  FILE* cmd_pipe = framed_pipe ? OpenFramedCommandPipe(fd) : fdopen(fd, "wb");
+  if (cmd_pipe == nullptr) {
+    LOG(ERROR) << "failed to open the command pipe";
     CloseArchive(za);
-    return 5;
+    return 1;
   }
+  setlinebuf(cmd_pipe);
 
   // Configure edify's functions.
 
   RegisterBuiltins();
+  std::vector<std::string> builtins = RegisteredFunctionNames();
   RegisterInstallFunctions();
   RegisterBlockImageFunctions();
   RegisterDeviceExtensions();
+  std::vector<std::string> names = RegisteredFunctionNames();
+  // The builtins are mostly control flow (ifelse, assert, ...) that would only repeat the time of
+  // what they wrap.
+  names.erase(std::remove_if(names.begin(), names.end(),
+                             [&builtins](const std::string& name) {
+                               return std::find(builtins.begin(), builtins.end(), name) !=
+                                      builtins.end();
+                             }),
+              names.end());
+  TimeFunctions(names);
 
   // Parse the script.
 
   std::unique_ptr<Expr> root;
   int error_count = 0;
-  int error = parse_string(script.c_str(), &root, &error_count);
+  int error = parse_string(script, script_len, &root, &error_count);
   if (error != 0 || error_count > 0) {
     LOG(ERROR) << error_count << " parse errors";
     CloseArchive(za);
@@ -160,22 +387,53 @@ int main(int argc, char** argv) {
   updater_info.cmd_pipe = cmd_pipe;
   updater_info.package_zip = za;
   updater_info.version = atoi(version);
-  updater_info.package_zip_addr = map.addr;
-  updater_info.package_zip_len = map.length;
+  updater_info.package_zip_addr = map->addr;
+  updater_info.package_zip_len = map->length;
+  updater_info.package_map = map;
+
+  // Index the entries once, for the lookups and the directory extractions of the whole script.
+  std::unique_ptr<ZipIndex> package_index = ZipIndex::Build(za);
+  if (package_index != nullptr) {
+    LOG(INFO) << "Indexed " << package_index->size() << " package entries";
+  }
+  updater_info.package_index = package_index.get();
 
-  State state(script, &updater_info);
+  State state(script, script_len, &updater_info);
 
-  if (argc == 5) {
-    if (strcmp(argv[4], "retry") == 0) {
-      state.is_retry = true;
-    } else {
-      printf("unexpected argument: %s", argv[4]);
-    }
-  }
+  state.is_retry = is_retry;
   ota_io_init(za, state.is_retry);
+  // Optionally count and time the package I/O by file, at some cost to each read and write.
+  bool io_stats = android::base::GetBoolProperty("ro.updater.io_stats", false);
+  if (io_stats) {
+    ota_io_enable_stats();
+  }
+
+  // Optionally profile every call of the script, at some cost to each call.
+  bool profile = android::base::GetBoolProperty("ro.updater.profile", false);
+  if (profile) {
+    state.evaluate_hook = ProfiledEvaluate;
+  }
+
+  // The imgdiff patches of the whole script share the inflated source chunks.
+  SetInflateCacheBudget(
+      android::base::GetUintProperty<size_t>("ro.updater.inflate_cache_size", 32 * 1024 * 1024));
 
   std::string result;
   bool status = Evaluate(&state, root, &result);
+  if (size_t hits = InflateCacheHits()) {
+    LOG(INFO) << "Reused " << hits << " inflated source chunks";
+  }
+  SetInflateCacheBudget(0);
+  WaitForPendingDeletes();
+  LogFunctionTimes(cmd_pipe);
+  if (io_stats) {
+    LogIoStats(cmd_pipe);
+  }
+  if (profile) {
+    WriteProfile(state, cmd_pipe,
+                 android::base::Dirname(CacheLocation::location().last_command_file()) +
+                     "/last_profile");
+  }
 
   if (have_eio_error) {
     fprintf(cmd_pipe, "retry_update\n");
@@ -22,20 +22,81 @@
 #include <string.h>
 
 #include <algorithm>
+#include <condition_variable>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 #include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
 #include <openssl/bn.h>
 #include <openssl/ecdsa.h>
 #include <openssl/obj_mac.h>
 
 #include "asn1_decoder.h"
+#include "otautil/SysUtil.h"
 #include "otautil/print_sha1.h"
 
 static constexpr size_t MiB = 1024 * 1024;
 
+// Computes the SHA-1 digest of the signed region on a worker thread, trailing the main thread's
+// SHA-256 pass. The worker only hashes bytes the main thread has already read, so it never faults
+// in pages of a FUSE-backed mapping itself: a SIGBUS there must hit the caller's thread, which is
+// the one that can recover from it.
+class TrailingSha1 {
+ public:
+  explicit TrailingSha1(const unsigned char* addr) : addr_(addr) {
+    SHA1_Init(&ctx_);
+    thread_ = std::thread(&TrailingSha1::Run, this);
+  }
+
+  // Makes the first |len| bytes available to the worker.
+  void Advance(size_t len) {
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      ready_ = len;
+    }
+    cv_.notify_one();
+  }
+
+  // Waits for the worker to hash everything passed to Advance() and returns the digest.
+  void Finish(uint8_t* digest) {
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      done_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+    SHA1_Final(digest, &ctx_);
+  }
+
+ private:
+  void Run() {
+    size_t hashed = 0;
+    std::unique_lock<std::mutex> lock(mtx_);
+    while (true) {
+      cv_.wait(lock, [&] { return ready_ > hashed || done_; });
+      size_t end = ready_;
+      if (end == hashed && done_) break;
+      lock.unlock();
+      SHA1_Update(&ctx_, addr_ + hashed, end - hashed);
+      hashed = end;
+      lock.lock();
+    }
+  }
+
+  const unsigned char* addr_;
+  SHA_CTX ctx_;
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  size_t ready_ = 0;
+  bool done_ = false;
+  std::thread thread_;
+};
+
 /*
  * Simple version of PKCS#7 SignedData extraction. This extracts the
  * signature OCTET STRING to be used for signature verification.
@@ -211,6 +272,16 @@ int verify_file(const unsigned char* addr, size_t length, const std::vector<Cert
   SHA1_Init(&sha1_ctx);
   SHA256_Init(&sha256_ctx);
 
+  // With both digests needed, SHA-1 runs on another core behind the SHA-256 pass.
+  std::unique_ptr<TrailingSha1> trailing_sha1;
+  if (need_sha1 && need_sha256) {
+    trailing_sha1 = std::make_unique<TrailingSha1>(addr);
+  }
+
+  // The region is read once, front to back. Tell the kernel so, and ask for each chunk ahead of
+  // time (the mapping may be backed by FUSE or a block map).
+  AdviseMappedRange(addr, signed_len, MemAccess::SEQUENTIAL);
+
   double frac = -1.0;
   size_t so_far = 0;
   while (so_far < signed_len) {
@@ -218,9 +289,18 @@ int verify_file(const unsigned char* addr, size_t length, const std::vector<Cert
     // 1196MiB full OTA and 60% for an 89MiB incremental OTA.
     // http://b/28135231.
     size_t size = std::min(signed_len - so_far, 16 * MiB);
+    if (so_far + size < signed_len) {
+      AdviseMappedRange(addr + so_far + size, std::min(signed_len - so_far - size, 16 * MiB),
+                        MemAccess::WILLNEED);
+    }
 
-    if (need_sha1) SHA1_Update(&sha1_ctx, addr + so_far, size);
-    if (need_sha256) SHA256_Update(&sha256_ctx, addr + so_far, size);
+    if (trailing_sha1) {
+      SHA256_Update(&sha256_ctx, addr + so_far, size);
+      trailing_sha1->Advance(so_far + size);
+    } else {
+      if (need_sha1) SHA1_Update(&sha1_ctx, addr + so_far, size);
+      if (need_sha256) SHA256_Update(&sha256_ctx, addr + so_far, size);
+    }
     so_far += size;
 
     if (set_progress) {
@@ -233,7 +313,11 @@ int verify_file(const unsigned char* addr, size_t length, const std::vector<Cert
   }
 
   uint8_t sha1[SHA_DIGEST_LENGTH];
-  SHA1_Final(sha1, &sha1_ctx);
+  if (trailing_sha1) {
+    trailing_sha1->Finish(sha1);
+  } else {
+    SHA1_Final(sha1, &sha1_ctx);
+  }
   uint8_t sha256[SHA256_DIGEST_LENGTH];
   SHA256_Final(sha256, &sha256_ctx);
 
@@ -551,3 +635,154 @@ bool load_keys(const char* filename, std::vector<Certificate>& certs) {
   }
   return true;
 }
+
+static bool parse_hex(const std::string& str, std::vector<uint8_t>* out) {
+  if (str.size() % 2 != 0) return false;
+  out->clear();
+  for (size_t i = 0; i < str.size(); i += 2) {
+    int value = 0;
+    for (char c : { str[i], str[i + 1] }) {
+      int nibble;
+      if (c >= '0' && c <= '9') {
+        nibble = c - '0';
+      } else if (c >= 'a' && c <= 'f') {
+        nibble = c - 'a' + 10;
+      } else if (c >= 'A' && c <= 'F') {
+        nibble = c - 'A' + 10;
+      } else {
+        return false;
+      }
+      value = value * 16 + nibble;
+    }
+    out->push_back(value);
+  }
+  return true;
+}
+
+std::unique_ptr<ChunkDigests> ChunkDigests::Parse(const std::string& manifest,
+                                                  uint64_t data_offset, uint64_t file_size,
+                                                  const std::vector<Certificate>& keys) {
+  // The signature line signs everything up to it.
+  if (manifest.empty() || manifest.back() != '\n') return nullptr;
+  size_t sig_start = manifest.rfind('\n', manifest.size() - 2);
+  if (sig_start == std::string::npos) return nullptr;
+  sig_start++;
+  std::vector<uint8_t> sig_der;
+  if (!parse_hex(manifest.substr(sig_start, manifest.size() - sig_start - 1), &sig_der)) {
+    LOG(ERROR) << "Malformed chunk digests signature";
+    return nullptr;
+  }
+  uint8_t hash[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const uint8_t*>(manifest.data()), sig_start, hash);
+
+  bool signed_by_key = false;
+  for (const auto& key : keys) {
+    if (key.hash_len != SHA256_DIGEST_LENGTH) continue;
+    if ((key.key_type == Certificate::KEY_TYPE_RSA &&
+         RSA_verify(NID_sha256, hash, sizeof(hash), sig_der.data(), sig_der.size(),
+                    key.rsa.get())) ||
+        (key.key_type == Certificate::KEY_TYPE_EC &&
+         ECDSA_verify(0, hash, sizeof(hash), sig_der.data(), sig_der.size(), key.ec.get()))) {
+      signed_by_key = true;
+      break;
+    }
+  }
+  if (!signed_by_key) {
+    LOG(ERROR) << "Chunk digests aren't signed by any of the keys";
+    return nullptr;
+  }
+
+  std::vector<std::string> lines = android::base::Split(manifest.substr(0, sig_start - 1), "\n");
+  if (lines.size() < 2 || lines[0] != "chunk_digests 1") {
+    LOG(ERROR) << "Unsupported chunk digests version";
+    return nullptr;
+  }
+  std::vector<std::string> header = android::base::Split(lines[1], " ");
+  std::unique_ptr<ChunkDigests> chunks(new ChunkDigests());
+  if (header.size() != 2 || !android::base::ParseUint(header[0], &chunks->chunk_size_) ||
+      chunks->chunk_size_ == 0 || !android::base::ParseUint(header[1], &chunks->covered_length_) ||
+      chunks->covered_length_ > file_size ||
+      data_offset + manifest.size() > chunks->covered_length_) {
+    LOG(ERROR) << "Malformed chunk digests header: " << lines[1];
+    return nullptr;
+  }
+  uint64_t count = (chunks->covered_length_ + chunks->chunk_size_ - 1) / chunks->chunk_size_;
+  if (lines.size() - 2 != count) {
+    LOG(ERROR) << "Expected " << count << " chunk digests, got " << lines.size() - 2;
+    return nullptr;
+  }
+  chunks->digests_.resize(count);
+  std::vector<uint8_t> digest;
+  for (uint64_t i = 0; i < count; i++) {
+    if (!parse_hex(lines[i + 2], &digest) || digest.size() != SHA256_DIGEST_LENGTH) {
+      LOG(ERROR) << "Malformed digest of chunk " << i;
+      return nullptr;
+    }
+    std::copy(digest.begin(), digest.end(), chunks->digests_[i].begin());
+  }
+  chunks->file_size_ = file_size;
+  chunks->manifest_offset_ = data_offset;
+  chunks->manifest_ = manifest;
+  return chunks;
+}
+
+bool ChunkDigests::SetTail(const std::string& tail) {
+  if (covered_length_ + tail.size() != file_size_ || tail.size() < 2) {
+    return false;
+  }
+  // The comment length field, right after the covered bytes, must account for the rest.
+  size_t comment_size = static_cast<uint8_t>(tail[0]) | (static_cast<uint8_t>(tail[1]) << 8);
+  if (comment_size + 2 != tail.size()) {
+    return false;
+  }
+  // As in verify_file(), a later EOCD marker would be picked up by libziparchive instead.
+  if (tail.find("PK\x05\x06") != std::string::npos) {
+    return false;
+  }
+  tail_ = tail;
+  has_tail_ = true;
+  return true;
+}
+
+bool ChunkDigests::Verify(uint64_t offset, const uint8_t* data, size_t len) const {
+  static const uint8_t zeroes[4096] = {};
+  if (offset % chunk_size_ != 0) return false;
+  uint64_t end = std::min(offset + len, file_size_);
+  for (uint64_t start = offset; start < std::min(end, covered_length_); start += chunk_size_) {
+    uint64_t chunk_end = std::min(start + chunk_size_, covered_length_);
+    if (chunk_end > end) return false;
+
+    // The manifest can't cover its own bytes, which are hashed as zeroes instead.
+    uint64_t zero_start = std::min(std::max(start, manifest_offset_), chunk_end);
+    uint64_t zero_end = std::min(std::max(start, manifest_offset_ + manifest_.size()), chunk_end);
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, data + (start - offset), zero_start - start);
+    for (uint64_t left = zero_end - zero_start; left > 0;) {
+      size_t size = std::min<uint64_t>(left, sizeof(zeroes));
+      SHA256_Update(&ctx, zeroes, size);
+      left -= size;
+    }
+    SHA256_Update(&ctx, data + (zero_end - offset), chunk_end - zero_end);
+    // Those bytes are authenticated by the manifest's own signature instead.
+    if (zero_end > zero_start &&
+        memcmp(data + (zero_start - offset), manifest_.data() + (zero_start - manifest_offset_),
+               zero_end - zero_start) != 0) {
+      return false;
+    }
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256_Final(digest, &ctx);
+    if (memcmp(digest, digests_[start / chunk_size_].data(), SHA256_DIGEST_LENGTH) != 0) {
+      return false;
+    }
+  }
+  if (end > covered_length_) {
+    uint64_t tail_start = std::max(offset, covered_length_);
+    if (!has_tail_ ||
+        memcmp(data + (tail_start - offset), tail_.data() + (tail_start - covered_length_),
+               end - tail_start) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
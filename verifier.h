@@ -17,8 +17,12 @@
 #ifndef _RECOVERY_VERIFIER_H
 #define _RECOVERY_VERIFIER_H
 
+#include <stdint.h>
+
+#include <array>
 #include <functional>
 #include <memory>
+#include <string>
 #include <vector>
 
 #include <openssl/ec_key.h>
@@ -70,6 +74,61 @@ int verify_file(const unsigned char* addr, size_t length, const std::vector<Cert
 
 bool load_keys(const char* filename, std::vector<Certificate>& certs);
 
+// Name of the optional (stored) package entry that lists the SHA-256 digest of each chunk of the
+// package, so that the package can be verified piece by piece as it's read instead of in a whole
+// pass upfront. Its text is
+//
+//   chunk_digests 1
+//   <chunk size> <covered length>
+//   <hex SHA-256 of chunk 0>
+//   ...
+//   <hex DER signature>
+//
+// The chunks cover the same bytes as the whole-file signature: everything but the comment length
+// and the comment. The bytes of the entry's own data count as zeroes. The last line signs the
+// SHA-256 of all the lines before it, with one of the SHA-256 keys, and vouches for the data of
+// the entry itself.
+static constexpr const char* CHUNK_DIGESTS_ENTRY = "META-INF/com/android/chunk_digests";
+
+class ChunkDigests {
+ public:
+  // Parses |manifest|, the data of CHUNK_DIGESTS_ENTRY found at |data_offset| in a package of
+  // |file_size| bytes. Returns nullptr unless it's well-formed, describes such a package and is
+  // signed by one of |keys|.
+  static std::unique_ptr<ChunkDigests> Parse(const std::string& manifest, uint64_t data_offset,
+                                             uint64_t file_size,
+                                             const std::vector<Certificate>& keys);
+
+  uint32_t chunk_size() const {
+    return chunk_size_;
+  }
+
+  uint64_t covered_length() const {
+    return covered_length_;
+  }
+
+  // Sets the bytes past the covered length, which must hold just the comment length and the
+  // comment, with no end-of-central-directory marker in them. Returns false otherwise.
+  bool SetTail(const std::string& tail);
+
+  // Checks |len| bytes of the package read at |offset|, which is a multiple of the chunk size.
+  // The chunks must be whole, except at the end of the covered length, and the bytes past it must
+  // match the tail given to SetTail().
+  bool Verify(uint64_t offset, const uint8_t* data, size_t len) const;
+
+ private:
+  ChunkDigests() = default;
+
+  uint32_t chunk_size_;
+  uint64_t covered_length_;
+  uint64_t file_size_;
+  uint64_t manifest_offset_;
+  std::string manifest_;
+  std::vector<std::array<uint8_t, SHA256_DIGEST_LENGTH>> digests_;
+  std::string tail_;
+  bool has_tail_ = false;
+};
+
 #define VERIFY_SUCCESS        0
 #define VERIFY_FAILURE        1
 
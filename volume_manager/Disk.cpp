@@ -17,6 +17,7 @@
 
 #include "Disk.h"
 #include <volume_manager/VolumeManager.h>
+#include "PartitionTable.h"
 #include "PublicVolume.h"
 #include "ResponseCode.h"
 #include "Utils.h"
@@ -28,8 +29,6 @@
 #include <android-base/stringprintf.h>
 #include <diskconfig/diskconfig.h>
 
-#include <sgdisk.h>
-
 #include <fcntl.h>
 #include <inttypes.h>
 #include <stdio.h>
@@ -75,12 +74,6 @@ static const unsigned int kMajorBlockExperimentalMax = 254;
 static const char* kGptBasicData = "EBD0A0A2-B9E5-4433-87C0-68B6B72699C7";
 static const char* kGptLinuxFilesystem = "0FC63DAF-8483-4772-8E79-3D69D8477DE4";
 
-enum class Table {
-    kUnknown,
-    kMbr,
-    kGpt,
-};
-
 static bool isVirtioBlkDevice(unsigned int major) {
     /*
      * The new emulator's "ranchu" virtual board no longer includes a goldfish
@@ -123,17 +116,20 @@ Disk::Disk(const std::string& eventPath, dev_t device, const std::string& nickna
 }
 
 Disk::~Disk() {
+    waitForProbe();
     CHECK(!mCreated);
     DestroyDeviceNode(mDevPath);
 }
 
 void Disk::getVolumeInfo(std::vector<VolumeInfo>& info) {
+    std::lock_guard<std::mutex> lock(mVolumesLock);
     for (auto vol : mVolumes) {
         info.push_back(VolumeInfo(vol.get()));
     }
 }
 
 std::shared_ptr<VolumeBase> Disk::findVolume(const std::string& id) {
+    std::lock_guard<std::mutex> lock(mVolumesLock);
     for (auto vol : mVolumes) {
         if (vol->getId() == id) {
             return vol;
@@ -143,6 +139,7 @@ std::shared_ptr<VolumeBase> Disk::findVolume(const std::string& id) {
 }
 
 void Disk::listVolumes(VolumeBase::Type type, std::list<std::string>& list) {
+    std::lock_guard<std::mutex> lock(mVolumesLock);
     for (const auto& vol : mVolumes) {
         if (vol->getType() == type) {
             list.push_back(vol->getId());
@@ -160,7 +157,19 @@ status_t Disk::create() {
     return OK;
 }
 
+void Disk::createAsync() {
+    waitForProbe();
+    mProbe = std::thread([this] { create(); });
+}
+
+void Disk::waitForProbe() {
+    if (mProbe.joinable()) {
+        mProbe.join();
+    }
+}
+
 status_t Disk::destroy() {
+    waitForProbe();
     CHECK(mCreated);
     destroyAllVolumes();
     mCreated = false;
@@ -172,16 +181,33 @@ void Disk::createPublicVolume(dev_t device, const std::string& fstype /* = "" */
                               const std::string& mntopts /* = "" */) {
     auto vol = std::shared_ptr<VolumeBase>(new PublicVolume(device, mNickname, fstype, mntopts));
 
-    mVolumes.push_back(vol);
     vol->setDiskId(getId());
     vol->create();
+
+    // Only list the volume once it has been probed, so the menu never shows a half-read one
+    std::lock_guard<std::mutex> lock(mVolumesLock);
+    mVolumes.push_back(vol);
+}
+
+void Disk::createPublicVolumes(const std::vector<dev_t>& devices) {
+    std::vector<std::thread> threads;
+    for (dev_t device : devices) {
+        threads.emplace_back([this, device] { createPublicVolume(device); });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
 }
 
 void Disk::destroyAllVolumes() {
-    for (const auto& vol : mVolumes) {
+    std::vector<std::shared_ptr<VolumeBase>> volumes;
+    {
+        std::lock_guard<std::mutex> lock(mVolumesLock);
+        volumes.swap(mVolumes);
+    }
+    for (const auto& vol : volumes) {
         vol->destroy();
     }
-    mVolumes.clear();
 }
 
 status_t Disk::readMetadata() {
@@ -292,29 +318,18 @@ status_t Disk::readPartitions() {
     destroyAllVolumes();
 
     // Parse partition table
-    sgdisk_partition_table ptbl;
-    std::vector<sgdisk_partition> partitions;
-    int res = sgdisk_read(mDevPath.c_str(), ptbl, partitions);
-    if (res != 0) {
-        LOG(WARNING) << "sgdisk failed to scan " << mDevPath;
+    Table table;
+    std::vector<PartitionEntry> partitions;
+    status_t res = ReadPartitionTable(mDevPath, &table, &partitions);
+    if (res != OK) {
+        LOG(WARNING) << "Failed to scan " << mDevPath;
         VolumeManager::Instance()->notifyEvent(ResponseCode::DiskScanned);
         return res;
     }
 
-    Table table = Table::kUnknown;
     bool foundParts = false;
-
-    switch (ptbl.type) {
-        case MBR:
-            table = Table::kMbr;
-            break;
-        case GPT:
-            table = Table::kGpt;
-        default:
-            table = Table::kUnknown;
-    }
-
     foundParts = partitions.size() > 0;
+    std::vector<dev_t> partDevices;
     for (const auto& part : partitions) {
         if (part.num <= 0 || part.num > maxMinors) {
             LOG(WARNING) << mId << " is ignoring partition " << part.num
@@ -323,23 +338,23 @@ status_t Disk::readPartitions() {
         }
         dev_t partDevice = makedev(major(mDevice), minor(mDevice) + part.num);
         if (table == Table::kMbr) {
-            switch (strtol(part.type.c_str(), nullptr, 16)) {
+            switch (part.mbrType) {
                 case 0x06:  // FAT16
                 case 0x07:  // NTFS/exFAT
                 case 0x0b:  // W95 FAT32 (LBA)
                 case 0x0c:  // W95 FAT32 (LBA)
                 case 0x0e:  // W95 FAT16 (LBA)
                 case 0x83:  // Linux EXT4/F2FS/...
-                    createPublicVolume(partDevice);
+                    partDevices.push_back(partDevice);
                     break;
             }
         } else if (table == Table::kGpt) {
-            if (!strcasecmp(part.guid.c_str(), kGptBasicData) ||
-                !strcasecmp(part.guid.c_str(), kGptLinuxFilesystem)) {
-                createPublicVolume(partDevice);
+            if (part.gptType == kGptBasicData || part.gptType == kGptLinuxFilesystem) {
+                partDevices.push_back(partDevice);
             }
         }
     }
+    createPublicVolumes(partDevices);
 
     // Ugly last ditch effort, treat entire disk as partition
     if (table == Table::kUnknown || !foundParts) {
@@ -359,6 +374,7 @@ status_t Disk::readPartitions() {
 }
 
 status_t Disk::unmountAll() {
+    std::lock_guard<std::mutex> lock(mVolumesLock);
     for (const auto& vol : mVolumes) {
         vol->unmount();
     }
@@ -23,6 +23,8 @@
 
 #include <utils/Errors.h>
 
+#include <mutex>
+#include <thread>
 #include <vector>
 
 #include <volume_manager/VolumeManager.h>
@@ -77,6 +79,11 @@ class Disk {
     virtual status_t create();
     virtual status_t destroy();
 
+    /* Runs create() on a background thread, so several disks can be probed at once */
+    void createAsync();
+    /* Waits for a pending createAsync() to finish */
+    void waitForProbe();
+
     virtual status_t readMetadata();
     virtual status_t readPartitions();
 
@@ -99,6 +106,10 @@ class Disk {
     std::string mLabel;
     /* Current partitions on disk */
     std::vector<std::shared_ptr<VolumeBase>> mVolumes;
+    /* Guards mVolumes, which the probe threads fill in while it's being listed */
+    std::mutex mVolumesLock;
+    /* Thread running createAsync() */
+    std::thread mProbe;
     /* Nickname for this disk */
     std::string mNickname;
     /* Flags applicable to this disk */
@@ -110,6 +121,8 @@ class Disk {
 
     void createPublicVolume(dev_t device, const std::string& fstype = "",
                             const std::string& mntopts = "");
+    /* Creates the volumes concurrently, since each one probes its own filesystem */
+    void createPublicVolumes(const std::vector<dev_t>& devices);
 
     void destroyAllVolumes();
 
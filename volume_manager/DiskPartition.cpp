@@ -68,6 +68,7 @@ status_t DiskPartition::create() {
 }
 
 status_t DiskPartition::destroy() {
+    waitForProbe();
     CHECK(mCreated);
     destroyAllVolumes();
     mCreated = false;
@@ -16,19 +16,36 @@
  */
 
 #include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <linux/netlink.h>
+
+#include <algorithm>
+#include <chrono>
 
 #define LOG_TAG "Vold"
 
 #include <cutils/log.h>
 
 #include <sysutils/NetlinkEvent.h>
+#include <sysutils/SocketClient.h>
 #include <volume_manager/VolumeManager.h>
 #include "NetlinkHandler.h"
 
-NetlinkHandler::NetlinkHandler(int listenerSocket) : NetlinkListener(listenerSocket) {}
+// The most uevents read by one recvmmsg() call, and the room for each of them.
+static const unsigned int kBatchSize = 32;
+static const size_t kEventSize = 8192;
+// A burst ends once no uevent has come for kQuietTime, or kMaxDelay after it started.
+static const std::chrono::milliseconds kQuietTime(50);
+static const std::chrono::milliseconds kMaxDelay(500);
+
+NetlinkHandler::NetlinkHandler(int listenerSocket)
+    : NetlinkListener(listenerSocket), mBuffers(new char[kBatchSize * kEventSize]) {}
 
 NetlinkHandler::~NetlinkHandler() {}
 
@@ -40,6 +57,101 @@ void NetlinkHandler::stop() {
     this->stopListener();
 }
 
+bool NetlinkHandler::receiveEvents(int sock, std::vector<std::unique_ptr<NetlinkEvent>>& events) {
+    struct iovec iovs[kBatchSize];
+    struct sockaddr_nl addrs[kBatchSize];
+    char controls[kBatchSize][CMSG_SPACE(sizeof(struct ucred))];
+    struct mmsghdr msgs[kBatchSize];
+    memset(msgs, 0, sizeof(msgs));
+    for (unsigned int i = 0; i < kBatchSize; i++) {
+        iovs[i] = {mBuffers.get() + i * kEventSize, kEventSize};
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = controls[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+    }
+
+    int count = TEMP_FAILURE_RETRY(recvmmsg(sock, msgs, kBatchSize, MSG_DONTWAIT, nullptr));
+    if (count <= 0) {
+        if (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            SLOGE("recvmmsg failed (%s)", strerror(errno));
+        }
+        return false;
+    }
+
+    for (int i = 0; i < count; i++) {
+        const struct msghdr& hdr = msgs[i].msg_hdr;
+        if (hdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+            SLOGW("Dropping truncated uevent");
+            continue;
+        }
+        // Only trust the kernel's multicasts, like uevent_kernel_multicast_uid_recv() does.
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+        if (!cmsg || cmsg->cmsg_type != SCM_CREDENTIALS) {
+            continue;
+        }
+        const struct ucred* cred = reinterpret_cast<const struct ucred*>(CMSG_DATA(cmsg));
+        if (cred->uid != 0 || addrs[i].nl_groups == 0 || addrs[i].nl_pid != 0) {
+            continue;
+        }
+
+        std::unique_ptr<NetlinkEvent> evt(new NetlinkEvent());
+        if (evt->decode(static_cast<char*>(iovs[i].iov_base), msgs[i].msg_len,
+                        NETLINK_FORMAT_ASCII)) {
+            events.push_back(std::move(evt));
+        } else {
+            SLOGE("Error decoding NetlinkEvent");
+        }
+    }
+    return true;
+}
+
+bool NetlinkHandler::onDataAvailable(SocketClient* cli) {
+    int sock = cli->getSocket();
+    std::vector<std::unique_ptr<NetlinkEvent>> events;
+    if (!receiveEvents(sock, events)) {
+        return true;
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + kMaxDelay;
+    while (true) {
+        // Drain what's queued already before waiting for more.
+        while (receiveEvents(sock, events)) {
+        }
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now());
+        if (left.count() <= 0) {
+            break;
+        }
+        struct pollfd pfd = {sock, POLLIN, 0};
+        if (TEMP_FAILURE_RETRY(poll(&pfd, 1, std::min(left, kQuietTime).count())) <= 0) {
+            break;
+        }
+    }
+
+    handleEvents(events);
+    return true;
+}
+
+void NetlinkHandler::handleEvents(const std::vector<std::unique_ptr<NetlinkEvent>>& events) {
+    std::vector<NetlinkEvent*> blockEvents;
+    for (const auto& evt : events) {
+        const char* subsys = evt->getSubsystem();
+        if (!subsys) {
+            SLOGW("No subsystem found in netlink event");
+            continue;
+        }
+        if (!strcmp(subsys, "block")) {
+            blockEvents.push_back(evt.get());
+        }
+    }
+    if (!blockEvents.empty()) {
+        android::volmgr::VolumeManager::Instance()->handleBlockEvents(blockEvents);
+    }
+}
+
 void NetlinkHandler::onEvent(NetlinkEvent* evt) {
     android::volmgr::VolumeManager* vm = android::volmgr::VolumeManager::Instance();
     const char* subsys = evt->getSubsystem();
@@ -20,6 +20,9 @@
 
 #include <sysutils/NetlinkListener.h>
 
+#include <memory>
+#include <vector>
+
 class NetlinkHandler : public NetlinkListener {
   public:
     explicit NetlinkHandler(int listenerSocket);
@@ -29,6 +32,16 @@ class NetlinkHandler : public NetlinkListener {
     void stop(void);
 
   protected:
+    // Reads the uevents with recvmmsg() and keeps reading until the socket has been quiet for a
+    // little while, so that a hotplug burst gets handled as one batch.
+    virtual bool onDataAvailable(SocketClient* cli);
     virtual void onEvent(NetlinkEvent* evt);
+
+  private:
+    // Appends the uevents queued on |sock| to |events|. Returns false if none could be read.
+    bool receiveEvents(int sock, std::vector<std::unique_ptr<NetlinkEvent>>& events);
+    void handleEvents(const std::vector<std::unique_ptr<NetlinkEvent>>& events);
+
+    std::unique_ptr<char[]> mBuffers;
 };
 #endif
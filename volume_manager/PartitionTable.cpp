@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 2019 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "PartitionTable.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
+#include <zlib.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+using android::base::StringPrintf;
+
+namespace android {
+namespace volmgr {
+
+static const uint8_t kMbrTypeExtendedChs = 0x05;
+static const uint8_t kMbrTypeExtendedLba = 0x0f;
+static const uint8_t kMbrTypeExtendedLinux = 0x85;
+static const uint8_t kMbrTypeGptProtective = 0xee;
+static const size_t kMbrEntriesOffset = 446;
+static const size_t kMbrEntrySize = 16;
+static const int kMaxLogicalPartitions = 64;
+
+static const char kGptSignature[8] = {'E', 'F', 'I', ' ', 'P', 'A', 'R', 'T'};
+static const uint32_t kGptMinHeaderSize = 92;
+static const uint32_t kGptMinEntrySize = 128;
+// Far more than the usual 128 entries of 128 bytes, but keeps a corrupt header from making us
+// read the whole disk.
+static const uint64_t kGptMaxEntriesSize = 1024 * 1024;
+
+// The fields are little-endian on disk, like on every device this runs on.
+template <typename T>
+static T Get(const uint8_t* p) {
+    T value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static bool ReadSector(int fd, uint64_t lba, uint32_t sectorSize, std::vector<uint8_t>* buf) {
+    buf->resize(sectorSize);
+    if (!android::base::ReadFullyAtOffset(fd, buf->data(), sectorSize, lba * sectorSize)) {
+        PLOG(WARNING) << "Failed to read sector " << lba;
+        return false;
+    }
+    return true;
+}
+
+static std::string GuidToString(const uint8_t* guid) {
+    return StringPrintf("%08X-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X", Get<uint32_t>(guid),
+                        Get<uint16_t>(guid + 4), Get<uint16_t>(guid + 6), guid[8], guid[9],
+                        guid[10], guid[11], guid[12], guid[13], guid[14], guid[15]);
+}
+
+static bool IsExtended(uint8_t type) {
+    return type == kMbrTypeExtendedChs || type == kMbrTypeExtendedLba ||
+           type == kMbrTypeExtendedLinux;
+}
+
+// Follows the chain of extended boot records from |start|, numbering the logical partitions
+// from 5 like the kernel does.
+static bool ReadLogicalPartitions(int fd, uint32_t sectorSize, uint64_t start,
+                                  std::vector<PartitionEntry>* partitions) {
+    std::vector<uint8_t> ebr;
+    uint64_t next = 0;
+    int num = 5;
+    for (int i = 0; i < kMaxLogicalPartitions; i++) {
+        if (!ReadSector(fd, start + next, sectorSize, &ebr)) {
+            return false;
+        }
+        if (ebr[510] != 0x55 || ebr[511] != 0xaa) {
+            break;
+        }
+        const uint8_t* entry = ebr.data() + kMbrEntriesOffset;
+        if (entry[4] != 0 && Get<uint32_t>(entry + 12) != 0) {
+            partitions->push_back({num++, entry[4], ""});
+        }
+        // The second entry points to the next EBR, relative to the start of the extended one.
+        const uint8_t* link = entry + kMbrEntrySize;
+        uint32_t offset = Get<uint32_t>(link + 8);
+        if (!IsExtended(link[4]) || offset == 0 || offset <= next) {
+            break;
+        }
+        next = offset;
+    }
+    return true;
+}
+
+// Reads the GPT whose header is at |lba|. Returns false if there's no valid one there.
+static bool ReadGpt(int fd, uint32_t sectorSize, uint64_t lba,
+                    std::vector<PartitionEntry>* partitions) {
+    std::vector<uint8_t> header;
+    if (!ReadSector(fd, lba, sectorSize, &header)) {
+        return false;
+    }
+    if (memcmp(header.data(), kGptSignature, sizeof(kGptSignature)) != 0) {
+        return false;
+    }
+    uint32_t headerSize = Get<uint32_t>(header.data() + 12);
+    if (headerSize < kGptMinHeaderSize || headerSize > sectorSize) {
+        LOG(WARNING) << "Bad GPT header size " << headerSize << " at " << lba;
+        return false;
+    }
+    uint32_t headerCrc = Get<uint32_t>(header.data() + 16);
+    memset(header.data() + 16, 0, sizeof(headerCrc));
+    if (crc32(0, header.data(), headerSize) != headerCrc) {
+        LOG(WARNING) << "Bad GPT header checksum at " << lba;
+        return false;
+    }
+
+    uint64_t entriesLba = Get<uint64_t>(header.data() + 72);
+    uint32_t count = Get<uint32_t>(header.data() + 80);
+    uint32_t entrySize = Get<uint32_t>(header.data() + 84);
+    uint32_t entriesCrc = Get<uint32_t>(header.data() + 88);
+    uint64_t entriesSize = static_cast<uint64_t>(count) * entrySize;
+    if (entrySize < kGptMinEntrySize || entrySize % 8 != 0 || entriesSize > kGptMaxEntriesSize) {
+        LOG(WARNING) << "Bad GPT entries (" << count << " x " << entrySize << ") at " << lba;
+        return false;
+    }
+
+    std::vector<uint8_t> entries(entriesSize);
+    if (!android::base::ReadFullyAtOffset(fd, entries.data(), entries.size(),
+                                          entriesLba * sectorSize)) {
+        PLOG(WARNING) << "Failed to read GPT entries at " << entriesLba;
+        return false;
+    }
+    if (crc32(0, entries.data(), entries.size()) != entriesCrc) {
+        LOG(WARNING) << "Bad GPT entries checksum at " << entriesLba;
+        return false;
+    }
+
+    static const uint8_t kUnused[16] = {};
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t* entry = entries.data() + static_cast<size_t>(i) * entrySize;
+        if (memcmp(entry, kUnused, sizeof(kUnused)) != 0) {
+            partitions->push_back({static_cast<int>(i + 1), 0, GuidToString(entry)});
+        }
+    }
+    return true;
+}
+
+status_t ReadPartitionTable(const std::string& path, Table* table,
+                            std::vector<PartitionEntry>* partitions) {
+    *table = Table::kUnknown;
+    partitions->clear();
+
+    android::base::unique_fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd == -1) {
+        PLOG(WARNING) << "Failed to open " << path;
+        return -errno;
+    }
+    int sectorSize = 0;
+    if (ioctl(fd, BLKSSZGET, &sectorSize) == -1 || sectorSize < 512) {
+        sectorSize = 512;
+    }
+    uint64_t size = 0;
+    if (ioctl(fd, BLKGETSIZE64, &size) == -1) {
+        struct stat sb;
+        size = fstat(fd, &sb) == 0 ? sb.st_size : 0;
+    }
+
+    std::vector<uint8_t> mbr;
+    if (!ReadSector(fd, 0, sectorSize, &mbr)) {
+        return -EIO;
+    }
+    if (mbr[510] != 0x55 || mbr[511] != 0xaa) {
+        return OK;
+    }
+
+    bool protective = false;
+    for (int i = 0; i < 4; i++) {
+        if (mbr[kMbrEntriesOffset + i * kMbrEntrySize + 4] == kMbrTypeGptProtective) {
+            protective = true;
+        }
+    }
+    if (protective) {
+        uint64_t lastLba = size / sectorSize;
+        if (ReadGpt(fd, sectorSize, 1, partitions) ||
+            (lastLba > 1 && ReadGpt(fd, sectorSize, lastLba - 1, partitions))) {
+            *table = Table::kGpt;
+        } else {
+            LOG(WARNING) << path << " has a protective MBR but no valid GPT";
+        }
+        return OK;
+    }
+
+    *table = Table::kMbr;
+    for (int i = 0; i < 4; i++) {
+        const uint8_t* entry = mbr.data() + kMbrEntriesOffset + i * kMbrEntrySize;
+        uint8_t type = entry[4];
+        uint32_t start = Get<uint32_t>(entry + 8);
+        if (type == 0 || Get<uint32_t>(entry + 12) == 0) {
+            continue;
+        }
+        partitions->push_back({i + 1, type, ""});
+        if (IsExtended(type) && !ReadLogicalPartitions(fd, sectorSize, start, partitions)) {
+            return -EIO;
+        }
+    }
+    return OK;
+}
+
+}  // namespace volmgr
+}  // namespace android
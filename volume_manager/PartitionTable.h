@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2019 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLMGR_PARTITION_TABLE_H
+#define ANDROID_VOLMGR_PARTITION_TABLE_H
+
+#include <utils/Errors.h>
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace android {
+namespace volmgr {
+
+enum class Table {
+    kUnknown,
+    kMbr,
+    kGpt,
+};
+
+struct PartitionEntry {
+    // The number of the partition, as the kernel numbers its block device.
+    int num;
+    // The partition type, for an MBR.
+    uint8_t mbrType;
+    // The partition type GUID in upper case text form, for a GPT.
+    std::string gptType;
+};
+
+/*
+ * Reads the partition table of the block device at |path| straight from the device: the MBR,
+ * with the logical partitions of an extended one, or the GPT behind a protective MBR, falling
+ * back to the backup GPT header at the end of the disk. Only the used entries end up in
+ * |partitions|. A disk with neither table is kUnknown. Returns OK, or -errno if the device can't
+ * be read.
+ */
+status_t ReadPartitionTable(const std::string& path, Table* table,
+                            std::vector<PartitionEntry>* partitions);
+
+}  // namespace volmgr
+}  // namespace android
+
+#endif
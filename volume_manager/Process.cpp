@@ -34,12 +34,17 @@
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
 #include <cutils/log.h>
+#include <otautil/open_files.h>
 
 #include "Process.h"
 
 using android::base::ReadFileToString;
 using android::base::StringPrintf;
 
+// How long a scan of /proc gets reused for, e.g. when unmounting several paths in a row. A scan
+// is never reused after signalling the processes found in it.
+static constexpr std::chrono::milliseconds kSnapshotMaxAge(500);
+
 int Process::readSymLink(const char* path, char* link, size_t max) {
     struct stat s;
     int length;
@@ -168,35 +173,39 @@ int Process::getPid(const char* s) {
  */
 int Process::killProcessesWithOpenFiles(const char* path, int signal) {
     int count = 0;
-    DIR* dir;
-    struct dirent* de;
-
-    if (!(dir = opendir("/proc"))) {
-        SLOGE("opendir failed (%s)", strerror(errno));
+    std::shared_ptr<const OpenFiles> files = OpenFiles::Get(kSnapshotMaxAge, true);
+    if (!files) {
+        SLOGE("Failed to scan /proc (%s)", strerror(errno));
         return count;
     }
 
-    while ((de = readdir(dir))) {
-        int pid = getPid(de->d_name);
-        if (pid == -1) continue;
+    // The entries come grouped by process, so each process gets reported and signalled once.
+    pid_t last = -1;
+    for (const auto& entry : files->entries()) {
+        if (entry.pid == last || !pathMatchesMountPoint(entry.path.c_str(), path)) continue;
+        last = entry.pid;
+        int pid = entry.pid;
 
         std::string name;
         getProcessName(pid, name);
 
-        char openfile[PATH_MAX];
-
-        if (checkFileDescriptorSymLinks(pid, path, openfile, sizeof(openfile))) {
-            SLOGE("Process %s (%d) has open file %s", name.c_str(), pid, openfile);
-        } else if (checkFileMaps(pid, path, openfile, sizeof(openfile))) {
-            SLOGE("Process %s (%d) has open filemap for %s", name.c_str(), pid, openfile);
-        } else if (checkSymLink(pid, path, "cwd")) {
-            SLOGE("Process %s (%d) has cwd within %s", name.c_str(), pid, path);
-        } else if (checkSymLink(pid, path, "root")) {
-            SLOGE("Process %s (%d) has chroot within %s", name.c_str(), pid, path);
-        } else if (checkSymLink(pid, path, "exe")) {
-            SLOGE("Process %s (%d) has executable path within %s", name.c_str(), pid, path);
-        } else {
-            continue;
+        const char* file = entry.path.c_str();
+        switch (entry.kind) {
+            case OpenFiles::Kind::kFd:
+                SLOGE("Process %s (%d) has open file %s", name.c_str(), pid, file);
+                break;
+            case OpenFiles::Kind::kMap:
+                SLOGE("Process %s (%d) has open filemap for %s", name.c_str(), pid, file);
+                break;
+            case OpenFiles::Kind::kCwd:
+                SLOGE("Process %s (%d) has cwd within %s", name.c_str(), pid, path);
+                break;
+            case OpenFiles::Kind::kRoot:
+                SLOGE("Process %s (%d) has chroot within %s", name.c_str(), pid, path);
+                break;
+            case OpenFiles::Kind::kExe:
+                SLOGE("Process %s (%d) has executable path within %s", name.c_str(), pid, path);
+                break;
         }
 
         if (signal != 0) {
@@ -205,6 +214,9 @@ int Process::killProcessesWithOpenFiles(const char* path, int signal) {
             count++;
         }
     }
-    closedir(dir);
+    // The processes that got signalled may be gone or have closed their files by the next call.
+    if (count > 0) {
+        OpenFiles::Invalidate();
+    }
     return count;
 }
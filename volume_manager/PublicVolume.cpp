@@ -46,7 +46,11 @@ namespace volmgr {
 PublicVolume::PublicVolume(dev_t device, const std::string& nickname,
                            const std::string& fstype /* = "" */,
                            const std::string& mntopts /* = "" */)
-    : VolumeBase(Type::kPublic), mDevice(device), mFsType(fstype), mMntOpts(mntopts) {
+    : VolumeBase(Type::kPublic),
+      mDevice(device),
+      mFsType(fstype),
+      mMntOpts(mntopts),
+      mMountedReadOnly(false) {
     setId(StringPrintf("public:%u_%u", major(device), minor(device)));
     setPartLabel(nickname);
     mDevPath = StringPrintf("/dev/block/volmgr/%s", getId().c_str());
@@ -97,8 +101,11 @@ status_t PublicVolume::doMount() {
         return -errno;
     }
 
+    bool readOnly = getMountFlags() & MountFlags::kReadOnly;
     int ret = 0;
-    if (mFsType == "exfat") {
+    if (readOnly) {
+        LOG(INFO) << getId() << " mounting read-only, skipping filesystem check";
+    } else if (mFsType == "exfat") {
         ret = exfat::Check(mDevPath);
     } else if (mFsType == "ext4") {
         ret = ext4::Check(mDevPath, getPath(), false);
@@ -112,30 +119,33 @@ status_t PublicVolume::doMount() {
         LOG(WARNING) << getId() << " unsupported filesystem check, skipping";
     }
     if (ret) {
-        LOG(ERROR) << getId() << " failed filesystem check";
-        return -EIO;
+        // Still let the user get at their files, just without writing to a damaged filesystem
+        LOG(ERROR) << getId() << " failed filesystem check; mounting read-only";
+        readOnly = true;
     }
 
     if (mFsType == "exfat") {
-        ret = exfat::Mount(mDevPath, getPath(), AID_MEDIA_RW, AID_MEDIA_RW, 0007);
+        ret = exfat::Mount(mDevPath, getPath(), AID_MEDIA_RW, AID_MEDIA_RW, 0007, readOnly);
     } else if (mFsType == "ext4") {
-        ret = ext4::Mount(mDevPath, getPath(), false, false, true, mMntOpts, false, true);
+        ret = ext4::Mount(mDevPath, getPath(), readOnly, false, true, mMntOpts, false, true);
     } else if (mFsType == "f2fs") {
-        ret = f2fs::Mount(mDevPath, getPath(), mMntOpts, false, true);
+        ret = f2fs::Mount(mDevPath, getPath(), mMntOpts, false, true, readOnly);
     } else if (mFsType == "ntfs") {
-        ret =
-            ntfs::Mount(mDevPath, getPath(), false, false, false, AID_MEDIA_RW, AID_MEDIA_RW, 0007);
+        ret = ntfs::Mount(mDevPath, getPath(), readOnly, false, false, AID_MEDIA_RW, AID_MEDIA_RW,
+                          0007);
     } else if (mFsType == "vfat") {
-        ret = vfat::Mount(mDevPath, getPath(), false, false, false, AID_MEDIA_RW, AID_MEDIA_RW,
-                          0007, true);
+        ret = vfat::Mount(mDevPath, getPath(), readOnly, false, false, AID_MEDIA_RW, AID_MEDIA_RW,
+                          0007, !readOnly);
     } else {
-        ret = ::mount(mDevPath.c_str(), getPath().c_str(), mFsType.c_str(), 0, nullptr);
+        ret = ::mount(mDevPath.c_str(), getPath().c_str(), mFsType.c_str(),
+                      readOnly ? MS_RDONLY : 0, nullptr);
     }
     if (ret) {
         PLOG(ERROR) << getId() << " failed to mount " << mDevPath;
         return -EIO;
     }
 
+    mMountedReadOnly = readOnly;
     return OK;
 }
 
@@ -49,6 +49,7 @@ class PublicVolume : public VolumeBase {
     status_t doDestroy() override;
     status_t doMount() override;
     status_t doUnmount(bool detach = false) override;
+    bool isMountedReadOnly() const override { return mMountedReadOnly; }
 
     status_t readMetadata();
 
@@ -64,6 +65,8 @@ class PublicVolume : public VolumeBase {
     std::string mFsUuid;
     /* Mount options */
     std::string mMntOpts;
+    /* Flag that the volume was mounted read-only */
+    bool mMountedReadOnly;
 
     DISALLOW_COPY_AND_ASSIGN(PublicVolume);
 };
@@ -24,20 +24,25 @@
 #include <android-base/logging.h>
 #include <android-base/properties.h>
 #include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
 
 #include <cutils/fs.h>
 #include <private/android_filesystem_config.h>
 
 #include <dirent.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <linux/fs.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <algorithm>
+#include <map>
 #include <mutex>
 #include <thread>
 
@@ -193,25 +198,320 @@ status_t BindMount(const std::string& source, const std::string& target) {
     return OK;
 }
 
-static status_t readMetadata(const std::string& path, std::string& fsType, std::string& fsUuid,
-                             std::string& fsLabel) {
-    char* val = NULL;
-    val = blkid_get_tag_value(NULL, "TYPE", path.c_str());
-    if (val) {
-        fsType = val;
+static uint16_t le16(const uint8_t* p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t le32(const uint8_t* p) {
+    return le16(p) | ((uint32_t)le16(p + 2) << 16);
+}
+
+static uint64_t le64(const uint8_t* p) {
+    return le32(p) | ((uint64_t)le32(p + 4) << 32);
+}
+
+/* Converts a little-endian UTF-16 string of up to len units, stopping at a NUL */
+static std::string utf16ToUtf8(const uint8_t* p, size_t len) {
+    std::string out;
+    for (size_t i = 0; i < len; i++) {
+        uint32_t c = le16(p + i * 2);
+        if (c == 0) break;
+        if (c >= 0xd800 && c < 0xdc00 && i + 1 < len) {
+            uint32_t lo = le16(p + (i + 1) * 2);
+            if (lo >= 0xdc00 && lo < 0xe000) {
+                c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+                i++;
+            }
+        }
+        if (c < 0x80) {
+            out += (char)c;
+        } else if (c < 0x800) {
+            out += (char)(0xc0 | (c >> 6));
+            out += (char)(0x80 | (c & 0x3f));
+        } else if (c < 0x10000) {
+            out += (char)(0xe0 | (c >> 12));
+            out += (char)(0x80 | ((c >> 6) & 0x3f));
+            out += (char)(0x80 | (c & 0x3f));
+        } else {
+            out += (char)(0xf0 | (c >> 18));
+            out += (char)(0x80 | ((c >> 12) & 0x3f));
+            out += (char)(0x80 | ((c >> 6) & 0x3f));
+            out += (char)(0x80 | (c & 0x3f));
+        }
     }
-    val = blkid_get_tag_value(NULL, "UUID", path.c_str());
-    if (val) {
-        fsUuid = val;
+    return out;
+}
+
+/* Returns the fixed-size field with trailing NULs and spaces removed, as blkid reports labels */
+static std::string trimLabel(const uint8_t* p, size_t len) {
+    const char* chars = reinterpret_cast<const char*>(p);
+    std::string label(chars, strnlen(chars, len));
+    while (!label.empty() && label.back() == ' ') {
+        label.pop_back();
     }
-    val = blkid_get_tag_value(NULL, "LABEL", path.c_str());
-    if (val) {
-        fsLabel = val;
+    return label;
+}
+
+static std::string formatUuid(const uint8_t* p) {
+    return StringPrintf("%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+                        p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], p[9], p[10], p[11],
+                        p[12], p[13], p[14], p[15]);
+}
+
+static std::string formatSerial(const uint8_t* p) {
+    return StringPrintf("%02X%02X-%02X%02X", p[3], p[2], p[1], p[0]);
+}
+
+static bool sniffExt4(const uint8_t* sb, std::string& fsType, std::string& fsUuid,
+                      std::string& fsLabel) {
+    if (le16(sb + 0x38) != 0xef53) return false;
+
+    static const uint32_t kCompatHasJournal = 0x0004;
+    static const uint32_t kIncompatJournalDev = 0x0008;
+    static const uint32_t kIncompatExt3 = 0x0002 | 0x0004 | 0x0010;
+    static const uint32_t kRoCompatExt3 = 0x0001 | 0x0002 | 0x0004;
+    uint32_t compat = le32(sb + 0x5c);
+    uint32_t incompat = le32(sb + 0x60);
+    uint32_t roCompat = le32(sb + 0x64);
+    if (incompat & kIncompatJournalDev) {
+        fsType = "jbd";
+    } else if ((incompat & ~kIncompatExt3) || (roCompat & ~kRoCompatExt3)) {
+        fsType = "ext4";
+    } else {
+        fsType = (compat & kCompatHasJournal) ? "ext3" : "ext2";
     }
+    fsUuid = formatUuid(sb + 0x68);
+    fsLabel = trimLabel(sb + 0x78, 16);
+    return true;
+}
+
+static bool sniffF2fs(const uint8_t* sb, std::string& fsType, std::string& fsUuid,
+                      std::string& fsLabel) {
+    if (le32(sb) != 0xf2f52010) return false;
+
+    fsType = "f2fs";
+    fsUuid = formatUuid(sb + 0x6c);
+    fsLabel = utf16ToUtf8(sb + 0x7c, 512);
+    return true;
+}
+
+static bool sniffVfat(const uint8_t* bs, std::string& fsType, std::string& fsUuid,
+                      std::string& fsLabel) {
+    if (le16(bs + 510) != 0xaa55) return false;
+
+    const uint8_t* ext;
+    if (!memcmp(bs + 0x52, "FAT32   ", 8)) {
+        ext = bs + 0x40;
+    } else if (!memcmp(bs + 0x36, "FAT12   ", 8) || !memcmp(bs + 0x36, "FAT16   ", 8)) {
+        ext = bs + 0x24;
+    } else {
+        return false;
+    }
+    // Extended boot signature: the serial and label that follow are valid
+    if (ext[2] != 0x29) return false;
+
+    fsType = "vfat";
+    fsUuid = formatSerial(ext + 3);
+    fsLabel = trimLabel(ext + 7, 11);
+    if (fsLabel == "NO NAME") {
+        fsLabel.clear();
+    }
+    return true;
+}
+
+static bool sniffExfat(int fd, const uint8_t* bs, std::string& fsType, std::string& fsUuid,
+                       std::string& fsLabel) {
+    if (memcmp(bs + 3, "EXFAT   ", 8)) return false;
+
+    fsType = "exfat";
+    fsUuid = formatSerial(bs + 0x64);
+
+    // The label is an entry in the root directory; it's normally among the first few
+    uint32_t heapOffset = le32(bs + 0x58);
+    uint32_t rootCluster = le32(bs + 0x60);
+    uint8_t sectorShift = bs[0x6c];
+    uint8_t clusterShift = bs[0x6d];
+    if (rootCluster < 2 || sectorShift < 9 || sectorShift > 12 || clusterShift > 25) return true;
+    off64_t root = ((off64_t)heapOffset + ((off64_t)(rootCluster - 2) << clusterShift))
+                   << sectorShift;
+    uint8_t dir[2048];
+    if (pread64(fd, dir, sizeof(dir), root) != (ssize_t)sizeof(dir)) return true;
+    for (size_t i = 0; i < sizeof(dir); i += 32) {
+        const uint8_t* entry = dir + i;
+        if (entry[0] == 0x00) break;
+        if (entry[0] == 0x83) {
+            fsLabel = utf16ToUtf8(entry + 2, std::min<size_t>(entry[1], 11));
+            break;
+        }
+    }
+    return true;
+}
+
+static bool sniffNtfs(int fd, const uint8_t* bs, std::string& fsType, std::string& fsUuid,
+                      std::string& fsLabel) {
+    if (memcmp(bs + 3, "NTFS    ", 8)) return false;
+
+    fsType = "ntfs";
+    fsUuid = StringPrintf("%016" PRIX64, le64(bs + 0x48));
+
+    // The label is the $VOLUME_NAME attribute of $Volume, the fourth MFT record
+    uint32_t sectorSize = le16(bs + 0x0b);
+    uint32_t clusterSize = sectorSize * bs[0x0d];
+    int8_t recordClusters = (int8_t)bs[0x40];
+    uint32_t recordSize;
+    if (recordClusters > 0) {
+        recordSize = clusterSize * recordClusters;
+    } else if (recordClusters > -31) {
+        recordSize = 1u << -recordClusters;
+    } else {
+        return true;
+    }
+    if (sectorSize < 256 || sectorSize > 4096 || clusterSize == 0 || recordSize < 256 ||
+        recordSize > 4096) {
+        return true;
+    }
+    uint8_t rec[4096];
+    off64_t mft = (off64_t)le64(bs + 0x30) * clusterSize;
+    if (pread64(fd, rec, recordSize, mft + 3 * (off64_t)recordSize) != (ssize_t)recordSize) {
+        return true;
+    }
+    if (memcmp(rec, "FILE", 4)) return true;
+
+    // Undo the update sequence, which replaces the last two bytes of every 512 byte block
+    uint32_t usaOffset = le16(rec + 0x04);
+    uint32_t usaCount = le16(rec + 0x06);
+    if (usaCount == 0 || usaOffset + usaCount * 2 > recordSize ||
+        (usaCount - 1) * 512 > recordSize) {
+        return true;
+    }
+    for (uint32_t i = 1; i < usaCount; i++) {
+        memcpy(rec + i * 512 - 2, rec + usaOffset + i * 2, 2);
+    }
+
+    uint32_t offset = le16(rec + 0x14);
+    while (offset + 0x18 <= recordSize) {
+        uint32_t type = le32(rec + offset);
+        uint32_t length = le32(rec + offset + 4);
+        if (type == 0xffffffff || length < 0x18 || offset + length > recordSize) break;
+        // Resident $VOLUME_NAME
+        if (type == 0x60 && rec[offset + 8] == 0) {
+            uint32_t valueLength = le32(rec + offset + 0x10);
+            uint32_t valueOffset = le16(rec + offset + 0x14);
+            if (valueOffset + valueLength <= length) {
+                fsLabel = utf16ToUtf8(rec + offset + valueOffset, valueLength / 2);
+            }
+            break;
+        }
+        offset += length;
+    }
+    return true;
+}
+
+/* Recognizes the filesystems we can mount by their superblocks, without going through blkid */
+static bool sniffMetadata(const std::string& path, std::string& fsType, std::string& fsUuid,
+                          std::string& fsLabel) {
+    android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_CLOEXEC)));
+    if (fd == -1) {
+        return false;
+    }
+    uint8_t buf[4096];
+    if (!android::base::ReadFully(fd, buf, sizeof(buf))) {
+        return false;
+    }
+    // exFAT and NTFS boot sectors carry the FAT signature too, so look at their names first
+    return sniffExfat(fd, buf, fsType, fsUuid, fsLabel) ||
+           sniffNtfs(fd, buf, fsType, fsUuid, fsLabel) ||
+           sniffVfat(buf, fsType, fsUuid, fsLabel) ||
+           sniffExt4(buf + 1024, fsType, fsUuid, fsLabel) ||
+           sniffF2fs(buf + 1024, fsType, fsUuid, fsLabel);
+}
+
+// Probes the device once with a private, in-memory cache. That picks up all the tags in a single
+// read of the superblock, and keeps concurrent probes of different disks from sharing (and
+// rewriting) the on-disk blkid cache.
+static status_t readBlkidMetadata(const std::string& path, std::string& fsType, std::string& fsUuid,
+                             std::string& fsLabel) {
+    blkid_cache cache;
+    if (blkid_get_cache(&cache, "/dev/null") != 0) {
+        LOG(ERROR) << "Failed to create blkid cache for " << path;
+        return -ENOMEM;
+    }
+
+    blkid_dev dev = blkid_get_dev(cache, path.c_str(), BLKID_DEV_NORMAL);
+    if (dev) {
+        blkid_tag_iterate iter = blkid_tag_iterate_begin(dev);
+        const char* type;
+        const char* value;
+        while (blkid_tag_next(iter, &type, &value) == 0) {
+            if (!strcmp(type, "TYPE")) {
+                fsType = value;
+            } else if (!strcmp(type, "UUID")) {
+                fsUuid = value;
+            } else if (!strcmp(type, "LABEL")) {
+                fsLabel = value;
+            }
+        }
+        blkid_tag_iterate_end(iter);
+    }
+    blkid_put_cache(cache);
 
     return OK;
 }
 
+struct CachedMetadata {
+    uint64_t generation;
+    status_t res;
+    std::string fsType;
+    std::string fsUuid;
+    std::string fsLabel;
+};
+
+static std::mutex sMetadataLock;
+static std::map<dev_t, CachedMetadata> sMetadataCache;
+static uint64_t sMetadataGeneration = 0;
+
+void InvalidateMetadataCache() {
+    std::lock_guard<std::mutex> lock(sMetadataLock);
+    sMetadataGeneration++;
+}
+
+static status_t readMetadata(const std::string& path, std::string& fsType, std::string& fsUuid,
+                             std::string& fsLabel) {
+    struct stat sb;
+    bool cacheable = stat(path.c_str(), &sb) == 0 && S_ISBLK(sb.st_mode);
+    uint64_t generation = 0;
+
+    CachedMetadata md;
+    bool found = false;
+    if (cacheable) {
+        std::lock_guard<std::mutex> lock(sMetadataLock);
+        generation = sMetadataGeneration;
+        auto it = sMetadataCache.find(sb.st_rdev);
+        if (it != sMetadataCache.end() && it->second.generation == generation) {
+            md = it->second;
+            found = true;
+        }
+    }
+
+    if (!found) {
+        md.generation = generation;
+        md.res = OK;
+        if (!sniffMetadata(path, md.fsType, md.fsUuid, md.fsLabel)) {
+            md.res = readBlkidMetadata(path, md.fsType, md.fsUuid, md.fsLabel);
+        }
+        if (cacheable) {
+            std::lock_guard<std::mutex> lock(sMetadataLock);
+            sMetadataCache[sb.st_rdev] = md;
+        }
+    }
+
+    // Like blkid, leave whatever the caller had for tags the device doesn't have
+    if (!md.fsType.empty()) fsType = md.fsType;
+    if (!md.fsUuid.empty()) fsUuid = md.fsUuid;
+    if (!md.fsLabel.empty()) fsLabel = md.fsLabel;
+    return md.res;
+}
+
 status_t ReadMetadata(const std::string& path, std::string& fsType, std::string& fsUuid,
                       std::string& fsLabel) {
     return readMetadata(path, fsType, fsUuid, fsLabel);
@@ -68,6 +68,9 @@ status_t ReadMetadata(const std::string& path, std::string& fsType, std::string&
 status_t ReadMetadataUntrusted(const std::string& path, std::string& fsType, std::string& fsUuid,
                                std::string& fsLabel);
 
+/* Makes the next metadata reads probe the devices again, e.g. after media changed */
+void InvalidateMetadataCache();
+
 /* Returns either WEXITSTATUS() status, or a negative errno */
 status_t ForkExecvp(const std::vector<std::string>& args);
 status_t ForkExecvp(const std::vector<std::string>& args, security_context_t context);
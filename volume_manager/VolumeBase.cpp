@@ -132,10 +132,14 @@ status_t VolumeBase::create() {
     }
     setState(State::kUnmounted);
 
+    // A quick read-only mount is enough to tell; checking is left for a real mount
+    int mountFlags = mMountFlags;
+    mMountFlags |= MountFlags::kReadOnly;
     if (doMount() == OK) {
         mMountable = true;
         doUnmount();
     }
+    mMountFlags = mountFlags;
 
     return res;
 }
@@ -149,7 +153,7 @@ status_t VolumeBase::destroy() {
         return NO_INIT;
     }
 
-    if (mState == State::kMounted) {
+    if (mState == State::kMounted || mState == State::kMountedReadOnly) {
         unmount();
         setState(State::kBadRemoval);
     } else {
@@ -175,7 +179,7 @@ status_t VolumeBase::mount() {
     setState(State::kChecking);
     status_t res = doMount();
     if (res == OK) {
-        setState(State::kMounted);
+        setState(isMountedReadOnly() ? State::kMountedReadOnly : State::kMounted);
     } else {
         setState(State::kUnmountable);
     }
@@ -61,6 +61,8 @@ class VolumeBase {
         kPrimary = 1 << 0,
         /* Flag that volume is visible to normal apps */
         kVisible = 1 << 1,
+        /* Flag that volume is mounted read-only, without checking it first */
+        kReadOnly = 1 << 2,
     };
 
     enum class State {
@@ -103,6 +105,9 @@ class VolumeBase {
     virtual status_t doMount() = 0;
     virtual status_t doUnmount(bool detach = false) = 0;
 
+    /* Whether the last doMount() ended up read-only */
+    virtual bool isMountedReadOnly() const { return mMountFlags & MountFlags::kReadOnly; }
+
     status_t setId(const std::string& id);
     status_t setPath(const std::string& path);
 
@@ -19,10 +19,16 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <fs_mgr.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
 
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
 #define LOG_TAG "VolumeManager"
 
 #include <android-base/logging.h>
@@ -42,6 +48,8 @@ static const unsigned int kMajorBlockMmc = 179;
 static const unsigned int kMajorBlockExperimentalMin = 240;
 static const unsigned int kMajorBlockExperimentalMax = 254;
 
+static const size_t kColdbootThreads = 4;
+
 namespace android {
 namespace volmgr {
 
@@ -77,11 +85,44 @@ static void do_coldboot(DIR* d, int lvl) {
     }
 }
 
+// Spreads the block devices over a few workers. Each "add" write is handled synchronously by the
+// kernel, so a single walk over many disks and partitions adds up.
 static void coldboot(const char* path) {
+    std::vector<std::string> devices;
     DIR* d = opendir(path);
-    if (d) {
-        do_coldboot(d, 0);
-        closedir(d);
+    if (!d) {
+        return;
+    }
+    struct dirent* de;
+    while ((de = readdir(d))) {
+        if (de->d_name[0] == '.') continue;
+        devices.push_back(de->d_name);
+    }
+    closedir(d);
+
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i = next++; i < devices.size(); i = next++) {
+            int fd = open((std::string(path) + "/" + devices[i]).c_str(),
+                          O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0) continue;
+            DIR* d2 = fdopendir(fd);
+            if (d2 == nullptr) {
+                close(fd);
+                continue;
+            }
+            do_coldboot(d2, 1);
+            closedir(d2);
+        }
+    };
+
+    size_t count = std::min<size_t>(devices.size(), kColdbootThreads);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < count; i++) {
+        threads.emplace_back(worker);
+    }
+    for (auto& thread : threads) {
+        thread.join();
     }
 }
 
@@ -242,12 +283,14 @@ VolumeBase* VolumeManager::findVolume(const std::string& id) {
     return nullptr;
 }
 
-bool VolumeManager::volumeMount(const std::string& id) {
+bool VolumeManager::volumeMount(const std::string& id, bool readOnly /* = false */) {
     std::lock_guard<std::mutex> lock(mLock);
     auto vol = findVolume(id);
     if (!vol) {
         return false;
     }
+    int flags = vol->getMountFlags() & ~VolumeBase::MountFlags::kReadOnly;
+    vol->setMountFlags(readOnly ? (flags | VolumeBase::MountFlags::kReadOnly) : flags);
     status_t res = vol->mount();
     return (res == OK);
 }
@@ -268,16 +311,56 @@ void VolumeManager::addDiskSource(DiskSource* source) {
     mDiskSources.push_back(source);
 }
 
+static bool IsDiskEvent(NetlinkEvent* evt) {
+    const char* devType = evt->findParam("DEVTYPE");
+    return devType && !strcmp(devType, "disk");
+}
+
+static dev_t GetEventDevice(NetlinkEvent* evt) {
+    return makedev(atoi(evt->findParam("MAJOR")), atoi(evt->findParam("MINOR")));
+}
+
 void VolumeManager::handleBlockEvent(NetlinkEvent* evt) {
     std::lock_guard<std::mutex> lock(mLock);
+    handleBlockEventLocked(evt);
+}
+
+void VolumeManager::handleBlockEvents(const std::vector<NetlinkEvent*>& events) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    // A change only needs a rescan if nothing later in the burst is about the same disk: a later
+    // change rescans it anyway, and an add probes it from scratch. A change that follows an add
+    // in the same burst is dropped too, since the probe reads the table as it is by then.
+    std::vector<bool> skip(events.size(), false);
+    for (size_t i = 0; i < events.size(); i++) {
+        if (!IsDiskEvent(events[i])) {
+            skip[i] = true;
+            continue;
+        }
+        if (events[i]->getAction() != NetlinkEvent::Action::kChange) {
+            continue;
+        }
+        dev_t device = GetEventDevice(events[i]);
+        for (size_t j = 0; j < events.size() && !skip[i]; j++) {
+            if (j == i || !IsDiskEvent(events[j]) || GetEventDevice(events[j]) != device) {
+                continue;
+            }
+            skip[i] = j > i || events[j]->getAction() == NetlinkEvent::Action::kAdd;
+        }
+    }
+
+    for (size_t i = 0; i < events.size(); i++) {
+        if (!skip[i]) {
+            handleBlockEventLocked(events[i]);
+        }
+    }
+}
 
-    const char* param;
-    param = evt->findParam("DEVTYPE");
-    std::string devType(param ? param : "");
-    if (devType != "disk") {
+void VolumeManager::handleBlockEventLocked(NetlinkEvent* evt) {
+    if (!IsDiskEvent(evt)) {
         return;
     }
-    param = evt->findParam("DEVPATH");
+    const char* param = evt->findParam("DEVPATH");
     std::string eventPath(param ? param : "");
 
     int major = atoi(evt->findParam("MAJOR"));
@@ -305,8 +388,10 @@ void VolumeManager::handleBlockEvent(NetlinkEvent* evt) {
                                      : new DiskPartition(eventPath, device, source->getNickname(),
                                                          flags, source->getPartNum(),
                                                          source->getFsType(), source->getMntOpts());
-                    disk->create();
+                    // Probing reads the partition table and every filesystem on the disk,
+                    // so do it off the netlink thread to let other disks probe meanwhile
                     mDisks.push_back(disk);
+                    disk->createAsync();
                     break;
                 }
             }
@@ -314,8 +399,10 @@ void VolumeManager::handleBlockEvent(NetlinkEvent* evt) {
         }
         case NetlinkEvent::Action::kChange: {
             LOG(DEBUG) << "Disk at " << major << ":" << minor << " changed";
+            InvalidateMetadataCache();
             for (const auto& disk : mDisks) {
                 if (disk->getDevice() == device) {
+                    disk->waitForProbe();
                     disk->readMetadata();
                     disk->readPartitions();
                 }
@@ -323,6 +410,7 @@ void VolumeManager::handleBlockEvent(NetlinkEvent* evt) {
             break;
         }
         case NetlinkEvent::Action::kRemove: {
+            InvalidateMetadataCache();
             auto i = mDisks.begin();
             while (i != mDisks.end()) {
                 if ((*i)->getDevice() == device) {
@@ -54,8 +54,9 @@ status_t Check(const std::string& source) {
 }
 
 status_t Mount(const std::string& source, const std::string& target, int ownerUid, int ownerGid,
-               int permMask) {
+               int permMask, bool ro /* = false */) {
     int mountFlags = MS_NODEV | MS_NOSUID | MS_DIRSYNC | MS_NOATIME | MS_NOEXEC;
+    mountFlags |= (ro ? MS_RDONLY : 0);
     auto mountData = android::base::StringPrintf("uid=%d,gid=%d,fmask=%o,dmask=%o", ownerUid,
                                                  ownerGid, permMask, permMask);
 
@@ -30,7 +30,7 @@ bool IsSupported();
 
 status_t Check(const std::string& source);
 status_t Mount(const std::string& source, const std::string& target, int ownerUid, int ownerGid,
-               int permMask);
+               int permMask, bool ro = false);
 
 }  // namespace exfat
 }  // namespace volmgr
@@ -48,7 +48,7 @@ status_t Check(const std::string& source, bool trusted) {
 }
 
 status_t Mount(const std::string& source, const std::string& target,
-               const std::string& opts /* = "" */, bool trusted, bool portable) {
+               const std::string& opts /* = "" */, bool trusted, bool portable, bool ro) {
     std::string data(opts);
 
     if (portable) {
@@ -63,6 +63,7 @@ status_t Mount(const std::string& source, const std::string& target,
     const char* c_data = data.c_str();
 
     unsigned long flags = MS_NOATIME | MS_NODEV | MS_NOSUID;
+    flags |= (ro ? MS_RDONLY : 0);
 
     // Only use MS_DIRSYNC if we're not mounting adopted storage
     if (!trusted) {
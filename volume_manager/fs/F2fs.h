@@ -30,7 +30,7 @@ bool IsSupported();
 
 status_t Check(const std::string& source, bool trusted);
 status_t Mount(const std::string& source, const std::string& target, const std::string& opts = "",
-               bool trusted = false, bool portable = false);
+               bool trusted = false, bool portable = false, bool ro = false);
 
 }  // namespace f2fs
 }  // namespace volmgr
@@ -25,6 +25,7 @@
 #include <list>
 #include <mutex>
 #include <string>
+#include <vector>
 
 class NetlinkManager;
 class NetlinkEvent;
@@ -107,19 +108,23 @@ class VolumeManager {
 
     VolumeBase* findVolume(const std::string& id);
 
-    bool volumeMount(const std::string& id);
+    bool volumeMount(const std::string& id, bool readOnly = false);
     bool volumeUnmount(const std::string& id, bool detach = false);
     bool volumeFormat(const std::string& id, const std::string& fsType);
 
   public:
     void addDiskSource(DiskSource* source);
     void handleBlockEvent(NetlinkEvent* evt);
+    // Handles a burst of uevents at once, rescanning a disk only once for all its changes.
+    void handleBlockEvents(const std::vector<NetlinkEvent*>& events);
 
     void notifyEvent(int code);
     void notifyEvent(int code, const std::string& arg);
     void notifyEvent(int code, const std::vector<std::string>& argv);
 
   private:
+    void handleBlockEventLocked(NetlinkEvent* evt);
+
     VolumeWatcher* mWatcher;
     NetlinkManager* mNetlinkManager;
     std::mutex mLock;
@@ -16,9 +16,12 @@
 
 #include "vr_ui.h"
 
+#include <algorithm>
+
 #include <minui/minui.h>
 
-VrRecoveryUI::VrRecoveryUI() : kStereoOffset(RECOVERY_UI_VR_STEREO_OFFSET) {}
+VrRecoveryUI::VrRecoveryUI()
+    : kStereoOffset(RECOVERY_UI_VR_STEREO_OFFSET), dirty_y1_(0), dirty_y2_(0) {}
 
 int VrRecoveryUI::ScreenWidth() const {
   return gr_fb_width() / 2;
@@ -28,38 +31,70 @@ int VrRecoveryUI::ScreenHeight() const {
   return gr_fb_height();
 }
 
+void VrRecoveryUI::AddDirtyRows(int y1, int y2) const {
+  if (dirty_y1_ >= dirty_y2_) {
+    dirty_y1_ = y1;
+    dirty_y2_ = y2;
+  } else {
+    dirty_y1_ = std::min(dirty_y1_, y1);
+    dirty_y2_ = std::max(dirty_y2_, y2);
+  }
+}
+
+void VrRecoveryUI::draw_screen_locked() {
+  // The screen gets cleared, and some parts are drawn with the gr_*() functions directly.
+  AddDirtyRows(0, ScreenHeight());
+  ScreenRecoveryUI::draw_screen_locked();
+}
+
+void VrRecoveryUI::flip_locked() {
+  int y1 = std::max(dirty_y1_, 0);
+  int y2 = std::min(dirty_y2_, ScreenHeight());
+  if (y1 < y2) {
+    // The left eye is at [kStereoOffset, kStereoOffset + ScreenWidth()), and the right one
+    // ScreenWidth() - 2 * kStereoOffset further; keep both within the screen.
+    int src_x = kStereoOffset;
+    int dst_x = ScreenWidth() - kStereoOffset;
+    int first = std::max({ 0, -src_x, -dst_x });
+    int last = std::min({ ScreenWidth(), gr_fb_width() - src_x, gr_fb_width() - dst_x });
+    if (first < last) {
+      gr_copy(src_x + first, y1, last - first, y2 - y1, dst_x + first, y1);
+    }
+  }
+  dirty_y1_ = dirty_y2_ = 0;
+  ScreenRecoveryUI::flip_locked();
+}
+
 void VrRecoveryUI::DrawSurface(GRSurface* surface, int sx, int sy, int w, int h, int dx,
                                int dy) const {
   gr_blit(surface, sx, sy, w, h, dx + kStereoOffset, dy);
-  gr_blit(surface, sx, sy, w, h, dx - kStereoOffset + ScreenWidth(), dy);
+  AddDirtyRows(dy, dy + h);
 }
 
 void VrRecoveryUI::DrawTextIcon(int x, int y, GRSurface* surface) const {
   gr_texticon(x + kStereoOffset, y, surface);
-  gr_texticon(x - kStereoOffset + ScreenWidth(), y, surface);
+  AddDirtyRows(y, y + gr_get_height(surface));
 }
 
 int VrRecoveryUI::DrawTextLine(int x, int y, const char* line, bool bold) const {
   gr_text(gr_sys_font(), x + kStereoOffset, y, line, bold);
-  gr_text(gr_sys_font(), x - kStereoOffset + ScreenWidth(), y, line, bold);
+  AddDirtyRows(y, y + char_height_);
   return char_height_ + 4;
 }
 
 int VrRecoveryUI::DrawHorizontalRule(int y) const {
   y += 4;
   gr_fill(kMarginWidth + kStereoOffset, y, ScreenWidth() - kMarginWidth + kStereoOffset, y + 2);
-  gr_fill(ScreenWidth() + kMarginWidth - kStereoOffset, y,
-          gr_fb_width() - kMarginWidth - kStereoOffset, y + 2);
+  AddDirtyRows(y, y + 2);
   return y + 4;
 }
 
 void VrRecoveryUI::DrawHighlightBar(int /* x */, int y, int /* width */, int height) const {
   gr_fill(kMarginWidth + kStereoOffset, y, ScreenWidth() - kMarginWidth + kStereoOffset, y + height);
-  gr_fill(ScreenWidth() + kMarginWidth - kStereoOffset, y,
-          gr_fb_width() - kMarginWidth - kStereoOffset, y + height);
+  AddDirtyRows(y, y + height);
 }
 
 void VrRecoveryUI::DrawFill(int x, int y, int w, int h) const {
   gr_fill(x + kStereoOffset, y, w, h);
-  gr_fill(x - kStereoOffset + ScreenWidth(), y, w, h);
+  AddDirtyRows(y, y + h);
 }
@@ -31,12 +31,24 @@ class VrRecoveryUI : public ScreenRecoveryUI {
   int ScreenWidth() const override;
   int ScreenHeight() const override;
 
+  void draw_screen_locked() override;
+  void flip_locked() override;
+
   void DrawSurface(GRSurface* surface, int sx, int sy, int w, int h, int dx, int dy) const override;
   int DrawHorizontalRule(int y) const override;
   void DrawHighlightBar(int x, int y, int width, int height) const override;
   void DrawFill(int x, int y, int w, int h) const override;
   void DrawTextIcon(int x, int y, GRSurface* surface) const override;
   int DrawTextLine(int x, int y, const char* line, bool bold) const override;
+
+ private:
+  // Adds the rows [y1, y2) to the part of the left eye to copy to the right one on the next flip.
+  void AddDirtyRows(int y1, int y2) const;
+
+  // The drawing functions only draw the view of the left eye, which gets copied to the right
+  // eye with gr_copy() before each flip, instead of drawing everything twice.
+  mutable int dirty_y1_;
+  mutable int dirty_y2_;
 };
 
 #endif  // RECOVERY_VR_UI_H
@@ -21,6 +21,7 @@
 #include <stdio.h>  // TODO: Remove after killing the call to sprintf().
 #include <string.h>
 
+#include <algorithm>
 #include <string>
 
 #include <android-base/properties.h>
@@ -29,7 +30,10 @@
 
 WearRecoveryUI::WearRecoveryUI()
     : kProgressBarBaseline(RECOVERY_UI_PROGRESS_BAR_BASELINE),
-      kMenuUnusableRows(RECOVERY_UI_MENU_UNUSABLE_ROWS) {
+      kMenuUnusableRows(RECOVERY_UI_MENU_UNUSABLE_ROWS),
+      kLowPower(android::base::GetBoolProperty("ro.recovery.wear_low_power", false)),
+      kLowPowerFps(android::base::GetIntProperty("ro.recovery.wear_low_power_fps", 10)),
+      blanked_(false) {
   // TODO: kMenuUnusableRows should be computed based on the lines in draw_screen_locked().
 
   // TODO: The following three variables are likely not needed. The first two are detected
@@ -44,11 +48,18 @@ int WearRecoveryUI::GetProgressBaseline() const {
   return kProgressBarBaseline;
 }
 
+int WearRecoveryUI::GetAnimationFps() const {
+  if (kLowPower && kLowPowerFps > 0) {
+    return std::min(kAnimationFps, kLowPowerFps);
+  }
+  return kAnimationFps;
+}
+
 // Draw background frame on the screen.  Does not flip pages.
 // Should only be called with updateMutex locked.
 // TODO merge drawing routines with screen_ui
 void WearRecoveryUI::draw_background_locked() {
-  pagesIdentical = false;
+  stalePages = kGraphicsPages - 1;
   gr_color(0, 0, 0, 255);
   gr_fill(0, 0, gr_fb_width(), gr_fb_height());
 
@@ -135,21 +146,65 @@ void WearRecoveryUI::draw_screen_locked() {
     // display from the bottom up, until we hit the top of the
     // screen, the bottom of the menu, or we've displayed the
     // entire text buffer.
-    int row = text_row_;
     size_t count = 0;
     for (int ty = gr_fb_height() - char_height_ - kMarginHeight; ty > y + 2 && count < text_rows_;
          ty -= char_height_, ++count) {
-      gr_text(gr_sys_font(), x + 4, ty, text_[row], 0);
-      --row;
-      if (row < 0) row = text_rows_ - 1;
+      gr_text(gr_sys_font(), x + 4, ty, text_->Row(count), 0);
     }
   }
 }
 
+// Should only be called with updateMutex locked.
+void WearRecoveryUI::draw_progress_locked() {
+  GRSurface* frame = GetCurrentFrame();
+  if (currentIcon != NONE) {
+    int frame_width = gr_get_width(frame);
+    int frame_height = gr_get_height(frame);
+    gr_blit(frame, 0, 0, frame_width, frame_height, (gr_fb_width() - frame_width) / 2,
+            (gr_fb_height() - frame_height) / 2);
+  }
+  int y = kMarginHeight;
+  draw_foreground_locked(y);
+}
+
 // TODO merge drawing routines with screen_ui
 void WearRecoveryUI::update_progress_locked() {
-  draw_screen_locked();
-  gr_flip();
+  if (!kLowPower || show_text) {
+    draw_screen_locked();
+  } else if (stalePages > 0) {
+    // The other pages still hold the previous screen, so they need a full redraw as well.
+    int remaining = stalePages - 1;
+    draw_screen_locked();
+    stalePages = remaining;
+  } else {
+    // Only the animation and the progress bar move, so leave the rest of the page alone and let
+    // the flip cover just what got drawn.
+    draw_progress_locked();
+  }
+  flip_locked();
+}
+
+// Should only be called with updateMutex locked.
+void WearRecoveryUI::flip_locked() {
+  if (!kLowPower) {
+    ScreenRecoveryUI::flip_locked();
+    return;
+  }
+  // Keep the panel off while it would only show black, and turn it back on with the next screen
+  // that has something on it.
+  bool visible = show_text || currentIcon != NONE || progressBarType != EMPTY;
+  if (!visible) {
+    if (!blanked_) {
+      gr_fb_blank(true);
+      blanked_ = true;
+    }
+    return;
+  }
+  ScreenRecoveryUI::flip_locked();
+  if (blanked_) {
+    gr_fb_blank(false);
+    blanked_ = false;
+  }
 }
 
 void WearRecoveryUI::SetStage(int /* current */, int /* max */) {}
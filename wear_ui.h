@@ -29,6 +29,11 @@ class WearRecoveryUI : public ScreenRecoveryUI {
   // menu display
   void StartMenu(bool is_main, menu_type_t type, const char* const* headers,
                  const MenuItemVector& items, int initial_selection) override;
+  // The scrolling of the menu here works on the built list.
+  void StartLazyMenu(bool is_main, menu_type_t type, const char* const* headers, size_t count,
+                     const MenuItemProvider& provider, int initial_selection) override {
+    RecoveryUI::StartLazyMenu(is_main, type, headers, count, provider, initial_selection);
+  }
   int SelectMenu(int sel) override;
   int SelectMenu(const Point& point) override;
 
@@ -40,15 +45,26 @@ class WearRecoveryUI : public ScreenRecoveryUI {
   // Recovery, build id and etc) and the bottom lines that may otherwise go out of the screen.
   const int kMenuUnusableRows;
 
+  // A lower frame rate, partial progress updates and blanking the screen while there's nothing on
+  // it, to save power during long installs. Enabled with ro.recovery.wear_low_power.
+  const bool kLowPower;
+  const int kLowPowerFps;
+
   int GetProgressBaseline() const override;
+  int GetAnimationFps() const override;
 
   void update_progress_locked() override;
+  void flip_locked() override;
 
  private:
   void draw_background_locked() override;
   void draw_screen_locked() override;
+  // Redraws only the animation frames and the progress bar, on top of the previous screen.
+  void draw_progress_locked();
 
   int menu_start, menu_end;
+  // Whether the screen has been blanked by flip_locked().
+  bool blanked_;
 };
 
 #endif  // RECOVERY_WEAR_UI_H